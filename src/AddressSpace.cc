@@ -4,14 +4,21 @@
 
 #include "AddressSpace.h"
 
+#include <elf.h>
+#include <fcntl.h>
 #include <linux/kdev_t.h>
+#include <sys/stat.h>
 
 #include <limits>
+#include <random>
+#include <type_traits>
 
+#include "AutoRemoteSyscalls.h"
 #include "log.h"
 #include "Session.h"
 #include "task.h"
 
+using namespace rr;
 using namespace std;
 
 /*static*/ ino_t MappableResource::nr_anonymous_maps;
@@ -125,6 +132,9 @@ struct Breakpoint {
   // data, and we can't enforce the order in which breakpoints
   // are set/removed.
   int internal_count, user_count;
+  // Set by the debugger for USER breakpoints; shared between clones
+  // since it's never modified.
+  shared_ptr<BreakpointCondition> condition;
   uint8_t overwritten_data;
   static_assert(sizeof(overwritten_data) ==
                     sizeof(AddressSpace::breakpoint_insn),
@@ -356,7 +366,16 @@ static void print_process_mmap(Task* t) {
   iterate_memory_map(t, print_process_mmap_iterator, nullptr);
 }
 
-AddressSpace::~AddressSpace() { session->on_destroy(this); }
+AddressSpace::~AddressSpace() {
+  drop_local_file_mappings();
+  // The read cache is keyed by address space, and another one could
+  // be allocated here.
+  Task::invalidate_read_caches();
+  session->on_destroy(this);
+  for (auto& kv : shared_file_refs) {
+    session->on_shared_file_unmapped(kv.first);
+  }
+}
 
 void AddressSpace::after_clone() { allocate_watchpoints(); }
 
@@ -390,6 +409,9 @@ TrapType AddressSpace::get_breakpoint_type_for_retired_insn(
 }
 
 TrapType AddressSpace::get_breakpoint_type_at_addr(remote_ptr<uint8_t> addr) {
+  if (!breakpoint_filter[breakpoint_filter_bit(addr)]) {
+    return TRAP_NONE;
+  }
   auto it = breakpoints.find(addr);
   return it == breakpoints.end() ? TRAP_NONE : it->second->type();
 }
@@ -414,6 +436,7 @@ void AddressSpace::map(remote_ptr<void> addr, size_t num_bytes, int prot,
   }
 
   map_and_coalesce(m, res);
+  set_file_pages_modified(m.start, m.end, prot & PROT_WRITE);
 }
 
 typedef AddressSpace::MemoryMap::value_type MappingResourcePair;
@@ -441,27 +464,33 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
   LOG(debug) << "mprotect(" << addr << ", " << num_bytes << ", " << HEX(prot)
              << ")";
 
-  Mapping last_overlap;
-  auto protector = [this, prot, &last_overlap](
-      const Mapping& m, const MappableResource& r, const Mapping& rem) {
+  auto last_overlap = mem.end();
+  auto protector = [this, prot, &last_overlap](MemoryMap::iterator it,
+                                               const Mapping& rem) {
     LOG(debug) << "  protecting (" << rem << ") ...";
 
-    mem.erase(m);
+    Mapping m = it->first;
+    MappableResource r = it->second;
+    auto next = erase_from_memmap(it, std::next(it));
     LOG(debug) << "  erased (" << m << ")";
 
+    // The pieces all go right before |next|, in address order.
+    //
     // If the first segment we protect underflows the
     // region, remap the underflow region with previous
     // prot.
     if (m.start < rem.start) {
       Mapping underflow(m.start, rem.start, m.prot, m.flags, m.offset);
-      mem[underflow] = r;
+      add_to_memmap(next, underflow, r);
     }
     // Remap the overlapping region with the new prot.
     remote_ptr<void> new_end = min(rem.end, m.end);
     Mapping overlap(rem.start, new_end, prot, m.flags,
                     adjust_offset(r, m, rem.start - m.start));
-    mem[overlap] = r;
-    last_overlap = overlap;
+    last_overlap = add_to_memmap(next, overlap, r);
+    if (prot & PROT_WRITE) {
+      set_file_pages_modified(overlap.start, overlap.end, true);
+    }
 
     // If the last segment we protect overflows the
     // region, remap the overflow region with previous
@@ -469,13 +498,16 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
     if (rem.end < m.end) {
       Mapping overflow(rem.end, m.end, m.prot, m.flags,
                        adjust_offset(r, m, rem.end - m.start));
-      mem[overflow] = r;
+      add_to_memmap(next, overflow, r);
     }
+    return next;
   };
   for_each_in_range(addr, num_bytes, protector, ITERATE_CONTIGUOUS);
   // All mappings that we altered which might need coalescing
   // are adjacent to |last_overlap|.
-  coalesce_around(mem.find(last_overlap));
+  if (last_overlap != mem.end()) {
+    coalesce_around(last_overlap);
+  }
 }
 
 void AddressSpace::remap(remote_ptr<void> old_addr, size_t old_num_bytes,
@@ -495,11 +527,20 @@ void AddressSpace::remap(remote_ptr<void> old_addr, size_t old_num_bytes,
   map_and_coalesce(Mapping(new_addr, new_num_bytes, m.prot, m.flags,
                            adjust_offset(r, m, old_addr - m.start)),
                    r);
+  // We don't track where modified pages move to.
+  set_file_pages_modified(new_addr, new_addr + ceil_page_size(new_num_bytes),
+                          true);
 }
 
 void AddressSpace::remove_breakpoint(remote_ptr<uint8_t> addr, TrapType type) {
   auto it = breakpoints.find(addr);
-  if (it == breakpoints.end() || !it->second || it->second->unref(type) > 0) {
+  if (it == breakpoints.end() || !it->second) {
+    return;
+  }
+  if (it->second->unref(type) > 0) {
+    if (it->second->user_count == 0) {
+      it->second->condition = nullptr;
+    }
     return;
   }
   destroy_breakpoint(it);
@@ -522,11 +563,36 @@ bool AddressSpace::set_breakpoint(remote_ptr<uint8_t> addr, TrapType type) {
     auto it_and_is_new = breakpoints.insert(make_pair(addr, bp));
     assert(it_and_is_new.second);
     it = it_and_is_new.first;
+    breakpoint_filter.set(breakpoint_filter_bit(addr));
   }
   it->second->ref(type);
   return true;
 }
 
+void AddressSpace::set_breakpoint_condition(
+    remote_ptr<uint8_t> addr, shared_ptr<BreakpointCondition> condition) {
+  auto it = breakpoints.find(addr);
+  assert(it != breakpoints.end() && it->second->user_count > 0);
+  it->second->condition = condition;
+}
+
+shared_ptr<BreakpointCondition> AddressSpace::get_breakpoint_condition(
+    remote_ptr<uint8_t> addr) {
+  auto it = breakpoints.find(addr);
+  if (it == breakpoints.end() || it->second->user_count == 0) {
+    return nullptr;
+  }
+  return it->second->condition;
+}
+
+void AddressSpace::replace_breakpoints_with_original_values(
+    uint8_t* dest, size_t length, remote_ptr<uint8_t> addr) {
+  for (auto it = breakpoints.lower_bound(addr);
+       it != breakpoints.end() && it->first < addr + length; ++it) {
+    dest[it->first - addr] = it->second->overwritten_data;
+  }
+}
+
 void AddressSpace::destroy_all_breakpoints() {
   while (!breakpoints.empty()) {
     destroy_breakpoint(breakpoints.begin());
@@ -562,31 +628,85 @@ void AddressSpace::destroy_all_watchpoints() {
   allocate_watchpoints();
 }
 
+void AddressSpace::copy_debugger_breakpoints_from(AddressSpace& other) {
+  vector<pair<remote_ptr<uint8_t>, int> > stale;
+  for (auto& kv : breakpoints) {
+    if (kv.second->user_count > 0) {
+      stale.push_back(make_pair(kv.first, kv.second->user_count));
+    }
+  }
+  for (auto& s : stale) {
+    for (int i = 0; i < s.second; ++i) {
+      remove_breakpoint(s.first, TRAP_BKPT_USER);
+    }
+  }
+  for (auto& kv : other.breakpoints) {
+    for (int i = 0; i < kv.second->user_count; ++i) {
+      set_breakpoint(kv.first, TRAP_BKPT_USER);
+    }
+    if (kv.second->user_count > 0 && kv.second->condition &&
+        get_breakpoint_type_at_addr(kv.first) == TRAP_BKPT_USER) {
+      set_breakpoint_condition(kv.first, kv.second->condition);
+    }
+  }
+
+  watchpoints.clear();
+  for (auto& kv : other.watchpoints) {
+    watchpoints[kv.first] = kv.second->clone();
+  }
+  allocate_watchpoints();
+}
+
+size_t AddressSpace::shm_attach_size(remote_ptr<void> addr) const {
+  auto it = mem.find(Mapping(addr, page_size()));
+  if (it == mem.end() || it->first.start != addr || it->first.offset != 0) {
+    return 0;
+  }
+  MappableResource res = it->second;
+  remote_ptr<void> end = it->first.end;
+  // mprotect() may have split the attach into several mappings.
+  for (++it; it != mem.end() && it->first.start == end && it->second == res &&
+                 it->first.offset == end - addr;
+       ++it) {
+    end = it->first.end;
+  }
+  return end - addr;
+}
+
 void AddressSpace::unmap(remote_ptr<void> addr, ssize_t num_bytes) {
   LOG(debug) << "munmap(" << addr << ", " << num_bytes << ")";
 
-  auto unmapper = [this](const Mapping& m, const MappableResource& r,
-                         const Mapping& rem) {
+  auto unmapper = [this](MemoryMap::iterator it, const Mapping& rem) {
     LOG(debug) << "  unmapping (" << rem << ") ...";
 
-    mem.erase(m);
+    Mapping m = it->first;
+    if (rem.start <= m.start && m.end <= rem.end) {
+      LOG(debug) << "  erased (" << m << ") ...";
+      return erase_from_memmap(it, std::next(it));
+    }
+    MappableResource r = it->second;
+    auto next = erase_from_memmap(it, std::next(it));
     LOG(debug) << "  erased (" << m << ") ...";
 
     // If the first segment we unmap underflows the unmap
     // region, remap the underflow region.
     if (m.start < rem.start) {
       Mapping underflow(m.start, rem.start, m.prot, m.flags, m.offset);
-      mem[underflow] = r;
+      add_to_memmap(next, underflow, r);
     }
     // If the last segment we unmap overflows the unmap
     // region, remap the overflow region.
     if (rem.end < m.end) {
       Mapping overflow(rem.end, m.end, m.prot, m.flags,
                        adjust_offset(r, m, rem.end - m.start));
-      mem[overflow] = r;
+      add_to_memmap(next, overflow, r);
     }
+    return next;
   };
   for_each_in_range(addr, num_bytes, unmapper);
+  modified_file_pages.erase(
+      modified_file_pages.lower_bound(addr),
+      modified_file_pages.lower_bound(addr + ceil_page_size(num_bytes)));
 }
 
 /**
@@ -772,6 +892,7 @@ void VerifyAddressSpace::assert_segments_match(Task* t) {
                  // (i.e. emulated in replay) device/inode for
                  // gc.  So this suffices for now.
            ||
+           string::npos != kr.fsname.find("/memfd:rr-emufs") ||
            string::npos != kr.fsname.find(SHMEM_FS "/rr-emufs") ||
            string::npos != kr.fsname.find(SHMEM_FS2 "/rr-emufs"));
     vas->km = km;
@@ -796,6 +917,23 @@ Mapping AddressSpace::vdso() const {
   return mapping_of(vdso_start_addr, 1).first;
 }
 
+void AddressSpace::set_remote_syscall_stub(remote_ptr<uint8_t> stub) {
+  remote_syscall_stub_addr = stub;
+  remote_syscall_stub_resource = mapping_of(stub, 1).second;
+}
+
+remote_ptr<uint8_t> AddressSpace::remote_syscall_stub() const {
+  if (remote_syscall_stub_addr.is_null()) {
+    return nullptr;
+  }
+  auto it = mem.find(Mapping(remote_syscall_stub_addr, 1));
+  if (it == mem.end() || !(it->first.prot & PROT_EXEC) ||
+      !(it->second == remote_syscall_stub_resource)) {
+    return nullptr;
+  }
+  return remote_syscall_stub_addr;
+}
+
 void AddressSpace::verify(Task* t) const {
   assert(task_set().end() != task_set().find(t));
 
@@ -806,12 +944,78 @@ void AddressSpace::verify(Task* t) const {
   vas.assert_segments_match(t);
 }
 
+/**
+ * Return the hash of |t|'s /proc/maps.
+ */
+static Hash128 hash_process_mmap(Task* t) {
+  char maps_path[PATH_MAX];
+  snprintf(maps_path, sizeof(maps_path) - 1, "/proc/%d/maps", t->tid);
+  ScopedFd fd(maps_path, O_RDONLY);
+  ASSERT(t, fd.is_open()) << "Failed to open " << maps_path;
+  string text;
+  char buf[16384];
+  ssize_t nread;
+  while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+    text.append(buf, nread);
+  }
+  return hash_bytes(text.data(), text.size());
+}
+
+void AddressSpace::maybe_verify(Task* t, bool force) {
+  static minstd_rand sample_random;
+  double rate = Flags::get().check_cached_mmaps_rate;
+  if (!force && rate < 1 &&
+      sample_random() - sample_random.min() >=
+          rate * (sample_random.max() - sample_random.min())) {
+    return;
+  }
+
+  string cached;
+  for (auto& kv : mem) {
+    cached += kv.first.to_kernel().str();
+    cached += ' ';
+    cached += kv.second.fsname;
+    cached += '\n';
+  }
+  Hash128 maps_hash = hash_process_mmap(t);
+  Hash128 mem_hash = hash_bytes(cached.data(), cached.size());
+  if (maps_hash == verified_maps_hash && mem_hash == verified_mem_hash) {
+    return;
+  }
+  verify(t);
+  verified_maps_hash = maps_hash;
+  verified_mem_hash = mem_hash;
+}
+
+/*static*/ bool AddressSpace::syscall_changes_mappings(int syscallno,
+                                                     SupportedArch arch) {
+  return is_mmap_syscall(syscallno, arch) ||
+         is_mmap2_syscall(syscallno, arch) ||
+         is_munmap_syscall(syscallno, arch) ||
+         is_mprotect_syscall(syscallno, arch) ||
+         is_mremap_syscall(syscallno, arch) ||
+         is_brk_syscall(syscallno, arch) ||
+         is_madvise_syscall(syscallno, arch) ||
+         is_execve_syscall(syscallno, arch) ||
+         is_shmat_syscall(syscallno, arch) ||
+         is_shmdt_syscall(syscallno, arch) || is_ipc_syscall(syscallno, arch);
+}
+
 AddressSpace::AddressSpace(Task* t, const string& exe, Session& session)
     : exe(exe),
       is_clone(false),
+      verified_maps_hash(),
+      verified_mem_hash(),
       session(&session),
       vdso_start_addr(),
-      child_mem_fd(-1) {
+      watched_pages_protected(false),
+      child_mem_fd(-1),
+      libraries_cached(false) {
+  // This is the only place the cached mmaps are built from
+  // /proc/maps: a fresh exec image has mappings the kernel chose.
+  // From here on they're updated as the tracee changes its mappings,
+  // and /proc/maps is only read again by verify().
+  //
   // TODO: this is a workaround of
   // https://github.com/mozilla/rr/issues/1113 .
   if (session.can_validate()) {
@@ -827,30 +1031,58 @@ AddressSpace::AddressSpace(const AddressSpace& o)
     // |remove_all_breakpoints()| is expected soon after
     // the creation of this.
     : breakpoints(o.breakpoints),
+      breakpoint_filter(o.breakpoint_filter),
       exe(o.exe),
       heap(o.heap),
       is_clone(true),
       mem(o.mem),
+      verified_maps_hash(),
+      verified_mem_hash(),
+      shared_file_refs(o.shared_file_refs),
       session(nullptr),
-      vdso_start_addr(o.vdso_start_addr) {
+      vdso_start_addr(o.vdso_start_addr),
+      remote_syscall_stub_addr(o.remote_syscall_stub_addr),
+      remote_syscall_stub_resource(o.remote_syscall_stub_resource),
+      watched_pages(o.watched_pages),
+      watched_pages_protected(o.watched_pages_protected),
+      shared_mapping_shadows_(o.shared_mapping_shadows_),
+      io_urings_(o.io_urings_),
+      modified_file_pages(o.modified_file_pages),
+      saved_auxv_(o.saved_auxv_),
+      libraries_cached(false) {
   for (auto it = breakpoints.begin(); it != breakpoints.end(); ++it) {
     it->second = it->second->clone();
   }
 }
 
 bool AddressSpace::allocate_watchpoints() {
-  Task::DebugRegs regs;
+  vector<WatchConfig> configs;
   for (auto kv : watchpoints) {
     const MemoryRange& r = kv.first;
     int watching = kv.second->watched_bits();
     if (EXEC_BIT & watching) {
-      regs.push_back(WatchConfig(r.addr, r.num_bytes, WATCH_EXEC));
+      configs.push_back(WatchConfig(r.addr, r.num_bytes, WATCH_EXEC));
     }
     if (!(READ_BIT & watching) && (WRITE_BIT & watching)) {
-      regs.push_back(WatchConfig(r.addr, r.num_bytes, WATCH_WRITE));
+      configs.push_back(WatchConfig(r.addr, r.num_bytes, WATCH_WRITE));
     }
     if (READ_BIT & watching) {
-      regs.push_back(WatchConfig(r.addr, r.num_bytes, WATCH_READWRITE));
+      configs.push_back(WatchConfig(r.addr, r.num_bytes, WATCH_READWRITE));
+    }
+  }
+
+  // Data watchpoints that don't get a debug register are watched by
+  // page protection, which only replay knows how to handle.
+  bool can_watch_pages = session && session->is_replaying();
+  Task::DebugRegs regs;
+  vector<WatchConfig> new_page_watches;
+  for (auto& w : configs) {
+    if (can_watch_pages && WATCH_EXEC != w.type &&
+        (regs.size() >= Task::num_debug_reg_watchpoints() ||
+         !Task::fits_debug_reg(w))) {
+      new_page_watches.push_back(w);
+    } else {
+      regs.push_back(w);
     }
   }
   for (auto t : task_set()) {
@@ -858,13 +1090,84 @@ bool AddressSpace::allocate_watchpoints() {
       return false;
     }
   }
+
+  Task* t = task_set().empty() ? nullptr : *task_set().begin();
+  if (t) {
+    protect_watched_pages(t, false);
+  }
+  page_watches = new_page_watches;
+  watched_pages.clear();
+  for (auto& w : page_watches) {
+    for (remote_ptr<void> page = floor_page_size(w.addr);
+         page < w.addr + w.num_bytes; page += page_size()) {
+      watched_pages.insert(page);
+    }
+  }
+  if (t) {
+    protect_watched_pages(t, true);
+  }
   return true;
 }
 
-void AddressSpace::coalesce_around(MemoryMap::iterator it) {
-  Mapping m = it->first;
-  MappableResource r = it->second;
+vector<WatchConfig> AddressSpace::page_watches_in(
+    const MemoryRange& range) const {
+  vector<WatchConfig> result;
+  for (auto& w : page_watches) {
+    if (w.addr < range.addr + range.num_bytes &&
+        range.addr < w.addr + w.num_bytes) {
+      result.push_back(w);
+    }
+  }
+  return result;
+}
+
+void AddressSpace::protect_watched_pages(Task* t, bool protect,
+                                         remote_ptr<void> addr) {
+  if (addr.is_null() && protect == watched_pages_protected) {
+    return;
+  }
+  vector<remote_ptr<void> > pages;
+  if (addr.is_null()) {
+    pages.assign(watched_pages.begin(), watched_pages.end());
+    watched_pages_protected = protect;
+  } else {
+    pages.push_back(floor_page_size(addr));
+  }
 
+  vector<pair<remote_ptr<void>, int> > prots;
+  for (auto page : pages) {
+    auto it = mem.find(Mapping(page, page_size()));
+    if (it == mem.end()) {
+      // Unmapped since the watchpoint was set.
+      continue;
+    }
+    int prot = it->first.prot;
+    if (protect) {
+      prot &= ~PROT_WRITE;
+      for (auto& w : page_watches_in(MemoryRange(page, page_size()))) {
+        if (WATCH_READWRITE == w.type) {
+          prot = PROT_NONE;
+        }
+      }
+    }
+    prots.push_back(make_pair(page, prot));
+  }
+  if (prots.empty()) {
+    return;
+  }
+
+  LOG(debug) << (protect ? "Protecting " : "Unprotecting ") << prots.size()
+             << " watched pages";
+  AutoRemoteSyscalls remote(t);
+  RemoteSyscallBatch batch;
+  for (auto& p : prots) {
+    batch.add(syscall_number_for_mprotect(remote.arch()),
+              { p.first, page_size(), p.second });
+  }
+  remote.syscall_batch(batch);
+}
+
+void AddressSpace::coalesce_around(MemoryMap::iterator it) {
   auto first_kv = it;
   while (mem.begin() != first_kv) {
     auto next = first_kv;
@@ -887,30 +1190,120 @@ void AddressSpace::coalesce_around(MemoryMap::iterator it) {
     return;
   }
 
+  const Mapping& m = it->first;
   Mapping c(first_kv->first.start, last_kv->first.end, m.prot, m.flags,
             first_kv->first.offset);
+  MappableResource r = it->second;
   LOG(debug) << "  coalescing " << c;
 
-  mem.erase(first_kv, ++last_kv);
+  auto next = erase_from_memmap(first_kv, ++last_kv);
+  add_to_memmap(next, c, r);
+}
+
+AddressSpace::MemoryMap::iterator AddressSpace::add_to_memmap(
+    MemoryMap::iterator hint, const Mapping& m, const MappableResource& r) {
+  drop_local_file_mappings();
+  libraries_cached = false;
+  size_t old_size = mem.size();
+  auto it = mem.insert(hint, MemoryMap::value_type(m, r));
+  assert(mem.size() == old_size + 1); // key didn't already exist
+  if (r.is_shared_mmap_file()) {
+    ++shared_file_refs[r.id];
+  }
+  return it;
+}
 
-  auto ins = mem.insert(MemoryMap::value_type(c, r));
-  assert(ins.second); // key didn't already exist
+AddressSpace::MemoryMap::iterator AddressSpace::erase_from_memmap(
+    MemoryMap::iterator first, MemoryMap::iterator last) {
+  drop_local_file_mappings();
+  libraries_cached = false;
+  for (auto it = first; it != last; ++it) {
+    const MappableResource& r = it->second;
+    if (!r.is_shared_mmap_file()) {
+      continue;
+    }
+    auto refs = shared_file_refs.find(r.id);
+    assert(refs != shared_file_refs.end() && refs->second > 0);
+    if (0 == --refs->second) {
+      shared_file_refs.erase(refs);
+      // Clones are given their session right after they're
+      // created, before they can unmap anything.
+      if (session) {
+        session->on_shared_file_unmapped(r.id);
+      }
+    }
+  }
+  return mem.erase(first, last);
 }
 
 void AddressSpace::destroy_breakpoint(BreakpointMap::const_iterator it) {
   Task* t = *task_set().begin();
   t->write_mem(it->first, it->second->overwritten_data);
   breakpoints.erase(it);
+  // Other breakpoints may share the bit, so recompute the filter.
+  breakpoint_filter.reset();
+  for (auto& kv : breakpoints) {
+    breakpoint_filter.set(breakpoint_filter_bit(kv.first));
+  }
+}
+
+bool AddressSpace::shares_memory() const {
+  for (auto& kv : mem) {
+    const Mapping& m = kv.first;
+    const MappableResource& r = kv.second;
+    if (!(m.flags & MAP_SHARED) ||
+        PSEUDODEVICE_SCRATCH == r.id.psuedodevice() ||
+        string::npos != r.fsname.find(SYSCALLBUF_SHMEM_NAME_PREFIX)) {
+      continue;
+    }
+    return true;
+  }
+  return false;
+}
+
+void AddressSpace::read_ranges(Task* t, const vector<MemoryRange>& ranges,
+                               const RangeReader& f,
+                               size_t max_batch_bytes) const {
+  vector<uint8_t> arena;
+  vector<Task::RemoteIovec> iovs;
+  vector<ssize_t> nread;
+  size_t i = 0;
+  while (i < ranges.size()) {
+    size_t end = i;
+    size_t batch_bytes = 0;
+    do {
+      batch_bytes += ranges[end].num_bytes;
+      ++end;
+    } while (end < ranges.size() &&
+             batch_bytes + ranges[end].num_bytes <= max_batch_bytes);
+
+    arena.resize(batch_bytes);
+    iovs.clear();
+    size_t offset = 0;
+    for (size_t j = i; j < end; ++j) {
+      iovs.push_back(Task::RemoteIovec(ranges[j].addr, ranges[j].num_bytes,
+                                       arena.data() + offset));
+      offset += ranges[j].num_bytes;
+    }
+    t->read_bytes_fallible_v(iovs, &nread);
+    for (size_t j = i; j < end; ++j) {
+      f(j, static_cast<const uint8_t*>(iovs[j - i].local), nread[j - i]);
+    }
+    i = end;
+  }
 }
 
-void AddressSpace::for_each_in_range(
-    remote_ptr<void> addr, ssize_t num_bytes,
-    function<void(const Mapping& m, const MappableResource& r,
-                  const Mapping& rem)> f,
-    int how) {
+void AddressSpace::for_each_in_range(remote_ptr<void> addr,
+                                     ssize_t num_bytes, const RangeVisitor& f,
+                                     int how) {
   num_bytes = ceil_page_size(num_bytes);
   remote_ptr<void> last_unmapped_end = addr;
   remote_ptr<void> region_end = addr + num_bytes;
+  if (addr >= region_end) {
+    return;
+  }
+  // The only lookup; from here on the mappings are visited in order.
+  auto it = mem.lower_bound(Mapping(addr, region_end));
   while (last_unmapped_end < region_end) {
     // Invariant: |rem| is always exactly the region of
     // memory remaining to be examined for pages to be
@@ -919,7 +1312,6 @@ void AddressSpace::for_each_in_range(
 
     // The next page to iterate may not be contiguous with
     // the last one seen.
-    auto it = mem.lower_bound(rem);
     if (mem.end() == it) {
       LOG(debug) << "  not found, done.";
       return;
@@ -936,8 +1328,7 @@ void AddressSpace::for_each_in_range(
       return;
     }
 
-    MappableResource r = it->second;
-    f(m, r, rem);
+    it = f(it, rem);
 
     // Maintain the loop invariant.
     last_unmapped_end = m.end;
@@ -948,9 +1339,235 @@ void AddressSpace::map_and_coalesce(const Mapping& m,
                                     const MappableResource& r) {
   LOG(debug) << "  mapping " << m;
 
-  auto ins = mem.insert(MemoryMap::value_type(m, r));
-  assert(ins.second); // key didn't already exist
-  coalesce_around(ins.first);
+  coalesce_around(add_to_memmap(mem.lower_bound(m), m, r));
+}
+
+static bool is_private_file_mapping(const Mapping& m,
+                                    const MappableResource& r) {
+  return !(m.flags & (MAP_SHARED | MAP_ANONYMOUS)) && r.id.is_real_device() &&
+         PSEUDODEVICE_NONE == r.id.psuedodevice() && !r.fsname.empty() &&
+         '/' == r.fsname[0];
+}
+
+void AddressSpace::set_file_pages_modified(remote_ptr<void> start,
+                                           remote_ptr<void> end,
+                                           bool modified) {
+  if (!modified) {
+    modified_file_pages.erase(modified_file_pages.lower_bound(start),
+                              modified_file_pages.lower_bound(end));
+    return;
+  }
+  if (start >= end) {
+    return;
+  }
+  for (auto it = mem.lower_bound(Mapping(start, end));
+       it != mem.end() && it->first.start < end; ++it) {
+    if (!is_private_file_mapping(it->first, it->second)) {
+      continue;
+    }
+    for (remote_ptr<void> p = max(start, it->first.start);
+         p < min(end, it->first.end); p += page_size()) {
+      modified_file_pages.insert(p);
+    }
+  }
+}
+
+void AddressSpace::notify_written(remote_ptr<void> addr, size_t num_bytes) {
+  if (0 == num_bytes) {
+    return;
+  }
+  set_file_pages_modified(floor_page_size(addr),
+                          ceil_page_size(addr + num_bytes), true);
+}
+
+bool AddressSpace::read_bytes_from_file(remote_ptr<void> addr,
+                                        size_t num_bytes, void* buf) {
+  if (0 == num_bytes) {
+    return false;
+  }
+  remote_ptr<void> start = floor_page_size(addr);
+  remote_ptr<void> end = ceil_page_size(addr + num_bytes);
+  auto it = mem.find(Mapping(start, end));
+  if (it == mem.end() || !it->first.has_subset(Mapping(start, end)) ||
+      (it->first.prot & PROT_WRITE) ||
+      !is_private_file_mapping(it->first, it->second)) {
+    return false;
+  }
+  auto modified = modified_file_pages.lower_bound(start);
+  if (modified != modified_file_pages.end() && *modified < end) {
+    return false;
+  }
+
+  const Mapping& m = it->first;
+  auto local = local_file_mappings.find(m.start);
+  if (local == local_file_mappings.end()) {
+    LocalFileMapping lm = { nullptr, 0 };
+    ScopedFd fd(it->second.fsname.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    // The file at that path must still be the one that was mapped.
+    if (fd.is_open() && !fstat(fd, &st) &&
+        FileId(st).equivalent_to(it->second.id) && st.st_size > m.offset) {
+      size_t size = min<uint64_t>(m.num_bytes(), st.st_size - m.offset);
+      void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, m.offset);
+      if (p != MAP_FAILED) {
+        lm.data = static_cast<uint8_t*>(p);
+        lm.size = size;
+      }
+    }
+    LOG(debug) << "  local mapping of " << it->second.fsname << " for " << m
+               << ": " << lm.size << " bytes";
+    local = local_file_mappings.insert(make_pair(m.start, lm)).first;
+  }
+  size_t offset = addr - m.start;
+  if (offset + num_bytes > local->second.size) {
+    return false;
+  }
+  memcpy(buf, local->second.data + offset, num_bytes);
+  return true;
+}
+
+const vector<uint8_t>& AddressSpace::saved_auxv(Task* t) {
+  if (saved_auxv_.empty()) {
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "/proc/%d/auxv", t->real_tgid());
+    ScopedFd fd(filename, O_RDONLY);
+    if (fd.is_open()) {
+      uint8_t buf[4096];
+      ssize_t len;
+      while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        saved_auxv_.insert(saved_auxv_.end(), buf, buf + len);
+      }
+      if (len < 0) {
+        saved_auxv_.clear();
+      }
+    }
+  }
+  return saved_auxv_;
+}
+
+// r_debug.r_state once the list is complete.
+static const int RT_CONSISTENT = 0;
+
+/**
+ * Read the dynamic linker's list of loaded objects into |list|. Returns
+ * true if the linker had marked it consistent.
+ */
+template <typename Arch>
+static bool read_libraries(Task* t, const vector<uint8_t>& auxv,
+                           AddressSpace::LibraryList* list) {
+  typedef typename Arch::unsigned_word Word;
+  typedef typename std::conditional<sizeof(Word) == 8, Elf64_Phdr,
+                                    Elf32_Phdr>::type Phdr;
+  typedef typename std::conditional<sizeof(Word) == 8, Elf64_Dyn,
+                                    Elf32_Dyn>::type Dyn;
+  list->valid = false;
+  list->main_lm = nullptr;
+  list->libraries.clear();
+
+  // Find the program's dynamic section from its program headers.
+  Word phdr_addr = 0;
+  Word phnum = 0;
+  const Word* words = reinterpret_cast<const Word*>(auxv.data());
+  for (size_t i = 0; i + 1 < auxv.size() / sizeof(Word); i += 2) {
+    if (words[i] == AT_PHDR) {
+      phdr_addr = words[i + 1];
+    } else if (words[i] == AT_PHNUM) {
+      phnum = words[i + 1];
+    }
+  }
+  if (!phdr_addr || !phnum || phnum > 256) {
+    return false;
+  }
+  vector<Phdr> phdrs(phnum);
+  ssize_t size = phnum * sizeof(Phdr);
+  if (t->read_bytes_fallible(phdr_addr, size, phdrs.data()) != size) {
+    return false;
+  }
+  Word bias = 0;
+  Word dynamic = 0;
+  for (auto& ph : phdrs) {
+    if (ph.p_type == PT_PHDR) {
+      bias = phdr_addr - ph.p_vaddr;
+    } else if (ph.p_type == PT_DYNAMIC) {
+      dynamic = ph.p_vaddr;
+    }
+  }
+  if (!dynamic) {
+    // Statically linked.
+    return false;
+  }
+
+  // The dynamic linker fills in DT_DEBUG with the address of its r_debug.
+  Word r_debug = 0;
+  for (remote_ptr<Dyn> d = bias + dynamic;; ++d) {
+    Dyn dyn;
+    if (t->read_bytes_fallible(d, sizeof(dyn), &dyn) != sizeof(dyn) ||
+        dyn.d_tag == DT_NULL) {
+      break;
+    }
+    if (dyn.d_tag == DT_DEBUG) {
+      r_debug = dyn.d_un.d_ptr;
+      break;
+    }
+  }
+  // struct r_debug { int r_version; link_map* r_map; ElfW(Addr) r_brk;
+  //                  int r_state; ... }, with each member word-aligned.
+  Word header[4];
+  if (!r_debug ||
+      t->read_bytes_fallible(r_debug, sizeof(header), header) !=
+          sizeof(header)) {
+    return false;
+  }
+
+  // struct link_map { ElfW(Addr) l_addr; char* l_name; ElfW(Dyn)* l_ld;
+  //                   link_map* l_next; link_map* l_prev; }
+  // The first entry is the program itself.
+  Word prev = 0;
+  Word lm = header[1];
+  while (lm) {
+    Word entry[5];
+    if (t->read_bytes_fallible(lm, sizeof(entry), entry) != sizeof(entry) ||
+        entry[4] != prev || list->libraries.size() > 10000) {
+      return false;
+    }
+    if (!prev) {
+      list->main_lm = lm;
+    } else if (entry[1]) {
+      AddressSpace::Library lib;
+      lib.name = t->read_c_str(entry[1]);
+      lib.lm = lm;
+      lib.l_addr = entry[0];
+      lib.l_ld = entry[2];
+      if (!lib.name.empty()) {
+        list->libraries.push_back(lib);
+      }
+    }
+    prev = lm;
+    lm = entry[3];
+  }
+  list->valid = true;
+  return int(header[3]) == RT_CONSISTENT;
+}
+
+static bool read_libraries_arch(Task* t, const vector<uint8_t>& auxv,
+                                AddressSpace::LibraryList* list) {
+  RR_ARCH_FUNCTION(read_libraries, t->arch(), t, auxv, list);
+}
+
+const AddressSpace::LibraryList& AddressSpace::libraries(Task* t) {
+  if (!libraries_cached) {
+    libraries_cached = read_libraries_arch(t, saved_auxv(t), &libraries_);
+  }
+  return libraries_;
+}
+
+void AddressSpace::drop_local_file_mappings() {
+  for (auto& kv : local_file_mappings) {
+    if (kv.second.size) {
+      munmap(kv.second.data, kv.second.size);
+    }
+  }
+  local_file_mappings.clear();
 }
 
 /*static*/ void AddressSpace::populate_address_space(
@@ -992,4 +1609,9 @@ void AddressSpace::map_and_coalesce(const Mapping& m,
 
   as->map(info.start_addr, info.end_addr - info.start_addr, info.prot,
           info.flags, info.file_offset, MappableResource(id, info.name));
+  if (!(info.prot & PROT_EXEC)) {
+    // A data segment the dynamic linker has already relocated and made
+    // read-only (RELRO) doesn't hold the file's contents.
+    as->set_file_pages_modified(info.start_addr, info.end_addr, true);
+  }
 }
@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include <sys/mman.h>
 
+#include <bitset>
 #include <map>
 #include <memory>
 #include <set>
@@ -337,6 +338,16 @@ enum TrapType {
   TRAP_BKPT_USER,
 };
 
+/**
+ * A predicate the debugger attached to a USER breakpoint.  Replay only
+ * stops for the breakpoint when it holds.
+ */
+class BreakpointCondition {
+public:
+  virtual ~BreakpointCondition() {}
+  virtual bool evaluate(Task* t) const = 0;
+};
+
 // XXX one is tempted to merge Breakpoint and Watchpoint into a single
 // entity, but the semantics are just different enough that separate
 // objects are easier for now.
@@ -420,6 +431,14 @@ public:
    */
   void brk(remote_ptr<void> addr);
 
+  /**
+   * Return the end of the dynamic heap segment adjusted by brk(), or
+   * null if it's not known.
+   */
+  remote_ptr<void> current_brk() const {
+    return heap.start.is_null() ? remote_ptr<void>() : heap.end;
+  }
+
   /**
    * Dump a representation of |this| to stderr in a format
    * similar to /proc/[tid]/maps.
@@ -473,6 +492,21 @@ public:
    */
   const MemoryMap& memmap() const { return mem; }
 
+  /**
+   * Return true if some mapping of this maps the emulated shared
+   * file |id|.
+   */
+  bool maps_shared_file(const FileId& id) const {
+    return shared_file_refs.count(id) > 0;
+  }
+
+  /**
+   * Return true if some mapping of this may share memory with another
+   * process.  The syscallbuf and scratch segments that rr shares with
+   * its tasks don't count.
+   */
+  bool shares_memory() const;
+
   /**
    * Change the protection bits of [addr, addr + num_bytes) to
    * |prot|.
@@ -496,6 +530,29 @@ public:
   /** Ensure a breakpoint of |type| is set at |addr|. */
   bool set_breakpoint(remote_ptr<uint8_t> addr, TrapType type);
 
+  /**
+   * Attach |condition| to the USER breakpoint at |addr|, replacing
+   * any previous one.  Null makes the breakpoint unconditional.  The
+   * condition is dropped with the breakpoint's last USER reference.
+   */
+  void set_breakpoint_condition(
+      remote_ptr<uint8_t> addr,
+      std::shared_ptr<BreakpointCondition> condition);
+
+  /**
+   * Return the condition of the USER breakpoint at |addr|, or null if
+   * it's unconditional or there's none.
+   */
+  std::shared_ptr<BreakpointCondition> get_breakpoint_condition(
+      remote_ptr<uint8_t> addr);
+
+  /**
+   * |dest| holds the |length| bytes of tracee memory at |addr|.  Put back
+   * the bytes that breakpoints set in that range overwrote.
+   */
+  void replace_breakpoints_with_original_values(uint8_t* dest, size_t length,
+                                                remote_ptr<uint8_t> addr);
+
   /**
    * Destroy all breakpoints in this VM, regardless of their
    * reference counts.
@@ -512,20 +569,114 @@ public:
   bool set_watchpoint(remote_ptr<void> addr, size_t num_bytes, WatchType type);
   void destroy_all_watchpoints();
 
+  /**
+   * Replace the debugger's (USER) breakpoints and all the watchpoints
+   * of this VM with those set in |other|, which is the same VM in
+   * another session.  Used when the debugger is switched over to a
+   * session restored from a checkpoint that predates its current
+   * breakpoints.
+   */
+  void copy_debugger_breakpoints_from(AddressSpace& other);
+
+  /**
+   * During replay, watchpoints that don't fit in the debug
+   * registers are implemented by protecting the pages they're on:
+   * pages with a read watchpoint become inaccessible, pages with
+   * only write watchpoints read-only.  The tracee faults on each
+   * access to such a page, and the replayer steps the faulting
+   * instruction with the page's normal protection to find out
+   * whether it hit a watchpoint.
+   *
+   * Return true if |addr| is on a page protected for a watchpoint.
+   */
+  bool is_page_watched(remote_ptr<void> addr) const {
+    return watched_pages_protected &&
+           watched_pages.count(floor_page_size(addr)) > 0;
+  }
+  bool has_page_watches() const { return !page_watches.empty(); }
+
+  /** Return the page-protection watchpoints overlapping |range|. */
+  std::vector<WatchConfig> page_watches_in(const MemoryRange& range) const;
+
+  /**
+   * Give the watched pages their normal protection back, or, if
+   * |protect|, protect them for their watchpoints again.  Only the
+   * page of |addr| is changed if it's not null.  |t| makes the
+   * mprotect() calls.
+   */
+  void protect_watched_pages(Task* t, bool protect,
+                             remote_ptr<void> addr = nullptr);
+
+  /**
+   * Record that the page-protection watchpoint at |addr| was hit.
+   * |take_page_watch_hit()| returns that address, once, or null if
+   * none was hit since the last call.
+   */
+  void set_page_watch_hit(remote_ptr<void> addr) { page_watch_hit = addr; }
+  remote_ptr<void> take_page_watch_hit() {
+    remote_ptr<void> hit = page_watch_hit;
+    page_watch_hit = nullptr;
+    return hit;
+  }
+
   /**
    * Make [addr, addr + num_bytes) inaccesible within this
    * address space.
    */
   void unmap(remote_ptr<void> addr, ssize_t num_bytes);
 
+  /**
+   * Return the number of bytes shmdt(|addr|) unmaps: the adjoining
+   * mappings from |addr| on of the SysV shm segment attached there, or
+   * 0 if no segment is attached at |addr|.
+   */
+  size_t shm_attach_size(remote_ptr<void> addr) const;
+
   /** Return the vdso mapping of this. */
   Mapping vdso() const;
 
+  /**
+   * Remember that the preload lib's |_remote_syscall_stub| is at |stub|,
+   * so that batches of remote syscalls can run there.
+   */
+  void set_remote_syscall_stub(remote_ptr<uint8_t> stub);
+  /**
+   * Return the address of |_remote_syscall_stub|, or null if it isn't
+   * known or the code it was in has been unmapped since.
+   */
+  remote_ptr<uint8_t> remote_syscall_stub() const;
+
   /**
    * Verify that this cached address space matches what the
    * kernel thinks it should be.
    */
   void verify(Task* t) const;
+  /**
+   * Call verify() as Flags::check_cached_mmaps asks: always if |force|,
+   * otherwise for a random check_cached_mmaps_rate of the calls.  The
+   * comparison is skipped if neither /proc/maps nor the cached mappings
+   * changed since the last check that passed.
+   */
+  void maybe_verify(Task* t, bool force);
+  /**
+   * Return true if the syscall |syscallno| can change the mappings of an
+   * address space, so that maybe_verify() should be forced after it.
+   */
+  static bool syscall_changes_mappings(int syscallno, SupportedArch arch);
+
+  /**
+   * Read each of |ranges| from |t|'s memory, batching as many ranges as
+   * fit in |max_batch_bytes| into one vectored read, and call |f| for
+   * each range in order.  |f| is passed the index of the range, the data
+   * read and the number of bytes at the start of the range that could be
+   * read; the data is only valid during the call.  A range bigger than
+   * |max_batch_bytes| is read on its own.
+   */
+  typedef std::function<void(size_t index, const uint8_t* data,
+                             size_t valid)> RangeReader;
+  void read_ranges(Task* t, const std::vector<MemoryRange>& ranges,
+                   const RangeReader& f,
+                   size_t max_batch_bytes = 64 * 1024 * 1024) const;
 
   bool has_breakpoints() { return !breakpoints.empty(); }
   bool has_watchpoints() { return !watchpoints.empty(); }
@@ -536,6 +687,86 @@ public:
   ScopedFd& mem_fd() { return child_mem_fd; }
   void set_mem_fd(ScopedFd&& fd) { child_mem_fd = std::move(fd); }
 
+  /**
+   * Checksums of each page of a private mapping, kept by incremental
+   * checksumming (see util.cc) so that only pages the kernel reports
+   * soft-dirty since the last checksum are read again.
+   */
+  struct PageChecksums {
+    // The mapping and resource the checksums are for, as Mapping::str()
+    // and MappableResource::str().
+    std::string map_line;
+    // The ChecksumKind of |sums|.
+    int kind;
+    // Sum of the words of each page, and how many bytes of the page
+    // could be read.
+    std::vector<uint32_t> sums;
+    std::vector<uint32_t> valid_bytes;
+  };
+  typedef std::map<remote_ptr<void>, PageChecksums> PageChecksumMap;
+  PageChecksumMap& page_checksums() { return page_checksums_; }
+
+  /**
+   * rr's copy of the contents of each copied MAP_SHARED writable file
+   * mapping, as of the last time they were recorded, so that changes made
+   * from outside the tracee can be found (see
+   * |rec_record_shared_mapping_changes()|).  Only kept during recording.
+   */
+  struct SharedMappingShadow {
+    // The mapping's end and resource.  The shadow is dropped when the
+    // mapping at its start no longer matches these.
+    remote_ptr<void> end;
+    MappableResource resource;
+    // The mapping's contents, up to the first byte that couldn't be
+    // read (past the end of the file).
+    std::vector<uint8_t> contents;
+  };
+  typedef std::map<remote_ptr<void>, SharedMappingShadow>
+      SharedMappingShadowMap;
+  SharedMappingShadowMap& shared_mapping_shadows() {
+    return shared_mapping_shadows_;
+  }
+
+  /**
+   * What recording knows of each io_uring instance set up in this address
+   * space, by the fd io_uring_setup returned, so that the buffers its
+   * requests fill can be recorded when their completions are posted (see
+   * |rec_process_syscall()|'s handling of io_uring_enter).  Only kept
+   * during recording.
+   */
+  struct IoUring {
+    IoUring() : setup_flags(0), features(0), cq_seen(0) {}
+    uint32_t setup_flags;
+    uint32_t features;
+    // Offsets of the ring fields rr reads, from io_uring_params.
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t sq_ring_mask;
+    uint32_t sq_array;
+    uint32_t cq_tail;
+    uint32_t cq_ring_mask;
+    uint32_t cqes;
+    // Where the tracee mapped the rings and the SQE array.
+    remote_ptr<void> sq_ring;
+    remote_ptr<void> cq_ring;
+    remote_ptr<void> sqes;
+    // The CQ tail as of the last io_uring_enter; the CQEs from here on
+    // haven't been looked at yet.
+    uint32_t cq_seen;
+    // What rr needs of a submitted request to record what it filled.
+    struct Request {
+      uint8_t opcode;
+      uint64_t addr;
+      uint64_t addr2;
+      uint32_t len;
+    };
+    // The requests submitted and not yet completed, by user_data, which
+    // tracees needn't keep unique.
+    std::multimap<uint64_t, Request> requests;
+  };
+  typedef std::map<int, IoUring> IoUringMap;
+  IoUringMap& io_urings() { return io_urings_; }
+
   /**
    * Call this when an exec replaces 'as' with 'this' for some process.
    */
@@ -544,6 +775,51 @@ public:
     child_mem_fd = std::move(as.child_mem_fd);
   }
 
+  /**
+   * If [addr, addr + num_bytes) lies in a private, read-only mapping of
+   * a file whose pages there hold the file's contents, as far as we know,
+   * copy them into |buf| from rr's own mapping of the file, without
+   * touching the tracee, and return true.  Otherwise return false.
+   *
+   * Pages stop qualifying when they were ever writable, or rr wrote them
+   * (see |notify_written()|), since the mapping was made.
+   */
+  bool read_bytes_from_file(remote_ptr<void> addr, size_t num_bytes,
+                            void* buf);
+
+  /**
+   * Call this when rr writes |num_bytes| at |addr| in this.
+   */
+  void notify_written(remote_ptr<void> addr, size_t num_bytes);
+
+  /**
+   * Return the auxiliary vector of the program this address space was
+   * exec()'d for, read through |t| the first time it's asked for.  Empty
+   * if it can't be read.
+   */
+  const std::vector<uint8_t>& saved_auxv(Task* t);
+
+  struct Library {
+    std::string name;
+    // The dynamic linker's link_map for the library.
+    remote_ptr<void> lm;
+    uint64_t l_addr;
+    remote_ptr<void> l_ld;
+  };
+  struct LibraryList {
+    // False if the dynamic linker hasn't published a list (yet).
+    bool valid;
+    // The link_map of the program itself, which isn't in |libraries|.
+    remote_ptr<void> main_lm;
+    std::vector<Library> libraries;
+  };
+  /**
+   * Return the shared libraries loaded into this, walking the dynamic
+   * linker's r_debug list through |t|.  A list the linker has marked
+   * consistent is kept until the memory map changes.
+   */
+  const LibraryList& libraries(Task* t);
+
 private:
   AddressSpace(Task* t, const std::string& exe, Session& session);
   AddressSpace(const AddressSpace& o);
@@ -563,17 +839,39 @@ private:
    */
   void coalesce_around(MemoryMap::iterator it);
 
+  /**
+   * Insert |m| of |r| into |mem| using |hint| as an insertion hint,
+   * and erase the mappings in [first, last) from it.  All changes
+   * to |mem| go through these, so that |shared_file_refs| stays
+   * correct.
+   */
+  MemoryMap::iterator add_to_memmap(MemoryMap::iterator hint, const Mapping& m,
+                                    const MappableResource& r);
+  MemoryMap::iterator erase_from_memmap(MemoryMap::iterator first,
+                                        MemoryMap::iterator last);
+
   /**
    * Erase |it| from |breakpoints| and restore any memory in
    * this it may have overwritten.
    */
   void destroy_breakpoint(BreakpointMap::const_iterator it);
 
+  /**
+   * Return the bit of |breakpoint_filter| that |addr| hashes to.
+   */
+  static size_t breakpoint_filter_bit(remote_ptr<uint8_t> addr) {
+    uintptr_t a = addr.as_int();
+    return (a ^ (a >> 12)) % BREAKPOINT_FILTER_BITS;
+  }
+
   /**
    * For each mapped segment overlapping [addr, addr +
-   * num_bytes), call |f|.  Pass |f| the overlapping mapping,
-   * the mapped resource, and the range of addresses remaining
-   * to be iterated over.
+   * num_bytes), call |f|.  Pass |f| the iterator of the
+   * overlapping mapping and the range of addresses remaining to
+   * be iterated over.  |f| may erase the mapping and insert
+   * pieces of it, and returns the iterator of the first mapping
+   * after the ones it replaced, so that walking k mappings costs
+   * one O(log n) lookup rather than k of them.
    *
    * Pass |ITERATE_CONTIGUOUS| to stop iterating when the last
    * contiguous mapping after |addr| within the region is seen.
@@ -583,11 +881,10 @@ private:
     ITERATE_DEFAULT,
     ITERATE_CONTIGUOUS
   };
-  void for_each_in_range(
-      remote_ptr<void> addr, ssize_t num_bytes,
-      std::function<void(const Mapping& m, const MappableResource& r,
-                         const Mapping& rem)> f,
-      int how = ITERATE_DEFAULT);
+  typedef std::function<MemoryMap::iterator(MemoryMap::iterator it,
+                                            const Mapping& rem)> RangeVisitor;
+  void for_each_in_range(remote_ptr<void> addr, ssize_t num_bytes,
+                         const RangeVisitor& f, int how = ITERATE_DEFAULT);
 
   /**
    * Map |m| of |r| into this address space, and coalesce any
@@ -595,6 +892,17 @@ private:
    */
   void map_and_coalesce(const Mapping& m, const MappableResource& r);
 
+  /**
+   * Note that the pages of private file mappings in [start, end) may no
+   * longer hold the file's contents, or again do.
+   */
+  void set_file_pages_modified(remote_ptr<void> start, remote_ptr<void> end,
+                               bool modified);
+  /**
+   * Unmap the local file mappings used by |read_bytes_from_file()|.
+   */
+  void drop_local_file_mappings();
+
   /** Set the dynamic heap segment to |[start, end)| */
   void update_heap(remote_ptr<void> start, remote_ptr<void> end) {
     heap = Mapping(start, end, PROT_READ | PROT_WRITE,
@@ -603,6 +911,12 @@ private:
 
   // All breakpoints set in this VM.
   BreakpointMap breakpoints;
+  // Bit |breakpoint_filter_bit(addr)| is set for the address of each
+  // breakpoint, so most "is there a breakpoint here?" checks are a
+  // single bit test, even with many breakpoints set.  Bits can be set
+  // for addresses without a breakpoint, but never clear for one with.
+  static const size_t BREAKPOINT_FILTER_BITS = 4096;
+  std::bitset<BREAKPOINT_FILTER_BITS> breakpoint_filter;
   /* Path of the executable image this address space was
    * exec()'d with. */
   std::string exe;
@@ -613,15 +927,35 @@ private:
   bool is_clone;
   /* All segments mapped into this address space. */
   MemoryMap mem;
+  // The hashes of /proc/maps and of |mem| at the last check by
+  // maybe_verify() that passed, or zero if there's been none.
+  Hash128 verified_maps_hash;
+  Hash128 verified_mem_hash;
+  // The number of segments of |mem| mapping each emulated shared
+  // file.  The session is told when a count drops to zero, so that
+  // it can free the file if no other address space maps it.
+  std::map<FileId, size_t> shared_file_refs;
   // The session that created this.  We save a ref to it so that
   // we can notify it when we die.
   Session* session;
   /* First mapped byte of the vdso. */
   remote_ptr<void> vdso_start_addr;
+  // Where the preload lib's |_remote_syscall_stub| is, and the resource
+  // its code was mapped from then.
+  remote_ptr<uint8_t> remote_syscall_stub_addr;
+  MappableResource remote_syscall_stub_resource;
   // The watchpoints set for tasks in this VM.  Watchpoints are
   // programmed per Task, but we track them per address space on
   // behalf of debuggers that assume that model.
   WatchpointMap watchpoints;
+  // The watchpoints that are implemented by page protection, see
+  // |is_page_watched()|, and the pages they're on.  Clones inherit
+  // |watched_pages| with their memory, so that they can restore
+  // the pages' normal protection.
+  std::vector<WatchConfig> page_watches;
+  std::set<remote_ptr<void> > watched_pages;
+  bool watched_pages_protected;
+  remote_ptr<void> page_watch_hit;
   // Tracee memory is read and written through this fd, which is
   // opened for the tracee's magic /proc/[tid]/mem device.  The
   // advantage of this over ptrace is that we can access it even
@@ -632,6 +966,29 @@ private:
   // Users of child_mem_fd should fall back to ptrace-based memory
   // access when child_mem_fd is not open.
   ScopedFd child_mem_fd;
+  // Page checksums as of the last checksum of this address space, if
+  // incremental checksumming is on. Clones start without any.
+  PageChecksumMap page_checksums_;
+  // Shadows of copied shared writable file mappings.  Forked address
+  // spaces share the mappings, so clones inherit them.
+  SharedMappingShadowMap shared_mapping_shadows_;
+  // io_uring instances, likewise inherited by clones.
+  IoUringMap io_urings_;
+  // Pages of private file mappings that may not hold the file's
+  // contents; see |read_bytes_from_file()|.
+  std::set<remote_ptr<void> > modified_file_pages;
+  // rr's read-only mappings of the files backing tracee mappings, by the
+  // tracee mapping's start.  |size| is zero if the file couldn't be
+  // mapped.  Dropped whenever |mem| changes.
+  struct LocalFileMapping {
+    uint8_t* data;
+    size_t size;
+  };
+  std::map<remote_ptr<void>, LocalFileMapping> local_file_mappings;
+  std::vector<uint8_t> saved_auxv_;
+  LibraryList libraries_;
+  // True when |libraries_| is still current.
+  bool libraries_cached;
 
   /**
    * Ensure that the cached mapping of |t| matches /proc/maps,
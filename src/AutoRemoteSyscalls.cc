@@ -105,6 +105,249 @@ long AutoRemoteSyscalls::wait_syscall(int syscallno) {
   return t->regs().syscall_result_signed();
 }
 
+size_t RemoteSyscallBatch::add(int syscallno,
+                               std::initializer_list<Arg> args) {
+  assert(args.size() <= 6);
+  for (auto& arg : args) {
+    assert(arg.result_of < ssize_t(calls.size()));
+  }
+  calls.push_back({ syscallno, args });
+  return calls.size() - 1;
+}
+
+static void set_arg(Registers& regs, int index, uintptr_t value) {
+  switch (index) {
+    case 1:
+      return regs.set_arg1(value);
+    case 2:
+      return regs.set_arg2(value);
+    case 3:
+      return regs.set_arg3(value);
+    case 4:
+      return regs.set_arg4(value);
+    case 5:
+      return regs.set_arg5(value);
+    case 6:
+      return regs.set_arg6(value);
+  }
+}
+
+// Layout of struct remote_syscall, in words: the syscall number, six
+// arguments, the mask of indirect arguments and the result.
+enum {
+  REMOTE_SYSCALL_INDIRECT_ARGS_WORD = 7,
+  REMOTE_SYSCALL_RESULT_WORD = 8,
+  REMOTE_SYSCALL_WORDS = 9
+};
+static_assert(sizeof(struct remote_syscall) ==
+                  REMOTE_SYSCALL_WORDS * sizeof(long),
+              "struct remote_syscall layout changed");
+
+template <typename T>
+static void append_value(std::vector<uint8_t>& code, T value) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  code.insert(code.end(), bytes, bytes + sizeof(value));
+}
+
+// Per syscall argument register, in argument order: the opcode of mov
+// reg,imm32 and the ModRM byte of mov reg,eax.
+static const uint8_t x86_mov_imm_opcodes[6] = { 0xbb, 0xb9, 0xba,
+                                                0xbe, 0xbf, 0xbd };
+static const uint8_t x86_mov_eax_modrms[6] = { 0xc3, 0xc1, 0xc2,
+                                               0xc6, 0xc7, 0xc5 };
+// The same for x86-64, where r10/r8/r9 also need REX.B.
+static const uint8_t x64_rex_prefixes[6] = { 0x48, 0x48, 0x48,
+                                             0x49, 0x49, 0x49 };
+static const uint8_t x64_mov_imm_opcodes[6] = { 0xbf, 0xbe, 0xba,
+                                                0xba, 0xb8, 0xb9 };
+static const uint8_t x64_mov_rax_modrms[6] = { 0xc7, 0xc6, 0xc2,
+                                               0xc2, 0xc0, 0xc1 };
+
+/**
+ * Return code that makes each of |calls| and stores its result in the
+ * 8-byte slot of |results| with the same index, then traps.
+ */
+static std::vector<uint8_t> encode_syscall_batch(
+    SupportedArch arch, const std::vector<RemoteSyscallBatch::Call>& calls,
+    remote_ptr<uint64_t> results) {
+  std::vector<uint8_t> code;
+  for (size_t i = 0; i < calls.size(); ++i) {
+    auto& call = calls[i];
+    for (size_t j = 0; j < call.args.size(); ++j) {
+      auto& arg = call.args[j];
+      if (arg.result_of >= 0) {
+        uintptr_t slot = (results + arg.result_of).as_int();
+        if (arch == x86) {
+          // mov eax,[slot]; mov reg,eax
+          code.push_back(0xa1);
+          append_value(code, uint32_t(slot));
+          code.insert(code.end(), { 0x89, x86_mov_eax_modrms[j] });
+        } else {
+          // movabs rax,[slot]; mov reg,rax
+          code.insert(code.end(), { 0x48, 0xa1 });
+          append_value(code, uint64_t(slot));
+          code.insert(code.end(),
+                      { x64_rex_prefixes[j], 0x89, x64_mov_rax_modrms[j] });
+        }
+      } else if (arch == x86) {
+        code.push_back(x86_mov_imm_opcodes[j]);
+        append_value(code, uint32_t(arg.value));
+      } else {
+        code.insert(code.end(),
+                    { x64_rex_prefixes[j], x64_mov_imm_opcodes[j] });
+        append_value(code, arg.value);
+      }
+    }
+    uintptr_t slot = (results + i).as_int();
+    if (arch == x86) {
+      // mov eax,syscallno; int $0x80; mov [slot],eax
+      code.push_back(0xb8);
+      append_value(code, uint32_t(call.syscallno));
+      code.insert(code.end(), { 0xcd, 0x80, 0xa3 });
+      append_value(code, uint32_t(slot));
+    } else {
+      // movabs rax,syscallno; syscall; movabs [slot],rax
+      code.insert(code.end(), { 0x48, 0xb8 });
+      append_value(code, uint64_t(call.syscallno));
+      code.insert(code.end(), { 0x0f, 0x05, 0x48, 0xa3 });
+      append_value(code, uint64_t(slot));
+    }
+  }
+  // int3
+  code.push_back(0xcc);
+  return code;
+}
+
+/**
+ * Return |calls| as the array of struct remote_syscall that the preload
+ * lib's |_remote_syscall_stub| runs, for the array at |entries|.
+ */
+static std::vector<uint8_t> encode_remote_syscalls(
+    SupportedArch arch, const std::vector<RemoteSyscallBatch::Call>& calls,
+    remote_ptr<void> entries) {
+  size_t word_size = arch == x86 ? 4 : 8;
+  std::vector<uint8_t> array;
+  for (auto& call : calls) {
+    uint64_t words[REMOTE_SYSCALL_WORDS] = { uint64_t(call.syscallno) };
+    for (size_t j = 0; j < call.args.size(); ++j) {
+      auto& arg = call.args[j];
+      if (arg.result_of >= 0) {
+        words[1 + j] =
+            (entries + (arg.result_of * REMOTE_SYSCALL_WORDS +
+                        REMOTE_SYSCALL_RESULT_WORD) *
+                           word_size).as_int();
+        words[REMOTE_SYSCALL_INDIRECT_ARGS_WORD] |= 1 << j;
+      } else {
+        words[1 + j] = arg.value;
+      }
+    }
+    for (uint64_t word : words) {
+      if (arch == x86) {
+        append_value(array, uint32_t(word));
+      } else {
+        append_value(array, word);
+      }
+    }
+  }
+  return array;
+}
+
+/**
+ * Resume |t| until it traps at the end of a batch of syscalls,
+ * skipping the seccomp events and SIGCHLDs they may cause.
+ */
+static void run_syscall_batch(Task* t) {
+  do {
+    t->cont_nonblocking();
+    t->wait();
+  } while (t->is_ptrace_seccomp_event() || SIGCHLD == t->pending_sig());
+}
+
+void AutoRemoteSyscalls::syscall_batch(RemoteSyscallBatch& batch) {
+  auto& calls = batch.calls;
+  batch.results.resize(calls.size());
+  if (calls.empty()) {
+    return;
+  }
+
+  remote_ptr<uint8_t> stub = t->vm()->remote_syscall_stub();
+  if (!stub.is_null()) {
+    // The preload lib's stub is already mapped, so we only have to
+    // write the syscalls' arguments, not any code.
+    size_t word_size = arch() == x86 ? 4 : 8;
+    AutoRestoreMem entries_mem(*this, nullptr, calls.size() *
+                                                   REMOTE_SYSCALL_WORDS *
+                                                   word_size);
+    auto entries = entries_mem.get();
+    std::vector<uint8_t> array = encode_remote_syscalls(arch(), calls, entries);
+    t->write_bytes_helper(entries, array.size(), array.data());
+    LOG(debug) << "Running " << calls.size() << " syscalls in stub at "
+               << stub;
+    Registers callregs = regs();
+    callregs.set_ip(stub.as_int());
+    callregs.set_arg1(entries);
+    callregs.set_arg2(calls.size());
+    t->set_regs(callregs);
+    run_syscall_batch(t);
+    ASSERT(t, SIGTRAP == t->pending_sig() &&
+                  0xcc == t->read_mem(t->ip() - 1))
+        << "Batched syscalls stopped at " << t->ip() << " with signal "
+        << t->pending_sig();
+    for (size_t i = 0; i < calls.size(); ++i) {
+      auto result = entries + (i * REMOTE_SYSCALL_WORDS +
+                               REMOTE_SYSCALL_RESULT_WORD) *
+                                  word_size;
+      batch.results[i] = arch() == x86
+                             ? long(t->read_mem(result.cast<int32_t>()))
+                             : long(t->read_mem(result.cast<int64_t>()));
+    }
+    return;
+  }
+
+  AutoRestoreMem results_mem(*this, nullptr, calls.size() * sizeof(uint64_t));
+  auto results = results_mem.get().cast<uint64_t>();
+  std::vector<uint8_t> code = encode_syscall_batch(arch(), calls, results);
+  // The program overwrites the code following the task's ip, so it
+  // must fit in that mapping, and the mapping mustn't be shared lest
+  // other processes see the program.
+  const Mapping& m = t->vm()->mapping_of(initial_ip, 1).first;
+  if ((m.flags & MAP_SHARED) ||
+      initial_ip.as_int() + code.size() > m.end.as_int()) {
+    LOG(debug) << "Can't batch " << calls.size() << " syscalls at "
+               << initial_ip;
+    for (size_t i = 0; i < calls.size(); ++i) {
+      Registers callregs = regs();
+      for (size_t j = 0; j < calls[i].args.size(); ++j) {
+        auto& arg = calls[i].args[j];
+        set_arg(callregs, j + 1, arg.result_of >= 0
+                                     ? batch.results[arg.result_of]
+                                     : arg.value);
+      }
+      batch.results[i] = syscall_helper(WAIT, calls[i].syscallno, callregs);
+    }
+    return;
+  }
+
+  LOG(debug) << "Batching " << calls.size() << " syscalls at " << initial_ip;
+  std::vector<uint8_t> saved_code(code.size());
+  t->read_bytes_helper(initial_ip, saved_code.size(), saved_code.data());
+  t->write_bytes_helper(initial_ip, code.size(), code.data());
+  Registers callregs = regs();
+  callregs.set_ip(initial_ip.as_int());
+  t->set_regs(callregs);
+  run_syscall_batch(t);
+  ASSERT(t, SIGTRAP == t->pending_sig() &&
+                t->ip() == initial_ip + code.size())
+      << "Batched syscalls stopped at " << t->ip() << " with signal "
+      << t->pending_sig();
+  t->write_bytes_helper(initial_ip, saved_code.size(), saved_code.data());
+
+  for (size_t i = 0; i < calls.size(); ++i) {
+    uint64_t result = t->read_mem(results + i);
+    batch.results[i] = arch() == x86 ? long(int32_t(result)) : long(result);
+  }
+}
+
 SupportedArch AutoRemoteSyscalls::arch() const { return t->arch(); }
 
 static void write_socketcall_args(Task* t,
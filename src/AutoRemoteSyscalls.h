@@ -5,6 +5,7 @@
 
 #include <string.h>
 
+#include <initializer_list>
 #include <vector>
 
 #include "Registers.h"
@@ -73,6 +74,60 @@ private:
   void operator delete(void*) = delete;
 };
 
+/**
+ * A sequence of syscalls for |AutoRemoteSyscalls::syscall_batch()| to
+ * make in a Task with a single resume, instead of a ptrace round trip
+ * per syscall.  Arguments may be the results of earlier syscalls in
+ * the batch.
+ */
+class RemoteSyscallBatch {
+public:
+  /** A syscall argument: an immediate value, or an earlier result. */
+  struct Arg {
+    template <typename T>
+    Arg(T value)
+        : value(uint64_t(value)), result_of(-1) {}
+    template <typename T>
+    Arg(remote_ptr<T> value)
+        : value(value.as_int()), result_of(-1) {}
+
+    static Arg result(size_t index) {
+      Arg arg(0);
+      arg.result_of = index;
+      return arg;
+    }
+
+    uint64_t value;
+    ssize_t result_of;
+  };
+
+  /**
+   * Append |syscallno| with up to six |args| to the batch.  Return
+   * the index of the syscall, to pass to |result()| or
+   * |Arg::result()|.
+   */
+  size_t add(int syscallno, std::initializer_list<Arg> args);
+
+  /**
+   * Return the raw kernel return value of syscall |index|, after
+   * the batch has been run.
+   */
+  long result(size_t index) const { return results[index]; }
+
+  size_t size() const { return calls.size(); }
+
+  struct Call {
+    int syscallno;
+    std::vector<Arg> args;
+  };
+
+private:
+  friend class AutoRemoteSyscalls;
+
+  std::vector<Call> calls;
+  std::vector<long> results;
+};
+
 /**
  * RAII helper to prepare a Task for remote syscalls and undo any
  * preparation upon going out of scope.
@@ -126,6 +181,20 @@ public:
     return syscall_helper<1>(syscallno, callregs, args...);
   }
 
+  /**
+   * Make all the syscalls in |batch|, in order, and store their
+   * results in it.  The syscalls run from the preload lib's
+   * |_remote_syscall_stub| once the lib has registered it, or else
+   * from a little program written over the code at the task's ip, so
+   * the task is resumed only once.  If neither is possible, they're
+   * made one at a time.
+   *
+   * The syscalls must not stop the task for ptrace events (e.g.
+   * no clone()s), and must not unmap the code at the task's ip or
+   * the preload lib.
+   */
+  void syscall_batch(RemoteSyscallBatch& batch);
+
   /** The Task in the context of which we're making syscalls. */
   Task* task() const { return t; }
 
@@ -0,0 +1,69 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "BufferPool"
+
+#include "BufferPool.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Leaked, so buffers can be returned while other statics are destroyed.
+static vector<vector<uint8_t> >& free_buffers =
+    *new vector<vector<uint8_t> >();
+static size_t free_bytes;
+
+void BufferPool::get(vector<uint8_t>& buf, size_t size) {
+  if (buf.capacity() < size) {
+    vector<uint8_t> found;
+    if (size >= MIN_POOLED_SIZE) {
+      pthread_mutex_lock(&pool_mutex);
+      // Take the smallest free buffer that's big enough.
+      auto best = free_buffers.end();
+      for (auto it = free_buffers.begin(); it != free_buffers.end(); ++it) {
+        if (it->capacity() >= size &&
+            (best == free_buffers.end() ||
+             it->capacity() < best->capacity())) {
+          best = it;
+        }
+      }
+      if (best != free_buffers.end()) {
+        free_bytes -= best->capacity();
+        found.swap(*best);
+        free_buffers.erase(best);
+      }
+      pthread_mutex_unlock(&pool_mutex);
+    }
+    if (found.capacity() < size) {
+      found.reserve(size);
+      uintptr_t start = (uintptr_t(found.data()) + HUGE_PAGE_SIZE - 1) &
+                        ~uintptr_t(HUGE_PAGE_SIZE - 1);
+      uintptr_t end =
+          (uintptr_t(found.data()) + size) & ~uintptr_t(HUGE_PAGE_SIZE - 1);
+      if (start < end) {
+        // Failure just means THP is unavailable.
+        madvise((void*)start, end - start, MADV_HUGEPAGE);
+      }
+    }
+    buf.swap(found);
+    put(found);
+  }
+  // Only grows the buffer's size, if it was pooled, so this faults in
+  // (by zeroing) just the memory that's never been touched.
+  buf.resize(size);
+}
+
+void BufferPool::put(vector<uint8_t>& buf) {
+  if (buf.capacity() >= MIN_POOLED_SIZE) {
+    pthread_mutex_lock(&pool_mutex);
+    if (free_bytes + buf.capacity() <= MAX_FREE_BYTES) {
+      free_bytes += buf.capacity();
+      free_buffers.push_back(vector<uint8_t>());
+      free_buffers.back().swap(buf);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+  }
+  vector<uint8_t>().swap(buf);
+}
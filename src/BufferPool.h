@@ -0,0 +1,45 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_BUFFER_POOL_H_
+#define RR_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/**
+ * BufferPool recycles the large buffers of the trace I/O path: compressed
+ * and decompressed blocks and CompressedWriter ring buffers. Allocating
+ * a fresh multi-megabyte buffer for each block costs a page fault per
+ * page every time; a recycled buffer is already faulted in.
+ *
+ * New buffers are marked for transparent huge pages (where they span an
+ * aligned huge page) before they're first touched, and are faulted in
+ * on allocation, so the hot path sees neither faults nor 4K TLB misses.
+ *
+ * The pool is shared by all threads and holds at most MAX_FREE_BYTES.
+ */
+class BufferPool {
+public:
+  /**
+   * Make |buf| a buffer of |size| bytes, reusing a pooled buffer if
+   * |buf| isn't big enough already (in which case |buf|'s old buffer
+   * goes back in the pool). The contents are unspecified.
+   */
+  static void get(std::vector<uint8_t>& buf, size_t size);
+  /**
+   * Give |buf|'s memory back to the pool, leaving |buf| empty.
+   */
+  static void put(std::vector<uint8_t>& buf);
+
+private:
+  enum {
+    // Buffers smaller than this are left to malloc.
+    MIN_POOLED_SIZE = 64 * 1024,
+    MAX_FREE_BYTES = 128 * 1024 * 1024,
+    HUGE_PAGE_SIZE = 2 * 1024 * 1024
+  };
+};
+
+#endif /* RR_BUFFER_POOL_H_ */
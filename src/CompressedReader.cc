@@ -10,39 +10,68 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RR_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
-#include "CompressedWriter.h"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+
+#include "BufferPool.h"
+#include "util.h"
+
+typedef CompressedWriter::BlockIndexEntry BlockIndexEntry;
 
 CompressedReader::CompressedReader(const std::string& filename)
-    : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)) {
+    : source(StreamSource::open(filename)) {
   fd_offset = 0;
-  error = !fd->is_open();
+  error = !source->is_open();
   eof = false;
   buffer_read_pos = 0;
+  buffer_start_offset = 0;
+  mapped_data = nullptr;
+  mapped_size = 0;
   have_saved_state = false;
+  block_cache = std::make_shared<BlockCache>();
+  map_unpacked();
+  load_block_index(filename);
 }
 
 CompressedReader::CompressedReader(const CompressedReader& other) {
-  fd = other.fd;
+  source = other.source;
   fd_offset = other.fd_offset;
   error = other.error;
   eof = other.eof;
   buffer_read_pos = other.buffer_read_pos;
+  buffer_start_offset = other.buffer_start_offset;
   buffer = other.buffer;
+  block_index = other.block_index;
+  read_ahead = other.read_ahead;
+  block_cache = other.block_cache;
+  mapping = other.mapping;
+  mapped_data = other.mapped_data;
+  mapped_size = other.mapped_size;
   have_saved_state = false;
   assert(!other.have_saved_state);
 }
 
 CompressedReader::~CompressedReader() { close(); }
 
-static bool read_all(const ScopedFd& fd, size_t size, void* data,
+static bool read_all(StreamSource& source, size_t size, void* data,
                      uint64_t* offset) {
   while (size > 0) {
-    ssize_t result = pread(fd, data, size, *offset);
+    ssize_t result = source.read_at(data, size, *offset);
     if (result <= 0) {
       return false;
     }
@@ -53,8 +82,8 @@ static bool read_all(const ScopedFd& fd, size_t size, void* data,
   return true;
 }
 
-static bool do_decompress(std::vector<uint8_t>& compressed,
-                          std::vector<uint8_t>& uncompressed) {
+static bool do_decompress_zlib(std::vector<uint8_t>& compressed,
+                               std::vector<uint8_t>& uncompressed) {
   z_stream stream;
   memset(&stream, 0, sizeof(stream));
   int result = inflateInit(&stream);
@@ -82,63 +111,566 @@ static bool do_decompress(std::vector<uint8_t>& compressed,
   return true;
 }
 
+static bool do_decompress(uint32_t codec, std::vector<uint8_t>& compressed,
+                          std::vector<uint8_t>& uncompressed) {
+  switch (codec) {
+    case CompressedWriter::CODEC_ZLIB:
+      return do_decompress_zlib(compressed, uncompressed);
+#ifdef RR_HAVE_LZ4
+    case CompressedWriter::CODEC_LZ4: {
+      int result = LZ4_decompress_safe(
+          reinterpret_cast<const char*>(compressed.data()),
+          reinterpret_cast<char*>(uncompressed.data()), compressed.size(),
+          uncompressed.size());
+      if (result < 0 || (size_t)result != uncompressed.size()) {
+        assert(0 && "LZ4_decompress_safe failed!");
+        return false;
+      }
+      return true;
+    }
+#endif
+#ifdef RR_HAVE_ZSTD
+    case CompressedWriter::CODEC_ZSTD: {
+      size_t result =
+          ZSTD_decompress(uncompressed.data(), uncompressed.size(),
+                          compressed.data(), compressed.size());
+      if (ZSTD_isError(result) || result != uncompressed.size()) {
+        assert(0 && "ZSTD_decompress failed!");
+        return false;
+      }
+      return true;
+    }
+#endif
+    default:
+      // Recorded by an rr built with a codec we don't have.
+      return false;
+  }
+}
+
+/**
+ * Read and decompress the block at |*offset| into |uncompressed|, and
+ * advance |*offset| past it.
+ */
+static bool read_block(StreamSource& source, uint64_t* offset,
+                       std::vector<uint8_t>& uncompressed) {
+  CompressedWriter::BlockHeader header;
+  if (!read_all(source, sizeof(header), &header, offset)) {
+    return false;
+  }
+
+  std::vector<uint8_t> compressed_buf;
+  BufferPool::get(compressed_buf, header.compressed_length);
+  bool ok =
+      read_all(source, compressed_buf.size(), &compressed_buf[0], offset) &&
+      crc32c(0, compressed_buf.data(), compressed_buf.size()) ==
+          header.checksum;
+  if (ok) {
+    BufferPool::get(uncompressed, header.uncompressed_length);
+    ok = do_decompress(header.codec, compressed_buf, uncompressed);
+  }
+  BufferPool::put(compressed_buf);
+  return ok;
+}
+
+/**
+ * Decompresses blocks on background threads ahead of the reader(s) that
+ * share it. Blocks are identified by their offset in the compressed file,
+ * so copies of a CompressedReader at different positions can share one
+ * ReadAhead. Only the thread(s) calling into the readers call request()
+ * and take().
+ */
+class CompressedReader::ReadAhead {
+public:
+  ReadAhead(const std::shared_ptr<StreamSource>& source, uint32_t num_threads,
+            size_t window);
+  ~ReadAhead();
+
+  /* Number of blocks to decompress ahead of a reader */
+  size_t window() const { return window_; }
+
+  /**
+   * Queue the block at |offset| for decompression unless it's already
+   * queued or done.  |reader_offset| is the current position of the
+   * requesting reader; finished blocks before it may be evicted to make
+   * room.  Returns false if there's no room.
+   */
+  bool request(uint64_t offset, uint64_t reader_offset);
+  /**
+   * If the block at |offset| was requested, wait for it to finish
+   * and, if it was decompressed successfully, move it into |buffer|, set
+   * |*next_offset| to the offset of the block after it and return true.
+   * Otherwise return false and the caller must read the block itself.
+   */
+  bool take(uint64_t offset, std::vector<uint8_t>& buffer,
+            uint64_t* next_offset);
+
+private:
+  static void* thread_callback(void* p);
+  void decompress_thread();
+
+  struct Block {
+    ~Block() { BufferPool::put(data); }
+    enum State {
+      QUEUED,
+      BUSY,
+      DONE,
+      FAILED
+    } state;
+    std::vector<uint8_t> data;
+    uint64_t next_offset;
+  };
+
+  // Immutable while threads are running
+  std::shared_ptr<StreamSource> source;
+  size_t window_;
+  std::vector<pthread_t> threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  // BEGIN protected by 'mutex'
+  std::map<uint64_t, Block> blocks;
+  std::deque<uint64_t> queue;
+  bool closing;
+  // END protected by 'mutex'
+};
+
+CompressedReader::ReadAhead::ReadAhead(
+    const std::shared_ptr<StreamSource>& source, uint32_t num_threads,
+    size_t window)
+    : source(source), window_(window), closing(false) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  threads.resize(num_threads);
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    pthread_create(&threads[i], nullptr, thread_callback, this);
+    pthread_setname_np(threads[i], "decompress");
+  }
+}
+
+CompressedReader::ReadAhead::~ReadAhead() {
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  for (auto i = threads.begin(); i != threads.end(); ++i) {
+    pthread_join(*i, nullptr);
+  }
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+void* CompressedReader::ReadAhead::thread_callback(void* p) {
+  bind_helper_thread();
+  static_cast<ReadAhead*>(p)->decompress_thread();
+  return nullptr;
+}
+
+void CompressedReader::ReadAhead::decompress_thread() {
+  pthread_mutex_lock(&mutex);
+  while (!closing) {
+    if (queue.empty()) {
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+    uint64_t offset = queue.front();
+    queue.pop_front();
+    // Blocks in the BUSY state are never erased, so |block| stays valid
+    // while we work on it unlocked.
+    Block& block = blocks[offset];
+    block.state = Block::BUSY;
+    pthread_mutex_unlock(&mutex);
+
+    uint64_t next_offset = offset;
+    std::vector<uint8_t> data;
+    bool ok = read_block(*source, &next_offset, data);
+
+    pthread_mutex_lock(&mutex);
+    block.state = ok ? Block::DONE : Block::FAILED;
+    block.data.swap(data);
+    block.next_offset = next_offset;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+bool CompressedReader::ReadAhead::request(uint64_t offset,
+                                          uint64_t reader_offset) {
+  pthread_mutex_lock(&mutex);
+  bool ok = true;
+  if (!blocks.count(offset)) {
+    // Leave room for the windows of a couple of readers; beyond that,
+    // evict blocks older readers have passed, or give up.
+    size_t max_blocks = window_ * 2;
+    for (auto it = blocks.begin();
+         blocks.size() >= max_blocks && it != blocks.end() &&
+             it->first < reader_offset;) {
+      if (it->second.state == Block::DONE ||
+          it->second.state == Block::FAILED) {
+        it = blocks.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (blocks.size() < max_blocks) {
+      blocks[offset].state = Block::QUEUED;
+      queue.push_back(offset);
+      pthread_cond_signal(&cond);
+    } else {
+      ok = false;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+bool CompressedReader::ReadAhead::take(uint64_t offset,
+                                       std::vector<uint8_t>& buffer,
+                                       uint64_t* next_offset) {
+  pthread_mutex_lock(&mutex);
+  auto it = blocks.find(offset);
+  if (it == blocks.end()) {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  while (it->second.state == Block::QUEUED ||
+         it->second.state == Block::BUSY) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  bool ok = it->second.state == Block::DONE;
+  if (ok) {
+    buffer.swap(it->second.data);
+    *next_offset = it->second.next_offset;
+  }
+  blocks.erase(it);
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+/**
+ * Finds the blocks decompressed by any of the readers that share it, by
+ * their offset in the compressed file.  Blocks stay findable while some
+ * reader uses them, and the most recently loaded ones stay alive for a
+ * while after that.
+ */
+class CompressedReader::BlockCache {
+public:
+  BlockCache() : sweep_size(RECENT_BLOCKS) {
+    pthread_mutex_init(&mutex, nullptr);
+  }
+  ~BlockCache() { pthread_mutex_destroy(&mutex); }
+
+  std::shared_ptr<const Block> find(uint64_t offset) {
+    pthread_mutex_lock(&mutex);
+    std::shared_ptr<const Block> block;
+    auto it = blocks.find(offset);
+    if (it != blocks.end()) {
+      block = it->second.lock();
+    }
+    pthread_mutex_unlock(&mutex);
+    return block;
+  }
+
+  void insert(uint64_t offset, const std::shared_ptr<const Block>& block) {
+    pthread_mutex_lock(&mutex);
+    blocks[offset] = block;
+    recent.push_back(block);
+    if (recent.size() > RECENT_BLOCKS) {
+      recent.pop_front();
+    }
+    if (blocks.size() > 2 * sweep_size) {
+      for (auto it = blocks.begin(); it != blocks.end();) {
+        if (it->second.expired()) {
+          it = blocks.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      sweep_size = std::max(blocks.size(), size_t(RECENT_BLOCKS));
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+private:
+  /* The number of blocks kept alive after readers are done with them */
+  static const size_t RECENT_BLOCKS = 8;
+
+  pthread_mutex_t mutex;
+  // BEGIN protected by 'mutex'
+  std::map<uint64_t, std::weak_ptr<const Block> > blocks;
+  std::deque<std::shared_ptr<const Block> > recent;
+  /* The number of entries in |blocks| after the last sweep of expired
+     ones */
+  size_t sweep_size;
+  // END protected by 'mutex'
+};
+
+void CompressedReader::map_unpacked() {
+  UnpackedHeader header;
+  uint64_t offset = 0;
+  if (error || !read_all(*source, sizeof(header), &header, &offset) ||
+      header.magic != UNPACKED_MAGIC) {
+    return;
+  }
+  // Unpacked streams are only read from local files.
+  if (source->local_fd() < 0 ||
+      source->size() != UNPACKED_DATA_OFFSET + header.uncompressed_length) {
+    error = true;
+    return;
+  }
+  size_t length = source->size();
+  void* p =
+      mmap(nullptr, length, PROT_READ, MAP_SHARED, source->local_fd(), 0);
+  if (p == MAP_FAILED) {
+    error = true;
+    return;
+  }
+  mapping = std::shared_ptr<void>(p, [length](void* p) { munmap(p, length); });
+  mapped_data = static_cast<const uint8_t*>(p) + UNPACKED_DATA_OFFSET;
+  mapped_size = header.uncompressed_length;
+  eof = true;
+}
+
 bool CompressedReader::read(void* data, size_t size) {
+  if (mapped_data) {
+    if (error || size > mapped_size - buffer_read_pos) {
+      error = true;
+      return false;
+    }
+    memcpy(data, mapped_data + buffer_read_pos, size);
+    buffer_read_pos += size;
+    return true;
+  }
+
   while (size > 0) {
     if (error) {
       return false;
     }
 
-    if (buffer_read_pos < buffer.size()) {
-      size_t amount = std::min(size, buffer.size() - buffer_read_pos);
-      memcpy(data, &buffer[buffer_read_pos], amount);
+    if (buffer_read_pos < buffer_size()) {
+      size_t amount = std::min(size, buffer_size() - buffer_read_pos);
+      memcpy(data, &buffer->data[buffer_read_pos], amount);
       size -= amount;
       data = static_cast<char*>(data) + amount;
       buffer_read_pos += amount;
       continue;
     }
 
+    buffer_start_offset += buffer_size();
     if (have_saved_state && !have_saved_buffer) {
       std::swap(buffer, saved_buffer);
       have_saved_buffer = true;
     }
 
-    CompressedWriter::BlockHeader header;
-    if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
-      error = true;
+    if (!load_next_block()) {
       return false;
     }
+  }
+  return true;
+}
 
-    std::vector<uint8_t> compressed_buf;
-    compressed_buf.resize(header.compressed_length);
-    if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
-      error = true;
-      return false;
+CompressedReader::Block::~Block() { BufferPool::put(data); }
+
+bool CompressedReader::load_next_block() {
+  buffer = block_cache->find(fd_offset);
+  if (buffer) {
+    fd_offset = buffer->next_offset;
+  } else {
+    auto block = std::make_shared<Block>();
+    uint64_t offset = fd_offset;
+    block->next_offset = fd_offset;
+    if (!read_ahead ||
+        !read_ahead->take(offset, block->data, &block->next_offset)) {
+      if (!read_block(*source, &block->next_offset, block->data)) {
+        error = true;
+        return false;
+      }
     }
+    fd_offset = block->next_offset;
+    buffer = block;
+    block_cache->insert(offset, buffer);
+  }
 
-    char ch;
-    if (pread(*fd, &ch, 1, fd_offset) == 0) {
-      eof = true;
+  if (fd_offset >= source->size()) {
+    eof = true;
+  }
+
+  buffer_read_pos = 0;
+  schedule_read_ahead();
+  return true;
+}
+
+void CompressedReader::schedule_read_ahead() {
+  if (!read_ahead || eof) {
+    return;
+  }
+  // Request the blocks following the current one. Use the block index
+  // to find them if we have it; otherwise read their headers.
+  auto indexed = std::lower_bound(
+      block_index->begin(), block_index->end(), fd_offset,
+      [](const BlockIndexEntry& e, uint64_t o) {
+        return e.compressed_offset < o;
+      });
+  bool use_index =
+      indexed != block_index->end() && indexed->compressed_offset == fd_offset;
+  uint64_t offset = fd_offset;
+  for (size_t i = 0; i < read_ahead->window(); ++i) {
+    if (use_index) {
+      if (indexed == block_index->end()) {
+        return;
+      }
+      offset = indexed->compressed_offset;
+      ++indexed;
+      if (!read_ahead->request(offset, fd_offset)) {
+        return;
+      }
+      continue;
     }
 
-    buffer.resize(header.uncompressed_length);
-    buffer_read_pos = 0;
-    if (!do_decompress(compressed_buf, buffer)) {
-      error = true;
-      return false;
+    CompressedWriter::BlockHeader header;
+    uint64_t header_end = offset;
+    if (!read_all(*source, sizeof(header), &header, &header_end) ||
+        !read_ahead->request(offset, fd_offset)) {
+      return;
     }
+    offset = header_end + header.compressed_length;
   }
-  return true;
+}
+
+void CompressedReader::start_read_ahead(uint32_t num_threads,
+                                        size_t num_blocks) {
+  assert(!read_ahead);
+  if (error || mapped_data || num_threads == 0 || num_blocks == 0) {
+    return;
+  }
+  read_ahead = std::make_shared<ReadAhead>(source, num_threads, num_blocks);
+  schedule_read_ahead();
 }
 
 void CompressedReader::rewind() {
   assert(!have_saved_state);
   fd_offset = 0;
   buffer_read_pos = 0;
-  buffer.clear();
+  buffer_start_offset = 0;
+  buffer = nullptr;
+  // Unpacked streams are always "at the last block".
+  eof = mapped_data != nullptr;
+}
+
+void CompressedReader::load_block_index(const std::string& filename) {
+  auto entries = std::make_shared<std::vector<BlockIndexEntry> >();
+  block_index = entries;
+  if (error) {
+    return;
+  }
+  auto index = StreamSource::open(CompressedWriter::index_path(filename));
+  if (!index->is_open()) {
+    // Traces from interrupted recordings have no index.
+    return;
+  }
+  uint64_t size = index->size();
+  if (size % sizeof(BlockIndexEntry)) {
+    return;
+  }
+  entries->resize(size / sizeof(BlockIndexEntry));
+  uint64_t offset = 0;
+  if (!entries->empty() &&
+      !read_all(*index, size, entries->data(), &offset)) {
+    entries->clear();
+  }
+}
+
+bool CompressedReader::seek_to_block(size_t block) {
+  assert(!have_saved_state);
+  if (error || block >= block_index->size()) {
+    return false;
+  }
+  const BlockIndexEntry& entry = (*block_index)[block];
+  fd_offset = entry.compressed_offset;
+  buffer_start_offset = entry.uncompressed_offset;
+  buffer = nullptr;
+  buffer_read_pos = 0;
   eof = false;
+  return load_next_block();
 }
 
-void CompressedReader::close() { fd = nullptr; }
+bool CompressedReader::seek(uint64_t offset) {
+  assert(!have_saved_state);
+  if (error) {
+    return false;
+  }
+  if (mapped_data) {
+    if (offset > mapped_size) {
+      return false;
+    }
+    buffer_read_pos = offset;
+    return true;
+  }
+  if (buffer_start_offset <= offset &&
+      offset - buffer_start_offset <= buffer_size()) {
+    buffer_read_pos = offset - buffer_start_offset;
+    return true;
+  }
+
+  // Find the last block starting at or before |offset|. Without an index,
+  // start from the current block if that's not past |offset|.
+  uint64_t block_fd_offset = 0;
+  uint64_t block_start = 0;
+  if (!block_index->empty()) {
+    auto it = std::upper_bound(
+        block_index->begin(), block_index->end(), offset,
+        [](uint64_t o, const BlockIndexEntry& e) {
+          return o < e.uncompressed_offset;
+        });
+    assert(it != block_index->begin());
+    --it;
+    block_fd_offset = it->compressed_offset;
+    block_start = it->uncompressed_offset;
+  } else if (buffer_start_offset + buffer_size() <= offset) {
+    block_fd_offset = fd_offset;
+    block_start = buffer_start_offset + buffer_size();
+  }
+
+  // Walk block headers until we find the block containing |offset|.
+  while (true) {
+    CompressedWriter::BlockHeader header;
+    uint64_t header_offset = block_fd_offset;
+    if (!read_all(*source, sizeof(header), &header, &header_offset)) {
+      if (block_start != offset) {
+        return false;
+      }
+      // Seeking to the very end of the stream.
+      fd_offset = block_fd_offset;
+      buffer_start_offset = block_start;
+      buffer = nullptr;
+      buffer_read_pos = 0;
+      eof = true;
+      return true;
+    }
+    if (offset < block_start + header.uncompressed_length) {
+      break;
+    }
+    block_fd_offset = header_offset + header.compressed_length;
+    block_start += header.uncompressed_length;
+  }
+
+  fd_offset = block_fd_offset;
+  buffer_start_offset = block_start;
+  buffer = nullptr;
+  eof = false;
+  if (!load_next_block()) {
+    return false;
+  }
+  buffer_read_pos = offset - block_start;
+  return true;
+}
+
+void CompressedReader::close() {
+  read_ahead = nullptr;
+  mapping = nullptr;
+  mapped_data = nullptr;
+  source = nullptr;
+}
 
 void CompressedReader::save_state() {
   assert(!have_saved_state);
@@ -146,6 +678,7 @@ void CompressedReader::save_state() {
   have_saved_buffer = false;
   saved_fd_offset = fd_offset;
   saved_buffer_read_pos = buffer_read_pos;
+  saved_buffer_start_offset = buffer_start_offset;
 }
 
 void CompressedReader::restore_state() {
@@ -157,16 +690,27 @@ void CompressedReader::restore_state() {
   fd_offset = saved_fd_offset;
   if (have_saved_buffer) {
     std::swap(buffer, saved_buffer);
-    saved_buffer.clear();
+    saved_buffer = nullptr;
   }
   buffer_read_pos = saved_buffer_read_pos;
+  buffer_start_offset = saved_buffer_start_offset;
+}
+
+void CompressedReader::discard_state() {
+  assert(have_saved_state);
+  have_saved_state = false;
+  have_saved_buffer = false;
+  saved_buffer = nullptr;
 }
 
 uint64_t CompressedReader::uncompressed_bytes() const {
+  if (mapped_data) {
+    return mapped_size;
+  }
   uint64_t offset = 0;
   uint64_t uncompressed_bytes = 0;
   CompressedWriter::BlockHeader header;
-  while (read_all(*fd, sizeof(header), &header, &offset)) {
+  while (read_all(*source, sizeof(header), &header, &offset)) {
     uncompressed_bytes += header.uncompressed_length;
     offset += header.compressed_length;
   }
@@ -174,5 +718,237 @@ uint64_t CompressedReader::uncompressed_bytes() const {
 }
 
 uint64_t CompressedReader::compressed_bytes() const {
-  return lseek(*fd, 0, SEEK_END);
+  return source->size();
+}
+
+static bool write_all(const ScopedFd& fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t result = write(fd, data, size);
+    if (result <= 0) {
+      return false;
+    }
+    size -= result;
+    data = static_cast<const uint8_t*>(data) + result;
+  }
+  return true;
+}
+
+bool CompressedReader::unpack(const std::string& filename) {
+  CompressedReader in(filename);
+  std::string tmp = filename + ".tmp";
+  ScopedFd out(tmp.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_TRUNC, 0400);
+  if (!in.good() || !out.is_open()) {
+    return false;
+  }
+
+  UnpackedHeader header = { UNPACKED_MAGIC, 0, 0 };
+  std::vector<uint8_t> buf(UNPACKED_DATA_OFFSET);
+  bool ok = write_all(out, buf.data(), buf.size());
+  buf.resize(1024 * 1024);
+  uint64_t total = in.uncompressed_bytes();
+  while (ok && in.uncompressed_offset() < total) {
+    size_t amount =
+        std::min<uint64_t>(buf.size(), total - in.uncompressed_offset());
+    ok = in.read(buf.data(), amount) && write_all(out, buf.data(), amount);
+    header.uncompressed_length += amount;
+  }
+  ok = ok && pwrite(out, &header, sizeof(header), 0) == sizeof(header);
+  if (!ok || rename(tmp.c_str(), filename.c_str())) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  unlink(CompressedWriter::index_path(filename).c_str());
+  return true;
+}
+
+bool CompressedReader::pack(const std::string& filename,
+                            CompressedWriter::Codec codec, size_t block_size,
+                            uint32_t num_threads) {
+  CompressedReader in(filename);
+  std::string tmp = filename + ".tmp";
+  unlink(tmp.c_str());
+  unlink(CompressedWriter::index_path(tmp).c_str());
+  bool ok = in.good();
+  {
+    CompressedWriter out(tmp, block_size, num_threads, codec);
+    std::vector<uint8_t> buf(1024 * 1024);
+    uint64_t total = in.uncompressed_bytes();
+    while (ok && out.good() && in.uncompressed_offset() < total) {
+      size_t amount =
+          std::min<uint64_t>(buf.size(), total - in.uncompressed_offset());
+      ok = in.read(buf.data(), amount);
+      out.write(buf.data(), amount);
+    }
+    out.close();
+    ok = ok && out.good();
+  }
+  std::string index = CompressedWriter::index_path(filename);
+  std::string tmp_index = CompressedWriter::index_path(tmp);
+  if (!ok || rename(tmp.c_str(), filename.c_str())) {
+    unlink(tmp.c_str());
+    unlink(tmp_index.c_str());
+    return false;
+  }
+  if (rename(tmp_index.c_str(), index.c_str())) {
+    // Readers cope without an index, but not with a stale one.
+    unlink(index.c_str());
+  }
+  return true;
+}
+
+namespace {
+
+/**
+ * The payload of one block, as CompressedReader::verify() checks it.
+ */
+struct BlockPayload {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t checksum;
+};
+
+/**
+ * The state shared by the threads checking the payloads of a stream's
+ * blocks in CompressedReader::verify().
+ */
+struct VerifyBlocks {
+  StreamSource* source;
+  const std::vector<BlockPayload>* payloads;
+  pthread_mutex_t mutex;
+  // BEGIN protected by 'mutex'
+  size_t next;
+  // The first payload found to be broken, or payloads->size()
+  size_t first_bad;
+  // END protected by 'mutex'
+};
+
+} // anonymous namespace
+
+/**
+ * Check the payloads handed out by |p|, a VerifyBlocks, until there are
+ * none left.
+ */
+static void* verify_blocks_thread(void* p) {
+  VerifyBlocks* v = static_cast<VerifyBlocks*>(p);
+  std::vector<uint8_t> buf;
+  while (true) {
+    pthread_mutex_lock(&v->mutex);
+    size_t i = v->next++;
+    pthread_mutex_unlock(&v->mutex);
+    if (i >= v->payloads->size()) {
+      return nullptr;
+    }
+    const BlockPayload& payload = (*v->payloads)[i];
+    uint64_t offset = payload.offset;
+    buf.resize(payload.length);
+    if (!read_all(*v->source, buf.size(), buf.data(), &offset) ||
+        crc32c(0, buf.data(), buf.size()) != payload.checksum) {
+      pthread_mutex_lock(&v->mutex);
+      v->first_bad = std::min(v->first_bad, i);
+      pthread_mutex_unlock(&v->mutex);
+    }
+  }
+}
+
+bool CompressedReader::verify(const std::string& filename,
+                              uint32_t num_threads,
+                              uint64_t* uncompressed_bytes,
+                              std::string* problem) {
+  auto source = StreamSource::open(filename);
+  if (!source->is_open()) {
+    *problem = "missing";
+    return false;
+  }
+  uint64_t size = source->size();
+
+  UnpackedHeader unpacked;
+  uint64_t offset = 0;
+  if (read_all(*source, sizeof(unpacked), &unpacked, &offset) &&
+      unpacked.magic == UNPACKED_MAGIC) {
+    if (size != UNPACKED_DATA_OFFSET + unpacked.uncompressed_length) {
+      *problem = "unpacked stream has the wrong size";
+      return false;
+    }
+    *uncompressed_bytes = unpacked.uncompressed_length;
+    return true;
+  }
+
+  // Walk the headers, which must tile the file exactly.
+  std::vector<BlockIndexEntry> blocks;
+  std::vector<BlockPayload> payloads;
+  offset = 0;
+  uint64_t uncompressed = 0;
+  while (offset < size) {
+    CompressedWriter::BlockHeader header;
+    uint64_t header_end = offset;
+    if (!read_all(*source, sizeof(header), &header, &header_end) ||
+        header.compressed_length > size - header_end) {
+      *problem = "truncated in block " + std::to_string(blocks.size()) +
+                 " at offset " + std::to_string(offset);
+      return false;
+    }
+    if (header.codec != CompressedWriter::CODEC_DISCARDED &&
+        !CompressedWriter::codec_supported(
+            (CompressedWriter::Codec)header.codec)) {
+      *problem = "unknown codec " + std::to_string(header.codec) +
+                 " in block " + std::to_string(blocks.size());
+      return false;
+    }
+    BlockIndexEntry entry = { offset, uncompressed };
+    blocks.push_back(entry);
+    // Discarded blocks have no payload left to check.
+    if (header.codec != CompressedWriter::CODEC_DISCARDED) {
+      BlockPayload payload = { header_end, header.compressed_length,
+                               header.checksum };
+      payloads.push_back(payload);
+    }
+    uncompressed += header.uncompressed_length;
+    offset = header_end + header.compressed_length;
+  }
+
+  // The index, if there is one, must list exactly these blocks.
+  auto index = StreamSource::open(CompressedWriter::index_path(filename));
+  if (index->is_open()) {
+    std::vector<BlockIndexEntry> entries(index->size() /
+                                         sizeof(BlockIndexEntry));
+    uint64_t index_offset = 0;
+    if (index->size() != blocks.size() * sizeof(BlockIndexEntry) ||
+        (!entries.empty() &&
+         !read_all(*index, index->size(), entries.data(), &index_offset))) {
+      *problem = "block index doesn't match the blocks";
+      return false;
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      if (entries[i].compressed_offset != blocks[i].compressed_offset ||
+          entries[i].uncompressed_offset != blocks[i].uncompressed_offset) {
+        *problem = "block index entry " + std::to_string(i) +
+                   " doesn't match its block";
+        return false;
+      }
+    }
+  }
+
+  VerifyBlocks v;
+  v.source = source.get();
+  v.payloads = &payloads;
+  pthread_mutex_init(&v.mutex, nullptr);
+  v.next = 0;
+  v.first_bad = payloads.size();
+  std::vector<pthread_t> threads(
+      std::max<size_t>(1, std::min<size_t>(num_threads, payloads.size())));
+  for (auto& t : threads) {
+    pthread_create(&t, nullptr, verify_blocks_thread, &v);
+  }
+  for (auto& t : threads) {
+    pthread_join(t, nullptr);
+  }
+  pthread_mutex_destroy(&v.mutex);
+  if (v.first_bad < payloads.size()) {
+    *problem = "checksum mismatch in the block at offset " +
+               std::to_string(payloads[v.first_bad].offset -
+                              sizeof(CompressedWriter::BlockHeader));
+    return false;
+  }
+  *uncompressed_bytes = uncompressed;
+  return true;
 }
@@ -10,12 +10,30 @@
 #include <vector>
 #include <string>
 
-#include "ScopedFd.h"
+#include "CompressedWriter.h"
+#include "StreamSource.h"
 
 /**
  * CompressedReader opens an input file written by CompressedWriter
  * and reads data from it. Currently data is decompressed by the thread that
- * calls read().
+ * calls read(). The file may be fetched from elsewhere on demand; see
+ * StreamSource.
+ *
+ * If the writer's block index is present, seek() uses it to jump straight to
+ * the block containing the target offset. Otherwise seek() walks the block
+ * headers, which still avoids decompressing the skipped blocks.
+ *
+ * start_read_ahead() optionally moves decompression onto background threads
+ * that work on the blocks following the current read position.
+ *
+ * Decompressed blocks are immutable and shared between copies of a reader:
+ * a copy starts out sharing the original's current block, and a block one
+ * copy has decompressed (and that's still in use, or recently used) isn't
+ * decompressed again by another.
+ *
+ * A stream can also be stored "unpacked" (see unpack()): an UnpackedHeader
+ * followed by the uncompressed data at offset UNPACKED_DATA_OFFSET. Readers
+ * mmap unpacked streams and copy straight out of the mapping.
  */
 class CompressedReader {
 public:
@@ -23,13 +41,47 @@ public:
   CompressedReader(const CompressedReader& aOther);
   ~CompressedReader();
   bool good() const { return !error; }
-  bool at_end() const { return eof && buffer_read_pos == buffer.size(); }
+  bool at_end() const {
+    return eof &&
+           buffer_read_pos == (mapped_data ? mapped_size : buffer_size());
+  }
   // Returns true if successful. Otherwise there's an error and good()
   // will be false.
   bool read(void* data, size_t size);
   void rewind();
   void close();
 
+  /**
+   * Return the offset in the uncompressed stream of the next byte that
+   * read() will return.
+   */
+  uint64_t uncompressed_offset() const {
+    return buffer_start_offset + buffer_read_pos;
+  }
+  /**
+   * Position the stream so that the next read() returns the byte at
+   * uncompressed offset 'offset'. Returns false if 'offset' is past the end
+   * of the stream; the stream position is then unchanged. Must not be called
+   * while there is saved state.
+   */
+  bool seek(uint64_t offset);
+  /**
+   * Position the stream at the start of block number 'block', as numbered
+   * by the block index. Returns false if there is no such block.
+   */
+  bool seek_to_block(size_t block);
+  /**
+   * Return true if the writer's block index was found and is usable.
+   */
+  bool has_block_index() const { return !block_index->empty(); }
+
+  /**
+   * Start |num_threads| background threads that decompress up to
+   * |num_blocks| blocks ahead of the current read position. Copies of this
+   * reader made afterwards share the threads and the decompressed blocks.
+   */
+  void start_read_ahead(uint32_t num_threads, size_t num_blocks);
+
   /**
    * Save the current position. Nested saves are not allowed.
    */
@@ -38,6 +90,52 @@ public:
    * Restore previously saved position.
    */
   void restore_state();
+  /**
+   * Forget the previously saved position.
+   */
+  void discard_state();
+
+  /**
+   * Return true if the stream is unpacked and mapped into memory.
+   */
+  bool is_mapped() const { return mapped_data != nullptr; }
+
+  struct UnpackedHeader {
+    /* UNPACKED_MAGIC. Never a valid BlockHeader::compressed_length. */
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t uncompressed_length;
+  };
+  enum {
+    UNPACKED_MAGIC = 0x50557272,
+    UNPACKED_DATA_OFFSET = 4096
+  };
+
+  /**
+   * Rewrite the stream 'filename' unpacked, replacing the file and
+   * removing its block index. Returns false on error, in which case the
+   * file is unchanged.
+   */
+  static bool unpack(const std::string& filename);
+  /**
+   * Rewrite the stream 'filename' (packed or not) compressed with 'codec',
+   * as a CompressedWriter with the given parameters would have written it.
+   * Returns false on error, in which case the file is unchanged.
+   */
+  static bool pack(const std::string& filename, CompressedWriter::Codec codec,
+                   size_t block_size, uint32_t num_threads);
+
+  /**
+   * Check the stream 'filename' without decompressing it: that its block
+   * headers tile the file exactly, that each block's compressed data
+   * matches the CRC-32C in its header and that its block index, if it
+   * has one, lists exactly its blocks. The blocks are checked on
+   * 'num_threads' threads. Returns false and describes the first problem
+   * found in '*problem' if the stream is broken; otherwise sets
+   * '*uncompressed_bytes' to the size of the uncompressed stream.
+   */
+  static bool verify(const std::string& filename, uint32_t num_threads,
+                     uint64_t* uncompressed_bytes, std::string* problem);
 
   /**
    * Gathers stats on the file stream. These are independent of what's
@@ -47,21 +145,55 @@ public:
   uint64_t compressed_bytes() const;
 
 protected:
-  /* Our fd might be the dup of another fd, so we can't rely on its current file
-     position.
-     Instead track the current position in fd_offset and use pread. */
+  class ReadAhead;
+  class BlockCache;
+
+  struct Block {
+    ~Block();
+    std::vector<uint8_t> data;
+    /* Offset in the compressed file of the block after this one */
+    uint64_t next_offset;
+  };
+
+  size_t buffer_size() const { return buffer ? buffer->data.size() : 0; }
+
+  void load_block_index(const std::string& filename);
+  void map_unpacked();
+  bool load_next_block();
+  void schedule_read_ahead();
+
+  /* Our source is shared with copies of this reader, so we can't rely on a
+     file position.
+     Instead track the current position in fd_offset and use read_at. */
   uint64_t fd_offset;
-  std::shared_ptr<ScopedFd> fd;
+  std::shared_ptr<StreamSource> source;
   bool error;
   bool eof;
-  std::vector<uint8_t> buffer;
+  /* The current block, or null */
+  std::shared_ptr<const Block> buffer;
   size_t buffer_read_pos;
+  /* Offset in the uncompressed stream of buffer[0] */
+  uint64_t buffer_start_offset;
+  /* Shared between copies of this reader; immutable once loaded */
+  std::shared_ptr<const std::vector<CompressedWriter::BlockIndexEntry> >
+      block_index;
+  /* Shared between copies of this reader, or null */
+  std::shared_ptr<ReadAhead> read_ahead;
+  /* Shared between copies of this reader */
+  std::shared_ptr<BlockCache> block_cache;
+  /* For unpacked streams, the mapped file, shared between copies of
+     this reader. In this mode |buffer| is unused and |buffer_read_pos| is
+     the offset of the next byte in the uncompressed data. */
+  std::shared_ptr<void> mapping;
+  const uint8_t* mapped_data;
+  size_t mapped_size;
 
   bool have_saved_state;
   bool have_saved_buffer;
   uint64_t saved_fd_offset;
-  std::vector<uint8_t> saved_buffer;
+  std::shared_ptr<const Block> saved_buffer;
   size_t saved_buffer_read_pos;
+  uint64_t saved_buffer_start_offset;
 };
 
 #endif /* RR_COMPRESSED_READER_H_ */
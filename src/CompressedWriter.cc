@@ -8,28 +8,124 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "BufferPool.h"
+#include "StreamSource.h"
+#include "util.h"
 
 using namespace std;
 
+#ifdef RR_HAVE_ZSTD
+// Level used for CODEC_ZSTD. High enough to be worth choosing over zlib
+// for archived traces, without being hopelessly slow for recording.
+static const int ZSTD_LEVEL = 12;
+#endif
+
+bool CompressedWriter::codec_supported(Codec codec) {
+  switch (codec) {
+    case CODEC_ZLIB:
+      return true;
+    case CODEC_LZ4:
+#ifdef RR_HAVE_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case CODEC_ZSTD:
+#ifdef RR_HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* CompressedWriter::codec_name(Codec codec) {
+  switch (codec) {
+    case CODEC_ZLIB:
+      return "zlib";
+    case CODEC_LZ4:
+      return "lz4";
+    case CODEC_ZSTD:
+      return "zstd";
+    default:
+      return "???codec";
+  }
+}
+
+bool CompressedWriter::parse_codec(const char* name, Codec* codec) {
+  static const Codec codecs[] = { CODEC_ZLIB, CODEC_LZ4, CODEC_ZSTD };
+  for (Codec c : codecs) {
+    if (!strcmp(name, codec_name(c))) {
+      *codec = c;
+      return true;
+    }
+  }
+  return false;
+}
+
 void* CompressedWriter::compression_thread_callback(void* p) {
+  bind_helper_thread();
   static_cast<CompressedWriter*>(p)->compression_thread();
   return nullptr;
 }
 
+static string base_name(const string& filename) {
+  size_t last_slash = filename.rfind('/');
+  return last_slash == string::npos ? filename
+                                    : filename.substr(last_slash + 1);
+}
+
+/**
+ * Allocate a ring buffer of |size| bytes, which goes back to the
+ * BufferPool when the writer and its threads are done with it.
+ */
+static shared_ptr<vector<uint8_t> > new_ring_buffer(size_t size) {
+  shared_ptr<vector<uint8_t> > buf(new vector<uint8_t>(),
+                                   [](vector<uint8_t>* b) {
+    BufferPool::put(*b);
+    delete b;
+  });
+  BufferPool::get(*buf, size);
+  return buf;
+}
+
 CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
-                                   uint32_t num_threads)
-    : fd(filename.c_str(),
-         O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400) {
+                                   uint32_t num_threads, Codec codec,
+                                   shared_ptr<OutputSink> sink,
+                                   const vector<string>& stripe_dirs)
+    : fd(sink || !stripe_dirs.empty()
+             ? -1
+             : open(filename.c_str(),
+                    O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE,
+                    0400)),
+      filename(filename),
+      sink(sink),
+      sink_name(base_name(filename)),
+      codec(codec) {
+  assert(codec_supported(codec));
   this->block_size = block_size;
   threads.resize(num_threads);
   thread_pos.resize(num_threads);
-  buffer.resize(block_size * (num_threads + 2));
+  max_threads = num_threads;
+  buffer = new_ring_buffer(block_size * (num_threads + 2));
+  blocked_count = 0;
+  blocked_time = 0;
   pthread_mutex_init(&mutex, nullptr);
   pthread_cond_init(&cond, nullptr);
 
@@ -39,14 +135,26 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
   next_thread_pos = 0;
   next_thread_end_pos = 0;
   closing = false;
+  flushing = false;
+  compression_done = false;
+  closed = false;
   write_error = false;
+  next_compressed_pos = 0;
+  written_compressed_pos = 0;
+  discarded_blocks = 0;
+  adaptive = false;
+  level = default_level(codec);
+  producer_waiting = false;
+  output_pos = 0;
 
   producer_reserved_pos = 0;
   producer_reserved_write_pos = 0;
   producer_reserved_upto_pos = 0;
   error = false;
-  if (fd < 0) {
+  if (!sink &&
+      (stripe_dirs.empty() ? fd < 0 : !open_stripes(stripe_dirs))) {
     error = true;
+    closed = true;
     return;
   }
 
@@ -55,13 +163,12 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
   pthread_mutex_lock(&mutex);
   for (uint32_t i = 0; i < num_threads; ++i) {
     pthread_create(&threads[i], nullptr, compression_thread_callback, this);
-    size_t last_slash = filename.rfind('/');
-    string thread_name =
-        string("compress ") + (last_slash == string::npos
-                                   ? filename
-                                   : filename.substr(last_slash + 1));
+    string thread_name = string("compress ") + sink_name;
     pthread_setname_np(threads[i], thread_name.substr(0, 15).c_str());
   }
+  pthread_create(&writer, nullptr, write_thread_callback, this);
+  string writer_name = string("write ") + sink_name;
+  pthread_setname_np(writer, writer_name.substr(0, 15).c_str());
   pthread_mutex_unlock(&mutex);
 }
 
@@ -79,22 +186,53 @@ void CompressedWriter::write(const void* data, size_t size) {
       update_reservation(WAIT);
       continue;
     }
-    size_t buf_offset = (size_t)(producer_reserved_write_pos % buffer.size());
-    size_t amount = min(buffer.size() - buf_offset,
+    vector<uint8_t>& buf = *buffer;
+    size_t buf_offset = (size_t)(producer_reserved_write_pos % buf.size());
+    size_t amount = min(buf.size() - buf_offset,
                         (size_t)min<uint64_t>(reservation_size, size));
-    memcpy(&buffer[buf_offset], data, amount);
+    memcpy(&buf[buf_offset], data, amount);
     producer_reserved_write_pos += amount;
     data = static_cast<const char*>(data) + amount;
     size -= amount;
   }
 
   if (!error && producer_reserved_write_pos - producer_reserved_pos >=
-                    buffer.size() / 2) {
+                    buffer->size() / 2) {
     update_reservation(NOWAIT);
   }
 }
 
-void CompressedWriter::update_reservation(WaitFlag wait_flag) {
+bool CompressedWriter::reserve_write(size_t size, WriteSpan spans[2]) {
+  // Compression threads only hold back a partial block, so the buffer
+  // always frees up enough space for a block's worth of data.
+  assert(size <= (size_t)block_size);
+  if (!error && producer_reserved_upto_pos - producer_reserved_write_pos <
+                    size) {
+    update_reservation(WAIT, size);
+  }
+  if (error) {
+    return false;
+  }
+  vector<uint8_t>& buf = *buffer;
+  size_t buf_offset = (size_t)(producer_reserved_write_pos % buf.size());
+  spans[0].data = &buf[buf_offset];
+  spans[0].size = min(buf.size() - buf_offset, size);
+  spans[1].data = &buf[0];
+  spans[1].size = size - spans[0].size;
+  return true;
+}
+
+void CompressedWriter::commit_write(size_t size) {
+  assert(producer_reserved_write_pos + size <= producer_reserved_upto_pos);
+  producer_reserved_write_pos += size;
+  if (!error && producer_reserved_write_pos - producer_reserved_pos >=
+                    buffer->size() / 2) {
+    update_reservation(NOWAIT);
+  }
+}
+
+void CompressedWriter::update_reservation(WaitFlag wait_flag,
+                                          size_t min_size) {
   pthread_mutex_lock(&mutex);
 
   next_thread_end_pos = producer_reserved_write_pos;
@@ -103,6 +241,7 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   // Wake up threads that might be waiting to consume data.
   pthread_cond_broadcast(&cond);
 
+  double blocked_since = 0;
   while (!error) {
     if (write_error) {
       error = true;
@@ -113,18 +252,129 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
     for (uint32_t i = 0; i < thread_pos.size(); ++i) {
       completed_pos = min(completed_pos, thread_pos[i]);
     }
-    producer_reserved_upto_pos = completed_pos + buffer.size();
-    if (producer_reserved_pos < producer_reserved_upto_pos ||
+    producer_reserved_upto_pos = completed_pos + buffer->size();
+    if (producer_reserved_pos + min_size <= producer_reserved_upto_pos ||
         wait_flag == NOWAIT) {
       break;
     }
 
+    if (!blocked_since) {
+      blocked_since = now();
+      ++blocked_count;
+      producer_waiting = true;
+      // The compression threads can't keep up. Add one, if we're allowed,
+      // with room in the buffer for it to work on.
+      if (threads.size() < max_threads) {
+        grow(completed_pos);
+        continue;
+      }
+    }
     pthread_cond_wait(&cond, &mutex);
   }
+  if (blocked_since) {
+    blocked_time += now() - blocked_since;
+    producer_waiting = false;
+  }
 
   pthread_mutex_unlock(&mutex);
 }
 
+double CompressedWriter::now() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+void CompressedWriter::set_max_threads(uint32_t max_threads) {
+  pthread_mutex_lock(&mutex);
+  this->max_threads = max(max_threads, (uint32_t)threads.size());
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedWriter::set_adaptive_level(bool adaptive) {
+  pthread_mutex_lock(&mutex);
+  this->adaptive = adaptive;
+  pthread_mutex_unlock(&mutex);
+}
+
+int CompressedWriter::default_level(Codec codec) {
+  switch (codec) {
+    case CODEC_ZLIB:
+      return 6;
+#ifdef RR_HAVE_ZSTD
+    case CODEC_ZSTD:
+      return ZSTD_LEVEL;
+#endif
+    default:
+      // LZ4 has no levels.
+      return 0;
+  }
+}
+
+int CompressedWriter::max_level(Codec codec) {
+  switch (codec) {
+    case CODEC_ZLIB:
+      return 9;
+    case CODEC_ZSTD:
+      return 19;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Return the level to compress the block a thread just took at. Called
+ * with |mutex| held.
+ */
+int CompressedWriter::choose_level() {
+  if (!adaptive || codec == CODEC_LZ4) {
+    return level;
+  }
+  uint64_t completed_pos = next_thread_pos;
+  for (uint64_t pos : thread_pos) {
+    completed_pos = min(completed_pos, pos);
+  }
+  // How much of the buffer is waiting for or being compressed, and how
+  // much of that no thread has taken yet.
+  uint64_t occupied = next_thread_end_pos - completed_pos;
+  uint64_t untaken = next_thread_end_pos - next_thread_pos;
+  int min_level = codec_supported(CODEC_LZ4) ? 0 : 1;
+  if (producer_waiting) {
+    // Recording is stalled on us; back off fast.
+    level = max(min_level, level - 2);
+  } else if (occupied > buffer->size() / 2) {
+    level = max(min_level, level - 1);
+  } else if (untaken < (uint64_t)block_size) {
+    // Nothing is queued behind this block: there's time to spare.
+    level = min(max_level(codec), level + 1);
+  }
+  return level;
+}
+
+void CompressedWriter::grow(uint64_t completed_pos) {
+  // Threads that are already compressing keep using the old buffer, so
+  // copy everything they and the producer still need into a new one.
+  auto old_buffer = buffer;
+  size_t old_size = old_buffer->size();
+  auto new_buffer = new_ring_buffer(old_size + block_size);
+  size_t new_size = new_buffer->size();
+  for (uint64_t pos = completed_pos; pos < producer_reserved_write_pos;) {
+    size_t from = (size_t)(pos % old_size);
+    size_t to = (size_t)(pos % new_size);
+    size_t amount = (size_t)min<uint64_t>(
+        min(old_size - from, new_size - to), producer_reserved_write_pos - pos);
+    memcpy(&(*new_buffer)[to], &(*old_buffer)[from], amount);
+    pos += amount;
+  }
+  buffer = new_buffer;
+
+  threads.push_back(pthread_t());
+  thread_pos.push_back(UINT64_MAX);
+  pthread_create(&threads.back(), nullptr, compression_thread_callback, this);
+  string thread_name = string("compress ") + sink_name;
+  pthread_setname_np(threads.back(), thread_name.substr(0, 15).c_str());
+}
+
 void CompressedWriter::compression_thread() {
   pthread_mutex_lock(&mutex);
 
@@ -133,26 +383,45 @@ void CompressedWriter::compression_thread() {
   for (thread_index = 0; threads[thread_index] != self; ++thread_index) {
   }
 
-  // Add slop for incompressible data
+  // Add slop for incompressible data. 10% is more than any of our codecs
+  // needs for blocks bigger than a few hundred bytes.
+  size_t outputbuf_size =
+      (size_t)(block_size * 1.1) + 1024 + sizeof(BlockHeader);
   vector<uint8_t> outputbuf;
-  outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
+  outputbuf.resize(outputbuf_size);
   BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
 
   while (true) {
     if (!write_error && next_thread_pos < next_thread_end_pos &&
-        (closing || next_thread_pos + block_size <= next_thread_end_pos)) {
-      thread_pos[thread_index] = next_thread_pos;
+        (closing || flushing ||
+         next_thread_pos + block_size <= next_thread_end_pos)) {
+      // Hold a reference to the input, in case the producer replaces the
+      // buffer while we're working on it.
+      shared_ptr<const vector<uint8_t> > input = buffer;
+      // |thread_pos| may be reallocated while we're unlocked.
+      uint64_t pos = next_thread_pos;
+      thread_pos[thread_index] = pos;
       next_thread_pos = min(next_thread_end_pos, next_thread_pos + block_size);
       // header->uncompressed_length must be <= block_size,
       // therefore fits in a size_t.
       header->uncompressed_length =
           (size_t)(next_thread_pos - thread_pos[thread_index]);
+      // Each block's header names its codec, so an adaptive writer can
+      // fall back to LZ4 block by block.
+      int block_level = choose_level();
+      Codec block_codec = codec;
+      if (block_level < 1 && codec != CODEC_LZ4) {
+        block_codec = CODEC_LZ4;
+      }
+      header->codec = block_codec;
 
       pthread_mutex_unlock(&mutex);
       header->compressed_length =
-          do_compress(thread_pos[thread_index], header->uncompressed_length,
-                      &outputbuf[sizeof(BlockHeader)],
+          do_compress(*input, pos, header->uncompressed_length, block_codec,
+                      block_level, &outputbuf[sizeof(BlockHeader)],
                       outputbuf.size() - sizeof(BlockHeader));
+      header->checksum = crc32c(0, &outputbuf[sizeof(BlockHeader)],
+                                header->compressed_length);
       pthread_mutex_lock(&mutex);
 
       if (header->compressed_length == 0) {
@@ -173,11 +442,28 @@ void CompressedWriter::compression_thread() {
         pthread_cond_wait(&cond, &mutex);
       }
 
+      // Hand the block to the writer thread, so we can start on the next
+      // block without waiting for the disk. Bound the queue so a slow disk
+      // still pushes back on the producer.
+      while (!write_error && pending_writes.size() > threads.size()) {
+        pthread_cond_wait(&cond, &mutex);
+      }
       if (!write_error) {
-        pthread_mutex_unlock(&mutex);
-        ::write(fd, &outputbuf[0],
-                sizeof(BlockHeader) + header->compressed_length);
-        pthread_mutex_lock(&mutex);
+        BlockIndexEntry entry = { next_compressed_pos,
+                                  thread_pos[thread_index] };
+        block_index.push_back(entry);
+        size_t size = sizeof(BlockHeader) + header->compressed_length;
+        next_compressed_pos += size;
+        pending_writes.push_back(PendingWrite());
+        pending_writes.back().size = size;
+        pending_writes.back().data.swap(outputbuf);
+        if (!free_write_buffers.empty()) {
+          outputbuf.swap(free_write_buffers.back());
+          free_write_buffers.pop_back();
+        } else {
+          outputbuf.resize(outputbuf_size);
+        }
+        header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
       }
 
       thread_pos[thread_index] = UINT64_MAX;
@@ -198,10 +484,68 @@ void CompressedWriter::compression_thread() {
   pthread_mutex_unlock(&mutex);
 }
 
+void* CompressedWriter::write_thread_callback(void* p) {
+  bind_helper_thread();
+  static_cast<CompressedWriter*>(p)->write_thread();
+  return nullptr;
+}
+
+void CompressedWriter::write_thread() {
+  // Where the last block we wrote starts in the file, and its size.
+  uint64_t last_offset = 0;
+  size_t last_size = 0;
+
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    if (!pending_writes.empty()) {
+      PendingWrite w;
+      w.data.swap(pending_writes.front().data);
+      w.size = pending_writes.front().size;
+      pending_writes.pop_front();
+      pthread_mutex_unlock(&mutex);
+
+      bool ok = write_output(w.data.data(), w.size);
+      if (ok && !sink && stripes.empty()) {
+        // Start writeback of this block now, and once the previous block
+        // is on disk drop it from the page cache. Traces are written far
+        // more often than they're read back, and usually much later.
+        uint64_t offset = last_offset + last_size;
+        sync_file_range(fd, offset, w.size, SYNC_FILE_RANGE_WRITE);
+        if (last_size > 0) {
+          sync_file_range(fd, last_offset, last_size,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER);
+          posix_fadvise(fd, last_offset, last_size, POSIX_FADV_DONTNEED);
+        }
+        last_offset = offset;
+        last_size = w.size;
+      }
+
+      pthread_mutex_lock(&mutex);
+      if (!ok) {
+        write_error = true;
+      }
+      written_compressed_pos += w.size;
+      free_write_buffers.push_back(vector<uint8_t>());
+      free_write_buffers.back().swap(w.data);
+      pthread_cond_broadcast(&cond);
+      continue;
+    }
+
+    if (compression_done) {
+      break;
+    }
+
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
 void CompressedWriter::close() {
-  if (!fd.is_open()) {
+  if (closed) {
     return;
   }
+  closed = true;
 
   update_reservation(NOWAIT);
 
@@ -214,14 +558,293 @@ void CompressedWriter::close() {
     pthread_join(*i, nullptr);
   }
 
+  pthread_mutex_lock(&mutex);
+  compression_done = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(writer, nullptr);
+
   fd.close();
+  stripes.clear();
+  write_block_index();
+  sink = nullptr;
+}
+
+bool CompressedWriter::flush() {
+  if (error) {
+    return false;
+  }
+  update_reservation(NOWAIT);
+
+  pthread_mutex_lock(&mutex);
+  flushing = true;
+  pthread_cond_broadcast(&cond);
+  while (!write_error) {
+    bool compressing = next_thread_pos < next_thread_end_pos;
+    for (uint64_t pos : thread_pos) {
+      compressing = compressing || pos != UINT64_MAX;
+    }
+    if (!compressing && written_compressed_pos == next_compressed_pos) {
+      break;
+    }
+    pthread_cond_wait(&cond, &mutex);
+  }
+  flushing = false;
+  if (write_error) {
+    error = true;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (!error && !sink) {
+    if (stripes.empty()) {
+      error = fdatasync(fd) != 0;
+    }
+    for (auto& s : stripes) {
+      error = error || fdatasync(s) != 0;
+    }
+  }
+  return !error;
+}
+
+void CompressedWriter::backlog(uint64_t* uncompressed, uint64_t* compressed) {
+  pthread_mutex_lock(&mutex);
+  // Idle threads' positions are UINT64_MAX.
+  uint64_t compressed_upto = next_thread_pos;
+  for (uint64_t pos : thread_pos) {
+    compressed_upto = min(compressed_upto, pos);
+  }
+  *uncompressed = producer_reserved_write_pos - compressed_upto;
+  *compressed = 0;
+  for (auto& w : pending_writes) {
+    *compressed += w.size;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+bool CompressedWriter::discard(uint64_t start, uint64_t end) {
+  if (error || sink) {
+    return false;
+  }
+  // A block's extent is known once the block after it has been queued.
+  vector<BlockIndexEntry> blocks;
+  pthread_mutex_lock(&mutex);
+  while (discarded_blocks + 1 < block_index.size()) {
+    const BlockIndexEntry& next = block_index[discarded_blocks + 1];
+    if (next.compressed_offset > written_compressed_pos ||
+        next.uncompressed_offset > end) {
+      break;
+    }
+    if (block_index[discarded_blocks].uncompressed_offset >= start) {
+      blocks.push_back(block_index[discarded_blocks]);
+      blocks.push_back(next);
+    }
+    ++discarded_blocks;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < blocks.size(); i += 2) {
+    BlockHeader header;
+    header.compressed_length = blocks[i + 1].compressed_offset -
+                               blocks[i].compressed_offset - sizeof(header);
+    header.uncompressed_length =
+        blocks[i + 1].uncompressed_offset - blocks[i].uncompressed_offset;
+    header.codec = CODEC_DISCARDED;
+    header.checksum = 0;
+    if (!stripes.empty()) {
+      if (!pwrite_stripes(&header, sizeof(header),
+                          blocks[i].compressed_offset) ||
+          !punch_stripes(blocks[i].compressed_offset + sizeof(header),
+                         header.compressed_length)) {
+        return false;
+      }
+      continue;
+    }
+    if (pwrite64(fd, &header, sizeof(header), blocks[i].compressed_offset) !=
+            sizeof(header) ||
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  blocks[i].compressed_offset + sizeof(header),
+                  header.compressed_length)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CompressedWriter::write_output(const void* data, size_t size) {
+  if (sink) {
+    return sink->write(sink_name, data, size);
+  }
+  if (!stripes.empty()) {
+    bool ok = pwrite_stripes(data, size, output_pos);
+    output_pos += size;
+    return ok;
+  }
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    ssize_t ret = ::write(fd, p, size);
+    if (ret <= 0) {
+      return false;
+    }
+    p += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+bool CompressedWriter::open_stripes(const vector<string>& dirs) {
+  // Name the stripes after the trace directory and the stream, so the
+  // stripes of many traces can share the directories.
+  string dir = filename.substr(0, filename.rfind('/'));
+  string prefix = base_name(dir) + "-" + sink_name;
+  string manifest = "unit " + to_string(StreamSource::STRIPE_UNIT) + "\n";
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    string path = dirs[i] + "/" + prefix + "." + to_string(i);
+    stripes.push_back(ScopedFd(path.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT |
+                                                 O_EXCL | O_LARGEFILE,
+                               0400));
+    if (!stripes.back().is_open()) {
+      return false;
+    }
+    manifest += path + "\n";
+  }
+  ScopedFd manifest_fd(StreamSource::stripes_path(filename).c_str(),
+                       O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL, 0400);
+  return manifest_fd.is_open() &&
+         ::write(manifest_fd, manifest.data(), manifest.size()) ==
+             (ssize_t)manifest.size();
+}
+
+bool CompressedWriter::pwrite_stripes(const void* data, size_t size,
+                                      uint64_t offset) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    uint64_t stripe_offset;
+    uint64_t piece_size;
+    size_t stripe =
+        StreamSource::find_stripe(offset, StreamSource::STRIPE_UNIT,
+                                  stripes.size(), &stripe_offset, &piece_size);
+    size_t amount = min<uint64_t>(size, piece_size);
+    if (pwrite64(stripes[stripe], p, amount, stripe_offset) !=
+        (ssize_t)amount) {
+      return false;
+    }
+    p += amount;
+    offset += amount;
+    size -= amount;
+  }
+  return true;
+}
+
+bool CompressedWriter::punch_stripes(uint64_t offset, size_t size) {
+  while (size > 0) {
+    uint64_t stripe_offset;
+    uint64_t piece_size;
+    size_t stripe =
+        StreamSource::find_stripe(offset, StreamSource::STRIPE_UNIT,
+                                  stripes.size(), &stripe_offset, &piece_size);
+    size_t amount = min<uint64_t>(size, piece_size);
+    if (fallocate(stripes[stripe], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  stripe_offset, amount)) {
+      return false;
+    }
+    offset += amount;
+    size -= amount;
+  }
+  return true;
 }
 
-size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
+void CompressedWriter::write_block_index() {
+  if (write_error) {
+    // Don't describe a file we couldn't write.
+    return;
+  }
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(block_index.data());
+  size_t size = block_index.size() * sizeof(BlockIndexEntry);
+  if (sink) {
+    sink->write(base_name(index_path(filename)), p, size);
+    return;
+  }
+  ScopedFd index_fd(index_path(filename).c_str(),
+                    O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE,
+                    0400);
+  if (!index_fd.is_open()) {
+    // The index is only an optimization; readers can do without it.
+    return;
+  }
+  while (size > 0) {
+    ssize_t ret = ::write(index_fd, p, size);
+    if (ret <= 0) {
+      // A truncated index is detected and ignored by CompressedReader.
+      return;
+    }
+    p += ret;
+    size -= ret;
+  }
+}
+
+const uint8_t* CompressedWriter::contiguous_input(
+    const vector<uint8_t>& buffer, uint64_t offset, size_t length,
+    vector<uint8_t>& scratch) {
+  size_t buf_offset = (size_t)(offset % buffer.size());
+  if (buf_offset + length <= buffer.size()) {
+    return &buffer[buf_offset];
+  }
+  // The block wraps around the end of the ring buffer.
+  size_t first = buffer.size() - buf_offset;
+  scratch.resize(length);
+  memcpy(&scratch[0], &buffer[buf_offset], first);
+  memcpy(&scratch[first], &buffer[0], length - first);
+  return &scratch[0];
+}
+
+size_t CompressedWriter::do_compress(const vector<uint8_t>& buffer,
+                                     uint64_t offset, size_t length,
+                                     Codec codec, int level,
                                      uint8_t* outputbuf, size_t outputbuf_len) {
+  switch (codec) {
+    case CODEC_ZLIB:
+      return do_compress_zlib(buffer, offset, length, level, outputbuf,
+                              outputbuf_len);
+#ifdef RR_HAVE_LZ4
+    case CODEC_LZ4: {
+      vector<uint8_t> scratch;
+      const uint8_t* input = contiguous_input(buffer, offset, length, scratch);
+      int result = LZ4_compress_default(
+          reinterpret_cast<const char*>(input),
+          reinterpret_cast<char*>(outputbuf), length, outputbuf_len);
+      if (result <= 0) {
+        assert(0 && "LZ4_compress_default failed!");
+        return 0;
+      }
+      return result;
+    }
+#endif
+#ifdef RR_HAVE_ZSTD
+    case CODEC_ZSTD: {
+      vector<uint8_t> scratch;
+      const uint8_t* input = contiguous_input(buffer, offset, length, scratch);
+      size_t result =
+          ZSTD_compress(outputbuf, outputbuf_len, input, length, level);
+      if (ZSTD_isError(result)) {
+        assert(0 && "ZSTD_compress failed!");
+        return 0;
+      }
+      return result;
+    }
+#endif
+    default:
+      assert(0 && "Unsupported codec!");
+      return 0;
+  }
+}
+
+size_t CompressedWriter::do_compress_zlib(const vector<uint8_t>& buffer,
+                                          uint64_t offset, size_t length,
+                                          int level, uint8_t* outputbuf,
+                                          size_t outputbuf_len) {
   z_stream stream;
   memset(&stream, 0, sizeof(stream));
-  int result = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+  int result = deflateInit(&stream, level);
   if (result != Z_OK) {
     assert(0 && "deflateInit failed!");
     return 0;
@@ -234,7 +857,7 @@ size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
     if (stream.avail_in == 0) {
       size_t buf_offset = (size_t)(offset % buffer.size());
       size_t amount = min(length, buffer.size() - buf_offset);
-      stream.next_in = &buffer[buf_offset];
+      stream.next_in = const_cast<uint8_t*>(&buffer[buf_offset]);
       stream.avail_in = amount;
       length -= amount;
       offset += amount;
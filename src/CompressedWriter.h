@@ -6,65 +6,218 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <deque>
 #include <memory>
 #include <vector>
 #include <string>
 
+#include "OutputSink.h"
 #include "ScopedFd.h"
 
 /**
  * CompressedWriter opens an output file and writes compressed blocks to it.
  * Blocks of a fixed but unspecified size (currently 1MB) are compressed.
- * Each block of compressed data is written to the file preceded by two
- * 32-bit words: the size of the compressed data (excluding block header)
- * and the size of the uncompressed data, in that order. See BlockHeader below.
+ * Each block of compressed data is written to the file preceded by a
+ * BlockHeader giving the size of the compressed data (excluding block
+ * header), the size of the uncompressed data, the codec and a CRC-32C of
+ * the compressed data, so that corruption can be found without
+ * decompressing anything (see CompressedReader::verify()).
  *
- * We use multiple threads to perform compression. The threads are
- * responsible for the actual data writes. The thread that creates the
+ * We use multiple threads to perform compression. The threads queue the
+ * compressed blocks, in order, for a separate writer thread, which writes
+ * them and keeps them from lingering in the page cache. The thread that
+ * creates the
  * CompressedWriter is the "producer" thread and must also be the caller of
  * 'write'. The producer thread may block in 'write' if 'buffer_size' bytes are
  * being compressed.
  *
- * Each data block is compressed independently using zlib.
+ * Each data block is compressed independently using the writer's Codec,
+ * which is recorded in the block header so readers can detect it. zlib is
+ * always available; LZ4 and zstd are available when rr was built against
+ * them (RR_HAVE_LZ4 / RR_HAVE_ZSTD).
+ *
+ * When the writer is closed, a sidecar file named |index_path(filename)| is
+ * written containing one BlockIndexEntry per block, in file order. This lets
+ * CompressedReader seek to an arbitrary uncompressed offset without
+ * decompressing (or even reading the headers of) the preceding blocks.
+ *
+ * If an OutputSink is given, no local file is created; the blocks and the
+ * index are sent to the sink instead, under the file's base name.
+ *
+ * If 'stripe_dirs' are given, the compressed file is instead striped across
+ * a file in each of those directories, as StreamSource describes, so it's
+ * written at the combined bandwidth of their disks.
  */
 class CompressedWriter {
 public:
+  enum Codec {
+    CODEC_ZLIB = 0,
+    // Fast compression, for recording throughput.
+    CODEC_LZ4 = 1,
+    // High-ratio compression, for archiving.
+    CODEC_ZSTD = 2,
+    // Marks a block whose data discard() dropped. Never written by
+    // write(); readers can skip such blocks but not decompress them.
+    CODEC_DISCARDED = 0xff,
+  };
+  /**
+   * Return true if this build of rr can compress and decompress 'codec'.
+   */
+  static bool codec_supported(Codec codec);
+  /**
+   * Parse a codec name ("zlib", "lz4" or "zstd"). Returns false if
+   * 'name' isn't a known codec.
+   */
+  static bool parse_codec(const char* name, Codec* codec);
+  static const char* codec_name(Codec codec);
+
   CompressedWriter(const std::string& filename, size_t buffer_size,
-                   uint32_t num_threads);
+                   uint32_t num_threads, Codec codec = CODEC_ZLIB,
+                   std::shared_ptr<OutputSink> sink = nullptr,
+                   const std::vector<std::string>& stripe_dirs =
+                       std::vector<std::string>());
   ~CompressedWriter();
   // Call only on producer thread
   bool good() const { return !error; }
   // Call only on producer thread.
   void write(const void* data, size_t size);
+  // Call only on producer thread.
+  // A region of the writer's buffer handed out by reserve_write().
+  struct WriteSpan {
+    uint8_t* data;
+    size_t size;
+  };
+  // Call only on producer thread.
+  // Reserve 'size' bytes of buffer space, which must not exceed
+  // uncompressed_block_size(), and return it in spans[0] and spans[1]
+  // (the second is empty unless the reservation wraps around the end of
+  // the buffer). The caller fills the spans in place and then calls
+  // commit_write() to append the bytes to the stream, saving the copy
+  // write() would make. A reservation that isn't committed is simply
+  // reused by the next write. Returns false if the writer is in error.
+  bool reserve_write(size_t size, WriteSpan spans[2]);
+  // Call only on producer thread.
+  // Append the first 'size' bytes of the last reservation to the stream.
+  void commit_write(size_t size);
   // Call only on producer thread
   void close();
+  // Call only on producer thread.
+  // Compress and write out everything passed to write() so far, ending the
+  // current block early if need be, and wait until it's on disk, so that a
+  // crash after this returns loses nothing written before it. Returns false
+  // on error.
+  bool flush();
+  // Call only on producer thread.
+  // Free the disk space of the blocks that lie wholly within the
+  // uncompressed range [start, end) and have been written, e.g. by
+  // flush(). Their headers are kept, marked CODEC_DISCARDED, so readers
+  // can still walk the file. Returns false if the blocks couldn't be
+  // discarded.
+  bool discard(uint64_t start, uint64_t end);
+  // Call only on producer thread.
+  // Returns the total number of uncompressed bytes passed to write() so far.
+  uint64_t uncompressed_offset() const { return producer_reserved_write_pos; }
+  // Uncompressed size of every block except possibly the last.
+  size_t uncompressed_block_size() const { return block_size; }
+  // Call only on producer thread.
+  // Let the writer add compression threads, up to 'max_threads', each time
+  // the producer finds the buffer full. Each new thread comes with another
+  // block of buffer space.
+  void set_max_threads(uint32_t max_threads);
+  // Call only on producer thread.
+  // Let the compression level of each block follow the load: compress
+  // harder while compression threads sit idle, and back off to faster
+  // levels while the buffer fills up or the producer waits for space,
+  // down to LZ4 (when this build has it) under sustained pressure. Off by
+  // default, so that packed traces compress as well as they can.
+  void set_adaptive_level(bool adaptive);
+  // Call only on producer thread.
+  // The number of times, and total seconds, the producer has waited for
+  // buffer space.
+  uint64_t producer_blocked_count() const { return blocked_count; }
+  double producer_blocked_time() const { return blocked_time; }
+  // Call only on producer thread.
+  size_t num_threads() const { return threads.size(); }
+  // Call only on producer thread.
+  // Set '*uncompressed' to the number of bytes passed to write() that
+  // haven't been compressed yet, and '*compressed' to the number of
+  // compressed bytes waiting to be written out.
+  void backlog(uint64_t* uncompressed, uint64_t* compressed);
 
   struct BlockHeader {
     uint32_t compressed_length;
     uint32_t uncompressed_length;
+    uint32_t codec;
+    /* CRC-32C of the compressed data; zero for CODEC_DISCARDED blocks */
+    uint32_t checksum;
   };
 
+  struct BlockIndexEntry {
+    /* Offset in the compressed file of the block's BlockHeader */
+    uint64_t compressed_offset;
+    /* Offset in the uncompressed stream of the block's first byte */
+    uint64_t uncompressed_offset;
+  };
+
+  /**
+   * Return the path of the block index written alongside 'filename'.
+   */
+  static std::string index_path(const std::string& filename) {
+    return filename + ".index";
+  }
+
 protected:
   enum WaitFlag {
     WAIT,
     NOWAIT
   };
-  void update_reservation(WaitFlag wait_flag);
+  void update_reservation(WaitFlag wait_flag, size_t min_size = 1);
 
   static void* compression_thread_callback(void* p);
   void compression_thread();
-  size_t do_compress(uint64_t offset, size_t length, uint8_t* outputbuf,
-                     size_t outputbuf_len);
+  static void* write_thread_callback(void* p);
+  void write_thread();
+  int choose_level();
+  static int default_level(Codec codec);
+  static int max_level(Codec codec);
+  static size_t do_compress(const std::vector<uint8_t>& buffer,
+                            uint64_t offset, size_t length, Codec codec,
+                            int level, uint8_t* outputbuf,
+                            size_t outputbuf_len);
+  static size_t do_compress_zlib(const std::vector<uint8_t>& buffer,
+                                 uint64_t offset, size_t length, int level,
+                                 uint8_t* outputbuf, size_t outputbuf_len);
+  static const uint8_t* contiguous_input(const std::vector<uint8_t>& buffer,
+                                         uint64_t offset, size_t length,
+                                         std::vector<uint8_t>& scratch);
+  void grow(uint64_t completed_pos);
+  static double now();
+
+  void write_block_index();
+  bool write_output(const void* data, size_t size);
+  bool open_stripes(const std::vector<std::string>& dirs);
+  // For striped output: write at, or punch a hole over, the compressed
+  // file's range [offset, offset + size).
+  bool pwrite_stripes(const void* data, size_t size, uint64_t offset);
+  bool punch_stripes(uint64_t offset, size_t size);
 
   // Immutable while threads are running
   ScopedFd fd;
+  std::string filename;
+  // If non-null, output goes here instead of |fd|.
+  std::shared_ptr<OutputSink> sink;
+  // If not empty, output is striped across these instead of |fd|.
+  std::vector<ScopedFd> stripes;
+  std::string sink_name;
   int block_size;
+  Codec codec;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
   std::vector<pthread_t> threads;
+  pthread_t writer;
 
-  // Carefully shared...
-  std::vector<uint8_t> buffer;
+  // Carefully shared... Only the producer replaces it, with 'mutex' held.
+  std::shared_ptr<std::vector<uint8_t> > buffer;
 
   // BEGIN protected by 'mutex'
   /* position in output stream that this thread is currently working on,
@@ -75,15 +228,51 @@ protected:
   /* position in output stream of end of data ready to dispatch */
   uint64_t next_thread_end_pos;
   bool closing;
+  /* set while the producer waits in flush(), so the compression threads
+   * compress a partial block */
+  bool flushing;
+  /* set once the compression threads have exited */
+  bool compression_done;
+  bool closed;
   bool write_error;
+  /* position in the compressed file of the next block to be written */
+  uint64_t next_compressed_pos;
+  /* position in the compressed file up to which the writer thread has
+   * written blocks */
+  uint64_t written_compressed_pos;
+  uint32_t max_threads;
+  /* one entry per block written, in file order */
+  std::vector<BlockIndexEntry> block_index;
+  /* number of leading entries of |block_index| that discard() has dealt
+   * with */
+  size_t discarded_blocks;
+  struct PendingWrite {
+    std::vector<uint8_t> data;
+    size_t size;
+  };
+  /* compressed blocks waiting for the writer thread, in file order */
+  std::deque<PendingWrite> pending_writes;
+  /* output buffers the writer thread has finished with */
+  std::vector<std::vector<uint8_t> > free_write_buffers;
+  /* whether set_adaptive_level() is on, and the level the next block
+   * will be compressed at; below 1, blocks fall back to LZ4 */
+  bool adaptive;
+  int level;
+  /* set while the producer waits for buffer space */
+  bool producer_waiting;
   // END protected by 'mutex'
 
+  /* writer thread only: the size of the compressed file written so far */
+  uint64_t output_pos;
+
   /* producer thread only */
   /* Areas in the buffer that have been reserved for write() */
   uint64_t producer_reserved_pos;
   uint64_t producer_reserved_write_pos;
   uint64_t producer_reserved_upto_pos;
   bool error;
+  uint64_t blocked_count;
+  double blocked_time;
 };
 
 #endif /* RR_COMPRESSED_WRITER_H_ */
@@ -4,11 +4,18 @@
 
 #include "DiversionSession.h"
 
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/perf_event.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
+
 #include "AutoRemoteSyscalls.h"
 #include "log.h"
 #include "ReplaySession.h"
 
 using namespace rr;
+using namespace std;
 
 DiversionSession::DiversionSession(const ReplaySession& other)
     : emu_fs(other.emufs().clone()) {}
@@ -24,20 +31,26 @@ DiversionSession::~DiversionSession() {
   assert(emu_fs->size() == 0);
 }
 
-static void finish_emulated_syscall_with_ret(Task* t, long ret) {
+static void finish_emulated_syscall_with_ret(Task* t, long ret,
+                                             bool skipped) {
   Registers r = t->regs();
   r.set_syscall_result(ret);
   t->set_regs(r);
-  t->finish_emulated_syscall();
+  if (!skipped) {
+    t->finish_emulated_syscall();
+  }
 }
 
 /**
  * Execute the syscall contained in |t|'s current register set.  The
  * return value of the syscall is set for |t|'s registers, to be
- * returned to the tracee task.
+ * returned to the tracee task.  |skipped| is true when the syscall
+ * insn has already been stepped over, at a filter trap.
  */
-static void execute_syscall(Task* t) {
-  t->finish_emulated_syscall();
+static void execute_syscall(Task* t, bool skipped) {
+  if (!skipped) {
+    t->finish_emulated_syscall();
+  }
 
   AutoRemoteSyscalls remote(t);
   remote.syscall(remote.regs().original_syscallno(), remote.regs().arg1(),
@@ -48,7 +61,7 @@ static void execute_syscall(Task* t) {
 }
 
 template <typename Arch>
-static void process_syscall_arch(Task* t, int syscallno) {
+static void process_syscall_arch(Task* t, int syscallno, bool skipped) {
   LOG(debug) << "Processing " << t->syscallname(syscallno);
 
   switch (syscallno) {
@@ -60,7 +73,7 @@ static void process_syscall_arch(Task* t, int syscallno) {
       if (!t->is_desched_event_syscall()) {
         break;
       }
-      finish_emulated_syscall_with_ret(t, 0);
+      finish_emulated_syscall_with_ret(t, 0, skipped);
       return;
 
     // We blacklist these syscalls because the params include
@@ -91,11 +104,132 @@ static void process_syscall_arch(Task* t, int syscallno) {
       return;
   }
 
-  return execute_syscall(t);
+  return execute_syscall(t, skipped);
 }
 
-static void process_syscall(Task* t, int syscallno) {
-  RR_ARCH_FUNCTION(process_syscall_arch, t->arch(), t, syscallno)
+static void process_syscall(Task* t, int syscallno, bool skipped) {
+  RR_ARCH_FUNCTION(process_syscall_arch, t->arch(), t, syscallno, skipped)
+}
+
+template <typename Arch> struct sock_fprog_arch {
+  typename Arch::unsigned_short len;
+  typename Arch::template ptr<struct sock_filter> filter;
+};
+
+static void trace_syscall(vector<struct sock_filter>& filter, int syscallno) {
+  // Syscalls this arch doesn't have are negative.
+  if (syscallno < 0) {
+    return;
+  }
+  filter.push_back((struct sock_filter)BPF_JUMP(
+      BPF_JMP + BPF_JEQ + BPF_K, (uint32_t)syscallno, 0, 1));
+  filter.push_back(
+      (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_TRACE));
+}
+
+/**
+ * Build the filter run by diverted tasks.  It traps the syscalls that
+ * process_syscall_arch() refuses or emulates, and those creating
+ * processes, which rr has to see; everything else runs natively.
+ */
+template <typename Arch>
+static vector<struct sock_filter> diversion_filter() {
+  vector<struct sock_filter> filter;
+  uint32_t audit_arch = Arch::arch() == x86 ? AUDIT_ARCH_I386
+                                            : AUDIT_ARCH_X86_64;
+  // Trap everything made under another arch's syscall ABI.
+  filter.push_back((struct sock_filter)BPF_STMT(
+      BPF_LD + BPF_W + BPF_ABS, offsetof(struct seccomp_data, arch)));
+  filter.push_back((struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K,
+                                                audit_arch, 1, 0));
+  filter.push_back(
+      (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_TRACE));
+  filter.push_back((struct sock_filter)BPF_STMT(
+      BPF_LD + BPF_W + BPF_ABS, offsetof(struct seccomp_data, nr)));
+
+  // Only the desched ioctls need emulating.
+  filter.push_back((struct sock_filter)BPF_JUMP(
+      BPF_JMP + BPF_JEQ + BPF_K, (uint32_t)Arch::ioctl, 0, 5));
+  filter.push_back((struct sock_filter)BPF_STMT(
+      BPF_LD + BPF_W + BPF_ABS, offsetof(struct seccomp_data, args[1])));
+  filter.push_back((struct sock_filter)BPF_JUMP(
+      BPF_JMP + BPF_JEQ + BPF_K, PERF_EVENT_IOC_ENABLE, 1, 0));
+  filter.push_back((struct sock_filter)BPF_JUMP(
+      BPF_JMP + BPF_JEQ + BPF_K, PERF_EVENT_IOC_DISABLE, 0, 1));
+  filter.push_back(
+      (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_TRACE));
+  filter.push_back(
+      (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_ALLOW));
+
+  int traced[] = { Arch::ipc,           Arch::kill,
+                   Arch::rt_sigqueueinfo, Arch::rt_tgsigqueueinfo,
+                   Arch::tgkill,        Arch::tkill,
+                   Arch::clone,         Arch::fork,
+                   Arch::vfork,         Arch::execve };
+  for (int syscallno : traced) {
+    trace_syscall(filter, syscallno);
+  }
+  filter.push_back(
+      (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_ALLOW));
+  return filter;
+}
+
+template <typename Arch> static bool install_filter_arch(Task* t) {
+  vector<struct sock_filter> filter = diversion_filter<Arch>();
+  AutoRemoteSyscalls remote(t);
+  long ret = remote.syscall(Arch::prctl, PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+  if (ret < 0) {
+    LOG(debug) << "prctl(NO_NEW_PRIVS) failed: errno " << -ret;
+    return false;
+  }
+  AutoRestoreMem filter_mem(remote, (const uint8_t*)filter.data(),
+                            filter.size() * sizeof(filter[0]));
+  sock_fprog_arch<Arch> prog;
+  prog.len = filter.size();
+  prog.filter = filter_mem.get().cast<struct sock_filter>();
+  AutoRestoreMem prog_mem(remote, (const uint8_t*)&prog, sizeof(prog));
+  ret = remote.syscall(Arch::prctl, PR_SET_SECCOMP, SECCOMP_MODE_FILTER,
+                       prog_mem.get().as_int(), 0, 0);
+  if (ret < 0) {
+    LOG(debug) << "prctl(SECCOMP) failed: errno " << -ret;
+    return false;
+  }
+  return true;
+}
+
+static bool install_filter(Task* t) {
+  RR_ARCH_FUNCTION(install_filter_arch, t->arch(), t)
+}
+
+bool DiversionSession::ensure_syscall_filter(Task* t) {
+  auto it = syscall_filtered.find(t->tid);
+  if (it == syscall_filtered.end()) {
+    bool ok = install_filter(t);
+    if (!ok) {
+      LOG(warn) << "Can't install the diversion syscall filter in " << t->tid
+                << "; its syscalls will all stop";
+    }
+    it = syscall_filtered.insert(make_pair(t->tid, ok)).first;
+  }
+  return it->second;
+}
+
+/**
+ * |t| is at a filter trap for the syscall in its registers.  Skip the
+ * syscall, leaving |t| just after the syscall insn with its registers
+ * as they were at the trap, so it can be processed like a syscall
+ * entered under sysemu.
+ */
+static void skip_trapped_syscall(Task* t) {
+  Registers r = t->regs();
+  Registers skip = r;
+  skip.set_original_syscallno(-1);
+  t->set_regs(skip);
+  do {
+    t->cont_syscall();
+  } while (SIGCHLD == t->pending_sig());
+  ASSERT(t, t->ptrace_event() == 0 && !t->pending_sig());
+  t->set_regs(r);
 }
 
 /**
@@ -114,6 +248,11 @@ DiversionSession::DiversionResult DiversionSession::diversion_step(
 
   switch (command) {
     case RUN_CONTINUE:
+      if (ensure_syscall_filter(t)) {
+        LOG(debug) << "Continuing to next trapped syscall";
+        t->resume_execution(RESUME_CONT, RESUME_WAIT);
+        break;
+      }
       LOG(debug) << "Continuing to next syscall";
       t->cont_sysemu();
       break;
@@ -131,6 +270,13 @@ DiversionSession::DiversionResult DiversionSession::diversion_step(
   }
 
   result.status = DIVERSION_CONTINUE;
+  if (t->is_ptrace_seccomp_event()) {
+    result.break_status.reason = BREAK_NONE;
+    int syscallno = t->regs().original_syscallno();
+    skip_trapped_syscall(t);
+    process_syscall(t, syscallno, true);
+    return result;
+  }
   if (t->pending_sig()) {
     result.break_status = diagnose_debugger_trap(t, t->pending_sig());
     ASSERT(t, result.break_status.reason != BREAK_SINGLESTEP ||
@@ -139,6 +285,6 @@ DiversionSession::DiversionResult DiversionSession::diversion_step(
   }
 
   result.break_status.reason = BREAK_NONE;
-  process_syscall(t, t->regs().original_syscallno());
+  process_syscall(t, t->regs().original_syscallno(), false);
   return result;
 }
@@ -3,6 +3,8 @@
 #ifndef RR_DIVERSION_SESSION_H_
 #define RR_DIVERSION_SESSION_H_
 
+#include <unordered_map>
+
 #include "EmuFs.h"
 #include "Session.h"
 
@@ -12,6 +14,12 @@ class ReplaySession;
  * A DiversionSession lets you run task(s) forward without replay.
  * Clone a ReplaySession to a DiversionSession to execute some arbitrary
  * code for its side effects.
+ *
+ * Diverted tasks run under a seccomp filter that traps only the
+ * syscalls rr must refuse or emulate, and process creation, so code
+ * that makes many ordinary syscalls (allocating memory, reading the
+ * clock ...) runs without a ptrace stop for each.  Tasks the filter
+ * can't be installed in stop at every syscall.
  */
 class DiversionSession : public Session {
 public:
@@ -21,6 +29,10 @@ public:
 
   EmuFs& emufs() const { return *emu_fs; }
 
+  virtual void on_shared_file_unmapped(const FileId& id) {
+    emu_fs->maybe_unused(id);
+  }
+
   enum DiversionStatus {
     // Some execution was done. diversion_step() can be called again.
     DIVERSION_CONTINUE,
@@ -44,7 +56,15 @@ private:
 
   DiversionSession(const ReplaySession& other);
 
+  /**
+   * Install the syscall filter in |t| unless that's been tried before.
+   * Return true if |t| runs under the filter.
+   */
+  bool ensure_syscall_filter(Task* t);
+
   std::shared_ptr<EmuFs> emu_fs;
+  // Whether each task, by tid, runs under the syscall filter.
+  std::unordered_map<pid_t, bool> syscall_filtered;
 };
 
 #endif // RR_DIVERSION_SESSION_H_
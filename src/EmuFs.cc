@@ -4,14 +4,19 @@
 
 #include "EmuFs.h"
 
+#include <fcntl.h>
+#include <linux/falloc.h>
 #include <syscall.h>
+#include <unistd.h>
 
-#include <fstream>
+#include <algorithm>
 #include <sstream>
 #include <string>
 
+#include "Flags.h"
 #include "log.h"
 #include "ReplaySession.h"
+#include "util.h"
 
 using namespace std;
 
@@ -26,16 +31,65 @@ EmuFile::~EmuFile() {
   LOG(debug) << "    EmuFs::~File(einode:" << est.st_ino << ")";
 }
 
+/**
+ * Copy the bytes in [begin, end) of |src| to the same offsets in
+ * |dst|, leaving all-zero pages as holes in |dst|.
+ */
+static void copy_nonzero_pages(int src, int dst, off_t begin, off_t end) {
+  static const size_t BLOCK_SIZE = 256 * 1024;
+  vector<uint8_t> buf(BLOCK_SIZE);
+  while (begin < end) {
+    ssize_t nread =
+        pread(src, buf.data(), min<off_t>(BLOCK_SIZE, end - begin), begin);
+    if (nread <= 0) {
+      FATAL() << "Failed to read emulated file at offset " << begin;
+    }
+    for (ssize_t i = 0; i < nread; i += page_size()) {
+      size_t len = min<size_t>(page_size(), nread - i);
+      if (is_zeroed(buf.data() + i, len)) {
+        continue;
+      }
+      if (pwrite(dst, buf.data() + i, len, begin + i) != ssize_t(len)) {
+        FATAL() << "Failed to write emulated file copy";
+      }
+    }
+    begin += nread;
+  }
+}
+
 EmuFile::shr_ptr EmuFile::clone() {
   auto f = EmuFile::create(orig_path.c_str(), est);
-  // NB: this isn't the most efficient possible file copy, but
-  // it's simple and not too slow.
-  ifstream src(proc_path(), ifstream::binary);
-  ofstream dst(f->proc_path(), ofstream::binary);
-  dst << src.rdbuf();
+  // The copy is created with the right size, full of holes, so
+  // we only have to fill in the extents of this file that hold
+  // data.  Shmem files are usually sparse because the recorded
+  // file's pages are only restored when mapped.
+  off_t size = lseek(file, 0, SEEK_END);
+  off_t data = lseek(file, 0, SEEK_DATA);
+  if (data < 0 && errno != ENXIO) {
+    // No SEEK_DATA support; treat the whole file as data.
+    copy_nonzero_pages(file, f->file, 0, size);
+    return f;
+  }
+  while (data >= 0 && data < size) {
+    off_t hole = lseek(file, data, SEEK_HOLE);
+    if (hole < 0) {
+      hole = size;
+    }
+    copy_nonzero_pages(file, f->file, data, hole);
+    data = lseek(file, hole, SEEK_DATA);
+  }
   return f;
 }
 
+uint64_t EmuFile::allocated_bytes() const {
+  struct stat st;
+  if (fstat(file, &st)) {
+    FATAL() << "Failed to stat emulated file " << orig_path;
+  }
+  // st_blocks is always in units of 512 bytes.
+  return uint64_t(st.st_blocks) * 512;
+}
+
 string EmuFile::proc_path() const {
   stringstream ss;
   ss << "/proc/" << getpid() << "/fd/" << fd().get();
@@ -50,6 +104,45 @@ void EmuFile::update(const struct stat& st) {
   est = st;
 }
 
+/**
+ * Make [offset, offset + len) of |fd| read as zeroes, freeing its
+ * pages if the file system supports that.
+ */
+static void zero_range(int fd, off64_t offset, size_t len) {
+  if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                 len)) {
+    return;
+  }
+  vector<uint8_t> zeroes(len, 0);
+  if (pwrite64(fd, zeroes.data(), len, offset) != ssize_t(len)) {
+    FATAL() << "Failed to zero " << len << " bytes at " << HEX(offset);
+  }
+}
+
+void EmuFile::zero(off64_t offset, size_t len) { zero_range(file, offset, len); }
+
+void EmuFile::write(const uint8_t* data, size_t len, off64_t offset) {
+  size_t i = 0;
+  while (i < len) {
+    // Find the run of pages starting at |i| that are all zero, or
+    // all nonzero.
+    bool zero = is_zeroed(data + i, min(page_size(), len - i));
+    size_t end = i;
+    do {
+      end += min(page_size(), len - end);
+    } while (end < len &&
+             is_zeroed(data + end, min(page_size(), len - end)) == zero);
+    if (zero) {
+      zero_range(file, offset + i, end - i);
+    } else if (pwrite64(file, data + i, end - i, offset + i) !=
+               ssize_t(end - i)) {
+      FATAL() << "Failed to write " << end - i << " bytes at "
+              << HEX(offset + i) << " to emulated " << orig_path;
+    }
+    i = end;
+  }
+}
+
 /*static*/ EmuFile::shr_ptr EmuFile::create(const char* orig_path,
                                             const struct stat& est) {
   // Sanitize the mapped file path so that we can use it in a
@@ -60,7 +153,7 @@ void EmuFile::update(const struct stat& st) {
   stringstream name;
   name << "rr-emufs-" << getpid() << "-dev-" << est.st_dev << "-inode-"
        << est.st_ino << "-" << path_tag;
-  shr_ptr f(new EmuFile(create_shmem_segment(name.str().c_str(), est.st_size),
+  shr_ptr f(new EmuFile(create_memfd_segment(name.str().c_str(), est.st_size),
                         est, orig_path));
   LOG(debug) << "created emulated file for " << orig_path << " as "
              << name.str();
@@ -68,7 +161,7 @@ void EmuFile::update(const struct stat& st) {
 }
 
 EmuFile::EmuFile(ScopedFd&& fd, const struct stat& est, const char* orig_path)
-    : est(est), orig_path(orig_path), file(std::move(fd)), is_marked(false) {}
+    : est(est), orig_path(orig_path), file(std::move(fd)) {}
 
 EmuFile::shr_ptr EmuFs::at(const FileId& id) const { return files.at(id); }
 
@@ -78,26 +171,22 @@ EmuFs::shr_ptr EmuFs::clone() {
     const FileId& id = kv.first;
     fs->files[id] = kv.second->clone();
   }
+  fs->unused_candidates = unused_candidates;
   return fs;
 }
 
 void EmuFs::gc(const Session& session) {
-  // XXX this implementation is unnecessarily slow.  But before
-  // throwing it away for something different, give it another
-  // shot once rr is caching local mmaps for all address spaces,
-  // which obviates the need for the yuck slow maps parsing
-  // here.
-  LOG(debug) << "Beginning emufs gc of " << files.size() << " files";
-
-  // Mark in-use files by iterating through the mmaps of all
-  // tracee address spaces.
-  //
+  LOG(debug) << "Beginning emufs gc of " << unused_candidates.size() << " of "
+             << files.size() << " files";
+
   // We inject these maps into the tracee and are careful to
   // close the injected fd after we finish the mmap.  That means
   // that the only way tracees can hold a reference to the
   // underlying inode is through a memory mapping.  So to
   // determine if a file is in use, we only have to find a
-  // recognizable filename in some tracee's memory map.
+  // tracee address space that maps it.  Address spaces count
+  // their mappings of each file and tell us when one stops
+  // mapping it, so only those files can have become garbage.
   //
   // We check *all* tracee file tables because tracees can share
   // fds with each other in many ways, and we don't attempt to
@@ -106,35 +195,39 @@ void EmuFs::gc(const Session& session) {
   // TODO: assuming AddressSpace == FileTable, but technically
   // they're different things: two tracees could share an
   // address space but have different file tables.
-  size_t nr_marked_files = 0;
-  for (auto& as : session.vms()) {
-    Task* t = *as->task_set().begin();
-    LOG(debug) << "  iterating /proc/" << t->tid << "/maps ...";
-
-    mark_used_vfiles(t, *as, &nr_marked_files);
-    if (files.size() == nr_marked_files) {
-      break;
+  //
+  // Sweep the files that aren't mapped.  It might be possible
+  // that a later task will mmap the same underlying file that
+  // we're about to destroy.  That's perfectly fine; we'll just
+  // create it anew, and restore its addressible contents from
+  // the snapshot saved to the trace.  Since there are no live
+  // references to the file in the interim, tracees can't
+  // observe the destroy/recreate operation.
+  for (auto& id : unused_candidates) {
+    bool used = false;
+    for (auto as : session.vms()) {
+      if (as->maps_shared_file(id)) {
+        used = true;
+        break;
+      }
+    }
+    if (used) {
+      continue;
     }
+    auto it = files.find(id);
+    if (it == files.end()) {
+      continue;
+    }
+    LOG(debug) << "  emufs gc reclaiming einode:" << id.disp_inode()
+               << "; fs name `" << it->second->emu_path() << "'";
+    files.erase(it);
   }
+  unused_candidates.clear();
 
-  // Sweep all the virtual files that weren't marked.  It might
-  // be possible that a later task will mmap the same underlying
-  // file that we're about to destroy.  That's perfectly fine;
-  // we'll just create it anew, and restore its addressible
-  // contents from the snapshot saved to the trace.  Since there
-  // are no live references to the file in the interim, tracees
-  // can't observe the destroy/recreate operation.
-  vector<FileId> garbage;
-  for (auto it = files.begin(); it != files.end(); ++it) {
-    if (!it->second->marked()) {
-      garbage.push_back(it->first);
+  if (Flags::get().check_cached_mmaps) {
+    for (auto as : session.vms()) {
+      as->maybe_verify(*as->task_set().begin(), false);
     }
-    it->second->unmark();
-  }
-  for (auto it = garbage.begin(); it != garbage.end(); ++it) {
-    LOG(debug) << "  emufs gc reclaiming einode:" << it->disp_inode()
-               << "; fs name `" << files[*it]->emu_path() << "'";
-    files.erase(*it);
   }
 }
 
@@ -147,9 +240,19 @@ EmuFile::shr_ptr EmuFs::get_or_create(const TraceMappedRegion& mf) {
   }
   auto vf = EmuFile::create(mf.file_name().c_str(), mf.stat());
   files[id] = vf;
+  // Collect it if it never gets mapped.
+  unused_candidates.insert(id);
   return vf;
 }
 
+uint64_t EmuFs::allocated_bytes() const {
+  uint64_t bytes = 0;
+  for (auto& kv : files) {
+    bytes += kv.second->allocated_bytes();
+  }
+  return bytes;
+}
+
 void EmuFs::log() const {
   LOG(error) << "EmuFs " << this << " with " << files.size() << " files:";
   for (auto& kv : files) {
@@ -162,30 +265,6 @@ void EmuFs::log() const {
 
 EmuFs::EmuFs() {}
 
-void EmuFs::mark_used_vfiles(Task* t, const AddressSpace& as,
-                             size_t* nr_marked_files) {
-  for (auto& kv : as.memmap()) {
-    const MappableResource& r = kv.second;
-    LOG(debug) << "  examining " << r.fsname.c_str() << " ...";
-
-    auto id_ef = files.find(r.id);
-    if (id_ef == files.end()) {
-      ASSERT(t, !r.is_shared_mmap_file());
-      continue;
-    }
-    auto ef = id_ef->second;
-    if (!ef->marked()) {
-      ef->mark();
-      LOG(debug) << "    marked einode:" << r.id.disp_inode();
-      ++*nr_marked_files;
-      if (files.size() == *nr_marked_files) {
-        LOG(debug) << "  (marked all files, bailing)";
-        return;
-      }
-    }
-  }
-}
-
 EmuFs::AutoGc::AutoGc(ReplaySession& session, int syscallno,
                       SyscallEntryOrExit state)
     : session(session),
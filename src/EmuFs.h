@@ -5,6 +5,7 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -62,10 +63,17 @@ public:
 
   /**
    * Return a copy of this file.  See |create()| for the meaning
-   * of |fs_tag|.
+   * of |fs_tag|.  Holes and all-zero pages aren't copied, so the
+   * copy only allocates memory for pages with data.
    */
   shr_ptr clone();
 
+  /**
+   * Return the number of bytes of memory actually allocated to
+   * the backing file.
+   */
+  uint64_t allocated_bytes() const;
+
   /**
    * Return the fd of the real file backing this.
    */
@@ -83,19 +91,25 @@ public:
    */
   std::string proc_path() const;
 
-  /**
-   * Mark/unmark/check to see if this file is marked.
-   */
-  void mark() { is_marked = true; }
-  bool marked() const { return is_marked; }
-  void unmark() { is_marked = false; }
-
   /**
    * Ensure that the emulated file is sized to match a later
    * stat() of it, |st|.
    */
   void update(const struct stat& st);
 
+  /**
+   * Write the |len| bytes at |data| to this file at |offset|.  Pages
+   * that are all zeroes are punched out as holes rather than
+   * written, so that restoring a big, mostly-empty shared mapping
+   * doesn't allocate memory for it.
+   */
+  void write(const uint8_t* data, size_t len, off64_t offset);
+
+  /**
+   * Make the |len| bytes of this file at |offset| read as zeroes.
+   */
+  void zero(off64_t offset, size_t len);
+
   /**
    * Create a new emulated file for |orig_path| that will
    * emulate the recorded attributes |est|.  |tag| is used to
@@ -110,7 +124,6 @@ private:
   struct stat est;
   std::string orig_path;
   ScopedFd file;
-  bool is_marked;
 
   EmuFile(const EmuFile&) = delete;
   EmuFile operator=(const EmuFile&) = delete;
@@ -149,6 +162,12 @@ public:
 
   size_t size() const { return files.size(); }
 
+  /**
+   * Return the number of bytes of memory allocated to all the
+   * files in this fs.  None of it is shared with other EmuFs's.
+   */
+  uint64_t allocated_bytes() const;
+
   /** Create and return a new emufs. */
   static shr_ptr create();
 
@@ -174,18 +193,25 @@ public:
    */
   void gc(const Session& session);
 
-private:
-  EmuFs();
-
   /**
-   * Mark all the files being used by the tasks in |as|, and
-   * increment |nt_marked_files| by the number of files that
-   * were marked.
+   * Note that the last mapping of |id| in some address space is
+   * gone, so the next |gc()| has to check whether |id| is still
+   * used.
    */
-  void mark_used_vfiles(Task* t, const AddressSpace& as,
-                        size_t* nr_marked_files);
+  void maybe_unused(const FileId& id) {
+    if (files.count(id)) {
+      unused_candidates.insert(id);
+    }
+  }
+
+private:
+  EmuFs();
 
   FileMap files;
+  // Files that may not be mapped by any address space any more.
+  // Every other file is known to be mapped by some address space,
+  // so |gc()| only has to look at these.
+  std::set<FileId> unused_candidates;
 
   EmuFs(const EmuFs&) = delete;
   EmuFs& operator=(const EmuFs&) = delete;
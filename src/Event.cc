@@ -40,6 +40,7 @@ Event::Event(EncodedEvent e) {
     case EV_SYSCALLBUF_FLUSH:
     case EV_SYSCALLBUF_ABORT_COMMIT:
     case EV_SYSCALLBUF_RESET:
+    case EV_SHARED_MAPPING_CHANGE:
     case EV_TRACE_TERMINATION:
     case EV_UNSTABLE_EXIT:
     case EV_INTERRUPTED_SYSCALL_NOT_RESTARTED:
@@ -159,6 +160,7 @@ EncodedEvent Event::encode() const {
     case EV_SYSCALLBUF_FLUSH:
     case EV_SYSCALLBUF_ABORT_COMMIT:
     case EV_SYSCALLBUF_RESET:
+    case EV_SHARED_MAPPING_CHANGE:
     case EV_TRACE_TERMINATION:
     case EV_UNSTABLE_EXIT:
     case EV_INTERRUPTED_SYSCALL_NOT_RESTARTED:
@@ -307,7 +309,7 @@ void Event::transform(EventType new_type) {
   event_type = new_type;
 }
 
-std::string Event::type_name() const {
+/*static*/ std::string Event::type_name(EventType event_type) {
   switch (event_type) {
     case EV_SENTINEL:
       return "(none)";
@@ -323,6 +325,7 @@ std::string Event::type_name() const {
       CASE(SYSCALLBUF_FLUSH);
       CASE(SYSCALLBUF_ABORT_COMMIT);
       CASE(SYSCALLBUF_RESET);
+      CASE(SHARED_MAPPING_CHANGE);
       CASE(UNSTABLE_EXIT);
       CASE(DESCHED);
       CASE(SIGNAL);
@@ -338,6 +341,39 @@ std::string Event::type_name() const {
   }
 }
 
+void EventStack::push(const Event& ev) {
+  if (depth == slots.size()) {
+    slots.push_back(unique_ptr<Event>(new Event(ev)));
+  } else {
+    // Event::operator= can't change the active member, so rebuild the
+    // event in place.
+    Event* slot = slots[depth].get();
+    slot->~Event();
+    new (slot) Event(ev);
+  }
+  ++depth;
+}
+
+void EventStack::pop() {
+  assert(depth > 0);
+  // Release whatever the event owns, but keep the slot.
+  Event* slot = slots[--depth].get();
+  slot->~Event();
+  new (slot) Event();
+}
+
+EventStack& EventStack::operator=(const EventStack& other) {
+  if (this != &other) {
+    while (depth > 0) {
+      pop();
+    }
+    for (size_t i = 0; i < other.size(); ++i) {
+      push(other[i]);
+    }
+  }
+  return *this;
+}
+
 const char* state_name(SyscallEntryOrExit state) {
   switch (state) {
 #define CASE(_id)                                                              \
@@ -5,9 +5,11 @@
 
 #include <assert.h>
 
+#include <memory>
 #include <ostream>
 #include <stack>
 #include <string>
+#include <vector>
 
 #include "kernel_abi.h"
 #include "Registers.h"
@@ -36,6 +38,10 @@ enum EventType {
   EV_SYSCALLBUF_FLUSH,
   EV_SYSCALLBUF_ABORT_COMMIT,
   EV_SYSCALLBUF_RESET,
+  // Pages of a copied MAP_SHARED writable file mapping changed without
+  // the tracee writing them, e.g. because another process outside the
+  // tracee tree wrote the file.  The new pages are the frame's data.
+  EV_SHARED_MAPPING_CHANGE,
   // The trace was terminated before all tasks exited, most
   // likely because the recorder was sent a terminating signal.
   // There are no more trace frames coming, so the best thing to
@@ -195,7 +201,10 @@ enum SyscallState {
   EXITING_SYSCALL
 };
 struct SyscallEvent : public BaseEvent {
-  typedef std::stack<remote_ptr<void> > ArgsStack;
+  // Backed by a vector so that empty stacks, i.e. almost all of them,
+  // don't allocate.
+  typedef std::stack<remote_ptr<void>, std::vector<remote_ptr<void> > >
+      ArgsStack;
 
   /** Syscall |syscallno| is the syscall number. */
   SyscallEvent(int syscallno, SupportedArch arch)
@@ -384,7 +393,9 @@ struct Event {
   SupportedArch arch() const { return base.arch(); }
 
   /** Return a string naming |ev|'s type. */
-  std::string type_name() const;
+  std::string type_name() const { return type_name(event_type); }
+  /** Return a string naming |type|. */
+  static std::string type_name(EventType type);
 
   /** Return an event of type EV_NOOP. */
   static Event noop(SupportedArch arch) {
@@ -401,6 +412,42 @@ private:
   };
 };
 
+/**
+ * A stack of Events that keeps the storage of popped events for reuse, so
+ * pushing and popping events around every syscall doesn't allocate once
+ * the stack has reached its usual depth. Events never move, so references
+ * to them stay valid until they're popped.
+ */
+class EventStack {
+public:
+  EventStack() : depth(0) {}
+  EventStack(const EventStack& other) : depth(0) { *this = other; }
+  EventStack& operator=(const EventStack& other);
+
+  void push(const Event& ev);
+  void pop();
+
+  Event& top() {
+    assert(depth > 0);
+    return *slots[depth - 1];
+  }
+  const Event& top() const {
+    assert(depth > 0);
+    return *slots[depth - 1];
+  }
+  /** Return the |i|th event from the bottom of the stack. */
+  const Event& operator[](size_t i) const {
+    assert(i < depth);
+    return *slots[i];
+  }
+  size_t size() const { return depth; }
+
+private:
+  // Slots at or above |depth| hold trivial Events, ready to be reused.
+  std::vector<std::unique_ptr<Event> > slots;
+  size_t depth;
+};
+
 inline static std::ostream& operator<<(std::ostream& o, const Event& ev) {
   return o << ev.str();
 }
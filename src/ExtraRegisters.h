@@ -41,6 +41,13 @@ public:
   const uint8_t* data_bytes() const { return data.data(); }
   bool empty() const { return data.empty(); }
 
+  bool operator==(const ExtraRegisters& other) const {
+    return format_ == other.format_ && data == other.data;
+  }
+  bool operator!=(const ExtraRegisters& other) const {
+    return !(*this == other);
+  }
+
   /**
    * Like |Registers::read_register()|, except attempts to read
    * the value of an "extra register" (floating point / vector).
@@ -7,6 +7,8 @@
 #include <unistd.h>
 
 #include <string>
+#include <utility>
+#include <vector>
 
 /**
  * Command line arguments for rr
@@ -15,6 +17,27 @@ struct Flags {
   /* Max counter value before the scheduler interrupts a tracee. */
   int max_ticks;
 
+  /* When true, the scheduler lets compute-bound tasks run for a
+   * multiple of |max_ticks| before interrupting them.  Setting
+   * |max_ticks| explicitly turns this off. */
+  bool adaptive_timeslice;
+
+  /* Randomize the scheduler's timeslices and priorities while
+   * recording, to make rare races more likely to show up.  The
+   * random numbers are generated from |chaos_seed|, or from a seed
+   * picked (and printed) at startup when that's zero. */
+  bool chaos;
+  uint32_t chaos_seed;
+
+  /* Let single-threaded tracee processes that share no memory with
+   * other processes run in parallel, on different CPUs, while
+   * recording. */
+  bool multicore;
+
+  /* When nonzero, the preload library answers this many clock reads
+   * from each real sample of the clock, without a syscall. */
+  int clock_sample_interval;
+
   /* Max number of trace events before the scheduler
    * de-schedules a tracee. */
   int max_events;
@@ -81,6 +104,10 @@ struct Flags {
   enum {
     DEFAULT_MAX_EVENTS = 10
   };
+  /* About 10ms of execution, by the estimate above. */
+  enum {
+    DEFAULT_PROFILE_PERIOD = 500000
+  };
 
   /* Whenever |ignore_sig| is pending for a tracee, decline to
    * deliver it. */
@@ -118,6 +145,9 @@ struct Flags {
    * event time at which to start checksumming.
    */
   int checksum;
+  /* Only re-read pages that changed since the last checksum, where the
+   * kernel can track that. The checksums are the same either way. */
+  bool checksum_incremental;
 
   /* IP port to listen on for debug connections. */
   int dbgport;
@@ -129,6 +159,12 @@ struct Flags {
   /* True when not-absolutely-urgently-critical messages will be
    * logged. */
   bool verbose;
+  /* When nonzero, keep the last this-many debug log messages in a
+   * LogRing and print them if rr dies. */
+  int log_ring_records;
+  /* When nonempty, time rr's ptrace calls and write the timeline to this
+   * file (see PtraceProfiler). */
+  std::string ptrace_profile;
 
   /* True when tracee processes in record and replay are allowed
    * to run on any logical CPU. */
@@ -145,6 +181,12 @@ struct Flags {
 
   // Check that cached mmaps match /proc/maps after each event.
   bool check_cached_mmaps;
+  // The fraction of events after which check_cached_mmaps checks, in
+  // (0, 1].  Events that change mappings are always checked.
+  double check_cached_mmaps_rate;
+
+  // Ignore the ProbeCache's results and probe the environment again.
+  bool reprobe;
 
   // Suppress warnings related to environmental features outside rr's
   // control.
@@ -158,6 +200,9 @@ struct Flags {
   // been "created".
   uint32_t goto_event;
 
+  // Don't replay writes to stdout/stderr made before goto_event.
+  bool quiet_goto;
+
   pid_t target_process;
 
   // We let users specify which process should be "created" before
@@ -180,12 +225,147 @@ struct Flags {
   // Let the 'dump' command dump statistics about the trace
   bool dump_statistics;
 
+  // Print the 'dump' command's statistics as JSON instead of dumping
+  // frames.
+  bool dump_json;
+
   // Let the 'dump' command dump syscallbuf contents
   bool dump_syscallbuf;
 
+  // If nonzero, the 'dump' command only dumps frames of this tid.
+  pid_t dump_tid;
+
+  // The 'index-writes' command only indexes writes to these address
+  // ranges [first, second), if any are given.
+  std::vector<std::pair<uint64_t, uint64_t> > index_ranges;
+
+  // Make 'index-writes' print the last |index_query_count| writes to
+  // |index_query_addr| at or before event |index_query_time| (zero means
+  // the end of the trace) from the saved index, instead of building it.
+  bool index_query;
+  uint64_t index_query_addr;
+  uint32_t index_query_time;
+  uint32_t index_query_count;
+
+  // Stop 'diff' after reporting this many divergences.
+  uint32_t diff_max_divergences;
+
+  // The CompressedWriter::Codec used to compress a new trace.
+  int compression_codec;
+
+  // If not empty, send the trace through an OutputSink to this file or
+  // FIFO instead of keeping it in the trace directory.
+  std::string output_sink;
+
+  // If not empty, stripe the new trace's data stream, or every stream
+  // with |stripe_all_streams|, across files in these directories.
+  std::vector<std::string> stripe_dirs;
+
+  // If not empty, only processes whose executable path or command line
+  // matches one of these fnmatch() patterns are recorded.  Others are
+  // detached when they exec and run untraced, like processes outside the
+  // recording.
+  std::vector<std::string> record_only;
+
+  // If not empty, rewrite this file every second during recording with
+  // live counters of the recording's progress, as JSON.
+  std::string record_stats_path;
+  bool stripe_all_streams;
+
+  // Names of additional perf counters to record in every trace frame,
+  // e.g. "cycles"; see PerfCounters::parse_extra_counters().
+  std::vector<std::string> extra_perf_counters;
+
+  // Save copies of mapped files in the store shared by all traces, with
+  // the trace only linking to them.
+  bool shared_store;
+
+  // Reflink copied files into the trace, or hard-link them if they're
+  // read-only, instead of copying their data.
+  bool clone_files;
+
+  // End a trace segment, flushing the trace to disk, whenever this many
+  // MB have been written since the last one (and/or this many seconds
+  // have passed). Zero disables that trigger.
+  uint32_t segment_size_mb;
+  uint32_t segment_secs;
+
+  // Keep only about this many seconds of the trace before the end of the
+  // recording, plus its start up to the initial exec: older segments are
+  // discarded up to the latest snapshot before the window. Zero keeps the
+  // whole trace.
+  uint32_t flight_recorder_secs;
+
+  // Record the already running process with this pid, starting from a
+  // snapshot of it, instead of starting a program. Zero if unset.
+  pid_t attach_pid;
+
+  // Number of threads used to decompress trace data ahead of the
+  // replayer or 'dump'. Zero means decompress on demand.
+  uint32_t decompress_threads;
+
+  // Take a checkpoint of the replay every this many events (and/or
+  // seconds), so restarting the debugger to an earlier event resumes from
+  // the nearest one. Zero disables that trigger.
+  uint32_t checkpoint_interval;
+  uint32_t checkpoint_interval_secs;
+
+  // Maximum number of automatic checkpoints kept alive at once, and the
+  // maximum memory in MB they may hold that isn't shared with other
+  // sessions. Zero means no memory limit.
+  uint32_t max_checkpoints;
+  uint32_t checkpoint_memory_mb;
+
+  // Snapshot the recorded process every this many events, so that
+  // replay to a late event can start from the nearest snapshot
+  // instead of from the beginning of the trace. Zero disables it.
+  uint32_t snapshot_interval;
+
+  // Save a snapshot of the replay in the trace at the first event from
+  // this one on where it can be taken, so that later replays to events
+  // after it start from there. Zero if unset.
+  uint32_t save_snapshot_event;
+
+  // Print how fast replay went when it finishes.
+  bool replay_statistics;
+
+  // With autopilot, instead of failing at the first memory checksum that
+  // doesn't validate, find the event and mapping where replay diverged.
+  bool diagnose_divergence;
+
+  // With autopilot, replay independent process subtrees of the trace
+  // concurrently in up to this many processes. Zero means replay
+  // everything in one session.
+  uint32_t parallel_replay;
+
+  // Replay only the frames of target_process's task group and of the
+  // tasks needed to create it; the other processes' effects on it are
+  // emulated from the trace.
+  bool replay_target_only;
+
+  // For replay-batch, the number of traces replayed at once.
+  uint32_t replay_batch_jobs;
+
+  // For verify, the number of threads checking the trace's blocks.
+  uint32_t verify_threads;
+
+  // When replaying a trace recorded bound to a CPU, bind to this CPU
+  // instead, unless it's negative.  replay-batch uses it to put its
+  // concurrent replays on separate CPUs.
+  int replay_cpu;
+
+  // With autopilot, write a sample of the tracees' stacks every
+  // |profile_period| ticks to this file.
+  std::string profile_path;
+  int64_t profile_period;
+
   // Only open a debug socket, don't launch the debugger too.
   bool dont_launch_debugger;
 
+  // Keep the replay when the debugger detaches, and wait for another to
+  // connect, starting where the first one did.
+  bool replay_server;
+
   // Pass this file name to debugger with -x
   std::string gdb_command_file_path;
 
@@ -195,6 +375,11 @@ struct Flags {
 
   Flags()
       : max_ticks(0),
+        adaptive_timeslice(false),
+        chaos(false),
+        chaos_seed(0),
+        multicore(false),
+        clock_sample_interval(0),
         max_events(0),
         ignore_sig(0),
         redirect(false),
@@ -203,6 +388,7 @@ struct Flags {
         dump_on(0),
         dump_at(0),
         checksum(0),
+        checksum_incremental(false),
         dbgport(0),
         wait_secs(0),
         verbose(false),
@@ -210,13 +396,47 @@ struct Flags {
         force_things(false),
         mark_stdio(false),
         check_cached_mmaps(false),
+        check_cached_mmaps_rate(1),
+        reprobe(false),
         goto_event(0),
+        quiet_goto(false),
         target_process(0),
         process_created_how(CREATED_NONE),
         raw_dump(false),
         dump_statistics(false),
+        dump_json(false),
         dump_syscallbuf(false),
-        dont_launch_debugger(false) {}
+        dump_tid(0),
+        index_query(false),
+        index_query_addr(0),
+        index_query_time(0),
+        index_query_count(1),
+        diff_max_divergences(10),
+        compression_codec(0),
+        stripe_all_streams(false),
+        shared_store(false),
+        clone_files(false),
+        segment_size_mb(0),
+        segment_secs(0),
+        flight_recorder_secs(0),
+        attach_pid(0),
+        decompress_threads(0),
+        checkpoint_interval(0),
+        checkpoint_interval_secs(0),
+        max_checkpoints(8),
+        checkpoint_memory_mb(0),
+        snapshot_interval(0),
+        save_snapshot_event(0),
+        replay_statistics(false),
+        diagnose_divergence(false),
+        parallel_replay(0),
+        replay_target_only(false),
+        replay_batch_jobs(0),
+        verify_threads(0),
+        replay_cpu(-1),
+        profile_period(DEFAULT_PROFILE_PERIOD),
+        dont_launch_debugger(false),
+        replay_server(false) {}
 
   static const Flags& get() { return singleton; }
 
@@ -13,15 +13,18 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <iomanip>
 #include <sstream>
 #include <vector>
 
@@ -50,6 +53,8 @@ static bool request_needs_immediate_response(const GdbRequest* req) {
     case DREQ_NONE:
     case DREQ_CONTINUE:
     case DREQ_STEP:
+    case DREQ_REVERSE_CONTINUE:
+    case DREQ_REVERSE_STEP:
       return false;
     default:
       return true;
@@ -57,8 +62,32 @@ static bool request_needs_immediate_response(const GdbRequest* req) {
 }
 
 GdbContext::GdbContext(pid_t tgid)
-    : tgid(tgid), no_ack(false), inlen(0), outlen(0) {
+    : tgid(tgid), no_ack(false), disconnect_detaches(false),
+      binary_mem_reply(false),
+      thread_snapshot_valid(false), thread_list_as_xml(false), inlen(0),
+      outlen(0), packet_start(0), interrupts_consumed(0), io_thread_started(false), io_len(0),
+      io_closed(false), io_errno(0), io_closing(false), io_interrupts_seen(0),
+      io_in_packet(false), io_checksum_left(0) {
   memset(&req, 0, sizeof(req));
+  pthread_mutex_init(&io_mutex, nullptr);
+  pthread_cond_init(&io_cond, nullptr);
+}
+
+GdbContext::~GdbContext() {
+  if (io_thread_started) {
+    pthread_mutex_lock(&io_mutex);
+    io_closing = true;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+    // Wake the thread if it's waiting for the socket.
+    char c = 0;
+    ssize_t nwritten = write(io_shutdown_write_fd, &c, 1);
+    assert(nwritten == 1);
+    (void)nwritten;
+    pthread_join(io_thread, nullptr);
+  }
+  pthread_mutex_destroy(&io_mutex);
+  pthread_cond_destroy(&io_cond);
 }
 
 static ScopedFd open_socket(const char* address, unsigned short* port,
@@ -108,6 +137,95 @@ void GdbContext::await_debugger(ScopedFd& listen_fd) {
       accept4(listen_fd, (struct sockaddr*)&client_addr, &len, SOCK_NONBLOCK));
   // We might restart this debugging session, so don't set the
   // socket fd CLOEXEC.
+  start_io_thread();
+}
+
+void GdbContext::start_io_thread() {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC)) {
+    FATAL() << "Couldn't create I/O thread shutdown pipe";
+  }
+  io_shutdown_read_fd = ScopedFd(fds[0]);
+  io_shutdown_write_fd = ScopedFd(fds[1]);
+  if (pthread_create(&io_thread, nullptr, io_thread_callback, this)) {
+    FATAL() << "Couldn't create gdb I/O thread";
+  }
+  pthread_setname_np(io_thread, "gdb-io");
+  io_thread_started = true;
+}
+
+void* GdbContext::io_thread_callback(void* p) {
+  // Signals are for the replay thread to handle.
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+  static_cast<GdbContext*>(p)->io_thread_loop();
+  return nullptr;
+}
+
+void GdbContext::io_thread_loop() {
+  while (true) {
+    struct pollfd pfds[2];
+    memset(pfds, 0, sizeof(pfds));
+    pfds[0].fd = sock_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = io_shutdown_read_fd;
+    pfds[1].events = POLLIN;
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      pthread_mutex_lock(&io_mutex);
+      io_closed = true;
+      io_errno = errno;
+      pthread_cond_broadcast(&io_cond);
+      pthread_mutex_unlock(&io_mutex);
+      return;
+    }
+    if (pfds[1].revents) {
+      return;
+    }
+
+    pthread_mutex_lock(&io_mutex);
+    // Wait for the replay thread to make room.
+    while (io_len == ssize_t(sizeof(io_buf)) && !io_closing) {
+      pthread_cond_wait(&io_cond, &io_mutex);
+    }
+    if (io_closing) {
+      pthread_mutex_unlock(&io_mutex);
+      return;
+    }
+    ssize_t nread = read(sock_fd, io_buf + io_len, sizeof(io_buf) - io_len);
+    if (nread < 0 && (errno == EAGAIN || errno == EINTR)) {
+      pthread_mutex_unlock(&io_mutex);
+      continue;
+    }
+    if (nread <= 0) {
+      io_closed = true;
+      io_errno = nread < 0 ? errno : 0;
+      pthread_cond_broadcast(&io_cond);
+      pthread_mutex_unlock(&io_mutex);
+      return;
+    }
+    for (ssize_t i = io_len; i < io_len + nread; ++i) {
+      uint8_t c = io_buf[i];
+      if (io_checksum_left > 0) {
+        --io_checksum_left;
+      } else if (io_in_packet) {
+        if (c == '#') {
+          io_in_packet = false;
+          io_checksum_left = 2;
+        }
+      } else if (c == '$') {
+        io_in_packet = true;
+      } else if (c == INTERRUPT_CHAR) {
+        ++io_interrupts_seen;
+      }
+    }
+    io_len += nread;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+  }
 }
 
 static const char connection_addr[] = "127.0.0.1";
@@ -120,7 +238,15 @@ struct DebuggerParams {
 unique_ptr<GdbContext> GdbContext::await_client_connection(
     unsigned short desired_port, ProbePort probe, pid_t tgid,
     const string* exe_image, ScopedFd* client_params_fd) {
-  auto dbg = unique_ptr<GdbContext>(new GdbContext(tgid));
+  ScopedFd listen_fd =
+      listen_for_client(desired_port, probe, exe_image, client_params_fd);
+  return accept_client_connection(listen_fd, tgid);
+}
+
+ScopedFd GdbContext::listen_for_client(unsigned short desired_port,
+                                       ProbePort probe,
+                                       const string* exe_image,
+                                       ScopedFd* client_params_fd) {
   unsigned short port = desired_port;
   ScopedFd listen_fd = open_socket(connection_addr, &port, probe);
   if (exe_image) {
@@ -136,6 +262,12 @@ unique_ptr<GdbContext> GdbContext::await_client_connection(
                     "  target remote :%d\n",
             port);
   }
+  return listen_fd;
+}
+
+unique_ptr<GdbContext> GdbContext::accept_client_connection(ScopedFd& listen_fd,
+                                                            pid_t tgid) {
+  auto dbg = unique_ptr<GdbContext>(new GdbContext(tgid));
   LOG(debug) << "limiting debugger traffic to tgid " << tgid;
   dbg->await_debugger(listen_fd);
   return dbg;
@@ -232,35 +364,48 @@ static int poll_socket(const ScopedFd& sock_fd, short events, int timeoutMs) {
   return ret;
 }
 
-static int poll_incoming(const ScopedFd& sock_fd, int timeoutMs) {
-  return poll_socket(sock_fd, POLLIN /* TODO: |POLLERR */, timeoutMs);
-}
-
 static int poll_outgoing(const ScopedFd& sock_fd, int timeoutMs) {
   return poll_socket(sock_fd, POLLOUT /* TODO: |POLLERR */, timeoutMs);
 }
 
 /**
- * read() incoming data exactly one time, successfully.  May block.
+ * Take incoming data from the I/O thread exactly one time,
+ * successfully.  May block.
  */
 void GdbContext::read_data_once() {
-  ssize_t nread;
-  /* Wait until there's data, instead of busy-looping on
-   * EAGAIN. */
-  poll_incoming(sock_fd, -1 /* wait forever */);
-  nread = read(sock_fd, inbuf + inlen, sizeof(inbuf) - inlen);
-  if (0 == nread) {
-    LOG(info) << "(gdb closed debugging socket, exiting)";
-    exit(0);
-  }
-  if (nread <= 0) {
+  pthread_mutex_lock(&io_mutex);
+  while (0 == io_len && !io_closed) {
+    pthread_cond_wait(&io_cond, &io_mutex);
+  }
+  if (0 == io_len) {
+    int err = io_errno;
+    pthread_mutex_unlock(&io_mutex);
+    if (!err) {
+      LOG(info) << "(gdb closed debugging socket, exiting)";
+      exit(0);
+    }
+    errno = err;
     FATAL() << "Error reading from gdb";
   }
+  ssize_t nread = min<ssize_t>(io_len, sizeof(inbuf) - inlen);
+  memcpy(inbuf + inlen, io_buf, nread);
+  memmove(io_buf, io_buf + nread, io_len - nread);
+  io_len -= nread;
+  pthread_cond_broadcast(&io_cond);
+  pthread_mutex_unlock(&io_mutex);
+
   inlen += nread;
   assert("Impl dynamic alloc if this fails (or double inbuf size)" &&
          inlen < int(sizeof(inbuf)));
 }
 
+bool GdbContext::client_disconnected() {
+  pthread_mutex_lock(&io_mutex);
+  bool closed = io_closed && 0 == io_len;
+  pthread_mutex_unlock(&io_mutex);
+  return closed && !memchr(inbuf, '#', inlen);
+}
+
 void GdbContext::write_flush() {
   ssize_t write_index = 0;
 
@@ -272,7 +417,13 @@ void GdbContext::write_flush() {
     ssize_t nwritten;
 
     poll_outgoing(sock_fd, -1 /*wait forever*/);
-    nwritten = write(sock_fd, outbuf + write_index, outlen - write_index);
+    nwritten = send(sock_fd, outbuf + write_index, outlen - write_index,
+                    MSG_NOSIGNAL);
+    if (nwritten < 0 && disconnect_detaches &&
+        (EPIPE == errno || ECONNRESET == errno)) {
+      // The client is gone; get_request() reports that as a detach.
+      break;
+    }
     if (nwritten < 0) {
       FATAL() << "Error writing to gdb";
     }
@@ -282,32 +433,75 @@ void GdbContext::write_flush() {
 }
 
 void GdbContext::write_data_raw(const uint8_t* data, ssize_t len) {
-  assert("Impl dynamic alloc if this fails (or double outbuf size)" &&
-         (outlen + len) < int(sizeof(inbuf)));
+  memcpy(write_reserve(len), data, len);
+  write_commit(len);
+}
 
-  memcpy(outbuf + outlen, data, len);
-  outlen += len;
+uint8_t* GdbContext::write_reserve(size_t len) {
+  assert("Impl dynamic alloc if this fails (or double outbuf size)" &&
+         outlen + ssize_t(len) < ssize_t(sizeof(outbuf)));
+  return outbuf + outlen;
 }
 
-void GdbContext::write_hex(unsigned long hex) {
-  char buf[32];
-  size_t len;
+static const char hex_digits[] = "0123456789abcdef";
 
-  len = snprintf(buf, sizeof(buf) - 1, "%02lx", hex);
-  write_data_raw((uint8_t*)buf, len);
+/**
+ * Write the two hex digits of |byte| to |out|.
+ */
+static void encode_hex_byte(uint8_t byte, char* out) {
+  out[0] = hex_digits[byte >> 4];
+  out[1] = hex_digits[byte & 0xf];
 }
 
-void GdbContext::write_packet_bytes(const uint8_t* data, size_t num_bytes) {
-  uint8_t checksum;
-  size_t i;
+/**
+ * Return the value of the hex digit |c|, or -1 if it isn't one.
+ */
+static int hex_digit_value(char c) {
+  if ('0' <= c && c <= '9') {
+    return c - '0';
+  }
+  if ('a' <= c && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if ('A' <= c && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/**
+ * Decode the |len| bytes hex-encoded at |in| into |out|, which may be
+ * |in| itself.
+ */
+static void decode_hex_bytes(const char* in, size_t len, uint8_t* out) {
+  for (size_t i = 0; i < len; ++i) {
+    int hi = hex_digit_value(in[2 * i]);
+    int lo = hex_digit_value(in[2 * i + 1]);
+    assert(hi >= 0 && lo >= 0);
+    out[i] = (hi << 4) | lo;
+  }
+}
 
+void GdbContext::begin_packet() {
   write_data_raw((uint8_t*)"$", 1);
-  for (i = 0, checksum = 0; i < num_bytes; ++i) {
-    checksum += data[i];
+  packet_start = outlen;
+}
+
+void GdbContext::end_packet() {
+  uint8_t checksum = 0;
+  for (ssize_t i = packet_start; i < outlen; ++i) {
+    checksum += outbuf[i];
   }
-  write_data_raw((uint8_t*)data, num_bytes);
-  write_data_raw((uint8_t*)"#", 1);
-  write_hex(checksum);
+  char* trailer = (char*)write_reserve(3);
+  trailer[0] = '#';
+  encode_hex_byte(checksum, &trailer[1]);
+  write_commit(3);
+}
+
+void GdbContext::write_packet_bytes(const uint8_t* data, size_t num_bytes) {
+  begin_packet();
+  write_data_raw(data, num_bytes);
+  end_packet();
 }
 
 void GdbContext::write_packet(const char* data) {
@@ -316,20 +510,15 @@ void GdbContext::write_packet(const char* data) {
 
 void GdbContext::write_binary_packet(const char* pfx, const uint8_t* data,
                                      ssize_t num_bytes) {
-  ssize_t pfx_num_chars = strlen(pfx);
-  uint8_t buf[2 * num_bytes + pfx_num_chars];
-  ssize_t buf_num_bytes = 0;
-  int i;
-
-  strncpy((char*)buf, pfx, sizeof(buf) - 1);
-  buf_num_bytes += pfx_num_chars;
+  begin_packet();
+  write_data_raw((const uint8_t*)pfx, strlen(pfx));
 
-  for (i = 0; i < num_bytes; ++i) {
+  // Every byte escapes to at most two.
+  uint8_t* buf = write_reserve(2 * num_bytes);
+  ssize_t buf_num_bytes = 0;
+  for (ssize_t i = 0; i < num_bytes; ++i) {
     uint8_t b = data[i];
 
-    if (buf_num_bytes + 2 > ssize_t(sizeof(buf))) {
-      break;
-    }
     switch (b) {
       case '#':
       case '$':
@@ -343,38 +532,29 @@ void GdbContext::write_binary_packet(const char* pfx, const uint8_t* data,
         break;
     }
   }
-
-  LOG(debug) << " ***** NOTE: writing binary data, upcoming debug output may "
-                "be truncated";
-  return write_packet_bytes(buf, buf_num_bytes);
+  write_commit(buf_num_bytes);
+  end_packet();
 }
 
 void GdbContext::write_hex_bytes_packet(const uint8_t* bytes, size_t len) {
-  if (0 == len) {
-    write_packet("");
-    return;
-  }
-
-  char buf[2 * len + 1];
+  begin_packet();
+  char* buf = (char*)write_reserve(2 * len);
   for (size_t i = 0; i < len; ++i) {
-    unsigned long b = bytes[i];
-    snprintf(&buf[2 * i], 3, "%02lx", b);
+    encode_hex_byte(bytes[i], &buf[2 * i]);
   }
-  write_packet(buf);
+  write_commit(2 * len);
+  end_packet();
 }
 
-static string decode_ascii_encoded_hex_str(const char* encoded) {
-  ssize_t enc_len = strlen(encoded);
+/**
+ * Decode the hex-encoded string |encoded| in place, and return it.
+ */
+static char* decode_ascii_encoded_hex_str(char* encoded) {
+  size_t enc_len = strlen(encoded);
   assert(enc_len % 2 == 0);
-  string str;
-  for (int i = 0; i < enc_len / 2; ++i) {
-    char enc_byte[] = { encoded[2 * i], encoded[2 * i + 1], '\0' };
-    char* endp;
-    int c = strtol(enc_byte, &endp, 16);
-    assert(c < 128);
-    str += static_cast<char>(c);
-  }
-  return str;
+  decode_hex_bytes(encoded, enc_len / 2, (uint8_t*)encoded);
+  encoded[enc_len / 2] = '\0';
+  return encoded;
 }
 
 bool GdbContext::skip_to_packet_start() {
@@ -410,7 +590,17 @@ bool GdbContext::sniff_packet() {
     return true;
   }
   assert(0 == inlen);
-  return poll_incoming(sock_fd, 0 /*don't wait*/);
+  pthread_mutex_lock(&io_mutex);
+  bool ready = io_len > 0 || io_closed;
+  pthread_mutex_unlock(&io_mutex);
+  return ready;
+}
+
+bool GdbContext::interrupt_pending() {
+  pthread_mutex_lock(&io_mutex);
+  bool pending = io_interrupts_seen > interrupts_consumed;
+  pthread_mutex_unlock(&io_mutex);
+  return pending;
 }
 
 void GdbContext::read_packet() {
@@ -434,6 +624,7 @@ void GdbContext::read_packet() {
     /* Interrupts are kind of an ugly duckling in the gdb
      * protocol ... */
     packetend = 1;
+    ++interrupts_consumed;
     return;
   }
 
@@ -506,6 +697,35 @@ bool GdbContext::xfer(const char* name, char* args) {
     req.target = query_thread;
     return true;
   }
+  if (!strcmp(name, "libraries-svr4")) {
+    assert(!strncmp(args, "read::", sizeof("read::") - 1));
+    args += sizeof("read::") - 1;
+    req.type = DREQ_GET_LIBRARIES;
+    req.target = query_thread;
+    req.mem.addr = strtoul(args, &args, 16);
+    assert(',' == *args++);
+    req.mem.len = strtoul(args, &args, 16);
+    assert('\0' == *args);
+    return true;
+  }
+  if (!strcmp(name, "threads")) {
+    assert(!strncmp(args, "read::", sizeof("read::") - 1));
+    args += sizeof("read::") - 1;
+    size_t offset = strtoul(args, &args, 16);
+    assert(',' == *args++);
+    size_t len = strtoul(args, &args, 16);
+    assert('\0' == *args);
+
+    if (thread_snapshot_valid) {
+      write_thread_list(true, offset, len);
+      return false;
+    }
+    req.type = DREQ_GET_THREAD_LIST;
+    req.mem.addr = offset;
+    req.mem.len = len;
+    thread_list_as_xml = true;
+    return true;
+  }
   if (name == strstr(name, "siginfo")) {
     if (args == strstr(args, "read")) {
       req.type = DREQ_READ_SIGINFO;
@@ -547,13 +767,12 @@ static size_t print_reg_value(const GdbRegisterValue& reg, char* buf) {
      * reg.value read in native endianness is exactly that.
      */
     for (size_t i = 0; i < reg.size; ++i) {
-      snprintf(&buf[2 * i], 3, "%02lx", (unsigned long)reg.value[i]);
+      encode_hex_byte(reg.value[i], &buf[2 * i]);
     }
   } else {
-    for (size_t i = 0; i < reg.size; ++i) {
-      strcpy(&buf[2 * i], "xx");
-    }
+    memset(buf, 'x', 2 * reg.size);
   }
+  buf[2 * reg.size] = '\0';
   return reg.size * 2;
 }
 
@@ -572,17 +791,10 @@ static void read_reg_value(char** strp, GdbRegisterValue* reg) {
 
   reg->defined = true;
   reg->size = strlen(str) / 2;
-  for (size_t i = 0; i < reg->size; ++i) {
-    char tmp = str[2];
-    str[2] = '\0';
+  assert(reg->size <= GdbRegisterValue::MAX_SIZE);
+  decode_hex_bytes(str, reg->size, reg->value);
 
-    reg->value[i] = strtoul(str, &str, 16);
-    assert('\0' == *str);
-
-    str[0] = tmp;
-  }
-
-  *strp = str;
+  *strp = str + 2 * reg->size;
 }
 
 bool GdbContext::query(char* payload) {
@@ -609,7 +821,12 @@ bool GdbContext::query(char* payload) {
   }
   if (!strcmp(name, "fThreadInfo")) {
     LOG(debug) << "gdb asks for thread list";
+    if (thread_snapshot_valid) {
+      write_thread_list(false, 0, 0);
+      return false;
+    }
     req.type = DREQ_GET_THREAD_LIST;
+    thread_list_as_xml = false;
     return true;
   }
   if (!strcmp(name, "sThreadInfo")) {
@@ -639,11 +856,15 @@ bool GdbContext::query(char* payload) {
     /* TODO process these */
     LOG(debug) << "gdb supports " << args;
 
+    // PacketSize is in hex.  Leave room in our buffers for the packet
+    // framing, and for an ack that may arrive along with a packet.
     snprintf(supported, sizeof(supported) - 1,
-             "PacketSize=%zd;QStartNoAckMode+;qXfer:auxv:read+"
+             "PacketSize=%zx;QStartNoAckMode+;qXfer:auxv:read+"
              ";qXfer:siginfo:read+;qXfer:siginfo:write+"
-             ";multiprocess+",
-             sizeof(outbuf));
+             ";qXfer:threads:read+;qXfer:libraries-svr4:read+"
+             ";multiprocess+;binary-upload+"
+             ";ReverseContinue+;ReverseStep+;ConditionalBreakpoints+",
+             sizeof(inbuf) - 64);
     write_packet(supported);
     return false;
   }
@@ -659,9 +880,16 @@ bool GdbContext::query(char* payload) {
     args = payload;
     args = 1 + strchr(args, ',' /*sic*/);
 
-    req.type = DREQ_GET_THREAD_EXTRA_INFO;
-    req.target = parse_threadid(args, &args);
+    GdbThreadId target = parse_threadid(args, &args);
     assert('\0' == *args);
+    const GdbThreadInfo* info = find_in_thread_snapshot(target);
+    if (info) {
+      write_hex_bytes_packet((const uint8_t*)info->name.c_str(),
+                             1 + info->name.length());
+      return false;
+    }
+    req.type = DREQ_GET_THREAD_EXTRA_INFO;
+    req.target = target;
     return true;
   }
   if (!strcmp(name, "TStatus")) {
@@ -797,7 +1025,7 @@ bool GdbContext::process_vpacket(char* payload) {
               << "' passed to run. We don't support that.";
     }
     if (strlen(args)) {
-      string event_str = decode_ascii_encoded_hex_str(args);
+      const char* event_str = decode_ascii_encoded_hex_str(args);
       char* endp;
       // TODO: ideally we would keep checkpointing
       // out of the gdb protocol translator, and
@@ -806,14 +1034,14 @@ bool GdbContext::process_vpacket(char* payload) {
       // request struct and the way gdb encodes the
       // run args.
       if (event_str[0] == 'c') {
-        int param = strtol(event_str.c_str() + 1, &endp, 0);
+        int param = strtol(event_str + 1, &endp, 0);
         req.restart.type = RESTART_FROM_CHECKPOINT;
         req.restart.param = param;
         LOG(debug) << "next replayer restarting from checkpoint "
                    << req.restart.param;
       } else {
         req.restart.type = RESTART_FROM_EVENT;
-        req.restart.param = strtol(event_str.c_str(), &endp, 0);
+        req.restart.param = strtol(event_str, &endp, 0);
         LOG(debug) << "next replayer advancing to event " << req.restart.param;
       }
       if (!endp || *endp != '\0') {
@@ -884,11 +1112,38 @@ bool GdbContext::process_packet() {
 
       ret = true;
       break;
+    case 'b':
+      // Reverse execution.  Like 'c' and 's', these resume
+      // |resume_thread|.
+      if ('c' == payload[0]) {
+        req.type = DREQ_REVERSE_CONTINUE;
+      } else if ('s' == payload[0]) {
+        req.type = DREQ_REVERSE_STEP;
+      } else {
+        UNHANDLED_REQ() << "Unhandled reverse request '" << payload << "'";
+        ret = false;
+        break;
+      }
+      req.target = resume_thread;
+      LOG(debug) << "gdb requests reverse "
+                 << ('c' == payload[0] ? "continue" : "step");
+      ret = true;
+      break;
     case 'k':
+      if (disconnect_detaches) {
+        LOG(info) << "gdb requests kill, detaching";
+        req.type = DREQ_DETACH;
+        ret = true;
+        break;
+      }
       LOG(info) << "gdb requests kill, exiting";
       write_packet("OK");
       exit(0);
     case 'm':
+    case 'x':
+      // 'x' is 'm' with a binary reply, which is half the size
+      // on the wire.
+      binary_mem_reply = 'x' == request;
       req.type = DREQ_GET_MEM;
       req.target = query_thread;
       req.mem.addr = strtoul(payload, &payload, 16);
@@ -935,13 +1190,20 @@ bool GdbContext::process_packet() {
     case 'Q':
       ret = set_var(payload);
       break;
-    case 'T':
-      req.type = DREQ_GET_IS_THREAD_ALIVE;
-      req.target = parse_threadid(payload, &payload);
+    case 'T': {
+      GdbThreadId target = parse_threadid(payload, &payload);
       assert('\0' == *payload);
-      LOG(debug) << "gdb wants to know if " << req.target << " is alive";
+      LOG(debug) << "gdb wants to know if " << target << " is alive";
+      if (thread_snapshot_valid && target.pid == tgid) {
+        write_packet(find_in_thread_snapshot(target) ? "OK" : "E01");
+        ret = false;
+        break;
+      }
+      req.type = DREQ_GET_IS_THREAD_ALIVE;
+      req.target = target;
       ret = true;
       break;
+    }
     case 'v':
       ret = process_vpacket(payload);
       break;
@@ -952,13 +1214,16 @@ bool GdbContext::process_packet() {
       ++payload;
       req.mem.len = strtoul(payload, &payload, 16);
       ++payload;
-      // This is freed by reply_set_mem().
-      req.mem.data = (uint8_t*)malloc(req.mem.len);
+      // The packet is erased from |inbuf| before the request is
+      // answered, so the data is kept in |set_mem_data|, which is
+      // reused from one write to the next.
+      set_mem_data.resize(req.mem.len);
+      req.mem.data = set_mem_data.data();
       // TODO: verify that the length of |payload| is as
       // expected in the presence of escaped data.  Right
       // now this call is potential-buffer-overrun-city.
       read_binary_data((const uint8_t*)payload, req.mem.len,
-                       (uint8_t*)req.mem.data);
+                       set_mem_data.data());
 
       LOG(debug) << "gdb setting memory (addr=" << req.mem.addr
                  << ", len=" << req.mem.len << ")";
@@ -981,11 +1246,31 @@ bool GdbContext::process_packet() {
       req.mem.addr = strtoul(payload, &payload, 16);
       assert(',' == *payload++);
       req.mem.len = strtoul(payload, &payload, 16);
-      assert('\0' == *payload);
+      req.mem.conditions = nullptr;
+      breakpoint_conditions.clear();
+      // Conditions come as ";X<len>,<hex bytecode>" each.
+      while (';' == *payload && 'X' == payload[1]) {
+        payload += 2;
+        size_t len = strtoul(payload, &payload, 16);
+        assert(',' == *payload++);
+        assert(strnlen(payload, 2 * len) == 2 * len);
+        // Decode the bytecode over its own encoding.
+        uint8_t* bytecode = (uint8_t*)payload;
+        decode_hex_bytes(payload, len, bytecode);
+        payload += 2 * len;
+        breakpoint_conditions.push_back(GdbExpression(bytecode, len));
+      }
+      if (!breakpoint_conditions.empty()) {
+        req.mem.conditions = &breakpoint_conditions;
+      }
+      if ('\0' != *payload) {
+        LOG(warn) << "Ignoring breakpoint options " << payload;
+      }
 
       LOG(debug) << "gdb requests " << ('Z' == request ? "set" : "remove")
                  << "breakpoint (addr=" << req.mem.addr
-                 << ", len=" << req.mem.len << ")";
+                 << ", len=" << req.mem.len << ", "
+                 << breakpoint_conditions.size() << " conditions)";
 
       ret = true;
       break;
@@ -1071,6 +1356,12 @@ GdbRequest GdbContext::get_request() {
   }
 
   while (1) {
+    if (disconnect_detaches && client_disconnected()) {
+      LOG(info) << "(gdb closed debugging socket, detaching)";
+      memset(&req, 0, sizeof(req));
+      req.type = DREQ_DETACH;
+      return req;
+    }
     /* There's either new request data, or we have nothing
      * to do.  Either way, block until we read a complete
      * packet from gdb. */
@@ -1079,6 +1370,10 @@ GdbRequest GdbContext::get_request() {
     if (process_packet()) {
       /* We couldn't process the packet internally,
        * so the target has to do something. */
+      if (req.is_resume_request() || DREQ_RESTART == req.type) {
+        /* Threads may come and go from here on. */
+        thread_snapshot_valid = false;
+      }
       return req;
     }
     /* The packet we got was "internal", gdb details.
@@ -1191,8 +1486,9 @@ static int to_gdb_signum(int sig) {
   }
 }
 
-void GdbContext::send_stop_reply_packet(GdbThreadId thread, int sig,
-                                        uintptr_t watch_addr) {
+void GdbContext::send_stop_reply_packet(
+    GdbThreadId thread, int sig, uintptr_t watch_addr,
+    const vector<GdbRegisterValue>& expedited, bool no_history) {
   if (sig < 0) {
     write_packet("E01");
     return;
@@ -1204,13 +1500,25 @@ void GdbContext::send_stop_reply_packet(GdbThreadId thread, int sig,
     watch[0] = '\0';
   }
   char buf[PATH_MAX];
-  snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;%s",
-           to_gdb_signum(sig), thread.pid, thread.tid, watch);
+  size_t len = snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;%s%s",
+                        to_gdb_signum(sig), thread.pid, thread.tid, watch,
+                        no_history ? "replaylog:begin;" : "");
+  for (auto& reg : expedited) {
+    if (!reg.defined ||
+        len + 4 + 2 * GdbRegisterValue::MAX_SIZE >= sizeof(buf)) {
+      continue;
+    }
+    len += snprintf(&buf[len], sizeof(buf) - len, "%02x:", reg.name);
+    len += print_reg_value(reg, &buf[len]);
+    buf[len++] = ';';
+    buf[len] = '\0';
+  }
   write_packet(buf);
 }
 
 void GdbContext::notify_stop(GdbThreadId thread, int sig,
-                             uintptr_t watch_addr) {
+                             uintptr_t watch_addr,
+                             const vector<GdbRegisterValue>& expedited) {
   assert(req.is_resume_request() || req.type == DREQ_INTERRUPT);
 
   if (tgid != thread.pid) {
@@ -1220,7 +1528,7 @@ void GdbContext::notify_stop(GdbThreadId thread, int sig,
     // the next stop we're willing to tell gdb about.
     return;
   }
-  send_stop_reply_packet(thread, sig, watch_addr);
+  send_stop_reply_packet(thread, sig, watch_addr, expedited);
 
   // This isn't documented in the gdb remote protocol, but if we
   // don't do this, gdb will sometimes continue to send requests
@@ -1233,6 +1541,17 @@ void GdbContext::notify_stop(GdbThreadId thread, int sig,
   consume_request();
 }
 
+void GdbContext::notify_no_history(GdbThreadId thread,
+                                   const vector<GdbRegisterValue>& expedited) {
+  assert(req.is_reverse_request());
+
+  send_stop_reply_packet(thread, SIGTRAP, 0, expedited, true);
+  query_thread = thread;
+  resume_thread = thread;
+
+  consume_request();
+}
+
 void GdbContext::notify_restart_failed() {
   assert(DREQ_RESTART == req.type);
 
@@ -1303,7 +1622,14 @@ void GdbContext::reply_get_mem(const vector<uint8_t>& mem) {
   assert(DREQ_GET_MEM == req.type);
   assert(mem.size() <= req.mem.len);
 
-  write_hex_bytes_packet(mem.data(), mem.size());
+  if (!binary_mem_reply) {
+    write_hex_bytes_packet(mem.data(), mem.size());
+  } else if (mem.empty() && req.mem.len > 0) {
+    // An empty 'b' reply would read as a successful zero-length read.
+    write_packet("E01");
+  } else {
+    write_binary_packet("b", mem.data(), mem.size());
+  }
 
   consume_request();
 }
@@ -1312,7 +1638,6 @@ void GdbContext::reply_set_mem(bool ok) {
   assert(DREQ_SET_MEM == req.type);
 
   write_packet(ok ? "OK" : "E01");
-  free((uint8_t*)req.mem.data);
 
   consume_request();
 }
@@ -1327,27 +1652,30 @@ void GdbContext::reply_get_offsets(/* TODO */) {
 }
 
 void GdbContext::reply_get_reg(const GdbRegisterValue& reg) {
-  char buf[2 * GdbRegisterValue::MAX_SIZE + 1];
-
   assert(DREQ_GET_REG == req.type);
 
-  print_reg_value(reg, buf);
-  write_packet(buf);
+  begin_packet();
+  char* buf = (char*)write_reserve(2 * GdbRegisterValue::MAX_SIZE + 1);
+  write_commit(print_reg_value(reg, buf));
+  end_packet();
 
   consume_request();
 }
 
 void GdbContext::reply_get_regs(const GdbRegisterFile& file) {
   size_t n_regs = file.total_registers();
-  char buf[n_regs * 2 * GdbRegisterValue::MAX_SIZE + 1];
 
   assert(DREQ_GET_REGS == req.type);
 
+  begin_packet();
+  char* buf =
+      (char*)write_reserve(n_regs * 2 * GdbRegisterValue::MAX_SIZE + 1);
   size_t offset = 0;
   for (auto it = file.regs.begin(), end = file.regs.end(); it != end; ++it) {
     offset += print_reg_value(*it, &buf[offset]);
   }
-  write_packet(buf);
+  write_commit(offset);
+  end_packet();
 
   consume_request();
 }
@@ -1368,41 +1696,131 @@ void GdbContext::reply_set_reg(bool ok) {
   consume_request();
 }
 
-void GdbContext::reply_get_stop_reason(GdbThreadId which, int sig) {
+void GdbContext::reply_get_stop_reason(
+    GdbThreadId which, int sig, const vector<GdbRegisterValue>& expedited) {
   assert(DREQ_GET_STOP_REASON == req.type);
 
-  send_stop_reply_packet(which, sig);
+  send_stop_reply_packet(which, sig, 0, expedited);
 
   consume_request();
 }
 
-void GdbContext::reply_get_thread_list(const vector<GdbThreadId>& threads) {
+static string xml_escape(const string& s) {
+  string escaped;
+  for (char c : s) {
+    switch (c) {
+      case '<':
+        escaped += "&lt;";
+        break;
+      case '>':
+        escaped += "&gt;";
+        break;
+      case '&':
+        escaped += "&amp;";
+        break;
+      case '"':
+        escaped += "&quot;";
+        break;
+      default:
+        escaped += c;
+        break;
+    }
+  }
+  return escaped;
+}
+
+void GdbContext::reply_get_thread_list(const vector<GdbThreadInfo>& threads) {
   assert(DREQ_GET_THREAD_LIST == req.type);
 
-  if (threads.empty()) {
-    write_packet("l");
-  } else {
-    ssize_t maxlen =
-        1 /*m char*/ +
-        threads.size() * (1 /*p*/ + 2 * sizeof(threads[0]) + 1 /*,*/) +
-        1 /*\0*/;
-    char* str = (char*)malloc(maxlen);
-    int offset = 0;
-
-    str[offset++] = 'm';
-    for (size_t i = 0; i < threads.size(); ++i) {
-      const GdbThreadId& t = threads[i];
-      if (tgid != t.pid) {
-        continue;
-      }
-      offset +=
-          snprintf(&str[offset], maxlen - offset, "p%02x.%02x,", t.pid, t.tid);
+  thread_snapshot.clear();
+  stringstream xml;
+  xml << "<?xml version=\"1.0\"?>\n<threads>\n";
+  for (auto& t : threads) {
+    if (tgid != t.id.pid) {
+      continue;
     }
-    /* Overwrite the trailing ',' */
-    str[offset - 1] = '\0';
+    thread_snapshot.push_back(t);
+    xml << "<thread id=\"p" << hex << t.id.pid << "." << t.id.tid
+        << "\" name=\"" << xml_escape(t.name) << "\"/>\n";
+  }
+  xml << "</threads>\n";
+  thread_snapshot_xml = xml.str();
+  thread_snapshot_valid = true;
 
-    write_packet(str);
-    free(str);
+  write_thread_list(thread_list_as_xml, req.mem.addr, req.mem.len);
+
+  consume_request();
+}
+
+const GdbThreadInfo* GdbContext::find_in_thread_snapshot(
+    const GdbThreadId& id) const {
+  if (!thread_snapshot_valid) {
+    return nullptr;
+  }
+  for (auto& t : thread_snapshot) {
+    if (t.id == id) {
+      return &t;
+    }
+  }
+  return nullptr;
+}
+
+void GdbContext::write_thread_list(bool as_xml, size_t offset, size_t len) {
+  assert(thread_snapshot_valid);
+
+  if (as_xml) {
+    if (offset >= thread_snapshot_xml.size()) {
+      write_packet("l");
+      return;
+    }
+    size_t n = min(len, thread_snapshot_xml.size() - offset);
+    write_binary_packet(offset + n < thread_snapshot_xml.size() ? "m" : "l",
+                        (const uint8_t*)thread_snapshot_xml.data() + offset,
+                        n);
+    return;
+  }
+
+  if (thread_snapshot.empty()) {
+    write_packet("l");
+    return;
+  }
+  stringstream list;
+  list << 'm' << hex;
+  for (size_t i = 0; i < thread_snapshot.size(); ++i) {
+    const GdbThreadId& t = thread_snapshot[i].id;
+    list << (i ? "," : "") << 'p' << setfill('0') << setw(2) << t.pid << '.'
+         << setw(2) << t.tid;
+  }
+  write_packet(list.str().c_str());
+}
+
+void GdbContext::reply_get_libraries(
+    uint64_t main_lm, const vector<GdbLibraryInfo>& libraries) {
+  assert(DREQ_GET_LIBRARIES == req.type);
+
+  if (!main_lm) {
+    write_packet("E01");
+    consume_request();
+    return;
+  }
+  stringstream xml;
+  xml << hex << "<library-list-svr4 version=\"1.0\" main-lm=\"0x" << main_lm
+      << "\">\n";
+  for (auto& lib : libraries) {
+    xml << "<library name=\"" << xml_escape(lib.name) << "\" lm=\"0x"
+        << lib.lm << "\" l_addr=\"0x" << lib.l_addr << "\" l_ld=\"0x"
+        << lib.l_ld << "\"/>\n";
+  }
+  xml << "</library-list-svr4>\n";
+  string doc = xml.str();
+
+  size_t offset = req.mem.addr;
+  if (offset >= doc.size()) {
+    write_packet("l");
+  } else {
+    size_t n = min(req.mem.len, doc.size() - offset);
+    write_binary_packet(offset + n < doc.size() ? "m" : "l",
+                        (const uint8_t*)doc.data() + offset, n);
   }
 
   consume_request();
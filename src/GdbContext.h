@@ -3,13 +3,16 @@
 #ifndef RR_GDB_CONTEXT_H_
 #define RR_GDB_CONTEXT_H_
 
+#include <pthread.h>
 #include <stddef.h>
 #include <sys/types.h>
 
 #include <memory>
 #include <ostream>
+#include <string>
 #include <vector>
 
+#include "GdbExpression.h"
 #include "GdbRegister.h"
 #include "ReplaySession.h"
 
@@ -35,6 +38,26 @@ inline std::ostream& operator<<(std::ostream& o, const GdbThreadId& t) {
   return o;
 }
 
+/**
+ * What the debugger host is told about a live thread.
+ */
+struct GdbThreadInfo {
+  GdbThreadId id;
+  std::string name;
+};
+
+/**
+ * What the debugger host is told about a loaded shared library: its path,
+ * the address of the dynamic linker's link_map for it, its load bias and
+ * the address of its dynamic section.
+ */
+struct GdbLibraryInfo {
+  std::string name;
+  uint64_t lm;
+  uint64_t l_addr;
+  uint64_t l_ld;
+};
+
 /**
  * Represents a possibly-undefined register |name|.  |size| indicates how
  * many bytes of |value| are valid, if any.
@@ -102,6 +125,8 @@ enum GdbRequestType {
   DREQ_CONTINUE,
   DREQ_INTERRUPT,
   DREQ_STEP,
+  DREQ_REVERSE_CONTINUE,
+  DREQ_REVERSE_STEP,
 
   /* gdb host detaching from stub.  No parameters. */
   DREQ_DETACH,
@@ -122,6 +147,13 @@ enum GdbRequestType {
   //
   // TODO: actual interface NYI.
   DREQ_WRITE_SIGINFO,
+
+  // gdb wants the shared libraries the dynamic linker has loaded, as a
+  // qXfer:libraries-svr4 document, rather than walking the linker's
+  // list in memory itself.
+  //
+  // Uses .target, and .mem for offset/len.
+  DREQ_GET_LIBRARIES,
 };
 
 enum GdbRestartType {
@@ -145,6 +177,10 @@ struct GdbRequest {
       // For SET_MEM requests, the stream of |len|
       // number of raw bytes that are to be written.
       const uint8_t* data;
+      // For SET_SW_BREAK requests, the breakpoint's conditions, or
+      // null if it has none.  The debugger only wants to stop if one
+      // of them evaluates to nonzero.  Valid until the next request.
+      const std::vector<GdbExpression>* conditions;
     } mem;
 
     GdbRegisterValue reg;
@@ -160,7 +196,15 @@ struct GdbRequest {
    * in some way.
    */
   bool is_resume_request() const {
-    return type == DREQ_CONTINUE || type == DREQ_STEP;
+    return type == DREQ_CONTINUE || type == DREQ_STEP ||
+           is_reverse_request();
+  }
+
+  /**
+   * Return true if this asks for execution to run backwards.
+   */
+  bool is_reverse_request() const {
+    return type == DREQ_REVERSE_CONTINUE || type == DREQ_REVERSE_STEP;
   }
 };
 
@@ -208,6 +252,20 @@ public:
       const std::string* exe_image = nullptr,
       ScopedFd* client_params_fd = nullptr);
 
+  /**
+   * The two halves of |await_client_connection()|: open the socket and
+   * tell the client about it, then later wait for the client to connect.
+   * A client that connects in between waits in the listen backlog, so
+   * rr can launch gdb early and let it load symbols while replay gets to
+   * where the debugger is wanted.
+   */
+  static ScopedFd listen_for_client(unsigned short desired_port,
+                                    ProbePort probe,
+                                    const std::string* exe_image = nullptr,
+                                    ScopedFd* client_params_fd = nullptr);
+  static std::unique_ptr<GdbContext> accept_client_connection(
+      ScopedFd& listen_fd, pid_t tgid);
+
   /**
    * Exec gdb using the params that were written to
    * |params_pipe_fd|.  Optionally, pre-define in the gdb client the set
@@ -215,6 +273,13 @@ public:
    */
   static void launch_gdb(ScopedFd& params_pipe_fd, const char* macros);
 
+  /**
+   * Report a client that closes the connection or asks to kill the
+   * target as a DREQ_DETACH, instead of exiting rr, so that the replay
+   * can be kept for the next client.
+   */
+  void report_disconnect_as_detach() { disconnect_detaches = true; }
+
   /**
    * Call this when the target of |req| is needed to fulfill the
    * request, but the target is dead.  This situation is a symptom of a
@@ -241,6 +306,14 @@ public:
    */
   GdbRequest get_request();
 
+  /**
+   * Return true if the debugger host has sent an interrupt that
+   * get_request() hasn't returned yet.  Never blocks or consumes
+   * input, so long-running operations that don't go through
+   * get_request() between steps can poll this to stop early.
+   */
+  bool interrupt_pending();
+
   /**
    * Notify the host that this process has exited with |code|.
    */
@@ -255,8 +328,20 @@ public:
    * Notify the host that a resume request has "finished", i.e., the
    * target has stopped executing for some reason.  |sig| is the signal
    * that stopped execution, or 0 if execution stopped otherwise.
+   * |expedited| registers are sent along with the stop so that gdb
+   * doesn't have to ask for them.
+   */
+  void notify_stop(GdbThreadId which, int sig, uintptr_t watch_addr = 0,
+                   const std::vector<GdbRegisterValue>& expedited =
+                       std::vector<GdbRegisterValue>());
+
+  /**
+   * Notify the host that a reverse-execution request stopped at the
+   * start of the replayable history of |which| without finding
+   * anything to stop at.
    */
-  void notify_stop(GdbThreadId which, int sig, uintptr_t watch_addr = 0);
+  void notify_no_history(GdbThreadId which,
+                         const std::vector<GdbRegisterValue>& expedited);
 
   /** Notify the debugger that a restart request failed. */
   void notify_restart_failed();
@@ -272,6 +357,14 @@ public:
    */
   void reply_get_auxv(const std::vector<GdbAuxvPair>& auxv);
 
+  /**
+   * Reply with the shared |libraries| loaded into the target's process,
+   * whose own link_map is at |main_lm|.  |main_lm| is zero if there's no
+   * library list, in which case gdb reads it from memory itself.
+   */
+  void reply_get_libraries(uint64_t main_lm,
+                           const std::vector<GdbLibraryInfo>& libraries);
+
   /**
    * |alive| is true if the requested thread is alive, false if dead.
    */
@@ -325,13 +418,16 @@ public:
   /**
    * Reply to the DREQ_GET_STOP_REASON request.
    */
-  void reply_get_stop_reason(GdbThreadId which, int sig);
+  void reply_get_stop_reason(GdbThreadId which, int sig,
+                             const std::vector<GdbRegisterValue>& expedited =
+                                 std::vector<GdbRegisterValue>());
 
   /**
-   * |threads| contains the list of live threads, of which there are
-   * |len|.
+   * |threads| contains the list of live threads.  It's kept until
+   * execution resumes, to answer further thread queries without
+   * bothering the target.
    */
-  void reply_get_thread_list(const std::vector<GdbThreadId>& threads);
+  void reply_get_thread_list(const std::vector<GdbThreadInfo>& threads);
 
   /**
    * |ok| is true if the request was successfully applied, false if
@@ -378,6 +474,8 @@ public:
    */
   ReplaySession::shr_ptr get_checkpoint(int checkpoint_id);
 
+  ~GdbContext();
+
 private:
   GdbContext(pid_t tgid);
 
@@ -388,15 +486,39 @@ private:
   void await_debugger(ScopedFd& listen_fd);
 
   /**
-   * read() incoming data exactly one time, successfully.  May block.
+   * Start the thread that reads from |sock_fd|.
+   */
+  void start_io_thread();
+  static void* io_thread_callback(void* p);
+  void io_thread_loop();
+  /**
+   * Take data read by the I/O thread exactly one time, successfully.
+   * May block.
    */
   void read_data_once();
+  /**
+   * Return true if gdb closed the socket and nothing it sent before
+   * that is left to be read.
+   */
+  bool client_disconnected();
   /**
    * Send all pending output to gdb.  May block.
    */
   void write_flush();
   void write_data_raw(const uint8_t* data, ssize_t len);
-  void write_hex(unsigned long hex);
+  /**
+   * Return space for up to |len| bytes of output, which is written in
+   * place and then committed with write_commit().  Nothing is copied
+   * or allocated.
+   */
+  uint8_t* write_reserve(size_t len);
+  void write_commit(size_t len) { outlen += len; }
+  /**
+   * Start a packet whose payload is then written with write_data_raw()
+   * or write_reserve(), and end it by appending its checksum.
+   */
+  void begin_packet();
+  void end_packet();
   void write_packet_bytes(const uint8_t* data, size_t num_bytes);
   void write_packet(const char* data);
   void write_binary_packet(const char* pfx, const uint8_t* data,
@@ -448,8 +570,21 @@ private:
    */
   bool process_packet();
   void consume_request();
+  /**
+   * Return the thread |id| in |thread_snapshot|, or null if it isn't
+   * there.
+   */
+  const GdbThreadInfo* find_in_thread_snapshot(const GdbThreadId& id) const;
+  /**
+   * Send |thread_snapshot| in reply to qfThreadInfo, or the chunk at
+   * |offset| of at most |len| bytes of it in reply to
+   * qXfer:threads:read if |as_xml|.
+   */
+  void write_thread_list(bool as_xml, size_t offset, size_t len);
   void send_stop_reply_packet(GdbThreadId thread, int sig,
-                              uintptr_t watch_addr = 0);
+                              uintptr_t watch_addr,
+                              const std::vector<GdbRegisterValue>& expedited,
+                              bool no_history = false);
 
   // Current request to be processed.
   GdbRequest req;
@@ -464,13 +599,60 @@ private:
   // true when "no-ack mode" enabled, in which we don't have
   // to send ack packets back to gdb.  This is a huge perf win.
   bool no_ack;
+  // See report_disconnect_as_detach().
+  bool disconnect_detaches;
+  // true when the pending DREQ_GET_MEM came from an 'x' packet, so
+  // the reply is binary rather than hex.
+  bool binary_mem_reply;
+  // Conditions parsed from the last 'Z' packet.
+  std::vector<GdbExpression> breakpoint_conditions;
+  // The data of the pending DREQ_SET_MEM.  Its capacity is kept from
+  // one write to the next.
+  std::vector<uint8_t> set_mem_data;
+  // The threads of |tgid| at the current stop, once the target has
+  // listed them.  gdb asks about threads over and over at each stop,
+  // so those queries are answered from here until execution resumes.
+  std::vector<GdbThreadInfo> thread_snapshot;
+  std::string thread_snapshot_xml;
+  bool thread_snapshot_valid;
+  // true when the pending DREQ_GET_THREAD_LIST came from
+  // qXfer:threads:read, so the reply is XML rather than a list.
+  bool thread_list_as_xml;
   ScopedFd sock_fd;
   /* XXX probably need to dynamically size these */
-  uint8_t inbuf[32768];  /* buffered input from gdb */
-  ssize_t inlen;         /* length of valid data */
-  ssize_t packetend;     /* index of '#' character */
-  uint8_t outbuf[32768]; /* buffered output for gdb */
+  uint8_t inbuf[1 << 18]; /* buffered input from gdb */
+  ssize_t inlen;          /* length of valid data */
+  ssize_t packetend;      /* index of '#' character */
+  uint8_t outbuf[1 << 18]; /* buffered output for gdb */
   ssize_t outlen;
+  ssize_t packet_start; /* index of the packet being written's payload */
+  // Number of interrupts read_packet() has returned.
+  uint64_t interrupts_consumed;
+
+  // Socket reads happen on a separate thread, so that interrupts are
+  // seen while the replay thread is busy.  Tracees can only be
+  // ptrace'd from the replay thread, so that's where requests are
+  // still parsed and answered.  The I/O thread never allocates, which
+  // keeps forking tracees from the replay thread safe.
+  pthread_t io_thread;
+  bool io_thread_started;
+  pthread_mutex_t io_mutex;
+  pthread_cond_t io_cond;
+  ScopedFd io_shutdown_read_fd;
+  ScopedFd io_shutdown_write_fd;
+  // BEGIN protected by 'io_mutex'
+  uint8_t io_buf[1 << 16]; /* read from gdb, not yet taken into inbuf */
+  ssize_t io_len;
+  // Set when gdb closed the socket or reading it failed with |io_errno|.
+  bool io_closed;
+  int io_errno;
+  bool io_closing;
+  uint64_t io_interrupts_seen;
+  // END protected by 'io_mutex'
+  // Packet framing state of the I/O thread, to tell interrupts from
+  // packet payload bytes.
+  bool io_in_packet;
+  int io_checksum_left;
 };
 
 #endif /* RR_GDB_CONTEXT_H_ */
@@ -0,0 +1,299 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "GdbExpression"
+
+#include "GdbExpression.h"
+
+#include "GdbRegister.h"
+#include "log.h"
+#include "task.h"
+
+using namespace std;
+
+// Bytecode values, from gdb's common/ax.def.
+enum Opcode {
+  OP_ADD = 0x02,
+  OP_SUB = 0x03,
+  OP_MUL = 0x04,
+  OP_DIV_SIGNED = 0x05,
+  OP_DIV_UNSIGNED = 0x06,
+  OP_REM_SIGNED = 0x07,
+  OP_REM_UNSIGNED = 0x08,
+  OP_LSH = 0x09,
+  OP_RSH_SIGNED = 0x0a,
+  OP_RSH_UNSIGNED = 0x0b,
+  OP_LOG_NOT = 0x0e,
+  OP_BIT_AND = 0x0f,
+  OP_BIT_OR = 0x10,
+  OP_BIT_XOR = 0x11,
+  OP_BIT_NOT = 0x12,
+  OP_EQUAL = 0x13,
+  OP_LESS_SIGNED = 0x14,
+  OP_LESS_UNSIGNED = 0x15,
+  OP_EXT = 0x16,
+  OP_REF8 = 0x17,
+  OP_REF16 = 0x18,
+  OP_REF32 = 0x19,
+  OP_REF64 = 0x1a,
+  OP_IF_GOTO = 0x20,
+  OP_GOTO = 0x21,
+  OP_CONST8 = 0x22,
+  OP_CONST16 = 0x23,
+  OP_CONST32 = 0x24,
+  OP_CONST64 = 0x25,
+  OP_REG = 0x26,
+  OP_END = 0x27,
+  OP_DUP = 0x28,
+  OP_POP = 0x29,
+  OP_ZERO_EXT = 0x2a,
+  OP_SWAP = 0x2b,
+  OP_PICK = 0x32,
+  OP_ROT = 0x33,
+};
+
+// gdb's own limit for agent expression stacks.
+static const size_t MAX_STACK_DEPTH = 1024;
+// Conditions can loop; give up on ones that don't finish quickly.
+static const size_t MAX_STEPS = 100000;
+
+GdbExpression::GdbExpression(const uint8_t* data, size_t size)
+    : bytecode(data, data + size) {}
+
+/**
+ * Read the |size|-byte big-endian operand at |*pc|, advancing |*pc|
+ * past it.  Return false if it runs off the end of |bytecode|.
+ */
+static bool fetch(const vector<uint8_t>& bytecode, size_t* pc, size_t size,
+                  uint64_t* value) {
+  if (*pc + size > bytecode.size()) {
+    return false;
+  }
+  *value = 0;
+  for (size_t i = 0; i < size; ++i) {
+    *value = (*value << 8) | bytecode[(*pc)++];
+  }
+  return true;
+}
+
+static int64_t sign_extend(uint64_t value, uint64_t bits) {
+  if (bits == 0 || bits >= 64) {
+    return value;
+  }
+  uint64_t sign = uint64_t(1) << (bits - 1);
+  value &= (sign << 1) - 1;
+  return (value ^ sign) - sign;
+}
+
+static uint64_t zero_extend(uint64_t value, uint64_t bits) {
+  if (bits >= 64) {
+    return value;
+  }
+  return value & ((uint64_t(1) << bits) - 1);
+}
+
+bool GdbExpression::evaluate(Task* t, int64_t* result) const {
+  vector<uint64_t> stack;
+  size_t pc = 0;
+
+#define NEED(n)                                                                \
+  if (stack.size() < (n)) {                                                    \
+    LOG(debug) << "agent expression stack underflow at " << pc;               \
+    return false;                                                              \
+  }
+#define OPERAND(size, v)                                                       \
+  if (!fetch(bytecode, &pc, (size), &(v))) {                                   \
+    return false;                                                              \
+  }
+
+  for (size_t steps = 0; steps < MAX_STEPS; ++steps) {
+    if (pc >= bytecode.size() || stack.size() > MAX_STACK_DEPTH) {
+      return false;
+    }
+    uint8_t op = bytecode[pc++];
+    uint64_t a, b, operand;
+    switch (op) {
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV_SIGNED:
+      case OP_DIV_UNSIGNED:
+      case OP_REM_SIGNED:
+      case OP_REM_UNSIGNED:
+      case OP_LSH:
+      case OP_RSH_SIGNED:
+      case OP_RSH_UNSIGNED:
+      case OP_BIT_AND:
+      case OP_BIT_OR:
+      case OP_BIT_XOR:
+      case OP_EQUAL:
+      case OP_LESS_SIGNED:
+      case OP_LESS_UNSIGNED:
+        NEED(2);
+        b = stack.back();
+        stack.pop_back();
+        a = stack.back();
+        switch (op) {
+          case OP_ADD:
+            a += b;
+            break;
+          case OP_SUB:
+            a -= b;
+            break;
+          case OP_MUL:
+            a *= b;
+            break;
+          case OP_DIV_SIGNED:
+          case OP_REM_SIGNED:
+            if (b == 0 ||
+                (int64_t(a) == INT64_MIN && int64_t(b) == -1)) {
+              return false;
+            }
+            a = op == OP_DIV_SIGNED ? int64_t(a) / int64_t(b)
+                                    : int64_t(a) % int64_t(b);
+            break;
+          case OP_DIV_UNSIGNED:
+          case OP_REM_UNSIGNED:
+            if (b == 0) {
+              return false;
+            }
+            a = op == OP_DIV_UNSIGNED ? a / b : a % b;
+            break;
+          case OP_LSH:
+            a = b >= 64 ? 0 : a << b;
+            break;
+          case OP_RSH_SIGNED:
+            a = int64_t(a) >> (b >= 64 ? 63 : b);
+            break;
+          case OP_RSH_UNSIGNED:
+            a = b >= 64 ? 0 : a >> b;
+            break;
+          case OP_BIT_AND:
+            a &= b;
+            break;
+          case OP_BIT_OR:
+            a |= b;
+            break;
+          case OP_BIT_XOR:
+            a ^= b;
+            break;
+          case OP_EQUAL:
+            a = a == b;
+            break;
+          case OP_LESS_SIGNED:
+            a = int64_t(a) < int64_t(b);
+            break;
+          case OP_LESS_UNSIGNED:
+            a = a < b;
+            break;
+        }
+        stack.back() = a;
+        break;
+      case OP_LOG_NOT:
+        NEED(1);
+        stack.back() = !stack.back();
+        break;
+      case OP_BIT_NOT:
+        NEED(1);
+        stack.back() = ~stack.back();
+        break;
+      case OP_EXT:
+        OPERAND(1, operand);
+        NEED(1);
+        stack.back() = sign_extend(stack.back(), operand);
+        break;
+      case OP_ZERO_EXT:
+        OPERAND(1, operand);
+        NEED(1);
+        stack.back() = zero_extend(stack.back(), operand);
+        break;
+      case OP_REF8:
+      case OP_REF16:
+      case OP_REF32:
+      case OP_REF64: {
+        NEED(1);
+        size_t size = size_t(1) << (op - OP_REF8);
+        uint64_t value = 0;
+        if (ssize_t(size) != t->read_bytes_fallible(
+                                 remote_ptr<void>(stack.back()), size, &value)) {
+          LOG(debug) << "agent expression can't read "
+                     << HEX(stack.back());
+          return false;
+        }
+        stack.back() = value;
+        break;
+      }
+      case OP_IF_GOTO:
+        OPERAND(2, operand);
+        NEED(1);
+        a = stack.back();
+        stack.pop_back();
+        if (a) {
+          pc = operand;
+        }
+        break;
+      case OP_GOTO:
+        OPERAND(2, operand);
+        pc = operand;
+        break;
+      case OP_CONST8:
+      case OP_CONST16:
+      case OP_CONST32:
+      case OP_CONST64:
+        OPERAND(size_t(1) << (op - OP_CONST8), operand);
+        stack.push_back(operand);
+        break;
+      case OP_REG: {
+        OPERAND(2, operand);
+        uint8_t buf[64];
+        bool defined = false;
+        size_t size = t->get_reg(buf, GdbRegister(operand), &defined);
+        if (!defined || size == 0 || size > sizeof(uint64_t)) {
+          LOG(debug) << "agent expression can't read register " << operand;
+          return false;
+        }
+        uint64_t value = 0;
+        memcpy(&value, buf, size);
+        stack.push_back(value);
+        break;
+      }
+      case OP_END:
+        NEED(1);
+        *result = stack.back();
+        return true;
+      case OP_DUP:
+        NEED(1);
+        stack.push_back(stack.back());
+        break;
+      case OP_POP:
+        NEED(1);
+        stack.pop_back();
+        break;
+      case OP_SWAP:
+        NEED(2);
+        swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+        break;
+      case OP_PICK:
+        OPERAND(1, operand);
+        NEED(operand + 1);
+        stack.push_back(stack[stack.size() - 1 - operand]);
+        break;
+      case OP_ROT: {
+        NEED(3);
+        size_t n = stack.size();
+        uint64_t top = stack[n - 1];
+        stack[n - 1] = stack[n - 2];
+        stack[n - 2] = stack[n - 3];
+        stack[n - 3] = top;
+        break;
+      }
+      default:
+        LOG(debug) << "unsupported agent expression bytecode " << HEX(op);
+        return false;
+    }
+  }
+  LOG(debug) << "agent expression didn't finish in " << MAX_STEPS << " steps";
+  return false;
+
+#undef NEED
+#undef OPERAND
+}
@@ -0,0 +1,37 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_GDB_EXPRESSION_H_
+#define RR_GDB_EXPRESSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+class Task;
+
+/**
+ * A gdb agent expression, as sent with breakpoint conditions. See
+ * http://sourceware.org/gdb/onlinedocs/gdb/Agent-Expressions.html
+ *
+ * Only the bytecodes that compute a value are supported; expressions
+ * using floating point, tracing, trace state variables or printf fail
+ * to evaluate.
+ */
+class GdbExpression {
+public:
+  GdbExpression(const uint8_t* data, size_t size);
+
+  /**
+   * Evaluate this expression in the context of |t|. Return false if
+   * it can't be evaluated (an unsupported bytecode, a memory read
+   * fault, a division by zero, ...); otherwise set |*result| to its
+   * value and return true.
+   */
+  bool evaluate(Task* t, int64_t* result) const;
+
+private:
+  std::vector<uint8_t> bytecode;
+};
+
+#endif /* RR_GDB_EXPRESSION_H_ */
@@ -0,0 +1,134 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "LogRing"
+
+#include "LogRing.h"
+
+#include <algorithm>
+
+using namespace std;
+
+struct LogRing::Record {
+  // The message's sequence number plus one once it's complete, 0 while
+  // it's being written.
+  atomic<uint64_t> seq;
+  const char* file;
+  const char* function;
+  int line;
+  uint8_t nargs;
+  uint8_t text_used;
+  bool truncated;
+  uint8_t types[MAX_ARGS];
+  uint64_t values[MAX_ARGS];
+  char text[TEXT_SIZE];
+};
+
+LogRing::Record* LogRing::ring;
+size_t LogRing::ring_size;
+atomic<uint64_t> LogRing::next_seq;
+
+/* static */ void LogRing::init(size_t records) {
+  ring_size = records;
+  ring = new Record[records];
+  for (size_t i = 0; i < records; ++i) {
+    ring[i].seq = 0;
+  }
+}
+
+LogRing::Stream::Stream(const char* file, int line, const char* function)
+    : seq(next_seq.fetch_add(1)) {
+  record = &ring[seq % ring_size];
+  record->seq.store(0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  record->file = file;
+  record->function = function;
+  record->line = line;
+  record->nargs = 0;
+  record->text_used = 0;
+  record->truncated = false;
+}
+
+LogRing::Stream::~Stream() { record->seq.store(seq + 1, memory_order_release); }
+
+void LogRing::Stream::add(ArgType type, uint64_t value) {
+  if (record->nargs == MAX_ARGS) {
+    record->truncated = true;
+    return;
+  }
+  record->types[record->nargs] = type;
+  record->values[record->nargs] = value;
+  ++record->nargs;
+}
+
+void LogRing::Stream::add_text(const char* text, size_t len) {
+  size_t offset = record->text_used;
+  len = min<size_t>(len, TEXT_SIZE - offset);
+  if (len == 0 && text[0]) {
+    record->truncated = true;
+    return;
+  }
+  memcpy(record->text + offset, text, len);
+  record->text_used += len;
+  add(TEXT, (offset << 8) | len);
+}
+
+/* static */ void LogRing::dump_record(ostream& out, const Record& r) {
+  out << "[" << r.file << ":" << r.line << ":" << r.function << "()] ";
+  for (int i = 0; i < r.nargs; ++i) {
+    uint64_t v = r.values[i];
+    switch (r.types[i]) {
+      case BOOL:
+        out << (v != 0);
+        break;
+      case CHAR:
+        out << char(v);
+        break;
+      case INT:
+        out << int64_t(v);
+        break;
+      case UINT:
+        out << v;
+        break;
+      case DOUBLE: {
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        out << d;
+        break;
+      }
+      case POINTER:
+        out << reinterpret_cast<void*>(uintptr_t(v));
+        break;
+      case LITERAL:
+        out << reinterpret_cast<const char*>(uintptr_t(v));
+        break;
+      case TEXT:
+        out.write(r.text + (v >> 8), v & 0xff);
+        break;
+    }
+  }
+  if (r.truncated) {
+    out << " ...";
+  }
+  out << "\n";
+}
+
+/* static */ void LogRing::dump(ostream& out) {
+  uint64_t end = next_seq.load();
+  uint64_t begin = end > ring_size ? end - ring_size : 0;
+  out << "=== Last " << end - begin << " debug log messages ===\n";
+  for (uint64_t seq = begin; seq < end; ++seq) {
+    const Record& slot = ring[seq % ring_size];
+    if (slot.seq.load(memory_order_acquire) != seq + 1) {
+      // Still being written, or already overwritten.
+      continue;
+    }
+    Record r;
+    memcpy(static_cast<void*>(&r), &slot, sizeof(r));
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.seq.load(memory_order_relaxed) != seq + 1) {
+      continue;
+    }
+    dump_record(out, r);
+  }
+  out << "=== End of debug log messages ===" << endl;
+}
@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_LOG_RING_H_
+#define RR_LOG_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+/**
+ * LogRing keeps the most recent LOG(debug) messages of files that don't
+ * #define DEBUGTAG in a fixed ring of binary records, so they can be
+ * printed when rr dies (see --log-ring) without paying for formatting
+ * every message along the way.
+ *
+ * A message's arguments are stored as they're streamed: numbers and
+ * pointers as raw words, char arrays (assumed to be string literals) as
+ * pointers and strings by copying them into the record.  Only arguments
+ * of other types are formatted, into the record's text space.  Records
+ * are claimed with an atomic increment, so any thread may log.
+ */
+class LogRing {
+  struct Record;
+  enum ArgType : uint8_t {
+    BOOL,
+    CHAR,
+    INT,
+    UINT,
+    DOUBLE,
+    POINTER,
+    LITERAL,
+    TEXT
+  };
+
+public:
+  enum {
+    MAX_ARGS = 16,
+    TEXT_SIZE = 96
+  };
+
+  /**
+   * Start keeping the last |records| messages.  Call once, before other
+   * threads are started.
+   */
+  static void init(size_t records);
+  static bool enabled() { return ring != nullptr; }
+  /**
+   * Format the kept messages, oldest first, to |out|.
+   */
+  static void dump(std::ostream& out);
+
+  class Stream {
+  public:
+    Stream(const char* file, int line, const char* function);
+    ~Stream();
+
+    template <size_t N> Stream& operator<<(const char(&v)[N]) {
+      add(LITERAL, reinterpret_cast<uintptr_t>(v));
+      return *this;
+    }
+    template <typename T> Stream& operator<<(const T& v) {
+      add_value(v);
+      return *this;
+    }
+
+  private:
+    void add_value(bool v) { add(BOOL, v); }
+    void add_value(char v) { add(CHAR, v); }
+    void add_value(short v) { add(INT, v); }
+    void add_value(int v) { add(INT, v); }
+    void add_value(long v) { add(INT, v); }
+    void add_value(long long v) { add(INT, v); }
+    void add_value(unsigned char v) { add(UINT, v); }
+    void add_value(unsigned short v) { add(UINT, v); }
+    void add_value(unsigned int v) { add(UINT, v); }
+    void add_value(unsigned long v) { add(UINT, v); }
+    void add_value(unsigned long long v) { add(UINT, v); }
+    void add_value(double v) {
+      uint64_t bits;
+      memcpy(&bits, &v, sizeof(bits));
+      add(DOUBLE, bits);
+    }
+    template <typename T> void add_value(T* v) {
+      add(POINTER, reinterpret_cast<uintptr_t>(v));
+    }
+    void add_value(const char* v) { add_text(v, strlen(v)); }
+    void add_value(char* v) { add_value(static_cast<const char*>(v)); }
+    void add_value(const std::string& v) { add_text(v.data(), v.size()); }
+    template <typename T> void add_value(const T& v) {
+      std::ostringstream ss;
+      ss << v;
+      std::string s = ss.str();
+      add_text(s.data(), s.size());
+    }
+
+    void add(ArgType type, uint64_t value);
+    void add_text(const char* text, size_t len);
+
+    Record* record;
+    uint64_t seq;
+  };
+
+private:
+  static void dump_record(std::ostream& out, const Record& r);
+
+  static Record* ring;
+  static size_t ring_size;
+  static std::atomic<uint64_t> next_seq;
+};
+
+#endif /* RR_LOG_RING_H_ */
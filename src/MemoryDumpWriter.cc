@@ -0,0 +1,139 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "MemoryDumpWriter"
+
+#include "MemoryDumpWriter.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include "log.h"
+
+using namespace std;
+
+MemoryDumpWriter& MemoryDumpWriter::get() {
+  static MemoryDumpWriter writer;
+  return writer;
+}
+
+MemoryDumpWriter::MemoryDumpWriter()
+    : pending_bytes(0), closing(false) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  pthread_create(&thread, nullptr, thread_callback, this);
+}
+
+MemoryDumpWriter::~MemoryDumpWriter() {
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, nullptr);
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+void MemoryDumpWriter::write(const string& filename, vector<Range>&& ranges) {
+  Dump dump;
+  dump.filename = filename;
+  dump.ranges = move(ranges);
+  dump.bytes = 0;
+  for (auto& r : dump.ranges) {
+    dump.bytes += r.data.size();
+  }
+
+  pthread_mutex_lock(&mutex);
+  // Always accept a dump when nothing's queued, however big it is.
+  while (!pending.empty() &&
+         pending_bytes + dump.bytes > MAX_PENDING_BYTES) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pending_bytes += dump.bytes;
+  pending.push_back(move(dump));
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+void MemoryDumpWriter::flush() {
+  pthread_mutex_lock(&mutex);
+  while (!pending.empty()) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+/* static */ void* MemoryDumpWriter::thread_callback(void* p) {
+  static_cast<MemoryDumpWriter*>(p)->write_dumps();
+  return nullptr;
+}
+
+void MemoryDumpWriter::write_dumps() {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    if (pending.empty()) {
+      if (closing) {
+        break;
+      }
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+    // Leave the dump queued while it's written, so flush() waits for it.
+    const Dump& dump = pending.front();
+    pthread_mutex_unlock(&mutex);
+    write_dump(dump);
+    pthread_mutex_lock(&mutex);
+    pending_bytes -= pending.front().bytes;
+    pending.pop_front();
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+static char* format_hex(char* p, uint64_t v, int min_digits) {
+  static const char digits[] = "0123456789abcdef";
+  char buf[16];
+  int n = 0;
+  do {
+    buf[n++] = digits[v & 0xf];
+    v >>= 4;
+  } while (v || n < min_digits);
+  *p++ = '0';
+  *p++ = 'x';
+  while (n > 0) {
+    *p++ = buf[--n];
+  }
+  return p;
+}
+
+/* static */ void MemoryDumpWriter::write_dump(const Dump& dump) {
+  gzFile out = gzopen64(dump.filename.c_str(), "wb1");
+  if (!out) {
+    LOG(warn) << "Can't create memory dump " << dump.filename;
+    return;
+  }
+  gzbuffer(out, 1024 * 1024);
+  // Format the same lines as dump_binary_data(), a batch at a time.
+  string text;
+  for (auto& r : dump.ranges) {
+    text = r.label + '\n';
+    size_t words = r.data.size() / sizeof(uint32_t);
+    const uint32_t* data = reinterpret_cast<const uint32_t*>(r.data.data());
+    for (size_t i = 0; i < words; ++i) {
+      char line[64];
+      char* p = format_hex(line, data[i], 8);
+      memcpy(p, " | [", 4);
+      p = format_hex(p + 4, r.addr.as_int() + i * sizeof(uint32_t), 1);
+      *p++ = ']';
+      *p++ = '\n';
+      text.append(line, p - line);
+      if (text.size() >= 1024 * 1024) {
+        gzwrite(out, text.data(), text.size());
+        text.clear();
+      }
+    }
+    gzwrite(out, text.data(), text.size());
+  }
+  if (gzclose(out) != Z_OK) {
+    LOG(warn) << "Failed to write memory dump " << dump.filename;
+  }
+}
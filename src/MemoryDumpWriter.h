@@ -0,0 +1,72 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_MEMORY_DUMP_WRITER_H_
+#define RR_MEMORY_DUMP_WRITER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "remote_ptr.h"
+
+/**
+ * MemoryDumpWriter writes the memory dumps taken by dump_process_memory().
+ * The caller copies the tracee's memory into buffers while the tracee is
+ * stopped and hands them over; a background thread formats them as
+ * "0xValue | [0xAddr]" lines and writes them gzip-compressed, so the
+ * tracee can run on while a (possibly huge) dump is written.
+ *
+ * At most MAX_PENDING_BYTES of memory is queued; write() blocks while more
+ * is. Dumps still queued when rr exits normally are finished first; call
+ * flush() before anything that might kill rr if a dump must be complete.
+ */
+class MemoryDumpWriter {
+public:
+  struct Range {
+    std::string label;
+    remote_ptr<void> addr;
+    std::vector<uint8_t> data;
+  };
+
+  static MemoryDumpWriter& get();
+
+  /**
+   * Queue |ranges| to be written to |filename|.
+   */
+  void write(const std::string& filename, std::vector<Range>&& ranges);
+  /**
+   * Wait until all queued dumps have been written.
+   */
+  void flush();
+
+  enum {
+    MAX_PENDING_BYTES = 512 * 1024 * 1024
+  };
+
+private:
+  struct Dump {
+    std::string filename;
+    std::vector<Range> ranges;
+    size_t bytes;
+  };
+
+  MemoryDumpWriter();
+  ~MemoryDumpWriter();
+
+  static void* thread_callback(void* p);
+  void write_dumps();
+  static void write_dump(const Dump& dump);
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Protected by |mutex|.
+  std::deque<Dump> pending;
+  size_t pending_bytes;
+  bool closing;
+};
+
+#endif /* RR_MEMORY_DUMP_WRITER_H_ */
@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "OutputSink"
+
+#define _LARGEFILE64_SOURCE
+
+#include "OutputSink.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <map>
+#include <vector>
+
+#include "log.h"
+
+using namespace std;
+
+// Longest file name we accept from a sender.
+static const uint32_t MAX_NAME_LENGTH = 255;
+
+static bool write_all(int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = ::write(fd, data, size);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    data = static_cast<const uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+/**
+ * Returns 1 if |size| bytes were read, 0 at EOF before any byte was read,
+ * and -1 on error or EOF in the middle.
+ */
+static int read_all(int fd, void* data, size_t size) {
+  size_t nread = 0;
+  while (nread < size) {
+    ssize_t ret = ::read(fd, static_cast<uint8_t*>(data) + nread, size - nread);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return ret == 0 && nread == 0 ? 0 : -1;
+    }
+    nread += ret;
+  }
+  return 1;
+}
+
+shared_ptr<OutputSink> OutputSink::open(const string& path) {
+  ScopedFd fd(path.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (!fd.is_open()) {
+    return nullptr;
+  }
+  return shared_ptr<OutputSink>(new OutputSink(move(fd)));
+}
+
+OutputSink::OutputSink(ScopedFd&& fd) : fd(move(fd)), error(false) {
+  pthread_mutex_init(&mutex, nullptr);
+}
+
+OutputSink::~OutputSink() { pthread_mutex_destroy(&mutex); }
+
+bool OutputSink::write(const string& name, const void* data, size_t size) {
+  assert(name.size() <= MAX_NAME_LENGTH && name.find('/') == string::npos);
+  pthread_mutex_lock(&mutex);
+  // Split writes too big for one record.
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  do {
+    RecordHeader header = { (uint32_t)name.size(),
+                            (uint32_t)min<size_t>(size, UINT32_MAX) };
+    error = error || !write_all(fd, &header, sizeof(header)) ||
+            !write_all(fd, name.c_str(), name.size()) ||
+            !write_all(fd, p, header.data_length);
+    p += header.data_length;
+    size -= header.data_length;
+  } while (!error && size > 0);
+  bool ok = !error;
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+bool OutputSink::send_file(const string& name, const string& path) {
+  ScopedFd in(path.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE);
+  if (!in.is_open()) {
+    return false;
+  }
+  vector<uint8_t> buf(64 * 1024);
+  // Always send a record, so that empty files are created too.
+  bool sent = false;
+  while (true) {
+    ssize_t nread = ::read(in, buf.data(), buf.size());
+    if (nread < 0) {
+      return false;
+    }
+    if (nread == 0 && sent) {
+      return true;
+    }
+    if (!write(name, buf.data(), nread)) {
+      return false;
+    }
+    if (nread == 0) {
+      return true;
+    }
+    sent = true;
+  }
+}
+
+bool OutputSink::receive(int fd, const string& dir) {
+  map<string, ScopedFd> files;
+  vector<uint8_t> buf;
+  while (true) {
+    RecordHeader header;
+    int ret = read_all(fd, &header, sizeof(header));
+    if (ret <= 0) {
+      return ret == 0;
+    }
+    if (header.name_length == 0 || header.name_length > MAX_NAME_LENGTH) {
+      LOG(error) << "Bad file name length " << header.name_length;
+      return false;
+    }
+    string name(header.name_length, '\0');
+    if (read_all(fd, &name[0], name.size()) <= 0 ||
+        name.find('/') != string::npos || name == "." || name == "..") {
+      LOG(error) << "Bad file name `" << name << "'";
+      return false;
+    }
+    buf.resize(header.data_length);
+    if (read_all(fd, buf.data(), buf.size()) < 0) {
+      LOG(error) << "Truncated record for `" << name << "'";
+      return false;
+    }
+
+    auto it = files.find(name);
+    if (it == files.end()) {
+      string path = dir + "/" + name;
+      ScopedFd out(path.c_str(),
+                   O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE,
+                   0400);
+      if (!out.is_open()) {
+        LOG(error) << "Can't create `" << path << "'";
+        return false;
+      }
+      it = files.insert(make_pair(name, move(out))).first;
+    }
+    if (!write_all(it->second, buf.data(), buf.size())) {
+      LOG(error) << "Can't write `" << dir << "/" << name << "'";
+      return false;
+    }
+  }
+}
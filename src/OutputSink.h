@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_OUTPUT_SINK_H_
+#define RR_OUTPUT_SINK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "ScopedFd.h"
+
+/**
+ * OutputSink multiplexes the contents of several files onto one output,
+ * typically a pipe, FIFO or socket, so that a collector at the other end
+ * (see receive()) can recreate the files without the writer keeping them
+ * on local disk.
+ *
+ * The output is a sequence of records, each a RecordHeader, the file name
+ * and then |data_length| bytes to append to that file. write() may be
+ * called from any thread; records are never interleaved. write() blocks
+ * while the collector isn't keeping up, which stalls CompressedWriter's
+ * compression threads and in turn the producer.
+ */
+class OutputSink {
+public:
+  struct RecordHeader {
+    uint32_t name_length;
+    uint32_t data_length;
+  };
+
+  /**
+   * Open 'path' for writing. Returns null on failure.
+   */
+  static std::shared_ptr<OutputSink> open(const std::string& path);
+  ~OutputSink();
+
+  /**
+   * Append 'data' to the file 'name'. Returns false if the output failed.
+   */
+  bool write(const std::string& name, const void* data, size_t size);
+  /**
+   * Send the contents of the local file 'path' as the file 'name'.
+   */
+  bool send_file(const std::string& name, const std::string& path);
+
+  /**
+   * Read records from 'fd' until EOF, creating the files they name in
+   * 'dir'. Returns false if the input was malformed or a file couldn't be
+   * written.
+   */
+  static bool receive(int fd, const std::string& dir);
+
+private:
+  OutputSink(ScopedFd&& fd);
+
+  ScopedFd fd;
+  pthread_mutex_t mutex;
+  // Protected by |mutex|
+  bool error;
+};
+
+#endif /* RR_OUTPUT_SINK_H_ */
@@ -10,22 +10,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <string>
+#include <vector>
 
 #include "log.h"
+#include "ProbeCache.h"
 #include "util.h"
 
 using namespace std;
 
 static bool attributes_initialized;
+static Ticks pmu_skid_size;
 static struct perf_event_attr ticks_attr;
-static struct perf_event_attr page_faults_attr;
-static struct perf_event_attr hw_interrupts_attr;
-static struct perf_event_attr instructions_retired_attr;
+static vector<struct perf_event_attr> extra_attrs;
+
+/**
+ * The extra counters that can be selected with |rr record
+ * --perf-counters|.
+ */
+struct ExtraCounter {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+static const ExtraCounter extra_counters[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+  { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+  { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  // The event is looked up in the CPU's PmuConfig.
+  { "hw-interrupts", PERF_TYPE_RAW, 0 },
+};
 
 /*
  * Find out the cpu model using the cpuid instruction.
@@ -51,25 +75,29 @@ struct PmuConfig {
   unsigned rcb_cntr_event;
   unsigned rinsn_cntr_event;
   unsigned hw_intr_cntr_event;
+  // The most ticks a counter interrupt is expected to skid past its
+  // programmed target.  When a uarch's |rr replay -S| skid statistics
+  // show a smaller tail, lower this to shrink the replay slack region.
+  unsigned skid_size;
   bool supported;
 };
 
 // XXX please only edit this if you really know what you're doing.
 static const PmuConfig
 pmu_configs[] = { { IntelBroadwell, "Intel Broadwell", 0x5101c4,
-                    0x5100c0,       0x5301cb,          true },
+                    0x5100c0,       0x5301cb,          70, true },
                   { IntelHaswell, "Intel Haswell", 0x5101c4,
-                    0x5100c0,     0x5301cb,        true },
+                    0x5100c0,     0x5301cb,        70, true },
                   { IntelIvyBridge, "Intel Ivy Bridge", 0x5101c4,
-                    0x5100c0,       0x5301cb,           true },
+                    0x5100c0,       0x5301cb,           70, true },
                   { IntelSandyBridge, "Intel Sandy Bridge", 0x5101c4,
-                    0x5100c0,         0x5301cb,             true },
+                    0x5100c0,         0x5301cb,             70, true },
                   { IntelNehalem, "Intel Nehalem", 0x5101c4,
-                    0x5100c0,     0x50011d,        true },
+                    0x5100c0,     0x50011d,        70, true },
                   { IntelWestmere, "Intel Westmere", 0x5101c4,
-                    0x5100c0,      0x50011d,         true },
-                  { IntelPenryn, "Intel Penryn", 0, 0, 0, false },
-                  { IntelMerom, "Intel Merom", 0, 0, 0, false }, };
+                    0x5100c0,      0x50011d,         70, true },
+                  { IntelPenryn, "Intel Penryn", 0, 0, 0, 0, false },
+                  { IntelMerom, "Intel Merom", 0, 0, 0, 0, false }, };
 
 static string lowercase(const string& s) {
   string c = s;
@@ -78,23 +106,10 @@ static string lowercase(const string& s) {
 }
 
 /**
- * Return the detected, known microarchitecture of this CPU, or don't
- * return; i.e. never return UnknownCpu.
+ * Identify this CPU's microarchitecture by its CPUID signature, or don't
+ * return.
  */
-static CpuMicroarch get_cpu_microarch() {
-  string forced_uarch = lowercase(Flags::get().forced_uarch);
-  if (!forced_uarch.empty()) {
-    for (size_t i = 0; i < array_length(pmu_configs); ++i) {
-      const PmuConfig& pmu = pmu_configs[i];
-      string name = lowercase(pmu.name);
-      if (name.npos != name.find(forced_uarch)) {
-        LOG(info) << "Using forced uarch " << pmu.name;
-        return pmu.uarch;
-      }
-    }
-    FATAL() << "Forced uarch " << Flags::get().forced_uarch << " isn't known.";
-  }
-
+static CpuMicroarch probe_cpu_microarch() {
   unsigned int cpu_type, eax, ecx, edx;
   cpuid(CPUID_GETFEATURES, 0, &eax, &ecx, &edx);
   cpu_type = (eax & 0xF0FF0);
@@ -131,8 +146,43 @@ static CpuMicroarch get_cpu_microarch() {
   }
 }
 
+/**
+ * Return the detected, known microarchitecture of this CPU, or don't
+ * return; i.e. never return UnknownCpu.
+ */
+static CpuMicroarch get_cpu_microarch() {
+  string forced_uarch = lowercase(Flags::get().forced_uarch);
+  if (!forced_uarch.empty()) {
+    for (size_t i = 0; i < array_length(pmu_configs); ++i) {
+      const PmuConfig& pmu = pmu_configs[i];
+      string name = lowercase(pmu.name);
+      if (name.npos != name.find(forced_uarch)) {
+        LOG(info) << "Using forced uarch " << pmu.name;
+        return pmu.uarch;
+      }
+    }
+    FATAL() << "Forced uarch " << Flags::get().forced_uarch << " isn't known.";
+  }
+
+  string cached;
+  if (ProbeCache::get("uarch", &cached)) {
+    for (size_t i = 0; i < array_length(pmu_configs); ++i) {
+      if (cached == pmu_configs[i].name) {
+        return pmu_configs[i].uarch;
+      }
+    }
+  }
+  CpuMicroarch uarch = probe_cpu_microarch();
+  for (size_t i = 0; i < array_length(pmu_configs); ++i) {
+    if (uarch == pmu_configs[i].uarch) {
+      ProbeCache::set("uarch", pmu_configs[i].name);
+    }
+  }
+  return uarch;
+}
+
 static void init_perf_event_attr(struct perf_event_attr* attr,
-                                 perf_type_id type, unsigned config) {
+                                 uint32_t type, uint64_t config) {
   memset(attr, 0, sizeof(*attr));
   attr->type = type;
   attr->size = sizeof(*attr);
@@ -163,20 +213,96 @@ static void init_attributes() {
     FATAL() << "Microarchitecture `" << pmu->name << "' currently unsupported.";
   }
 
+  pmu_skid_size = pmu->skid_size;
   init_perf_event_attr(&ticks_attr, PERF_TYPE_RAW, pmu->rcb_cntr_event);
-  init_perf_event_attr(&instructions_retired_attr, PERF_TYPE_RAW,
-                       pmu->rinsn_cntr_event);
-  init_perf_event_attr(&hw_interrupts_attr, PERF_TYPE_RAW,
-                       pmu->hw_intr_cntr_event);
-  // libpfm encodes the event with this bit set, so we'll do the
-  // same thing.  Unclear if necessary.
-  hw_interrupts_attr.exclude_hv = 1;
-  init_perf_event_attr(&page_faults_attr, PERF_TYPE_SOFTWARE,
-                       PERF_COUNT_SW_PAGE_FAULTS);
+  if (PerfCounters::extra_perf_counters_enabled()) {
+    // Read all the counters with one read() of the ticks counter.
+    ticks_attr.read_format = PERF_FORMAT_GROUP;
+  }
+  for (auto& name : Flags::get().extra_perf_counters) {
+    for (auto& counter : extra_counters) {
+      if (name != counter.name) {
+        continue;
+      }
+      struct perf_event_attr attr;
+      if (name == "hw-interrupts") {
+        init_perf_event_attr(&attr, PERF_TYPE_RAW, pmu->hw_intr_cntr_event);
+        // libpfm encodes the event with this bit set, so we'll do the
+        // same thing.  Unclear if necessary.
+        attr.exclude_hv = 1;
+      } else {
+        init_perf_event_attr(&attr, counter.type, counter.config);
+      }
+      extra_attrs.push_back(attr);
+    }
+  }
+}
+
+/*static*/ bool PerfCounters::extra_perf_counters_enabled() {
+  return !Flags::get().extra_perf_counters.empty();
+}
+
+/*static*/ bool PerfCounters::parse_extra_counters(const string& list,
+                                                   vector<string>* names) {
+  names->clear();
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = min(list.find(',', start), list.size());
+    string name = list.substr(start, end - start);
+    bool known = false;
+    for (auto& counter : extra_counters) {
+      known |= name == counter.name;
+    }
+    if (!known || names->size() == MAX_EXTRA_COUNTERS) {
+      return false;
+    }
+    names->push_back(name);
+    start = end + 1;
+  }
+  return true;
 }
 
-PerfCounters::PerfCounters(pid_t tid) : tid(tid), started(false) {
+/*static*/ string PerfCounters::known_extra_counters() {
+  string names;
+  for (auto& counter : extra_counters) {
+    names += names.empty() ? "" : ",";
+    names += counter.name;
+  }
+  return names;
+}
+
+/*static*/ Ticks PerfCounters::skid_size() {
   init_attributes();
+  return pmu_skid_size;
+}
+
+list<PerfCounters*> PerfCounters::idle_counters;
+size_t PerfCounters::num_started;
+
+PerfCounters::PerfCounters(pid_t tid)
+    : tid(tid),
+      ticks_base(0),
+      ticks_last_read(0),
+      ticks_read_since_reset(false),
+      started(false),
+      idle(false) {
+  init_attributes();
+}
+
+/*static*/ size_t PerfCounters::num_extra_fds() { return extra_attrs.size(); }
+
+/**
+ * Tracees with thousands of threads would otherwise need thousands of
+ * counter fds; leave at least half of our fd limit for everything else.
+ */
+/*static*/ size_t PerfCounters::max_started() {
+  static size_t max_counters;
+  if (!max_counters) {
+    struct rlimit limit;
+    rlim_t fds = getrlimit(RLIMIT_NOFILE, &limit) ? 1024 : limit.rlim_cur;
+    max_counters = max<rlim_t>(16, fds / 2 / (1 + num_extra_fds()));
+  }
+  return max_counters;
 }
 
 static ScopedFd start_counter(pid_t tid, int group_fd,
@@ -191,8 +317,48 @@ static ScopedFd start_counter(pid_t tid, int group_fd,
   return fd;
 }
 
+static void reset_counter(ScopedFd& fd) {
+  if (ioctl(fd, PERF_EVENT_IOC_RESET, 0)) {
+    FATAL() << "Failed to reset counter";
+  }
+}
+
 void PerfCounters::reset(Ticks ticks_period) {
-  stop();
+  if (idle) {
+    idle_counters.erase(idle_it);
+    idle = false;
+  }
+  if (started) {
+    // Reprogram the counters we already have rather than paying for
+    // perf_event_open() and the fcntl()s below on every resume.
+    // Setting the period also discards what was left of the old one.
+    uint64_t period = ticks_period;
+    if (ioctl(fd_ticks, PERF_EVENT_IOC_PERIOD, &period)) {
+      FATAL() << "Failed to set ticks counter period";
+    }
+    if (extra_perf_counters_enabled()) {
+      if (ioctl(fd_ticks, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP)) {
+        FATAL() << "Failed to reset counters";
+      }
+      ticks_base = 0;
+      extra_since_reset = Extra();
+    } else if (ticks_read_since_reset) {
+      // The task has been stopped since we read the counter, so it
+      // still holds that value.  That saves an ioctl per resume.
+      ticks_base = ticks_last_read;
+    } else {
+      reset_counter(fd_ticks);
+      ticks_base = 0;
+    }
+    ticks_read_since_reset = false;
+    return;
+  }
+
+  while (num_started >= max_started() && !idle_counters.empty()) {
+    PerfCounters* victim = idle_counters.front();
+    LOG(debug) << "Closing the counters of stopped task " << victim->tid;
+    victim->stop();
+  }
 
   struct perf_event_attr attr = ticks_attr;
   attr.sample_period = ticks_period;
@@ -210,27 +376,32 @@ void PerfCounters::reset(Ticks ticks_period) {
             << signalname(PerfCounters::TIME_SLICE_SIGNAL);
   }
 
-  if (extra_perf_counters_enabled()) {
-    int group_leader = fd_ticks;
-    fd_hw_interrupts = start_counter(tid, group_leader, &hw_interrupts_attr);
-    fd_instructions_retired =
-        start_counter(tid, group_leader, &instructions_retired_attr);
-    fd_page_faults = start_counter(tid, group_leader, &page_faults_attr);
+  for (size_t i = 0; i < extra_attrs.size(); ++i) {
+    fd_extra[i] = start_counter(tid, fd_ticks, &extra_attrs[i]);
   }
 
+  ticks_base = 0;
+  extra_since_reset = Extra();
+  ticks_read_since_reset = false;
   started = true;
+  ++num_started;
 }
 
 void PerfCounters::stop() {
+  if (idle) {
+    idle_counters.erase(idle_it);
+    idle = false;
+  }
   if (!started) {
     return;
   }
   started = false;
+  --num_started;
 
   fd_ticks.close();
-  fd_page_faults.close();
-  fd_hw_interrupts.close();
-  fd_instructions_retired.close();
+  for (auto& fd : fd_extra) {
+    fd.close();
+  }
 }
 
 static int64_t read_counter(ScopedFd& fd) {
@@ -240,20 +411,50 @@ static int64_t read_counter(ScopedFd& fd) {
   return val;
 }
 
-Ticks PerfCounters::read_ticks() {
-  return started ? read_counter(fd_ticks) : 0;
+/**
+ * The PERF_FORMAT_GROUP layout of the counters when extra counters are
+ * enabled.  Siblings follow the leader in the order they were opened.
+ */
+struct CounterGroup {
+  uint64_t nr;
+  uint64_t ticks;
+  uint64_t extra[PerfCounters::MAX_EXTRA_COUNTERS];
+};
+
+static CounterGroup read_counter_group(ScopedFd& fd) {
+  CounterGroup group;
+  ssize_t nread = read(fd, &group, sizeof(group));
+  assert(nread >= ssize_t(2 * sizeof(uint64_t)) &&
+         nread == ssize_t((1 + group.nr) * sizeof(uint64_t)));
+  return group;
 }
 
-PerfCounters::Extra PerfCounters::read_extra() {
-  assert(extra_perf_counters_enabled());
+Ticks PerfCounters::read_ticks_counter() {
+  if (!extra_perf_counters_enabled()) {
+    return read_counter(fd_ticks);
+  }
+  CounterGroup group = read_counter_group(fd_ticks);
+  for (size_t i = 0; i + 1 < group.nr; ++i) {
+    extra_totals.values[i] += group.extra[i] - extra_since_reset.values[i];
+    extra_since_reset.values[i] = group.extra[i];
+  }
+  return group.ticks;
+}
 
-  Extra extra;
-  if (started) {
-    extra.page_faults = read_counter(fd_page_faults);
-    extra.hw_interrupts = read_counter(fd_hw_interrupts);
-    extra.instructions_retired = read_counter(fd_instructions_retired);
-  } else {
-    memset(&extra, 0, sizeof(extra));
+Ticks PerfCounters::read_ticks() {
+  if (!started) {
+    return 0;
+  }
+  ticks_last_read = read_ticks_counter();
+  ticks_read_since_reset = true;
+  if (!idle) {
+    idle_it = idle_counters.insert(idle_counters.end(), this);
+    idle = true;
   }
-  return extra;
+  return ticks_last_read - ticks_base;
+}
+
+PerfCounters::Extra PerfCounters::read_extra() const {
+  assert(extra_perf_counters_enabled());
+  return extra_totals;
 }
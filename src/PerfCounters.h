@@ -11,6 +11,10 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <list>
+#include <string>
+#include <vector>
+
 #include "ScopedFd.h"
 #include "Ticks.h"
 
@@ -23,8 +27,9 @@
  * conditional branches. We support dispatching a signal when the counter
  * reaches a particular value.
  *
- * When extra_perf_counters_enabled() returns true, we monitor additional
- * counters of interest.
+ * When extra_perf_counters_enabled() returns true, we also monitor the
+ * counters the user selected with |rr record --perf-counters|, and
+ * record their running totals in every trace frame.
  */
 class PerfCounters {
 public:
@@ -34,9 +39,23 @@ public:
   PerfCounters(pid_t tid);
   ~PerfCounters() { stop(); }
 
-  // Change this to 'true' to enable perf counters that may be interesting
-  // for experimentation, but aren't necessary for core functionality.
-  static bool extra_perf_counters_enabled() { return false; }
+  /**
+   * Return true if extra counters, which aren't necessary for core
+   * functionality, were selected for this recording.
+   */
+  static bool extra_perf_counters_enabled();
+
+  /**
+   * Parse the comma-separated counter names in |list| into |names|.
+   * Return false if a name isn't known or there are too many of them.
+   */
+  static bool parse_extra_counters(const std::string& list,
+                                   std::vector<std::string>* names);
+
+  /**
+   * Return the names parse_extra_counters() accepts, comma-separated.
+   */
+  static std::string known_extra_counters();
 
   /**
    * Reset all counter values to 0 and program the counters to send
@@ -44,43 +63,91 @@ public:
    * the hardware triggers its interrupt some time after that.)
    * This must be called while the task is stopped, and it must be called
    * before the task is allowed to run again.
+   * The counters are only opened the first time this is called; later
+   * calls reprogram them in place.  If that would leave too many
+   * counters open, the counters of the task that has been stopped
+   * longest are closed, to be reopened when it's next reset().
    */
   void reset(Ticks ticks_period);
 
   /**
-   * Read the current value of the ticks counter.
+   * Read the number of ticks since the last reset().
    */
   Ticks read_ticks();
 
   /**
-   * Return the fd we are using to monitor the ticks counter.
+   * Return the most ticks an interrupt programmed with reset() is
+   * expected to fire past its target on this CPU's microarchitecture.
+   */
+  static Ticks skid_size();
+
+  /**
+   * Return the fd we are using to monitor the ticks counter, or -1 while
+   * the counters are closed.
    */
   int ticks_fd() const { return fd_ticks; }
 
+  /**
+   * Return the number of fds this holds open.
+   */
+  size_t num_fds() const { return started ? 1 + num_extra_fds() : 0; }
+
   /* This choice is fairly arbitrary; linux doesn't use SIGSTKFLT so we
    * hope that tracees don't either. */
   enum {
     TIME_SLICE_SIGNAL = SIGSTKFLT
   };
 
+  // Trace frames have room for this many extra counter values.
+  enum {
+    MAX_EXTRA_COUNTERS = 3
+  };
+
+  /**
+   * The totals of the selected extra counters since this task started,
+   * in the order they were selected.  Unused slots are 0.
+   */
   struct Extra {
-    Extra() : page_faults(0), hw_interrupts(0), instructions_retired(0) {}
+    Extra() {
+      for (auto& v : values) {
+        v = 0;
+      }
+    }
 
-    int64_t page_faults;
-    int64_t hw_interrupts;
-    int64_t instructions_retired;
+    int64_t values[MAX_EXTRA_COUNTERS];
   };
-  Extra read_extra();
+  /**
+   * Return the extra counter totals as of the last read_ticks().
+   */
+  Extra read_extra() const;
 
 private:
   void stop();
+  Ticks read_ticks_counter();
+  static size_t num_extra_fds();
+  static size_t max_started();
 
   pid_t tid;
   ScopedFd fd_ticks;
-  ScopedFd fd_page_faults;
-  ScopedFd fd_hw_interrupts;
-  ScopedFd fd_instructions_retired;
+  ScopedFd fd_extra[MAX_EXTRA_COUNTERS];
+  // The extra counters are read along with the ticks counter, which
+  // leads their group.  |extra_since_reset| holds what they read last
+  // time, so reading more than once between resets counts nothing twice.
+  Extra extra_totals;
+  Extra extra_since_reset;
+  // The ticks counter isn't zeroed by reset() when we know its value:
+  // the task can't have run since we last read it.  read_ticks()
+  // subtracts |ticks_base| instead.
+  Ticks ticks_base;
+  Ticks ticks_last_read;
+  bool ticks_read_since_reset;
   bool started;
+  // Started counters whose task has stopped since they were reset, least
+  // recently reset first, and our place in that list while |idle|.
+  static std::list<PerfCounters*> idle_counters;
+  std::list<PerfCounters*>::iterator idle_it;
+  bool idle;
+  static size_t num_started;
 };
 
 #endif /* RR_PERF_COUNTERS_H_ */
@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "ProbeCache"
+
+#include "ProbeCache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <map>
+#include <sstream>
+
+#include "Flags.h"
+#include "log.h"
+#include "ScopedFd.h"
+#include "util.h"
+
+using namespace std;
+
+static string cache_path() {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && *runtime_dir) {
+    return string(runtime_dir) + "/rr-probe-cache";
+  }
+  return "/tmp/rr-probe-cache-" + to_string(getuid());
+}
+
+/**
+ * What the cached results depend on: this boot, kernel and CPU model.
+ */
+static string cache_key() {
+  char boot_id[64] = "";
+  ScopedFd fd("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+  ssize_t len = fd.is_open() ? read(fd, boot_id, sizeof(boot_id) - 1) : -1;
+  boot_id[max<ssize_t>(0, len)] = 0;
+  struct utsname uts;
+  if (uname(&uts)) {
+    uts.release[0] = 0;
+  }
+  unsigned int eax, ecx, edx;
+  cpuid(CPUID_GETFEATURES, 0, &eax, &ecx, &edx);
+  stringstream key;
+  key << "boot " << string(boot_id, strcspn(boot_id, "\n")) << " kernel "
+      << uts.release << " cpu " << hex << eax;
+  return key.str();
+}
+
+static map<string, string>& entries() {
+  static map<string, string> cached;
+  static bool loaded;
+  if (loaded) {
+    return cached;
+  }
+  loaded = true;
+  if (Flags::get().reprobe) {
+    return cached;
+  }
+  ScopedFd fd(cache_path().c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  struct stat st;
+  if (!fd.is_open() || fstat(fd, &st) || st.st_uid != getuid()) {
+    return cached;
+  }
+  string contents;
+  char buf[4096];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    contents.append(buf, len);
+  }
+  stringstream lines(contents);
+  string line;
+  if (!getline(lines, line) || line != cache_key()) {
+    LOG(debug) << "Probe cache is stale";
+    return cached;
+  }
+  while (getline(lines, line)) {
+    size_t space = line.find(' ');
+    if (space != string::npos) {
+      cached[line.substr(0, space)] = line.substr(space + 1);
+    }
+  }
+  return cached;
+}
+
+bool ProbeCache::get(const string& key, string* value) {
+  auto& cached = entries();
+  auto it = cached.find(key);
+  if (it == cached.end()) {
+    return false;
+  }
+  *value = it->second;
+  return true;
+}
+
+void ProbeCache::set(const string& key, const string& value) {
+  auto& cached = entries();
+  cached[key] = value;
+  string contents = cache_key() + "\n";
+  for (auto& e : cached) {
+    contents += e.first + " " + e.second + "\n";
+  }
+  // Write a new file and rename it over the old one, so concurrent runs
+  // never see a partial cache.
+  string path = cache_path();
+  string tmp = path + "." + to_string(getpid());
+  ScopedFd fd(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (!fd.is_open()) {
+    return;
+  }
+  if (write(fd, contents.data(), contents.size()) != (ssize_t)contents.size() ||
+      rename(tmp.c_str(), path.c_str())) {
+    unlink(tmp.c_str());
+  }
+}
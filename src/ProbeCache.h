@@ -0,0 +1,38 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PROBE_CACHE_H_
+#define RR_PROBE_CACHE_H_
+
+#include <string>
+
+/**
+ * ProbeCache keeps the results of rr's probes of its environment (the
+ * CPU microarchitecture, the CPU frequency governor) in a small per-user
+ * file, so that the many short rr runs of a test harness don't each probe
+ * again.  The file is $XDG_RUNTIME_DIR/rr-probe-cache, or
+ * /tmp/rr-probe-cache-<uid> without XDG_RUNTIME_DIR.
+ *
+ * Results are only reused by runs in the same boot (by
+ * /proc/sys/kernel/random/boot_id), under the same kernel release and on
+ * the same CPU model; otherwise the cache starts over.  The common
+ * option --reprobe ignores the cached results and saves fresh ones.
+ *
+ * Probes that run in the first tracee (CPUIDBugDetector's, and the
+ * check that the ticks counter works) are part of the recording itself
+ * and are never cached.
+ */
+class ProbeCache {
+public:
+  /**
+   * Set |*value| to the cached result of probe |key| and return true, or
+   * return false if it has to be probed.
+   */
+  static bool get(const std::string& key, std::string* value);
+  /**
+   * Save |value| as the result of probe |key|.  Failure to save it is
+   * ignored.
+   */
+  static void set(const std::string& key, const std::string& value);
+};
+
+#endif /* RR_PROBE_CACHE_H_ */
@@ -0,0 +1,209 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "PtraceProfiler"
+
+#include "PtraceProfiler.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+PtraceProfiler* PtraceProfiler::profiler;
+
+static pid_t profiler_pid;
+
+/* static */ void PtraceProfiler::finish() {
+  // Forked children that exit() mustn't write the profile too.
+  if (getpid() == profiler_pid) {
+    delete profiler;
+    profiler = nullptr;
+  }
+}
+
+/* static */ void PtraceProfiler::init(const string& filename) {
+  profiler = new PtraceProfiler(filename);
+  profiler_pid = getpid();
+  atexit(finish);
+}
+
+/* static */ uint64_t PtraceProfiler::now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+PtraceProfiler::PtraceProfiler(const string& filename)
+    : out(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+      origin(now_ns()),
+      first_span(true) {
+  if (!out.is_open()) {
+    FATAL() << "Can't create ptrace profile " << filename;
+  }
+  buffer = "{\"traceEvents\":[\n";
+  calls.reserve(MAX_BUFFERED_CALLS);
+}
+
+PtraceProfiler::~PtraceProfiler() {
+  flush_calls();
+  uint64_t now = now_ns();
+  for (auto& r : running) {
+    tracee_total.count++;
+    tracee_total.ns += now - r.second;
+    write_span("running", "tracee", r.first, r.second, now - r.second,
+               nullptr);
+  }
+  buffer += "\n]}\n";
+  write_out();
+  print_totals();
+}
+
+static bool is_resume_request(int request) {
+  switch (request) {
+    case PTRACE_CONT:
+    case PTRACE_SYSCALL:
+    case PTRACE_SINGLESTEP:
+    case PTRACE_SYSEMU:
+    case PTRACE_SYSEMU_SINGLESTEP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void PtraceProfiler::ptrace_call(int request, pid_t tid, uint64_t start,
+                                 uint64_t end, void* site,
+                                 const Event& event) {
+  uint64_t duration = end - start;
+  EventType type = event.type();
+  if (event_type_names[type].empty()) {
+    event_type_names[type] = event.type_name();
+  }
+
+  Call call = { start, uint32_t(min<uint64_t>(duration, UINT32_MAX)), tid,
+                int16_t(request), uint8_t(type), site };
+  calls.push_back(call);
+  if (calls.size() >= MAX_BUFFERED_CALLS) {
+    flush_calls();
+  }
+
+  ptrace_total.count++;
+  ptrace_total.ns += duration;
+  Totals& r = by_request[request];
+  r.count++;
+  r.ns += duration;
+  Totals& s = by_site[site];
+  s.count++;
+  s.ns += duration;
+  Totals& e = by_event_type[type];
+  e.count++;
+  e.ns += duration;
+
+  if (is_resume_request(request)) {
+    running[tid] = end;
+  }
+}
+
+void PtraceProfiler::tracee_stopped(pid_t tid) {
+  auto it = running.find(tid);
+  if (it == running.end()) {
+    return;
+  }
+  uint64_t now = now_ns();
+  tracee_total.count++;
+  tracee_total.ns += now - it->second;
+  // Keep the timeline's spans in order by flushing the calls before them.
+  flush_calls();
+  write_span("running", "tracee", tid, it->second, now - it->second, nullptr);
+  running.erase(it);
+}
+
+void PtraceProfiler::write_span(const char* name, const char* cat, pid_t tid,
+                                uint64_t start, uint64_t duration,
+                                const Call* call) {
+  char span[256];
+  snprintf(span, sizeof(span),
+           "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+           "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+           first_span ? "" : ",\n", name, cat, profiler_pid, tid,
+           (start - origin) / 1000.0, duration / 1000.0);
+  buffer += span;
+  if (call) {
+    snprintf(span, sizeof(span), ",\"args\":{\"site\":\"%p\",\"event\":\"%s\"}",
+             call->site, event_type_names[call->event_type].c_str());
+    buffer += span;
+  }
+  buffer += "}";
+  first_span = false;
+  if (buffer.size() >= MAX_BUFFERED_BYTES) {
+    write_out();
+  }
+}
+
+void PtraceProfiler::write_out() {
+  if (write(out, buffer.data(), buffer.size()) != ssize_t(buffer.size())) {
+    LOG(warn) << "Failed to write ptrace profile";
+  }
+  buffer.clear();
+}
+
+void PtraceProfiler::flush_calls() {
+  for (auto& c : calls) {
+    write_span(ptrace_req_name(c.request), "ptrace", c.tid, c.start,
+               c.duration, &c);
+  }
+  calls.clear();
+}
+
+template <typename K>
+static vector<pair<K, PtraceProfiler::Totals> > by_time(
+    const map<K, PtraceProfiler::Totals>& totals) {
+  vector<pair<K, PtraceProfiler::Totals> > v(totals.begin(), totals.end());
+  sort(v.begin(), v.end(),
+       [](const pair<K, PtraceProfiler::Totals>& a,
+          const pair<K, PtraceProfiler::Totals>& b) {
+    return a.second.ns > b.second.ns;
+  });
+  return v;
+}
+
+static void print_total(const char* name, const void* site,
+                        const PtraceProfiler::Totals& t) {
+  if (name) {
+    fprintf(stderr, "  %-28s", name);
+  } else {
+    fprintf(stderr, "  %-28p", site);
+  }
+  fprintf(stderr, " %10llu calls %10.3f ms %8.2f us/call\n",
+          (unsigned long long)t.count, t.ns / 1e6,
+          t.count ? t.ns / 1e3 / t.count : 0.0);
+}
+
+void PtraceProfiler::print_totals() {
+  double wall_ms = (now_ns() - origin) / 1e6;
+  fprintf(stderr, "ptrace profile: %.3f ms wall time, %.3f ms tracees "
+                  "running, %.3f ms in %llu ptrace calls\n",
+          wall_ms, tracee_total.ns / 1e6, ptrace_total.ns / 1e6,
+          (unsigned long long)ptrace_total.count);
+  fprintf(stderr, "By request:\n");
+  for (auto& r : by_time(by_request)) {
+    print_total(ptrace_req_name(r.first), nullptr, r.second);
+  }
+  fprintf(stderr, "By event type:\n");
+  for (auto& e : by_time(by_event_type)) {
+    print_total(event_type_names[e.first].c_str(), nullptr, e.second);
+  }
+  fprintf(stderr, "By calling site:\n");
+  for (auto& s : by_time(by_site)) {
+    print_total(nullptr, s.first, s.second);
+  }
+}
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PTRACE_PROFILER_H_
+#define RR_PTRACE_PROFILER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Event.h"
+#include "ScopedFd.h"
+
+/**
+ * PtraceProfiler times every ptrace call rr makes through Task, and the
+ * intervals tracees run between being resumed and rr seeing them stop,
+ * when --ptrace-profile=FILE is given.
+ *
+ * FILE is written as a Chrome trace ("Trace Event Format") JSON timeline
+ * that chrome://tracing and Perfetto load: one row per tracee, with a
+ * "running" span for each time it ran and a span for each ptrace call,
+ * labelled with the request and carrying the calling site and the type
+ * of the event being recorded or replayed.  Calling sites are raw return
+ * addresses; use addr2line -f -e rr to name them.  Totals by request,
+ * site and event type are printed to stderr when rr exits.
+ */
+class PtraceProfiler {
+public:
+  /**
+   * Start profiling to |filename|.
+   */
+  static void init(const std::string& filename);
+  static bool enabled() { return profiler != nullptr; }
+  static PtraceProfiler& get() { return *profiler; }
+
+  /**
+   * Record a ptrace |request| on |tid| that ran from |start| to |end|
+   * (CLOCK_MONOTONIC nanoseconds), made from |site| while |event| was
+   * being processed.
+   */
+  void ptrace_call(int request, pid_t tid, uint64_t start, uint64_t end,
+                   void* site, const Event& event);
+  /**
+   * Record that |tid| was seen to stop, ending the span it ran for since
+   * it was last resumed.
+   */
+  void tracee_stopped(pid_t tid);
+
+  static uint64_t now_ns();
+
+  struct Totals {
+    Totals() : count(0), ns(0) {}
+    uint64_t count;
+    uint64_t ns;
+  };
+
+private:
+  PtraceProfiler(const std::string& filename);
+  ~PtraceProfiler();
+
+  static void finish();
+
+  struct Call {
+    uint64_t start;
+    uint32_t duration;
+    pid_t tid;
+    int16_t request;
+    uint8_t event_type;
+    void* site;
+  };
+  void write_span(const char* name, const char* cat, pid_t tid,
+                  uint64_t start, uint64_t duration, const Call* call);
+  void flush_calls();
+  void write_out();
+  void print_totals();
+
+  static PtraceProfiler* profiler;
+
+  // Written with write(2) rather than stdio, so that forked children
+  // can't flush buffered output a second time.
+  ScopedFd out;
+  std::string buffer;
+  uint64_t origin;
+  bool first_span;
+  std::vector<Call> calls;
+  // When each running tracee was last resumed.
+  std::map<pid_t, uint64_t> running;
+  std::string event_type_names[1 << 5];
+
+  std::map<int, Totals> by_request;
+  std::map<void*, Totals> by_site;
+  std::map<int, Totals> by_event_type;
+  Totals ptrace_total;
+  Totals tracee_total;
+
+  enum {
+    MAX_BUFFERED_CALLS = 64 * 1024,
+    MAX_BUFFERED_BYTES = 1024 * 1024
+  };
+};
+
+#endif /* RR_PTRACE_PROFILER_H_ */
@@ -4,12 +4,24 @@
 
 #include "RecordSession.h"
 
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/prctl.h>
+#include <sys/personality.h>
+
 #include <algorithm>
+#include <fstream>
 #include <sstream>
 
+#include "AutoRemoteSyscalls.h"
 #include "log.h"
 #include "record_signal.h"
 #include "record_syscall.h"
+#include "ScopedFd.h"
 #include "task.h"
 
 using namespace rr;
@@ -185,6 +197,7 @@ enum ForceSyscall {
 };
 static void task_continue(Task* t, ForceSyscall force_cont, int sig) {
   bool may_restart = t->at_may_restart_syscall();
+  int ticks = t->record_session().scheduler().timeslice_ticks(t);
 
   if (sig) {
     LOG(debug) << "  delivering " << signalname(sig) << " to " << t->tid;
@@ -199,7 +212,7 @@ static void task_continue(Task* t, ForceSyscall force_cont, int sig) {
      * syscall_buffer lib in the child, therefore we must
      * record in the traditional way (with PTRACE_SYSCALL)
      * until it is installed. */
-    t->cont_syscall_nonblocking(sig, Flags::get().max_ticks);
+    t->cont_syscall_nonblocking(sig, ticks);
   } else {
     /* When the seccomp filter is on, instead of capturing
      * syscalls by using PTRACE_SYSCALL, the filter will
@@ -211,7 +224,7 @@ static void task_continue(Task* t, ForceSyscall force_cont, int sig) {
      * process to continue to the actual entry point of
      * the syscall (using cont_syscall_block()) and then
      * using the same logic as before. */
-    t->cont_nonblocking(sig, Flags::get().max_ticks);
+    t->cont_nonblocking(sig, ticks);
   }
 }
 
@@ -500,7 +513,8 @@ static void syscall_state_changed(Task* t, bool by_waitpid) {
       if (!may_restart) {
         rec_process_syscall(t);
         if (t->session().can_validate() && Flags::get().check_cached_mmaps) {
-          t->vm()->verify(t);
+          t->vm()->maybe_verify(t, AddressSpace::syscall_changes_mappings(
+                                       syscallno, t->arch()));
         }
       } else {
         LOG(debug) << "  may restart " << t->syscallname(syscallno)
@@ -583,6 +597,13 @@ void RecordSession::check_perf_counters_working(Task* t,
   }
 }
 
+// How often the stats file is rewritten; see maybe_write_stats().
+static const double STATS_INTERVAL_SECS = 1.0;
+
+// The largest signal handler frame recorded exactly; see
+// signal_state_changed().
+static const intptr_t MAX_SIGFRAME_SIZE = 64 * 1024;
+
 /**
  * |t| is being delivered a signal, and its state changed.
  * |by_waitpid| is true if the status change was observed by a
@@ -603,6 +624,7 @@ static bool signal_state_changed(Task* t, bool by_waitpid) {
       t->record_current_event();
       t->ev().transform(EV_SIGNAL_DELIVERY);
       ssize_t sigframe_size = 0;
+      remote_ptr<void> interrupted_sp = t->sp();
       // If a signal is blocked but is still delivered (e.g. a synchronous
       // terminating signal such as SIGSEGV), user handlers do not run.
       if (t->signal_has_user_handler(sig) && !t->is_sig_blocked(sig)) {
@@ -611,16 +633,6 @@ static bool signal_state_changed(Task* t, bool by_waitpid) {
 
         t->cont_singlestep(sig);
 
-        // It's been observed that when tasks enter
-        // sighandlers, the singlestep operation above
-        // doesn't retire any instructions; and
-        // indeed, if an instruction could be retired,
-        // this code wouldn't work.  This also
-        // cross-checks the sighandler information we
-        // maintain in |t->sighandlers|.
-        assert(!PerfCounters::extra_perf_counters_enabled() ||
-               0 == t->hpc.read_extra().instructions_retired);
-
         // It's somewhat difficult engineering-wise to
         // compute the sigframe size at compile time,
         // and it can vary across kernel versions.  So
@@ -640,6 +652,15 @@ static bool signal_state_changed(Task* t, bool by_waitpid) {
         // are run with checksumming enabled, then
         // they can catch errors here.
         sigframe_size = 2048;
+        // When the handler runs on the interrupted stack, the kernel
+        // wrote exactly the frame (and skipped the red zone) below the
+        // interrupted $sp, so record just that much.  That keeps the
+        // handler frame records small, and covers frames larger than
+        // the estimate, e.g. with a big XSAVE area.
+        if (t->sp() < interrupted_sp &&
+            interrupted_sp - t->sp() <= MAX_SIGFRAME_SIZE) {
+          sigframe_size = interrupted_sp - t->sp();
+        }
 
         t->ev().transform(EV_SIGNAL_HANDLER);
         t->signal_delivered(sig);
@@ -746,12 +767,20 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result) {
     case EV_NOOP:
       t->pop_noop();
       break;
-    case EV_SEGV_RDTSC:
     case EV_SCHED:
+      scheduler().on_timeslice_expired(t);
       t->record_current_event();
       t->pop_event(t->ev().type());
       t->switchable = ALLOW_SWITCH;
       break;
+    case EV_SEGV_RDTSC:
+      t->record_current_event();
+      t->pop_event(t->ev().type());
+      // An emulated rdtsc is just an instruction, not a scheduling
+      // point; time-slice interrupts still preempt |t|.  Resuming |t|
+      // directly skips polling every other task for each rdtsc.
+      t->switchable = PREVENT_SWITCH;
+      break;
     case EV_SIGNAL:
       signal_state_changed(t, false);
       break;
@@ -815,15 +844,352 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result) {
   return session;
 }
 
+/**
+ * Return the NUL-separated strings in /proc/|pid|/|name|.
+ */
+static vector<string> read_proc_strings(pid_t pid, const char* name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+  ifstream in(path);
+  if (!in) {
+    FATAL() << "Unable to read " << path;
+  }
+  vector<string> strings;
+  string s;
+  while (getline(in, s, '\0')) {
+    strings.push_back(s);
+  }
+  return strings;
+}
+
+static string read_proc_link(pid_t pid, const char* name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+  char target[PATH_MAX];
+  ssize_t len = readlink(path, target, sizeof(target) - 1);
+  if (len < 0) {
+    FATAL() << "Unable to read " << path;
+  }
+  target[len] = 0;
+  return target;
+}
+
+/**
+ * Return true if Flags::record_only asks for a process that has exec'd
+ * |exe| with the arguments |args| to be recorded.
+ */
+static bool should_record_process(const string& exe,
+                                  const vector<string>& args) {
+  string cmdline;
+  for (auto& arg : args) {
+    if (!cmdline.empty()) {
+      cmdline += ' ';
+    }
+    cmdline += arg;
+  }
+  for (auto& pattern : Flags::get().record_only) {
+    if (!fnmatch(pattern.c_str(), exe.c_str(), 0) ||
+        !fnmatch(pattern.c_str(), cmdline.c_str(), 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * If |t| has just finished an exec of a program that Flags::record_only
+ * doesn't ask for, detach from its process so that it runs untraced,
+ * delete |t| and return true.  The rest of the recording sees the process
+ * as one outside the tracee tree; replay kills it where it was detached.
+ * The initial tracee's process is always recorded.
+ */
+bool RecordSession::maybe_run_untraced(Task* t) {
+  if (Flags::get().record_only.empty() || EV_SENTINEL != t->ev().type() ||
+      !is_execve_syscall(t->regs().original_syscallno(), t->arch()) ||
+      t->regs().syscall_failed() || t->task_group() == initial_task_group ||
+      t->task_group()->task_set().size() != 1 ||
+      t->vm()->task_set().size() != 1) {
+    return false;
+  }
+  if (should_record_process(t->vm()->exe_image(),
+                            read_proc_strings(t->tid, "cmdline"))) {
+    return false;
+  }
+  LOG(debug) << "Letting " << t->tid << " (" << t->vm()->exe_image()
+             << ") run untraced";
+  {
+    AutoRemoteSyscalls remote(t);
+    long ret = remote.syscall(syscall_number_for_prctl(t->arch()),
+                              PR_SET_TSC, PR_TSC_ENABLE);
+    ASSERT(t, !ret) << "Unable to let " << t->tid << " run rdtsc";
+  }
+  t->record_event(Event(EV_EXIT, NO_EXEC_INFO, t->arch()));
+  t->run_untraced = true;
+  delete t;
+  return true;
+}
+
+/*static*/ RecordSession::shr_ptr RecordSession::attach(pid_t pid) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  DIR* dir = opendir(path);
+  if (!dir) {
+    FATAL() << "No process " << pid;
+  }
+  int threads = 0;
+  while (struct dirent* ent = readdir(dir)) {
+    if (ent->d_name[0] != '.') {
+      ++threads;
+    }
+  }
+  closedir(dir);
+  if (threads != 1) {
+    FATAL() << "Can only attach to a single-threaded process, but " << pid
+            << " has " << threads << " threads";
+  }
+
+  // Replay recreates the process by exec()ing its image with rr's usual
+  // personality, and that has to map the vdso and the image's
+  // interpreter where they are now.
+  snprintf(path, sizeof(path), "/proc/%d/personality", pid);
+  unsigned int personality = 0;
+  {
+    ifstream in(path);
+    in >> hex >> personality;
+    if (in.fail()) {
+      FATAL() << "Unable to read " << path;
+    }
+  }
+  if ((personality & (ADDR_NO_RANDOMIZE | ADDR_COMPAT_LAYOUT)) !=
+      (ADDR_NO_RANDOMIZE | ADDR_COMPAT_LAYOUT)) {
+    FATAL() << "Process " << pid << " must be started with address space "
+            << "randomization disabled and the legacy layout, e.g. with "
+            << "`setarch `uname -m` -R -L'";
+  }
+
+  string exe = read_proc_link(pid, "exe");
+  vector<string> argv = read_proc_strings(pid, "cmdline");
+  // Replay execs |exe| itself; the rest of the arguments only end up in
+  // memory the snapshot overwrites.
+  if (argv.empty()) {
+    argv.push_back(exe);
+  } else {
+    argv[0] = exe;
+  }
+  vector<string> envp = read_proc_strings(pid, "environ");
+  string cwd = read_proc_link(pid, "cwd");
+
+  shr_ptr session(new RecordSession(argv, envp, cwd, choose_cpu(), pid));
+  return session;
+}
+
 RecordSession::RecordSession(const std::vector<std::string>& argv,
                              const std::vector<std::string>& envp,
-                             const string& cwd, int bind_to_cpu)
+                             const string& cwd, int bind_to_cpu,
+                             pid_t attach_pid)
     : trace_out(argv, envp, cwd, bind_to_cpu),
       scheduler_(*this),
-      can_deliver_signals(false) {
-  last_recorded_task = Task::spawn(*this, trace_out);
+      can_deliver_signals(false),
+      last_snapshot_time(0),
+      segment_start_secs(now_sec()),
+      flight_prefix_end(0),
+      discarded_until(0),
+      stats_start_secs(now_sec()),
+      stats_written_secs(stats_start_secs),
+      stats_last_frames(EV_LAST, 0) {
+  if (Flags::get().flight_recorder_secs) {
+    trace_out.set_discardable();
+  }
+  if (!attach_pid) {
+    last_recorded_task = Task::spawn(*this, trace_out);
+    initial_task_group = last_recorded_task->task_group();
+    on_create(last_recorded_task);
+    return;
+  }
+
+  last_recorded_task = Task::attach(*this, trace_out, attach_pid);
   initial_task_group = last_recorded_task->task_group();
   on_create(last_recorded_task);
+  // The process is past its exec; the trace starts with a snapshot of
+  // it as we found it.
+  can_deliver_signals = true;
+  TraceStream::ProcessSnapshot snapshot;
+  if (!last_recorded_task->save_snapshot(&snapshot)) {
+    FATAL() << "Can't attach to process " << attach_pid
+            << ", which has shared memory mappings";
+  }
+  trace_out.write_snapshot(snapshot);
+  trace_out.set_attached(snapshot.time);
+  last_snapshot_time = snapshot.time;
+  flight_prefix_end = snapshot.time;
+  discarded_until = snapshot.time;
+  LOG(info) << "Attached to process " << attach_pid;
+}
+
+/**
+ * Snapshot |t|'s process if it's time to, and it has just finished
+ * recording a syscall exit in a state replay can be put into directly:
+ * the only task of the initial process, with nothing buffered.
+ */
+void RecordSession::maybe_write_snapshot(Task* t) {
+  uint32_t interval = Flags::get().snapshot_interval;
+  if (!interval || !can_deliver_signals ||
+      trace_out.time() < last_snapshot_time + interval) {
+    return;
+  }
+  if (tasks().size() != 1 || t->task_group() != initial_task_group ||
+      t->arch() != x86_64 || EV_SENTINEL != t->ev().type() ||
+      t->regs().original_syscallno() < 0 || t->has_stashed_sig() ||
+      (t->syscallbuf_hdr && t->syscallbuf_hdr->num_rec_bytes)) {
+    return;
+  }
+  TraceStream::ProcessSnapshot snapshot;
+  if (!t->save_snapshot(&snapshot)) {
+    // Don't retry at every syscall.
+    last_snapshot_time = trace_out.time();
+    return;
+  }
+  trace_out.write_snapshot(snapshot);
+  last_snapshot_time = snapshot.time;
+  LOG(debug) << "Wrote snapshot at " << snapshot.time;
+  if (Flags::get().flight_recorder_secs) {
+    // End a segment here, so the snapshot is a seek point even if the
+    // recording is interrupted and the trace can be discarded up to it.
+    trace_out.end_segment();
+    segment_start_secs = now_sec();
+    flight_snapshots.push_back(make_pair(snapshot.time, now_sec()));
+  }
+}
+
+/**
+ * End the current trace segment if it's grown past the segment size or
+ * lasted past the segment interval. Called between steps, when every
+ * event recorded so far has its frame in the trace.
+ */
+void RecordSession::maybe_end_segment() {
+  const Flags& flags = Flags::get();
+  if ((!flags.segment_size_mb ||
+       trace_out.segment_bytes() < uint64_t(flags.segment_size_mb) << 20) &&
+      (!flags.segment_secs ||
+       now_sec() - segment_start_secs < flags.segment_secs)) {
+    return;
+  }
+  trace_out.end_segment();
+  segment_start_secs = now_sec();
+  if (flags.flight_recorder_secs) {
+    discard_old_trace();
+  }
+}
+
+/**
+ * Discard the trace between the end of the first segment after the
+ * initial exec and the latest snapshot taken before the flight recorder
+ * window. Replay gets to a state it can restore the snapshot in by
+ * replaying the kept start of the trace.
+ */
+void RecordSession::discard_old_trace() {
+  if (!flight_prefix_end) {
+    if (can_deliver_signals) {
+      flight_prefix_end = trace_out.time();
+    }
+    return;
+  }
+  double window_start = now_sec() - Flags::get().flight_recorder_secs;
+  TraceFrame::Time keep_from = 0;
+  while (!flight_snapshots.empty() &&
+         flight_snapshots.front().second <= window_start) {
+    keep_from = flight_snapshots.front().first;
+    flight_snapshots.pop_front();
+  }
+  if (keep_from > max(discarded_until, flight_prefix_end)) {
+    trace_out.discard(flight_prefix_end, keep_from);
+    discarded_until = keep_from;
+  }
+}
+
+/**
+ * Rewrite the stats file, if there is one and it's been a while, with
+ * the recording's live counters as a JSON object:
+ *
+ *  { "secs": 12.5, "events": 123456, "tasks": 7,
+ *    "events_per_sec": { "SYSCALL": 3400.2, "SYSCALLBUF_FLUSH": 96.1, ... },
+ *    "streams": { "data": { "bytes": 1234, "bytes_per_sec": 100.5,
+ *                           "uncompressed_backlog": 0,
+ *                           "compressed_backlog": 0,
+ *                           "blocked_count": 0, "blocked_secs": 0.0 },
+ *                 ... } }
+ *
+ * Rates are over the time since the file was last written. The file is
+ * replaced atomically, so readers never see it half written.
+ */
+void RecordSession::maybe_write_stats() {
+  const string& path = Flags::get().record_stats_path;
+  if (path.empty()) {
+    return;
+  }
+  double now = now_sec();
+  if (now - stats_written_secs < STATS_INTERVAL_SECS) {
+    return;
+  }
+  double interval = now - stats_written_secs;
+  stats_written_secs = now;
+
+  string tmp = path + ".tmp";
+  FILE* out = fopen(tmp.c_str(), "w");
+  if (!out) {
+    LOG(warn) << "Can't write stats file " << tmp;
+    return;
+  }
+  fprintf(out, "{ \"secs\": %.3f, \"events\": %u, \"tasks\": %zu,\n",
+          now - stats_start_secs, trace_out.time(), tasks().size());
+  fprintf(out, "  \"events_per_sec\": {");
+  const uint64_t* frames = trace_out.frame_counts();
+  const char* sep = "";
+  for (int type = 0; type < EV_LAST; ++type) {
+    if (!frames[type]) {
+      continue;
+    }
+    fprintf(out, "%s \"%s\": %.1f", sep,
+            Event::type_name(EventType(type)).c_str(),
+            (frames[type] - stats_last_frames[type]) / interval);
+    stats_last_frames[type] = frames[type];
+    sep = ",";
+  }
+  fprintf(out, " },\n  \"streams\": {");
+  vector<TraceWriter::StreamStats> streams = trace_out.stream_stats();
+  stats_last_bytes.resize(streams.size());
+  sep = "";
+  for (size_t i = 0; i < streams.size(); ++i) {
+    const TraceWriter::StreamStats& s = streams[i];
+    fprintf(out, "%s\n    \"%s\": { \"bytes\": %" PRIu64
+                 ", \"bytes_per_sec\": %.1f, "
+                 "\"uncompressed_backlog\": %" PRIu64
+                 ", \"compressed_backlog\": %" PRIu64
+                 ", \"blocked_count\": %" PRIu64
+                 ", \"blocked_secs\": %.3f }",
+            sep, s.name, s.bytes, (s.bytes - stats_last_bytes[i]) / interval,
+            s.uncompressed_backlog, s.compressed_backlog, s.blocked_count,
+            s.blocked_time);
+    stats_last_bytes[i] = s.bytes;
+    sep = ",";
+  }
+  fprintf(out, " } }\n");
+  if (fclose(out) || rename(tmp.c_str(), path.c_str())) {
+    LOG(warn) << "Can't write stats file " << path;
+    unlink(tmp.c_str());
+  }
+}
+
+/**
+ * Return true if |t| can be left running while we record other tasks.
+ * Replay emulates every interaction between processes that goes
+ * through the kernel, so the only thing that makes the order of a
+ * single-threaded process's events relative to other processes' matter
+ * is memory it shares with them.
+ */
+static bool may_run_in_parallel(Task* t) {
+  return Flags::get().multicore && t->switchable == ALLOW_SWITCH &&
+         t->vm()->task_set().size() == 1 && !t->vm()->shares_memory();
 }
 
 RecordSession::RecordResult RecordSession::record_step() {
@@ -837,6 +1203,9 @@ RecordSession::RecordResult RecordSession::record_step() {
 
   result.status = STEP_CONTINUE;
 
+  maybe_end_segment();
+  maybe_write_stats();
+
   bool by_waitpid;
   Task* t = scheduler().get_next_thread(last_recorded_task, &by_waitpid);
   if (!t) {
@@ -853,8 +1222,18 @@ RecordSession::RecordResult RecordSession::record_step() {
 #ifdef DEBUGTAG
   t->log_pending_events();
 #endif
-  ASSERT(t, (!by_waitpid || t->may_be_blocked() || t->ptrace_event()))
+  ASSERT(t, (!by_waitpid || t->may_be_blocked() || t->ptrace_event() ||
+             t->running_in_parallel))
       << "unexpectedly runnable (" << HEX(t->status()) << ") by waitpid";
+  if (t->running_in_parallel) {
+    // We resumed |t| last time without waiting for it, and now it's
+    // stopped.  Carry on as if we'd waited for it then.
+    ASSERT(t, by_waitpid);
+    t->running_in_parallel = false;
+    resume_execution(t, DONT_NEED_TASK_CONTINUE);
+    runnable_state_changed(t, &result);
+    return result;
+  }
   if (handle_ptrace_exit_event(t)) {
     // t is dead and has been deleted.
     last_recorded_task = nullptr;
@@ -871,6 +1250,8 @@ RecordSession::RecordResult RecordSession::record_step() {
     return result;
   }
 
+  rec_record_shared_mapping_changes(t);
+
   bool did_initial_resume = false;
   switch (t->ev().type()) {
     case EV_DESCHED:
@@ -878,6 +1259,11 @@ RecordSession::RecordResult RecordSession::record_step() {
       return result;
     case EV_SYSCALL:
       syscall_state_changed(t, by_waitpid);
+      if (maybe_run_untraced(t)) {
+        last_recorded_task = nullptr;
+        return result;
+      }
+      maybe_write_snapshot(t);
       return result;
     case EV_SIGNAL_DELIVERY: {
       if ((did_initial_resume = signal_state_changed(t, by_waitpid))) {
@@ -892,6 +1278,13 @@ RecordSession::RecordResult RecordSession::record_step() {
   }
 
   if (!t->has_stashed_sig()) {
+    if (!did_initial_resume && may_run_in_parallel(t)) {
+      LOG(debug) << "  letting " << t->tid << " run in parallel";
+      debug_exec_state("EXEC_START", t);
+      task_continue(t, DEFAULT_CONT, /*no sig*/ 0);
+      t->running_in_parallel = true;
+      return result;
+    }
     resume_execution(t, did_initial_resume ? DONT_NEED_TASK_CONTINUE
                                            : NEED_TASK_CONTINUE);
   }
@@ -917,9 +1310,59 @@ void RecordSession::terminate_recording() {
   trace_out.close();
 }
 
+bool RecordSession::exec_file_supported(const string& filename) {
+#if defined(__i386__)
+  /* All this function does is reject 64-bit ELF binaries. Everything
+     else we (optimistically) indicate support for. Missing or corrupt
+     files will cause execve to fail normally. When we support 64-bit,
+     this entire function can be removed. */
+  struct stat st;
+  if (stat(filename.c_str(), &st)) {
+    return true;
+  }
+  ExecFileKey key(st.st_dev, st.st_ino, st.st_mtim.tv_sec,
+                  st.st_mtim.tv_nsec);
+  auto it = exec_files_supported.find(key);
+  if (it != exec_files_supported.end()) {
+    return it->second;
+  }
+  ScopedFd fd(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return true;
+  }
+  char header[5];
+  bool ok = true;
+  if (read(fd, header, sizeof(header)) == sizeof(header)) {
+    if (header[0] == ELFMAG0 && header[1] == ELFMAG1 && header[2] == ELFMAG2 &&
+        header[3] == ELFMAG3 && header[4] == ELFCLASS64) {
+      ok = false;
+    }
+  }
+  exec_files_supported[key] = ok;
+  return ok;
+#elif defined(__x86_64__)
+  // We support 32-bit and 64-bit binaries.
+  return true;
+#else
+#error unknown architecture
+#endif
+}
+
 void RecordSession::on_create(Task* t) {
   Session::on_create(t);
   scheduler().on_create(t);
+
+  // Report what thousands of threads cost us, each time their number
+  // doubles.
+  size_t num_tasks = tasks().size();
+  if (num_tasks >= 256 && !(num_tasks & (num_tasks - 1))) {
+    size_t fds = 0;
+    for (auto& kv : tasks()) {
+      fds += kv.second->num_fds_held();
+    }
+    LOG(info) << num_tasks << " tasks; holding " << fds << " fds for them ("
+              << double(fds) / num_tasks << " per task)";
+  }
 }
 
 void RecordSession::on_destroy(Task* t) {
@@ -3,6 +3,10 @@
 #ifndef RR_RECORD_SESSION_H_
 #define RR_RECORD_SESSION_H_
 
+#include <deque>
+#include <map>
+#include <tuple>
+
 #include "Scheduler.h"
 #include "Session.h"
 #include "task.h"
@@ -20,6 +24,14 @@ public:
   static shr_ptr create(const std::vector<std::string>& argv,
                         const std::vector<std::string>& envp,
                         const std::string& cwd);
+  /**
+   * Create a recording session that attaches to the running process
+   * |pid| instead of starting one.  The trace starts with a snapshot of
+   * the process, so it must be single-threaded, x86-64, without shared
+   * memory mappings, and started with the address space layout rr gives
+   * its tracees (see `setarch -R -L').
+   */
+  static shr_ptr attach(pid_t pid);
 
   enum RecordStatus {
     // Some execution was recorded. record_step() can be called again.
@@ -59,16 +71,29 @@ public:
 
   Scheduler& scheduler() { return scheduler_; }
 
+  /**
+   * Return true if rr can record an exec of |filename|.  Files that can't
+   * be read are assumed to be supported; the exec fails normally.  The
+   * answer is cached by the file's device, inode and mtime, since builds
+   * exec the same binaries over and over.
+   */
+  bool exec_file_supported(const std::string& filename);
+
 private:
   RecordSession(const std::vector<std::string>& argv,
                 const std::vector<std::string>& envp, const std::string& cwd,
-                int bind_to_cpu);
+                int bind_to_cpu, pid_t attach_pid = 0);
 
   virtual void on_create(Task* t);
 
   void check_perf_counters_working(Task* t, RecordResult* step_result);
   void handle_ptrace_event(Task* t);
   void runnable_state_changed(Task* t, RecordResult* step_result);
+  void maybe_write_snapshot(Task* t);
+  bool maybe_run_untraced(Task* t);
+  void maybe_end_segment();
+  void discard_old_trace();
+  void maybe_write_stats();
 
   TraceWriter trace_out;
   Scheduler scheduler_;
@@ -81,6 +106,32 @@ private:
    * replay won't be able to find the right execution point to deliver
    * the signal. */
   bool can_deliver_signals;
+
+  // Trace time of the last process snapshot, or 0.
+  TraceFrame::Time last_snapshot_time;
+  // now_sec() when the current trace segment started.
+  double segment_start_secs;
+  // With a flight recorder window, the times and now_sec()s of the
+  // snapshots that may become the new start of the replayable trace, the
+  // end of the first segment after the initial exec, which is kept for
+  // replay to get to a snapshot from, and where the trace was last
+  // discarded to.
+  std::deque<std::pair<TraceFrame::Time, double> > flight_snapshots;
+  TraceFrame::Time flight_prefix_end;
+  TraceFrame::Time discarded_until;
+
+  // With a stats file, now_sec() when the recording started and when the
+  // file was last written, and the frame counts by event type and stream
+  // sizes then, to compute rates from.
+  double stats_start_secs;
+  double stats_written_secs;
+  std::vector<uint64_t> stats_last_frames;
+  std::vector<uint64_t> stats_last_bytes;
+
+  // exec_file_supported()'s answers, by the device, inode and mtime (in
+  // seconds and nanoseconds) of the file.
+  typedef std::tuple<dev_t, ino_t, time_t, long> ExecFileKey;
+  std::map<ExecFileKey, bool> exec_files_supported;
 };
 
 #endif // RR_RECORD_SESSION_H_
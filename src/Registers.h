@@ -90,6 +90,7 @@ public:
   void set_ip(uintptr_t addr) { RR_SET_REG(eip, rip, addr); }
   uintptr_t sp() const { return RR_GET_REG(esp, rsp); }
   void set_sp(uintptr_t addr) { RR_SET_REG(esp, rsp, addr); }
+  uintptr_t bp() const { return RR_GET_REG(ebp, rbp); }
 
   // Access the registers holding system-call numbers, results, and
   // parameters.
@@ -234,6 +235,21 @@ public:
                                      const char* name2, const Registers& reg2,
                                      int mismatch_behavior);
 
+  /**
+   * Return true if every register of this is bitwise equal to |other|'s.
+   */
+  bool operator==(const Registers& other) const {
+    return arch() == other.arch() &&
+           !memcmp(&u, &other.u, arch() == x86 ? sizeof(u.x86regs)
+                                               : sizeof(u.x64regs));
+  }
+
+  /**
+   * Return a 64-bit digest of the registers compare_register_files()
+   * compares, so register files it considers matching have equal digests.
+   */
+  uint64_t digest() const;
+
   /**
    * Return the total number of registers for this target.
    */
@@ -275,6 +291,8 @@ private:
                                      const char* name2, const Registers& reg2,
                                      int mismatch_behavior);
 
+  template <typename Arch> uint64_t digest_arch() const;
+
   template <typename Arch>
   size_t read_register_arch(uint8_t* buf, GdbRegister regno,
                             bool* defined) const;
@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "ReplayOutput"
+
+#include "ReplayOutput.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+
+#include "log.h"
+
+using namespace std;
+
+namespace {
+
+struct Chunk {
+  int fd;
+  vector<uint8_t> data;
+};
+
+struct Queue {
+  pthread_mutex_t mutex;
+  // Signalled when chunks are queued.
+  pthread_cond_t queued;
+  // Signalled when chunks have been written.
+  pthread_cond_t written;
+  deque<Chunk> chunks;
+  // Bytes in |chunks| plus the chunk being written, if any.
+  size_t pending_bytes;
+  bool started;
+};
+
+} // anonymous namespace
+
+static Queue queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                       PTHREAD_COND_INITIALIZER, deque<Chunk>(), 0, false };
+
+static void write_all(int fd, const uint8_t* data, size_t len) {
+  while (len > 0) {
+    ssize_t ret = ::write(fd, data, len);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      // The tracee's output can't be shown; its replay doesn't depend
+      // on that.
+      LOG(warn) << "Couldn't write replayed output to " << fd;
+      return;
+    }
+    data += ret;
+    len -= ret;
+  }
+}
+
+static void* write_thread(void*) {
+  pthread_mutex_lock(&queue.mutex);
+  while (true) {
+    while (queue.chunks.empty()) {
+      pthread_cond_wait(&queue.queued, &queue.mutex);
+    }
+    Chunk chunk;
+    swap(chunk, queue.chunks.front());
+    queue.chunks.pop_front();
+    pthread_mutex_unlock(&queue.mutex);
+
+    write_all(chunk.fd, chunk.data.data(), chunk.data.size());
+
+    pthread_mutex_lock(&queue.mutex);
+    queue.pending_bytes -= chunk.data.size();
+    pthread_cond_broadcast(&queue.written);
+  }
+  return nullptr;
+}
+
+static void flush_at_exit() { ReplayOutput::flush(); }
+
+/*static*/ void ReplayOutput::write(int fd, const void* data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  pthread_mutex_lock(&queue.mutex);
+  if (!queue.started) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, write_thread, nullptr)) {
+      FATAL() << "Couldn't start replayed output thread";
+    }
+    pthread_detach(thread);
+    atexit(flush_at_exit);
+    queue.started = true;
+  }
+  while (queue.pending_bytes > 0 &&
+         queue.pending_bytes + len > MAX_PENDING_BYTES) {
+    pthread_cond_wait(&queue.written, &queue.mutex);
+  }
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  // Coalesce small writes to the same fd, so that a tracee writing a line
+  // at a time is shown with few write()s.
+  if (!queue.chunks.empty() && queue.chunks.back().fd == fd) {
+    auto& last = queue.chunks.back().data;
+    last.insert(last.end(), bytes, bytes + len);
+  } else {
+    Chunk chunk = { fd, vector<uint8_t>(bytes, bytes + len) };
+    queue.chunks.push_back(move(chunk));
+  }
+  queue.pending_bytes += len;
+  pthread_cond_signal(&queue.queued);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+/*static*/ void ReplayOutput::flush() {
+  pthread_mutex_lock(&queue.mutex);
+  while (queue.pending_bytes > 0) {
+    pthread_cond_wait(&queue.written, &queue.mutex);
+  }
+  pthread_mutex_unlock(&queue.mutex);
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_REPLAY_OUTPUT_H_
+#define RR_REPLAY_OUTPUT_H_
+
+#include <stddef.h>
+
+/**
+ * ReplayOutput writes the tracees' replayed stdout/stderr output on a
+ * background thread, so that replaying a program that logs a lot isn't
+ * slowed down to the speed of the terminal showing it.
+ *
+ * Output is written in the order it was queued, across both fds.  At
+ * most MAX_PENDING_BYTES are queued; write() blocks while the terminal
+ * is that far behind.  flush() must be called before anything else is
+ * shown to the user, e.g. before the debugger gets control; it's called
+ * at exit().
+ */
+class ReplayOutput {
+public:
+  /**
+   * Queue |len| bytes of |data| to be written to |fd|.
+   */
+  static void write(int fd, const void* data, size_t len);
+  /**
+   * Return when everything queued so far has been written.
+   */
+  static void flush();
+
+private:
+  static const size_t MAX_PENDING_BYTES = 1024 * 1024;
+};
+
+#endif /* RR_REPLAY_OUTPUT_H_ */
@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "ReplayProfiler"
+
+#include "ReplayProfiler.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "ReplaySession.h"
+#include "task.h"
+
+using namespace std;
+
+ReplayProfiler::ReplayProfiler(const string& filename, Ticks period)
+    : out(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+      period(period),
+      samples(0) {
+  if (!out.is_open()) {
+    FATAL() << "Can't create profile " << filename;
+  }
+}
+
+ReplayProfiler::~ReplayProfiler() {
+  write_out();
+  LOG(info) << "Took " << samples << " profile samples";
+}
+
+Ticks ReplayProfiler::next_sample(Task* t) const {
+  return (t->tick_count() / period + 1) * period;
+}
+
+void ReplayProfiler::sample(Task* t) {
+  const Registers& regs = t->regs();
+  char line[256];
+  // perf script's "comm tid time: period event:" header, with the
+  // event and tick count standing in for the time.
+  snprintf(line, sizeof(line), "%s %d %u.%" PRId64 ": %" PRId64 " ticks:\n",
+           t->name().c_str(), t->rec_tid,
+           t->replay_session().current_trace_frame().time(), t->tick_count(),
+           period);
+  buffer += line;
+  write_frame(t, regs.ip());
+
+  // Follow the saved frame pointers up the stack.  Code built without
+  // them just cuts the stack short.
+  size_t word_size = regs.arch() == x86 ? 4 : 8;
+  uintptr_t bp = regs.bp();
+  uintptr_t sp = regs.sp();
+  for (int depth = 1; depth < MAX_STACK_DEPTH; ++depth) {
+    if (bp < sp || bp % word_size) {
+      break;
+    }
+    uint64_t frame[2] = { 0, 0 };
+    if (word_size == 4) {
+      uint32_t frame32[2];
+      if (t->read_bytes_fallible(bp, sizeof(frame32), frame32) !=
+          sizeof(frame32)) {
+        break;
+      }
+      frame[0] = frame32[0];
+      frame[1] = frame32[1];
+    } else if (t->read_bytes_fallible(bp, sizeof(frame), frame) !=
+               sizeof(frame)) {
+      break;
+    }
+    if (!frame[1]) {
+      break;
+    }
+    // Return addresses point after the call; name the call instead.
+    write_frame(t, frame[1] - 1);
+    sp = bp + 2 * word_size;
+    bp = frame[0];
+  }
+  buffer += "\n";
+  ++samples;
+  if (buffer.size() >= MAX_BUFFERED_BYTES) {
+    write_out();
+  }
+}
+
+void ReplayProfiler::write_frame(Task* t, uintptr_t ip) {
+  char line[512];
+  const AddressSpace::MemoryMap& maps = t->vm()->memmap();
+  auto it = maps.find(Mapping(floor_page_size(remote_ptr<void>(ip)),
+                              page_size()));
+  if (it == maps.end() || it->second.fsname.empty()) {
+    snprintf(line, sizeof(line), "\t%16" PRIxPTR " [unknown] ([unknown])\n",
+             ip);
+  } else {
+    const string& file = it->second.fsname;
+    uint64_t offset = ip - it->first.start.as_int() + it->first.offset;
+    snprintf(line, sizeof(line), "\t%16" PRIxPTR " %s+0x%" PRIx64 " (%s)\n",
+             ip, file.substr(file.rfind('/') + 1).c_str(), offset,
+             file.c_str());
+  }
+  buffer += line;
+}
+
+void ReplayProfiler::write_out() {
+  if (write(out, buffer.data(), buffer.size()) != ssize_t(buffer.size())) {
+    LOG(warn) << "Failed to write profile";
+  }
+  buffer.clear();
+}
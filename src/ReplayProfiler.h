@@ -0,0 +1,56 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_REPLAY_PROFILER_H_
+#define RR_REPLAY_PROFILER_H_
+
+#include <string>
+
+#include "ScopedFd.h"
+#include "Ticks.h"
+
+class Task;
+
+/**
+ * ReplayProfiler samples the tracees' stacks every |period| ticks of
+ * their replay, when `rr replay --profile=FILE` is given.
+ *
+ * Replay programs the tick counter to interrupt a little before each
+ * sample point and singlesteps the rest of the way, so a sample is taken
+ * at exactly the same instruction every time the trace is replayed and
+ * profiles of one trace can be compared.  Stacks are unwound by following
+ * the frame pointer chain through tracee memory.
+ *
+ * FILE is written in the format of `perf script`, so the usual tools for
+ * that (stackcollapse-perf.pl, speedscope ...) read it.  Frames are named
+ * by their mapping's file and offset; use addr2line to symbolize them.
+ */
+class ReplayProfiler {
+public:
+  ReplayProfiler(const std::string& filename, Ticks period);
+  ~ReplayProfiler();
+
+  /**
+   * Return the tick count at which |t| is to be sampled next.
+   */
+  Ticks next_sample(Task* t) const;
+  /**
+   * Write a sample of |t|'s stack as it is now.
+   */
+  void sample(Task* t);
+
+private:
+  void write_frame(Task* t, uintptr_t ip);
+  void write_out();
+
+  ScopedFd out;
+  std::string buffer;
+  Ticks period;
+  uint64_t samples;
+
+  enum {
+    MAX_STACK_DEPTH = 128,
+    MAX_BUFFERED_BYTES = 1024 * 1024
+  };
+};
+
+#endif /* RR_REPLAY_PROFILER_H_ */
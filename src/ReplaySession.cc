@@ -6,14 +6,21 @@
 
 #include "ReplaySession.h"
 
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
 #include <syscall.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 
 #include <algorithm>
 
 #include "AutoRemoteSyscalls.h"
+#include "ReplayProfiler.h"
+#include "WriteIndex.h"
 #include "log.h"
 #include "replay_syscall.h"
+#include "syscalls.h"
 #include "task.h"
 #include "util.h"
 
@@ -25,8 +32,9 @@ using namespace std;
  * there's a variable slack region, which is technically unbounded.
  * This means that an interrupt programmed for retired branch k might
  * fire at |k + 50|, for example.  To counteract the slack, we program
- * interrupts just short of our target, by the |SKID_SIZE| region
- * below, and then more slowly advance to the real target.
+ * interrupts just short of our target, by the skid region (the
+ * |skid_size| of the CPU's PmuConfig in PerfCounters.cc), and then
+ * more slowly advance to the real target.
  *
  * How was this magic number determined?  Trial and error: we want it
  * to be as small as possible for efficiency, but not so small that
@@ -36,26 +44,80 @@ using namespace std;
  * observed during replay.  Running with DEBUGLOG enabled (see above),
  * a sequence of log messages like the following will appear
  *
- * 1. programming interrupt for [target - SKID_SIZE] ticks
+ * 1. programming interrupt for [target - skid_size] ticks
  * 2. Error: Replay diverged.  Dumping register comparison.
  * 3. Error: [list of divergent registers; arbitrary]
  * 4. Error: overshot target ticks=[target] by [i]
  *
  * The key is that no other replayer log messages occur between (1)
  * and (2).  This spew means that the replayer programmed an interrupt
- * for ticks=[target-SKID_SIZE], but the tracee was actually interrupted
+ * for ticks=[target-skid_size], but the tracee was actually interrupted
  * at ticks=[target+i].  And that in turn means that the kernel/HW
  * skidded too far past the programmed target for rr to handle it.
  *
- * If that occurs, the SKID_SIZE needs to be increased by at least
- * [i].
+ * If that occurs, the CPU's skid_size needs to be increased by at
+ * least [i].
  *
  * NB: there are probably deeper reasons for the target slack that
  * could perhaps let it be deduced instead of arrived at empirically;
  * perhaps pipeline depth and things of that nature are involved.  But
  * those reasons if they exit are currently not understood.
  */
-static const int SKID_SIZE = 70;
+/* skid_size is a worst case; the skid of a given CPU is usually much
+ * smaller.  So we measure the skid of every interrupt we program and,
+ * once we've seen enough of them, stop short of targets by a margin of
+ * twice the largest skid observed (plus a little), if that's smaller.
+ * Trap-and-check in the slack region is slow, especially when the target
+ * $ip is hit repeatedly, so a tighter margin makes replay of async
+ * signals faster.  All tracees run on this machine's (one) CPU
+ * microarchitecture, so one set of statistics suffices. */
+static const uint64_t MIN_SKID_SAMPLES = 32;
+static const Ticks MIN_SKID_MARGIN = 10;
+
+/* Skids at least this large share the last histogram bucket. */
+static const Ticks SKID_HISTOGRAM_SIZE = 256;
+
+static struct {
+  uint64_t samples;
+  Ticks max_skid;
+  uint64_t histogram[SKID_HISTOGRAM_SIZE];
+} skid_stats;
+
+static void record_skid(Ticks skid) {
+  ++skid_stats.samples;
+  ++skid_stats.histogram[min(skid, SKID_HISTOGRAM_SIZE - 1)];
+  if (skid > skid_stats.max_skid) {
+    LOG(debug) << "  new maximum interrupt skid " << skid << " ticks";
+    skid_stats.max_skid = skid;
+  }
+}
+
+/**
+ * Return how many ticks short of a target to program interrupts for.
+ */
+static Ticks skid_margin() {
+  Ticks skid_size = PerfCounters::skid_size();
+  if (skid_stats.samples < MIN_SKID_SAMPLES) {
+    return skid_size;
+  }
+  return min<Ticks>(skid_size, 2 * skid_stats.max_skid + MIN_SKID_MARGIN);
+}
+
+/**
+ * Return the smallest skid that |fraction| of the measured skids don't
+ * exceed.
+ */
+static Ticks skid_percentile(double fraction) {
+  uint64_t wanted = (uint64_t)(fraction * skid_stats.samples);
+  uint64_t seen = 0;
+  for (Ticks i = 0; i < SKID_HISTOGRAM_SIZE; ++i) {
+    seen += skid_stats.histogram[i];
+    if (seen >= wanted) {
+      return i;
+    }
+  }
+  return skid_stats.max_skid;
+}
 
 static void debug_memory(Task* t) {
   if (should_dump_memory(t, t->current_trace_frame())) {
@@ -69,47 +131,77 @@ static void debug_memory(Task* t) {
   }
 }
 
-static void remap_shared_mmap(AutoRemoteSyscalls& remote, EmuFs& dest_emu_fs,
-                              const Mapping& m, const MappableResource& r) {
-  LOG(debug) << "    remapping shared region at " << m.start << "-" << m.end;
-  remote.syscall(syscall_number_for_munmap(remote.arch()), m.start,
-                 m.num_bytes());
-  // NB: we don't have to unmap then re-map |t->vm()|'s idea of
-  // the emulated file mapping.  Though we'll be remapping the
-  // *real* OS mapping in |t| to a different file, that new
-  // mapping still refers to the same *emulated* file, with the
-  // same emulated metadata.
-
-  auto emufile = dest_emu_fs.at(r.id);
-  // TODO: this duplicates some code in replay_syscall.cc, but
-  // it's somewhat nontrivial to factor that code out.
-  int remote_fd;
-  {
-    string path = emufile->proc_path();
-    AutoRestoreMem child_path(remote, path.c_str());
-    int oflags =
-        (MAP_SHARED & m.flags) && (PROT_WRITE & m.prot) ? O_RDWR : O_RDONLY;
-    remote_fd = remote.syscall(syscall_number_for_open(remote.arch()),
-                               child_path.get().as_int(), oflags);
-    if (0 > remote_fd) {
-      FATAL() << "Couldn't open " << path << " in tracee";
+/**
+ * Remap the shared mappings in |remote|'s task to the corresponding
+ * emulated files of |dest_emu_fs|, all in one batch of remote syscalls.
+ */
+static void remap_shared_mmaps(AutoRemoteSyscalls& remote,
+                               EmuFs& dest_emu_fs) {
+  vector<pair<Mapping, MappableResource> > shared;
+  vector<size_t> path_offsets;
+  string paths;
+  for (auto& kv : remote.task()->vm()->memmap()) {
+    if (kv.second.is_shared_mmap_file()) {
+      shared.push_back(kv);
+      path_offsets.push_back(paths.size());
+      paths += dest_emu_fs.at(kv.second.id)->proc_path();
+      paths.push_back('\0');
     }
   }
+  if (shared.empty()) {
+    return;
+  }
+
+  AutoRestoreMem child_paths(remote, (const uint8_t*)paths.data(),
+                             paths.size());
+  RemoteSyscallBatch batch;
+  vector<size_t> opens;
+  vector<size_t> mmaps;
   // XXX this condition is x86/x64-specific, I imagine.
   bool page_offset_mmap_in_use = has_mmap2_syscall(remote.arch());
-  remote_ptr<void> addr = remote.syscall(
-      page_offset_mmap_in_use ? syscall_number_for_mmap2(remote.arch())
-                              : syscall_number_for_mmap(remote.arch()),
-      m.start, m.num_bytes(), m.prot,
-      // The remapped segment *must* be
-      // remapped at the same address,
-      // or else many things will go
-      // haywire.
-      m.flags | MAP_FIXED, remote_fd,
-      page_offset_mmap_in_use ? m.offset / page_size() : m.offset);
-  ASSERT(remote.task(), addr == m.start);
-
-  remote.syscall(syscall_number_for_close(remote.arch()), remote_fd);
+  for (size_t i = 0; i < shared.size(); ++i) {
+    const Mapping& m = shared[i].first;
+    LOG(debug) << "    remapping shared region at " << m.start << "-"
+               << m.end;
+    batch.add(syscall_number_for_munmap(remote.arch()),
+              { m.start, m.num_bytes() });
+    // NB: we don't have to unmap then re-map |t->vm()|'s idea of
+    // the emulated file mapping.  Though we'll be remapping the
+    // *real* OS mapping in |t| to a different file, that new
+    // mapping still refers to the same *emulated* file, with the
+    // same emulated metadata.
+
+    // TODO: this duplicates some code in replay_syscall.cc, but
+    // it's somewhat nontrivial to factor that code out.
+    int oflags =
+        (MAP_SHARED & m.flags) && (PROT_WRITE & m.prot) ? O_RDWR : O_RDONLY;
+    size_t open = batch.add(syscall_number_for_open(remote.arch()),
+                            { child_paths.get() + path_offsets[i], oflags });
+    opens.push_back(open);
+    mmaps.push_back(batch.add(
+        page_offset_mmap_in_use ? syscall_number_for_mmap2(remote.arch())
+                                : syscall_number_for_mmap(remote.arch()),
+        { m.start, m.num_bytes(), m.prot,
+          // The remapped segment *must* be
+          // remapped at the same address,
+          // or else many things will go
+          // haywire.
+          m.flags | MAP_FIXED, RemoteSyscallBatch::Arg::result(open),
+          page_offset_mmap_in_use ? m.offset / page_size() : m.offset }));
+    batch.add(syscall_number_for_close(remote.arch()),
+              { RemoteSyscallBatch::Arg::result(open) });
+  }
+  remote.syscall_batch(batch);
+
+  for (size_t i = 0; i < shared.size(); ++i) {
+    if (0 > batch.result(opens[i])) {
+      FATAL() << "Couldn't open "
+              << dest_emu_fs.at(shared[i].second.id)->proc_path()
+              << " in tracee";
+    }
+    ASSERT(remote.task(),
+           remote_ptr<void>(batch.result(mmaps[i])) == shared[i].first.start);
+  }
 }
 
 ReplaySession::~ReplaySession() {
@@ -125,11 +217,6 @@ ReplaySession::~ReplaySession() {
 
 void ReplaySession::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
   for (auto vm : sas) {
-    // Creating a checkpoint of a session with active breakpoints
-    // or watchpoints is not supported.
-    assert(!vm->has_breakpoints());
-    assert(!vm->has_watchpoints());
-
     Task* some_task = *vm->task_set().begin();
     pid_t tgid = some_task->tgid();
     Task* group_leader = find_task(tgid);
@@ -146,14 +233,7 @@ void ReplaySession::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
 
     {
       AutoRemoteSyscalls remote(clone_leader);
-      for (auto& kv : clone_leader->vm()->memmap()) {
-        const Mapping& m = kv.first;
-        const MappableResource& r = kv.second;
-        if (!r.is_shared_mmap_file()) {
-          continue;
-        }
-        remap_shared_mmap(remote, dest_emu_fs, m, r);
-      }
+      remap_shared_mmaps(remote, dest_emu_fs);
 
       for (auto t : group_leader->task_group()->task_set()) {
         if (group_leader == t) {
@@ -171,6 +251,13 @@ void ReplaySession::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
     }
     LOG(debug) << "  restoring group-leader state ...";
     clone_leader->copy_state(group_leader);
+
+    // The clone's memory has the debugger's breakpoint instructions
+    // and watched page protections in it, but they aren't part of
+    // its state: a debugger sets them again in a session it's
+    // switched to.
+    clone_leader->vm()->destroy_all_breakpoints();
+    clone_leader->vm()->destroy_all_watchpoints();
   }
   assert(dest.vms().size() > 0);
 }
@@ -181,14 +268,52 @@ ReplaySession::shr_ptr ReplaySession::clone() {
   shr_ptr session(new ReplaySession(*this));
   LOG(debug) << "  deepfork session is " << session.get();
   session->tracees_consistent = tracees_consistent;
-  memcpy(session->syscallbuf_flush_buffer_array, syscallbuf_flush_buffer_array,
-         sizeof(syscallbuf_flush_buffer_array));
+  session->syscallbuf_flush_buffer_array = syscallbuf_flush_buffer_array;
 
   copy_state_to(*session, session->emufs());
 
   return session;
 }
 
+ReplaySession::MemoryUsage ReplaySession::memory_usage() const {
+  MemoryUsage usage = { 0, 0 };
+  uint64_t kb_per_page = page_size() / 1024;
+  for (auto vm : sas) {
+    Task* t = *vm->task_set().begin();
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path) - 1, "/proc/%d/smaps", t->tid);
+    FILE* smaps = fopen(path, "r");
+    if (!smaps) {
+      FATAL() << "Failed to open " << path;
+    }
+    // Shared mappings are of emulated files, which are counted
+    // separately below.
+    bool shared = false;
+    char line[PATH_MAX + 256];
+    while (fgets(line, sizeof(line), smaps)) {
+      unsigned long start, end;
+      char perms[5];
+      uint64_t kb;
+      if (3 == sscanf(line, "%lx-%lx %4s", &start, &end, perms)) {
+        shared = perms[3] == 's';
+      } else if (shared) {
+        continue;
+      } else if (1 == sscanf(line, "Rss: %" SCNu64 " kB", &kb)) {
+        usage.resident_pages += kb / kb_per_page;
+      } else if (1 == sscanf(line, "Private_Clean: %" SCNu64 " kB", &kb) ||
+                 1 == sscanf(line, "Private_Dirty: %" SCNu64 " kB", &kb)) {
+        usage.unique_pages += kb / kb_per_page;
+      }
+    }
+    fclose(smaps);
+  }
+  // Emulated files are copied, not shared, by clone().
+  uint64_t emufs_pages = emu_fs->allocated_bytes() / page_size();
+  usage.resident_pages += emufs_pages;
+  usage.unique_pages += emufs_pages;
+  return usage;
+}
+
 DiversionSession::shr_ptr ReplaySession::clone_diversion() {
   LOG(debug) << "Deepforking ReplaySession " << this
              << " to DiversionSession...";
@@ -201,7 +326,18 @@ DiversionSession::shr_ptr ReplaySession::clone_diversion() {
   return session;
 }
 
-void ReplaySession::gc_emufs() { emu_fs->gc(*this); }
+bool ReplaySession::backing_file_needs_verification(
+    const TraceMappedRegion& file, int prot, int flags) {
+  VerifiedBackingFile key = { FileId(file.stat()), file.stat().st_mtime,
+                              file.file_name(), prot, flags };
+  return verified_backing_files->insert(key).second;
+}
+
+void ReplaySession::gc_emufs() {
+  double start = now_sec();
+  emu_fs->gc(*this);
+  stats.emufs_gc_seconds += now_sec() - start;
+}
 
 /*static*/ ReplaySession::shr_ptr ReplaySession::create(const string& dir) {
   shr_ptr session(new ReplaySession(dir));
@@ -224,6 +360,11 @@ void ReplaySession::gc_emufs() { emu_fs->gc(*this); }
   Task* t = Task::spawn(*session, session->trace_in,
                         session->trace_reader().peek_frame().tid());
   session->on_create(t);
+  if (session->trace_in.attached()) {
+    // The trace starts with a snapshot of a process that was already
+    // running; start_from_snapshot() restores it over this exec.
+    t->exec_unrecorded(session->trace_in.initial_exe());
+  }
 
   return session;
 }
@@ -234,7 +375,12 @@ void ReplaySession::advance_to_next_trace_frame() {
     return;
   }
 
+  double start = now_sec();
   trace_frame = trace_in.read_frame();
+  while (partition && !partition->replays(trace_frame)) {
+    skip_trace_frame();
+    trace_frame = trace_in.read_frame();
+  }
 
   // Subsequent reschedule-events of the same thread can be
   // combined to a single event.  This meliorization is a
@@ -249,6 +395,46 @@ void ReplaySession::advance_to_next_trace_frame() {
       next_frame = trace_in.peek_frame();
     }
   }
+  note_trace_read(now_sec() - start);
+}
+
+/**
+ * Return the number of mapped region records that replaying |frame|
+ * reads.
+ */
+static int mapped_regions_read_by(const TraceFrame& frame) {
+  if (EV_SYSCALL != frame.event().type || frame.regs().syscall_failed()) {
+    return 0;
+  }
+  Event ev(frame.event());
+  if (EXITING_SYSCALL != ev.Syscall().state) {
+    return 0;
+  }
+  int syscallno = ev.Syscall().number;
+  SupportedArch arch = ev.arch();
+  if (is_clone_syscall(syscallno, arch) || is_execve_syscall(syscallno, arch)) {
+    // The scratch memory of the new task.
+    return 1;
+  }
+  if (is_mmap_syscall(syscallno, arch) || is_mmap2_syscall(syscallno, arch)) {
+    // TracePartition never skips old-style x86 mmaps, so the flags are in
+    // the registers.
+    return (frame.regs().arg4() & MAP_ANONYMOUS) ? 0 : 1;
+  }
+  return 0;
+}
+
+/**
+ * Discard the trace data recorded for |trace_frame|, which belongs to a
+ * task outside |partition|.
+ */
+void ReplaySession::skip_trace_frame() {
+  TraceReader::RawData data;
+  while (trace_in.read_raw_data_for_frame(trace_frame, data)) {
+  }
+  for (int i = mapped_regions_read_by(trace_frame); i > 0; --i) {
+    trace_in.read_mapped_region();
+  }
 }
 
 /**
@@ -303,6 +489,142 @@ static bool entering_syscall_insn(Task* t) {
           !memcmp(insn, syscall_insn, sizeof(syscall_insn)));
 }
 
+/**
+ * If |t| stopped for an access to a page protected for a watchpoint
+ * (see |AddressSpace::is_page_watched()|), step it over the faulting
+ * instruction with the normal protection of the pages it accesses,
+ * and note a watchpoint hit if the instruction accessed a read
+ * watchpoint or changed the contents of a watched range.  Return true
+ * if |t| should then be resumed again to carry on: the fault was one
+ * of ours, no watchpoint was hit, and it wasn't singlestepping.
+ */
+static bool step_over_page_watch_fault(Task* t, ResumeRequest how) {
+  AddressSpace::shr_ptr vm = t->vm();
+  if (!vm->has_page_watches() || SIGSEGV != t->pending_sig()) {
+    return false;
+  }
+  remote_ptr<void> addr = (uintptr_t)t->get_siginfo().si_addr;
+  if (!vm->is_page_watched(addr)) {
+    return false;
+  }
+
+  struct WatchedBytes {
+    WatchConfig watch;
+    MemoryRange range;
+    vector<uint8_t> before;
+  };
+  vector<WatchedBytes> watched;
+  vector<remote_ptr<void> > fault_addrs;
+  vector<remote_ptr<void> > pages;
+  // An instruction can access two pages, so it may fault again.
+  do {
+    remote_ptr<void> page = floor_page_size(addr);
+    pages.push_back(page);
+    LOG(debug) << "  stepping over access to watched page " << page;
+    for (auto& w : vm->page_watches_in(MemoryRange(page, page_size()))) {
+      remote_ptr<void> start = max(w.addr, page);
+      remote_ptr<void> end = min(w.addr + w.num_bytes, page + page_size());
+      WatchedBytes bytes = { w, MemoryRange(start, end - start),
+                             vector<uint8_t>(end - start) };
+      t->read_bytes_helper(start, bytes.before.size(), bytes.before.data());
+      watched.push_back(bytes);
+    }
+    fault_addrs.push_back(addr);
+    vm->protect_watched_pages(t, false, addr);
+    t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT);
+    if (SIGSEGV != t->pending_sig()) {
+      break;
+    }
+    addr = (uintptr_t)t->get_siginfo().si_addr;
+  } while (vm->is_page_watched(addr) &&
+           find(pages.begin(), pages.end(), floor_page_size(addr)) ==
+               pages.end());
+  for (auto page : pages) {
+    vm->protect_watched_pages(t, true, page);
+  }
+
+  for (auto& bytes : watched) {
+    bool hit = false;
+    if (WATCH_READWRITE == bytes.watch.type) {
+      for (auto a : fault_addrs) {
+        hit |= bytes.range.addr <= a &&
+               a < bytes.range.addr + bytes.range.num_bytes;
+      }
+    }
+    vector<uint8_t> after(bytes.before.size());
+    t->read_bytes_helper(bytes.range.addr, after.size(), after.data());
+    if (hit || after != bytes.before) {
+      LOG(debug) << "  hit watchpoint at " << bytes.watch.addr;
+      vm->set_page_watch_hit(bytes.watch.addr);
+      return false;
+    }
+  }
+  // A fault we didn't step over is a real one.
+  return SIGTRAP == t->pending_sig() && RESUME_SINGLESTEP != how &&
+         RESUME_SYSEMU_SINGLESTEP != how;
+}
+
+/**
+ * Singlestep |t| from just before the profiler's sample point to it, so
+ * that the sample doesn't depend on the interrupt's skid.  Stops short
+ * at syscall instructions, which mustn't be stepped into.  Returns false
+ * if a signal stopped |t| instead, which the caller has to see.
+ */
+static bool step_to_sample(Task* t, Ticks sample_at) {
+  while (t->tick_count() < sample_at && !entering_syscall_insn(t)) {
+    t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT);
+    if (SIGTRAP != t->pending_sig()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Resume |t| as |Task::resume_execution()| does, stepping it over
+ * the accesses to pages protected for watchpoints that don't hit one,
+ * and stopping it for the profiler's samples on the way.
+ */
+static void resume_watched(Task* t, ResumeRequest how, Ticks tick_period = 0) {
+  t->vm()->take_page_watch_hit();
+  ReplayProfiler* profiler = t->replay_session().get_profiler();
+  // Singlesteps are already where the caller wants them, and
+  // singlestepping to a sample would step over internal breakpoints.
+  bool sampling = profiler && RESUME_SINGLESTEP != how &&
+                  RESUME_SYSEMU_SINGLESTEP != how &&
+                  !t->vm()->has_breakpoints() && !t->vm()->has_watchpoints();
+  Ticks start_ticks = t->tick_count();
+  while (true) {
+    Ticks period = tick_period;
+    if (tick_period) {
+      period = max<Ticks>(1, tick_period - (t->tick_count() - start_ticks));
+    }
+    Ticks sample_at = 0;
+    if (sampling) {
+      // Only stop for a sample before the caller's own interrupt.
+      sample_at = profiler->next_sample(t);
+      Ticks sample_period =
+          max<Ticks>(1, sample_at - t->tick_count() - skid_margin());
+      if (!period || t->tick_count() + period >= sample_at) {
+        period = sample_period;
+      } else {
+        sample_at = 0;
+      }
+    }
+    t->resume_execution(how, RESUME_WAIT, 0, period);
+    if (step_over_page_watch_fault(t, how)) {
+      continue;
+    }
+    if (!sample_at || PerfCounters::TIME_SLICE_SIGNAL != t->pending_sig()) {
+      return;
+    }
+    if (!step_to_sample(t, sample_at)) {
+      return;
+    }
+    profiler->sample(t);
+  }
+}
+
 /**
  * Continue until reaching either the "entry" of an emulated syscall,
  * or the entry or exit of an executed syscall.  |emu| is nonzero when
@@ -347,7 +669,7 @@ Completion ReplaySession::cont_syscall_boundary(Task* t, ExecOrEmulate emu,
   } else {
     resume_how = RESUME_SYSCALL;
   }
-  t->resume_execution(resume_how, RESUME_WAIT);
+  resume_watched(t, resume_how);
 
   t->child_sig = t->pending_sig();
   if (is_ignored_replay_signal(t->child_sig)) {
@@ -377,6 +699,21 @@ Completion ReplaySession::enter_syscall(Task* t, RunCommand stepi) {
   return COMPLETE;
 }
 
+/**
+ * Return true if |t|'s next frame is the entry to another syscall that
+ * replay emulates, so |t| will be resumed with PTRACE_SYSEMU next.
+ */
+bool ReplaySession::next_frame_enters_emulated_syscall(Task* t) {
+  TraceFrame next = trace_in.peek_frame();
+  if (next.tid() != t->rec_tid || EV_SYSCALL != next.event().type ||
+      SYSCALL_ENTRY != next.event().state) {
+    return false;
+  }
+  const SyscallInfo& info =
+      syscall_info(next.event().data, next.event().arch());
+  return SYSCALL_UNDEFINED != info.kind && SEMANTICS_EMU == info.semantics;
+}
+
 /**
  * Advance past the reti (or virtual reti) according to |step|.
  * Return COMPLETE if successful, or INCOMPLETE if an unhandled trap occurred.
@@ -390,8 +727,8 @@ Completion ReplaySession::exit_syscall(Task* t, RunCommand stepi) {
     }
   }
 
-  for (int i = 0; i < current_step.syscall.num_emu_args; ++i) {
-    t->set_data_from_trace();
+  if (current_step.syscall.num_emu_args > 0) {
+    t->set_data_from_trace_v(current_step.syscall.num_emu_args);
   }
   if (current_step.syscall.emu_ret) {
     t->set_return_value_from_trace();
@@ -399,7 +736,12 @@ Completion ReplaySession::exit_syscall(Task* t, RunCommand stepi) {
   validate_args(current_step.syscall.number, SYSCALL_EXIT, t);
 
   if (emu == EMULATE) {
-    t->finish_emulated_syscall();
+    if (stepi == RUN_CONTINUE && next_frame_enters_emulated_syscall(t)) {
+      // The next resume, into that syscall, leaves this one's stop.
+      t->defer_finish_emulated_syscall();
+    } else {
+      t->finish_emulated_syscall();
+    }
   }
   return COMPLETE;
 }
@@ -425,7 +767,7 @@ void ReplaySession::continue_or_step(Task* t, RunCommand stepi,
      * should be neglible. */
     resume_how = RESUME_SYSCALL;
   }
-  t->resume_execution(resume_how, RESUME_WAIT, 0, tick_period);
+  resume_watched(t, resume_how, tick_period);
 
   t->child_sig = t->pending_sig();
   child_sig_gt_zero = (0 < t->child_sig);
@@ -676,7 +1018,6 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
   bool ignored_early_match = false;
   Ticks ticks_left_at_ignored_early_match = 0;
 
-  assert(t->hpc.ticks_fd() > 0);
   assert(t->child_sig == 0);
 
   /* Step 1: advance to the target ticks (minus a slack region) as
@@ -687,7 +1028,8 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
              << ip;
 
   /* XXX should we only do this if (ticks > 10000)? */
-  while (ticks_left - SKID_SIZE > SKID_SIZE) {
+  Ticks margin = skid_margin();
+  while (ticks_left - margin > margin) {
     if (SIGTRAP == t->child_sig) {
       /* We proved we're not at the execution
        * target, and we haven't set any internal
@@ -700,10 +1042,14 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
     }
     t->child_sig = 0;
 
-    LOG(debug) << "  programming interrupt for " << (ticks_left - SKID_SIZE)
+    LOG(debug) << "  programming interrupt for " << (ticks_left - margin)
                << " ticks";
 
-    continue_or_step(t, stepi, ticks_left - SKID_SIZE);
+    Ticks interrupt_at = t->tick_count() + ticks_left - margin;
+    continue_or_step(t, stepi, ticks_left - margin);
+    if (PerfCounters::TIME_SLICE_SIGNAL == t->child_sig) {
+      record_skid(max<Ticks>(0, t->tick_count() - interrupt_at));
+    }
     if (PerfCounters::TIME_SLICE_SIGNAL == t->child_sig ||
         is_ignored_replay_signal(t->child_sig)) {
       t->child_sig = 0;
@@ -922,8 +1268,11 @@ Completion ReplaySession::emulate_signal_delivery(Task* oldtask, int sig) {
   }
   /* If this signal had a user handler, and we just set up the
    * callframe, and we need to restore the $sp for continued
-   * execution. */
-  t->set_regs(trace_frame.regs());
+   * execution.  Without one, the tracee is usually at the recorded
+   * state already. */
+  if (!(t->regs() == trace_frame.regs())) {
+    t->set_regs(trace_frame.regs());
+  }
   /* Delivered the signal. */
   t->child_sig = 0;
 
@@ -936,8 +1285,15 @@ void ReplaySession::check_ticks_consistency(Task* t, const Event& ev) {
     return;
   }
 
-  Ticks ticks_slack = get_ticks_slack(t);
   Ticks ticks_now = t->tick_count();
+  // Usually we're exactly at the recorded state, which one digest
+  // comparison confirms.
+  if (TraceFrame::exec_digest(ticks_now, t->regs()) ==
+      trace_frame.exec_digest()) {
+    return;
+  }
+
+  Ticks ticks_slack = get_ticks_slack(t);
   Ticks trace_ticks = trace_frame.ticks();
 
   ASSERT(t, llabs(ticks_now - trace_ticks) <= ticks_slack)
@@ -999,6 +1355,52 @@ Completion ReplaySession::emulate_async_signal(Task* t, int sig,
   return COMPLETE;
 }
 
+/**
+ * Return true if, after the step of the syscallbuf flush that's
+ * finishing now, |t| will be resumed with PTRACE_SYSEMU to reach the
+ * next step.  That resume also completes the emulated syscall |t| is
+ * stopped in, so the single-step of |finish_emulated_syscall()| can be
+ * skipped, saving a ptrace stop per emulated syscall of the flush.
+ * Resuming with PTRACE_SYSCALL instead would report a syscall-exit stop
+ * for the skipped syscall, so executed syscalls (and the end of the
+ * flush, and debugger stepping) still need the finish.
+ */
+bool ReplaySession::flush_continues_emulated(Task* t, RunCommand stepi) {
+  if (stepi != RUN_CONTINUE) {
+    return false;
+  }
+  const uint8_t* recs = (const uint8_t*)syscallbuf_flush_buffer_hdr()->recs;
+  const struct syscallbuf_record* rec =
+      (const struct syscallbuf_record*)(recs +
+                                        current_step.flush
+                                            .syscall_record_offset);
+  switch (current_step.flush.state) {
+    case FLUSH_ARM:
+      return !is_madvise_syscall(rec->syscallno, t->arch());
+    case FLUSH_EXIT:
+      if (rec->desched) {
+        // The disarm-desched ioctl is next.
+        return true;
+      }
+    // Fall through.
+    case FLUSH_DISARM: {
+      size_t rec_size = stored_record_size(rec->size);
+      if (current_step.flush.num_rec_bytes_remaining <= rec_size) {
+        return false;
+      }
+      const struct syscallbuf_record* next_rec =
+          (const struct syscallbuf_record*)(recs +
+                                            current_step.flush
+                                                .syscall_record_offset +
+                                            rec_size);
+      return next_rec->desched ||
+             !is_madvise_syscall(next_rec->syscallno, t->arch());
+    }
+    default:
+      return false;
+  }
+}
+
 /**
  * Skip over the entry/exit of either an arm-desched-event or
  * disarm-desched-event ioctl(), as described by |ds|.  Return INCOMPLETE
@@ -1029,7 +1431,10 @@ Completion ReplaySession::skip_desched_ioctl(Task* t, ReplayDeschedState* ds,
   Registers r = t->regs();
   r.set_syscall_result(0);
   t->set_regs(r);
-  t->finish_emulated_syscall();
+  if (ds != &current_step.flush.desched ||
+      !flush_continues_emulated(t, stepi)) {
+    t->finish_emulated_syscall();
+  }
   return COMPLETE;
 }
 
@@ -1049,9 +1454,9 @@ void ReplaySession::prepare_syscallbuf_records(Task* t) {
   auto buf = t->trace_reader().read_raw_data();
   current_step.flush.num_rec_bytes_remaining = buf.data.size();
 
-  assert(current_step.flush.num_rec_bytes_remaining <= SYSCALLBUF_BUFFER_SIZE);
-  memcpy(syscallbuf_flush_buffer_array, buf.data.data(),
-         current_step.flush.num_rec_bytes_remaining);
+  assert(current_step.flush.num_rec_bytes_remaining <=
+         SYSCALLBUF_MAX_BUFFER_SIZE);
+  syscallbuf_flush_buffer_array.swap(buf.data);
 
   // The stored num_rec_bytes in the header doesn't include the
   // header bytes, but the stored trace data does.
@@ -1207,7 +1612,7 @@ Completion ReplaySession::flush_one_syscall(Task* t, RunCommand stepi) {
       Registers r = t->regs();
       r.set_syscall_result(rec_rec->ret);
       t->set_regs(r);
-      if (emu == EMULATE) {
+      if (emu == EMULATE && !flush_continues_emulated(t, stepi)) {
         t->finish_emulated_syscall();
       }
 
@@ -1417,6 +1822,12 @@ void ReplaySession::setup_replay_one_trace_frame(Task* t) {
       t->syscallbuf_hdr->num_rec_bytes = 0;
       current_step.action = TSTEP_RETIRE;
       break;
+    case EV_SHARED_MAPPING_CHANGE:
+      // The pages are written through |t|'s mapping of the emulated
+      // file, so every mapping of it sees them.
+      t->apply_all_data_records_from_trace();
+      current_step.action = TSTEP_RETIRE;
+      break;
     case EV_SCHED:
       current_step.action = TSTEP_PROGRAM_ASYNC_SIGNAL_INTERRUPT;
       current_step.target.ticks = trace_frame.ticks();
@@ -1455,7 +1866,188 @@ void ReplaySession::setup_replay_one_trace_frame(Task* t) {
 }
 
 ReplaySession::ReplayResult ReplaySession::replay_step(RunCommand command) {
+  double start = now_sec();
+  TraceFrame::Time start_time = trace_frame.time();
+  ReplayResult result = replay_one_step(command);
+  stats.frames += trace_frame.time() - start_time;
+  stats.seconds += now_sec() - start;
+  return result;
+}
+
+void ReplaySession::note_resume(ResumeRequest how, double seconds) {
+  ++stats.resumes[how];
+  stats.resume_seconds += seconds;
+  if (how == RESUME_SINGLESTEP || how == RESUME_SYSEMU_SINGLESTEP) {
+    ++stats.singlesteps[trace_frame.event().type];
+  }
+}
+
+void ReplaySession::note_trace_data(Task* t, remote_ptr<void> addr,
+                                    size_t len) {
+  if (write_index) {
+    write_index->add(trace_frame, t->rec_tid, addr, len);
+  }
+}
+
+static const char* step_type_name(int action) {
+  switch (action) {
+#define CASE(_id)                                                              \
+  case TSTEP_##_id:                                                            \
+    return #_id
+    CASE(NONE);
+    CASE(RETIRE);
+    CASE(ENTER_SYSCALL);
+    CASE(EXIT_SYSCALL);
+    CASE(DETERMINISTIC_SIGNAL);
+    CASE(PROGRAM_ASYNC_SIGNAL_INTERRUPT);
+    CASE(DELIVER_SIGNAL);
+    CASE(FLUSH_SYSCALLBUF);
+    CASE(DESCHED);
+#undef CASE
+    default:
+      return "???";
+  }
+}
+
+void ReplaySession::print_statistics(FILE* out) const {
+  fprintf(out, "Replayed %llu frames in %.2fs (%.0f frames/sec)\n",
+          (unsigned long long)stats.frames, stats.seconds,
+          stats.frames_per_sec());
+  fprintf(out, "  tracee resume+wait: %.3fs\n", stats.resume_seconds);
+  for (auto& it : stats.resumes) {
+    fprintf(out, "    %-28s %llu\n", ptrace_req_name(it.first),
+            (unsigned long long)it.second);
+  }
+  fprintf(out, "  singlesteps by frame type:\n");
+  for (int i = 0; i < EV_LAST; ++i) {
+    if (stats.singlesteps[i]) {
+      Event ev(EventType(i), NO_EXEC_INFO, x86_64);
+      fprintf(out, "    %-28s %llu\n", ev.type_name().c_str(),
+              (unsigned long long)stats.singlesteps[i]);
+    }
+  }
+  fprintf(out, "  trace steps:\n");
+  for (int i = 0; i < TSTEP_LAST; ++i) {
+    if (stats.step_counts[i]) {
+      fprintf(out, "    %-28s %llu in %.3fs\n", step_type_name(i),
+              (unsigned long long)stats.step_counts[i], stats.step_seconds[i]);
+    }
+  }
+  fprintf(out, "  trace reads/decompression: %.3fs\n",
+          stats.trace_read_seconds);
+  fprintf(out, "  recorded data writes: %llu bytes in %.3fs\n",
+          (unsigned long long)stats.data_bytes_written,
+          stats.data_write_seconds);
+  fprintf(out, "  emufs gc: %.3fs\n", stats.emufs_gc_seconds);
+  fprintf(out, "  interrupt skid: %llu samples, median %lld, 99%% %lld, "
+               "max %lld ticks (limit %lld)\n",
+          (unsigned long long)skid_stats.samples,
+          (long long)skid_percentile(0.5), (long long)skid_percentile(0.99),
+          (long long)skid_stats.max_skid,
+          (long long)PerfCounters::skid_size());
+}
+
+ReplaySession::ReplayStatus ReplaySession::fast_forward(
+    TraceFrame::Time target) {
+  for (auto vm : sas) {
+    assert(!vm->has_breakpoints());
+    assert(!vm->has_watchpoints());
+  }
+  double start = now_sec();
+  TraceFrame::Time start_time = trace_frame.time();
+  ReplayStatus status = REPLAY_CONTINUE;
+  while (trace_frame.time() < target && status == REPLAY_CONTINUE) {
+    // Without breakpoints the only breaks are signal deliveries,
+    // which need no handling here.
+    status = replay_one_step(RUN_CONTINUE).status;
+  }
+  stats.frames += trace_frame.time() - start_time;
+  stats.seconds += now_sec() - start;
+  return status;
+}
+
+bool ReplaySession::start_from_snapshot(TraceFrame::Time target) {
+  typedef TraceStream::ProcessSnapshot ProcessSnapshot;
+  vector<TraceFrame::Time> times = trace_in.snapshot_times();
+  auto it = upper_bound(times.begin(), times.end(), target);
+  if (it == times.begin()) {
+    return false;
+  }
+  ProcessSnapshot snapshot;
+  if (!trace_in.read_snapshot(*(it - 1), &snapshot)) {
+    return false;
+  }
+
+  // Before the exec, the replay address space doesn't match the
+  // recording's.
+  while (!can_validate() || !at_frame_start()) {
+    if (trace_frame.time() >= snapshot.time ||
+        replay_one_step(RUN_CONTINUE).status != REPLAY_CONTINUE) {
+      return false;
+    }
+  }
+  if (tasks().size() != 1 || trace_frame.time() > snapshot.time) {
+    return false;
+  }
+  Task* t = tasks().begin()->second;
+  if (t->rec_tid != snapshot.tid || t->arch() != x86_64 ||
+      t->vm()->exe_image() != snapshot.exe_image) {
+    LOG(debug) << "Snapshot at " << snapshot.time << " is of another process";
+    return false;
+  }
+  remote_ptr<void> ip_page = t->ip().as_int() & ~(page_size() - 1);
+  bool ip_covered = false;
+  for (auto& region : snapshot.regions) {
+    if (region.kind == ProcessSnapshot::REGION_VDSO &&
+        region.start != t->vm()->vdso().start.as_int()) {
+      LOG(debug) << "vdso moved since snapshot at " << snapshot.time;
+      return false;
+    }
+    if (region.kind == ProcessSnapshot::REGION_MEMORY &&
+        region.start <= ip_page.as_int() && ip_page.as_int() < region.end &&
+        (region.prot & PROT_EXEC)) {
+      ip_covered = true;
+    }
+  }
+  if (!ip_covered) {
+    return false;
+  }
+
+  LOG(info) << "Starting replay from snapshot at " << snapshot.time;
+  t->restore_snapshot(snapshot);
+  trace_in.seek_to_time(snapshot.time);
+  trace_in.seek_mapped_regions(snapshot.mmaps_offset);
+  current_step.action = TSTEP_NONE;
+  advance_to_next_trace_frame();
+  return true;
+}
+
+bool ReplaySession::save_snapshot(Task* t, TraceFrame::Time time) {
+  // The conditions RecordSession::maybe_write_snapshot() snapshots under.
+  if (partition || tasks().size() != 1 || t->arch() != x86_64 ||
+      t->regs().original_syscallno() < 0 ||
+      (t->syscallbuf_hdr && t->syscallbuf_hdr->num_rec_bytes)) {
+    return false;
+  }
+  TraceStream::ProcessSnapshot snapshot;
+  if (!t->save_snapshot(&snapshot)) {
+    return false;
+  }
+  snapshot.time = time;
+  snapshot.mmaps_offset = trace_in.mapped_regions_offset();
+  if (!trace_in.write_snapshot(snapshot)) {
+    LOG(warn) << "Couldn't save a snapshot at " << time << " in "
+              << trace_in.dir();
+    return false;
+  }
+  LOG(info) << "Saved a snapshot at " << time;
+  return true;
+}
+
+ReplaySession::ReplayResult ReplaySession::replay_one_step(
+    RunCommand command) {
   ReplayResult result;
+  current_state_id = new_state_id();
 
   Task* t = current_task();
 
@@ -1484,7 +2076,11 @@ ReplaySession::ReplayResult ReplaySession::replay_step(RunCommand command) {
 
   /* Advance towards fulfilling |current_step|. */
   ReplayTraceStepType current_action = current_step.action;
-  if (try_one_trace_step(t, command) == INCOMPLETE) {
+  double step_start = now_sec();
+  Completion completion = try_one_trace_step(t, command);
+  ++stats.step_counts[current_action];
+  stats.step_seconds[current_action] += now_sec() - step_start;
+  if (completion == INCOMPLETE) {
     if (EV_TRACE_TERMINATION == trace_frame.event().type) {
       // An irregular trace step had to read the
       // next trace frame, and that frame was an
@@ -1522,7 +2118,11 @@ ReplaySession::ReplayResult ReplaySession::replay_step(RunCommand command) {
   }
   if (can_validate() && SYSCALL_EXIT == trace_frame.event().state &&
       Flags::get().check_cached_mmaps) {
-    t->vm()->verify(t);
+    bool changes_mappings =
+        EV_SYSCALL == trace_frame.event().type &&
+        AddressSpace::syscall_changes_mappings(trace_frame.event().data,
+                                               trace_frame.event().arch());
+    t->vm()->maybe_verify(t, changes_mappings);
   }
 
   Event ev(trace_frame.event());
@@ -1534,6 +2134,13 @@ ReplaySession::ReplayResult ReplaySession::replay_step(RunCommand command) {
 
   // Record that this step completed successfully.
   current_step.action = TSTEP_NONE;
+  TraceFrame::Time next_time = trace_frame.time() + 1;
   advance_to_next_trace_frame();
+  uint32_t save_at = Flags::get().save_snapshot_event;
+  if (save_at && !snapshot_saved && next_time >= save_at &&
+      EV_SYSCALL == ev.type() && EXITING_SYSCALL == ev.Syscall().state &&
+      !last_task()) {
+    snapshot_saved = save_snapshot(t, next_time);
+  }
   return result;
 }
@@ -3,10 +3,19 @@
 #ifndef RR_REPLAY_SESSION_H_
 #define RR_REPLAY_SESSION_H_
 
+#include <stdio.h>
+#include <string.h>
+
+#include <set>
+
 #include "CPUIDBugDetector.h"
 #include "DiversionSession.h"
 #include "EmuFs.h"
 #include "Session.h"
+#include "TracePartition.h"
+
+class ReplayProfiler;
+class WriteIndex;
 
 struct syscallbuf_hdr;
 
@@ -98,6 +107,8 @@ enum ReplayTraceStepType {
   /* Emulate arming or disarming the desched event.  |desched|
    * tracks the replay state. */
   TSTEP_DESCHED,
+
+  TSTEP_LAST
 };
 
 enum ExecOrEmulate {
@@ -176,6 +187,31 @@ public:
   /** Collect garbage files from this session's emufs. */
   void gc_emufs();
 
+  virtual void on_shared_file_unmapped(const FileId& id) {
+    emu_fs->maybe_unused(id);
+  }
+
+  /**
+   * Return true if the file backing |file|, mapped with |prot| and
+   * |flags|, still has to be checked against its recorded metadata, and
+   * note that it no longer does.  Sessions cloned from one another share
+   * the files they've checked, so checkpoints don't check them again.
+   */
+  bool backing_file_needs_verification(const TraceMappedRegion& file,
+                                       int prot, int flags);
+
+  /**
+   * Memory held by a session, in pages.  |resident_pages| counts all
+   * the pages of its tracees and emulated files that are in memory,
+   * |unique_pages| only the ones not shared copy-on-write with another
+   * session, i.e. what destroying the session would free.
+   */
+  struct MemoryUsage {
+    uint64_t resident_pages;
+    uint64_t unique_pages;
+  };
+  MemoryUsage memory_usage() const;
+
   TraceReader& trace_reader() { return trace_in; }
 
   /**
@@ -184,6 +220,11 @@ public:
    */
   const TraceFrame& current_trace_frame() const { return trace_frame; }
 
+  /**
+   * Return true if replay of the current trace frame hasn't started yet.
+   */
+  bool at_frame_start() const { return current_step.action == TSTEP_NONE; }
+
   /**
    * The Task for the current trace record.
    */
@@ -231,27 +272,160 @@ public:
   };
   ReplayResult replay_step(RunCommand command = RUN_CONTINUE);
 
+  /**
+   * Return an id for the current state of this session.  It changes
+   * whenever replay makes progress, and no other session, clones
+   * included, ever has the same one.  So something derived from this
+   * session can tell whether it's still in sync with it.
+   */
+  uint64_t state_id() const { return current_state_id; }
+
+  /**
+   * Replay without stopping until the next frame to replay is at or
+   * after |target|, or all tracees are dead.  There's no debugger to
+   * report breaks to, so there must be no breakpoints or watchpoints.
+   */
+  ReplayStatus fast_forward(TraceFrame::Time target);
+
+  /**
+   * Skip ahead to the latest process snapshot recorded at or before
+   * |target|, if any: replay up to the initial exec, then make the
+   * process look like the snapshot and continue from the frame after
+   * it.  Tracee output of the skipped frames isn't replayed.  Returns
+   * false if there's no usable snapshot, possibly after having
+   * replayed up to the exec as usual.
+   */
+  bool start_from_snapshot(TraceFrame::Time target);
+  /**
+   * Save a snapshot of |t|, which has just replayed the syscall exit
+   * before the |time| frame, in the trace for start_from_snapshot() of
+   * later replays, if it's the only task and can be snapshotted.  Returns
+   * true if a snapshot was saved.
+   */
+  bool save_snapshot(Task* t, TraceFrame::Time time);
+
+  /**
+   * How fast this session has replayed so far, and where the time went.
+   */
+  struct Statistics {
+    Statistics()
+        : frames(0),
+          seconds(0),
+          resume_seconds(0),
+          trace_read_seconds(0),
+          data_bytes_written(0),
+          data_write_seconds(0),
+          emufs_gc_seconds(0) {
+      memset(step_counts, 0, sizeof(step_counts));
+      memset(step_seconds, 0, sizeof(step_seconds));
+      memset(singlesteps, 0, sizeof(singlesteps));
+    }
+    // Number of trace frames replayed.
+    uint64_t frames;
+    // Wall-clock time spent replaying them.
+    double seconds;
+    // Tracee resumptions, by ptrace request.
+    std::map<ResumeRequest, uint64_t> resumes;
+    // Time spent resuming tracees and waiting for them to stop.
+    double resume_seconds;
+    // Singlesteps, by the type of the frame being replayed.
+    uint64_t singlesteps[EV_LAST];
+    // Trace steps attempted and the time spent in them, by step type.
+    uint64_t step_counts[TSTEP_LAST];
+    double step_seconds[TSTEP_LAST];
+    // Time spent reading (and waiting for decompression of) frames and
+    // raw data.
+    double trace_read_seconds;
+    // Recorded data written back into tracee memory.
+    uint64_t data_bytes_written;
+    double data_write_seconds;
+    double emufs_gc_seconds;
+    double frames_per_sec() const { return seconds > 0 ? frames / seconds : 0; }
+  };
+  const Statistics& statistics() const { return stats; }
+  void print_statistics(FILE* out) const;
+
+  /**
+   * Hooks for the tasks of this session to account tracee resumptions
+   * and trace reads/data writes in |statistics()|.
+   */
+  void note_resume(ResumeRequest how, double seconds);
+  void note_trace_read(double seconds) { stats.trace_read_seconds += seconds; }
+  void note_data_write(size_t bytes, double seconds) {
+    stats.data_bytes_written += bytes;
+    stats.data_write_seconds += seconds;
+  }
+  /**
+   * Pass the recorded data replay writes into tracee memory to |index|,
+   * if not null.  Clones don't inherit it.
+   */
+  void set_write_index(WriteIndex* index) { write_index = index; }
+  /**
+   * Hook for the tasks of this session to report that the |len| bytes at
+   * |addr| of |t| were written from the trace.
+   */
+  void note_trace_data(Task* t, remote_ptr<void> addr, size_t len);
+
+  /**
+   * Sample the tracees' stacks with |p| as they run, if not null.  Clones
+   * don't inherit it.
+   */
+  void set_profiler(ReplayProfiler* p) { profiler = p; }
+  ReplayProfiler* get_profiler() const { return profiler; }
+
+  /**
+   * Only replay the frames |p| selects; the tasks of other partitions
+   * are created as usual but never run.  Must be called before the
+   * first replay step.
+   */
+  void set_partition(std::shared_ptr<const TracePartition> p) {
+    partition = p;
+  }
+  /**
+   * Return true if the writes of |t| to stdout/stderr should be replayed.
+   */
+  bool replays_output_of(Task* t) const {
+    return !partition || partition->owns(t->rec_tid);
+  }
+
   virtual ReplaySession* as_replay() { return this; }
 
 private:
+  // How much decoded trace data sessions cloned from one another keep in
+  // memory, so that replaying the same stretch of the trace again (after
+  // a restart, say) doesn't decompress it again.
+  static const size_t FRAME_CACHE_BYTES = 64 * 1024 * 1024;
+
   ReplaySession(const std::string& dir)
       : emu_fs(EmuFs::create()),
+        verified_backing_files(new std::set<VerifiedBackingFile>()),
         last_debugged_task(nullptr),
         tgid_debugged(0),
         trace_in(dir),
         trace_frame(),
-        current_step() {
+        current_step(),
+        current_state_id(new_state_id()),
+        write_index(nullptr),
+        profiler(nullptr),
+        snapshot_saved(false) {
+    trace_in.enable_frame_cache(FRAME_CACHE_BYTES);
     advance_to_next_trace_frame();
   }
 
   ReplaySession(const ReplaySession& other)
       : emu_fs(other.emu_fs->clone()),
+        verified_backing_files(other.verified_backing_files),
         last_debugged_task(nullptr),
         tgid_debugged(other.tgid_debugged),
         trace_in(other.trace_in),
         trace_frame(other.trace_frame),
         current_step(other.current_step),
-        cpuid_bug_detector(other.cpuid_bug_detector) {
+        cpuid_bug_detector(other.cpuid_bug_detector),
+        partition(other.partition),
+        current_state_id(new_state_id()),
+        write_index(nullptr),
+        profiler(nullptr),
+        snapshot_saved(other.snapshot_saved) {
     assert(!other.last_debugged_task);
   }
 
@@ -269,17 +443,25 @@ private:
 
   void copy_state_to(Session& dest, EmuFs& dest_emu_fs);
 
+  static uint64_t new_state_id() {
+    static uint64_t next_state_id = 1;
+    return next_state_id++;
+  }
+
   const struct syscallbuf_hdr* syscallbuf_flush_buffer_hdr() {
-    return (const struct syscallbuf_hdr*)syscallbuf_flush_buffer_array;
+    return (const struct syscallbuf_hdr*)syscallbuf_flush_buffer_array.data();
   }
 
+  ReplayResult replay_one_step(RunCommand command);
   void setup_replay_one_trace_frame(Task* t);
   void advance_to_next_trace_frame();
+  void skip_trace_frame();
   Completion emulate_signal_delivery(Task* oldtask, int sig);
   Completion try_one_trace_step(Task* t, RunCommand stepi);
   Completion cont_syscall_boundary(Task* t, ExecOrEmulate emu,
                                    RunCommand stepi);
   Completion enter_syscall(Task* t, RunCommand stepi);
+  bool next_frame_enters_emulated_syscall(Task* t);
   Completion exit_syscall(Task* t, RunCommand stepi);
   Ticks get_ticks_slack(Task* t);
   void check_ticks_consistency(Task* t, const Event& ev);
@@ -300,6 +482,7 @@ private:
   Completion emulate_deterministic_signal(Task* t, int sig, RunCommand stepi);
   Completion emulate_async_signal(Task* t, int sig, RunCommand stepi,
                                   Ticks ticks);
+  bool flush_continues_emulated(Task* t, RunCommand stepi);
   Completion skip_desched_ioctl(Task* t, ReplayDeschedState* ds,
                                 RunCommand stepi);
   void prepare_syscallbuf_records(Task* t);
@@ -307,22 +490,59 @@ private:
   Completion flush_syscallbuf(Task* t, RunCommand stepi);
   bool is_last_interesting_task(Task* t);
 
+  /**
+   * A backing file that was checked against its recorded metadata.  The
+   * recorded mtime and name are part of the key, so a file that's
+   * replaced or mapped under another name is checked again.
+   */
+  struct VerifiedBackingFile {
+    FileId id;
+    time_t mtime;
+    std::string name;
+    int prot;
+    int flags;
+
+    bool operator<(const VerifiedBackingFile& o) const {
+      if (id < o.id || o.id < id) {
+        return id < o.id;
+      }
+      if (mtime != o.mtime) {
+        return mtime < o.mtime;
+      }
+      if (prot != o.prot) {
+        return prot < o.prot;
+      }
+      if (flags != o.flags) {
+        return flags < o.flags;
+      }
+      return name < o.name;
+    }
+  };
+
   std::shared_ptr<EmuFs> emu_fs;
+  std::shared_ptr<std::set<VerifiedBackingFile> > verified_backing_files;
   Task* last_debugged_task;
   pid_t tgid_debugged;
   TraceReader trace_in;
   TraceFrame trace_frame;
   ReplayTraceStep current_step;
   CPUIDBugDetector cpuid_bug_detector;
+  std::shared_ptr<const TracePartition> partition;
+  uint64_t current_state_id;
+  Statistics stats;
+  WriteIndex* write_index;
+  ReplayProfiler* profiler;
+  // Whether the snapshot Flags::save_snapshot_event asks for was saved.
+  bool snapshot_saved;
   /**
    * Buffer for recorded syscallbuf bytes.  By definition buffer flushes
    * must be replayed sequentially, so we can use one buffer for all
    * tracees.  At the start of the flush, the recorded bytes are read
    * back into this buffer.  Then they're copied back to the tracee
    * record-by-record, as the tracee exits those syscalls.
-   * This needs to be word-aligned.
+   * This needs to be word-aligned, which vector storage is.
    */
-  uint8_t syscallbuf_flush_buffer_array[SYSCALLBUF_BUFFER_SIZE];
+  std::vector<uint8_t> syscallbuf_flush_buffer_array;
 };
 
 #endif // RR_REPLAY_SESSION_H_
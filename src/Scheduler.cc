@@ -6,6 +6,7 @@
 #include "Scheduler.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,43 +33,152 @@ static void note_switch(Task* prev_t, Task* t, int max_events) {
   }
 }
 
+Scheduler::Scheduler(RecordSession& session)
+    : session(session),
+      round_robin_active(false),
+      round_robin_epoch(0),
+      round_robin_last(nullptr),
+      current(nullptr) {
+  const Flags& flags = Flags::get();
+  if (flags.chaos) {
+    uint32_t seed = flags.chaos_seed;
+    if (!seed) {
+      seed = random();
+      fprintf(stderr, "rr: chaos mode seed %u\n", seed);
+    }
+    chaos_random.seed(seed);
+  }
+}
+
+bool Scheduler::chaos_chance(int n) {
+  return Flags::get().chaos && 0 == chaos_random() % n;
+}
+
+static void reset_timeslice(Task* t) {
+  t->timeslice_ticks = Flags::get().max_ticks;
+}
+
+int Scheduler::timeslice_ticks(Task* t) {
+  if (!Flags::get().chaos) {
+    return t->timeslice_ticks;
+  }
+  // Mostly normal timeslices, but a good share of very short ones, so
+  // that tasks often get preempted in the middle of short critical
+  // sections.
+  int max_ticks = Flags::get().max_ticks;
+  int limit = chaos_chance(4) ? min(max_ticks, 1000) : 2 * max_ticks;
+  int ticks = 1 + chaos_random() % limit;
+  LOG(debug) << "  chaos timeslice for " << t->tid << " is " << ticks;
+  return ticks;
+}
+
+void Scheduler::on_timeslice_expired(Task* t) {
+  const Flags& flags = Flags::get();
+  if (!flags.adaptive_timeslice) {
+    return;
+  }
+  int max_timeslice = flags.max_ticks * MAX_TIMESLICE_MULTIPLIER;
+  if (t->timeslice_ticks < max_timeslice) {
+    t->timeslice_ticks = min(max_timeslice, t->timeslice_ticks * 2);
+    LOG(debug) << "  " << t->tid << " used up its timeslice; growing it to "
+               << t->timeslice_ticks << " ticks";
+  }
+}
+
 Task* Scheduler::get_next_task_with_same_priority(Task* t) {
-  if (t->in_round_robin_queue) {
+  if (in_round_robin(t)) {
     return nullptr;
   }
 
-  auto it = task_priority_set.find(make_pair(t->priority, t));
-  assert(it != task_priority_set.end());
-  ++it;
+  // |t| itself may be in |blocked_tasks|.
+  auto it = task_priority_set.upper_bound(make_pair(t->priority, t));
   if (it == task_priority_set.end() || it->first != t->priority) {
     it = task_priority_set.lower_bound(make_pair(t->priority, nullptr));
   }
+  if (it == task_priority_set.end() || it->first != t->priority) {
+    return nullptr;
+  }
   return it->second;
 }
 
-/**
- * Returns true if we should return t as the runnable task. Otherwise we
- * should check the next task.
- */
-static bool is_task_runnable(Task* t, bool* by_waitpid) {
+void Scheduler::collect_wait_statuses() {
+  int status;
+  pid_t tid;
+  while (0 < (tid = waitpid(-1, &status, WNOHANG | __WALL | WSTOPPED))) {
+    Task* t = session.find_task(tid);
+    if (!t) {
+      LOG(debug) << "  " << tid << " changed status, but it's dead";
+      continue;
+    }
+    LOG(debug) << "  " << tid << " changed status to " << HEX(status);
+    t->did_waitpid(status);
+    waited_tasks.insert(t);
+  }
+}
+
+bool Scheduler::take_waited_task(Task* t) {
+  if (!waited_tasks.erase(t)) {
+    return false;
+  }
+  t->pseudo_blocked = false;
+  return true;
+}
+
+void Scheduler::on_status_changed(Task* t) {
+  if (blocked_tasks.erase(t)) {
+    t->round_robin_epoch = round_robin_epoch;
+    task_priority_set.insert(make_pair(t->priority, t));
+  }
+}
+
+void Scheduler::park_blocked_tasks() {
+  for (Task* t : newly_blocked_tasks) {
+    if (in_round_robin(t) ||
+        !task_priority_set.erase(make_pair(t->priority, t))) {
+      continue;
+    }
+    blocked_tasks.insert(t);
+  }
+  newly_blocked_tasks.clear();
+}
+
+bool Scheduler::is_task_runnable(Task* t, bool* by_waitpid,
+                                 bool* collected_statuses) {
+  if (t->is_waiting_for_vfork_child()) {
+    LOG(debug) << "  " << t->tid << " is waiting for vfork child "
+               << t->vfork_child_tid;
+    return false;
+  }
+
+  if (take_waited_task(t)) {
+    *by_waitpid = true;
+    LOG(debug) << "  " << t->tid << " ready with status " << HEX(t->status());
+    return true;
+  }
+
   if (t->unstable) {
     LOG(debug) << "  " << t->tid << " is unstable, doing waitpid(-1)";
     return true;
   }
 
-  if (!t->may_be_blocked()) {
+  if (!t->may_be_blocked() && !t->running_in_parallel) {
     LOG(debug) << "  " << t->tid << " isn't blocked";
     return true;
   }
 
-  LOG(debug) << "  " << t->tid << " is blocked on " << t->ev()
-             << "; checking status ...";
-  bool did_wait_for_t;
+  LOG(debug) << "  " << t->tid << " is "
+             << (t->running_in_parallel ? "running" : "blocked") << " on "
+             << t->ev() << "; checking status ...";
+  bool did_wait_for_t = false;
   if (t->pseudo_blocked) {
     t->wait();
     did_wait_for_t = true;
-  } else {
-    did_wait_for_t = t->try_wait();
+  } else if (!*collected_statuses) {
+    // Reap the status changes of all blocked tasks at once, rather
+    // than trying each blocked task in turn.
+    collect_wait_statuses();
+    *collected_statuses = true;
+    did_wait_for_t = take_waited_task(t);
   }
   if (did_wait_for_t) {
     t->pseudo_blocked = false;
@@ -77,12 +187,42 @@ static bool is_task_runnable(Task* t, bool* by_waitpid) {
     return true;
   }
   LOG(debug) << "  still blocked";
+  // It's waiting on something, probably another task, so it doesn't
+  // need a long timeslice when it wakes up.
+  reset_timeslice(t);
+  if (*collected_statuses && !t->pseudo_blocked) {
+    newly_blocked_tasks.push_back(t);
+  }
   // Try next task
   return false;
 }
 
+Task* Scheduler::find_random_runnable_task(bool* by_waitpid,
+                                           bool* collected_statuses) {
+  if (task_priority_set.size() < 2 || !chaos_chance(8)) {
+    return nullptr;
+  }
+  // Start at a random task and take the first runnable one, whatever
+  // its priority.
+  auto begin_at = task_priority_set.begin();
+  advance(begin_at, chaos_random() % task_priority_set.size());
+  auto it = begin_at;
+  do {
+    Task* t = it->second;
+    if (is_task_runnable(t, by_waitpid, collected_statuses)) {
+      LOG(debug) << "  chaos: choosing " << t->tid << " regardless of priority";
+      return t;
+    }
+    if (++it == task_priority_set.end()) {
+      it = task_priority_set.begin();
+    }
+  } while (it != begin_at);
+  return nullptr;
+}
+
 Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
   *by_waitpid = false;
+  bool collected_statuses = false;
 
   while (true) {
     Task* t = get_next_round_robin_task();
@@ -90,7 +230,7 @@ Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
       break;
     }
     LOG(debug) << "Choosing task " << t->tid << " from yield queue";
-    if (is_task_runnable(t, by_waitpid)) {
+    if (is_task_runnable(t, by_waitpid, &collected_statuses)) {
       return t;
     }
     // This task had its chance to run but couldn't. Move to the
@@ -98,6 +238,11 @@ Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
     remove_round_robin_task();
   }
 
+  Task* t = find_random_runnable_task(by_waitpid, &collected_statuses);
+  if (t) {
+    return t;
+  }
+
   // The outer loop has one iteration per unique priority value.
   // The inner loop iterates over all tasks with that priority.
   for (auto same_priority_start = task_priority_set.begin();
@@ -108,14 +253,18 @@ Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
 
     auto begin_at = same_priority_start;
     if (current && priority == current->priority) {
-      begin_at = task_priority_set.find(make_pair(priority, current));
+      // |current| may be in |blocked_tasks|.
+      begin_at = task_priority_set.lower_bound(make_pair(priority, current));
+      if (begin_at == same_priority_end) {
+        begin_at = same_priority_start;
+      }
     }
 
     auto task_iterator = begin_at;
     do {
       Task* t = task_iterator->second;
 
-      if (is_task_runnable(t, by_waitpid)) {
+      if (is_task_runnable(t, by_waitpid, &collected_statuses)) {
         return t;
       }
 
@@ -146,7 +295,10 @@ Task* Scheduler::get_next_thread(Task* t, bool* by_waitpid) {
   if (current && !current->switchable) {
     LOG(debug) << "  (" << current->tid << " is un-switchable at "
                << current->ev() << ")";
-    if (current->may_be_blocked()) {
+    if (take_waited_task(current)) {
+      LOG(debug) << "  and its status was already collected";
+      *by_waitpid = true;
+    } else if (current->may_be_blocked()) {
       LOG(debug) << "  and not runnable; waiting for state change";
 /* |current| is un-switchable, but not runnable in
  * this state.  Wait for it to change state
@@ -170,8 +322,9 @@ Task* Scheduler::get_next_thread(Task* t, bool* by_waitpid) {
   }
 
   /* Prefer switching to the next task if the current one
-   * exceeded its event limit. */
-  if (current && current->succ_event_counter > max_events) {
+   * exceeded its event limit, or sometimes at random in chaos mode. */
+  if (current && (current->succ_event_counter > max_events ||
+                  (!in_round_robin(current) && chaos_chance(4)))) {
     LOG(debug) << "  previous task exceeded event limit, preferring next";
     current->succ_event_counter = 0;
     if (current == get_next_round_robin_task()) {
@@ -181,8 +334,9 @@ Task* Scheduler::get_next_thread(Task* t, bool* by_waitpid) {
   }
 
   Task* next = find_next_runnable_task(by_waitpid);
+  park_blocked_tasks();
 
-  if (next && !next->unstable) {
+  if (next && (!next->unstable || *by_waitpid)) {
     LOG(debug) << "  selecting task " << next->tid;
   } else {
     // All the tasks are blocked (or we found an unstable-exit task).
@@ -192,6 +346,16 @@ Task* Scheduler::get_next_thread(Task* t, bool* by_waitpid) {
 
     LOG(debug) << "  all tasks blocked or some unstable, waiting for runnable ("
                << task_priority_set.size() << " total)";
+    if (!waited_tasks.empty()) {
+      // Some status change has already been reaped.
+      next = *waited_tasks.begin();
+      take_waited_task(next);
+      LOG(debug) << "  selecting already-waited task " << next->tid;
+      *by_waitpid = true;
+      note_switch(current, next, max_events);
+      current = next;
+      return current;
+    }
     do {
       tid = waitpid(-1, &status, __WALL | WSTOPPED | WUNTRACED);
       if (-1 == tid) {
@@ -208,8 +372,9 @@ Task* Scheduler::get_next_thread(Task* t, bool* by_waitpid) {
         LOG(debug) << "    ... but it's dead";
       }
     } while (!next);
-    ASSERT(next, next->unstable || next->may_be_blocked())
-        << "Scheduled task should have been blocked or unstable";
+    ASSERT(next, next->unstable || next->may_be_blocked() ||
+                     next->running_in_parallel)
+        << "Scheduled task should have been blocked, running or unstable";
     next->did_waitpid(status);
     *by_waitpid = true;
   }
@@ -220,11 +385,20 @@ Task* Scheduler::get_next_thread(Task* t, bool* by_waitpid) {
 }
 
 void Scheduler::on_create(Task* t) {
-  assert(!t->in_round_robin_queue);
+  // New tasks wait for the next round.
+  t->round_robin_epoch = round_robin_epoch;
+  reset_timeslice(t);
   task_priority_set.insert(make_pair(t->priority, t));
 }
 
 void Scheduler::on_destroy(Task* t) {
+  waited_tasks.erase(t);
+  if (blocked_tasks.erase(t)) {
+    if (t == current) {
+      current = nullptr;
+    }
+    return;
+  }
   if (t == current) {
     current = get_next_task_with_same_priority(t);
     if (t == current) {
@@ -232,20 +406,17 @@ void Scheduler::on_destroy(Task* t) {
     }
   }
 
-  if (t->in_round_robin_queue) {
-    auto iter =
-        find(task_round_robin_queue.begin(), task_round_robin_queue.end(), t);
-    task_round_robin_queue.erase(iter);
-  } else {
-    task_priority_set.erase(make_pair(t->priority, t));
+  if (t == round_robin_last) {
+    round_robin_last = nullptr;
   }
+  task_priority_set.erase(make_pair(t->priority, t));
 }
 
 void Scheduler::update_task_priority(Task* t, int value) {
   if (t->priority == value) {
     return;
   }
-  if (t->in_round_robin_queue) {
+  if (blocked_tasks.count(t)) {
     t->priority = value;
     return;
   }
@@ -255,36 +426,50 @@ void Scheduler::update_task_priority(Task* t, int value) {
 }
 
 void Scheduler::schedule_one_round_robin(Task* t) {
-  if (!task_round_robin_queue.empty()) {
+  // |t| yielded, so it's waiting for some other task.
+  reset_timeslice(t);
+  if (round_robin_active) {
     return;
   }
 
-  for (auto iter : task_priority_set) {
-    if (iter.second != t) {
-      task_round_robin_queue.push_back(iter.second);
-      iter.second->in_round_robin_queue = true;
-    }
-  }
-  task_round_robin_queue.push_back(t);
-  t->in_round_robin_queue = true;
-  task_priority_set.clear();
+  ++round_robin_epoch;
+  round_robin_active = true;
+  round_robin_cursor = make_pair(INT_MIN, nullptr);
+  round_robin_last = t;
+}
+
+bool Scheduler::in_round_robin(Task* t) const {
+  return round_robin_active && t->round_robin_epoch < round_robin_epoch;
 }
 
 Task* Scheduler::get_next_round_robin_task() {
-  if (task_round_robin_queue.empty()) {
+  if (!round_robin_active) {
     return nullptr;
   }
 
-  return task_round_robin_queue.front();
+  // Skip tasks that have had their turn, or joined since the round
+  // started.
+  auto it = task_priority_set.lower_bound(round_robin_cursor);
+  while (it != task_priority_set.end() &&
+         (!in_round_robin(it->second) || it->second == round_robin_last)) {
+    ++it;
+  }
+  if (it != task_priority_set.end()) {
+    round_robin_cursor = *it;
+    return it->second;
+  }
+  if (round_robin_last && in_round_robin(round_robin_last) &&
+      task_priority_set.count(
+          make_pair(round_robin_last->priority, round_robin_last))) {
+    return round_robin_last;
+  }
+  round_robin_active = false;
+  round_robin_last = nullptr;
+  return nullptr;
 }
 
 void Scheduler::remove_round_robin_task() {
-  assert(!task_round_robin_queue.empty());
-
-  Task* t = task_round_robin_queue.front();
-  task_round_robin_queue.pop_front();
-  if (t) {
-    t->in_round_robin_queue = false;
-    task_priority_set.insert(make_pair(t->priority, t));
-  }
+  Task* t = get_next_round_robin_task();
+  assert(t);
+  t->round_robin_epoch = round_robin_epoch;
 }
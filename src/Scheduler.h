@@ -3,8 +3,9 @@
 #ifndef RR_REC_SCHED_H_
 #define RR_REC_SCHED_H_
 
-#include <deque>
+#include <random>
 #include <set>
+#include <vector>
 
 class RecordSession;
 class Task;
@@ -20,16 +21,16 @@ class Task;
  * starvation.
  *
  * When a task calls sched_yield we temporarily switch to a completely
- * fair scheduler that ignores priorities. All tasks are placed on a queue
- * and while the queue is non-empty we take the next task from the queue and
- * run it for a quantum if it's runnable. We do this because tasks calling
+ * fair scheduler that ignores priorities. A round starts in which every task
+ * gets a turn, and until the round is over we take the next task whose turn
+ * it is and run it for a quantum if it's runnable. We do this because tasks calling
  * sched_yield are often expecting some kind of fair scheduling and may deadlock
  * (e.g. trying to acquire a spinlock) if some other tasks don't get a chance
  * to run.
  */
 class Scheduler {
 public:
-  Scheduler(RecordSession& session) : session(session), current(nullptr) {}
+  Scheduler(RecordSession& session);
 
   /**
    * Given a previously-scheduled task |t|, return a new runnable task (which
@@ -53,21 +54,40 @@ public:
    * Do one round of round-robin scheduling if we're not already doing one.
    * If we start round-robin scheduling now, make last_task the last
    * task to be scheduled.
-   * If the task_round_robin_queue is empty this moves all tasks into it,
-   * putting last_task last.
+   * Starting a round takes constant time, however many tasks there are:
+   * it just begins a new round-robin epoch.
    */
   void schedule_one_round_robin(Task* last_task);
 
+  /**
+   * Return the number of ticks to let |t| run for before interrupting
+   * it.  With adaptive timeslices, |t|'s timeslice doubles each time it
+   * runs to the end of it, up to MAX_TIMESLICE_MULTIPLIER times
+   * |max_ticks|, and drops back to |max_ticks| as soon as |t| is seen
+   * blocked or yields, i.e. is waiting on other tasks.  In chaos
+   * mode, return a random number of ticks instead.
+   */
+  int timeslice_ticks(Task* t);
+
+  /**
+   * Call this when |t| was interrupted at the end of its timeslice.
+   */
+  void on_timeslice_expired(Task* t);
+
   void on_create(Task* t);
   /**
    * De-register a thread. This function should be called when a thread exits.
    */
   void on_destroy(Task* t);
+  /**
+   * Call this when a waitpid() status change of |t| has been reaped, by
+   * whoever reaped it.
+   */
+  void on_status_changed(Task* t);
 
 private:
   // Tasks sorted by priority.
   typedef std::set<std::pair<int, Task*> > TaskPrioritySet;
-  typedef std::deque<Task*> TaskQueue;
 
   /**
    * Pull a task from the round-robin queue if available. Otherwise,
@@ -79,28 +99,101 @@ private:
    */
   Task* find_next_runnable_task(bool* by_waitpid);
   /**
-   * Returns the first task in the round-robin queue or null if it's empty.
+   * In chaos mode, sometimes return a runnable task chosen regardless of
+   * priority, to invert priorities.  Otherwise return nullptr.
+   */
+  Task* find_random_runnable_task(bool* by_waitpid, bool* collected_statuses);
+  /**
+   * Return true one time in |n|, if in chaos mode.
+   */
+  bool chaos_chance(int n);
+  /**
+   * Returns the task whose turn it is in the current round-robin round, or
+   * null if there's no round going on (ending a round that's run out of
+   * tasks).
    */
   Task* get_next_round_robin_task();
   /**
-   * Removes a task from the front of the round-robin queue.
+   * Ends the turn of the task get_next_round_robin_task() returns.
    */
   void remove_round_robin_task();
+  /**
+   * Returns true if |t| has yet to have its turn in the current round.
+   */
+  bool in_round_robin(Task* t) const;
   Task* get_next_task_with_same_priority(Task* t);
+  /**
+   * Returns true if we should return t as the runnable task. Otherwise we
+   * should check the next task.  The first blocked task checked in a
+   * scheduling pass reaps the status changes of all tasks, setting
+   * |*collected_statuses|.
+   */
+  bool is_task_runnable(Task* t, bool* by_waitpid, bool* collected_statuses);
+  /**
+   * Reap every pending waitpid() status change without blocking, and
+   * add the tasks they belong to to |waited_tasks|.
+   */
+  void collect_wait_statuses();
+  /**
+   * If |t| is in |waited_tasks|, remove it and return true.
+   */
+  bool take_waited_task(Task* t);
+  /**
+   * Move the tasks the last scheduling pass found blocked from
+   * |task_priority_set| to |blocked_tasks|.
+   */
+  void park_blocked_tasks();
+  // Compute-bound tasks' timeslices grow to at most this multiple of
+  // |max_ticks|.  At the default |max_ticks| that's about 400ms, which
+  // keeps interactive programs responsive.
+  static const int MAX_TIMESLICE_MULTIPLIER = 8;
 
   RecordSession& session;
 
   /**
-   * Every task of this session is either in task_priority_set
-   * (when in_round_robin_queue is false), or in task_round_robin_queue
-   * (when in_round_robin_queue is true).
+   * Every task of this session is either in task_priority_set or in
+   * blocked_tasks.
    *
    * task_priority_set is a set of pairs of (task->priority, task). This
    * lets us efficiently iterate over the tasks with a given priority, or
    * all tasks in priority order.
    */
   TaskPrioritySet task_priority_set;
-  TaskQueue task_round_robin_queue;
+
+  /**
+   * A round-robin round gives each task that was in task_priority_set
+   * when it started a turn, in task_priority_set order, except that
+   * |round_robin_last| goes last. Tasks are stamped with the round's
+   * epoch when their turn ends, or when they join task_priority_set
+   * during it, so nothing has to be moved to start or end a round.
+   * |round_robin_cursor| is where in task_priority_set the round is up
+   * to.
+   */
+  bool round_robin_active;
+  uint64_t round_robin_epoch;
+  std::pair<int, Task*> round_robin_cursor;
+  Task* round_robin_last;
+
+  /**
+   * Blocked tasks whose status change collect_wait_statuses() has
+   * already reaped (and passed to Task::did_waitpid()), but which
+   * haven't been scheduled since.  They must not be waited for again.
+   */
+  std::set<Task*> waited_tasks;
+
+  /**
+   * Tasks found blocked, with no status change to reap, by a scheduling
+   * pass.  Nothing can change until a status change of theirs is reaped,
+   * so they're left out of task_priority_set until then, and scheduling
+   * passes don't cost more the more tasks are blocked.
+   */
+  std::set<Task*> blocked_tasks;
+  // The tasks the current scheduling pass found blocked.
+  std::vector<Task*> newly_blocked_tasks;
+
+  // Random numbers for chaos mode.  This isn't random(), so that
+  // nothing else rr does can perturb a seeded run.
+  std::minstd_rand chaos_random;
 
   /**
    * The currently scheduled task. This may be nullptr if the last scheduled
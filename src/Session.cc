@@ -8,6 +8,7 @@
 #include <sys/prctl.h>
 
 #include <algorithm>
+#include <set>
 
 #include "log.h"
 #include "task.h"
@@ -64,11 +65,20 @@ Task* Session::find_task(pid_t rec_tid) const {
 }
 
 void Session::kill_all_tasks() {
+  // SIGKILL kills a whole thread group, so signal each group once, all
+  // before tearing any task down: the kernel then destroys the groups
+  // concurrently while we free our state, and we destabilize each group
+  // once instead of once per task.
+  set<TaskGroup*> killed;
+  for (auto& kv : task_map) {
+    Task* t = kv.second;
+    if (!t->stable_exit && killed.insert(t->task_group().get()).second) {
+      LOG(debug) << "Killing " << t->tid << "(" << t << ")";
+      t->kill();
+    }
+  }
   while (!task_map.empty()) {
-    Task* t = task_map.rbegin()->second;
-    LOG(debug) << "Killing " << t->tid << "(" << t << ")";
-    t->kill();
-    delete t;
+    delete task_map.rbegin()->second;
   }
 }
 
@@ -88,6 +98,7 @@ Session::BreakStatus Session::diagnose_debugger_trap(Task* t, int stop_sig) {
 
   TrapType pending_bp = t->vm()->get_breakpoint_type_at_addr(t->ip());
   TrapType retired_bp = t->vm()->get_breakpoint_type_for_retired_insn(t->ip());
+  remote_ptr<void> page_watch_hit = t->vm()->take_page_watch_hit();
 
   // NBB: very little effort has been made to handle
   // corner cases where multiple
@@ -128,6 +139,14 @@ Session::BreakStatus Session::diagnose_debugger_trap(Task* t, int stop_sig) {
     // right before it.
     t->move_ip_before_breakpoint();
     break_status.reason = BREAK_BREAKPOINT;
+  } else if (!page_watch_hit.is_null()) {
+    LOG(debug) << "  " << t->tid << "(rec:" << t->rec_tid
+               << "): hit debugger watchpoint at " << page_watch_hit
+               << " on a protected page.";
+    // Checked before singlestepping because the replayer
+    // singlestepped the access that hit it.
+    break_status.reason = BREAK_WATCHPOINT;
+    break_status.watch_address = page_watch_hit;
   } else if (DS_SINGLESTEP & t->debug_status()) {
     LOG(debug) << "  finished debugger stepi";
     /* Successful stepi.  Nothing else to do. */
@@ -13,6 +13,7 @@
 
 class AddressSpace;
 class DiversionSession;
+class FileId;
 class RecordSession;
 class ReplaySession;
 class Task;
@@ -84,6 +85,12 @@ public:
   void on_destroy(AddressSpace* vm);
   virtual void on_destroy(Task* t);
 
+  /**
+   * Called when an address space stops mapping the emulated shared
+   * file |id|, which may now be garbage.
+   */
+  virtual void on_shared_file_unmapped(const FileId& id) {}
+
   /** Return the set of Tasks being tracekd in this session. */
   const TaskMap& tasks() const { return task_map; }
 
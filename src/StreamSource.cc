@@ -0,0 +1,289 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "StreamSource"
+
+#define _LARGEFILE64_SOURCE
+
+#include "StreamSource.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "log.h"
+#include "ScopedFd.h"
+
+using namespace std;
+
+extern char** environ;
+
+namespace {
+
+class LocalStreamSource : public StreamSource {
+public:
+  LocalStreamSource(const string& filename)
+      : fd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE) {}
+
+  virtual bool is_open() const { return fd.get() >= 0; }
+  virtual ssize_t read_at(void* data, size_t size, uint64_t offset) {
+    return pread64(fd, data, size, offset);
+  }
+  virtual uint64_t size() const {
+    struct stat st;
+    return fstat(fd, &st) ? 0 : st.st_size;
+  }
+  virtual int local_fd() const { return fd; }
+
+private:
+  ScopedFd fd;
+};
+
+class RemoteStreamSource : public StreamSource {
+public:
+  RemoteStreamSource(const string& filename, uint64_t size,
+                     const string& command)
+      : chunks_dir(filename + ".chunks"), size_(size), command(command) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cond, nullptr);
+    if (mkdir(chunks_dir.c_str(), 0700) && errno != EEXIST) {
+      LOG(warn) << "Can't create " << chunks_dir;
+    }
+  }
+  virtual ~RemoteStreamSource() {
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+  }
+
+  virtual bool is_open() const { return true; }
+  virtual ssize_t read_at(void* data, size_t size, uint64_t offset);
+  virtual uint64_t size() const { return size_; }
+
+private:
+  string chunk_path(uint64_t chunk) const {
+    stringstream ss;
+    ss << chunks_dir << "/" << chunk;
+    return ss.str();
+  }
+  uint64_t chunk_size(uint64_t chunk) const {
+    return min<uint64_t>(CHUNK_SIZE, size_ - chunk * CHUNK_SIZE);
+  }
+  /**
+   * Open the local copy of |chunk|, fetching it first if there's none.
+   */
+  ScopedFd open_chunk(uint64_t chunk);
+  bool fetch(uint64_t chunk);
+
+  const string chunks_dir;
+  const uint64_t size_;
+  const string command;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Protected by |mutex|: the chunks being fetched.
+  set<uint64_t> fetching;
+};
+
+class StripedStreamSource : public StreamSource {
+public:
+  StripedStreamSource(uint64_t unit, vector<ScopedFd>&& stripes)
+      : unit(unit), stripes(move(stripes)) {}
+
+  virtual bool is_open() const {
+    for (auto& fd : stripes) {
+      if (fd.get() < 0) {
+        return false;
+      }
+    }
+    return unit > 0 && !stripes.empty();
+  }
+  virtual ssize_t read_at(void* data, size_t size, uint64_t offset);
+  virtual uint64_t size() const {
+    uint64_t total = 0;
+    for (auto& fd : stripes) {
+      struct stat st;
+      total += fstat(fd, &st) ? 0 : st.st_size;
+    }
+    return total;
+  }
+
+private:
+  const uint64_t unit;
+  vector<ScopedFd> stripes;
+};
+
+} // anonymous namespace
+
+ssize_t StripedStreamSource::read_at(void* data, size_t size,
+                                     uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    uint64_t stripe_offset;
+    uint64_t piece_size;
+    size_t stripe = find_stripe(offset + done, unit, stripes.size(),
+                                &stripe_offset, &piece_size);
+    size_t amount = min<uint64_t>(size - done, piece_size);
+    ssize_t ret = pread64(stripes[stripe], static_cast<uint8_t*>(data) + done,
+                          amount, stripe_offset);
+    if (ret < 0) {
+      return done > 0 ? (ssize_t)done : -1;
+    }
+    done += ret;
+    if ((size_t)ret < amount) {
+      // The end of the stream.
+      break;
+    }
+  }
+  return done;
+}
+
+ssize_t RemoteStreamSource::read_at(void* data, size_t size,
+                                    uint64_t offset) {
+  if (offset >= size_) {
+    return 0;
+  }
+  size = min<uint64_t>(size, size_ - offset);
+  size_t done = 0;
+  while (done < size) {
+    uint64_t pos = offset + done;
+    uint64_t chunk = pos / CHUNK_SIZE;
+    ScopedFd fd = open_chunk(chunk);
+    size_t amount =
+        min<uint64_t>(size - done, (chunk + 1) * CHUNK_SIZE - pos);
+    if (!fd.is_open() ||
+        pread64(fd, static_cast<uint8_t*>(data) + done, amount,
+                pos - chunk * CHUNK_SIZE) != (ssize_t)amount) {
+      return done > 0 ? (ssize_t)done : -1;
+    }
+    done += amount;
+  }
+  return done;
+}
+
+ScopedFd RemoteStreamSource::open_chunk(uint64_t chunk) {
+  string path = chunk_path(chunk);
+  ScopedFd fd(path.c_str(), O_CLOEXEC | O_RDONLY);
+  if (fd.is_open()) {
+    return fd;
+  }
+
+  // Only one thread fetches a given chunk; the others wait for it.
+  pthread_mutex_lock(&mutex);
+  bool fetched_elsewhere = false;
+  while (fetching.count(chunk)) {
+    fetched_elsewhere = true;
+    pthread_cond_wait(&cond, &mutex);
+  }
+  if (!fetched_elsewhere) {
+    fetching.insert(chunk);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (!fetched_elsewhere) {
+    bool ok = fetch(chunk);
+    pthread_mutex_lock(&mutex);
+    fetching.erase(chunk);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    if (!ok) {
+      return ScopedFd();
+    }
+  }
+  return ScopedFd(path.c_str(), O_CLOEXEC | O_RDONLY);
+}
+
+bool RemoteStreamSource::fetch(uint64_t chunk) {
+  string path = chunk_path(chunk);
+  string tmp = path + ".tmp";
+  uint64_t offset = chunk * CHUNK_SIZE;
+  uint64_t length = chunk_size(chunk);
+  LOG(debug) << "Fetching " << length << " bytes at " << offset << " for "
+             << chunks_dir;
+
+  vector<string> env_strings;
+  for (char** e = environ; *e; ++e) {
+    env_strings.push_back(*e);
+  }
+  stringstream ss;
+  ss << "RR_FETCH_OFFSET=" << offset;
+  env_strings.push_back(ss.str());
+  ss.str("");
+  ss << "RR_FETCH_LENGTH=" << length;
+  env_strings.push_back(ss.str());
+  ss.str("");
+  ss << "RR_FETCH_END=" << offset + length - 1;
+  env_strings.push_back(ss.str());
+  vector<char*> env;
+  for (auto& s : env_strings) {
+    env.push_back(const_cast<char*>(s.c_str()));
+  }
+  env.push_back(nullptr);
+  const char* argv[] = { "/bin/sh", "-c", command.c_str(), nullptr };
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, tmp.c_str(),
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  pid_t pid;
+  int ret = posix_spawn(&pid, argv[0], &actions, nullptr,
+                        const_cast<char**>(argv), env.data());
+  posix_spawn_file_actions_destroy(&actions);
+  if (ret) {
+    LOG(warn) << "Can't run fetch command for " << chunks_dir;
+    return false;
+  }
+  // If something else reaped the child, the chunk's size decides.
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+
+  struct stat st;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) || stat(tmp.c_str(), &st) ||
+      (uint64_t)st.st_size != length || rename(tmp.c_str(), path.c_str())) {
+    LOG(warn) << "Fetching " << length << " bytes at " << offset << " for "
+              << chunks_dir << " failed";
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+shared_ptr<StreamSource> StreamSource::open(const string& filename) {
+  auto local = make_shared<LocalStreamSource>(filename);
+  if (local->is_open()) {
+    return local;
+  }
+  ifstream manifest(stripes_path(filename));
+  string word;
+  uint64_t unit;
+  if (manifest >> word >> unit && word == "unit") {
+    vector<ScopedFd> stripes;
+    string path;
+    while (manifest >> path) {
+      stripes.push_back(ScopedFd(path.c_str(), O_CLOEXEC | O_RDONLY |
+                                                   O_LARGEFILE));
+    }
+    auto striped = make_shared<StripedStreamSource>(unit, move(stripes));
+    if (!striped->is_open()) {
+      LOG(error) << "Can't open all the stripes of " << filename;
+    }
+    return striped;
+  }
+  ifstream remote(filename + ".remote");
+  uint64_t size;
+  string command;
+  if (!(remote >> size) || !getline(remote.ignore(1), command) ||
+      command.empty()) {
+    return local;
+  }
+  return make_shared<RemoteStreamSource>(filename, size, command);
+}
@@ -0,0 +1,93 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_STREAM_SOURCE_H_
+#define RR_STREAM_SOURCE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+
+/**
+ * StreamSource supplies the bytes of a file written by CompressedWriter to
+ * the CompressedReaders reading it: normally the file itself, but a trace
+ * kept on a server or object store can be replayed without downloading
+ * its (possibly huge) streams first.
+ *
+ * To do that, copy the trace's small files to a local trace directory and
+ * replace each stream file 'name' that should stay remote with a file
+ * 'name.remote' holding the stream's size in bytes on the first line and
+ * a shell command that fetches part of it on the second, e.g.
+ *
+ *   1234567890
+ *   curl -sf -r $RR_FETCH_OFFSET-$RR_FETCH_END https://ci.example/t/events
+ *
+ * The command is run with RR_FETCH_OFFSET, RR_FETCH_LENGTH and
+ * RR_FETCH_END (the last byte's offset) in its environment and must write
+ * those bytes, or as many as the stream has, to stdout.  Streams are
+ * fetched in CHUNK_SIZE pieces as they're read, so CompressedReader's
+ * read-ahead fetches ahead too, and the pieces are kept in 'name.chunks'
+ * so later replays don't fetch them again.
+ *
+ * A stream recorded with `rr record --stripe-dir` is striped across
+ * several files, usually on different disks: its bytes are dealt out
+ * round-robin in STRIPE_UNIT pieces.  Instead of 'name' the trace
+ * directory then has a manifest 'name.stripes' with a line "unit <bytes>"
+ * followed by the path of each stripe file, in order.
+ */
+class StreamSource {
+public:
+  virtual ~StreamSource() {}
+
+  /**
+   * Open the source of the stream 'filename': the file if it exists,
+   * otherwise 'filename'.remote if that exists. Never returns null; check
+   * is_open().
+   */
+  static std::shared_ptr<StreamSource> open(const std::string& filename);
+
+  /**
+   * Return the path of the stripe manifest of 'filename'.
+   */
+  static std::string stripes_path(const std::string& filename) {
+    return filename + ".stripes";
+  }
+  /**
+   * For a stream striped across 'num_stripes' files in 'unit' byte pieces,
+   * return which stripe holds the stream's byte at 'offset', and set
+   * '*stripe_offset' to its offset in that stripe and '*piece_size' to the
+   * number of the stream's bytes from there that follow it in the stripe.
+   */
+  static size_t find_stripe(uint64_t offset, uint64_t unit,
+                            size_t num_stripes, uint64_t* stripe_offset,
+                            uint64_t* piece_size) {
+    uint64_t piece = offset / unit;
+    *stripe_offset = piece / num_stripes * unit + offset % unit;
+    *piece_size = unit - offset % unit;
+    return piece % num_stripes;
+  }
+
+  virtual bool is_open() const = 0;
+  /**
+   * Read up to 'size' bytes at 'offset' into 'data'. Returns the number of
+   * bytes read, 0 at the end of the stream or -1 on error. May be called
+   * from any thread.
+   */
+  virtual ssize_t read_at(void* data, size_t size, uint64_t offset) = 0;
+  /**
+   * Return the size of the stream.
+   */
+  virtual uint64_t size() const = 0;
+  /**
+   * Return the fd of the stream's local file, or -1 if there's none.
+   */
+  virtual int local_fd() const { return -1; }
+
+  enum {
+    CHUNK_SIZE = 4 * 1024 * 1024,
+    STRIPE_UNIT = 4 * 1024 * 1024
+  };
+};
+
+#endif /* RR_STREAM_SOURCE_H_ */
@@ -0,0 +1,291 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "TraceExport"
+
+#include "TraceExport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "log.h"
+#include "ScopedFd.h"
+#include "syscalls.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+static const char* column_type(const vector<uint8_t>&) { return "u8"; }
+static const char* column_type(const vector<int32_t>&) { return "i32"; }
+static const char* column_type(const vector<uint32_t>&) { return "u32"; }
+static const char* column_type(const vector<int64_t>&) { return "i64"; }
+static const char* column_type(const vector<uint64_t>&) { return "u64"; }
+
+/**
+ * One table being exported, as a directory with a file per column.
+ * Batches of rows are appended column by column.
+ */
+class TableWriter {
+public:
+  TableWriter(const string& dir) : dir(dir), rows(0), ok(true) {
+    if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) &&
+        errno != EEXIST) {
+      LOG(error) << "Can't create " << dir;
+      ok = false;
+    }
+  }
+
+  template <typename T>
+  void column(const string& name, const vector<T>& values) {
+    write_file(name + "." + column_type(values), values.data(),
+               values.size() * sizeof(T));
+  }
+
+  void string_column(const string& name, const vector<string>& values) {
+    auto& offset = string_offsets[name];
+    vector<uint64_t> offsets;
+    string data;
+    if (0 == rows) {
+      offsets.push_back(0);
+    }
+    for (auto& v : values) {
+      data += v;
+      offset += v.size();
+      offsets.push_back(offset);
+    }
+    write_file(name + ".offsets.u64", offsets.data(),
+               offsets.size() * sizeof(uint64_t));
+    write_file(name + ".str", data.data(), data.size());
+  }
+
+  /**
+   * Call after the columns of each batch of |n| rows have been written.
+   */
+  void end_batch(size_t n) { rows += n; }
+
+  /**
+   * Write the schema file and return true if the whole table was
+   * written.
+   */
+  bool finish() {
+    if (!ok) {
+      return false;
+    }
+    string schema = "rows " + to_string(rows) + "\n";
+    for (auto& f : files) {
+      schema += f.first + "\n";
+    }
+    return write_file("schema", schema.data(), schema.size());
+  }
+
+private:
+  bool write_file(const string& name, const void* data, size_t bytes) {
+    if (!ok) {
+      return false;
+    }
+    auto it = files.find(name);
+    if (it == files.end()) {
+      string path = dir + "/" + name;
+      it = files.insert(make_pair(name, make_shared<ScopedFd>(
+                                            path.c_str(),
+                                            O_WRONLY | O_CREAT | O_TRUNC |
+                                                O_CLOEXEC,
+                                            0644))).first;
+      if (!it->second->is_open()) {
+        LOG(error) << "Can't create " << path;
+        ok = false;
+        return false;
+      }
+    }
+    if (write(*it->second, data, bytes) != ssize_t(bytes)) {
+      LOG(error) << "Can't write " << dir << "/" << name;
+      ok = false;
+    }
+    return ok;
+  }
+
+  string dir;
+  size_t rows;
+  bool ok;
+  map<string, shared_ptr<ScopedFd> > files;
+  map<string, uint64_t> string_offsets;
+};
+
+struct SyscallSummary {
+  SyscallSummary() : entries(0), exits(0), errors(0), raw_bytes(0) {}
+  uint64_t entries;
+  uint64_t exits;
+  uint64_t errors;
+  uint64_t raw_bytes;
+};
+
+/**
+ * The rows decoded from one time range of the trace.
+ */
+struct ExportBatch {
+  vector<uint32_t> time;
+  vector<int32_t> tid;
+  vector<uint8_t> type;
+  vector<uint8_t> state;
+  vector<int32_t> data;
+  vector<int64_t> ticks;
+  vector<uint64_t> ip;
+  vector<int64_t> result;
+  vector<uint32_t> raw_records;
+  vector<uint64_t> raw_bytes;
+
+  vector<uint32_t> data_time;
+  vector<int32_t> data_tid;
+  vector<uint64_t> data_addr;
+  vector<uint64_t> data_size;
+
+  map<pair<int, int>, SyscallSummary> syscalls;
+};
+
+static void add_frame(ExportBatch& b, const TraceFrame& frame,
+                      const vector<TraceReader::RawData>& raw_data) {
+  EncodedEvent ev = frame.event();
+  bool exec_info = ev.has_exec_info == HAS_EXEC_INFO;
+  uint64_t bytes = 0;
+  for (auto& d : raw_data) {
+    b.data_time.push_back(frame.time());
+    b.data_tid.push_back(frame.tid());
+    b.data_addr.push_back(d.addr.as_int());
+    b.data_size.push_back(d.data.size());
+    bytes += d.data.size();
+  }
+  b.time.push_back(frame.time());
+  b.tid.push_back(frame.tid());
+  b.type.push_back(ev.type);
+  b.state.push_back(ev.state);
+  b.data.push_back(ev.data);
+  b.ticks.push_back(exec_info ? frame.ticks() : 0);
+  b.ip.push_back(exec_info ? frame.regs().ip() : 0);
+  b.result.push_back(exec_info ? frame.regs().syscall_result_signed() : 0);
+  b.raw_records.push_back(raw_data.size());
+  b.raw_bytes.push_back(bytes);
+
+  if (EV_SYSCALL == ev.type) {
+    SyscallSummary& s = b.syscalls[make_pair(int(ev.arch()), int(ev.data))];
+    if (SYSCALL_ENTRY == ev.state) {
+      ++s.entries;
+    } else {
+      ++s.exits;
+      s.errors += exec_info && frame.regs().syscall_failed();
+    }
+    s.raw_bytes += bytes;
+  }
+}
+
+static bool export_mmaps(const TraceReader& trace, const string& out_dir) {
+  TraceReader mmaps(trace.dir(), TraceReader::MAPPED_REGIONS);
+  TableWriter table(out_dir + "/mmaps");
+  vector<uint64_t> start, end, dev, inode, size;
+  vector<uint8_t> copied, stored;
+  vector<string> filename;
+  while (!mmaps.mapped_regions_at_end()) {
+    TraceMappedRegion m = mmaps.read_mapped_region();
+    start.push_back(m.start().as_int());
+    end.push_back(m.end().as_int());
+    copied.push_back(m.copied());
+    stored.push_back(!m.stored_file().empty());
+    dev.push_back(m.stat().st_dev);
+    inode.push_back(m.stat().st_ino);
+    size.push_back(m.stat().st_size);
+    filename.push_back(m.file_name());
+  }
+  table.column("start", start);
+  table.column("end", end);
+  table.column("copied", copied);
+  table.column("stored", stored);
+  table.column("dev", dev);
+  table.column("inode", inode);
+  table.column("size", size);
+  table.string_column("filename", filename);
+  table.end_batch(start.size());
+  return table.finish();
+}
+
+bool export_trace(const TraceReader& trace, const string& out_dir,
+                  uint32_t threads) {
+  if (mkdir(out_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) &&
+      errno != EEXIST) {
+    LOG(error) << "Can't create " << out_dir;
+    return false;
+  }
+  threads = max<uint32_t>(1, threads);
+  vector<ExportBatch> batches(trace.split_time_ranges(threads * 4).size());
+  trace.visit_frames_parallel(
+      threads, [&batches](size_t range, const TraceFrame& frame,
+                          const vector<TraceReader::RawData>& raw_data) {
+        add_frame(batches[range], frame, raw_data);
+      });
+
+  TableWriter events(out_dir + "/events");
+  TableWriter raw_data(out_dir + "/raw_data");
+  map<pair<int, int>, SyscallSummary> syscalls;
+  for (auto& b : batches) {
+    events.column("time", b.time);
+    events.column("tid", b.tid);
+    events.column("type", b.type);
+    events.column("state", b.state);
+    events.column("data", b.data);
+    events.column("ticks", b.ticks);
+    events.column("ip", b.ip);
+    events.column("result", b.result);
+    events.column("raw_records", b.raw_records);
+    events.column("raw_bytes", b.raw_bytes);
+    events.end_batch(b.time.size());
+
+    raw_data.column("time", b.data_time);
+    raw_data.column("tid", b.data_tid);
+    raw_data.column("addr", b.data_addr);
+    raw_data.column("size", b.data_size);
+    raw_data.end_batch(b.data_time.size());
+
+    for (auto& s : b.syscalls) {
+      SyscallSummary& total = syscalls[s.first];
+      total.entries += s.second.entries;
+      total.exits += s.second.exits;
+      total.errors += s.second.errors;
+      total.raw_bytes += s.second.raw_bytes;
+    }
+    // Free each batch once it's written.
+    b = ExportBatch();
+  }
+
+  TableWriter syscall_table(out_dir + "/syscalls");
+  vector<uint8_t> arch;
+  vector<int32_t> number;
+  vector<string> name;
+  vector<uint64_t> entries, exits, errors, raw_bytes;
+  for (auto& s : syscalls) {
+    arch.push_back(s.first.first);
+    number.push_back(s.first.second);
+    name.push_back(
+        syscall_name(s.first.second, SupportedArch(s.first.first)));
+    entries.push_back(s.second.entries);
+    exits.push_back(s.second.exits);
+    errors.push_back(s.second.errors);
+    raw_bytes.push_back(s.second.raw_bytes);
+  }
+  syscall_table.column("arch", arch);
+  syscall_table.column("number", number);
+  syscall_table.string_column("name", name);
+  syscall_table.column("entries", entries);
+  syscall_table.column("exits", exits);
+  syscall_table.column("errors", errors);
+  syscall_table.column("raw_bytes", raw_bytes);
+  syscall_table.end_batch(number.size());
+
+  bool ok = events.finish();
+  ok = raw_data.finish() && ok;
+  ok = syscall_table.finish() && ok;
+  ok = export_mmaps(trace, out_dir) && ok;
+  return ok;
+}
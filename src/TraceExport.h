@@ -0,0 +1,41 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_TRACE_EXPORT_H_
+#define RR_TRACE_EXPORT_H_
+
+#include <stdint.h>
+
+#include <string>
+
+class TraceReader;
+
+/**
+ * Export |trace| for bulk analysis into the directory |out_dir|, as the
+ * tables
+ *
+ *   events    one row per frame: time, tid, type, state, data (the
+ *             syscall or signal number), ticks, ip, result (the syscall
+ *             result at syscall exits), raw_records and raw_bytes
+ *   syscalls  one row per syscall of each arch: arch, number, name,
+ *             entries, exits, errors and raw_bytes
+ *   raw_data  one row per raw data record: time, tid, addr and size
+ *   mmaps     one row per mapped region descriptor, in trace order:
+ *             start, end, copied, stored (whether the contents are kept
+ *             in the trace), dev, inode, size and filename
+ *
+ * Each table is a directory with one file per column, so a column can be
+ * loaded without reading the rest of the table.  Fixed-width columns are
+ * little-endian arrays named <column>.<type>, with types u8, i32, u32,
+ * i64 and u64 (numpy.fromfile() reads them as is).  String columns are a
+ * <column>.offsets.u64 array of rows + 1 offsets into <column>.str.  A
+ * "schema" file lists the row count and the columns.
+ *
+ * Frames are decoded in parallel on |threads| threads, as
+ * TraceReader::visit_frames_parallel() does, and each table is written
+ * in batches of a time range's rows.  Returns false if the export
+ * couldn't be written.
+ */
+bool export_trace(const TraceReader& trace, const std::string& out_dir,
+                  uint32_t threads);
+
+#endif /* RR_TRACE_EXPORT_H_ */
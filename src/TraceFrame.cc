@@ -21,7 +21,8 @@ void TraceFrame::set_exec_info(Ticks ticks, const Registers& regs,
   }
 }
 
-void TraceFrame::dump(FILE* out) const {
+void TraceFrame::dump(FILE* out,
+                      const std::vector<std::string>* extra_perf_counters) const {
   out = out ? out : stdout;
 
   fprintf(out, "{\n  global_time:%u, event:`%s' (state:%d), tid:%d", time(),
@@ -31,15 +32,14 @@ void TraceFrame::dump(FILE* out) const {
     return;
   }
 
-  if (PerfCounters::extra_perf_counters_enabled()) {
-    fprintf(out, "\n  hw_ints:%" PRId64 " faults:%" PRId64 " ticks:%" PRId64
-                 " insns:%" PRId64 "\n",
-            exec_info.extra_perf_values.hw_interrupts,
-            exec_info.extra_perf_values.page_faults, ticks(),
-            exec_info.extra_perf_values.instructions_retired);
-  } else {
-    fprintf(out, "\n  ticks:%" PRId64 "\n", ticks());
+  fprintf(out, "\n ");
+  if (extra_perf_counters) {
+    for (size_t i = 0; i < extra_perf_counters->size(); ++i) {
+      fprintf(out, " %s:%" PRId64, (*extra_perf_counters)[i].c_str(),
+              exec_info.extra_perf_values.values[i]);
+    }
   }
+  fprintf(out, " ticks:%" PRId64 "\n", ticks());
   regs().print_register_file_for_trace(out);
 }
 
@@ -53,9 +53,9 @@ void TraceFrame::dump_raw(FILE* out) const {
   }
 
   fprintf(out, " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64,
-          exec_info.extra_perf_values.hw_interrupts,
-          exec_info.extra_perf_values.page_faults, ticks(),
-          exec_info.extra_perf_values.instructions_retired);
+          exec_info.extra_perf_values.values[0],
+          exec_info.extra_perf_values.values[1], ticks(),
+          exec_info.extra_perf_values.values[2]);
   regs().print_register_file_for_trace_raw(out);
   fprintf(out, "\n");
 }
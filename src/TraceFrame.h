@@ -52,14 +52,32 @@ public:
   Ticks ticks() const { return exec_info.ticks; }
   const Registers& regs() const { return exec_info.recorded_regs; }
   const ExtraRegisters& extra_regs() const { return recorded_extra_regs; }
+  const PerfCounters::Extra& extra_perf_values() const {
+    return exec_info.extra_perf_values;
+  }
+
+  /**
+   * Return a 64-bit digest of this frame's ticks and registers. A task
+   * whose tick count and registers produce the same digest (see
+   * exec_digest(Ticks, const Registers&)) is at the recorded state.
+   */
+  uint64_t exec_digest() const {
+    return exec_digest(exec_info.ticks, exec_info.recorded_regs);
+  }
+  static uint64_t exec_digest(Ticks ticks, const Registers& regs) {
+    return (regs.digest() ^ uint64_t(ticks)) * 0xff51afd7ed558ccdULL;
+  }
 
   /**
    * Log a human-readable representation of this to |out|
    * (defaulting to stdout), including a newline character.
    * A human-friendly format is used. Does not emit a trailing '}'
-   * (so the caller can add more fields to the record).
+   * (so the caller can add more fields to the record).  The values of
+   * |extra_perf_counters|, if given, are included.
    */
-  void dump(FILE* out = nullptr) const;
+  void dump(FILE* out = nullptr,
+            const std::vector<std::string>* extra_perf_counters =
+                nullptr) const;
   /**
    * Log a human-readable representation of this to |out|
    * (defaulting to stdout), including a newline character.  An
@@ -69,6 +87,7 @@ public:
 
 private:
   friend class TraceReader;
+  friend class TraceStream;
   friend class TraceWriter;
 
   struct {
@@ -77,7 +96,7 @@ private:
     EncodedEvent ev;
   } basic_info;
 
-  struct {
+  struct ExecInfo {
     Ticks ticks;
     PerfCounters::Extra extra_perf_values;
     Registers recorded_regs;
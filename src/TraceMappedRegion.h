@@ -21,18 +21,21 @@ class TraceMappedRegion {
 public:
   TraceMappedRegion(const std::string& filename, const struct stat& stat,
                     remote_ptr<void> start, remote_ptr<void> end,
-                    bool copied = false)
+                    bool copied = false,
+                    const std::string& stored_file = std::string())
       : filename(filename),
         stat_(stat),
         start_(start),
         end_(end),
-        copied_(copied) {}
+        copied_(copied),
+        stored_file_(stored_file) {}
 
   const std::string& file_name() const { return filename; }
   const struct stat& stat() const { return stat_; }
   remote_ptr<void> start() const { return start_; }
   remote_ptr<void> end() const { return end_; }
   bool copied() const { return copied_; }
+  const std::string& stored_file() const { return stored_file_; }
 
   size_t size() {
     intptr_t s = end() - start();
@@ -59,6 +62,9 @@ private:
   /* Did we save a copy of the mapped region in the trace
    * data? */
   bool copied_;
+  /* If nonempty, the copy isn't in the trace data but in this
+   * file of the trace directory, linked from the shared store. */
+  std::string stored_file_;
 };
 
 #endif /* RR_TRACE_MAPPED_REGION_H_ */
@@ -0,0 +1,239 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "TracePartition"
+
+#include "TracePartition.h"
+
+#include <linux/sched.h>
+#include <sys/mman.h>
+
+#include <map>
+
+#include "kernel_abi.h"
+#include "log.h"
+#include "TraceStream.h"
+
+using namespace rr;
+using namespace std;
+
+namespace {
+
+/**
+ * A process subtree forked from the root partition while scanning the
+ * trace.
+ */
+struct Subtree {
+  Subtree(TraceFrame::Time forked_at, bool independent)
+      : forked_at(forked_at), independent(independent) {}
+  set<pid_t> tids;
+  TraceFrame::Time forked_at;
+  bool independent;
+};
+
+} // anonymous namespace
+
+/*static*/ vector<TracePartition> TracePartition::compute(TraceReader trace) {
+  trace.rewind();
+  // Index 0 is the root partition.
+  vector<Subtree> subtrees;
+  subtrees.push_back(Subtree(0, false));
+  map<pid_t, size_t> subtree_of;
+  // Time the root partition first mapped memory shared, or 0.  Processes
+  // forked after that may share it.
+  TraceFrame::Time root_shared_since = 0;
+  bool whole_trace = false;
+
+  while (!trace.at_end() && !whole_trace) {
+    TraceFrame frame = trace.read_frame();
+    if (subtree_of.empty()) {
+      subtree_of[frame.tid()] = 0;
+      subtrees[0].tids.insert(frame.tid());
+    }
+    if (EV_SYSCALL != frame.event().type) {
+      continue;
+    }
+    auto it = subtree_of.find(frame.tid());
+    if (it == subtree_of.end()) {
+      LOG(debug) << "Frame " << frame.time() << " of unknown task "
+                 << frame.tid();
+      whole_trace = true;
+      break;
+    }
+    size_t index = it->second;
+    Event ev(frame.event());
+    int syscallno = ev.Syscall().number;
+    SupportedArch arch = ev.arch();
+    const Registers& regs = frame.regs();
+
+    if (is_ptrace_syscall(syscallno, arch) || is_ipc_syscall(syscallno, arch)) {
+      // These can reach into other processes' memory.
+      if (index == 0) {
+        whole_trace = true;
+      } else {
+        subtrees[index].independent = false;
+      }
+      continue;
+    }
+    if (EXITING_SYSCALL != ev.Syscall().state || regs.syscall_failed()) {
+      continue;
+    }
+    if (is_clone_syscall(syscallno, arch)) {
+      pid_t child = regs.syscall_result_signed();
+      if (subtree_of.count(child)) {
+        // Recycled tid; the tid sets can't tell the tasks apart.
+        whole_trace = true;
+        break;
+      }
+      size_t child_index = index;
+      if (index == 0 && !(regs.arg1() & CLONE_VM)) {
+        child_index = subtrees.size();
+        subtrees.push_back(Subtree(frame.time(), root_shared_since == 0));
+      }
+      subtree_of[child] = child_index;
+      subtrees[child_index].tids.insert(child);
+    } else if (is_mmap_syscall(syscallno, arch) && arch == x86) {
+      // Old-style mmap passes its flags in memory, so skipping these
+      // frames can't tell whether they consumed a mapped region record.
+      whole_trace = true;
+    } else if ((is_mmap_syscall(syscallno, arch) ||
+                is_mmap2_syscall(syscallno, arch)) &&
+               (regs.arg4() & MAP_SHARED)) {
+      if (index == 0) {
+        if (!root_shared_since) {
+          root_shared_since = frame.time();
+        }
+      } else {
+        subtrees[index].independent = false;
+      }
+    }
+  }
+
+  vector<TracePartition> partitions;
+  partitions.push_back(TracePartition());
+  TracePartition& root = partitions[0];
+  root.tids = subtrees[0].tids;
+  for (size_t i = 1; i < subtrees.size(); ++i) {
+    if (!subtrees[i].independent || whole_trace) {
+      root.tids.insert(subtrees[i].tids.begin(), subtrees[i].tids.end());
+    }
+  }
+  if (whole_trace) {
+    root.all = true;
+    return partitions;
+  }
+  for (size_t i = 1; i < subtrees.size(); ++i) {
+    if (subtrees[i].independent) {
+      TracePartition p;
+      p.tids = subtrees[i].tids;
+      p.prefix_tids = partitions[0].tids;
+      p.prefix_end = subtrees[i].forked_at;
+      partitions.push_back(p);
+    }
+  }
+  if (partitions.size() == 1) {
+    partitions[0].all = true;
+  }
+  return partitions;
+}
+
+/*static*/ TracePartition TracePartition::for_process(TraceReader trace,
+                                                       pid_t tgid) {
+  trace.rewind();
+  TracePartition p;
+  set<pid_t> seen;
+  bool target_seen = false;
+  // Whether the prefix tasks had mapped memory shared before the target
+  // was forked, so that the target may share it with them.
+  bool prefix_shared = false;
+  // Whether the partition's tasks have mapped anonymous memory shared.
+  // Processes they fork after that may write to it, so they're replayed
+  // too.
+  bool owned_shared = false;
+  bool whole_trace = false;
+
+  while (!trace.at_end() && !whole_trace) {
+    TraceFrame frame = trace.read_frame();
+    if (seen.empty()) {
+      seen.insert(frame.tid());
+      if (frame.tid() == tgid) {
+        target_seen = true;
+        p.tids.insert(tgid);
+      } else {
+        p.prefix_tids.insert(frame.tid());
+      }
+    }
+    if (EV_SYSCALL != frame.event().type) {
+      continue;
+    }
+    if (!seen.count(frame.tid())) {
+      LOG(debug) << "Frame " << frame.time() << " of unknown task "
+                 << frame.tid();
+      whole_trace = true;
+      break;
+    }
+    bool owned = p.tids.count(frame.tid()) > 0;
+    Event ev(frame.event());
+    int syscallno = ev.Syscall().number;
+    SupportedArch arch = ev.arch();
+    const Registers& regs = frame.regs();
+
+    if (is_ptrace_syscall(syscallno, arch) || is_ipc_syscall(syscallno, arch)) {
+      // These can reach into other processes' memory.
+      whole_trace = true;
+      break;
+    }
+    if (EXITING_SYSCALL != ev.Syscall().state || regs.syscall_failed()) {
+      continue;
+    }
+    if (is_clone_syscall(syscallno, arch)) {
+      pid_t child = regs.syscall_result_signed();
+      if (seen.count(child)) {
+        // Recycled tid; the tid sets can't tell the tasks apart.
+        whole_trace = true;
+        break;
+      }
+      seen.insert(child);
+      if (!target_seen) {
+        if (child == tgid) {
+          if (prefix_shared) {
+            whole_trace = true;
+            break;
+          }
+          target_seen = true;
+          p.tids.insert(child);
+          p.prefix_end = frame.time();
+        } else {
+          p.prefix_tids.insert(child);
+        }
+      } else if (owned && ((regs.arg1() & CLONE_VM) || owned_shared)) {
+        p.tids.insert(child);
+      }
+    } else if (is_mmap_syscall(syscallno, arch) && arch == x86) {
+      // Old-style mmap passes its flags in memory, so skipping these
+      // frames can't tell whether they consumed a mapped region record.
+      whole_trace = true;
+    } else if ((is_mmap_syscall(syscallno, arch) ||
+                is_mmap2_syscall(syscallno, arch)) &&
+               (regs.arg4() & MAP_SHARED)) {
+      if (!target_seen) {
+        prefix_shared = true;
+      } else if (owned) {
+        if (!(regs.arg4() & MAP_ANONYMOUS)) {
+          // A file other processes may map too.
+          whole_trace = true;
+        }
+        owned_shared = true;
+      }
+    }
+  }
+
+  if (!target_seen) {
+    LOG(info) << "Process " << tgid << " not found in trace";
+  }
+  if (whole_trace || !target_seen) {
+    TracePartition all;
+    all.all = true;
+    return all;
+  }
+  return p;
+}
@@ -0,0 +1,79 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_TRACE_PARTITION_H_
+#define RR_TRACE_PARTITION_H_
+
+#include <set>
+#include <vector>
+
+#include "TraceFrame.h"
+
+class TraceReader;
+
+/**
+ * A subset of the tasks in a trace that can be replayed without
+ * replaying the others.
+ *
+ * Replay emulates every interaction between tasks that goes through the
+ * kernel (signals, pipes, wait() etc.) from the trace, so processes
+ * only really interact during replay through memory they share.  A
+ * process subtree whose members never share memory with the rest of
+ * the trace can therefore be replayed on its own, once the process it
+ * was forked from has been replayed up to the fork.
+ *
+ * The first partition returned by |compute()| is the "root" partition
+ * containing the initial process; each other one is an independent
+ * subtree forked from a task of the root partition.
+ */
+class TracePartition {
+public:
+  /**
+   * Partition the trace read by |trace|.  When no subtree is
+   * independent, the result is a single partition selecting every
+   * frame.
+   */
+  static std::vector<TracePartition> compute(TraceReader trace);
+
+  /**
+   * Return the partition of the trace read by |trace| that replays only
+   * the process |tgid|: its threads and the tasks sharing its memory,
+   * after replaying its ancestors up to its fork.  When the others may
+   * affect it other than through the kernel interactions replay
+   * emulates, or |tgid| isn't in the trace, the result selects every
+   * frame.
+   */
+  static TracePartition for_process(TraceReader trace, pid_t tgid);
+
+  /**
+   * Return true if |frame| has to be replayed to replay this partition.
+   */
+  bool replays(const TraceFrame& frame) const {
+    return frame.event().type == EV_TRACE_TERMINATION || owns(frame.tid()) ||
+           (frame.time() <= prefix_end && prefix_tids.count(frame.tid()));
+  }
+
+  /**
+   * Return true if |rec_tid| belongs to this partition.  Only the tasks
+   * a partition owns replay writes to stdout/stderr, so that output
+   * isn't duplicated by the partitions replaying the same prefix.
+   */
+  bool owns(pid_t rec_tid) const { return all || tids.count(rec_tid); }
+
+  size_t num_tasks() const { return tids.size(); }
+
+  bool is_whole_trace() const { return all; }
+
+private:
+  TracePartition() : prefix_end(0), all(false) {}
+
+  // Tasks of this partition.
+  std::set<pid_t> tids;
+  // Frames of these tasks up to and including |prefix_end| are
+  // replayed too, to create this partition's tasks.
+  std::set<pid_t> prefix_tids;
+  TraceFrame::Time prefix_end;
+  // When true, this partition is the whole trace.
+  bool all;
+};
+
+#endif /* RR_TRACE_PARTITION_H_ */
@@ -4,14 +4,25 @@
 
 #include "TraceStream.h"
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sysexits.h>
 
+#include <algorithm>
+#include <deque>
 #include <fstream>
+#include <limits>
+#include <list>
 #include <string>
 #include <sstream>
 
 #include "log.h"
+#include "ScopedFd.h"
 #include "util.h"
 
 using namespace std;
@@ -25,7 +36,11 @@ using namespace std;
 // MUST increment this version number.  Otherwise users' old traces
 // will become unreplayable and they won't know why.
 //
-#define TRACE_VERSION 16
+#define TRACE_VERSION 31
+
+const uint64_t TraceStream::RAW_DATA_INLINE;
+const uint64_t TraceStream::RAW_DATA_MULTI;
+const uint64_t TraceStream::RAW_DATA_ZERO;
 
 static string default_rr_trace_dir() { return string(getenv("HOME")) + "/.rr"; }
 
@@ -64,76 +79,566 @@ static void ensure_default_rr_trace_dir() {
 }
 
 bool TraceWriter::good() const {
-  return events.good() && data.good() && data_header.good() && mmaps.good();
+  return events.good() && data.good() && data_header.good() && mmaps.good() &&
+         (!checksums || checksums->good());
 }
 
 bool TraceReader::good() const {
-  return events.good() && data.good() && data_header.good() && mmaps.good();
+  return events.good() && data.good() && data_header.good() && mmaps.good() &&
+         data_refs.good() && (!checksums || checksums->good());
+}
+
+static void write_varint(vector<uint8_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back((uint8_t)value | 0x80);
+    value >>= 7;
+  }
+  out.push_back((uint8_t)value);
+}
+
+static void append(vector<uint8_t>& out, const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  out.insert(out.end(), bytes, bytes + size);
+}
+
+static uint64_t read_varint(CompressedReader& in) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t b = 0;
+    in.read(&b, 1);
+    value |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  return value;
+}
+
+static uint64_t zigzag_encode(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// XSAVE areas start with the 512-byte legacy (FXSAVE) region, followed by
+// the XSAVE header, whose first word is the XSTATE_BV component bitmap.
+static const size_t XSAVE_HEADER_OFFSET = 512;
+// Extra registers are delta-encoded in chunks of this many bytes. XSAVE
+// components are at least this aligned.
+static const size_t EXTRA_REGS_CHUNK_SIZE = 64;
+
+struct XSaveComponent {
+  uint32_t offset;
+  uint32_t size;
+};
+
+/**
+ * Return the standard-format offset and size of each XSAVE component this
+ * CPU supports, or zeroes for unsupported components.
+ */
+static const XSaveComponent* xsave_components() {
+  static XSaveComponent components[64];
+  static bool initialized = false;
+  if (!initialized) {
+    initialized = true;
+    unsigned int eax, ebx, ecx, edx;
+    cpuid(CPUID_GETXSAVE, 0, &eax, &ebx, &ecx, &edx);
+    uint64_t supported = eax | ((uint64_t)edx << 32);
+    // Components 0 and 1 (x87 and SSE) live in the legacy region.
+    for (int i = 2; i < 64; ++i) {
+      if (supported & (1ULL << i)) {
+        cpuid(CPUID_GETXSAVE, i, &eax, &ebx, &ecx, &edx);
+        components[i].offset = ebx;
+        components[i].size = eax;
+      }
+    }
+  }
+  return components;
+}
+
+/**
+ * Zero the components of the XSAVE area |data| whose XSTATE_BV bits are
+ * clear. Those components are in their init state, so XRSTOR ignores their
+ * contents, and whatever stale bytes the kernel left there needn't be
+ * recorded.
+ */
+static void clear_init_xsave_components(vector<uint8_t>& data) {
+  uint64_t xstate_bv;
+  if (data.size() < XSAVE_HEADER_OFFSET + sizeof(xstate_bv)) {
+    return;
+  }
+  memcpy(&xstate_bv, data.data() + XSAVE_HEADER_OFFSET, sizeof(xstate_bv));
+  const XSaveComponent* components = xsave_components();
+  for (int i = 2; i < 64; ++i) {
+    const XSaveComponent& c = components[i];
+    if (!(xstate_bv & (1ULL << i)) && c.size > 0 &&
+        c.offset + c.size <= data.size()) {
+      memset(data.data() + c.offset, 0, c.size);
+    }
+  }
+}
+
+/**
+ * Extra registers are encoded as
+ *   uint8_t  format
+ *   varint   size
+ * followed, if size > 0, by
+ *   uint8_t  1 if the data is relative to the previous extra registers of
+ *            the same tid, 0 if it's relative to all-zeroes
+ *   uint8_t  bitmap[(number of EXTRA_REGS_CHUNK_SIZE chunks + 7) / 8] of
+ *            the chunks that changed
+ *   the bytes of each changed chunk.
+ * XSAVE components in their init state are recorded as zeroes, so they
+ * cost nothing unless they just left a non-init state.
+ */
+static void write_extra_regs(vector<uint8_t>& out, const ExtraRegisters& regs,
+                             const ExtraRegisters* last) {
+  uint8_t format = (uint8_t)regs.format();
+  size_t size = regs.data_size();
+  append(out, &format, sizeof(format));
+  write_varint(out, size);
+  if (size == 0) {
+    return;
+  }
+
+  vector<uint8_t> data(regs.data_bytes(), regs.data_bytes() + size);
+  if (regs.format() == ExtraRegisters::XSAVE ||
+      regs.format() == ExtraRegisters::XSAVE64) {
+    clear_init_xsave_components(data);
+  }
+  uint8_t relative = last && last->format() == regs.format() &&
+                     (size_t)last->data_size() == size;
+  const uint8_t* base = relative ? last->data_bytes() : nullptr;
+  size_t chunks = (size + EXTRA_REGS_CHUNK_SIZE - 1) / EXTRA_REGS_CHUNK_SIZE;
+  vector<uint8_t> changed((chunks + 7) / 8);
+  for (size_t i = 0; i < chunks; ++i) {
+    size_t start = i * EXTRA_REGS_CHUNK_SIZE;
+    size_t len = min(EXTRA_REGS_CHUNK_SIZE, size - start);
+    bool same = true;
+    for (size_t j = start; j < start + len; ++j) {
+      if (data[j] != (base ? base[j] : 0)) {
+        same = false;
+        break;
+      }
+    }
+    if (!same) {
+      changed[i / 8] |= 1 << (i % 8);
+    }
+  }
+  append(out, &relative, sizeof(relative));
+  append(out, changed.data(), changed.size());
+  for (size_t i = 0; i < chunks; ++i) {
+    if (changed[i / 8] & (1 << (i % 8))) {
+      size_t start = i * EXTRA_REGS_CHUNK_SIZE;
+      append(out, data.data() + start,
+             min(EXTRA_REGS_CHUNK_SIZE, size - start));
+    }
+  }
+}
+
+/**
+ * Decode extra registers written by write_extra_regs(), relative to
+ * |last| (which may be null if there are none).
+ */
+static ExtraRegisters read_extra_regs(CompressedReader& in,
+                                      const ExtraRegisters* last,
+                                      TraceFrame::Time time) {
+  uint8_t format;
+  in.read(&format, sizeof(format));
+  size_t size = read_varint(in);
+  ExtraRegisters regs;
+  if (size == 0) {
+    assert(format == ExtraRegisters::NONE);
+    return regs;
+  }
+
+  uint8_t relative;
+  in.read(&relative, sizeof(relative));
+  vector<uint8_t> data(size);
+  if (relative) {
+    if (!last || last->format() != format ||
+        (size_t)last->data_size() != size) {
+      FATAL() << "Frame " << time << " refers to missing extra registers";
+    }
+    memcpy(data.data(), last->data_bytes(), size);
+  }
+  size_t chunks = (size + EXTRA_REGS_CHUNK_SIZE - 1) / EXTRA_REGS_CHUNK_SIZE;
+  vector<uint8_t> changed((chunks + 7) / 8);
+  in.read(changed.data(), changed.size());
+  for (size_t i = 0; i < chunks; ++i) {
+    if (changed[i / 8] & (1 << (i % 8))) {
+      size_t start = i * EXTRA_REGS_CHUNK_SIZE;
+      in.read(data.data() + start, min(EXTRA_REGS_CHUNK_SIZE, size - start));
+    }
+  }
+  regs.set_to_raw_data((ExtraRegisters::Format)format, data);
+  return regs;
 }
 
+/**
+ * Frames are encoded as
+ *   varint   zigzag(global_time - time())
+ *   varint   tid
+ *   varint   encoded event
+ * followed, for events with exec info, by
+ *   uint8_t  1 if the exec info is relative to the previous exec info of
+ *            the same tid, 0 if it's relative to all-zeroes
+ *   uint8_t  bitmap[(number of words in ExecInfo + 7) / 8] of the words
+ *            that changed
+ *   varint   word ^ base word, for each changed word
+ *   extra registers, relative to the previous extra registers of the same
+ *            tid; see write_extra_regs().
+ * Writers forget the previous exec infos at every seek point, so readers
+ * that seek there can decode the following frames.
+ */
 void TraceWriter::write_frame(const TraceFrame& frame) {
-  events.write(&frame.basic_info, sizeof(frame.basic_info));
-  if (!events.good()) {
-    FATAL() << "Tried to save " << sizeof(frame.basic_info)
-            << " bytes to the trace, but failed";
+  if (fold_sched_frames && EV_SCHED == frame.event().type) {
+    if (has_held_frame && held_frame.tid() != frame.tid()) {
+      write_held_frame();
+    }
+    // Any frame of the same tid that we were holding is superseded.
+    held_frame = frame;
+    held_frame.basic_info.global_time = time();
+    has_held_frame = true;
+    return;
+  }
+  if (has_held_frame) {
+    write_held_frame();
+    TraceFrame renumbered = frame;
+    renumbered.basic_info.global_time = time();
+    write_frame_now(renumbered);
+    return;
+  }
+  write_frame_now(frame);
+}
+
+void TraceWriter::write_held_frame() {
+  if (!has_held_frame) {
+    return;
+  }
+  has_held_frame = false;
+  write_frame_now(held_frame);
+}
+
+void TraceWriter::write_frame_now(const TraceFrame& frame) {
+  ++frames_by_type[frame.event().type];
+  // Remember where the first frame starting in each events block begins,
+  // and every SEEK_POINT_INTERVAL'th frame, so readers can seek to them.
+  uint64_t block_size = events.uncompressed_block_size();
+  next_frame_start.global_time = frame.time();
+  next_frame_start.events = events.uncompressed_offset();
+  if (automatic_seek_points &&
+      (seek_points.empty() ||
+       seek_points.back().events / block_size !=
+           next_frame_start.events / block_size ||
+       frame.time() - seek_points.back().global_time >= SEEK_POINT_INTERVAL)) {
+    seek_points.push_back(next_frame_start);
+    last_exec_info.clear();
   }
+
+  // Encode the whole frame first and hand it to |events| in one go.
+  frame_buf.clear();
+  write_varint(frame_buf, zigzag_encode((int64_t)frame.time() - time()));
+  write_varint(frame_buf, (uint32_t)frame.tid());
+  write_varint(frame_buf, (uint32_t)frame.event().encoded);
   // TODO: only store exec info for non-async-sig events when
   // debugging assertions are enabled.
   if (frame.event().has_exec_info == HAS_EXEC_INFO) {
-    events.write(&frame.exec_info, sizeof(frame.exec_info));
-    if (!events.good()) {
-      FATAL() << "Tried to save " << sizeof(frame.exec_info)
-              << " bytes to the trace, but failed";
-    }
-
-    int extra_reg_bytes = frame.extra_regs().data_size();
-    char extra_reg_format = (char)frame.extra_regs().format();
-    events.write(&extra_reg_format, sizeof(extra_reg_format));
-    events.write((char*)&extra_reg_bytes, sizeof(extra_reg_bytes));
-    if (!events.good()) {
-      FATAL() << "Tried to save "
-              << sizeof(extra_reg_bytes) + sizeof(extra_reg_format)
-              << " bytes to the trace, but failed";
-    }
-    if (extra_reg_bytes > 0) {
-      events.write((const char*)frame.extra_regs().data_bytes(),
-                   extra_reg_bytes);
-      if (!events.good()) {
-        FATAL() << "Tried to save " << extra_reg_bytes
-                << " bytes to the trace, but failed";
+    static_assert(sizeof(TraceFrame::ExecInfo) % sizeof(uint64_t) == 0,
+                  "ExecInfo must be a whole number of words");
+    const size_t EXEC_INFO_WORDS =
+        sizeof(TraceFrame::ExecInfo) / sizeof(uint64_t);
+    auto last = last_exec_info.find(frame.tid());
+    uint8_t relative = last != last_exec_info.end();
+    const uint64_t* base =
+        relative ? reinterpret_cast<const uint64_t*>(&last->second.exec_info)
+                 : nullptr;
+    const uint64_t* words =
+        reinterpret_cast<const uint64_t*>(&frame.exec_info);
+    uint8_t changed[(EXEC_INFO_WORDS + 7) / 8] = { 0 };
+    for (size_t i = 0; i < EXEC_INFO_WORDS; ++i) {
+      if (words[i] != (base ? base[i] : 0)) {
+        changed[i / 8] |= 1 << (i % 8);
+      }
+    }
+    append(frame_buf, &relative, sizeof(relative));
+    append(frame_buf, changed, sizeof(changed));
+    for (size_t i = 0; i < EXEC_INFO_WORDS; ++i) {
+      if (changed[i / 8] & (1 << (i % 8))) {
+        write_varint(frame_buf, words[i] ^ (base ? base[i] : 0));
       }
     }
+    write_extra_regs(frame_buf, frame.extra_regs(),
+                     relative ? &last->second.extra_regs : nullptr);
+    LastExecInfo& info = last_exec_info[frame.tid()];
+    info.exec_info = frame.exec_info;
+    info.extra_regs = frame.extra_regs();
+  }
+  events.write(frame_buf.data(), frame_buf.size());
+  if (!events.good()) {
+    FATAL() << "Tried to save frame " << frame.time()
+            << " to the trace, but failed";
   }
 
   tick_time();
+
+  // Raw data and mapped regions for the next frame are written before the
+  // frame itself, so this is where the next frame's data begins.
+  next_frame_start.data = data.uncompressed_offset();
+  next_frame_start.data_header = data_header.uncompressed_offset();
+  next_frame_start.mmaps = mmaps.uncompressed_offset();
 }
 
-TraceFrame TraceReader::read_frame() {
+TraceFrame TraceReader::read_frame_from(CompressedReader& events,
+                                        TraceFrame::Time time,
+                                        ExecInfoMap& last_exec_info) {
   // Read the common event info first, to see if we also have
   // exec info to read.
   TraceFrame frame;
-  events.read(&frame.basic_info, sizeof(frame.basic_info));
+  // The writer's time() is one past the frame it wrote last, the frame
+  // at |time|.
+  frame.basic_info.global_time =
+      time + 1 + zigzag_decode(read_varint(events));
+  frame.basic_info.tid = (pid_t)read_varint(events);
+  frame.basic_info.ev.encoded = (int)read_varint(events);
   if (frame.event().has_exec_info) {
-    events.read(&frame.exec_info, sizeof(frame.exec_info));
+    const size_t EXEC_INFO_WORDS =
+        sizeof(TraceFrame::ExecInfo) / sizeof(uint64_t);
+    uint8_t relative = 0;
+    uint8_t changed[(EXEC_INFO_WORDS + 7) / 8];
+    events.read(&relative, sizeof(relative));
+    events.read(changed, sizeof(changed));
+    const uint64_t* base = nullptr;
+    const ExtraRegisters* last_extra_regs = nullptr;
+    if (relative) {
+      auto last = last_exec_info.find(frame.tid());
+      if (last == last_exec_info.end()) {
+        FATAL() << "Frame " << frame.time() << " refers to missing exec info"
+                << " for tid " << frame.tid();
+      }
+      base = reinterpret_cast<const uint64_t*>(&last->second.exec_info);
+      last_extra_regs = &last->second.extra_regs;
+    }
+    uint64_t* words = reinterpret_cast<uint64_t*>(&frame.exec_info);
+    for (size_t i = 0; i < EXEC_INFO_WORDS; ++i) {
+      words[i] = base ? base[i] : 0;
+      if (changed[i / 8] & (1 << (i % 8))) {
+        words[i] ^= read_varint(events);
+      }
+    }
+    frame.recorded_extra_regs =
+        read_extra_regs(events, last_extra_regs, frame.time());
+    LastExecInfo& info = last_exec_info[frame.tid()];
+    info.exec_info = frame.exec_info;
+    info.extra_regs = frame.recorded_extra_regs;
+  }
 
-    int extra_reg_bytes;
-    char extra_reg_format;
-    events.read(&extra_reg_format, sizeof(extra_reg_format));
-    events.read((char*)&extra_reg_bytes, sizeof(extra_reg_bytes));
-    if (extra_reg_bytes > 0) {
-      std::vector<uint8_t> data;
-      data.resize(extra_reg_bytes);
-      events.read((char*)data.data(), extra_reg_bytes);
-      frame.recorded_extra_regs.set_to_raw_data(
-          (ExtraRegisters::Format)extra_reg_format, data);
-    } else {
-      assert(extra_reg_format == ExtraRegisters::NONE);
-      frame.recorded_extra_regs = ExtraRegisters();
+  return frame;
+}
+
+/**
+ * The frames most recently read by any copy of a TraceReader, keyed by
+ * their global time, evicting the least recently read first.
+ */
+class TraceReader::FrameCache {
+public:
+  FrameCache(size_t max_bytes) : max_bytes(max_bytes), bytes(0) {}
+
+  shared_ptr<const CachedFrame> find(TraceFrame::Time time) {
+    auto it = frames.find(time);
+    if (it == frames.end()) {
+      return nullptr;
+    }
+    lru.splice(lru.end(), lru, it->second.lru_it);
+    return it->second.frame;
+  }
+
+  void insert(shared_ptr<const CachedFrame> frame) {
+    TraceFrame::Time time = frame->frame.time();
+    size_t frame_bytes = frame->bytes();
+    if (frame_bytes > max_frame_bytes() || frames.count(time)) {
+      return;
+    }
+    while (bytes + frame_bytes > max_bytes) {
+      auto it = frames.find(lru.front());
+      bytes -= it->second.bytes;
+      frames.erase(it);
+      lru.pop_front();
     }
+    Entry& e = frames[time];
+    e.frame = move(frame);
+    e.bytes = frame_bytes;
+    e.lru_it = lru.insert(lru.end(), time);
+    bytes += frame_bytes;
   }
 
+  /**
+   * Frames bigger than this aren't cached, so one huge frame can't evict
+   * everything else.
+   */
+  size_t max_frame_bytes() const { return max_bytes / 16; }
+
+private:
+  struct Entry {
+    shared_ptr<const CachedFrame> frame;
+    size_t bytes;
+    list<TraceFrame::Time>::iterator lru_it;
+  };
+  unordered_map<TraceFrame::Time, Entry> frames;
+  // Least recently read first.
+  list<TraceFrame::Time> lru;
+  size_t max_bytes;
+  size_t bytes;
+};
+
+/**
+ * The frames after some time, up to where peek_to() last stopped reading
+ * ahead, by tid.  The frames are those of the trace, so the index stays
+ * valid as long as the reader it's for stays within its time range.
+ */
+class TraceReader::PeekIndex {
+public:
+  PeekIndex(const CompressedReader& events, TraceFrame::Time time,
+            const ExecInfoMap& exec_info)
+      : events(events), from(time), to(time), exec_info(exec_info),
+        num_frames(0) {}
+
+  /**
+   * Return true if this holds every frame after |time| that it could.
+   */
+  bool covers(TraceFrame::Time time) const {
+    return from <= time && time <= to;
+  }
+
+  /**
+   * Forget the frames up to and including |time|.
+   */
+  void drop_through(TraceFrame::Time time) {
+    for (auto it = frames.begin(); it != frames.end();) {
+      auto& tid_frames = it->second;
+      while (!tid_frames.empty() && tid_frames.front().time() <= time) {
+        tid_frames.pop_front();
+        --num_frames;
+      }
+      if (tid_frames.empty()) {
+        it = frames.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    from = time;
+  }
+
+  const TraceFrame* find(pid_t tid, EventType type,
+                         SyscallEntryOrExit state) const {
+    auto it = frames.find(tid);
+    if (it == frames.end()) {
+      return nullptr;
+    }
+    for (auto& frame : it->second) {
+      if (frame.event().type == type && frame.event().state == state) {
+        return &frame;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Read the next frame after |to| and index it.
+   */
+  const TraceFrame& read_next() {
+    TraceFrame frame = read_frame_from(events, to, exec_info);
+    ++to;
+    auto& tid_frames = frames[frame.tid()];
+    tid_frames.push_back(move(frame));
+    ++num_frames;
+    return tid_frames.back();
+  }
+
+  // Positioned after the frame at |to|.
+  CompressedReader events;
+  TraceFrame::Time from;
+  TraceFrame::Time to;
+  ExecInfoMap exec_info;
+  // The frames in (|from|, |to|] of each tid, in order.
+  unordered_map<pid_t, deque<TraceFrame> > frames;
+  size_t num_frames;
+};
+
+size_t TraceReader::CachedFrame::bytes() const {
+  size_t total = sizeof(*this) + frame.recorded_extra_regs.data_size();
+  for (auto& d : raw_data) {
+    total += sizeof(d) + d.data.size();
+  }
+  return total;
+}
+
+void TraceReader::enable_frame_cache(size_t max_bytes) {
+  assert(streams & RAW_DATA);
+  frame_cache = make_shared<FrameCache>(max_bytes);
+}
+
+void TraceReader::cache_pending_frame() {
+  if (!pending_frame) {
+    return;
+  }
+  shared_ptr<CachedFrame> frame = move(pending_frame);
+  pending_frame = nullptr;
+  TraceFrame::Time time;
+  if (peek_raw_data_time(&time)) {
+    if (time <= frame->frame.time()) {
+      // The frame's raw data wasn't all read.
+      return;
+    }
+  }
+  frame->data_end = data.uncompressed_offset();
+  frame->data_header_end = data_header.uncompressed_offset();
+  frame_cache->insert(move(frame));
+}
+
+void TraceReader::sync_streams() {
+  if (!served_frame) {
+    return;
+  }
+  unread_ranges.clear();
+  if (!events.seek(served_frame->events_end) ||
+      !data.seek(served_frame->data_end) ||
+      !data_header.seek(served_frame->data_header_end)) {
+    FATAL() << "Cached frame " << served_frame->frame.time()
+            << " is beyond the end of the trace";
+  }
+  served_frame = nullptr;
+}
+
+TraceFrame TraceReader::read_frame() {
+  shared_ptr<const CachedFrame> cached =
+      frame_cache ? frame_cache->find(global_time + 1) : nullptr;
+  // Now that there's a next frame, the last one can be cached.
+  cache_pending_frame();
+  if (cached) {
+    served_frame = cached;
+    served_raw_data = 0;
+    tick_time();
+    const TraceFrame& frame = cached->frame;
+    if (frame.event().has_exec_info) {
+      LastExecInfo& info = last_exec_info[frame.tid()];
+      info.exec_info = frame.exec_info;
+      info.extra_regs = frame.recorded_extra_regs;
+    }
+    return frame;
+  }
+
+  sync_streams();
+  TraceFrame frame = read_frame_from(events, time(), last_exec_info);
   tick_time();
   assert(time() == frame.time());
+  if (frame_cache) {
+    pending_frame = make_shared<CachedFrame>();
+    pending_frame->frame = frame;
+    pending_frame->events_end = events.uncompressed_offset();
+  }
   return frame;
 }
 
@@ -169,16 +674,144 @@ static CompressedReader& operator>>(CompressedReader& in, string& value) {
 }
 
 void TraceWriter::write_mapped_region(const TraceMappedRegion& map) {
+  write_held_frame();
   mmaps << map.copied() << map.file_name() << map.stat() << map.start()
-        << map.end();
+        << map.end() << map.stored_file();
 }
 
 TraceMappedRegion TraceReader::read_mapped_region() {
+  assert(streams & MAPPED_REGIONS);
   TraceMappedRegion map;
-  mmaps >> map.copied_ >> map.filename >> map.stat_ >> map.start_ >> map.end_;
+  mmaps >> map.copied_ >> map.filename >> map.stat_ >> map.start_ >>
+      map.end_ >> map.stored_file_;
   return map;
 }
 
+string TraceStream::shared_store_dir() { return trace_save_dir() + "/store"; }
+
+string TraceStream::mmap_cache_path(const TraceMappedRegion& file,
+                                    off64_t offset, size_t len) const {
+  const struct stat& st = file.stat();
+  stringstream ss;
+  ss << trace_dir << "/mmap_cache_" << st.st_dev << "_" << st.st_ino << "_"
+     << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << "_"
+     << st.st_ctim.tv_sec << "." << st.st_ctim.tv_nsec << "_" << st.st_size
+     << "_" << offset << "_" << len;
+  return ss.str();
+}
+
+string TraceWriter::write_stored_copy(const void* data, size_t len) {
+  Hash128 hash = hash_bytes(data, len);
+  char name[64];
+  snprintf(name, sizeof(name), "copy-%016" PRIx64 "%016" PRIx64 "-%zu",
+           hash.hi, hash.lo, len);
+  string store = shared_store_dir();
+  if (mkdir(store.c_str(), S_IRWXU | S_IRWXG) && errno != EEXIST) {
+    FATAL() << "Unable to create shared store `" << store << "'";
+  }
+  string path = store + "/" + name;
+  if (access(path.c_str(), F_OK)) {
+    // Write the copy under a temporary name, so concurrent recordings
+    // never see a partial copy.
+    stringstream tmp;
+    tmp << path << ".tmp" << getpid();
+    {
+      ofstream out(tmp.str().c_str(), ios::binary);
+      out.write(static_cast<const char*>(data), len);
+      if (!out.good()) {
+        FATAL() << "Unable to write `" << tmp.str() << "'";
+      }
+    }
+    if (rename(tmp.str().c_str(), path.c_str())) {
+      FATAL() << "Unable to rename `" << tmp.str() << "' to `" << path << "'";
+    }
+  }
+  link_stored_copy(path, name);
+  return name;
+}
+
+string TraceWriter::write_cloned_copy(const string& path,
+                                      const struct stat& st, off64_t offset,
+                                      size_t len) {
+  ClonedCopyKey key(st.st_dev, st.st_ino, st.st_mtim.tv_sec,
+                    st.st_mtim.tv_nsec, st.st_ctim.tv_sec, st.st_ctim.tv_nsec,
+                    st.st_size, offset, len);
+  auto it = cloned_copy_names.find(key);
+  if (it != cloned_copy_names.end()) {
+    return it->second;
+  }
+  stringstream ss;
+  ss << "clone-" << cloned_copies++;
+  string name = ss.str();
+  string trace_path = trace_file_path(name);
+  bool cloned = false;
+  if (offset == 0 && off64_t(len) == st.st_size && !(st.st_mode & 0222)) {
+    cloned = !linkat(AT_FDCWD, path.c_str(), AT_FDCWD, trace_path.c_str(),
+                     AT_SYMLINK_FOLLOW);
+  }
+#ifdef FICLONERANGE
+  if (!cloned) {
+    ScopedFd src(path.c_str(), O_RDONLY | O_CLOEXEC);
+    ScopedFd dest(trace_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0400);
+    if (src.is_open() && dest.is_open()) {
+      struct file_clone_range range = { src.get(), uint64_t(offset), len, 0 };
+      cloned = !ioctl(dest, FICLONERANGE, &range);
+    }
+    if (dest.is_open() && !cloned) {
+      unlink(trace_path.c_str());
+    }
+  }
+#endif
+  if (!cloned) {
+    LOG(debug) << "Can't clone " << path << "; copying it instead";
+    return string();
+  }
+  if (sink && !sink->send_file(name, trace_path)) {
+    FATAL() << "Unable to send `" << trace_path << "' to the output sink";
+  }
+  cloned_copy_names[key] = name;
+  return name;
+}
+
+void TraceWriter::link_stored_copy(const string& path, const string& name) {
+  string trace_path = trace_file_path(name);
+  if (link(path.c_str(), trace_path.c_str()) && errno != EEXIST) {
+    // The store is on another filesystem; keep a private copy.
+    ifstream in(path.c_str(), ios::binary);
+    ofstream out(trace_path.c_str(), ios::binary);
+    out << in.rdbuf();
+    if (!in.good() || !out.good()) {
+      FATAL() << "Unable to copy `" << path << "' to `" << trace_path << "'";
+    }
+  }
+  if (sink && !sink->send_file(name, trace_path)) {
+    FATAL() << "Unable to send `" << trace_path << "' to the output sink";
+  }
+}
+
+bool TraceWriter::gc_shared_store(uint64_t* files, uint64_t* bytes) {
+  string store = shared_store_dir();
+  DIR* dir = opendir(store.c_str());
+  if (!dir) {
+    return errno == ENOENT;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    string path = store + "/" + entry->d_name;
+    struct stat st;
+    if (strncmp(entry->d_name, "copy-", 5) || lstat(path.c_str(), &st) ||
+        !S_ISREG(st.st_mode) || st.st_nlink > 1) {
+      continue;
+    }
+    if (!unlink(path.c_str())) {
+      ++*files;
+      *bytes += st.st_size;
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
 static ostream& operator<<(ostream& out, const vector<string>& vs) {
   out << vs.size() << endl;
   for (auto& v : vs) {
@@ -199,28 +832,180 @@ static istream& operator>>(istream& in, vector<string>& vs) {
   return in;
 }
 
+bool TraceWriter::write_raw_header(const void* d, size_t len,
+                                   remote_ptr<void> addr) {
+  write_held_frame();
+  if (len > 0 && is_zeroed(d, len)) {
+    data_header << global_time << addr.as_int() << len << RAW_DATA_ZERO;
+    return false;
+  }
+  if (len >= MIN_DEDUP_BYTES) {
+    RawDataKey key = { hash_bytes(d, len), len };
+    auto it = raw_data_offsets.find(key);
+    if (it != raw_data_offsets.end()) {
+      data_header << global_time << addr.as_int() << len << it->second;
+      return false;
+    }
+    raw_data_offsets[key] = data.uncompressed_offset();
+  }
+  data_header << global_time << addr.as_int() << len << RAW_DATA_INLINE;
+  return true;
+}
+
 void TraceWriter::write_raw(const void* d, size_t len, remote_ptr<void> addr) {
-  data_header << global_time << addr.as_int() << len;
-  data.write(d, len);
+  if (write_raw_header(d, len, addr)) {
+    data.write(d, len);
+  }
 }
 
-TraceReader::RawData TraceReader::read_raw_data() {
+void TraceWriter::write_raw_v(const void* d, const vector<RawRange>& ranges) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(d);
+  size_t i = 0;
+  while (i < ranges.size()) {
+    // Find the run of ranges from |i| that are small enough to share a
+    // record.  The records keep the ranges' order.
+    size_t end = i;
+    size_t run_bytes = 0;
+    while (end < ranges.size() && ranges[end].len < MIN_DEDUP_BYTES) {
+      run_bytes += ranges[end].len;
+      ++end;
+    }
+    if (end - i < 2) {
+      const RawRange& r = ranges[i];
+      write_raw(bytes, r.len, r.addr);
+      bytes += r.len;
+      ++i;
+      continue;
+    }
+    write_held_frame();
+    data_header << global_time << uintptr_t(end - i) << run_bytes
+                << RAW_DATA_MULTI;
+    for (; i < end; ++i) {
+      data_header << ranges[i].addr.as_int() << ranges[i].len;
+    }
+    if (run_bytes > 0) {
+      data.write(bytes, run_bytes);
+      bytes += run_bytes;
+    }
+  }
+}
+
+bool TraceWriter::reserve_raw(size_t len,
+                              CompressedWriter::WriteSpan spans[2]) {
+  // The reserved bytes belong to the next frame, so the held frame must
+  // be written (and its seek point, if any, taken) first.
+  write_held_frame();
+  if (len > data.uncompressed_block_size() ||
+      !data.reserve_write(len, reserved_raw)) {
+    return false;
+  }
+  spans[0] = reserved_raw[0];
+  spans[1] = reserved_raw[1];
+  return true;
+}
+
+void TraceWriter::commit_raw(size_t len, remote_ptr<void> addr) {
+  assert(len == reserved_raw[0].size + reserved_raw[1].size);
+  const uint8_t* d = reserved_raw[0].data;
+  // write_raw_header() scans the data for zeros, so it must be contiguous.
+  if (reserved_raw[1].size > 0) {
+    reserved_raw_scratch.resize(len);
+    memcpy(reserved_raw_scratch.data(), reserved_raw[0].data,
+           reserved_raw[0].size);
+    memcpy(reserved_raw_scratch.data() + reserved_raw[0].size,
+           reserved_raw[1].data, reserved_raw[1].size);
+    d = reserved_raw_scratch.data();
+  }
+  if (write_raw_header(d, len, addr)) {
+    data.commit_write(len);
+  }
+}
+
+void TraceReader::read_raw_record() {
   TraceFrame::Time time;
-  RawData d;
+  uintptr_t addr;
   size_t num_bytes;
-  data_header >> time >> d.addr >> num_bytes;
+  uint64_t source;
+  data_header >> time >> addr >> num_bytes >> source;
   assert(time == global_time);
+  unread_ranges_time = time;
+  if (source == RAW_DATA_MULTI) {
+    vector<uint8_t> buf(num_bytes);
+    data.read((char*)buf.data(), num_bytes);
+    size_t offset = 0;
+    for (uintptr_t i = 0; i < addr; ++i) {
+      RawData d;
+      size_t len;
+      data_header >> d.addr >> len;
+      assert(offset + len <= num_bytes);
+      d.data.assign(buf.begin() + offset, buf.begin() + offset + len);
+      offset += len;
+      unread_ranges.push_back(move(d));
+    }
+    return;
+  }
+  RawData d;
+  d.addr = addr;
+  // RAW_DATA_ZERO records need nothing more than this zero fill.
   d.data.resize(num_bytes);
-  data.read((char*)d.data.data(), num_bytes);
+  if (source == RAW_DATA_INLINE) {
+    data.read((char*)d.data.data(), num_bytes);
+  } else if (source != RAW_DATA_ZERO) {
+    if (!data_refs.seek(source)) {
+      FATAL() << "Raw data reference to offset " << source
+              << " is beyond the end of the trace";
+    }
+    data_refs.read((char*)d.data.data(), num_bytes);
+  }
+  unread_ranges.push_back(move(d));
+}
+
+bool TraceReader::peek_raw_data_time(TraceFrame::Time* time) {
+  if (!unread_ranges.empty()) {
+    *time = unread_ranges_time;
+    return true;
+  }
+  if (data_header.at_end()) {
+    return false;
+  }
+  data_header.save_state();
+  data_header >> *time;
+  data_header.restore_state();
+  return true;
+}
+
+TraceReader::RawData TraceReader::read_raw_data() {
+  assert(streams & RAW_DATA);
+  if (served_frame) {
+    assert(served_raw_data < served_frame->raw_data.size());
+    return served_frame->raw_data[served_raw_data++];
+  }
+  if (unread_ranges.empty()) {
+    read_raw_record();
+  }
+  RawData d = move(unread_ranges.front());
+  unread_ranges.pop_front();
+  if (pending_frame) {
+    pending_frame->raw_data.push_back(d);
+    if (pending_frame->bytes() > frame_cache->max_frame_bytes()) {
+      pending_frame = nullptr;
+    }
+  }
   return d;
 }
 
 bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
-  while (!data_header.at_end()) {
-    TraceFrame::Time time;
-    data_header.save_state();
-    data_header >> time;
-    data_header.restore_state();
+  assert(streams & RAW_DATA);
+  if (served_frame) {
+    if (served_frame->frame.time() != frame.time() ||
+        served_raw_data == served_frame->raw_data.size()) {
+      return false;
+    }
+    d = served_frame->raw_data[served_raw_data++];
+    return true;
+  }
+  TraceFrame::Time time;
+  while (peek_raw_data_time(&time)) {
     if (time == frame.time()) {
       d = read_raw_data();
       return true;
@@ -232,11 +1017,110 @@ bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
   return false;
 }
 
+static void log_writer_stats(const char* name, const CompressedWriter& w) {
+  LOG(info) << name << ": recorder waited " << w.producer_blocked_count()
+            << " times, " << w.producer_blocked_time() << "s, for "
+            << w.num_threads() << " compression threads";
+}
+
 void TraceWriter::close() {
+  write_held_frame();
+  log_writer_stats("events", events);
+  log_writer_stats("data", data);
+  log_writer_stats("data_header", data_header);
+  log_writer_stats("mmaps", mmaps);
   events.close();
   data.close();
   data_header.close();
   mmaps.close();
+  if (checksums) {
+    log_writer_stats("checksums", *checksums);
+    checksums->close();
+  }
+  if (segments.is_open()) {
+    // The trace is complete, so its last segment ends at the end.
+    SeekPoint point = { time(), events.uncompressed_offset(),
+                        data.uncompressed_offset(),
+                        data_header.uncompressed_offset(),
+                        mmaps.uncompressed_offset() };
+    if (write(segments, &point, sizeof(point)) != sizeof(point)) {
+      LOG(warn) << "Unable to write " << segments_path();
+    }
+    segments.close();
+  }
+
+  if (!seek_points.empty()) {
+    string path = seek_points_path();
+    ofstream out(path.c_str(), ios::binary);
+    out.write(reinterpret_cast<const char*>(seek_points.data()),
+              seek_points.size() * sizeof(SeekPoint));
+    if (!out.good()) {
+      // Readers can do without seek points, and we don't want a
+      // truncated file to mislead them.
+      LOG(warn) << "Unable to write " << path;
+      unlink(path.c_str());
+    }
+    seek_points.clear();
+  }
+
+  if (sink) {
+    string paths[] = { version_path(), args_env_path(), seek_points_path(),
+                       perf_counters_path() };
+    for (auto& path : paths) {
+      if (access(path.c_str(), F_OK) == 0 &&
+          !sink->send_file(path.substr(trace_dir.size() + 1), path)) {
+        LOG(warn) << "Unable to send " << path << " to the output sink";
+      }
+    }
+    sink = nullptr;
+  }
+}
+
+// Compression block size and initial number of compression threads for
+// each stream, and the number of threads each stream may grow to when the
+// recorder has to wait for them.
+static const size_t EVENTS_BLOCK_SIZE = 1024 * 1024;
+static const uint32_t EVENTS_THREADS = 1;
+static const uint32_t EVENTS_MAX_THREADS = 4;
+static const size_t DATA_BLOCK_SIZE = 8 * 1024 * 1024;
+static const uint32_t DATA_THREADS = 3;
+static const uint32_t DATA_MAX_THREADS = 8;
+static const size_t DATA_HEADER_BLOCK_SIZE = 1024 * 1024;
+static const uint32_t DATA_HEADER_THREADS = 1;
+static const uint32_t DATA_HEADER_MAX_THREADS = 2;
+static const size_t MMAPS_BLOCK_SIZE = 64 * 1024;
+static const uint32_t MMAPS_THREADS = 1;
+static const size_t CHECKSUMS_BLOCK_SIZE = 1024 * 1024;
+static const uint32_t CHECKSUMS_THREADS = 1;
+static const size_t SNAPSHOT_BLOCK_SIZE = 8 * 1024 * 1024;
+static const uint32_t SNAPSHOT_THREADS = 2;
+
+static CompressedWriter::Codec trace_codec() {
+  return (CompressedWriter::Codec)Flags::get().compression_codec;
+}
+
+/**
+ * Return the directories to stripe the recorded stream |data_stream| or
+ * other across, if any.
+ */
+static vector<string> stripe_dirs(bool data_stream) {
+  const Flags& flags = Flags::get();
+  if (data_stream || flags.stripe_all_streams) {
+    return flags.stripe_dirs;
+  }
+  return vector<string>();
+}
+
+static shared_ptr<OutputSink> open_trace_sink() {
+  const string& path = Flags::get().output_sink;
+  if (path.empty()) {
+    return nullptr;
+  }
+  auto sink = OutputSink::open(path);
+  if (!sink) {
+    FATAL() << "Unable to open output sink `" << path << "'";
+  }
+  return sink;
 }
 
 static string make_trace_dir(const string& exe_path) {
@@ -268,21 +1152,40 @@ TraceWriter::TraceWriter(const std::vector<std::string>& argv,
                   // Somewhat arbitrarily start the
                   // global time from 1.
                   1),
-      events(events_path(), 1024 * 1024, 1),
-      data(data_path(), 8 * 1024 * 1024, 3),
-      data_header(data_header_path(), 1024 * 1024, 1),
-      mmaps(mmaps_path(), 64 * 1024, 1) {
+      sink(open_trace_sink()),
+      events(events_path(), EVENTS_BLOCK_SIZE, EVENTS_THREADS, trace_codec(),
+             sink, stripe_dirs(false)),
+      data(data_path(), DATA_BLOCK_SIZE, DATA_THREADS, trace_codec(), sink,
+           stripe_dirs(true)),
+      data_header(data_header_path(), DATA_HEADER_BLOCK_SIZE,
+                  DATA_HEADER_THREADS, trace_codec(), sink, stripe_dirs(false)),
+      mmaps(mmaps_path(), MMAPS_BLOCK_SIZE, MMAPS_THREADS, trace_codec(),
+            sink, stripe_dirs(false)) {
   this->argv = argv;
   this->envp = envp;
   this->cwd = cwd;
   this->bind_to_cpu = bind_to_cpu;
-
-  string ver_path = version_path();
-  fstream version(ver_path.c_str(), fstream::out);
-  if (!version.good()) {
-    FATAL() << "Unable to create " << ver_path;
-  }
-  version << TRACE_VERSION << endl;
+  this->extra_perf_counters = Flags::get().extra_perf_counters;
+  next_frame_start = { global_time, 0, 0, 0, 0 };
+  automatic_seek_points = true;
+  cloned_copies = 0;
+  // Checksums are keyed by frame time, so a superseded frame's checksum
+  // would be checked against the frame that replaced it.
+  fold_sched_frames = Flags::get().checksum == Flags::CHECKSUM_NONE ||
+                      Flags::get().checksum == Flags::CHECKSUM_SYSCALL;
+  has_held_frame = false;
+  segment_start_bytes = 0;
+  discardable = false;
+  memset(frames_by_type, 0, sizeof(frames_by_type));
+  events.set_max_threads(EVENTS_MAX_THREADS);
+  data.set_max_threads(DATA_MAX_THREADS);
+  data_header.set_max_threads(DATA_HEADER_MAX_THREADS);
+  // Compress as hard as the recording leaves time for.
+  events.set_adaptive_level(true);
+  data.set_adaptive_level(true);
+  data_header.set_adaptive_level(true);
+  mmaps.set_adaptive_level(true);
+  write_metadata_files();
 
   string link_name = latest_trace_symlink();
   // Try to update the symlink to |this|.  We only try attempt
@@ -301,6 +1204,45 @@ TraceWriter::TraceWriter(const std::vector<std::string>& argv,
     printf("rr: Saving the execution of `%s' to trace directory `%s'.\n",
            argv[0].c_str(), trace_dir.c_str());
   }
+}
+
+static string make_output_dir(const string& dir) {
+  if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG)) {
+    FATAL() << "Unable to create trace directory `" << dir << "'";
+  }
+  return dir;
+}
+
+TraceWriter::TraceWriter(const string& dir, const TraceReader& source)
+    : TraceStream(make_output_dir(dir), 1),
+      events(events_path(), EVENTS_BLOCK_SIZE, EVENTS_THREADS, trace_codec()),
+      data(data_path(), DATA_BLOCK_SIZE, DATA_THREADS, trace_codec()),
+      data_header(data_header_path(), DATA_HEADER_BLOCK_SIZE,
+                  DATA_HEADER_THREADS, trace_codec()),
+      mmaps(mmaps_path(), MMAPS_BLOCK_SIZE, MMAPS_THREADS, trace_codec()) {
+  argv = source.initial_argv();
+  envp = source.initial_envp();
+  cwd = source.initial_cwd();
+  bind_to_cpu = source.bound_to_cpu();
+  extra_perf_counters = source.extra_perf_counter_names();
+  next_frame_start = { global_time, 0, 0, 0, 0 };
+  automatic_seek_points = false;
+  cloned_copies = 0;
+  fold_sched_frames = false;
+  has_held_frame = false;
+  segment_start_bytes = 0;
+  discardable = false;
+  memset(frames_by_type, 0, sizeof(frames_by_type));
+  write_metadata_files();
+}
+
+void TraceWriter::write_metadata_files() {
+  string ver_path = version_path();
+  fstream version(ver_path.c_str(), fstream::out);
+  if (!version.good()) {
+    FATAL() << "Unable to create " << ver_path;
+  }
+  version << TRACE_VERSION << endl;
 
   ofstream out(args_env_path());
   out << cwd << '\0';
@@ -308,59 +1250,662 @@ TraceWriter::TraceWriter(const std::vector<std::string>& argv,
   out << envp;
   out << bind_to_cpu;
   assert(out.good());
+
+  if (!extra_perf_counters.empty()) {
+    ofstream counters(perf_counters_path());
+    for (auto& name : extra_perf_counters) {
+      counters << name << endl;
+    }
+    assert(counters.good());
+  }
+}
+
+/**
+ * A checksums record is the time, tid, checksum kind and number of
+ * mappings, followed by each mapping's start, end and checksum.
+ */
+void TraceWriter::write_checksums(TraceFrame::Time time, pid_t tid,
+                                  uint32_t kind,
+                                  const vector<MappingChecksum>& mappings) {
+  if (!checksums) {
+    checksums.reset(new CompressedWriter(checksums_path(),
+                                         CHECKSUMS_BLOCK_SIZE,
+                                         CHECKSUMS_THREADS, trace_codec(),
+                                         sink));
+  }
+  *checksums << time << tid << kind << uint32_t(mappings.size());
+  for (auto& m : mappings) {
+    *checksums << m.start << m.end << m.checksum;
+  }
+  if (!checksums->good()) {
+    FATAL() << "Tried to save checksums for " << tid << " at " << time
+            << " to the trace, but failed";
+  }
+}
+
+static void write_snapshot_to(CompressedWriter& out,
+                              const TraceStream::ProcessSnapshot& snapshot) {
+  out << snapshot.mmaps_offset << snapshot.tid << snapshot.exe_image
+      << snapshot.name << snapshot.regs << (char)snapshot.extra_regs.format()
+      << snapshot.extra_regs.data_size();
+  out.write(snapshot.extra_regs.data_bytes(), snapshot.extra_regs.data_size());
+  out << snapshot.ticks << snapshot.brk << snapshot.scratch_ptr
+      << snapshot.scratch_size << snapshot.syscallbuf_child
+      << snapshot.num_syscallbuf_bytes << snapshot.traced_syscall_ip
+      << snapshot.untraced_syscall_ip << snapshot.syscallbuf_lib_start
+      << snapshot.syscallbuf_lib_end << snapshot.robust_list
+      << snapshot.robust_list_len << snapshot.tid_addr
+      << uint32_t(snapshot.regions.size());
+  for (auto& r : snapshot.regions) {
+    out << r.start << r.end << r.prot << r.flags << r.kind
+        << uint64_t(r.data.size());
+    out.write(r.data.data(), r.data.size());
+  }
+}
+
+void TraceWriter::write_snapshot(ProcessSnapshot& snapshot) {
+  add_seek_point();
+  if (discardable) {
+    raw_data_offsets.clear();
+  }
+  snapshot.time = time();
+  snapshot.mmaps_offset = mmaps.uncompressed_offset();
+  snapshots.push_back(snapshot.time);
+  string path = snapshot_path(snapshot.time);
+  CompressedWriter out(path, SNAPSHOT_BLOCK_SIZE, SNAPSHOT_THREADS,
+                       trace_codec(), sink);
+  write_snapshot_to(out, snapshot);
+  out.close();
+  if (!out.good()) {
+    FATAL() << "Tried to save a snapshot at " << snapshot.time
+            << " to the trace, but failed";
+  }
+}
+
+bool TraceReader::write_snapshot(const ProcessSnapshot& snapshot) const {
+  string path = snapshot_path(snapshot.time);
+  // Write under a name snapshot_times() doesn't list, so a concurrent
+  // replay never reads a partial snapshot.
+  string tmp = trace_dir + "/tmp_snapshot_" + to_string(getpid());
+  unlink(tmp.c_str());
+  {
+    CompressedWriter out(tmp, SNAPSHOT_BLOCK_SIZE, SNAPSHOT_THREADS,
+                         trace_codec());
+    write_snapshot_to(out, snapshot);
+    out.close();
+    if (!out.good()) {
+      unlink(tmp.c_str());
+      return false;
+    }
+  }
+  if (rename(tmp.c_str(), path.c_str())) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+vector<TraceFrame::Time> TraceReader::snapshot_times() const {
+  vector<TraceFrame::Time> times;
+  DIR* dir = opendir(trace_dir.c_str());
+  if (!dir) {
+    return times;
+  }
+  static const char prefix[] = "snapshot_";
+  while (struct dirent* ent = readdir(dir)) {
+    if (!strncmp(ent->d_name, prefix, sizeof(prefix) - 1)) {
+      times.push_back(strtoull(ent->d_name + sizeof(prefix) - 1, nullptr, 10));
+    }
+  }
+  closedir(dir);
+  sort(times.begin(), times.end());
+  return times;
+}
+
+TraceFrame::Time TraceReader::discarded_until() const {
+  TraceFrame::Time time = 0;
+  ifstream in(discarded_path().c_str());
+  in >> time;
+  return in.fail() ? 0 : time;
+}
+
+bool TraceReader::attached() const {
+  return !access(attached_path().c_str(), F_OK);
+}
+
+bool TraceReader::read_snapshot(TraceFrame::Time time,
+                                ProcessSnapshot* snapshot) const {
+  string path = snapshot_path(time);
+  if (access(path.c_str(), F_OK)) {
+    return false;
+  }
+  CompressedReader in(path);
+  snapshot->time = time;
+  char extra_reg_format;
+  int extra_reg_bytes;
+  in >> snapshot->mmaps_offset >> snapshot->tid >> snapshot->exe_image >>
+      snapshot->name >> snapshot->regs >> extra_reg_format >> extra_reg_bytes;
+  vector<uint8_t> extra_regs(extra_reg_bytes);
+  in.read(extra_regs.data(), extra_reg_bytes);
+  snapshot->extra_regs.set_to_raw_data(
+      (ExtraRegisters::Format)extra_reg_format, extra_regs);
+  uint32_t count;
+  in >> snapshot->ticks >> snapshot->brk >> snapshot->scratch_ptr >>
+      snapshot->scratch_size >> snapshot->syscallbuf_child >>
+      snapshot->num_syscallbuf_bytes >> snapshot->traced_syscall_ip >>
+      snapshot->untraced_syscall_ip >> snapshot->syscallbuf_lib_start >>
+      snapshot->syscallbuf_lib_end >> snapshot->robust_list >>
+      snapshot->robust_list_len >> snapshot->tid_addr >> count;
+  snapshot->regions.resize(count);
+  for (auto& r : snapshot->regions) {
+    uint64_t size;
+    in >> r.start >> r.end >> r.prot >> r.flags >> r.kind >> size;
+    r.data.resize(size);
+    in.read(r.data.data(), size);
+  }
+  if (!in.good()) {
+    LOG(warn) << "Snapshot " << path << " is corrupt";
+    return false;
+  }
+  return true;
+}
+
+static void read_checksums_record(CompressedReader& in, TraceFrame::Time* time,
+                                  pid_t* tid, uint32_t* kind,
+                                  vector<TraceStream::MappingChecksum>* out) {
+  uint32_t count;
+  in >> *time >> *tid >> *kind >> count;
+  out->resize(count);
+  for (auto& m : *out) {
+    in >> m.start >> m.end >> m.checksum;
+  }
+}
+
+bool TraceReader::read_checksums(TraceFrame::Time time, pid_t tid,
+                                 uint32_t* kind,
+                                 vector<MappingChecksum>* mappings) {
+  // Records are in the order replay validates them, so normally the
+  // next record is the one we want. After a restart or a return to an
+  // earlier checkpoint, start again from the beginning.
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    bool fresh = !checksums;
+    if (fresh) {
+      if (access(checksums_path().c_str(), F_OK)) {
+        return false;
+      }
+      checksums.reset(new CompressedReader(checksums_path()));
+    }
+    while (!checksums->at_end()) {
+      checksums->save_state();
+      TraceFrame::Time rec_time;
+      pid_t rec_tid;
+      read_checksums_record(*checksums, &rec_time, &rec_tid, kind, mappings);
+      if (rec_time == time && rec_tid == tid) {
+        checksums->discard_state();
+        return true;
+      }
+      if (rec_time > time) {
+        checksums->restore_state();
+        break;
+      }
+      checksums->discard_state();
+    }
+    if (fresh) {
+      return false;
+    }
+    checksums.reset();
+  }
+  return false;
+}
+
+void TraceWriter::add_seek_point() {
+  write_held_frame();
+  SeekPoint point = { global_time, events.uncompressed_offset(),
+                      data.uncompressed_offset(),
+                      data_header.uncompressed_offset(),
+                      mmaps.uncompressed_offset() };
+  seek_points.push_back(point);
+  last_exec_info.clear();
+}
+
+static TraceWriter::StreamStats writer_stats(const char* name,
+                                             CompressedWriter& w) {
+  TraceWriter::StreamStats stats;
+  stats.name = name;
+  stats.bytes = w.uncompressed_offset();
+  w.backlog(&stats.uncompressed_backlog, &stats.compressed_backlog);
+  stats.blocked_count = w.producer_blocked_count();
+  stats.blocked_time = w.producer_blocked_time();
+  return stats;
+}
+
+vector<TraceWriter::StreamStats> TraceWriter::stream_stats() {
+  vector<StreamStats> stats;
+  stats.push_back(writer_stats("events", events));
+  stats.push_back(writer_stats("data", data));
+  stats.push_back(writer_stats("data_header", data_header));
+  stats.push_back(writer_stats("mmaps", mmaps));
+  return stats;
+}
+
+uint64_t TraceWriter::segment_bytes() const {
+  return events.uncompressed_offset() + data.uncompressed_offset() +
+         data_header.uncompressed_offset() + mmaps.uncompressed_offset() -
+         segment_start_bytes;
+}
+
+void TraceWriter::end_segment() {
+  write_held_frame();
+  // Data already written for the next frame belongs to the next segment.
+  SeekPoint point = next_frame_start;
+  point.global_time = time();
+  point.events = events.uncompressed_offset();
+  if (seek_points.empty() ||
+      seek_points.back().global_time != point.global_time) {
+    seek_points.push_back(point);
+    last_exec_info.clear();
+  }
+  if (discardable) {
+    raw_data_offsets.clear();
+  }
+
+  // Flush the events last, so no frame reaches the disk before its data.
+  if (!data.flush() || !data_header.flush() || !mmaps.flush() ||
+      (checksums && !checksums->flush()) || !events.flush()) {
+    FATAL() << "Unable to flush the trace at the end of segment "
+            << point.global_time;
+  }
+  segment_start_bytes += segment_bytes();
+  if (sink) {
+    // The sink receives the streams as they're written; there's no
+    // segments file to update.
+    return;
+  }
+  if (!segments.is_open()) {
+    segments = ScopedFd(segments_path().c_str(),
+                        O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  }
+  if (write(segments, &point, sizeof(point)) != sizeof(point) ||
+      fdatasync(segments)) {
+    FATAL() << "Unable to write " << segments_path();
+  }
+  LOG(debug) << "Ended trace segment at " << point.global_time;
+}
+
+void TraceWriter::discard(TraceFrame::Time from, TraceFrame::Time to) {
+  auto find_point = [this](TraceFrame::Time time) -> const SeekPoint* {
+    for (auto& p : seek_points) {
+      if (p.global_time == time) {
+        return &p;
+      }
+    }
+    return nullptr;
+  };
+  const SeekPoint* start = find_point(from);
+  const SeekPoint* end = find_point(to);
+  if (!start || !end || from >= to) {
+    LOG(warn) << "Can't discard the trace from " << from << " to " << to;
+    return;
+  }
+  if (!events.discard(start->events, end->events) ||
+      !data.discard(start->data, end->data) ||
+      !data_header.discard(start->data_header, end->data_header) ||
+      !mmaps.discard(start->mmaps, end->mmaps)) {
+    LOG(warn) << "Unable to discard the trace from " << from << " to " << to;
+  }
+  // Readers can't seek into the discarded range.
+  seek_points.erase(
+      remove_if(seek_points.begin(), seek_points.end(),
+                [from, to](const SeekPoint& p) {
+        return from < p.global_time && p.global_time < to;
+      }),
+      seek_points.end());
+  for (auto it = snapshots.begin(); it != snapshots.end() && *it < to;) {
+    unlink(snapshot_path(*it).c_str());
+    it = snapshots.erase(it);
+  }
+
+  write_discarded_until(to);
+  LOG(debug) << "Discarded the trace from " << from << " to " << to;
+}
+
+void TraceWriter::write_discarded_until(TraceFrame::Time time) {
+  string path = discarded_path();
+  string tmp = path + ".tmp";
+  {
+    ofstream out(tmp.c_str());
+    out << time << endl;
+    if (!out.good()) {
+      FATAL() << "Unable to write " << tmp;
+    }
+  }
+  if (rename(tmp.c_str(), path.c_str())) {
+    FATAL() << "Unable to rename `" << tmp << "' to `" << path << "'";
+  }
+}
+
+void TraceWriter::set_attached(TraceFrame::Time time) {
+  // Nothing before the snapshot can be replayed, as if it was discarded.
+  write_discarded_until(time);
+  ScopedFd fd(attached_path().c_str(),
+              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (!fd.is_open()) {
+    FATAL() << "Unable to create " << attached_path();
+  }
+}
+
+void TraceReader::copy_mapped_regions(TraceWriter& out, uint64_t end) {
+  while (!mmaps.at_end() && mmaps.uncompressed_offset() < end) {
+    TraceMappedRegion map = read_mapped_region();
+    if (!map.stored_file().empty()) {
+      out.link_stored_copy(trace_file_path(map.stored_file()),
+                           map.stored_file());
+    }
+    out.write_mapped_region(map);
+  }
+}
+
+void TraceReader::verify(uint32_t threads, vector<string>* problems) const {
+  struct Stream {
+    const char* name;
+    string path;
+    // Only recordings with --checksum have checksums.
+    bool optional;
+    uint64_t size;
+  } streams[] = { { "events", events_path(), false, 0 },
+                  { "data", data_path(), false, 0 },
+                  { "data_header", data_header_path(), false, 0 },
+                  { "mmaps", mmaps_path(), false, 0 },
+                  { "checksums", checksums_path(), true, 0 } };
+  bool streams_ok = true;
+  for (auto& s : streams) {
+    if (s.optional && !StreamSource::open(s.path)->is_open()) {
+      continue;
+    }
+    string problem;
+    if (!CompressedReader::verify(s.path, threads, &s.size, &problem)) {
+      problems->push_back(string(s.name) + ": " + problem);
+      streams_ok = false;
+    }
+  }
+  if (!streams_ok) {
+    return;
+  }
+
+  auto check_points = [&](const char* name,
+                          const vector<SeekPoint>& points) {
+    TraceFrame::Time last_time = 0;
+    for (auto& p : points) {
+      if (p.global_time < last_time || p.events > streams[0].size ||
+          p.data > streams[1].size || p.data_header > streams[2].size ||
+          p.mmaps > streams[3].size) {
+        problems->push_back(string(name) + ": point at event " +
+                            to_string(p.global_time) +
+                            " lies outside the streams");
+        return;
+      }
+      last_time = p.global_time;
+    }
+  };
+  check_points("seek_points", *seek_points);
+  check_points("segments", *segments);
+}
+
+bool TraceReader::compact(const string& dir) {
+  rewind();
+  TraceWriter out(dir, *this);
+  size_t next_point = 0;
+  while (!at_end()) {
+    if (next_point < seek_points->size() &&
+        (*seek_points)[next_point].global_time == time() + 1) {
+      copy_mapped_regions(out, (*seek_points)[next_point].mmaps);
+      out.add_seek_point();
+      ++next_point;
+    }
+    TraceFrame frame = read_frame();
+    RawData d;
+    while (read_raw_data_for_frame(frame, d)) {
+      out.write_raw(d.data.data(), d.data.size(), d.addr);
+    }
+    out.write_frame(frame);
+  }
+  copy_mapped_regions(out, UINT64_MAX);
+  if (!access(checksums_path().c_str(), F_OK)) {
+    CompressedReader in(checksums_path());
+    while (!in.at_end()) {
+      TraceFrame::Time time;
+      pid_t tid;
+      uint32_t kind;
+      vector<MappingChecksum> mappings;
+      read_checksums_record(in, &time, &tid, &kind, &mappings);
+      out.write_checksums(time, tid, kind, mappings);
+    }
+  }
+  out.close();
+  return good() && out.good();
 }
 
 TraceFrame TraceReader::peek_frame() {
-  events.save_state();
-  auto saved_time = global_time;
+  if (frame_cache) {
+    auto cached = frame_cache->find(global_time + 1);
+    if (cached) {
+      return cached->frame;
+    }
+  }
+  sync_streams();
   TraceFrame frame;
   if (!at_end()) {
-    frame = read_frame();
+    events.save_state();
+    ExecInfoMap exec_info = last_exec_info;
+    frame = read_frame_from(events, global_time, exec_info);
+    events.restore_state();
   }
-  events.restore_state();
-  global_time = saved_time;
   return frame;
 }
 
 TraceFrame TraceReader::peek_to(pid_t pid, EventType type,
                                 SyscallEntryOrExit state) {
-  TraceFrame frame;
-  events.save_state();
-  auto saved_time = global_time;
-  while (good() && !at_end()) {
-    frame = read_frame();
+  // Read-ahead is dropped once it holds this many frames, so a long
+  // lookahead costs no more memory than it did time.
+  static const size_t MAX_PEEK_INDEX_FRAMES = 1 << 20;
+
+  sync_streams();
+  if (!peek_index || !peek_index->covers(global_time)) {
+    peek_index =
+        make_shared<PeekIndex>(events, global_time, last_exec_info);
+  }
+  peek_index->drop_through(global_time);
+  if (const TraceFrame* found = peek_index->find(pid, type, state)) {
+    return *found;
+  }
+  auto& index_events = peek_index->events;
+  while (index_events.good() && !index_events.at_end() &&
+         (segments->empty() ||
+          index_events.uncompressed_offset() < segments->back().events)) {
+    const TraceFrame& frame = peek_index->read_next();
     if (frame.tid() == pid && frame.event().type == type &&
         frame.event().state == state) {
-      events.restore_state();
-      global_time = saved_time;
-      return frame;
+      TraceFrame result = frame;
+      if (peek_index->num_frames > MAX_PEEK_INDEX_FRAMES) {
+        peek_index = nullptr;
+      }
+      return result;
     }
   }
   FATAL() << "Unable to find requested frame in stream";
   // Unreachable
-  return frame;
+  return TraceFrame();
+}
+
+void TraceReader::skip_raw_data_before(TraceFrame::Time target_time) {
+  if (served_frame) {
+    if (served_frame->frame.time() < target_time) {
+      served_raw_data = served_frame->raw_data.size();
+    }
+    return;
+  }
+  TraceFrame::Time time;
+  while (peek_raw_data_time(&time)) {
+    if (time >= target_time) {
+      return;
+    }
+    // The pending frame can't be cached without this record.
+    pending_frame = nullptr;
+    if (!unread_ranges.empty()) {
+      unread_ranges.clear();
+      continue;
+    }
+    uintptr_t addr;
+    size_t num_bytes;
+    uint64_t source;
+    data_header >> time >> addr >> num_bytes >> source;
+    if (source == RAW_DATA_MULTI) {
+      for (uintptr_t i = 0; i < addr; ++i) {
+        uintptr_t range_addr;
+        size_t range_len;
+        data_header >> range_addr >> range_len;
+      }
+    }
+    if (source == RAW_DATA_INLINE || source == RAW_DATA_MULTI) {
+      data.seek(data.uncompressed_offset() + num_bytes);
+    }
+  }
+}
+
+const TraceStream::SeekPoint* TraceReader::seek_point_before(
+    TraceFrame::Time time) const {
+  auto it = upper_bound(seek_points->begin(), seek_points->end(), time,
+                        [](TraceFrame::Time t, const SeekPoint& p) {
+    return t < p.global_time;
+  });
+  return it == seek_points->begin() ? nullptr : &*(it - 1);
+}
+
+TraceFrame TraceReader::peek_frame_at(TraceFrame::Time target_time) const {
+  // As in seek_to_time(), start from here if that's at least as close as
+  // the seek point.
+  const SeekPoint* point = seek_point_before(target_time);
+  CompressedReader in(events);
+  ExecInfoMap exec_info;
+  TraceFrame::Time t;
+  if (frame_cache) {
+    auto cached = frame_cache->find(target_time);
+    if (cached) {
+      return cached->frame;
+    }
+  }
+  // The streams aren't where the current position says while a cached
+  // frame is being served.
+  if (target_time > global_time && !served_frame &&
+      (!point || point->global_time <= global_time + 1)) {
+    exec_info = last_exec_info;
+    t = global_time;
+  } else if (point) {
+    if (!in.seek(point->events)) {
+      return TraceFrame();
+    }
+    t = point->global_time - 1;
+  } else {
+    in.rewind();
+    t = 0;
+  }
+
+  while (in.good() && !in.at_end()) {
+    TraceFrame frame = read_frame_from(in, t, exec_info);
+    ++t;
+    if (frame.time() >= target_time) {
+      return frame.time() == target_time ? frame : TraceFrame();
+    }
+  }
+  return TraceFrame();
+}
+
+bool TraceReader::seek_to_time(TraceFrame::Time target_time) {
+  // Find the last seek point not after |target_time|. If we're already
+  // between that point and |target_time|, just read forward from here.
+  const SeekPoint* point = seek_point_before(target_time);
+  bool can_read_forward = target_time > global_time;
+  if (point && (!can_read_forward || point->global_time > global_time + 1)) {
+    served_frame = nullptr;
+    pending_frame = nullptr;
+    unread_ranges.clear();
+    if (!events.seek(point->events) ||
+        ((streams & RAW_DATA) && (!data.seek(point->data) ||
+                                  !data_header.seek(point->data_header))) ||
+        ((streams & MAPPED_REGIONS) && !mmaps.seek(point->mmaps))) {
+      FATAL() << "Seek point for time " << point->global_time
+              << " is beyond the end of the trace";
+    }
+    global_time = point->global_time - 1;
+    last_exec_info.clear();
+  } else if (!can_read_forward) {
+    return false;
+  }
+
+  while (!at_end() && global_time + 1 < target_time) {
+    read_frame();
+  }
+  if (streams & RAW_DATA) {
+    skip_raw_data_before(global_time + 1);
+  }
+  return true;
+}
+
+void TraceReader::seek_mapped_regions(uint64_t offset) {
+  if (!mmaps.seek(offset)) {
+    FATAL() << "Mapped region offset " << offset
+            << " is beyond the end of the trace";
+  }
 }
 
 void TraceReader::rewind() {
+  served_frame = nullptr;
+  pending_frame = nullptr;
+  unread_ranges.clear();
   events.rewind();
   data.rewind();
   data_header.rewind();
   mmaps.rewind();
   global_time = 0;
+  last_exec_info.clear();
   assert(good());
 }
 
-TraceReader::TraceReader(const string& dir)
+shared_ptr<const vector<TraceStream::SeekPoint> >
+TraceReader::read_seek_points(const string& path) {
+  auto points = make_shared<vector<SeekPoint> >();
+  ifstream in(path.c_str(), ios::binary | ios::ate);
+  if (in.good()) {
+    streamoff size = in.tellg();
+    if (size > 0 && size % sizeof(SeekPoint) == 0) {
+      points->resize(size / sizeof(SeekPoint));
+      in.seekg(0);
+      in.read(reinterpret_cast<char*>(points->data()), size);
+      if (!in.good()) {
+        points->clear();
+      }
+    }
+  }
+  return points;
+}
+
+TraceReader::TraceReader(const string& dir, int streams)
     : TraceStream(dir.empty() ? latest_trace_symlink() : dir,
                   // Initialize the global time at 0, so
                   // that when we tick it when reading
                   // the first trace, it matches the
                   // initial global time at recording, 1.
                   0),
+      segments(read_seek_points(segments_path())),
       events(events_path()),
       data(data_path()),
       data_header(data_header_path()),
-      mmaps(mmaps_path()) {
+      mmaps(mmaps_path()),
+      // Shares |data|'s decompressed blocks.
+      data_refs(data),
+      streams(streams),
+      served_raw_data(0),
+      unread_ranges_time(0) {
   string path = version_path();
   fstream vfile(path.c_str(), fstream::in);
   if (!vfile.good()) {
@@ -401,6 +1946,131 @@ TraceReader::TraceReader(const string& dir)
   in >> argv;
   in >> envp;
   in >> bind_to_cpu;
+
+  // Only recordings that selected extra perf counters name them.
+  ifstream counters(perf_counters_path());
+  string counter;
+  while (getline(counters, counter)) {
+    extra_perf_counters.push_back(counter);
+  }
+
+  // Seek points are optional; a recording that didn't shut down cleanly
+  // won't have them, but the ends of its segments are seek points too.
+  seek_points = read_seek_points(seek_points_path());
+  if (seek_points->empty()) {
+    seek_points = segments;
+  }
+
+  uint32_t threads = Flags::get().decompress_threads;
+  if (threads > 0) {
+    // mmaps records are tiny and rarely read, so don't bother with it.
+    events.start_read_ahead(threads, 2 * threads);
+    if (streams & RAW_DATA) {
+      data.start_read_ahead(threads, 2 * threads);
+      data_header.start_read_ahead(threads, 2 * threads);
+    }
+  }
+}
+
+vector<TraceReader::TimeRange> TraceReader::split_time_ranges(
+    size_t max_ranges) const {
+  assert(max_ranges > 0);
+  vector<TimeRange> ranges;
+  size_t num_points = seek_points->size();
+  size_t points_per_range = (num_points + max_ranges - 1) / max_ranges;
+  TimeRange range = { 0, numeric_limits<TraceFrame::Time>::max() };
+  for (size_t i = points_per_range; i < num_points; i += points_per_range) {
+    range.end = (*seek_points)[i].global_time;
+    ranges.push_back(range);
+    range.start = range.end;
+  }
+  range.end = numeric_limits<TraceFrame::Time>::max();
+  ranges.push_back(range);
+  return ranges;
+}
+
+namespace {
+struct ParallelVisit {
+  string dir;
+  const TraceReader::FrameVisitor* visitor;
+  vector<TraceReader::TimeRange> ranges;
+  pthread_mutex_t mutex;
+  // Protected by |mutex|
+  size_t next_range;
+};
+}
+
+static void* visit_ranges(void* p) {
+  ParallelVisit* visit = static_cast<ParallelVisit*>(p);
+  while (true) {
+    pthread_mutex_lock(&visit->mutex);
+    size_t i = visit->next_range++;
+    pthread_mutex_unlock(&visit->mutex);
+    if (i >= visit->ranges.size()) {
+      return nullptr;
+    }
+
+    const TraceReader::TimeRange& range = visit->ranges[i];
+    TraceReader reader(visit->dir, TraceReader::RAW_DATA);
+    reader.seek_to_time(range.start);
+    vector<TraceReader::RawData> raw_data;
+    while (!reader.at_end()) {
+      TraceFrame frame = reader.read_frame();
+      if (frame.time() >= range.end) {
+        break;
+      }
+      raw_data.clear();
+      TraceReader::RawData d;
+      while (reader.read_raw_data_for_frame(frame, d)) {
+        raw_data.push_back(move(d));
+      }
+      (*visit->visitor)(i, frame, raw_data);
+    }
+  }
+}
+
+void TraceReader::visit_frames_parallel(uint32_t num_threads,
+                                        const FrameVisitor& visitor) const {
+  assert(num_threads > 0);
+  ParallelVisit visit;
+  visit.dir = dir();
+  visit.visitor = &visitor;
+  visit.ranges = split_time_ranges(num_threads * 4);
+  pthread_mutex_init(&visit.mutex, nullptr);
+  visit.next_range = 0;
+
+  vector<pthread_t> threads;
+  threads.resize(min<size_t>(num_threads, visit.ranges.size()));
+  for (auto& t : threads) {
+    pthread_create(&t, nullptr, visit_ranges, &visit);
+  }
+  for (auto& t : threads) {
+    pthread_join(t, nullptr);
+  }
+  pthread_mutex_destroy(&visit.mutex);
+}
+
+bool TraceReader::unpack() {
+  return CompressedReader::unpack(events_path()) &&
+         CompressedReader::unpack(data_path()) &&
+         CompressedReader::unpack(data_header_path()) &&
+         CompressedReader::unpack(mmaps_path()) &&
+         (access(checksums_path().c_str(), F_OK) ||
+          CompressedReader::unpack(checksums_path()));
+}
+
+bool TraceReader::pack(CompressedWriter::Codec codec) {
+  return CompressedReader::pack(events_path(), codec, EVENTS_BLOCK_SIZE,
+                                EVENTS_THREADS) &&
+         CompressedReader::pack(data_path(), codec, DATA_BLOCK_SIZE,
+                                DATA_THREADS) &&
+         CompressedReader::pack(data_header_path(), codec,
+                                DATA_HEADER_BLOCK_SIZE, DATA_HEADER_THREADS) &&
+         CompressedReader::pack(mmaps_path(), codec, MMAPS_BLOCK_SIZE,
+                                MMAPS_THREADS) &&
+         (access(checksums_path().c_str(), F_OK) ||
+          CompressedReader::pack(checksums_path(), codec, CHECKSUMS_BLOCK_SIZE,
+                                 CHECKSUMS_THREADS));
 }
 
 uint64_t TraceReader::uncompressed_bytes() const {
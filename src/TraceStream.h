@@ -5,16 +5,23 @@
 
 #include <unistd.h>
 
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "CompressedReader.h"
 #include "CompressedWriter.h"
 #include "Event.h"
 #include "remote_ptr.h"
+#include "ScopedFd.h"
 #include "TraceFrame.h"
 #include "TraceMappedRegion.h"
+#include "util.h"
 
 /**
  * TraceStream stores all the data common to both recording and
@@ -37,6 +44,13 @@ public:
   const std::vector<string>& initial_envp() const { return envp; }
   const string& initial_cwd() const { return cwd; }
   int bound_to_cpu() const { return bind_to_cpu; }
+  /**
+   * Return the names of the extra perf counters whose totals were
+   * recorded in each trace frame, in PerfCounters::Extra order.
+   */
+  const std::vector<string>& extra_perf_counter_names() const {
+    return extra_perf_counters;
+  }
 
   /**
    * Return the current "global time" (event count) for this
@@ -44,7 +58,100 @@ public:
    */
   TraceFrame::Time time() const { return global_time; }
 
+  /**
+   * Return the path of the file |name| in the trace directory, such as a
+   * TraceMappedRegion's stored_file().
+   */
+  string trace_file_path(const string& name) const {
+    return trace_dir + "/" + name;
+  }
+
+  /**
+   * Return the path of the file replay caches the |len| bytes at |offset|
+   * of the recorded private copy of |file| in. The name identifies the
+   * file as verify_backing_file() does, by its inode and change times, so
+   * every mapping of the same file contents shares one cached copy.
+   */
+  string mmap_cache_path(const TraceMappedRegion& file, off64_t offset,
+                         size_t len) const;
+
+  /**
+   * Return the directory of the store of mapped file copies shared by
+   * all traces in the trace save directory.
+   */
+  static string shared_store_dir();
+
+  /**
+   * The checksum of the mapping [start, end) in a checksums record.
+   */
+  struct MappingChecksum {
+    uint64_t start;
+    uint64_t end;
+    uint32_t checksum;
+  };
+
+  /**
+   * The state of a single-task process between two trace frames, saved
+   * so that replay can start there instead of at the initial exec.
+   */
+  struct ProcessSnapshot {
+    enum RegionKind {
+      // Private memory, restored as an anonymous mapping of |data|.
+      REGION_MEMORY,
+      // The vdso, which the kernel maps; only |data| is restored.
+      REGION_VDSO,
+      // The task's scratch memory, whose contents replay never uses.
+      REGION_SCRATCH,
+      // The syscallbuf shared with rr.
+      REGION_SYSCALLBUF
+    };
+    struct Region {
+      uint64_t start;
+      uint64_t end;
+      int32_t prot;
+      int32_t flags;
+      int32_t kind;
+      std::vector<uint8_t> data;
+    };
+    ProcessSnapshot() : time(0), mmaps_offset(0), tid(0), ticks(0) {}
+    // The first frame to replay after restoring this.
+    TraceFrame::Time time;
+    // The offset of the mapped regions stream at |time|, which frames
+    // don't locate by themselves.
+    uint64_t mmaps_offset;
+    pid_t tid;
+    string exe_image;
+    string name;
+    Registers regs;
+    ExtraRegisters extra_regs;
+    Ticks ticks;
+    remote_ptr<void> brk;
+    remote_ptr<void> scratch_ptr;
+    uint64_t scratch_size;
+    remote_ptr<void> syscallbuf_child;
+    uint64_t num_syscallbuf_bytes;
+    remote_ptr<void> traced_syscall_ip;
+    remote_ptr<void> untraced_syscall_ip;
+    remote_ptr<void> syscallbuf_lib_start;
+    remote_ptr<void> syscallbuf_lib_end;
+    remote_ptr<void> robust_list;
+    uint64_t robust_list_len;
+    remote_ptr<int> tid_addr;
+    std::vector<Region> regions;
+  };
+
 protected:
+  /**
+   * The exec info and extra registers of the last frame with exec info
+   * for a tid. Frames' exec info and extra registers are encoded relative
+   * to these.
+   */
+  struct LastExecInfo {
+    TraceFrame::ExecInfo exec_info;
+    ExtraRegisters extra_regs;
+  };
+  typedef std::unordered_map<pid_t, LastExecInfo> ExecInfoMap;
+
   TraceStream(const string& trace_dir, TraceFrame::Time initial_time)
       : trace_dir(trace_dir), global_time(initial_time) {}
 
@@ -52,23 +159,102 @@ protected:
   string data_path() const { return trace_dir + "/data"; }
   string data_header_path() const { return trace_dir + "/data_header"; }
   string mmaps_path() const { return trace_dir + "/mmaps"; }
+  /**
+   * Return the path of the "seek_points" file, which stores one SeekPoint
+   * for the first frame starting in each block of the events file.
+   */
+  string seek_points_path() const { return trace_dir + "/seek_points"; }
+  /**
+   * Return the path of the "segments" file, which stores one SeekPoint
+   * for the end of each segment of the trace whose streams were flushed
+   * to disk.
+   */
+  string segments_path() const { return trace_dir + "/segments"; }
+  /**
+   * Return the path of the "discarded" file, which stores the time of the
+   * snapshot replay must start from when the trace before it was
+   * discarded.
+   */
+  string discarded_path() const { return trace_dir + "/discarded"; }
+  /**
+   * Return the path of the "attached" file, which exists when the
+   * recording attached to a process that was already running.
+   */
+  string attached_path() const { return trace_dir + "/attached"; }
   /**
    * Return the path of the "args_env" file, into which the
    * initial tracee argv and envp are recorded.
    */
   string args_env_path() const { return trace_dir + "/args_env"; }
+  /**
+   * Return the path of the "perf_counters" file, which names the extra
+   * perf counters recorded, if any were, one per line.
+   */
+  string perf_counters_path() const { return trace_dir + "/perf_counters"; }
   /**
    * Return the path of "version" file, into which the current
    * trace format version of rr is stored upon creation of the
    * trace.
    */
   string version_path() const { return trace_dir + "/version"; }
+  /**
+   * Return the path of the "checksums" file, which stores the memory
+   * checksums taken with --checksum, if any.
+   */
+  string checksums_path() const { return trace_dir + "/checksums"; }
+  /**
+   * Return the path of the file storing the ProcessSnapshot for
+   * |time|.
+   */
+  string snapshot_path(TraceFrame::Time time) const {
+    return trace_dir + "/snapshot_" + std::to_string(time);
+  }
 
   /**
    * Increment the global time and return the incremented value.
    */
   void tick_time() { ++global_time; }
 
+  /**
+   * Writers add a seek point at least this often, and also at the first
+   * frame starting in each block of the events stream.
+   */
+  enum {
+    SEEK_POINT_INTERVAL = 4096
+  };
+
+  /**
+   * Value of the |source| field of a data_header record whose data
+   * immediately follows the previous record's in |data|. Any other value
+   * is the offset in |data| of an identical earlier copy of the data.
+   */
+  static const uint64_t RAW_DATA_INLINE = UINT64_MAX;
+  /**
+   * Value of the |source| field of a data_header record for several
+   * ranges of tracee memory, written by write_raw_v().  Its |addr| field
+   * is the number of ranges and its |len| field their total size; it's
+   * followed by an (addr, len) pair for each range, and their data
+   * immediately follows the previous record's in |data|.
+   */
+  static const uint64_t RAW_DATA_MULTI = UINT64_MAX - 1;
+  /**
+   * Value of the |source| field of a data_header record whose data is
+   * all zeros.  Nothing is stored for it in |data|.
+   */
+  static const uint64_t RAW_DATA_ZERO = UINT64_MAX - 2;
+
+  /**
+   * The uncompressed offsets in each stream at which the data for trace
+   * frame |global_time| begins.
+   */
+  struct SeekPoint {
+    TraceFrame::Time global_time;
+    uint64_t events;
+    uint64_t data;
+    uint64_t data_header;
+    uint64_t mmaps;
+  };
+
   // Directory into which we're saving the trace files.
   string trace_dir;
   // The initial argv and envp for a tracee.
@@ -78,12 +264,16 @@ protected:
   string cwd;
   // CPU core# that the tracees are bound to
   int bind_to_cpu;
+  // Extra perf counters recorded in each frame.
+  std::vector<string> extra_perf_counters;
 
   // Arbitrary notion of trace time, ticked on the recording of
   // each event (trace frame).
   TraceFrame::Time global_time;
 };
 
+class TraceReader;
+
 class TraceWriter : public TraceStream {
 public:
   /**
@@ -91,8 +281,18 @@ public:
    *
    * Recording a trace frame has the side effect of ticking
    * the global time.
+   *
+   * While recording, an EV_SCHED frame is held back until the next
+   * write, and dropped if that write is another EV_SCHED of the same
+   * tid: replay runs through a task's consecutive preemptions to the
+   * last one anyway.  A held frame ticks the global time when it's
+   * written, so frames handed in after it are renumbered to follow it.
    */
   void write_frame(const TraceFrame& frame);
+  /**
+   * Write the EV_SCHED frame held back by write_frame(), if any.
+   */
+  void write_held_frame();
 
   /**
    * Write TraceMappedRegion record to the trace.
@@ -103,9 +303,52 @@ public:
    * Write a raw-data record to the trace.
    * 'addr' is the address in the tracee where the data came from/will be
    * restored to.
+   * Data of at least MIN_DEDUP_BYTES that's identical to data written
+   * earlier is not written again; the record refers to the earlier copy.
+   * All-zero data is not written at all.
    */
   void write_raw(const void* data, size_t len, remote_ptr<void> addr);
 
+  struct RawRange {
+    remote_ptr<void> addr;
+    size_t len;
+  };
+  /**
+   * Write raw-data records for |ranges|, whose data lie back to back at
+   * 'data', as one record with a single header, so that recording the
+   * fields of a struct costs one record, not one per field.  Replay
+   * reads them back as one record per range, as if each had been written
+   * with write_raw().  Ranges of at least MIN_DEDUP_BYTES are written
+   * with write_raw() instead, so they can still be deduplicated.
+   */
+  void write_raw_v(const void* data, const std::vector<RawRange>& ranges);
+
+  /**
+   * Start a raw-data record of 'len' bytes by reserving space for the data
+   * directly in the data stream's buffer. The caller fills |spans| and
+   * then calls commit_raw(). Returns false if the data is too large to
+   * reserve in one piece; use write_raw() instead.
+   */
+  bool reserve_raw(size_t len, CompressedWriter::WriteSpan spans[2]);
+  /**
+   * Finish the record started by reserve_raw(), as write_raw() would.
+   */
+  void commit_raw(size_t len, remote_ptr<void> addr);
+
+  /**
+   * Save the checksums of the memory of task |tid| at |time|, computed
+   * with the checksum algorithm |kind|.
+   */
+  void write_checksums(TraceFrame::Time time, pid_t tid, uint32_t kind,
+                       const std::vector<MappingChecksum>& checksums);
+
+  /**
+   * Save |snapshot|, taken after the last frame written, and add a seek
+   * point for the next frame so replay can start there.  Sets the
+   * snapshot's time.
+   */
+  void write_snapshot(ProcessSnapshot& snapshot);
+
   /**
    * Return true iff all trace files are "good".
    */
@@ -128,8 +371,116 @@ public:
   TraceWriter(const std::vector<std::string>& argv,
               const std::vector<std::string>& envp, const string& cwd,
               int bind_to_cpu);
+  /**
+   * Create a trace in the new directory |dir| for a copy of |source|'s
+   * trace, with the same initial exe, args, environment, cwd and cpu
+   * binding. Seek points are only added by add_seek_point().
+   */
+  TraceWriter(const string& dir, const TraceReader& source);
+
+  /**
+   * Add a seek point for the frame about to be written, at the current
+   * position of every stream. Call before writing the frame's raw data
+   * and mapped regions.
+   */
+  void add_seek_point();
+
+  /**
+   * End the current segment of the trace: flush every stream to disk, so
+   * that a recording interrupted later still leaves the trace readable up
+   * to here, and record the position in the segments file. The next frame
+   * starts at a seek point.
+   */
+  void end_segment();
+  /**
+   * Return the number of uncompressed bytes written to the streams since
+   * the last end_segment().
+   */
+  uint64_t segment_bytes() const;
+
+  /**
+   * The state of one of the trace's streams while recording.
+   */
+  struct StreamStats {
+    const char* name;
+    // Uncompressed bytes written so far.
+    uint64_t bytes;
+    // See CompressedWriter::backlog().
+    uint64_t uncompressed_backlog;
+    uint64_t compressed_backlog;
+    // How often, and how long, the recorder waited for buffer space.
+    uint64_t blocked_count;
+    double blocked_time;
+  };
+  std::vector<StreamStats> stream_stats();
+  /**
+   * Return the number of frames of each EventType written so far.
+   */
+  const uint64_t* frame_counts() const { return frames_by_type; }
+
+  /**
+   * Don't let raw data refer to data written before the last segment end
+   * or snapshot, so that discard() can drop the trace before either.
+   */
+  void set_discardable() { discardable = true; }
+  /**
+   * Free the disk space taken by the trace from the segment end at |from|
+   * up to the snapshot at |to|, and delete the snapshots before |to|.
+   * Replay then replays up to |from| and continues from the snapshot.
+   */
+  void discard(TraceFrame::Time from, TraceFrame::Time to);
+
+  /**
+   * Record that the recording attached to a running process, so the
+   * trace starts with the snapshot of it at |time|.  Replay execs the
+   * process's image without the trace and restores that snapshot.
+   */
+  void set_attached(TraceFrame::Time time);
+
+  /**
+   * Save |len| bytes of mapped file data in the shared store, unless an
+   * identical copy is already there, and link the stored copy into this
+   * trace. Returns its file name in the trace directory, for
+   * TraceMappedRegion's |stored_file|. Each trace's link is a reference
+   * to the stored copy, so copies no trace links to have a link count of
+   * one; gc_shared_store() removes them.
+   */
+  string write_stored_copy(const void* data, size_t len);
+  /**
+   * Try to save the |len| bytes at |offset| of the file |path| (with
+   * metadata |st|) in this trace without reading them: hard-link the file
+   * if it's read-only and wholly copied, otherwise reflink the range.
+   * Returns the copy's file name in the trace directory, or an empty
+   * string if the filesystem doesn't support either.
+   */
+  string write_cloned_copy(const string& path, const struct stat& st,
+                           off64_t offset, size_t len);
+  /**
+   * Link the stored copy at |path| into this trace as |name|.
+   */
+  void link_stored_copy(const string& path, const string& name);
+
+  /**
+   * Remove the stored copies that no trace references any more. Adds the
+   * number of files and bytes removed to |files| and |bytes|. Returns
+   * false if the store couldn't be read.
+   */
+  static bool gc_shared_store(uint64_t* files, uint64_t* bytes);
 
 private:
+  void write_metadata_files();
+  void write_frame_now(const TraceFrame& frame);
+  void write_discarded_until(TraceFrame::Time time);
+
+  /**
+   * Write the data_header record for raw data 'data'. Returns false if the
+   * data is a duplicate and must not be written to |data|.
+   */
+  bool write_raw_header(const void* data, size_t len, remote_ptr<void> addr);
+
+  // Where the streams go instead of the trace directory, if non-null.
+  // The trace's other files are sent here too when the trace is closed.
+  std::shared_ptr<OutputSink> sink;
   // File that stores events (trace frames).
   CompressedWriter events;
   // Files that store raw data saved from tracees (|data|), and
@@ -139,6 +490,63 @@ private:
   // File that stores metadata about files mmap'd during
   // recording.
   CompressedWriter mmaps;
+  enum {
+    MIN_DEDUP_BYTES = 4096
+  };
+  struct RawDataKey {
+    Hash128 hash;
+    size_t len;
+    bool operator==(const RawDataKey& other) const {
+      return hash == other.hash && len == other.len;
+    }
+  };
+  struct RawDataKeyHasher {
+    size_t operator()(const RawDataKey& key) const { return key.hash.lo; }
+  };
+  // Offset in |data| of the first copy of each distinct large payload.
+  std::unordered_map<RawDataKey, uint64_t, RawDataKeyHasher> raw_data_offsets;
+  // The exec info of the last frame written for each tid since the last
+  // seek point.
+  ExecInfoMap last_exec_info;
+  // The encoding of the frame being written, so each frame goes to
+  // |events| with a single write.  Kept around to reuse its storage.
+  std::vector<uint8_t> frame_buf;
+  // The number of frames written of each EventType.
+  uint64_t frames_by_type[EV_LAST];
+  // The spans handed out by the last reserve_raw().
+  CompressedWriter::WriteSpan reserved_raw[2];
+  // Holds reserved data that wraps around the data buffer, for hashing.
+  std::vector<uint8_t> reserved_raw_scratch;
+  // Seek points written so far, plus the stream offsets at which the data
+  // for the next frame starts.
+  std::vector<SeekPoint> seek_points;
+  SeekPoint next_frame_start;
+  // False if seek points come only from add_seek_point().
+  bool automatic_seek_points;
+  // Number of write_cloned_copy() files, for naming them.
+  uint32_t cloned_copies;
+  // The names of the write_cloned_copy() files, by the device, inode,
+  // mtime, ctime and size of the file and the offset and length of the
+  // range, so that each range of a file that's mapped repeatedly is only
+  // cloned once.
+  typedef std::tuple<dev_t, ino_t, time_t, long, time_t, long, off64_t,
+                     off64_t, size_t> ClonedCopyKey;
+  std::map<ClonedCopyKey, string> cloned_copy_names;
+  // True if write_frame() folds consecutive EV_SCHED frames of a tid.
+  bool fold_sched_frames;
+  // The EV_SCHED frame write_frame() is holding back, if |has_held_frame|.
+  bool has_held_frame;
+  TraceFrame held_frame;
+  // Created by the first write_checksums().
+  std::unique_ptr<CompressedWriter> checksums;
+  // Opened by the first end_segment().
+  ScopedFd segments;
+  // Total offset of the streams at the last end_segment().
+  uint64_t segment_start_bytes;
+  // True after set_discardable().
+  bool discardable;
+  // Times of the snapshots written and not yet discarded.
+  std::vector<TraceFrame::Time> snapshots;
 };
 
 class TraceReader : public TraceStream {
@@ -166,6 +574,11 @@ public:
    */
   TraceMappedRegion read_mapped_region();
 
+  /**
+   * Return true if all mapped region descriptors have been read.
+   */
+  bool mapped_regions_at_end() const { return mmaps.at_end(); }
+
   /**
    * Read the next raw data record and return it.
    */
@@ -177,6 +590,13 @@ public:
    * false.
    */
   bool read_raw_data_for_frame(const TraceFrame& frame, RawData& d);
+  /**
+   * Discard the raw data records for 'frame' from the current point in
+   * the trace, without copying them out.
+   */
+  void skip_raw_data_for_frame(const TraceFrame& frame) {
+    skip_raw_data_before(frame.time() + 1);
+  }
 
   /**
    * Return true iff all trace files are "good".
@@ -185,9 +605,64 @@ public:
   bool good() const;
 
   /**
-   * Return true if we're at the end of the trace file.
+   * Read the checksums that were saved for task |tid| at |time|. Returns
+   * false if there are none.
+   */
+  bool read_checksums(TraceFrame::Time time, pid_t tid, uint32_t* kind,
+                      std::vector<MappingChecksum>* checksums);
+
+  /**
+   * Return the times of the ProcessSnapshots saved in this trace, in
+   * increasing order.
+   */
+  std::vector<TraceFrame::Time> snapshot_times() const;
+  /**
+   * Read the ProcessSnapshot for |time| into |snapshot|.  Returns false
+   * if there's none.
+   */
+  bool read_snapshot(TraceFrame::Time time, ProcessSnapshot* snapshot) const;
+  /**
+   * Save |snapshot|, taken by replay at the start of its |time| frame,
+   * in the trace, so that later replays can start from it as from the
+   * snapshots saved while recording.  Returns false if it couldn't be
+   * written.
+   */
+  bool write_snapshot(const ProcessSnapshot& snapshot) const;
+  /**
+   * Move the mapped regions stream to |offset|, a ProcessSnapshot's
+   * |mmaps_offset|.
    */
-  bool at_end() const { return events.at_end(); }
+  void seek_mapped_regions(uint64_t offset);
+  /**
+   * Return the offset of the next mapped region descriptor.
+   */
+  uint64_t mapped_regions_offset() const {
+    return mmaps.uncompressed_offset();
+  }
+  /**
+   * Return the time of the snapshot replay must start from because the
+   * trace before it was discarded while recording, or 0 if nothing was.
+   */
+  TraceFrame::Time discarded_until() const;
+  /**
+   * Return true if the recording attached to a running process; see
+   * TraceWriter::set_attached().
+   */
+  bool attached() const;
+
+  /**
+   * Return true if we're at the end of the trace file. The trace of a
+   * recording that was interrupted ends with its last finished segment.
+   */
+  bool at_end() const {
+    // A frame is only cached once the frame after it has been read.
+    if (served_frame) {
+      return false;
+    }
+    return events.at_end() ||
+           (!segments->empty() &&
+            events.uncompressed_offset() >= segments->back().events);
+  }
 
   /**
    * Return the next trace frame, without mutating any stream
@@ -198,24 +673,123 @@ public:
   /**
    * Peek ahead in the stream to find the next trace frame that
    * matches the requested parameters. Returns the frame if one
-   * was found, and issues a fatal error if not.
+   * was found, and issues a fatal error if not.  The frames passed on
+   * the way are indexed by tid, so later calls don't decode them again.
    */
   TraceFrame peek_to(pid_t pid, EventType type, SyscallEntryOrExit state);
 
+  /**
+   * Return the frame at |time| without changing the state of this, or a
+   * frame with time() 0 if there is no such frame. Decodes forward from
+   * the nearest seek point (or from the current position, if that's
+   * closer).
+   */
+  TraceFrame peek_frame_at(TraceFrame::Time time) const;
+
   /**
    * Restore the state of this to what it was just after
    * |open()|.
    */
   void rewind();
 
+  /**
+   * Keep up to |max_bytes| of the frames read and their raw data in
+   * memory, shared with the copies made of this from now on, so that
+   * reading the same frames again skips decompressing them.  The reader
+   * must keep the raw data stream.
+   */
+  void enable_frame_cache(size_t max_bytes);
+
+  /**
+   * Position the trace so that the next read_frame() returns the frame at
+   * |target_time| (or the end of the trace, if there's no such frame),
+   * without decompressing the trace data preceding the nearest seek point.
+   * Raw data of frames skipped over is discarded.  The mmaps stream is left
+   * at the nearest seek point at or before |target_time|, so callers that
+   * need mapped region records must not skip over mmap frames.  Returns
+   * false if |target_time| is before the current position and no seek
+   * points are available.
+   */
+  bool seek_to_time(TraceFrame::Time target_time);
+
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
 
+  /**
+   * The frames with global times in [start, end).
+   */
+  struct TimeRange {
+    TraceFrame::Time start;
+    TraceFrame::Time end;
+  };
+  /**
+   * Split the trace into at most |max_ranges| consecutive ranges covering
+   * the whole trace. Each range starts at a seek point, so ranges can be
+   * decoded independently of each other.
+   */
+  std::vector<TimeRange> split_time_ranges(size_t max_ranges) const;
+
+  typedef std::function<void(size_t range, const TraceFrame& frame,
+                             const std::vector<RawData>& raw_data)>
+      FrameVisitor;
+  /**
+   * Decode the ranges of split_time_ranges(|num_threads| * 4) on
+   * |num_threads| threads, each using its own reader, and call |visitor|
+   * with every frame and its raw data. The frames of a range are visited
+   * in trace order on one thread; different ranges are visited
+   * concurrently, so |visitor| must be thread-safe. |range| is the index
+   * of the frame's range, so callers can keep per-range state and combine
+   * it afterward. This reader's position is unaffected.
+   */
+  void visit_frames_parallel(uint32_t num_threads,
+                             const FrameVisitor& visitor) const;
+
+  /**
+   * Rewrite the trace's streams uncompressed, so that later readers of the
+   * trace map them instead of decompressing them. Returns false on error.
+   */
+  bool unpack();
+  /**
+   * Rewrite the trace's streams compressed with 'codec'. Returns false on
+   * error.
+   */
+  bool pack(CompressedWriter::Codec codec);
+
+  /**
+   * Rewrite the whole trace into the new trace directory |dir|, with raw
+   * data deduplicated over the whole trace and compressed with the
+   * current compression codec flag. Keeps the seek points of this trace.
+   * Rewinds this reader first and leaves it at the end.
+   */
+  bool compact(const string& dir);
+
+  /**
+   * Check that every stream of this trace is intact, as
+   * CompressedReader::verify() does, on |threads| threads, and that the
+   * seek points and segment ends lie within the streams. Appends a
+   * description of each problem found to |problems|.
+   */
+  void verify(uint32_t threads, std::vector<string>* problems) const;
+
+  /**
+   * The streams a reader can be limited to. Frames are always read.
+   */
+  enum Streams {
+    FRAMES_ONLY = 0,
+    // Raw data records, via read_raw_data() and friends.
+    RAW_DATA = 0x1,
+    // Mapped region descriptors, via read_mapped_region().
+    MAPPED_REGIONS = 0x2,
+    ALL_STREAMS = RAW_DATA | MAPPED_REGIONS
+  };
+
   /**
    * Open the trace in 'dir'. When 'dir' is the empty string, open the
-   * latest trace.
+   * latest trace. Only |streams| are kept in step with the frames read
+   * (by seek_to_time()) and decompressed ahead, so tools that don't need
+   * the raw data don't pay for it.
    */
-  TraceReader(const string& dir);
+  TraceReader(const string& dir, int streams = ALL_STREAMS);
 
   /**
    * Create a copy of this stream that has exactly the same
@@ -224,17 +798,68 @@ public:
    */
   TraceReader(const TraceReader& other)
       : TraceStream(other.dir(), other.time()),
+        segments(other.segments),
         events(other.events),
         data(other.data),
         data_header(other.data_header),
-        mmaps(other.mmaps) {
+        mmaps(other.mmaps),
+        data_refs(other.data_refs),
+        streams(other.streams),
+        seek_points(other.seek_points),
+        last_exec_info(other.last_exec_info),
+        frame_cache(other.frame_cache),
+        served_frame(other.served_frame),
+        served_raw_data(other.served_raw_data),
+        unread_ranges(other.unread_ranges),
+        unread_ranges_time(other.unread_ranges_time) {
     argv = other.argv;
     envp = other.envp;
     cwd = other.cwd;
     bind_to_cpu = other.bind_to_cpu;
+    extra_perf_counters = other.extra_perf_counters;
   }
 
 private:
+  /**
+   * Discard raw data records for frames before |target_time|.
+   */
+  void skip_raw_data_before(TraceFrame::Time target_time);
+  /**
+   * Set |time| to the time of the next raw data record not yet read.
+   * Returns false if there are none.
+   */
+  bool peek_raw_data_time(TraceFrame::Time* time);
+  /**
+   * Read the next data_header record and its data into |unread_ranges|.
+   */
+  void read_raw_record();
+
+  /**
+   * A frame and all its raw data, with the stream offsets following them.
+   */
+  struct CachedFrame {
+    TraceFrame frame;
+    std::vector<RawData> raw_data;
+    uint64_t events_end;
+    uint64_t data_end;
+    uint64_t data_header_end;
+    size_t bytes() const;
+  };
+  class FrameCache;
+  class PeekIndex;
+  /**
+   * Cache |pending_frame| if all its raw data was read.
+   */
+  void cache_pending_frame();
+  /**
+   * Position the streams after |served_frame|, if it's set.
+   */
+  void sync_streams();
+
+  // Loaded from segments_path() before the streams are opened, so that
+  // they hold the whole of every segment listed even if the recording is
+  // still going; shared between copies of this.
+  std::shared_ptr<const std::vector<SeekPoint> > segments;
   // File that stores events (trace frames).
   CompressedReader events;
   // Files that store raw data saved from tracees (|data|), and
@@ -244,6 +869,59 @@ private:
   // File that stores metadata about files mmap'd during
   // recording.
   CompressedReader mmaps;
+  // A second reader of |data|, used to fetch data that data_header records
+  // refer to by offset.
+  CompressedReader data_refs;
+  // The Streams this reader keeps up to date.
+  int streams;
+  /**
+   * Decode the frame following the frame at |time| from |events|, whose
+   * previous exec infos are |last_exec_info|.
+   */
+  static TraceFrame read_frame_from(CompressedReader& events,
+                                    TraceFrame::Time time,
+                                    ExecInfoMap& last_exec_info);
+  /**
+   * Copy the mapped region records before offset |end| of |mmaps| to
+   * |out|.
+   */
+  void copy_mapped_regions(TraceWriter& out, uint64_t end);
+  /**
+   * Return the SeekPoints in the file at |path|, or none if it's missing
+   * or malformed.
+   */
+  static std::shared_ptr<const std::vector<SeekPoint> > read_seek_points(
+      const string& path);
+  /**
+   * Return the last seek point at or before |time|, or null.
+   */
+  const SeekPoint* seek_point_before(TraceFrame::Time time) const;
+
+  // Loaded from seek_points_path(); shared between copies of this.
+  std::shared_ptr<const std::vector<SeekPoint> > seek_points;
+  // The exec info of the last frame read for each tid; see
+  // TraceWriter::last_exec_info.
+  ExecInfoMap last_exec_info;
+  // Opened by read_checksums(). Not shared with copies of this, which
+  // open their own when they need it.
+  std::unique_ptr<CompressedReader> checksums;
+  // Shared between copies of this, or null.
+  std::shared_ptr<FrameCache> frame_cache;
+  // The last frame read, if it was decoded, while its raw data is read.
+  // Not shared with copies of this.
+  std::shared_ptr<CachedFrame> pending_frame;
+  // The last frame read, if it came from |frame_cache|.  Reading it
+  // doesn't move the streams, so until sync_streams() they're still where
+  // the last decoded frame left them.
+  std::shared_ptr<const CachedFrame> served_frame;
+  // The number of |served_frame|'s raw data records read.
+  size_t served_raw_data;
+  // The ranges of the last RAW_DATA_MULTI record read that haven't been
+  // returned by read_raw_data() yet, and the record's time.
+  std::deque<RawData> unread_ranges;
+  TraceFrame::Time unread_ranges_time;
+  // The frames peek_to() has read ahead.  Not shared with copies of this.
+  std::shared_ptr<PeekIndex> peek_index;
 };
 
 #endif /* RR_TRACE_H_ */
@@ -0,0 +1,174 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "WriteIndex"
+
+#include "WriteIndex.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "ReplaySession.h"
+#include "ScopedFd.h"
+#include "TraceStream.h"
+#include "log.h"
+
+using namespace std;
+
+static const char INDEX_FILE[] = "write_index";
+static const char INDEX_MAGIC[8] = "rrwidx1";
+
+struct IndexHeader {
+  char magic[8];
+  uint64_t num_entries;
+};
+
+static_assert(sizeof(WriteIndex::Entry) == 32,
+              "Index entries are written as they're laid out in memory");
+
+// How many entries a query reads back at once.
+static const size_t QUERY_BATCH = 256;
+
+void WriteIndex::add(const TraceFrame& frame, pid_t tid,
+                     remote_ptr<void> addr, size_t len) {
+  if (addr.is_null() || len == 0) {
+    return;
+  }
+  uint64_t start = addr.as_int();
+  uint64_t end = start + len;
+  if (ranges.empty()) {
+    add_range(frame, tid, start, end);
+    return;
+  }
+  for (auto& r : ranges) {
+    uint64_t s = max(start, r.start);
+    uint64_t e = min(end, r.end);
+    if (s < e) {
+      add_range(frame, tid, s, e);
+    }
+  }
+}
+
+void WriteIndex::add_range(const TraceFrame& frame, pid_t tid,
+                           uint64_t start, uint64_t end) {
+  while (start < end) {
+    uint64_t page_end = (start / INDEX_PAGE_SIZE + 1) * INDEX_PAGE_SIZE;
+    Entry e;
+    e.start = start;
+    e.end = min(end, page_end);
+    e.ticks = frame.ticks();
+    e.time = frame.time();
+    e.tid = tid;
+    entries.push_back(e);
+    start = e.end;
+  }
+}
+
+bool WriteIndex::save(const TraceReader& trace) {
+  // Entries were added in replay order, which the stable sort keeps
+  // among the writes to a page during one frame.
+  stable_sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) {
+    return a.page() < b.page() || (a.page() == b.page() && a.time < b.time);
+  });
+
+  string path = trace.trace_file_path(INDEX_FILE);
+  ScopedFd fd(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (!fd.is_open()) {
+    LOG(error) << "Can't create " << path;
+    return false;
+  }
+  IndexHeader header;
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.num_entries = entries.size();
+  ssize_t bytes = entries.size() * sizeof(Entry);
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, entries.data(), bytes) != bytes) {
+    LOG(error) << "Can't write " << path;
+    unlink(path.c_str());
+    return false;
+  }
+  return true;
+}
+
+/* static */ bool WriteIndex::build(const string& trace_dir,
+                                    const vector<Range>& ranges,
+                                    size_t* num_entries) {
+  WriteIndex index(ranges);
+  auto session = ReplaySession::create(trace_dir);
+  session->set_write_index(&index);
+  while (session->fast_forward(numeric_limits<TraceFrame::Time>::max()) ==
+         ReplaySession::REPLAY_CONTINUE) {
+  }
+  LOG(info) << "Indexed " << index.size() << " writes";
+  *num_entries = index.size();
+  return index.save(session->trace_reader());
+}
+
+static bool read_entries(int fd, uint64_t first, size_t count,
+                         WriteIndex::Entry* entries) {
+  ssize_t bytes = count * sizeof(WriteIndex::Entry);
+  return pread(fd, entries, bytes, sizeof(IndexHeader) +
+                                       first * sizeof(WriteIndex::Entry)) ==
+         bytes;
+}
+
+/* static */ bool WriteIndex::query(const TraceReader& trace,
+                                    remote_ptr<void> addr,
+                                    TraceFrame::Time time, size_t count,
+                                    vector<Entry>* writes) {
+  writes->clear();
+  ScopedFd fd(trace.trace_file_path(INDEX_FILE).c_str(),
+              O_RDONLY | O_CLOEXEC);
+  IndexHeader header;
+  if (!fd.is_open() ||
+      read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic))) {
+    return false;
+  }
+
+  // Find the first entry after the writes to |addr|'s page at or before
+  // |time|.
+  uint64_t page = addr.as_int() / INDEX_PAGE_SIZE;
+  uint64_t lo = 0;
+  uint64_t hi = header.num_entries;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    Entry e;
+    if (!read_entries(fd, mid, 1, &e)) {
+      return false;
+    }
+    if (e.page() < page || (e.page() == page && e.time <= time)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  // Walk back through the page's entries for those covering |addr|.
+  Entry batch[QUERY_BATCH];
+  uint64_t end = lo;
+  while (end > 0 && writes->size() < count) {
+    size_t n = min<uint64_t>(end, QUERY_BATCH);
+    if (!read_entries(fd, end - n, n, batch)) {
+      return false;
+    }
+    for (size_t i = n; i > 0; --i) {
+      const Entry& e = batch[i - 1];
+      if (e.page() != page) {
+        return true;
+      }
+      if (e.start <= addr.as_int() && addr.as_int() < e.end) {
+        writes->push_back(e);
+        if (writes->size() == count) {
+          return true;
+        }
+      }
+    }
+    end -= n;
+  }
+  return true;
+}
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_WRITE_INDEX_H_
+#define RR_WRITE_INDEX_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "Ticks.h"
+#include "TraceFrame.h"
+#include "remote_ptr.h"
+
+class TraceReader;
+
+/**
+ * WriteIndex answers "which event last wrote this address?" for the
+ * recorded data replay writes into tracee memory (syscall outputs,
+ * syscallbuf flushes, signal frames, mapped file contents ...) without
+ * replaying the trace again.
+ *
+ * `rr index-writes` replays the trace once, its ReplaySession passing
+ * every recorded write to |add()|, and saves the index to the trace's
+ * "write_index" file.  The file is an array of fixed-size Entries,
+ * split at INDEX_PAGE_SIZE boundaries and sorted by page and then by
+ * time, so a query is a binary search of the file for the address's
+ * page followed by one read of the entries before the query time.
+ */
+class WriteIndex {
+public:
+  enum { INDEX_PAGE_SIZE = 4096 };
+
+  struct Range {
+    Range(uint64_t start, uint64_t end) : start(start), end(end) {}
+    uint64_t start;
+    uint64_t end;
+  };
+
+  struct Entry {
+    // The bytes [start, end) were written, all within one index page.
+    uint64_t start;
+    uint64_t end;
+    // The ticks and time of the frame being replayed when they were.
+    Ticks ticks;
+    TraceFrame::Time time;
+    // The recorded tid of the task written to.
+    pid_t tid;
+
+    uint64_t page() const { return start / INDEX_PAGE_SIZE; }
+  };
+
+  /**
+   * Index only the writes overlapping |ranges|, or all of them when
+   * it's empty.
+   */
+  WriteIndex(const std::vector<Range>& ranges) : ranges(ranges) {}
+
+  /**
+   * Note that the |len| bytes at |addr| of |tid| were written while
+   * replaying |frame|.
+   */
+  void add(const TraceFrame& frame, pid_t tid, remote_ptr<void> addr,
+           size_t len);
+
+  /**
+   * Sort the index and write it to |trace|'s index file.  Returns false
+   * if that fails.
+   */
+  bool save(const TraceReader& trace);
+  size_t size() const { return entries.size(); }
+
+  /**
+   * Replay |trace_dir| and save the index of the writes overlapping
+   * |ranges| (all of them when it's empty).  Returns false if it can't
+   * be saved; |num_entries| is set to its size.
+   */
+  static bool build(const std::string& trace_dir,
+                    const std::vector<Range>& ranges, size_t* num_entries);
+
+  /**
+   * Set |writes| to the (up to) |count| last writes covering |addr| made
+   * at or before event |time|, latest first.  Returns false if |trace|
+   * has no readable index.
+   */
+  static bool query(const TraceReader& trace, remote_ptr<void> addr,
+                    TraceFrame::Time time, size_t count,
+                    std::vector<Entry>* writes);
+
+private:
+  void add_range(const TraceFrame& frame, pid_t tid, uint64_t start,
+                 uint64_t end);
+
+  std::vector<Range> ranges;
+  std::vector<Entry> entries;
+};
+
+#endif /* RR_WRITE_INDEX_H_ */
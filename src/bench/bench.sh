@@ -0,0 +1,79 @@
+#
+# Measure the overhead of recording and replaying standard workloads.
+#
+#  bash bench.sh <build-dir> [workload ...]
+#
+# runs each workload (all of them by default) natively, under |rr
+# record| and under |rr replay -a|, and prints one line of JSON per
+# workload to stdout:
+#
+#  { "workload": "syscall_storm", "native_s": 0.05, "record_s": 1.2,
+#    "replay_s": 0.9, "trace_bytes": 123456, "frames": 200012,
+#    "events_per_s": 166676 }
+#
+# Set $RECORD_ARGS to pass extra arguments to |rr record|, e.g. to
+# compare scheduler or syscallbuf configurations.  Progress and errors
+# go to stderr.
+#
+
+WORKLOADS="syscall_storm thread_storm mmap_churn signal_flood fork_exec big_io"
+
+bin_dir=$1
+shift
+if [[ -z "$bin_dir" ]]; then
+    echo "Usage: bench.sh <build-dir> [workload ...]" >&2
+    exit 1
+fi
+if [[ $# -gt 0 ]]; then
+    WORKLOADS="$@"
+fi
+bench_dir=$(cd `dirname $0` && pwd)
+rr="$bin_dir/bin/rr"
+work_dir=`mktemp -d /tmp/rr-bench-XXXXXX`
+trap "rm -rf $work_dir" EXIT
+
+function now { date +%s.%N; }
+function elapsed { start=$1; end=$2
+    awk "BEGIN { printf \"%.3f\", $end - $start }"
+}
+
+# run_timed <command...>
+#
+# Run the command with its output discarded and print how long it took,
+# or fail if it failed.
+function run_timed {
+    start=`now`
+    "$@" > $work_dir/out 2>&1 || return 1
+    elapsed $start `now`
+}
+
+failed=0
+for workload in $WORKLOADS; do
+    if [[ -f "$bench_dir/$workload.sh" ]]; then
+        cmd="bash $bench_dir/$workload.sh"
+    else
+        cmd="$bin_dir/bin/bench_$workload"
+    fi
+    echo "Running $workload ..." >&2
+
+    rm -rf $work_dir/trace
+    mkdir $work_dir/trace
+    native=`run_timed $cmd` &&
+    record=`_RR_TRACE_DIR=$work_dir/trace run_timed $rr record $RECORD_ARGS $cmd` &&
+    trace=`readlink -f $work_dir/trace/latest-trace` &&
+    replay=`run_timed $rr replay -a $trace`
+    if [[ $? -ne 0 ]]; then
+        echo "  $workload failed:" >&2
+        cat $work_dir/out >&2
+        failed=1
+        continue
+    fi
+    trace_bytes=`du -sb $trace | cut -f1`
+    frames=`$rr dump -s $trace 0-0 | sed -n 's,^// Frames \([0-9]*\).*,\1,p'`
+    events_per_s=`awk "BEGIN { printf \"%d\", $record > 0 ? $frames / $record : 0 }"`
+    echo "{ \"workload\": \"$workload\", \"native_s\": $native," \
+         "\"record_s\": $record, \"replay_s\": $replay," \
+         "\"trace_bytes\": $trace_bytes, \"frames\": $frames," \
+         "\"events_per_s\": $events_per_s }"
+done
+exit $failed
@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Write a big file and read it back, in large chunks. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE (1 << 20)
+
+int main(int argc, char* argv[]) {
+  int megabytes = argc > 1 ? atoi(argv[1]) : 256;
+  char path[] = "/tmp/rr-bench-big-io-XXXXXX";
+  char* buf = malloc(CHUNK_SIZE);
+  int fd = mkstemp(path);
+  int i;
+
+  if (fd < 0 || !buf) {
+    return 1;
+  }
+  unlink(path);
+  memset(buf, 'x', CHUNK_SIZE);
+  for (i = 0; i < megabytes; ++i) {
+    if (write(fd, buf, CHUNK_SIZE) != CHUNK_SIZE) {
+      return 1;
+    }
+  }
+  lseek(fd, 0, SEEK_SET);
+  for (i = 0; i < megabytes; ++i) {
+    if (read(fd, buf, CHUNK_SIZE) != CHUNK_SIZE) {
+      return 1;
+    }
+  }
+  return 0;
+}
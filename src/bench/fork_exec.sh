@@ -0,0 +1,8 @@
+# A shell script that, like configure scripts and make, spends its time
+# forking and execing short-lived processes.
+
+iterations=${1:-200}
+for i in `seq 1 $iterations`; do
+    /bin/true
+    echo $i | cat > /dev/null
+done
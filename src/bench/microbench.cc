@@ -0,0 +1,299 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/**
+ * Microbenchmarks for rr's core data structures and trace I/O layers,
+ * run in isolation on synthetic inputs, without tracees:
+ *
+ *  rr_microbench [benchmark ...]
+ *
+ * runs each benchmark (all of them by default) and prints one line of
+ * JSON per benchmark to stdout:
+ *
+ *  { "benchmark": "frame_write", "ops": 1000000, "median_s": 1.2,
+ *    "ops_per_s": 833333 }
+ *
+ * Each benchmark is run REPEATS times on the same input and the median
+ * time is reported, so numbers are comparable from one build to the
+ * next.  Scratch files go in a temporary directory under $TMPDIR.
+ *
+ * The scheduler isn't covered: its decisions wait on and inspect live
+ * tracees.  The "bench" target's thread_storm workload measures it.
+ */
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../AddressSpace.h"
+#include "../CompressedReader.h"
+#include "../CompressedWriter.h"
+#include "../Flags.h"
+#include "../Session.h"
+#include "../TraceStream.h"
+#include "../util.h"
+
+using namespace std;
+
+static const int REPEATS = 5;
+
+// The size of the compressed stream written and read back.
+static const size_t STREAM_BYTES = 64 * 1024 * 1024;
+static const size_t STREAM_WRITE_SIZE = 4096;
+static const size_t STREAM_BLOCK_SIZE = 1024 * 1024;
+static const uint32_t STREAM_THREADS = 2;
+
+// The number of frames written and read back.
+static const uint32_t NUM_FRAMES = 1000000;
+// The number of tids the frames are spread over.
+static const pid_t NUM_FRAME_TIDS = 16;
+
+// The number of mappings made in one address space.
+static const size_t NUM_MAPPINGS = 10000;
+
+static string scratch_dir;
+
+/**
+ * Run |body|, which does |ops| operations, REPEATS times and print its
+ * median time as |name|'s result.  |setup| is run untimed before each
+ * repeat.
+ */
+static void measure(const char* name, uint64_t ops,
+                    const function<void()>& setup,
+                    const function<void()>& body) {
+  vector<double> times;
+  for (int i = 0; i < REPEATS; ++i) {
+    setup();
+    double start = now_sec();
+    body();
+    times.push_back(now_sec() - start);
+  }
+  sort(times.begin(), times.end());
+  double median = times[REPEATS / 2];
+  printf("{ \"benchmark\": \"%s\", \"ops\": %llu, \"median_s\": %.6f, "
+         "\"ops_per_s\": %.0f }\n",
+         name, (unsigned long long)ops, median, ops / median);
+  fflush(stdout);
+}
+
+static void nothing() {}
+
+/**
+ * Fill |buf| with bytes that compress about as well as trace data: runs
+ * of small counters and a sprinkling of pseudo-random words.
+ */
+static void fill_synthetic(vector<uint8_t>& buf, uint32_t seed) {
+  uint32_t x = seed * 2654435761U + 1;
+  for (size_t i = 0; i < buf.size(); i += sizeof(uint32_t)) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    uint32_t word = (i / 64) % 8 ? uint32_t(i / 4096) : x;
+    memcpy(&buf[i], &word, min(sizeof(word), buf.size() - i));
+  }
+}
+
+static void bench_compressed_stream() {
+  string path = scratch_dir + "/stream";
+  vector<uint8_t> chunk(STREAM_WRITE_SIZE);
+  fill_synthetic(chunk, 1);
+  CompressedWriter::Codec codec =
+      (CompressedWriter::Codec)Flags::get().compression_codec;
+
+  // Streams are created exclusively.
+  auto remove_stream = [&]() { unlink(path.c_str()); };
+  measure("compressed_write", STREAM_BYTES, remove_stream, [&]() {
+    CompressedWriter writer(path, STREAM_BLOCK_SIZE, STREAM_THREADS, codec);
+    for (size_t i = 0; i < STREAM_BYTES; i += chunk.size()) {
+      writer.write(chunk.data(), chunk.size());
+    }
+    writer.close();
+    if (!writer.good()) {
+      fprintf(stderr, "Writing %s failed\n", path.c_str());
+      exit(1);
+    }
+  });
+  measure("compressed_read", STREAM_BYTES, nothing, [&]() {
+    CompressedReader reader(path);
+    for (size_t i = 0; i < STREAM_BYTES; i += chunk.size()) {
+      if (!reader.read(chunk.data(), chunk.size())) {
+        fprintf(stderr, "Reading %s failed\n", path.c_str());
+        exit(1);
+      }
+    }
+  });
+  unlink(path.c_str());
+}
+
+/**
+ * A session that owns address spaces but no tasks.
+ */
+class BenchSession : public Session {};
+
+/**
+ * Return a new empty address space of |session|.  create_vm() adds the
+ * task it's given to the space it creates, and the null task can't be
+ * removed again, so that space is kept for the whole run and cloned.
+ */
+static AddressSpace::shr_ptr new_vm(BenchSession& session) {
+  static AddressSpace::shr_ptr* origin =
+      new AddressSpace::shr_ptr(session.create_vm(nullptr, "bench"));
+  return session.clone(*origin);
+}
+
+static void bench_address_space() {
+  static BenchSession session;
+  size_t page = page_size();
+  // Leave a hole after each mapping and alternate the protection, so
+  // neighbouring mappings are never coalesced.
+  auto addr = [page](size_t i) {
+    return remote_ptr<void>(0x10000000 + i * 4 * page);
+  };
+  AddressSpace::shr_ptr vm;
+  auto fresh_vm = [&]() { vm = new_vm(session); };
+
+  measure("address_space_map", NUM_MAPPINGS, fresh_vm, [&]() {
+    for (size_t i = 0; i < NUM_MAPPINGS; ++i) {
+      vm->map(addr(i), 2 * page, i % 2 ? PROT_READ : PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, 0, MappableResource::anonymous());
+    }
+  });
+
+  auto mapped_vm = [&]() {
+    fresh_vm();
+    for (size_t i = 0; i < NUM_MAPPINGS; ++i) {
+      vm->map(addr(i), 2 * page, i % 2 ? PROT_READ : PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, 0, MappableResource::anonymous());
+    }
+  };
+  // Each protect splits a mapping in two.
+  measure("address_space_protect", NUM_MAPPINGS, mapped_vm, [&]() {
+    for (size_t i = 0; i < NUM_MAPPINGS; ++i) {
+      vm->protect(addr(i), page, PROT_NONE);
+    }
+  });
+  measure("address_space_unmap", NUM_MAPPINGS, mapped_vm, [&]() {
+    for (size_t i = 0; i < NUM_MAPPINGS; ++i) {
+      vm->unmap(addr(i), 2 * page);
+    }
+  });
+  vm = nullptr;
+}
+
+/**
+ * Return the |i|th synthetic frame, for |time|: syscall entries and exits spread
+ * over a few tids, with registers that change a little from frame to
+ * frame the way real ones do.
+ */
+static TraceFrame synthetic_frame(TraceFrame::Time time, uint32_t i) {
+  EncodedEvent ev;
+  ev.encoded = 0;
+  ev.type = EV_SYSCALL;
+  ev.state = i % 2 ? SYSCALL_EXIT : SYSCALL_ENTRY;
+  ev.has_exec_info = HAS_EXEC_INFO;
+  ev.arch_ = Registers().arch();
+  ev.data = (i / 2) % 300;
+  pid_t tid = 1000 + (i / 2) % NUM_FRAME_TIDS;
+  TraceFrame frame(time, tid, ev);
+  Registers regs;
+  regs.set_ip(0x400000 + (i / 2) % 4096 * 16);
+  regs.set_sp(0x7ff000000000ULL - tid * 0x100000);
+  regs.set_syscall_result(i % 2 ? i : 0);
+  frame.set_exec_info(uint64_t(i) * 1000, regs, nullptr, nullptr);
+  return frame;
+}
+
+static void bench_frames() {
+  vector<string> argv;
+  argv.push_back("bench");
+  string trace_dir;
+
+  measure("frame_write", NUM_FRAMES, nothing, [&]() {
+    TraceWriter writer(argv, vector<string>(), "/", -1);
+    for (uint32_t i = 0; i < NUM_FRAMES; ++i) {
+      writer.write_frame(synthetic_frame(writer.time(), i));
+    }
+    writer.close();
+    trace_dir = writer.dir();
+  });
+  measure("frame_read", NUM_FRAMES, nothing, [&]() {
+    TraceReader reader(trace_dir, TraceReader::FRAMES_ONLY);
+    uint32_t frames = 0;
+    while (!reader.at_end()) {
+      reader.read_frame();
+      ++frames;
+    }
+    if (frames != NUM_FRAMES) {
+      fprintf(stderr, "Read %u frames, expected %u\n", frames, NUM_FRAMES);
+      exit(1);
+    }
+  });
+}
+
+static int remove_entry(const char* path, const struct stat*, int,
+                        struct FTW*) {
+  return remove(path);
+}
+
+struct Benchmark {
+  const char* name;
+  void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+  { "compressed_stream", bench_compressed_stream },
+  { "address_space", bench_address_space },
+  { "frames", bench_frames },
+};
+
+static const Benchmark* find_benchmark(const char* name) {
+  for (auto& b : benchmarks) {
+    if (!strcmp(name, b.name)) {
+      return &b;
+    }
+  }
+  return nullptr;
+}
+
+int main(int argc, char* argv[]) {
+  vector<const Benchmark*> selected;
+  for (int i = 1; i < argc; ++i) {
+    const Benchmark* b = find_benchmark(argv[i]);
+    if (!b) {
+      fprintf(stderr, "Unknown benchmark %s\n", argv[i]);
+      return 1;
+    }
+    selected.push_back(b);
+  }
+  if (selected.empty()) {
+    for (auto& b : benchmarks) {
+      selected.push_back(&b);
+    }
+  }
+
+  const char* tmp = getenv("TMPDIR");
+  string dir_template = string(tmp ? tmp : "/tmp") + "/rr-microbench-XXXXXX";
+  vector<char> dir_buf(dir_template.begin(), dir_template.end());
+  dir_buf.push_back('\0');
+  if (!mkdtemp(dir_buf.data())) {
+    fprintf(stderr, "Can't create %s\n", dir_template.c_str());
+    return 1;
+  }
+  scratch_dir = dir_buf.data();
+  // Traces are written under the scratch directory.
+  setenv("_RR_TRACE_DIR", scratch_dir.c_str(), 1);
+
+  for (auto b : selected) {
+    b->run();
+  }
+
+  nftw(scratch_dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
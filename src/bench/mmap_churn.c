@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Map, touch, reprotect and unmap memory over and over, in an address
+ * space with lots of mappings. */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define NUM_MAPPINGS 256
+#define MAPPING_PAGES 16
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t len = MAPPING_PAGES * page_size;
+  char* maps[NUM_MAPPINGS] = { 0 };
+  int i;
+
+  for (i = 0; i < iterations; ++i) {
+    int slot = i % NUM_MAPPINGS;
+    if (maps[slot]) {
+      munmap(maps[slot], len);
+    }
+    maps[slot] = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (maps[slot] == MAP_FAILED) {
+      return 1;
+    }
+    maps[slot][(i % MAPPING_PAGES) * page_size] = (char)i;
+    mprotect(maps[slot] + page_size, page_size, PROT_READ);
+  }
+  return 0;
+}
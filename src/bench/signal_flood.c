@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Deliver lots of synchronous and asynchronous signals to a handler. */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t caught;
+
+static void handler(int sig) { ++caught; }
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  struct sigaction sa;
+  pid_t parent = getpid();
+  pid_t child;
+  int status;
+  int i;
+
+  sa.sa_handler = handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+
+  for (i = 0; i < iterations; ++i) {
+    raise(SIGUSR1);
+  }
+
+  child = fork();
+  if (0 == child) {
+    for (i = 0; i < iterations; ++i) {
+      kill(parent, SIGUSR2);
+    }
+    return 0;
+  }
+  while (waitpid(child, &status, 0) < 0) {
+  }
+  return caught >= iterations ? 0 : 1;
+}
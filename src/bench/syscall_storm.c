@@ -0,0 +1,22 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Many small syscalls, both ones the syscallbuf handles and ones that
+ * always stop in rr. */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  int fd = open("/dev/zero", O_RDONLY);
+  char buf[64];
+  int i;
+
+  for (i = 0; i < iterations; ++i) {
+    read(fd, buf, sizeof(buf));
+    syscall(SYS_getpgid, 0);
+  }
+  return 0;
+}
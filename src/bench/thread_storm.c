@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Many threads contending for a lock and making syscalls. */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NUM_THREADS 16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int iterations;
+static long counter;
+
+static void* thread(void* arg) {
+  int i;
+
+  for (i = 0; i < iterations; ++i) {
+    pthread_mutex_lock(&lock);
+    ++counter;
+    pthread_mutex_unlock(&lock);
+    if (i % 16 == 0) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  pthread_t threads[NUM_THREADS];
+  int i;
+
+  iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  for (i = 0; i < NUM_THREADS; ++i) {
+    pthread_create(&threads[i], NULL, thread, NULL);
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  return counter == (long)NUM_THREADS * iterations ? 0 : 1;
+}
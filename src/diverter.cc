@@ -20,6 +20,14 @@ static DiversionSession::shr_ptr session;
 // dying.
 static int diversion_refcount;
 
+// A dying diversion is kept for the next diversion from the replay
+// session it was cloned from, as long as that replay session hasn't
+// moved on: gdb evaluating several expressions at a stop would
+// otherwise deep-fork the replay for each of them.  This is the
+// ReplaySession::state_id() it was cloned at, or 0 if |session| isn't
+// kept.
+static uint64_t kept_for_state_id;
+
 /**
  * Process debugger requests made through |dbg| until action needs to
  * be taken by the caller (a resume-execution request is received).
@@ -32,6 +40,12 @@ static Task* process_debugger_requests(GdbContext* dbg, Task* t,
   while (true) {
     *req = dbg->get_request();
 
+    if (req->is_reverse_request()) {
+      // A diversion has no history to run back through.  Abandon
+      // it and let the replay session handle the request.
+      diversion_refcount = 0;
+      return nullptr;
+    }
     if (req->is_resume_request()) {
       if (diversion_refcount == 0) {
         return nullptr;
@@ -43,6 +57,12 @@ static Task* process_debugger_requests(GdbContext* dbg, Task* t,
       case DREQ_RESTART:
         return nullptr;
 
+      case DREQ_DETACH:
+        // The replay session handles detaching, which a replay server
+        // survives.
+        diversion_refcount = 0;
+        return nullptr;
+
       case DREQ_READ_SIGINFO: {
         LOG(debug) << "Adding ref to diversion session";
         ++diversion_refcount;
@@ -102,12 +122,43 @@ static GdbThreadId get_threadid(Task* t) {
   return thread;
 }
 
+/**
+ * Return true if the diversion ended with |req| can be kept for reuse.
+ * Requests that resume or replace the replay session make it stale.
+ */
+static bool can_keep_diversion_for(const GdbRequest& req) {
+  return !req.is_resume_request() && req.type != DREQ_RESTART &&
+         req.type != DREQ_DETACH;
+}
+
+/**
+ * Make the kept diversion session look like a fresh clone of the
+ * replay session again, as far as the debugger can tell.
+ */
+static void reset_kept_diversion() {
+  for (auto vm : session->vms()) {
+    // Like ReplaySession::copy_state_to(), start without the
+    // debugger's breakpoints.
+    vm->destroy_all_breakpoints();
+    vm->destroy_all_watchpoints();
+  }
+}
+
 void divert(ReplaySession& replay, GdbContext* dbg, pid_t task,
             GdbRequest* req) {
   LOG(debug) << "Starting debugging diversion for " << &replay;
-  assert(!session && diversion_refcount == 0);
+  assert(diversion_refcount == 0);
 
-  session = replay.clone_diversion();
+  if (session && kept_for_state_id == replay.state_id()) {
+    LOG(debug) << "  reusing diversion session " << session.get();
+    reset_kept_diversion();
+  } else {
+    if (session) {
+      session->kill_all_tasks();
+    }
+    session = replay.clone_diversion();
+  }
+  kept_for_state_id = 0;
   diversion_refcount = 1;
 
   Task* t = session->find_task(task);
@@ -148,11 +199,17 @@ void divert(ReplaySession& replay, GdbContext* dbg, pid_t task,
     /* Notify the debugger and process any new requests
      * that might have triggered before resuming. */
     dbg->notify_stop(get_threadid(result.break_status.task), sig,
-                     watch_addr.as_int());
+                     watch_addr.as_int(),
+                     get_expedited_regs(result.break_status.task));
   }
 
   LOG(debug) << "... ending debugging diversion";
   assert(diversion_refcount == 0);
+  if (!session->tasks().empty() && can_keep_diversion_for(*req)) {
+    LOG(debug) << "  keeping it for reuse";
+    kept_for_state_id = replay.state_id();
+    return;
+  }
   session->kill_all_tasks();
   session = nullptr;
 }
@@ -43,6 +43,10 @@ class ReplaySession;
  * request made that wasn't handled by the diversion session.  That
  * is, the first request that should be handled by |replay| upon
  * resuming execution in that session.
+ *
+ * A diversion that ends without |replay| being resumed is kept, and
+ * reused by the next divert() from |replay| as long as |replay| is
+ * still in the same state, instead of cloning |replay| again.
  */
 void divert(ReplaySession& replay, GdbContext* dbg, pid_t task,
             GdbRequest* req);
@@ -77,13 +77,51 @@ struct drm_i915_gem_mmap {
   __u64 addr_ptr;
 };
 
+struct drm_i915_gem_relocation_entry {
+  __u32 target_handle;
+  __u32 delta;
+  __u64 offset;
+  __u64 presumed_offset;
+  __u32 read_domains;
+  __u32 write_domain;
+};
+
+struct drm_i915_gem_exec_object2 {
+  __u32 handle;
+  __u32 relocation_count;
+  __u64 relocs_ptr;
+  __u64 alignment;
+  __u64 offset;
+  __u64 flags;
+  __u64 rsvd1;
+  __u64 rsvd2;
+};
+
+struct drm_i915_gem_execbuffer2 {
+  __u64 buffers_ptr;
+  __u32 buffer_count;
+  __u32 batch_start_offset;
+  __u32 batch_len;
+  __u32 DR1;
+  __u32 DR4;
+  __u32 num_cliprects;
+  __u64 cliprects_ptr;
+  __u64 flags;
+  __u64 rsvd1;
+  __u64 rsvd2;
+};
+
 #define DRM_I915_GEM_PWRITE 0x1d
 #define DRM_I915_GEM_MMAP 0x1e
+#define DRM_I915_GEM_EXECBUFFER2 0x29
 
 #define DRM_IOCTL_I915_GEM_PWRITE                                              \
   DRM_IOW(DRM_COMMAND_BASE + DRM_I915_GEM_PWRITE, struct drm_i915_gem_pwrite)
 #define DRM_IOCTL_I915_GEM_MMAP                                                \
   DRM_IOWR(DRM_COMMAND_BASE + DRM_I915_GEM_MMAP, struct drm_i915_gem_mmap)
+#define DRM_IOCTL_I915_GEM_EXECBUFFER2                                         \
+  DRM_IOW(DRM_COMMAND_BASE + DRM_I915_GEM_EXECBUFFER2,                         \
+          struct drm_i915_gem_execbuffer2)
 
 /*---------------------------------------------------------------------------*/
 struct drm_nouveau_gem_info {
@@ -146,6 +184,14 @@ struct drm_radeon_gem_get_tiling {
   uint32_t pitch;
 };
 
+// The |drm_radeon_info.request|s whose value isn't a single 32-bit word.
+#define RADEON_INFO_TIMESTAMP 0x12
+#define RADEON_INFO_SI_TILE_MODE_ARRAY 0x17
+#define RADEON_INFO_CIK_MACROTILE_MODE_ARRAY 0x19
+#define RADEON_INFO_NUM_BYTES_MOVED 0x1e
+#define RADEON_INFO_VRAM_USAGE 0x1f
+#define RADEON_INFO_GTT_USAGE 0x20
+
 #define DRM_RADEON_INFO 0x27
 #define DRM_RADEON_GEM_CREATE 0x1d
 #define DRM_RADEON_GEM_GET_TILING 0x29
@@ -22,41 +22,29 @@ def write_syscall_enum(f, arch):
     f.write("};\n")
     f.write("\n")
 
-def write_is_always_emulated_syscall(f):
-    semantics_to_retval = { syscalls.ReplaySemantics.EMU: 'true',
-                            syscalls.ReplaySemantics.EXEC: 'false',
-                            syscalls.ReplaySemantics.EXEC_RET_EMU: 'false',
-                            syscalls.ReplaySemantics.MAY_EXEC: 'false' }
-
-    f.write("template <typename Arch> static bool is_always_emulated_syscall_arch(int syscall);\n");
-    f.write("\n");
+def write_syscall_info_tables(f):
     for specializer, arch in [("X86Arch", "x86"), ("X64Arch", "x64")]:
-        f.write("template<> bool is_always_emulated_syscall_arch<%s>(int syscallno) {\n" % specializer)
-        f.write("  switch (syscallno) {\n")
-        for name, obj in syscalls.all():
-            f.write("    case %s::%s: return %s;\n"
-                    % (specializer, name, semantics_to_retval[obj.semantics]))
-        f.write("    default:\n")
-        f.write("      FATAL() << \"Unknown syscall \" << syscallno;\n")
-        f.write("      return true;\n")
-        f.write("  }\n")
-        f.write("}\n")
-        f.write("\n")
-
-def write_syscallname_arch(f):
-    f.write("template <typename Arch> static const char* syscallname_arch(int syscall);\n")
-    f.write("\n");
-    for specializer, arch in [("X86Arch", "x86"), ("X64Arch", "x64")]:
-        f.write("template <> const char* syscallname_arch<%s>(int syscall) {\n" % specializer)
-        f.write("  switch (syscall) {\n");
-        def write_case(name):
-            f.write("    case %(specializer)s::%(syscall)s: return \"%(syscall)s\";\n"
-                    % { 'specializer': specializer, 'syscall': name })
-        for name, _ in syscalls.for_arch(arch):
-            write_case(name)
-        f.write("    default: return \"<unknown-syscall>\";\n")
-        f.write("  }\n")
-        f.write("}\n")
+        numbered = dict((getattr(obj, arch), (name, obj))
+                        for name, obj in syscalls.for_arch(arch))
+        f.write("template <> const SyscallInfo SyscallInfoTable<%s>::entries[] = {\n"
+                % specializer)
+        for number in range(max(numbered.keys()) + 1):
+            if number not in numbered:
+                f.write("  { \"<unknown-syscall>\", SYSCALL_UNDEFINED, SEMANTICS_EMU, -1 },\n")
+                continue
+            name, obj = numbered[number]
+            num_recorded_args = -1
+            if isinstance(obj, syscalls.RegularSyscall):
+                kind = "SYSCALL_REGULAR"
+                num_recorded_args = len([arg for arg in syscalls.RegularSyscall.ARGUMENT_SLOTS
+                                         if getattr(obj, arg, None) is not None])
+            elif isinstance(obj, (syscalls.IrregularSyscall, syscalls.RestartSyscall)):
+                kind = "SYSCALL_IRREGULAR"
+            else:
+                kind = "SYSCALL_UNSUPPORTED"
+            f.write("  { \"%s\", %s, SEMANTICS_%s, %d },\n"
+                    % (name, kind, obj.semantics, num_recorded_args))
+        f.write("};\n")
         f.write("\n")
 
 def write_syscall_record_cases(f):
@@ -68,7 +56,10 @@ def write_syscall_record_cases(f):
             f.write("    t->record_remote(remote_ptr<%s>(t->regs().%s()));\n"
                     % (arg_descriptor, arg))
         elif isinstance(arg_descriptor, syscalls.DynamicSize):
-            f.write("    t->record_remote(remote_ptr<void>(t->regs().%s()), %s);\n"
+            # Size expressions may use the result of a syscall that
+            # failed; record nothing for those.
+            f.write("    t->record_remote(remote_ptr<void>(t->regs().%s()),\n"
+                    "                     std::max<ssize_t>(0, %s));\n"
                     % (arg, arg_descriptor.size_expr))
         elif isinstance(arg_descriptor, syscalls.NullTerminatedString):
             f.write("    t->record_remote_str(remote_ptr<void>(t->regs().%s()));\n" % arg)
@@ -134,24 +125,6 @@ def write_syscall_helper_functions(f):
     for name, obj in syscalls.all():
         write_helpers(name)
 
-def write_syscall_defs_table(f):
-    for specializer, arch in [("X86Arch", "x86"), ("X64Arch", "x64")]:
-        f.write("template<> syscall_defs<%s>::Table syscall_defs<%s>::table = {\n"
-                % (specializer, specializer))
-        arch_syscalls = sorted(syscalls.for_arch(arch), key=lambda x: getattr(x[1], arch))
-        for name, obj in arch_syscalls:
-            if isinstance(obj, syscalls.RegularSyscall):
-                recorded_args = [arg for arg in syscalls.RegularSyscall.ARGUMENT_SLOTS
-                                 if getattr(obj, arg, None) is not None]
-                f.write("  { %s::%s, { rep_%s, %d } },\n"
-                        % (specializer, name, obj.semantics, len(recorded_args)))
-            elif isinstance(obj, (syscalls.IrregularSyscall, syscalls.RestartSyscall)):
-                f.write("  { %s::%s, { rep_IRREGULAR, -1 } },\n" % (specializer, name))
-            elif isinstance(obj, syscalls.UnsupportedSyscall):
-                pass
-        f.write("};\n")
-        f.write("\n")
-
 def write_check_syscall_numbers(f):
     for name, obj in syscalls.all():
         # XXX hard-coded to x86 currently
@@ -163,11 +136,9 @@ def write_check_syscall_numbers(f):
 generators_for = {
     'AssemblyTemplates': lambda f: assembly_templates.generate(f),
     'CheckSyscallNumbers': write_check_syscall_numbers,
-    'IsAlwaysEmulatedSyscall': write_is_always_emulated_syscall,
-    'SyscallDefsTable': write_syscall_defs_table,
     'SyscallEnumsX86': lambda f: write_syscall_enum(f, 'x86'),
     'SyscallEnumsX64': lambda f: write_syscall_enum(f, 'x64'),
-    'SyscallnameArch': write_syscallname_arch,
+    'SyscallInfoTable': write_syscall_info_tables,
     'SyscallRecordCase': write_syscall_record_cases,
     'SyscallHelperFunctions': write_syscall_helper_functions,
 }
@@ -12,6 +12,7 @@
 #include <linux/ipc.h>
 #include <linux/msg.h>
 #include <linux/net.h>
+#include <linux/shm.h>
 #include <linux/sockios.h>
 #include <linux/sysctl.h>
 #include <linux/wireless.h>
@@ -29,6 +30,7 @@
 
 #include <assert.h>
 
+#include "drm.h"
 #include "remote_ptr.h"
 
 enum SupportedArch {
@@ -438,6 +440,45 @@ struct BaseArch : public wordsize, public FcntlConstants {
   };
   RR_VERIFY_TYPE(msginfo);
 
+  struct shmid64_ds {
+    struct ipc64_perm shm_perm;
+    size_t shm_segsz;
+    // As for msqid64_ds, these are __kernel_time_t plus padding on 32-bit
+    // architectures.
+    uint64_t shm_atime_only_little_endian;
+    uint64_t shm_dtime_only_little_endian;
+    uint64_t shm_ctime_only_little_endian;
+    __kernel_pid_t shm_cpid;
+    __kernel_pid_t shm_lpid;
+    __kernel_ulong_t shm_nattch;
+    __kernel_ulong_t unused4;
+    __kernel_ulong_t unused5;
+  };
+  RR_VERIFY_TYPE(shmid64_ds);
+
+  struct shminfo64 {
+    __kernel_ulong_t shmmax;
+    __kernel_ulong_t shmmin;
+    __kernel_ulong_t shmmni;
+    __kernel_ulong_t shmseg;
+    __kernel_ulong_t shmall;
+    __kernel_ulong_t unused1;
+    __kernel_ulong_t unused2;
+    __kernel_ulong_t unused3;
+    __kernel_ulong_t unused4;
+  };
+  RR_VERIFY_TYPE(shminfo64);
+
+  struct shm_info {
+    signed_int used_ids;
+    __kernel_ulong_t shm_tot;
+    __kernel_ulong_t shm_rss;
+    __kernel_ulong_t shm_swp;
+    __kernel_ulong_t swap_attempts;
+    __kernel_ulong_t swap_successes;
+  };
+  RR_VERIFY_TYPE(shm_info);
+
   // The clone(2) syscall has four (!) different calling conventions,
   // depending on what architecture it's being compiled for.  We describe
   // the orderings for x86oids here.
@@ -553,6 +594,19 @@ struct BaseArch : public wordsize, public FcntlConstants {
   };
   RR_VERIFY_TYPE(ifconf);
 
+  struct drm_version {
+    signed_int version_major;
+    signed_int version_minor;
+    signed_int version_patchlevel;
+    size_t name_len;
+    ptr<char> name;
+    size_t date_len;
+    ptr<char> date;
+    size_t desc_len;
+    ptr<char> desc;
+  };
+  RR_VERIFY_TYPE(drm_version);
+
   struct iw_param {
     int32_t value;
     uint8_t fixed;
@@ -794,6 +848,68 @@ struct BaseArch : public wordsize, public FcntlConstants {
   };
   RR_VERIFY_TYPE(__sysctl_args);
 
+  // The io_uring types are the same size everywhere too.  They aren't
+  // verified because older system headers don't have them.
+  struct io_sqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t flags;
+    uint32_t dropped;
+    uint32_t array;
+    uint32_t resv1;
+    uint64_t user_addr;
+  };
+
+  struct io_cqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t overflow;
+    uint32_t cqes;
+    uint32_t flags;
+    uint32_t resv1;
+    uint64_t user_addr;
+  };
+
+  struct io_uring_params {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags;
+    uint32_t sq_thread_cpu;
+    uint32_t sq_thread_idle;
+    uint32_t features;
+    uint32_t wq_fd;
+    uint32_t resv[3];
+    io_sqring_offsets sq_off;
+    io_cqring_offsets cq_off;
+  };
+
+  // The first 64 bytes of an SQE; rings set up with IORING_SETUP_SQE128
+  // have another 64 after them.
+  struct io_uring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t op_flags;
+    uint64_t user_data;
+    uint64_t __pad2[3];
+  };
+
+  // Likewise the first 16 bytes of a CQE, which are followed by another
+  // 16 with IORING_SETUP_CQE32.
+  struct io_uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+  };
+
   // The getgroups syscall (as well as several others) differs between
   // architectures depending on whether they ever supported 16-bit
   // {U,G}IDs or not.  Architectures such as x86, which did support
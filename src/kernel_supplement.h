@@ -35,6 +35,46 @@
 #define ERESTARTNOHAND 514
 #define ERESTART_RESTARTBLOCK 516
 
+/* The parts of linux/io_uring.h that rr uses, which older systems don't
+ * have. */
+#ifndef IORING_OFF_SQ_RING
+#define IORING_OFF_SQ_RING 0ULL
+#define IORING_OFF_CQ_RING 0x8000000ULL
+#define IORING_OFF_SQES 0x10000000ULL
+#define IORING_SETUP_SQPOLL (1U << 1)
+#define IORING_SETUP_TASKRUN_FLAG (1U << 9)
+#define IORING_SETUP_SQE128 (1U << 10)
+#define IORING_SETUP_CQE32 (1U << 11)
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#define IORING_FEAT_SINGLE_MMAP (1U << 0)
+#define IOSQE_BUFFER_SELECT (1U << 5)
+#define IORING_CQE_F_MORE (1U << 1)
+#define IORING_OP_READV 1
+#define IORING_OP_READ_FIXED 4
+#define IORING_OP_RECVMSG 10
+#define IORING_OP_ACCEPT 13
+#define IORING_OP_STATX 21
+#define IORING_OP_READ 22
+#define IORING_OP_RECV 27
+#define IORING_OP_FGETXATTR 43
+#define IORING_OP_GETXATTR 44
+#define IORING_OP_URING_CMD 46
+#define IORING_OP_SENDMSG_ZC 48
+#define IORING_REGISTER_PROBE 8
+#define IORING_REGISTER_RING_FDS 20
+#endif
+#ifndef IORING_SETUP_NO_MMAP
+#define IORING_SETUP_NO_MMAP (1U << 14)
+#endif
+#ifndef IORING_SETUP_NO_SQARRAY
+#define IORING_SETUP_NO_SQARRAY (1U << 16)
+#endif
+
+#ifndef SHM_STAT_ANY
+#define SHM_STAT_ANY 15
+#endif
+
 /* (There are various GNU and BSD extensions that define this, but
  * it's not worth the bother to sort those out.) */
 typedef void (*sig_handler_t)(int);
@@ -6,6 +6,7 @@
 #include <iostream>
 
 #include "Flags.h"
+#include "LogRing.h"
 #include "replayer.h" // emergency_debug()
 #include "task.h"
 #include "util.h"
@@ -18,6 +19,19 @@ enum LogLevel {
   LOG_debug
 };
 
+/**
+ * Messages less severe than RR_MAX_LOG_LEVEL are compiled out entirely,
+ * arguments and all.  Configure it with cmake -DRR_MAX_LOG_LEVEL=info
+ * (say); fatal and error messages are always kept.
+ */
+#ifndef RR_MAX_LOG_LEVEL
+#define RR_MAX_LOG_LEVEL LOG_debug
+#endif
+
+inline static constexpr bool log_compiled_in(LogLevel level) {
+  return level <= LOG_error || level <= RR_MAX_LOG_LEVEL;
+}
+
 inline static bool logging_enabled_for(LogLevel level) {
   switch (level) {
     case LOG_fatal:
@@ -69,11 +83,21 @@ inline static std::ostream& log_stream() {
 #endif
 }
 
+/**
+ * Print the messages kept by --log-ring, if any, before rr dies.
+ */
+inline static void dump_log_ring() {
+  if (LogRing::enabled()) {
+    LogRing::dump(log_stream());
+  }
+}
+
 struct NewlineTerminatingOstream {
   NewlineTerminatingOstream(LogLevel level) : level(level) {}
   ~NewlineTerminatingOstream() {
     log_stream() << std::endl;
     if (Flags::get().fatal_errors_and_warnings && level <= LOG_warn) {
+      dump_log_ring();
       abort();
     }
   }
@@ -93,6 +117,7 @@ NewlineTerminatingOstream& operator<<(NewlineTerminatingOstream& stream,
 struct FatalOstream {
   ~FatalOstream() {
     log_stream() << std::endl;
+    dump_log_ring();
     abort();
   }
 };
@@ -106,6 +131,7 @@ struct EmergencyDebugOstream {
   EmergencyDebugOstream(const Task* t) : t(const_cast<Task*>(t)) {}
   ~EmergencyDebugOstream() {
     log_stream() << std::endl;
+    dump_log_ring();
     t->log_pending_events();
     emergency_debug(t);
   }
@@ -159,11 +185,26 @@ inline static T& prepare_log_stream(T&& stream, LogLevel level,
 /**
  * Write logging output at the given level, which can be one of |{
  * error, warn, info, debug }| in decreasing order of severity.
+ *
+ * Debug messages are printed for files that #define DEBUGTAG; in other
+ * files they go to the LogRing when --log-ring is given.
  */
-#define LOG(_level)                                                            \
-  if (logging_enabled_for(LOG_##_level))                                       \
+#define LOG(_level) RR_LOG_##_level
+
+#define RR_LOG_TEXT(_level)                                                    \
+  if (log_compiled_in(LOG_##_level) && logging_enabled_for(LOG_##_level))      \
   prepare_log_stream(NewlineTerminatingOstream(LOG_##_level), LOG_##_level,    \
                      __FILE__, __LINE__, __FUNCTION__)
+#define RR_LOG_error RR_LOG_TEXT(error)
+#define RR_LOG_warn RR_LOG_TEXT(warn)
+#define RR_LOG_info RR_LOG_TEXT(info)
+#ifdef DEBUGTAG
+#define RR_LOG_debug RR_LOG_TEXT(debug)
+#else
+#define RR_LOG_debug                                                           \
+  if (log_compiled_in(LOG_debug) && LogRing::enabled())                        \
+  LogRing::Stream(__FILE__, __LINE__, __FUNCTION__)
+#endif
 
 /** A fatal error has occurred.  Log the error and exit. */
 #define FATAL()                                                                \
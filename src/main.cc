@@ -13,18 +13,26 @@
 #include <sys/utsname.h>
 #include <sys/wait.h>
 
+#include <algorithm>
+#include <deque>
 #include <limits>
+#include <map>
 #include <sstream>
 
 #include "preload/syscall_buffer.h"
 
 #include "log.h"
+#include "OutputSink.h"
+#include "ProbeCache.h"
+#include "PtraceProfiler.h"
 #include "recorder.h"
 #include "replayer.h"
 #include "syscalls.h"
 #include "task.h"
+#include "TraceExport.h"
 #include "TraceStream.h"
 #include "util.h"
+#include "WriteIndex.h"
 
 using namespace std;
 
@@ -83,16 +91,19 @@ static void dump_events_matching(TraceReader& trace, FILE* out,
   }
 
   bool dump_raw_data = Flags::get().dump_syscallbuf;
+  // Jump close to |start| instead of decoding every frame before it.
+  trace.seek_to_time(start);
   while (!trace.at_end()) {
     auto frame = trace.read_frame();
     if (end < frame.time()) {
       return;
     }
-    if (start <= frame.time() && frame.time() <= end) {
+    if (start <= frame.time() && frame.time() <= end &&
+        (!Flags::get().dump_tid || frame.tid() == Flags::get().dump_tid)) {
       if (Flags::get().raw_dump) {
         frame.dump_raw(out);
       } else {
-        frame.dump(out);
+        frame.dump(out, &trace.extra_perf_counter_names());
       }
       if (Flags::get().dump_syscallbuf) {
         dump_syscallbuf_data(trace, out, frame);
@@ -108,25 +119,393 @@ static void dump_events_matching(TraceReader& trace, FILE* out,
   }
 }
 
+/**
+ * Return |s| as a JSON string literal.
+ */
+static string json_string(const string& s) {
+  string result = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      sprintf(buf, "\\u%04x", c);
+      result += buf;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+/**
+ * Summarize where |trace|'s frames and bytes came from: events by type,
+ * syscalls (with the raw data they saved), tasks, syscallbuf flushes and
+ * mapped regions. Printed as comments, or as a JSON object if
+ * Flags::dump_json.
+ */
 static void dump_statistics(const TraceReader& trace, FILE* out) {
+  struct EventCounts {
+    EventCounts() : frames(0), raw_bytes(0) {}
+    uint64_t frames;
+    uint64_t raw_bytes;
+  };
+  struct SyscallCounts {
+    SyscallCounts() : buffered(0), traced(0), raw_bytes(0) {}
+    uint64_t buffered;
+    uint64_t traced;
+    uint64_t raw_bytes;
+  };
+  struct TaskCounts {
+    TaskCounts()
+        : frames(0),
+          raw_bytes(0),
+          first_time(numeric_limits<TraceFrame::Time>::max()),
+          last_time(0) {}
+    uint64_t frames;
+    uint64_t raw_bytes;
+    TraceFrame::Time first_time;
+    TraceFrame::Time last_time;
+  };
+  struct Counts {
+    Counts()
+        : frames(0),
+          raw_records(0),
+          raw_bytes(0),
+          flushes(0),
+          flush_bytes(0),
+          max_flush_bytes(0),
+          descheds(0),
+          aborted_commits(0) {}
+    uint64_t frames;
+    uint64_t raw_records;
+    uint64_t raw_bytes;
+    uint64_t flushes;
+    uint64_t flush_bytes;
+    uint64_t max_flush_bytes;
+    uint64_t descheds;
+    uint64_t aborted_commits;
+    map<string, EventCounts> events;
+    map<string, SyscallCounts> syscalls;
+    map<pid_t, TaskCounts> tasks;
+  };
+  uint32_t threads = max<uint32_t>(1, Flags::get().decompress_threads);
+  vector<Counts> counts(trace.split_time_ranges(threads * 4).size());
+  trace.visit_frames_parallel(
+      threads, [&counts](size_t range, const TraceFrame& frame,
+                         const vector<TraceReader::RawData>& raw_data) {
+        Counts& c = counts[range];
+        ++c.frames;
+        c.raw_records += raw_data.size();
+        uint64_t raw_bytes = 0;
+        for (auto& d : raw_data) {
+          raw_bytes += d.data.size();
+        }
+        c.raw_bytes += raw_bytes;
+        Event ev(frame.event());
+        EventCounts& e = c.events[ev.type_name()];
+        ++e.frames;
+        e.raw_bytes += raw_bytes;
+        TaskCounts& t = c.tasks[frame.tid()];
+        ++t.frames;
+        t.raw_bytes += raw_bytes;
+        t.first_time = min(t.first_time, frame.time());
+        t.last_time = max(t.last_time, frame.time());
+        switch (ev.type()) {
+          case EV_SYSCALL: {
+            SyscallCounts& s =
+                c.syscalls[syscall_name(ev.Syscall().number, ev.arch())];
+            if (ENTERING_SYSCALL == ev.Syscall().state) {
+              ++s.traced;
+            }
+            s.raw_bytes += raw_bytes;
+            break;
+          }
+          case EV_DESCHED:
+            if (ARMING_DESCHED_EVENT == ev.Desched().state) {
+              ++c.descheds;
+            }
+            break;
+          case EV_SYSCALLBUF_ABORT_COMMIT:
+            ++c.aborted_commits;
+            break;
+          case EV_SYSCALLBUF_FLUSH: {
+            ++c.flushes;
+            if (raw_data.empty()) {
+              break;
+            }
+            auto& data = raw_data[0].data;
+            c.flush_bytes += data.size();
+            c.max_flush_bytes = max<uint64_t>(c.max_flush_bytes, data.size());
+            auto hdr = reinterpret_cast<const syscallbuf_hdr*>(data.data());
+            auto p = reinterpret_cast<const uint8_t*>(hdr + 1);
+            auto end = data.data() + data.size();
+            while (p + sizeof(syscallbuf_record) <= end) {
+              auto rec = reinterpret_cast<const syscallbuf_record*>(p);
+              if (rec->size < sizeof(*rec)) {
+                break;
+              }
+              SyscallCounts& s =
+                  c.syscalls[syscall_name(rec->syscallno, ev.arch())];
+              ++s.buffered;
+              s.raw_bytes += rec->size - sizeof(*rec);
+              p += stored_record_size(rec->size);
+            }
+            break;
+          }
+          default:
+            break;
+        }
+      });
+  Counts total;
+  for (auto& c : counts) {
+    total.frames += c.frames;
+    total.raw_records += c.raw_records;
+    total.raw_bytes += c.raw_bytes;
+    total.flushes += c.flushes;
+    total.flush_bytes += c.flush_bytes;
+    total.max_flush_bytes = max(total.max_flush_bytes, c.max_flush_bytes);
+    total.descheds += c.descheds;
+    total.aborted_commits += c.aborted_commits;
+    for (auto& e : c.events) {
+      total.events[e.first].frames += e.second.frames;
+      total.events[e.first].raw_bytes += e.second.raw_bytes;
+    }
+    for (auto& s : c.syscalls) {
+      total.syscalls[s.first].buffered += s.second.buffered;
+      total.syscalls[s.first].traced += s.second.traced;
+      total.syscalls[s.first].raw_bytes += s.second.raw_bytes;
+    }
+    for (auto& t : c.tasks) {
+      TaskCounts& to = total.tasks[t.first];
+      to.frames += t.second.frames;
+      to.raw_bytes += t.second.raw_bytes;
+      to.first_time = min(to.first_time, t.second.first_time);
+      to.last_time = max(to.last_time, t.second.last_time);
+    }
+  }
+
+  uint64_t regions = 0, copied_regions = 0, copied_bytes = 0,
+           stored_regions = 0;
+  TraceReader reader(trace);
+  reader.rewind();
+  while (!reader.mapped_regions_at_end()) {
+    TraceMappedRegion map = reader.read_mapped_region();
+    ++regions;
+    if (map.copied()) {
+      ++copied_regions;
+      copied_bytes += map.size();
+    }
+    if (!map.stored_file().empty()) {
+      ++stored_regions;
+    }
+  }
+
+  // List the syscalls that trap most first; they're the candidates for
+  // buffering.
+  vector<pair<string, SyscallCounts> > syscalls(total.syscalls.begin(),
+                                                total.syscalls.end());
+  stable_sort(syscalls.begin(), syscalls.end(),
+              [](const pair<string, SyscallCounts>& a,
+                 const pair<string, SyscallCounts>& b) {
+                return a.second.traced > b.second.traced;
+              });
   uint64_t uncompressed = trace.uncompressed_bytes();
   uint64_t compressed = trace.compressed_bytes();
-  fprintf(stdout, "// Uncompressed bytes %" PRIu64 ", compressed bytes %" PRIu64
-                  ", ratio %.2fx\n",
+
+  if (Flags::get().dump_json) {
+    fprintf(out, "{\n  \"uncompressed_bytes\": %" PRIu64
+                 ",\n  \"compressed_bytes\": %" PRIu64
+                 ",\n  \"frames\": %" PRIu64
+                 ",\n  \"raw_records\": %" PRIu64
+                 ",\n  \"raw_bytes\": %" PRIu64 ",\n",
+            uncompressed, compressed, total.frames, total.raw_records,
+            total.raw_bytes);
+    fprintf(out, "  \"syscallbuf\": { \"flushes\": %" PRIu64
+                 ", \"flush_bytes\": %" PRIu64
+                 ", \"max_flush_bytes\": %" PRIu64 ", \"descheds\": %" PRIu64
+                 ", \"aborted_commits\": %" PRIu64 " },\n",
+            total.flushes, total.flush_bytes, total.max_flush_bytes,
+            total.descheds, total.aborted_commits);
+    fprintf(out, "  \"mapped_regions\": { \"regions\": %" PRIu64
+                 ", \"copied_regions\": %" PRIu64
+                 ", \"copied_bytes\": %" PRIu64
+                 ", \"stored_regions\": %" PRIu64 " },\n",
+            regions, copied_regions, copied_bytes, stored_regions);
+    fprintf(out, "  \"events\": {");
+    const char* sep = "\n";
+    for (auto& e : total.events) {
+      fprintf(out, "%s    %s: { \"frames\": %" PRIu64 ", \"raw_bytes\": %" PRIu64
+                   " }",
+              sep, json_string(e.first).c_str(), e.second.frames,
+              e.second.raw_bytes);
+      sep = ",\n";
+    }
+    fprintf(out, "\n  },\n  \"syscalls\": {");
+    sep = "\n";
+    for (auto& s : syscalls) {
+      fprintf(out, "%s    %s: { \"traced\": %" PRIu64 ", \"buffered\": %" PRIu64
+                   ", \"raw_bytes\": %" PRIu64 " }",
+              sep, json_string(s.first).c_str(), s.second.traced,
+              s.second.buffered, s.second.raw_bytes);
+      sep = ",\n";
+    }
+    fprintf(out, "\n  },\n  \"tasks\": {");
+    sep = "\n";
+    for (auto& t : total.tasks) {
+      fprintf(out, "%s    \"%d\": { \"frames\": %" PRIu64
+                   ", \"raw_bytes\": %" PRIu64 ", \"first_event\": %" PRIu64
+                   ", \"last_event\": %" PRIu64 " }",
+              sep, t.first, t.second.frames, t.second.raw_bytes,
+              (uint64_t)t.second.first_time, (uint64_t)t.second.last_time);
+      sep = ",\n";
+    }
+    fprintf(out, "\n  }\n}\n");
+    return;
+  }
+
+  fprintf(out, "// Uncompressed bytes %" PRIu64 ", compressed bytes %" PRIu64
+               ", ratio %.2fx\n",
           uncompressed, compressed, double(uncompressed) / compressed);
+  fprintf(out, "// Frames %" PRIu64 ", raw data records %" PRIu64 " (%" PRIu64
+               " bytes)\n",
+          total.frames, total.raw_records, total.raw_bytes);
+  fprintf(out, "// Syscallbuf flushes %" PRIu64 ", descheds %" PRIu64
+               ", aborted commits %" PRIu64 "\n",
+          total.flushes, total.descheds, total.aborted_commits);
+  fprintf(out, "// Syscallbuf flush bytes %" PRIu64 ", mean %" PRIu64
+               ", max %" PRIu64 "\n",
+          total.flush_bytes,
+          total.flushes ? total.flush_bytes / total.flushes : 0,
+          total.max_flush_bytes);
+  fprintf(out, "// Mapped regions %" PRIu64 ", copied %" PRIu64 " (%" PRIu64
+               " bytes), in the shared store %" PRIu64 "\n",
+          regions, copied_regions, copied_bytes, stored_regions);
+  for (auto& s : syscalls) {
+    fprintf(out, "//   %s: %" PRIu64 " traced, %" PRIu64 " buffered, %" PRIu64
+                 " raw bytes\n",
+            s.first.c_str(), s.second.traced, s.second.buffered,
+            s.second.raw_bytes);
+  }
+  fprintf(out, "// Events by type:\n");
+  for (auto& e : total.events) {
+    fprintf(out, "//   %s: %" PRIu64 " frames, %" PRIu64 " raw bytes\n",
+            e.first.c_str(), e.second.frames, e.second.raw_bytes);
+  }
+  fprintf(out, "// Events by task:\n");
+  for (auto& t : total.tasks) {
+    TraceFrame::Time span = t.second.last_time - t.second.first_time + 1;
+    fprintf(out, "//   %d: %" PRIu64 " frames (%.1f%% of events %" PRIu64
+                 "-%" PRIu64 "), %" PRIu64 " raw bytes\n",
+            t.first, t.second.frames, 100.0 * t.second.frames / span,
+            (uint64_t)t.second.first_time, (uint64_t)t.second.last_time,
+            t.second.raw_bytes);
+  }
+}
+
+/**
+ * Attribute the extra perf counters recorded in |trace| to tasks, to the
+ * events that ended each stretch of execution, and to time ranges.
+ * Frames hold per-task running totals, so what a task counted between
+ * two of its frames is the difference of their values.
+ */
+static void dump_perf_counters(const TraceReader& trace, FILE* out) {
+  const vector<string>& names = trace.extra_perf_counter_names();
+  typedef vector<int64_t> Counts;
+  auto add = [&names](Counts& to, const Counts& delta) {
+    to.resize(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+      to[i] += delta[i];
+    }
+  };
+  auto print = [&names, out](const string& what, const Counts& counts) {
+    fprintf(out, "//   %s:", what.c_str());
+    for (size_t i = 0; i < names.size(); ++i) {
+      fprintf(out, " %s %" PRId64, names[i].c_str(), counts[i]);
+    }
+    fprintf(out, "\n");
+  };
+
+  vector<TraceReader::TimeRange> ranges = trace.split_time_ranges(10);
+  vector<Counts> by_range(ranges.size());
+  map<pid_t, Counts> by_task;
+  map<string, Counts> by_event;
+  map<pid_t, Counts> last;
+  TraceReader reader(trace);
+  reader.rewind();
+  size_t range = 0;
+  while (!reader.at_end()) {
+    TraceFrame frame = reader.read_frame();
+    if (!frame.event().has_exec_info) {
+      continue;
+    }
+    Counts now;
+    for (size_t i = 0; i < names.size(); ++i) {
+      now.push_back(frame.extra_perf_values().values[i]);
+    }
+    Counts& prev = last[frame.tid()];
+    prev.resize(names.size());
+    Counts delta(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+      delta[i] = now[i] - prev[i];
+    }
+    prev = now;
+
+    Event ev(frame.event());
+    string event_name = EV_SYSCALL == ev.type()
+                            ? syscall_name(ev.Syscall().number, ev.arch())
+                            : ev.type_name();
+    while (range + 1 < ranges.size() && frame.time() >= ranges[range].end) {
+      ++range;
+    }
+    add(by_task[frame.tid()], delta);
+    add(by_event[event_name], delta);
+    if (!by_range.empty()) {
+      add(by_range[range], delta);
+    }
+  }
+
+  fprintf(out, "// Perf counters by task:\n");
+  for (auto& c : by_task) {
+    print(to_string(c.first), c.second);
+  }
+  fprintf(out, "// Perf counters by the event ending each interval:\n");
+  for (auto& c : by_event) {
+    print(c.first, c.second);
+  }
+  fprintf(out, "// Perf counters by time range:\n");
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    if (!by_range[i].empty()) {
+      print(to_string(ranges[i].start) + "-" + to_string(ranges[i].end - 1),
+            by_range[i]);
+    }
+  }
 }
 
 static int dump(int argc, char* argv[], char** envp) {
   FILE* out = stdout;
-  TraceReader trace(argc > 0 ? argv[0] : "");
+  // Frame headers alone come from the events stream; don't seek or
+  // decompress the others unless the output needs them.
+  const Flags& flags = Flags::get();
+  int streams = TraceReader::FRAMES_ONLY;
+  if (flags.dump_syscallbuf) {
+    streams |= TraceReader::RAW_DATA;
+  }
+  if (flags.dump_statistics || flags.dump_json) {
+    streams |= TraceReader::ALL_STREAMS;
+  }
+  TraceReader trace(argc > 0 ? argv[0] : "", streams);
 
-  if (Flags::get().raw_dump) {
+  if (Flags::get().raw_dump && !Flags::get().dump_json) {
     fprintf(out, "global_time tid reason "
-                 "hw_interrupts page_faults adapted_ticks instructions "
+                 "perf0 perf1 adapted_ticks perf2 "
                  "eax ebx ecx edx esi edi ebp orig_eax esp eip eflags\n");
   }
 
-  if (1 == argc) {
+  if (Flags::get().dump_json) {
+    // Only the statistics, so the output parses.
+  } else if (1 == argc) {
     // No specs => dump all events.
     dump_events_matching(trace, stdout, nullptr /*all events*/);
   } else {
@@ -135,8 +514,12 @@ static int dump(int argc, char* argv[], char** envp) {
     }
   }
 
-  if (Flags::get().dump_statistics) {
+  if (Flags::get().dump_statistics || Flags::get().dump_json) {
     dump_statistics(trace, stdout);
+    if (!Flags::get().dump_json &&
+        !trace.extra_perf_counter_names().empty()) {
+      dump_perf_counters(trace, stdout);
+    }
   }
 
   return 0;
@@ -163,7 +546,10 @@ static void assert_prerequisites(Flags* flags) {
   }
 }
 
-static void check_performance_settings() {
+/**
+ * Return cpu0's frequency governor, or an empty string if it has none.
+ */
+static string read_governor() {
   // NB: we hard-code "cpu0" here because rr pins itself and all
   // tracees to cpu 0.  We don't care about the other CPUs.
   ScopedFd fd("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor",
@@ -172,8 +558,7 @@ static void check_performance_settings() {
     // If the file doesn't exist, the system probably
     // doesn't have the ability to frequency-scale, for
     // example a VM.
-    LOG(info) << "Unable to check CPU-frequency governor.";
-    return;
+    return string();
   }
   char governor[PATH_MAX];
   ssize_t nread = read(fd, governor, sizeof(governor) - 1);
@@ -186,6 +571,20 @@ static void check_performance_settings() {
     // Eat the '\n'.
     governor[len - 1] = '\0';
   }
+  return governor;
+}
+
+static void check_performance_settings() {
+  string cached;
+  if (!ProbeCache::get("governor", &cached)) {
+    cached = read_governor();
+    ProbeCache::set("governor", cached);
+  }
+  const char* governor = cached.c_str();
+  if (!*governor) {
+    LOG(info) << "Unable to check CPU-frequency governor.";
+    return;
+  }
   LOG(info) << "cpu0's frequency governor is '" << governor << "'";
   if (strcmp("performance", governor)) {
     fprintf(stderr,
@@ -210,9 +609,377 @@ static void check_performance_settings() {
   }
 }
 
+static int pack(int argc, char* argv[], char** envp) {
+  TraceReader trace(argc > 0 ? argv[0] : "");
+  CompressedWriter::Codec codec =
+      (CompressedWriter::Codec)Flags::get().compression_codec;
+  if (!trace.pack(codec)) {
+    fprintf(stderr, "Failed to pack trace %s\n", trace.dir().c_str());
+    return 1;
+  }
+  return 0;
+}
+
+static int unpack(int argc, char* argv[], char** envp) {
+  TraceReader trace(argc > 0 ? argv[0] : "");
+  if (!trace.unpack()) {
+    fprintf(stderr, "Failed to unpack trace %s\n", trace.dir().c_str());
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Return true if |a| and |b| decode to the same frames and raw data.
+ */
+static bool same_traces(TraceReader& a, TraceReader& b) {
+  TraceReader::RawData a_data, b_data;
+  while (!a.at_end() && !b.at_end()) {
+    TraceFrame a_frame = a.read_frame();
+    TraceFrame b_frame = b.read_frame();
+    if (a_frame.time() != b_frame.time() || a_frame.tid() != b_frame.tid() ||
+        a_frame.event().encoded != b_frame.event().encoded ||
+        (a_frame.event().has_exec_info == HAS_EXEC_INFO &&
+         (a_frame.ticks() != b_frame.ticks() ||
+          memcmp(&a_frame.regs(), &b_frame.regs(), sizeof(Registers))))) {
+      fprintf(stderr, "Frame %d differs\n", (int)a_frame.time());
+      return false;
+    }
+    while (a.read_raw_data_for_frame(a_frame, a_data)) {
+      if (!b.read_raw_data_for_frame(b_frame, b_data) ||
+          a_data.addr != b_data.addr || a_data.data != b_data.data) {
+        fprintf(stderr, "Raw data for frame %d differs\n",
+                (int)a_frame.time());
+        return false;
+      }
+    }
+    if (b.read_raw_data_for_frame(b_frame, b_data)) {
+      fprintf(stderr, "Raw data for frame %d differs\n", (int)a_frame.time());
+      return false;
+    }
+  }
+  return a.at_end() && b.at_end() && a.good() && b.good();
+}
+
+static int compact(int argc, char* argv[], char** envp) {
+  TraceReader trace(argc > 0 ? argv[0] : "");
+  string out_dir = argc > 1 ? string(argv[1]) : trace.dir() + "-compact";
+  if (!trace.compact(out_dir)) {
+    fprintf(stderr, "Failed to compact trace %s\n", trace.dir().c_str());
+    return 1;
+  }
+  trace.rewind();
+  TraceReader compacted(out_dir);
+  if (!same_traces(trace, compacted)) {
+    fprintf(stderr, "Compacted trace %s doesn't match %s\n", out_dir.c_str(),
+            trace.dir().c_str());
+    return 1;
+  }
+  fprintf(stdout, "Compacted %s (%" PRIu64 " bytes) into %s (%" PRIu64
+                  " bytes)\n",
+          trace.dir().c_str(), trace.compressed_bytes(), out_dir.c_str(),
+          compacted.compressed_bytes());
+  return 0;
+}
+
+static int export_tables(int argc, char* argv[], char** envp) {
+  // Frames are decoded by readers of their own.
+  TraceReader trace(argc > 0 ? argv[0] : "", TraceReader::FRAMES_ONLY);
+  string out_dir = argc > 1 ? string(argv[1]) : trace.dir() + "-export";
+  if (!export_trace(trace, out_dir, Flags::get().decompress_threads)) {
+    fprintf(stderr, "Failed to export trace %s\n", trace.dir().c_str());
+    return 1;
+  }
+  fprintf(stdout, "Exported %s to %s\n", trace.dir().c_str(),
+          out_dir.c_str());
+  return 0;
+}
+
+static int verify(int argc, char* argv[], char** envp) {
+  TraceReader trace(argc > 0 ? argv[0] : "", TraceReader::FRAMES_ONLY);
+  vector<string> problems;
+  trace.verify(Flags::get().verify_threads, &problems);
+  for (auto& p : problems) {
+    fprintf(stderr, "%s: %s\n", trace.dir().c_str(), p.c_str());
+  }
+  if (!problems.empty()) {
+    return 1;
+  }
+  fprintf(stdout, "Verified %s\n", trace.dir().c_str());
+  return 0;
+}
+
+static int gc(int argc, char* argv[], char** envp) {
+  uint64_t files = 0, bytes = 0;
+  if (!TraceWriter::gc_shared_store(&files, &bytes)) {
+    fprintf(stderr, "Failed to read the shared store %s\n",
+            TraceStream::shared_store_dir().c_str());
+    return 1;
+  }
+  fprintf(stdout, "Removed %" PRIu64 " unreferenced copies (%" PRIu64
+                  " bytes)\n",
+          files, bytes);
+  return 0;
+}
+
+static int receive(int argc, char* argv[], char** envp) {
+  if (mkdir(argv[0], S_IRWXU | S_IRWXG)) {
+    fprintf(stderr, "Unable to create trace directory %s\n", argv[0]);
+    return 1;
+  }
+  if (!OutputSink::receive(STDIN_FILENO, argv[0])) {
+    fprintf(stderr, "Failed to receive trace into %s\n", argv[0]);
+    return 1;
+  }
+  return 0;
+}
+
+static int index_writes(int argc, char* argv[], char** envp) {
+  const Flags& flags = Flags::get();
+  string trace_dir = argc > 0 ? argv[0] : "";
+  if (!flags.index_query) {
+    vector<WriteIndex::Range> ranges;
+    for (auto& r : flags.index_ranges) {
+      ranges.push_back(WriteIndex::Range(r.first, r.second));
+    }
+    size_t entries;
+    if (!WriteIndex::build(trace_dir, ranges, &entries)) {
+      fprintf(stderr, "Failed to save the write index\n");
+      return 1;
+    }
+    fprintf(stdout, "Indexed %zu writes\n", entries);
+    return 0;
+  }
+
+  TraceReader trace(trace_dir, TraceReader::FRAMES_ONLY);
+  vector<WriteIndex::Entry> writes;
+  if (!WriteIndex::query(trace, flags.index_query_addr,
+                         flags.index_query_time
+                             ? flags.index_query_time
+                             : numeric_limits<TraceFrame::Time>::max(),
+                         flags.index_query_count, &writes)) {
+    fprintf(stderr, "No write index in %s; run `rr index-writes' first\n",
+            trace.dir().c_str());
+    return 1;
+  }
+  for (auto& w : writes) {
+    fprintf(stdout, "event %u ticks %" PRId64 " tid %d wrote 0x%" PRIx64
+                    "-0x%" PRIx64 "\n",
+            w.time, w.ticks, w.tid, w.start, w.end);
+  }
+  return 0;
+}
+
+/**
+ * A frame of one of the traces `rr diff' compares, with its raw data.
+ */
+struct DiffFrame {
+  TraceFrame frame;
+  vector<TraceReader::RawData> data;
+};
+
+/**
+ * A task of the first trace and the one of the second it's compared
+ * with.  Tids differ between recordings, so tasks are paired by the
+ * order in which they first appear in the traces.
+ */
+struct DiffTask {
+  DiffTask() : diverged(false) { tids[0] = tids[1] = 0; }
+  pid_t tids[2];
+  // Frames read from one trace that the other hasn't caught up with.
+  deque<DiffFrame> pending[2];
+  // Only a task's first divergence is reported; its frames after that
+  // are usually out of step.
+  bool diverged;
+};
+
+static bool read_diff_frame(TraceReader& trace, DiffFrame* f) {
+  if (trace.at_end()) {
+    return false;
+  }
+  f->frame = trace.read_frame();
+  f->data.clear();
+  TraceReader::RawData d;
+  while (trace.read_raw_data_for_frame(f->frame, d)) {
+    f->data.push_back(d);
+  }
+  return true;
+}
+
+static string describe_diff_frame(const TraceFrame& f) {
+  stringstream ss;
+  ss << "event " << f.time() << " " << Event(f.event());
+  if (f.event().type == EV_SYSCALL && f.event().state == SYSCALL_EXIT) {
+    ss << " = " << f.regs().syscall_result_signed();
+  }
+  return ss.str();
+}
+
+/**
+ * Return a description of how |a| and |b| differ, or the empty string
+ * if they don't.
+ */
+static string diff_frames(const DiffFrame& a, const DiffFrame& b) {
+  stringstream ss;
+  if (a.frame.event() != b.frame.event()) {
+    ss << "different events";
+    return ss.str();
+  }
+  if (a.frame.event().type == EV_SYSCALL &&
+      a.frame.event().state == SYSCALL_EXIT &&
+      a.frame.regs().syscall_result() != b.frame.regs().syscall_result()) {
+    ss << "different results";
+    return ss.str();
+  }
+  if (a.data.size() != b.data.size()) {
+    ss << a.data.size() << " vs " << b.data.size() << " data records";
+    return ss.str();
+  }
+  for (size_t i = 0; i < a.data.size(); ++i) {
+    const vector<uint8_t>& da = a.data[i].data;
+    const vector<uint8_t>& db = b.data[i].data;
+    if (da.size() != db.size()) {
+      ss << "data record " << i << " is " << da.size() << " vs " << db.size()
+         << " bytes";
+      return ss.str();
+    }
+    auto m = mismatch(da.begin(), da.end(), db.begin());
+    if (m.first != da.end()) {
+      size_t offset = m.first - da.begin();
+      ss << "data record " << i << " (" << da.size()
+         << " bytes) differs from offset " << offset << ": " << hex
+         << "0x" << int(*m.first) << " vs 0x" << int(*m.second);
+      return ss.str();
+    }
+  }
+  return ss.str();
+}
+
+static int diff(int argc, char* argv[], char** envp) {
+  if (argc < 2) {
+    fprintf(stderr, "`rr diff' needs two traces\n");
+    return 1;
+  }
+  TraceReader traces[2] = { TraceReader(argv[0], TraceReader::RAW_DATA),
+                            TraceReader(argv[1], TraceReader::RAW_DATA) };
+  uint32_t max_divergences = Flags::get().diff_max_divergences;
+  uint32_t divergences = 0;
+  vector<DiffTask> tasks;
+  map<pid_t, size_t> task_index[2];
+  bool schedule_diverged = false;
+  uint64_t frames = 0;
+
+  DiffFrame f[2];
+  while (divergences < max_divergences) {
+    bool read[2];
+    size_t index[2] = { 0, 0 };
+    for (int i = 0; i < 2; ++i) {
+      read[i] = read_diff_frame(traces[i], &f[i]);
+      if (!read[i]) {
+        continue;
+      }
+      auto it = task_index[i].find(f[i].frame.tid());
+      if (it == task_index[i].end()) {
+        // The n-th task of one trace to appear is compared with the n-th
+        // of the other.
+        size_t n = task_index[i].size();
+        if (n == tasks.size()) {
+          tasks.push_back(DiffTask());
+        }
+        tasks[n].tids[i] = f[i].frame.tid();
+        it = task_index[i].insert(make_pair(f[i].frame.tid(), n)).first;
+      }
+      index[i] = it->second;
+    }
+    if (!read[0] && !read[1]) {
+      break;
+    }
+    ++frames;
+
+    // Scheduling decisions only show in the order of the frames of
+    // different tasks, so the first difference in that order is all
+    // there is to report.
+    bool same_step = read[0] && read[1] && index[0] == index[1] &&
+                     (f[0].frame.event().type == EV_SCHED) ==
+                         (f[1].frame.event().type == EV_SCHED);
+    if (!schedule_diverged && !same_step) {
+      schedule_diverged = true;
+      ++divergences;
+      fprintf(stdout, "Schedules diverge at frame %" PRIu64 ":\n", frames);
+      for (int i = 0; i < 2; ++i) {
+        if (read[i]) {
+          fprintf(stdout, "  %s: tid %d %s\n", argv[i], f[i].frame.tid(),
+                  describe_diff_frame(f[i].frame).c_str());
+        } else {
+          fprintf(stdout, "  %s: ended\n", argv[i]);
+        }
+      }
+    }
+
+    for (int i = 0; i < 2; ++i) {
+      // Time slices are scheduling decisions, compared above.
+      if (read[i] && f[i].frame.event().type != EV_SCHED &&
+          !tasks[index[i]].diverged) {
+        tasks[index[i]].pending[i].push_back(f[i]);
+      }
+    }
+    for (int i = 0; i < 2; ++i) {
+      if (!read[i]) {
+        continue;
+      }
+      DiffTask& t = tasks[index[i]];
+      while (!t.pending[0].empty() && !t.pending[1].empty()) {
+        const DiffFrame& a = t.pending[0].front();
+        const DiffFrame& b = t.pending[1].front();
+        string how = diff_frames(a, b);
+        if (!how.empty()) {
+          t.diverged = true;
+          ++divergences;
+          fprintf(stdout, "Task %d/%d diverges: %s\n  %s: %s\n  %s: %s\n",
+                  t.tids[0], t.tids[1], how.c_str(), argv[0],
+                  describe_diff_frame(a.frame).c_str(), argv[1],
+                  describe_diff_frame(b.frame).c_str());
+          t.pending[0].clear();
+          t.pending[1].clear();
+          break;
+        }
+        t.pending[0].pop_front();
+        t.pending[1].pop_front();
+      }
+    }
+  }
+
+  // A task one trace has more frames of than the other diverges at
+  // the first of them.
+  for (auto& t : tasks) {
+    if (divergences == max_divergences) {
+      break;
+    }
+    for (int i = 0; i < 2; ++i) {
+      if (!t.diverged && !t.pending[i].empty() && t.pending[1 - i].empty()) {
+        t.diverged = true;
+        ++divergences;
+        fprintf(stdout, "Task %d/%d diverges: only %s goes on to\n  %s\n",
+                t.tids[0], t.tids[1], argv[i],
+                describe_diff_frame(t.pending[i].front().frame).c_str());
+      }
+    }
+  }
+
+  if (divergences == max_divergences) {
+    fprintf(stdout, "Stopped after %u divergences\n", divergences);
+  } else if (!divergences) {
+    fprintf(stdout, "No divergences in %" PRIu64 " frames\n", frames);
+  }
+  return divergences ? 1 : 0;
+}
+
 static void print_usage(void) {
   fputs(
-      "Usage: rr [OPTION] (record|replay|dump) [OPTION]... [ARG]...\n"
+      "Usage: rr [OPTION] "
+      "(record|replay|replay-batch|dump|pack|unpack|compact|export|verify|"
+      "gc|receive|index-writes|diff) [OPTION]... "
+      "[ARG]...\n"
       "\n"
       "Common options\n"
       "  -a, --microarch=<NAME>     force rr to assume it's running on a CPU\n"
@@ -242,14 +1009,30 @@ static void print_usage(void) {
       "                             like good ideas, for example launching an\n"
       "                             interactive emergency debugger if stderr\n"
       "                             isn't a tty.\n"
-      "  -k, --check-cached-mmaps   verify that cached task mmaps match "
-      "/proc/maps\n"
+      "  -i, --incremental-checksum with -c, only re-read the pages written\n"
+      "                             since the last checksum, if the kernel\n"
+      "                             tracks soft-dirty pages\n"
+      "  -k, --check-cached-mmaps[=<RATE>]\n"
+      "                             verify that cached task mmaps match\n"
+      "                             /proc/maps after a random RATE (default\n"
+      "                             1) of events, and always after syscalls\n"
+      "                             that change mappings\n"
+      "  -l, --log-ring=<NUM>       keep the last NUM debug log messages in\n"
+      "                             memory, without formatting them, and\n"
+      "                             print them if rr dies\n"
       "  -e, --fatal-errors         any warning or error that is printed is\n"
       "                             treated as fatal\n"
       "  -m, --mark-stdio           mark stdio writes with [rr.<EVENT-NO>],\n"
       "                             where EVENT-NO is the global trace time "
       "at\n"
       "                             which the write occures.\n"
+      "  -P, --ptrace-profile=<FILE>\n"
+      "                             time rr's ptrace calls and the tracees'\n"
+      "                             running time, writing a Chrome trace\n"
+      "                             timeline to FILE and totals to stderr\n"
+      "  -R, --reprobe              probe the CPU and its settings again\n"
+      "                             instead of using the results cached\n"
+      "                             earlier in this boot\n"
       "  -s, --suppress-environment-warnings\n"
       "                             suppress warnings about issues in the\n"
       "                             environment that rr has no control over\n"
@@ -265,40 +1048,181 @@ static void print_usage(void) {
       "\n"
       "Syntax for `record'\n"
       " rr record [OPTION]... <exe> [exe-args]...\n"
+      " rr record [OPTION]... --attach=<PID>\n"
+      "  -a, --attach=<PID>         record the running process PID from now\n"
+      "                             on, instead of starting <exe>.  It must\n"
+      "                             be single-threaded and started with\n"
+      "                             `setarch `uname -m` -R -L', so replay can\n"
+      "                             recreate it from a snapshot.  It's killed\n"
+      "                             when the recording ends\n"
       "  -b, --force-syscall-buffer force the syscall buffer preload library\n"
       "                             to be used, even if that's probably a bad\n"
       "                             idea\n"
+      "  -C, --chaos                randomize timeslices and scheduling\n"
+      "                             priorities, to shake out rare races.\n"
+      "                             The random seed is printed at startup\n"
+      "  -R, --chaos-seed=<SEED>    use SEED for --chaos, to get the same\n"
+      "                             scheduling decisions as an earlier run\n"
+      "  -T, --clock-samples=<NUM>  answer NUM clock_gettime() and\n"
+      "                             gettimeofday() calls from each real\n"
+      "                             reading of the clock, without a\n"
+      "                             syscall.  Those calls see the time\n"
+      "                             advance by the clock's resolution.\n"
+      "                             Needs the syscall buffer\n"
       "  -c, --num-cpu-ticks=<NUM>  maximum number of 'CPU ticks' (currently \n"
       "                             retired conditional branches) to allow a \n"
-      "                             task to run before interrupting it\n"
+      "                             task to run before interrupting it.\n"
+      "                             By default, tasks that keep using up \n"
+      "                             their timeslice get longer ones\n"
+      "  -d, --stripe-dir=<DIR>     stripe the trace's data stream across\n"
+      "                             files in each DIR given (typically one\n"
+      "                             per disk), to write it at their\n"
+      "                             combined bandwidth\n"
+      "  -D, --stripe-all           stripe every trace stream, not just the\n"
+      "                             data stream\n"
       "  -e, --num-events=<NUM>     maximum number of events (syscall \n"
       "                             enter/exit, signal, CPU interrupt, ...) \n"
       "                             to allow a task before descheduling it\n"
+      "  -F, --flight-recorder=<SECS>\n"
+      "                             keep only about the last SECS seconds of\n"
+      "                             the trace, discarding older segments up\n"
+      "                             to a process snapshot (see -S, -G), so\n"
+      "                             long recordings use bounded disk space.\n"
+      "                             Replay starts from that snapshot\n"
+      "  -g, --segment-size=<MB>    flush the trace to disk as a finished\n"
+      "                             segment after every MB megabytes of\n"
+      "                             trace data, so that if rr is killed the\n"
+      "                             trace can still be replayed up to the\n"
+      "                             last finished segment\n"
+      "  -G, --segment-secs=<SECS>  likewise, every SECS seconds\n"
       "  -i, --ignore-signal=<SIG>  block <SIG> from being delivered to "
       "tracees.\n"
       "                             Probably only useful for unit tests.\n"
+      "  -M, --multicore            run tracee processes that share no\n"
+      "                             memory with others in parallel, on any\n"
+      "                             CPU, instead of one task at a time on a\n"
+      "                             single CPU.  Implies `-u'\n"
       "  -n, --no-syscall-buffer    disable the syscall buffer preload "
       "library\n"
       "                             even if it would otherwise be used\n"
+      "  -o, --output-sink=<PATH>   stream the trace to the file or FIFO "
+      "PATH,\n"
+      "                             to be unpacked by `rr receive', instead "
+      "of\n"
+      "                             storing it in the trace directory\n"
+      "  -O, --record-only=<PATTERN>\n"
+      "                             only record processes whose executable\n"
+      "                             path or command line matches the shell\n"
+      "                             wildcard PATTERN (may be repeated); others\n"
+      "                             run untraced from their exec on.  Needs\n"
+      "                             -n\n"
+      "  -p, --perf-counters=<LIST> record the totals of up to three extra\n"
+      "                             perf counters in every trace frame,\n"
+      "                             e.g. `cycles,cache-misses'; `dump -s'\n"
+      "                             attributes them to tasks, events and\n"
+      "                             time ranges\n"
+      "  -r, --reflink              reflink copies of mapped files into the\n"
+      "                             trace, or hard-link read-only files, on\n"
+      "                             filesystems that allow it\n"
+      "  -s, --shared-store         keep copies of mapped files in a store\n"
+      "                             shared by all traces, linked into each\n"
+      "                             trace; see `rr gc'\n"
+      "  -S, --snapshot-interval=<EVENTS>\n"
+      "                             snapshot a single-threaded tracee every\n"
+      "                             EVENTS events, so that `replay -g' can\n"
+      "                             start from the nearest snapshot\n"
+      "  -t, --stats-file=<FILE>    rewrite FILE every second with live\n"
+      "                             counters of the recording as JSON:\n"
+      "                             events/sec by event type, bytes and\n"
+      "                             bytes/sec per trace stream, compression\n"
+      "                             backlog and time spent waiting for it,\n"
+      "                             and the number of live tasks\n"
+      "  -z, --compression=<CODEC>  compress the trace with CODEC, one of\n"
+      "                             `zlib' (the default), `lz4' (fastest) "
+      "or\n"
+      "                             `zstd' (smallest).  Replay detects the\n"
+      "                             codec automatically.\n"
       "\n"
       "Syntax for `replay'\n"
       " rr replay [OPTION]... [<trace-dir>]\n"
       "  -a, --autopilot            replay without debugger server\n"
+      "  -c, --checkpoint-interval=<EVENTS>\n"
+      "                             checkpoint the replay every EVENTS events\n"
+      "                             so that restarting the debugger resumes\n"
+      "                             from the nearest checkpoint\n"
+      "  -C, --checkpoint-secs=<SECS>\n"
+      "                             checkpoint the replay every SECS seconds\n"
+      "                             of replay time\n"
+      "  -D, --diagnose-divergence  like -a, but when a memory checksum (see\n"
+      "                             --checksum) doesn't validate, bisect\n"
+      "                             between it and the last one that did to\n"
+      "                             find the event and the mapping where\n"
+      "                             replay diverged\n"
       "  -f, --onfork=<PID>         start a debug server when <PID> has been\n"
       "                             fork()d, AND the target event has been\n"
       "                             reached.\n"
       "  -g, --goto=<EVENT-NUM>     start a debug server on reaching "
       "<EVENT-NUM>\n"
       "                             in the trace.  See -m above.\n"
+      "  -j, --decompress-threads=<NUM>\n"
+      "                             decompress trace data ahead of replay on\n"
+      "                             NUM background threads (default 1; 0\n"
+      "                             decompresses on demand)\n"
+      "  -K, --save-snapshot=<EVENT-NUM>\n"
+      "                             save a snapshot of the replayed process\n"
+      "                             in the trace at the first syscall exit\n"
+      "                             from <EVENT-NUM> on where it's single-\n"
+      "                             threaded, so that later `replay -g' runs\n"
+      "                             start from it as from a recorded one\n"
+      "  -O, --profile=<FILE>       like -a, but sample the tracees' stacks\n"
+      "                             every -T ticks into FILE, in the format\n"
+      "                             of `perf script'.  Samples are taken at\n"
+      "                             the same instructions in every replay\n"
+      "  -T, --profile-period=<TICKS>\n"
+      "                             sample every TICKS ticks (default\n"
+      "                             500000, about 10ms)\n"
+      "  -k, --max-checkpoints=<NUM>\n"
+      "                             keep at most NUM automatic checkpoints\n"
+      "                             (default 8), thinning out older ones\n"
+      "  -M, --checkpoint-memory=<MB>\n"
+      "                             also thin out automatic checkpoints\n"
+      "                             while they hold more than MB megabytes\n"
+      "                             of memory not shared with the replay\n"
+      "  -P, --parallel=<NUM>       with -a, replay process subtrees that\n"
+      "                             share no memory with the rest of the\n"
+      "                             trace in separate sessions, NUM at a\n"
+      "                             time\n"
       "  -p, --onprocess=<PID>      start a debug server when <PID> has been\n"
       "                             exec()d, AND the target event has been\n"
       "                             reached.\n"
       "  -q, --no-redirect-output   don't replay writes to stdout/stderr\n"
+      "  -t, --target-only          with -p or -f, replay only the target\n"
+      "                             process (and the processes that share\n"
+      "                             its memory) after its fork, emulating\n"
+      "                             the others' effects on it from the\n"
+      "                             trace\n"
+      "  -Q, --quiet-goto           don't replay writes to stdout/stderr\n"
+      "                             made before the -g event, so that\n"
+      "                             replay gets there faster\n"
+      "  -R, --server               like -s, but when the debugger detaches\n"
+      "                             or disconnects, keep the replay and its\n"
+      "                             checkpoints and wait for the next one,\n"
+      "                             which starts where the first one did\n"
+      "  -S, --statistics           print how many frames per second were\n"
+      "                             replayed when replay finishes\n"
       "  -s, --dbgport=<PORT>       only start a debug server on <PORT>;\n"
       "                             don't automatically launch the debugger\n"
       "                             client too.\n"
       "  -x, --gdb-x=<FILE>         execute gdb commands from <FILE>\n"
       "\n"
+      "Syntax for `replay-batch'\n"
+      " rr replay-batch [OPTION]... <trace-dir>...\n"
+      "  Replay each trace to the end with autopilot, several at once on\n"
+      "  separate CPUs, discarding the tracees' output, and print each\n"
+      "  trace's replay time and whether it diverged.\n"
+      "  -j, --jobs=<NUM>           replay NUM traces at once (default: the\n"
+      "                             number of CPUs)\n"
+      "\n"
       "Syntax for `dump`\n"
       " rr dump [OPTIONS] <trace_dir> [<event-spec>...]\n"
       "  Event specs can be either an event number like `127', or a range\n"
@@ -306,43 +1230,260 @@ static void print_usage(void) {
       "  -r, --raw                  dump trace frames in a more easily\n"
       "                             machine-parseable format instead of the\n"
       "                             default human-readable format\n"
-      "  -s, --statistics           dump statistics about the trace\n"
+      "  -s, --statistics           dump statistics about the trace, "
+      "decoding\n"
+      "                             it on -j threads\n"
+      "  -J, --json                 print the statistics as JSON instead "
+      "of\n"
+      "                             dumping frames\n"
       "  -b, --syscallbuf           dump syscallbuf contents\n"
+      "  -t, --tid=<TID>            only dump frames of task <TID>\n"
+      "  -j, --decompress-threads=<NUM>\n"
+      "                             decompress trace data ahead of the dump "
+      "on\n"
+      "                             NUM background threads\n"
+      "\n"
+      "Syntax for `unpack' and `pack'\n"
+      " rr unpack [<trace-dir>]\n"
+      "  Store the trace uncompressed, so that replaying it repeatedly\n"
+      "  doesn't decompress it each time.\n"
+      " rr pack [OPTION]... [<trace-dir>]\n"
+      "  Compress an unpacked (or compressed) trace.\n"
+      "  -z, --compression=<CODEC>  as for `record'\n"
+      "\n"
+      "Syntax for `compact'\n"
+      " rr compact [OPTION]... [<trace-dir> [<output-dir>]]\n"
+      "  Write a copy of the trace to <output-dir> (default\n"
+      "  <trace-dir>-compact) with duplicate data stored once and\n"
+      "  compressed as tightly as possible, for archiving. The copy is\n"
+      "  checked against the original.\n"
+      "  -z, --compression=<CODEC>  as for `record'; defaults to zstd\n"
+      "                             when available\n"
+      "\n"
+      "Syntax for `export'\n"
+      " rr export [OPTION]... [<trace-dir> [<output-dir>]]\n"
+      "  Write the trace's events, per-syscall totals, raw data records\n"
+      "  and mapped regions to <output-dir> (default <trace-dir>-export)\n"
+      "  as tables with a little-endian array file per column, for bulk\n"
+      "  analysis.  Each table's `schema' file lists its columns.\n"
+      "  -j, --decompress-threads=<NUM>\n"
+      "                             decode the trace on NUM threads\n"
+      "                             (default: the number of CPUs)\n"
+      "\n"
+      "Syntax for `verify'\n"
+      " rr verify [OPTION]... [<trace-dir>]\n"
+      "  Check that the trace isn't corrupt or truncated without replaying\n"
+      "  it: every block of every stream must match the checksum it was\n"
+      "  written with, and the block indexes and seek points must match\n"
+      "  the streams.  Exits with status 1 if anything is wrong.\n"
+      "  -j, --threads=<NUM>        check blocks on NUM threads (default:\n"
+      "                             the number of CPUs)\n"
+      "\n"
+      "Syntax for `gc'\n"
+      " rr gc\n"
+      "  Delete the copies in the shared store (see `rr record -s') that\n"
+      "  no trace links to any more.\n"
+      "\n"
+      "Syntax for `receive'\n"
+      " rr receive <trace-dir>\n"
+      "  Create <trace-dir> from a trace streamed to stdin by\n"
+      "  `rr record -o'.\n"
+      "\n"
+      "Syntax for `index-writes'\n"
+      " rr index-writes [OPTION]... [<trace-dir>]\n"
+      "  Replay the trace once and save an index of the recorded data\n"
+      "  replay writes into tracee memory, so the events that last wrote\n"
+      "  an address can be looked up with -q.\n"
+      "  -r, --range=<START>-<END>  only index writes to the addresses\n"
+      "                             [START, END); may be repeated\n"
+      "  -q, --query=<ADDR>         print the last write to ADDR from the\n"
+      "                             saved index instead\n"
+      "  -g, --goto=<EVENT>         with -q, the last write at or before\n"
+      "                             EVENT\n"
+      "  -n, --count=<NUM>          with -q, print the last NUM writes\n"
+      "\n"
+      "Syntax for `diff'\n"
+      " rr diff [OPTION]... <trace-dir1> <trace-dir2>\n"
+      "  Compare two recordings of the same program and report where they\n"
+      "  diverged: the first frame at which their schedules differ, and for\n"
+      "  each task the first event, syscall result or recorded data that\n"
+      "  differs.  Tasks are paired by the order they first appear in.\n"
+      "  Exits with status 1 if the traces diverge.\n"
+      "  -n, --max-divergences=<NUM>\n"
+      "                             stop after reporting NUM divergences\n"
+      "                             (default 10)\n"
       "\n"
       "A command line like `rr (-h|--help|help)...' will print this message.\n",
       stderr);
 }
 
+static bool parse_codec_arg(const char* arg, Flags* flags) {
+  CompressedWriter::Codec codec;
+  if (!CompressedWriter::parse_codec(arg, &codec)) {
+    fprintf(stderr, "Unknown compression codec `%s'\n", arg);
+    return false;
+  }
+  if (!CompressedWriter::codec_supported(codec)) {
+    fprintf(stderr, "This rr was built without %s support\n", arg);
+    return false;
+  }
+  flags->compression_codec = codec;
+  return true;
+}
+
 static int parse_record_args(int cmdi, int argc, char** argv, Flags* flags) {
   struct option opts[] = {
+    { "attach", required_argument, nullptr, 'a' },
     { "force-syscall-buffer", no_argument, nullptr, 'b' },
+    { "chaos", no_argument, nullptr, 'C' },
+    { "chaos-seed", required_argument, nullptr, 'R' },
+    { "clock-samples", required_argument, nullptr, 'T' },
+    { "flight-recorder", required_argument, nullptr, 'F' },
     { "ignore-signal", required_argument, nullptr, 'i' },
     { "num-cpu-ticks", required_argument, nullptr, 'c' },
     { "num-events", required_argument, nullptr, 'e' },
+    { "multicore", no_argument, nullptr, 'M' },
     { "no-syscall-buffer", no_argument, nullptr, 'n' },
+    { "output-sink", required_argument, nullptr, 'o' },
+    { "record-only", required_argument, nullptr, 'O' },
+    { "perf-counters", required_argument, nullptr, 'p' },
+    { "reflink", no_argument, nullptr, 'r' },
+    { "segment-size", required_argument, nullptr, 'g' },
+    { "segment-secs", required_argument, nullptr, 'G' },
+    { "shared-store", no_argument, nullptr, 's' },
+    { "snapshot-interval", required_argument, nullptr, 'S' },
+    { "stats-file", required_argument, nullptr, 't' },
+    { "stripe-all", no_argument, nullptr, 'D' },
+    { "stripe-dir", required_argument, nullptr, 'd' },
+    { "compression", required_argument, nullptr, 'z' },
     { 0 }
   };
   optind = cmdi;
   while (1) {
     int i = 0;
-    switch (getopt_long(argc, argv, "+c:be:i:n", opts, &i)) {
+    switch (getopt_long(argc, argv, "+a:c:bCd:De:F:g:G:i:Mno:O:p:R:rS:st:T:z:", opts, &i)) {
       case -1:
+        if (flags->flight_recorder_secs) {
+          // The window can only start at a snapshot, and the trace can
+          // only be discarded at segment ends.
+          if (!flags->snapshot_interval) {
+            flags->snapshot_interval = 10000;
+          }
+          if (!flags->segment_size_mb && !flags->segment_secs) {
+            flags->segment_secs = max(1u, flags->flight_recorder_secs / 4);
+          }
+          if (!flags->output_sink.empty()) {
+            fprintf(stderr, "--flight-recorder can't be used with "
+                            "--output-sink\n");
+            return -1;
+          }
+        }
+        if (flags->attach_pid) {
+          if (optind < argc) {
+            fprintf(stderr, "--attach doesn't take a program to run\n");
+            return -1;
+          }
+          if (!flags->output_sink.empty()) {
+            fprintf(stderr, "--attach can't be used with --output-sink\n");
+            return -1;
+          }
+        }
+        if (!flags->stripe_dirs.empty() && !flags->output_sink.empty()) {
+          fprintf(stderr, "--stripe-dir can't be used with --output-sink\n");
+          return -1;
+        }
+        if (!flags->record_only.empty() && flags->use_syscall_buffer) {
+          // Processes that have run the syscall buffer's seccomp filter
+          // can't make syscalls without rr.
+          fprintf(stderr, "--record-only requires --no-syscall-buffer\n");
+          return -1;
+        }
+        if (flags->stripe_all_streams && flags->stripe_dirs.empty()) {
+          fprintf(stderr, "--stripe-all requires --stripe-dir\n");
+          return -1;
+        }
         return optind;
+      case 'a':
+        flags->attach_pid = max(0, atoi(optarg));
+        break;
       case 'b':
         flags->use_syscall_buffer = true;
         break;
+      case 'C':
+        flags->chaos = true;
+        break;
+      case 'd':
+        flags->stripe_dirs.push_back(optarg);
+        break;
+      case 'D':
+        flags->stripe_all_streams = true;
+        break;
+      case 'R':
+        flags->chaos = true;
+        flags->chaos_seed = strtoul(optarg, nullptr, 0);
+        break;
       case 'c':
         flags->max_ticks = max(1, atoi(optarg));
+        flags->adaptive_timeslice = false;
         break;
       case 'e':
         flags->max_events = max(1, atoi(optarg));
         break;
+      case 'F':
+        flags->flight_recorder_secs = max(0, atoi(optarg));
+        break;
+      case 'g':
+        flags->segment_size_mb = max(0, atoi(optarg));
+        break;
+      case 'G':
+        flags->segment_secs = max(0, atoi(optarg));
+        break;
       case 'i':
         flags->ignore_sig = min(_NSIG - 1, max(1, atoi(optarg)));
         break;
+      case 'M':
+        flags->multicore = true;
+        // Parallel tasks have to be able to run on different CPUs.
+        flags->cpu_unbound = true;
+        break;
       case 'n':
         flags->use_syscall_buffer = false;
         break;
+      case 'o':
+        flags->output_sink = optarg;
+        break;
+      case 'O':
+        flags->record_only.push_back(optarg);
+        break;
+      case 't':
+        flags->record_stats_path = optarg;
+        break;
+      case 'p':
+        if (!PerfCounters::parse_extra_counters(optarg,
+                                                &flags->extra_perf_counters)) {
+          fprintf(stderr, "Select up to %d of %s\n",
+                  PerfCounters::MAX_EXTRA_COUNTERS,
+                  PerfCounters::known_extra_counters().c_str());
+          return -1;
+        }
+        break;
+      case 'r':
+        flags->clone_files = true;
+        break;
+      case 'S':
+        flags->snapshot_interval = max(0, atoi(optarg));
+        break;
+      case 's':
+        flags->shared_store = true;
+        break;
+      case 'T':
+        flags->clock_sample_interval = max(0, atoi(optarg));
+        break;
+      case 'z':
+        if (!parse_codec_arg(optarg, flags)) {
+          return -1;
+        }
+        break;
       default:
         return -1;
     }
@@ -351,23 +1492,79 @@ static int parse_record_args(int cmdi, int argc, char** argv, Flags* flags) {
 
 static int parse_replay_args(int cmdi, int argc, char** argv, Flags* flags) {
   struct option opts[] = { { "autopilot", no_argument, nullptr, 'a' },
+                           { "checkpoint-interval", required_argument,
+                             nullptr, 'c' },
+                           { "checkpoint-memory", required_argument,
+                             nullptr, 'M' },
+                           { "checkpoint-secs", required_argument, nullptr,
+                             'C' },
                            { "dbgport", required_argument, nullptr, 's' },
+                           { "diagnose-divergence", no_argument, nullptr,
+                             'D' },
                            { "goto", required_argument, nullptr, 'g' },
+                           { "decompress-threads", required_argument, nullptr,
+                             'j' },
+                           { "max-checkpoints", required_argument, nullptr,
+                             'k' },
                            { "no-redirect-output", no_argument, nullptr, 'q' },
                            { "onfork", required_argument, nullptr, 'f' },
                            { "onprocess", required_argument, nullptr, 'p' },
+                           { "parallel", required_argument, nullptr, 'P' },
+                           { "profile", required_argument, nullptr, 'O' },
+                           { "save-snapshot", required_argument, nullptr,
+                             'K' },
+                           { "server", no_argument, nullptr, 'R' },
+                           { "target-only", no_argument, nullptr, 't' },
+                           { "profile-period", required_argument, nullptr,
+                             'T' },
+                           { "quiet-goto", no_argument, nullptr, 'Q' },
+                           { "statistics", no_argument, nullptr, 'S' },
                            { "gdb-x", required_argument, nullptr, 'x' },
                            { 0 } };
+  // Replay knows it'll read the whole trace in order, so keep one
+  // thread decompressing ahead of it while the tracees run.
+  flags->decompress_threads = 1;
   optind = cmdi;
   while (1) {
     int i = 0;
-    switch (getopt_long(argc, argv, "+af:g:p:qs:x:", opts, &i)) {
+    switch (
+        getopt_long(argc, argv, "+aC:c:Df:g:j:K:k:M:O:P:p:QqRSs:tT:x:", opts,
+                    &i)) {
       case -1:
+        if (flags->parallel_replay &&
+            flags->goto_event !=
+                numeric_limits<decltype(flags->goto_event)>::max()) {
+          fprintf(stderr, "--parallel requires --autopilot\n");
+          return -1;
+        }
+        if (!flags->profile_path.empty() && flags->parallel_replay) {
+          fprintf(stderr, "--profile can't be used with --parallel\n");
+          return -1;
+        }
+        if (flags->replay_target_only && !flags->target_process) {
+          fprintf(stderr, "--target-only requires --onprocess or --onfork\n");
+          return -1;
+        }
+        if (flags->replay_target_only && flags->parallel_replay) {
+          fprintf(stderr, "--target-only can't be used with --parallel\n");
+          return -1;
+        }
         return optind;
       case 'a':
         flags->goto_event = numeric_limits<decltype(flags->goto_event)>::max();
         flags->dont_launch_debugger = true;
         break;
+      case 'C':
+        flags->checkpoint_interval_secs = max(0, atoi(optarg));
+        break;
+      case 'D':
+        flags->diagnose_divergence = true;
+        flags->goto_event = numeric_limits<decltype(flags->goto_event)>::max();
+        flags->dont_launch_debugger = true;
+        break;
+      case 'c':
+        flags->checkpoint_interval = max(0, atoi(optarg));
+        break;
       case 'f':
         flags->target_process = atoi(optarg);
         flags->process_created_how = Flags::CREATED_FORK;
@@ -375,17 +1572,53 @@ static int parse_replay_args(int cmdi, int argc, char** argv, Flags* flags) {
       case 'g':
         flags->goto_event = atoi(optarg);
         break;
+      case 'j':
+        flags->decompress_threads = max(0, atoi(optarg));
+        break;
+      case 'K':
+        flags->save_snapshot_event = max(0, atoi(optarg));
+        break;
+      case 'k':
+        flags->max_checkpoints = max(1, atoi(optarg));
+        break;
+      case 'M':
+        flags->checkpoint_memory_mb = max(0, atoi(optarg));
+        break;
+      case 'O':
+        flags->profile_path = optarg;
+        flags->goto_event = numeric_limits<decltype(flags->goto_event)>::max();
+        flags->dont_launch_debugger = true;
+        break;
+      case 'P':
+        flags->parallel_replay = max(0, atoi(optarg));
+        break;
       case 'p':
         flags->target_process = atoi(optarg);
         flags->process_created_how = Flags::CREATED_EXEC;
         break;
+      case 'Q':
+        flags->quiet_goto = true;
+        break;
       case 'q':
         flags->redirect = false;
         break;
+      case 'R':
+        flags->replay_server = true;
+        flags->dont_launch_debugger = true;
+        break;
+      case 'S':
+        flags->replay_statistics = true;
+        break;
       case 's':
         flags->dbgport = atoi(optarg);
         flags->dont_launch_debugger = true;
         break;
+      case 't':
+        flags->replay_target_only = true;
+        break;
+      case 'T':
+        flags->profile_period = max(1LL, atoll(optarg));
+        break;
       case 'x':
         flags->gdb_command_file_path = optarg;
         break;
@@ -397,40 +1630,209 @@ static int parse_replay_args(int cmdi, int argc, char** argv, Flags* flags) {
 
 static int parse_dump_args(int cmdi, int argc, char** argv, Flags* flags) {
   struct option opts[] = { { "syscallbuf", no_argument, nullptr, 'b' },
+                           { "decompress-threads", required_argument, nullptr,
+                             'j' },
+                           { "json", no_argument, nullptr, 'J' },
                            { "raw", no_argument, nullptr, 'r' },
                            { "statistics", no_argument, nullptr, 's' },
+                           { "stats", no_argument, nullptr, 's' },
+                           { "tid", required_argument, nullptr, 't' },
                            { 0 } };
   optind = cmdi;
   while (1) {
     int i = 0;
-    switch (getopt_long(argc, argv, "brs", opts, &i)) {
+    switch (getopt_long(argc, argv, "bj:Jrst:", opts, &i)) {
       case -1:
         return optind;
       case 'b':
         flags->dump_syscallbuf = true;
         break;
+      case 'j':
+        flags->decompress_threads = max(0, atoi(optarg));
+        break;
+      case 'J':
+        flags->dump_json = true;
+        break;
       case 'r':
         flags->raw_dump = true;
         break;
       case 's':
         flags->dump_statistics = true;
         break;
+      case 't':
+        flags->dump_tid = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+}
+
+static int parse_pack_args(int cmdi, int argc, char** argv, Flags* flags) {
+  struct option opts[] = { { "compression", required_argument, nullptr, 'z' },
+                           { 0 } };
+  optind = cmdi;
+  while (1) {
+    int i = 0;
+    switch (getopt_long(argc, argv, "z:", opts, &i)) {
+      case -1:
+        return optind;
+      case 'z':
+        if (!parse_codec_arg(optarg, flags)) {
+          return -1;
+        }
+        break;
+      default:
+        return -1;
+    }
+  }
+}
+
+static int parse_index_writes_args(int cmdi, int argc, char** argv,
+                                   Flags* flags) {
+  struct option opts[] = { { "count", required_argument, nullptr, 'n' },
+                           { "goto", required_argument, nullptr, 'g' },
+                           { "query", required_argument, nullptr, 'q' },
+                           { "range", required_argument, nullptr, 'r' },
+                           { 0 } };
+  optind = cmdi;
+  while (1) {
+    int i = 0;
+    switch (getopt_long(argc, argv, "g:n:q:r:", opts, &i)) {
+      case -1:
+        return optind;
+      case 'g':
+        flags->index_query_time = atoi(optarg);
+        break;
+      case 'n':
+        flags->index_query_count = max(1, atoi(optarg));
+        break;
+      case 'q':
+        flags->index_query = true;
+        flags->index_query_addr = strtoull(optarg, nullptr, 0);
+        break;
+      case 'r': {
+        char* end;
+        uint64_t start = strtoull(optarg, &end, 0);
+        if (*end != '-') {
+          fprintf(stderr, "Bad address range `%s'\n", optarg);
+          return -1;
+        }
+        flags->index_ranges.push_back(
+            make_pair(start, strtoull(end + 1, nullptr, 0)));
+        break;
+      }
+      default:
+        return -1;
+    }
+  }
+}
+
+static int parse_diff_args(int cmdi, int argc, char** argv, Flags* flags) {
+  struct option opts[] = { { "max-divergences", required_argument, nullptr,
+                             'n' },
+                           { 0 } };
+  // Both traces are read in order, so decompress ahead of the diff.
+  flags->decompress_threads = 1;
+  optind = cmdi;
+  while (1) {
+    int i = 0;
+    switch (getopt_long(argc, argv, "n:", opts, &i)) {
+      case -1:
+        return optind;
+      case 'n':
+        flags->diff_max_divergences = max(1, atoi(optarg));
+        break;
+      default:
+        return -1;
+    }
+  }
+}
+
+static int parse_export_args(int cmdi, int argc, char** argv,
+                             Flags* flags) {
+  struct option opts[] = { { "decompress-threads", required_argument, nullptr,
+                             'j' },
+                           { 0 } };
+  flags->decompress_threads = get_num_cpus();
+  optind = cmdi;
+  while (1) {
+    int i = 0;
+    switch (getopt_long(argc, argv, "j:", opts, &i)) {
+      case -1:
+        return optind;
+      case 'j':
+        flags->decompress_threads = max(1, atoi(optarg));
+        break;
+      default:
+        return -1;
+    }
+  }
+}
+
+static int parse_verify_args(int cmdi, int argc, char** argv,
+                             Flags* flags) {
+  struct option opts[] = { { "threads", required_argument, nullptr, 'j' },
+                           { 0 } };
+  flags->verify_threads = get_num_cpus();
+  optind = cmdi;
+  while (1) {
+    int i = 0;
+    switch (getopt_long(argc, argv, "j:", opts, &i)) {
+      case -1:
+        return optind;
+      case 'j':
+        flags->verify_threads = max(1, atoi(optarg));
+        break;
+      default:
+        return -1;
+    }
+  }
+}
+
+static int parse_replay_batch_args(int cmdi, int argc, char** argv,
+                                   Flags* flags) {
+  struct option opts[] = { { "jobs", required_argument, nullptr, 'j' },
+                           { 0 } };
+  flags->dont_launch_debugger = true;
+  flags->replay_batch_jobs = get_num_cpus();
+  optind = cmdi;
+  while (1) {
+    int i = 0;
+    switch (getopt_long(argc, argv, "j:", opts, &i)) {
+      case -1:
+        return optind;
+      case 'j':
+        flags->replay_batch_jobs = max(1, atoi(optarg));
+        break;
       default:
         return -1;
     }
   }
 }
 
+static int parse_compact_args(int cmdi, int argc, char** argv,
+                              Flags* flags) {
+  if (CompressedWriter::codec_supported(CompressedWriter::CODEC_ZSTD)) {
+    flags->compression_codec = CompressedWriter::CODEC_ZSTD;
+  }
+  return parse_pack_args(cmdi, argc, argv, flags);
+}
+
 static int parse_common_args(int argc, char** argv, Flags* flags) {
   struct option opts[] = {
     { "checksum", required_argument, nullptr, 'c' },
-    { "check-cached-mmaps", no_argument, nullptr, 'k' },
+    { "check-cached-mmaps", optional_argument, nullptr, 'k' },
     { "cpu-unbound", no_argument, nullptr, 'u' },
     { "dump-at", required_argument, nullptr, 't' },
     { "dump-on", required_argument, nullptr, 'd' },
     { "force-things", no_argument, nullptr, 'f' },
     { "force-microarch", required_argument, nullptr, 'a' },
+    { "incremental-checksum", no_argument, nullptr, 'i' },
+    { "log-ring", required_argument, nullptr, 'l' },
     { "mark-stdio", no_argument, nullptr, 'm' },
+    { "ptrace-profile", required_argument, nullptr, 'P' },
+    { "reprobe", no_argument, nullptr, 'R' },
     { "suppress-environment-warnings", no_argument, nullptr, 's' },
     { "fatal-errors", no_argument, nullptr, 'e' },
     { "verbose", no_argument, nullptr, 'v' },
@@ -439,7 +1841,7 @@ static int parse_common_args(int argc, char** argv, Flags* flags) {
   };
   while (1) {
     int i = 0;
-    switch (getopt_long(argc, argv, "+a:c:d:efkmst:uvw:", opts, &i)) {
+    switch (getopt_long(argc, argv, "+a:c:d:efik::l:mP:Rst:uvw:", opts, &i)) {
       case -1:
         return optind;
       case 'a':
@@ -466,12 +1868,31 @@ static int parse_common_args(int argc, char** argv, Flags* flags) {
       case 'f':
         flags->force_things = true;
         break;
+      case 'i':
+        flags->checksum_incremental = true;
+        break;
       case 'k':
         flags->check_cached_mmaps = true;
+        if (optarg) {
+          flags->check_cached_mmaps_rate = strtod(optarg, nullptr);
+          if (!(flags->check_cached_mmaps_rate > 0 &&
+                flags->check_cached_mmaps_rate <= 1)) {
+            return -1;
+          }
+        }
+        break;
+      case 'l':
+        flags->log_ring_records = atoi(optarg);
         break;
       case 'm':
         flags->mark_stdio = true;
         break;
+      case 'P':
+        flags->ptrace_profile = optarg;
+        break;
+      case 'R':
+        flags->reprobe = true;
+        break;
       case 's':
         flags->suppress_environment_warnings = true;
         break;
@@ -496,7 +1917,17 @@ static int parse_common_args(int argc, char** argv, Flags* flags) {
 enum Command {
   RECORD,
   REPLAY,
-  DUMP_EVENTS
+  DUMP_EVENTS,
+  PACK,
+  UNPACK,
+  COMPACT,
+  GC,
+  RECEIVE,
+  INDEX_WRITES,
+  DIFF,
+  EXPORT,
+  REPLAY_BATCH,
+  VERIFY
 };
 
 static int parse_args(int argc, char** argv, Flags* flags, Command* command) {
@@ -505,6 +1936,7 @@ static int parse_args(int argc, char** argv, Flags* flags, Command* command) {
   int cmdi;
 
   flags->max_ticks = Flags::DEFAULT_MAX_TICKS;
+  flags->adaptive_timeslice = true;
   flags->max_events = Flags::DEFAULT_MAX_EVENTS;
   flags->checksum = Flags::CHECKSUM_NONE;
   flags->dbgport = -1;
@@ -531,10 +1963,50 @@ static int parse_args(int argc, char** argv, Flags* flags, Command* command) {
     *command = REPLAY;
     return parse_replay_args(cmdi + 1, argc, argv, flags);
   }
+  if (!strcmp("replay-batch", cmd)) {
+    *command = REPLAY_BATCH;
+    return parse_replay_batch_args(cmdi + 1, argc, argv, flags);
+  }
   if (!strcmp("dump", cmd)) {
     *command = DUMP_EVENTS;
     return parse_dump_args(cmdi + 1, argc, argv, flags);
   }
+  if (!strcmp("pack", cmd)) {
+    *command = PACK;
+    return parse_pack_args(cmdi + 1, argc, argv, flags);
+  }
+  if (!strcmp("unpack", cmd)) {
+    *command = UNPACK;
+    return cmdi + 1;
+  }
+  if (!strcmp("compact", cmd)) {
+    *command = COMPACT;
+    return parse_compact_args(cmdi + 1, argc, argv, flags);
+  }
+  if (!strcmp("export", cmd)) {
+    *command = EXPORT;
+    return parse_export_args(cmdi + 1, argc, argv, flags);
+  }
+  if (!strcmp("verify", cmd)) {
+    *command = VERIFY;
+    return parse_verify_args(cmdi + 1, argc, argv, flags);
+  }
+  if (!strcmp("gc", cmd)) {
+    *command = GC;
+    return cmdi + 1;
+  }
+  if (!strcmp("receive", cmd)) {
+    *command = RECEIVE;
+    return cmdi + 1;
+  }
+  if (!strcmp("index-writes", cmd)) {
+    *command = INDEX_WRITES;
+    return parse_index_writes_args(cmdi + 1, argc, argv, flags);
+  }
+  if (!strcmp("diff", cmd)) {
+    *command = DIFF;
+    return parse_diff_args(cmdi + 1, argc, argv, flags);
+  }
   if (!strcmp("help", cmd) || !strcmp("-h", cmd) || !strcmp("--help", cmd)) {
     return -1;
   }
@@ -574,14 +2046,25 @@ int main(int argc, char* argv[]) {
 
   Command command;
   if (0 > (argi = parse_args(argc, argv, flags, &command)) || argc < argi ||
-      // |rr replay| is allowed to have no arguments to replay
+      // |rr replay|, |rr pack|, |rr unpack|, |rr compact|, |rr export|,
+      // |rr verify| and |rr index-writes| are allowed to have no arguments, to use
       // the most recently saved trace.
-      (REPLAY != command && argc <= argi)) {
+      ((RECORD == command || DUMP_EVENTS == command ||
+        RECEIVE == command || DIFF == command ||
+        REPLAY_BATCH == command) &&
+       argc <= argi && !flags->attach_pid)) {
     print_usage();
     return 1;
   }
 
+  if (flags->log_ring_records > 0) {
+    LogRing::init(flags->log_ring_records);
+  }
+  if (!flags->ptrace_profile.empty()) {
+    PtraceProfiler::init(flags->ptrace_profile);
+  }
   assert_prerequisites(flags);
+  raise_fd_limit();
   if (!flags->suppress_environment_warnings) {
     check_performance_settings();
   }
@@ -609,6 +2092,12 @@ int main(int argc, char* argv[]) {
       LOG(info) << "Syscall buffer disabled by flag";
       unsetenv(SYSCALLBUF_ENABLED_ENV_VAR);
     }
+    if (flags->clock_sample_interval) {
+      setenv(SYSCALLBUF_CLOCK_SAMPLE_ENV_VAR,
+             to_string(flags->clock_sample_interval).c_str(), 1);
+    } else {
+      unsetenv(SYSCALLBUF_CLOCK_SAMPLE_ENV_VAR);
+    }
     flags->syscall_buffer_lib_path = find_syscall_buffer_library();
   }
 
@@ -621,8 +2110,28 @@ int main(int argc, char* argv[]) {
       return record(rr_exe, argc, argv, environ);
     case REPLAY:
       return replay(argc, argv, environ);
+    case REPLAY_BATCH:
+      return replay_batch(argc, argv, environ);
     case DUMP_EVENTS:
       return dump(argc, argv, environ);
+    case PACK:
+      return pack(argc, argv, environ);
+    case UNPACK:
+      return unpack(argc, argv, environ);
+    case COMPACT:
+      return compact(argc, argv, environ);
+    case EXPORT:
+      return export_tables(argc, argv, environ);
+    case VERIFY:
+      return verify(argc, argv, environ);
+    case GC:
+      return gc(argc, argv, environ);
+    case RECEIVE:
+      return receive(argc, argv, environ);
+    case INDEX_WRITES:
+      return index_writes(argc, argv, environ);
+    case DIFF:
+      return diff(argc, argv, environ);
     default:
       FATAL() << "Unknown option " << command;
       return 0; // unreached
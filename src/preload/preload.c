@@ -40,12 +40,14 @@
  * XShmQueryExtension.
  */
 
+#include <cpuid.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <link.h>
 #include <linux/futex.h>
 #include <linux/net.h>
 #include <linux/perf_event.h>
+#include <immintrin.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
@@ -99,18 +101,33 @@ struct syscall_info {
 
 /* Nonzero when syscall buffering is enabled. */
 static int buffer_enabled;
+/* When nonzero, each real sample of a clock answers this many more
+ * reads of it, set from |SYSCALLBUF_CLOCK_SAMPLE_ENV_VAR|.  Those
+ * reads make no syscall and write no record: the time they return is
+ * computed from the sample, so replay computes the same time. */
+static int clock_sample_interval;
 /* Nonzero after process-global state like the seccomp-bpf has been
  * initialized. */
 static int process_inited;
+/* Nonzero when the vdso still needs monkeypatching by the first
+ * |rrcall_init_buffers()|. */
+static int vdso_patch_pending;
 
 /* Nonzero when thread-local state like the syscallbuf has been
  * initialized.  */
 static __thread int thread_inited;
+/* Nonzero in a thread started by |pthread_create()| until its first
+ * attempt to buffer a syscall, which initializes its thread-local
+ * state.  Threads that never buffer a syscall never set up a
+ * syscallbuf. */
+static __thread int thread_init_pending;
 /* When buffering is enabled, points at the thread's mapped buffer
  * segment.  At the start of the segment is an object of type |struct
  * syscallbuf_hdr|, so |buffer| is also a pointer to the buffer
  * header. */
 static __thread uint8_t* buffer;
+/* Size of |buffer|, which rr chooses per thread. */
+static __thread size_t buffer_size;
 /* This is used to support the buffering of "may-block" system calls.
  * The problem that needs to be addressed can be introduced with a
  * simple example; assume that we're buffering the "read" and "write"
@@ -177,16 +194,16 @@ static uint8_t* buffer_last(void) {
  * Return a pointer to the byte just after the very end of the mapped
  * region.
  */
-static uint8_t* buffer_end(void) { return buffer + SYSCALLBUF_BUFFER_SIZE; }
+static uint8_t* buffer_end(void) { return buffer + buffer_size; }
 
 #define MEMCPY_UNROLL 4
 #define MEMCPY_WORD uintptr_t
 
 /**
  * Same as libc memcpy(), but usable within syscallbuf transaction
- * critical sections.
+ * critical sections.  This version works on any CPU.
  */
-static void local_memcpy(void* dest, const void* source, size_t n) {
+static void local_memcpy_words(void* dest, const void* source, size_t n) {
   char* dst = dest;
   const char* src = source;
   static const size_t block_size = MEMCPY_UNROLL * sizeof(MEMCPY_WORD);
@@ -215,6 +232,100 @@ static void local_memcpy(void* dest, const void* source, size_t n) {
   }
 }
 
+/**
+ * Like local_memcpy_words(), but copies 64 bytes at a time through the
+ * SSE2 registers once |dest| is 16-byte aligned.
+ */
+__attribute__((target("sse2"))) static void local_memcpy_sse2(
+    void* dest, const void* source, size_t n) {
+  char* dst = dest;
+  const char* src = source;
+  char* dst_end = dst + n;
+
+  while (dst < dst_end && ((uintptr_t)dst & 15)) {
+    *dst++ = *src++;
+  }
+  while (dst_end - dst >= 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*)src);
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+    _mm_store_si128((__m128i*)dst, a);
+    _mm_store_si128((__m128i*)(dst + 16), b);
+    _mm_store_si128((__m128i*)(dst + 32), c);
+    _mm_store_si128((__m128i*)(dst + 48), d);
+    src += 64;
+    dst += 64;
+  }
+  while (dst < dst_end) {
+    *dst++ = *src++;
+  }
+}
+
+/**
+ * Like local_memcpy_sse2(), but through the AVX registers, 128 bytes
+ * at a time once |dest| is 32-byte aligned.
+ */
+__attribute__((target("avx"))) static void local_memcpy_avx(
+    void* dest, const void* source, size_t n) {
+  char* dst = dest;
+  const char* src = source;
+  char* dst_end = dst + n;
+
+  while (dst < dst_end && ((uintptr_t)dst & 31)) {
+    *dst++ = *src++;
+  }
+  while (dst_end - dst >= 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)src);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+    _mm256_store_si256((__m256i*)dst, a);
+    _mm256_store_si256((__m256i*)(dst + 32), b);
+    _mm256_store_si256((__m256i*)(dst + 64), c);
+    _mm256_store_si256((__m256i*)(dst + 96), d);
+    src += 128;
+    dst += 128;
+  }
+  while (dst < dst_end) {
+    *dst++ = *src++;
+  }
+}
+
+/* The local_memcpy_*() variant for this CPU, picked by
+ * |choose_local_memcpy()|. */
+static void (*local_memcpy)(void* dest, const void* source,
+                            size_t n) = local_memcpy_words;
+
+/**
+ * Point |local_memcpy| at the widest copy loop this CPU and kernel
+ * support.  Recording and replay run on the same machine, so they
+ * pick the same one.
+ */
+static void choose_local_memcpy(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return;
+  }
+  if ((ecx & bit_AVX) && (ecx & bit_OSXSAVE)) {
+    unsigned int xcr0_lo, xcr0_hi;
+    /* xgetbv, spelled out so this file builds without -mxsave. */
+    __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0"
+                         : "=a"(xcr0_lo), "=d"(xcr0_hi)
+                         : "c"(0));
+    (void)xcr0_hi;
+    /* The kernel has to save the SSE and AVX state for us. */
+    if ((xcr0_lo & 6) == 6) {
+      local_memcpy = local_memcpy_avx;
+      return;
+    }
+  }
+  if (edx & bit_SSE2) {
+    local_memcpy = local_memcpy_sse2;
+  }
+}
+
 /* The following are wrappers for the syscalls invoked by this library
  * itself.  These syscalls will generate ptrace traps. */
 
@@ -426,6 +537,8 @@ static long untraced_socketcall(int call, long a0, long a1, long a2, long a3,
 #define untraced_socketcall0(no) untraced_socketcall1(no, 0)
 #endif
 
+extern __attribute__((visibility("hidden"))) void _remote_syscall_stub(void);
+
 #if RR_SYSCALL_FILTERING
 extern
     __attribute__((visibility("hidden"))) void _vsyscall_hook_trampoline(void);
@@ -553,6 +666,9 @@ static void set_up_buffer(void) {
   args.traced_syscall_ip = get_traced_syscall_entry_point();
   args.untraced_syscall_ip = get_untraced_syscall_entry_point();
   args.desched_counter_fd = desched_counter_fd;
+  args.monkeypatch_vdso = vdso_patch_pending;
+  args.vsyscall_hook_trampoline = &_vsyscall_hook_trampoline;
+  args.remote_syscall_stub = &_remote_syscall_stub;
 
   /* Trap to rr: let the magic begin!
    *
@@ -561,9 +677,11 @@ static void set_up_buffer(void) {
    * syscalls.  But the tracee will set the guard when (or if)
    * the signal is unblocked. */
   rrcall_init_buffers(&args);
+  vdso_patch_pending = 0;
 
   /* rr initializes the buffer header. */
   buffer = args.syscallbuf_ptr;
+  buffer_size = args.syscallbuf_size;
 }
 
 /**
@@ -592,6 +710,7 @@ static void init_thread(void) {
 static void post_fork_child(void) {
   buffer = NULL;
   thread_inited = 0;
+  thread_init_pending = 0;
   init_thread();
 }
 
@@ -605,8 +724,11 @@ static void __attribute__((constructor)) init_process(void) {
   real_pthread_mutex_timedlock = dlsym(RTLD_NEXT, "pthread_mutex_timedlock");
 
   buffer_enabled = !!getenv(SYSCALLBUF_ENABLED_ENV_VAR);
+  choose_local_memcpy();
 
   if (buffer_enabled) {
+    const char* interval = getenv(SYSCALLBUF_CLOCK_SAMPLE_ENV_VAR);
+    clock_sample_interval = interval ? atoi(interval) : 0;
     install_syscall_filter();
   } else {
     debug("Syscall buffering is disabled");
@@ -614,8 +736,13 @@ static void __attribute__((constructor)) init_process(void) {
 
   pthread_atfork(NULL, NULL, post_fork_child);
   /* Always monkeypatch, since x86-64 needs vdso symbols overridden.  x86
-   * can avoid monkeypatching if we're not using the syscallbuf. */
-  rrcall_monkeypatch_vdso(&_vsyscall_hook_trampoline, buffer_enabled);
+   * can avoid monkeypatching if we're not using the syscallbuf.  When
+   * we're about to set up this thread's buffer, let that rrcall do it. */
+  if (buffer_enabled) {
+    vdso_patch_pending = 1;
+  } else {
+    rrcall_monkeypatch_vdso(&_vsyscall_hook_trampoline, buffer_enabled);
+  }
   process_inited = 1;
 
   init_thread();
@@ -635,11 +762,15 @@ static void* thread_trampoline(void* arg) {
   struct thread_func_data* data = arg;
   void* ret;
 
-  init_thread();
+  /* Setting up a syscallbuf costs a shmem segment and several traced
+   * syscalls, so wait until the thread wants one; see
+   * |prep_syscall()|. */
+  thread_init_pending = 1;
 
   ret = data->start_routine(data->arg);
 
   /* We don't want glibc re-entering us during thread cleanup. */
+  thread_init_pending = 0;
   buffer = NULL;
   free(data);
   return ret;
@@ -772,6 +903,12 @@ int pthread_mutex_trylock(pthread_mutex_t* mutex) {
  */
 
 static void* prep_syscall(void) {
+  if (!buffer && thread_init_pending) {
+    /* Cleared first, so a signal handler that buffers a syscall
+     * while the buffer is being set up takes the traced path. */
+    thread_init_pending = 0;
+    init_thread();
+  }
   if (!buffer) {
     return NULL;
   }
@@ -781,9 +918,12 @@ static void* prep_syscall(void) {
     return NULL;
   }
   /* We don't need to worry about a race between testing
-   * |locked| and setting it here. rr recording is responsible
-   * for ensuring signals are not delivered during
-   * syscall_buffer prologue and epilogue code.
+   * |locked| and setting it here.  rr may deliver a signal in
+   * between, but a handler that buffers syscalls there will
+   * have committed its records and unlocked the buffer again
+   * by the time it returns, and |buffer_last()| is only read
+   * below, after locking.  Once the buffer is locked, rr steps
+   * the tracee out of the critical section before delivering.
    *
    * XXX except for synchronous signals generated in the syscall
    * buffer code, while reading/writing user pointers */
@@ -842,6 +982,11 @@ static int start_commit_buffered_syscall(int syscallno, void* record_end,
      * we failed to lock the buffer. Just bail out. */
     return 0;
   }
+  if (record_end - record_start > SYSCALLBUF_MAX_RECORD_SIZE) {
+    /* Too big to describe in |rec->size|.  Trap to rr instead. */
+    buffer_hdr()->locked = 0;
+    return 0;
+  }
   if (stored_end > (void*)buffer_end() - sizeof(struct syscallbuf_record)) {
     /* Buffer overflow.
      * Unlock the buffer and then execute the system call
@@ -953,6 +1098,112 @@ static long commit_raw_syscall(int syscallno, void* record_end, int ret) {
   return ret;
 }
 
+/**
+ * Return the total length of the buffers described by the |iovcnt|
+ * iovecs |iov|, or -1 if they can't possibly fit in the syscallbuf.
+ */
+static ssize_t iovecs_len(const struct iovec* iov, size_t iovcnt) {
+  size_t total = 0;
+  size_t i;
+
+  if (iovcnt > buffer_size / sizeof(*iov)) {
+    return -1;
+  }
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > buffer_size - total) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+/**
+ * Make the |iovcnt| iovecs |iov2| describe consecutive buffers
+ * starting at |data|, with the same lengths as those of |iov|.
+ */
+static void set_up_iovecs(struct iovec* iov2, const struct iovec* iov,
+                          size_t iovcnt, uint8_t* data) {
+  size_t i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    iov2[i].iov_base = data;
+    iov2[i].iov_len = iov[i].iov_len;
+    data += iov[i].iov_len;
+  }
+}
+
+/**
+ * Scatter the first |len| bytes of |data| into the buffers described
+ * by the |iovcnt| iovecs |iov|.
+ */
+static void copy_to_iovecs(const struct iovec* iov, size_t iovcnt,
+                           const uint8_t* data, size_t len) {
+  size_t i;
+
+  for (i = 0; i < iovcnt && len > 0; ++i) {
+    size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+    local_memcpy(iov[i].iov_base, data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+/* How the fds below this block, as far as we've found out. */
+#define NUM_CLASSIFIED_FDS 1024
+enum {
+  FD_UNCLASSIFIED = 0,
+  FD_MAY_BLOCK,
+  FD_WONT_BLOCK
+};
+static uint8_t fd_classes[NUM_CLASSIFIED_FDS];
+
+static long sys_xstat64(const struct syscall_info* call);
+
+/**
+ * Return WONT_BLOCK if reads and writes of |fd| can't block for long,
+ * because it's a regular file or block device, and MAY_BLOCK if they
+ * can.  Syscalls that won't block needn't arm the desched event, which
+ * saves two ioctls each.
+ *
+ * Each fd is classified with a (buffered) fstat() the first time it's
+ * asked about, until it's closed or replaced.  Call this before
+ * |prep_syscall()|.
+ */
+static int fd_blockness(int fd) {
+  struct syscall_info fstat_call;
+  struct stat64 st;
+
+  if (fd < 0 || fd >= NUM_CLASSIFIED_FDS) {
+    return MAY_BLOCK;
+  }
+  if (FD_UNCLASSIFIED == fd_classes[fd]) {
+#if defined(SYS_fstat64)
+    fstat_call.no = SYS_fstat64;
+#else
+    fstat_call.no = SYS_fstat;
+#endif
+    fstat_call.args[0] = fd;
+    fstat_call.args[1] = (long)&st;
+    if (sys_xstat64(&fstat_call)) {
+      return MAY_BLOCK;
+    }
+    fd_classes[fd] = (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+                         ? FD_WONT_BLOCK
+                         : FD_MAY_BLOCK;
+  }
+  return FD_WONT_BLOCK == fd_classes[fd] ? WONT_BLOCK : MAY_BLOCK;
+}
+
+/**
+ * Forget what we know about |fd|, which is being closed or replaced.
+ */
+static void forget_fd_class(int fd) {
+  if (0 <= fd && fd < NUM_CLASSIFIED_FDS) {
+    fd_classes[fd] = FD_UNCLASSIFIED;
+  }
+}
+
 /* Keep syscalls in alphabetical order, please. */
 
 static long sys_access(const struct syscall_info* call) {
@@ -972,17 +1223,68 @@ static long sys_access(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+/**
+ * A thread's last sample of a clock, and how many more reads it can
+ * answer.
+ */
+struct sampled_clock {
+  struct timespec now;
+  int calls_left;
+};
+/* One slot for each clock_gettime() clock id below this, and one more
+ * for gettimeofday(). */
+#define NUM_SAMPLED_CLOCK_IDS 8
+#define SAMPLED_GETTIMEOFDAY NUM_SAMPLED_CLOCK_IDS
+static __thread struct sampled_clock sampled_clocks[NUM_SAMPLED_CLOCK_IDS + 1];
+
+/**
+ * If |clock| can answer another read, advance it by |step_ns| so that
+ * its readings still increase, and return nonzero.
+ */
+static int advance_sampled_clock(struct sampled_clock* clock, long step_ns) {
+  if (clock->calls_left <= 0) {
+    return 0;
+  }
+  --clock->calls_left;
+  clock->now.tv_nsec += step_ns;
+  if (clock->now.tv_nsec >= 1000000000) {
+    clock->now.tv_nsec -= 1000000000;
+    ++clock->now.tv_sec;
+  }
+  return 1;
+}
+
+static void set_clock_sample(struct sampled_clock* clock, time_t sec,
+                             long nsec) {
+  clock->now.tv_sec = sec;
+  clock->now.tv_nsec = nsec;
+  clock->calls_left = clock_sample_interval;
+}
+
 static long sys_clock_gettime(const struct syscall_info* call) {
   const int syscallno = SYS_clock_gettime;
   clockid_t clk_id = (clockid_t)call->args[0];
   struct timespec* tp = (struct timespec*)call->args[1];
 
-  void* ptr = prep_syscall();
+  void* ptr;
   struct timespec* tp2 = NULL;
+  struct sampled_clock* sampled = NULL;
   long ret;
 
   assert(syscallno == call->no);
 
+  if (clock_sample_interval && tp && 0 <= clk_id &&
+      clk_id < NUM_SAMPLED_CLOCK_IDS) {
+    sampled = &sampled_clocks[clk_id];
+    if (advance_sampled_clock(sampled, 1)) {
+      tp->tv_sec = sampled->now.tv_sec;
+      tp->tv_nsec = sampled->now.tv_nsec;
+      return 0;
+    }
+  }
+
+  ptr = prep_syscall();
+
   if (tp) {
     tp2 = ptr;
     ptr += sizeof(*tp2);
@@ -994,6 +1296,9 @@ static long sys_clock_gettime(const struct syscall_info* call) {
   if (tp) {
     local_memcpy(tp, tp2, sizeof(*tp));
   }
+  if (sampled && !ret) {
+    set_clock_sample(sampled, tp->tv_sec, tp->tv_nsec);
+  }
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
@@ -1001,9 +1306,12 @@ static long sys_close(const struct syscall_info* call) {
   const int syscallno = SYS_close;
   int fd = call->args[0];
 
-  void* ptr = prep_syscall();
+  void* ptr;
   long ret;
 
+  forget_fd_class(fd);
+  ptr = prep_syscall();
+
   if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
     return traced_raw_syscall(call);
   }
@@ -1106,6 +1414,51 @@ static int sys_fcntl64_xlk64(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+/**
+ * dup2() and dup3() aren't buffered, but replace the fd they dup onto.
+ */
+static long sys_dup2(const struct syscall_info* call) {
+  forget_fd_class(call->args[1]);
+  return traced_raw_syscall(call);
+}
+
+static long sys_dup3(const struct syscall_info* call) {
+  forget_fd_class(call->args[1]);
+  return traced_raw_syscall(call);
+}
+
+static long sys_epoll_wait(const struct syscall_info* call) {
+  const int syscallno = SYS_epoll_wait;
+  int epfd = call->args[0];
+  struct epoll_event* events = (struct epoll_event*)call->args[1];
+  int maxevents = call->args[2];
+  int timeout = call->args[3];
+
+  void* ptr;
+  struct epoll_event* events2;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (maxevents <= 0 || (size_t)maxevents > buffer_size / sizeof(*events)) {
+    return traced_raw_syscall(call);
+  }
+  ptr = prep_syscall();
+  events2 = ptr;
+  ptr += maxevents * sizeof(*events2);
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     timeout ? MAY_BLOCK : WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall4(syscallno, epfd, events2, maxevents, timeout);
+
+  if (ret > 0) {
+    local_memcpy(events, events2, ret * sizeof(*events));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 #if defined(SYS_fcntl64)
 static long sys_fcntl64(const struct syscall_info* call)
 #else
@@ -1152,6 +1505,35 @@ static long sys_fcntl(const struct syscall_info* call)
   }
 }
 
+#if defined(SYS_fstatat64)
+static long sys_fstatat64(const struct syscall_info* call) {
+  const int syscallno = SYS_fstatat64;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  struct stat64* buf = (struct stat64*)call->args[2];
+  int flags = call->args[3];
+
+  void* ptr = prep_syscall();
+  struct stat64* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf) {
+    buf2 = ptr;
+    ptr += sizeof(*buf2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall4(syscallno, dirfd, pathname, buf2, flags);
+  if (buf2) {
+    local_memcpy(buf, buf2, sizeof(*buf));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 static long sys_futex(const struct syscall_info* call) {
   enum {
     FUTEX_USES_UADDR2 = 1 << 0,
@@ -1159,6 +1541,7 @@ static long sys_futex(const struct syscall_info* call) {
 
   int op = call->args[1];
   int flags = 0;
+  int blockness = WONT_BLOCK;
   switch (FUTEX_CMD_MASK & op) {
     case FUTEX_WAKE:
       break;
@@ -1167,16 +1550,30 @@ static long sys_futex(const struct syscall_info* call) {
       flags |= FUTEX_USES_UADDR2;
       break;
 
-    /* It turns out not to be worth buffering the FUTEX_WAIT*
-     * calls.  When a WAIT call is made, we know almost for sure
-     * that the tracee is going to be desched'd (otherwise the
-     * userspace CAS would have succeeded).  This is unlike
-     * read/write, f.e., where the vast majority of calls aren't
-     * desched'd and the overhead is worth it.  So all that
-     * buffering WAIT does is add the overhead of arming/disarming
-     * desched (which is a measurable perf loss).
+    /* It usually isn't worth buffering the FUTEX_WAIT* calls.
+     * When a WAIT call is made, we know almost for sure that the
+     * tracee is going to be desched'd (otherwise the userspace
+     * CAS would have succeeded).  This is unlike read/write,
+     * f.e., where the vast majority of calls aren't desched'd
+     * and the overhead is worth it.  So all that buffering WAIT
+     * does is add the overhead of arming/disarming desched
+     * (which is a measurable perf loss).
      *
-     * NB: don't ever try to buffer FUTEX_LOCK_PI; it requires
+     * The exception is a WAIT whose futex word has already moved
+     * on from |val|, because the waker got there between the
+     * caller's CAS and this call.  The kernel will almost
+     * certainly fail that with EAGAIN straight away.  The word
+     * can still change back before the kernel looks at it, so
+     * the desched event stays armed. */
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+      if (*(volatile uint32_t*)call->args[0] == (uint32_t)call->args[2]) {
+        return traced_raw_syscall(call);
+      }
+      blockness = MAY_BLOCK;
+      break;
+
+    /* NB: don't ever try to buffer FUTEX_LOCK_PI; it requires
      * special processing in the tracer process (in addition to
      * not being worth doing for perf reasons). */
     default:
@@ -1208,9 +1605,7 @@ static long sys_futex(const struct syscall_info* call) {
     saved_uaddr2 = ptr;
     ptr += sizeof(*saved_uaddr2);
   }
-  /* See above; it's not worth buffering may-block futex
-   * calls. */
-  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1233,6 +1628,52 @@ static long sys_futex(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+/**
+ * Buffer a syscall that takes no arguments, can't block and whose only
+ * output is its return value, such as getpid().  These are
+ * frequent enough that the ptrace round trip was most of their cost.
+ */
+static long sys_generic_nonblocking(const struct syscall_info* call) {
+  void* ptr = prep_syscall();
+  long ret;
+
+  if (!start_commit_buffered_syscall(call->no, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall0(call->no);
+  return commit_raw_syscall(call->no, ptr, ret);
+}
+
+/**
+ * Buffer getdents() or getdents64(); the only difference is the
+ * layout of the records, which we don't look at.
+ */
+static long sys_getdents(const struct syscall_info* call) {
+  const int syscallno = call->no;
+  unsigned int fd = call->args[0];
+  void* dirp = (void*)call->args[1];
+  unsigned int count = call->args[2];
+
+  void* ptr = prep_syscall();
+  void* dirp2 = NULL;
+  long ret;
+
+  if (dirp && count > 0) {
+    dirp2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall3(syscallno, fd, dirp2, count);
+
+  if (dirp2 && ret > 0) {
+    local_memcpy(dirp, dirp2, ret);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_gettimeofday(const struct syscall_info* call) {
   const int syscallno = SYS_gettimeofday;
   struct timeval* tp = (struct timeval*)call->args[0];
@@ -1241,13 +1682,26 @@ static long sys_gettimeofday(const struct syscall_info* call) {
   /* XXX it seems odd that clock_gettime() is spec'd to be
    * async-signal-safe while gettimeofday() isn't, but that's
    * what the docs say! */
-  void* ptr = prep_syscall();
+  void* ptr;
   struct timeval* tp2 = NULL;
   struct timezone* tzp2 = NULL;
+  struct sampled_clock* sampled = NULL;
   long ret;
 
   assert(syscallno == call->no);
 
+  /* The timezone isn't sampled. */
+  if (clock_sample_interval && tp && !tzp) {
+    sampled = &sampled_clocks[SAMPLED_GETTIMEOFDAY];
+    if (advance_sampled_clock(sampled, 1000)) {
+      tp->tv_sec = sampled->now.tv_sec;
+      tp->tv_usec = sampled->now.tv_nsec / 1000;
+      return 0;
+    }
+  }
+
+  ptr = prep_syscall();
+
   if (tp) {
     tp2 = ptr;
     ptr += sizeof(*tp2);
@@ -1266,6 +1720,9 @@ static long sys_gettimeofday(const struct syscall_info* call) {
   if (tzp) {
     local_memcpy(tzp, tzp2, sizeof(*tzp));
   }
+  if (sampled && !ret) {
+    set_clock_sample(sampled, tp->tv_sec, tp->tv_usec * 1000);
+  }
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
@@ -1394,7 +1851,8 @@ static long sys_poll(const struct syscall_info* call) {
     fds2 = ptr;
     ptr += nfds * sizeof(*fds2);
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     timeout ? MAY_BLOCK : WONT_BLOCK)) {
     return traced_raw_syscall(call);
   }
   if (fds2) {
@@ -1415,23 +1873,93 @@ static long sys_poll(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_pread64(const struct syscall_info* call) {
+  const int syscallno = SYS_pread64;
+  int fd = call->args[0];
+  void* buf = (void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr;
+  void* buf2 = NULL;
+  int blockness;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (count >= SYSCALLBUF_DIRECT_READ_SIZE) {
+    return traced_raw_syscall(call);
+  }
+  blockness = fd_blockness(fd);
+  ptr = prep_syscall();
+
+  if (buf && count > 0) {
+    buf2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
+    return traced_raw_syscall(call);
+  }
+
+  /* Pass the offset through untouched; on x86 it takes two args. */
+  ret = untraced_syscall5(syscallno, fd, buf2, count, call->args[3],
+                          call->args[4]);
+
+  if (buf2 && ret > 0) {
+    local_memcpy(buf, buf2, ret);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pwrite64(const struct syscall_info* call) {
+  const int syscallno = SYS_pwrite64;
+  int fd = call->args[0];
+  const void* buf = (const void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr;
+  int blockness;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  blockness = fd_blockness(fd);
+  ptr = prep_syscall();
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall5(syscallno, fd, buf, count, call->args[3],
+                          call->args[4]);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_read(const struct syscall_info* call) {
   const int syscallno = SYS_read;
   int fd = call->args[0];
   void* buf = (void*)call->args[1];
   size_t count = call->args[2];
 
-  void* ptr = prep_syscall();
+  void* ptr;
   void* buf2 = NULL;
+  int blockness;
   long ret;
 
   assert(syscallno == call->no);
 
+  /* The trap to rr costs less than copying this much data twice. */
+  if (count >= SYSCALLBUF_DIRECT_READ_SIZE) {
+    return traced_raw_syscall(call);
+  }
+  blockness = fd_blockness(fd);
+  ptr = prep_syscall();
+
   if (buf && count > 0) {
     buf2 = ptr;
     ptr += count;
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1470,6 +1998,45 @@ static long sys_readlink(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_readv(const struct syscall_info* call) {
+  const int syscallno = SYS_readv;
+  int fd = call->args[0];
+  const struct iovec* iov = (const struct iovec*)call->args[1];
+  int iovcnt = call->args[2];
+
+  void* ptr;
+  struct iovec* iov2;
+  uint8_t* data;
+  ssize_t len = iovcnt >= 0 ? iovecs_len(iov, iovcnt) : -1;
+  int blockness;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (len < 0) {
+    return traced_raw_syscall(call);
+  }
+  /* Read into one buffer described by a copy of |iov|, and scatter
+   * what we got afterwards. */
+  blockness = fd_blockness(fd);
+  ptr = prep_syscall();
+  iov2 = ptr;
+  ptr += iovcnt * sizeof(*iov2);
+  data = ptr;
+  ptr += len;
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
+    return traced_raw_syscall(call);
+  }
+  set_up_iovecs(iov2, iov, iovcnt, data);
+
+  ret = untraced_syscall3(syscallno, fd, iov2, iovcnt);
+
+  if (ret > 0) {
+    copy_to_iovecs(iov, iovcnt, data, ret);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 #if defined(SYS_socketcall)
 static long sys_recv(const struct syscall_info* call) {
 #if defined(SYS_socketcall)
@@ -1518,10 +2085,97 @@ static long sys_recv(const struct syscall_info* call) {
 #endif
 }
 
+static long sys_recvmsg(const struct syscall_info* call) {
+  const int syscallno = SYS_socketcall;
+  long* args = (long*)call->args[1];
+  int sockfd = args[0];
+  struct msghdr* msg = (struct msghdr*)args[1];
+  int flags = args[2];
+
+  void* ptr;
+  struct msghdr* msg2;
+  struct iovec* iov2;
+  void* name2 = NULL;
+  uint8_t* data;
+  ssize_t len;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  /* Leave control messages, which may carry fds, to rr. */
+  if (!msg || msg->msg_control || msg->msg_controllen ||
+      msg->msg_namelen > buffer_size) {
+    return traced_raw_syscall(call);
+  }
+  len = iovecs_len(msg->msg_iov, msg->msg_iovlen);
+  if (len < 0) {
+    return traced_raw_syscall(call);
+  }
+
+  ptr = prep_syscall();
+  msg2 = ptr;
+  ptr += sizeof(*msg2);
+  iov2 = ptr;
+  ptr += msg->msg_iovlen * sizeof(*iov2);
+  if (msg->msg_name) {
+    name2 = ptr;
+    ptr += msg->msg_namelen;
+  }
+  data = ptr;
+  ptr += len;
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  local_memcpy(msg2, msg, sizeof(*msg2));
+  msg2->msg_name = name2;
+  msg2->msg_iov = iov2;
+  set_up_iovecs(iov2, msg->msg_iov, msg->msg_iovlen, data);
+
+  ret = untraced_socketcall3(SYS_RECVMSG, sockfd, msg2, flags);
+
+  if (ret >= 0) {
+    if (name2) {
+      local_memcpy(msg->msg_name, name2, msg2->msg_namelen < msg->msg_namelen
+                                             ? msg2->msg_namelen
+                                             : msg->msg_namelen);
+    }
+    msg->msg_namelen = msg2->msg_namelen;
+    msg->msg_flags = msg2->msg_flags;
+    copy_to_iovecs(msg->msg_iov, msg->msg_iovlen, data, ret);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+/**
+ * Buffer a socketcall that only reads tracee memory, such as
+ * sendto() or sendmsg(), by passing its args block through.
+ */
+static long sys_send(const struct syscall_info* call) {
+  const int syscallno = SYS_socketcall;
+
+  void* ptr = prep_syscall();
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall2(syscallno, call->args[0], call->args[1]);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_socketcall(const struct syscall_info* call) {
   switch (call->args[0]) {
     case SYS_RECV:
       return sys_recv(call);
+    case SYS_RECVMSG:
+      return sys_recvmsg(call);
+    case SYS_SENDMSG:
+    case SYS_SENDTO:
+      return sys_send(call);
     default:
       return traced_raw_syscall(call);
   }
@@ -1582,7 +2236,8 @@ static long sys_write(const struct syscall_info* call) {
   const void* buf = (const void*)call->args[1];
   size_t count = call->args[2];
 
-  void* ptr = prep_syscall();
+  void* ptr;
+  int blockness;
   long ret;
 
   assert(syscallno == call->no);
@@ -1591,8 +2246,12 @@ static long sys_write(const struct syscall_info* call) {
    * fd, because the rr tracer processes them specially.
    *
    * TODO: buffer them normally here. */
-  if (RR_MAGIC_SAVE_DATA_FD == fd ||
-      !start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (RR_MAGIC_SAVE_DATA_FD == fd) {
+    return traced_raw_syscall(call);
+  }
+  blockness = fd_blockness(fd);
+  ptr = prep_syscall();
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1607,12 +2266,16 @@ static long sys_writev(const struct syscall_info* call) {
   const struct iovec* iov = (const struct iovec*)call->args[1];
   unsigned long iovcnt = call->args[2];
 
-  void* ptr = prep_syscall();
+  void* ptr;
+  int blockness;
   long ret;
 
   assert(syscallno == call->no);
 
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  blockness = fd_blockness(fd);
+  ptr = prep_syscall();
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1634,12 +2297,19 @@ __attribute__((visibility("hidden"))) long vsyscall_hook(
     CASE(clock_gettime);
     CASE(close);
     CASE(creat);
+    CASE(dup2);
+    CASE(dup3);
+    CASE(epoll_wait);
 #if defined(SYS_fcntl64)
     CASE(fcntl64);
 #else
     CASE(fcntl);
+#endif
+#if defined(SYS_fstatat64)
+    CASE(fstatat64);
 #endif
     CASE(futex);
+    CASE(getdents);
     CASE(gettimeofday);
 #if defined(SYS__llseek)
     CASE(_llseek);
@@ -1649,8 +2319,11 @@ __attribute__((visibility("hidden"))) long vsyscall_hook(
     CASE(madvise);
     CASE(open);
     CASE(poll);
+    CASE(pread64);
+    CASE(pwrite64);
     CASE(read);
     CASE(readlink);
+    CASE(readv);
 #if defined(SYS_socketcall)
     CASE(socketcall);
 #endif
@@ -1674,6 +2347,23 @@ __attribute__((visibility("hidden"))) long vsyscall_hook(
     case SYS_stat:
 #endif
       return sys_xstat64(call);
+    case SYS_getdents64:
+      return sys_getdents(call);
+    case SYS_getegid:
+    case SYS_geteuid:
+    case SYS_getgid:
+    case SYS_getpgrp:
+    case SYS_getpid:
+    case SYS_getppid:
+    case SYS_gettid:
+    case SYS_getuid:
+#if defined(SYS_getegid32)
+    case SYS_getegid32:
+    case SYS_geteuid32:
+    case SYS_getgid32:
+    case SYS_getuid32:
+#endif
+      return sys_generic_nonblocking(call);
     default:
       return traced_raw_syscall(call);
   }
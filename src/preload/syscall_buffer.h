@@ -23,11 +23,25 @@ extern "C" {
 #define SYSCALLBUF_DESCHED_SIGNAL SIGSYS
 
 #define SYSCALLBUF_LIB_FILENAME "librrpreload.so"
-/* This size counts the header along with record data. */
-#define SYSCALLBUF_BUFFER_SIZE (1 << 20)
+/* These sizes count the header along with record data.  rr picks
+ * each thread's buffer size between the min and max, starting from
+ * the default; see |Task::syscallbuf_size_hint|. */
+#define SYSCALLBUF_DEFAULT_BUFFER_SIZE (1 << 20)
+#define SYSCALLBUF_MIN_BUFFER_SIZE (1 << 16)
+#define SYSCALLBUF_MAX_BUFFER_SIZE (1 << 23)
+/* Records must fit in the 21-bit |syscallbuf_record::size|. */
+#define SYSCALLBUF_MAX_RECORD_SIZE ((1 << 21) - 1)
+/* Reads at least this big aren't buffered, so that the kernel can
+ * write straight into the tracee's buffer instead of into a record
+ * that's then copied out, once during recording and again during
+ * replay. */
+#define SYSCALLBUF_DIRECT_READ_SIZE (1 << 18)
 
 /* Set this env var to enable syscall buffering. */
 #define SYSCALLBUF_ENABLED_ENV_VAR "_RR_USE_SYSCALLBUF"
+/* Set this env var to N to answer N clock reads from each real
+ * sample; see |clock_sample_interval| in preload.c. */
+#define SYSCALLBUF_CLOCK_SAMPLE_ENV_VAR "_RR_CLOCK_SAMPLE_INTERVAL"
 
 /* "Magic" (rr-implemented) syscall that we use to initialize the
  * syscallbuf.
@@ -60,11 +74,35 @@ struct rrcall_init_buffers_params {
   void* untraced_syscall_ip;
   /* The fd we're using to track desched events. */
   int desched_counter_fd;
+  /* Nonzero if rr should also monkeypatch the vdso, as
+   * |rrcall_monkeypatch_vdso()| would, to save the process's first
+   * thread a separate rrcall. */
+  int monkeypatch_vdso;
+  /* Where the patched |__kernel_vsyscall()| should jump. */
+  void* vsyscall_hook_trampoline;
+  /* Where rr can run batches of remote syscalls; see
+   * |struct remote_syscall|. */
+  void* remote_syscall_stub;
 
   /* "Out" params. */
   /* Returned pointer to and size of the shared syscallbuf
    * segment. */
   void* syscallbuf_ptr;
+  size_t syscallbuf_size;
+};
+
+/**
+ * One syscall for |_remote_syscall_stub()| to make.  rr passes it an
+ * array of these.  Bit i of |indirect_args| means |args[i]| is the
+ * address of the argument's value, e.g. an earlier entry's |result|.
+ * The stub's code depends on this layout.
+ */
+struct remote_syscall {
+  long syscallno;
+  long args[6];
+  long indirect_args;
+  /* Out param: the raw kernel return value. */
+  long result;
 };
 
 /**
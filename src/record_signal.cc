@@ -420,9 +420,15 @@ static Completion go_to_a_happy_place(Task* t, siginfo_t* si) {
    * code invoked by the signal runs, so there are no reentrancy
    * problems.
    *
+   * Syscallbuf code that runs while the buffer is unlocked doesn't
+   * need to be stepped out of: it hasn't reserved a record yet, or
+   * has finished committing one, so a handler can run its own
+   * buffered syscalls there.  Only the locked window needs stepping,
+   * which saves a run of singlesteps for every signal that lands in
+   * the library.
+   *
    * The code below determines if the tracee is in a happy place
    * per above, and if not, steps it until it finds one. */
-  struct syscallbuf_hdr initial_hdr;
   struct syscallbuf_hdr* hdr = t->syscallbuf_hdr;
   bool desched_event_maybe_armed = true;
 
@@ -445,7 +451,6 @@ static Completion go_to_a_happy_place(Task* t, siginfo_t* si) {
    * syscallbuf code segfaulting would lead to an infinite
    * single-stepping loop here.. */
 
-  initial_hdr = *hdr;
   while (true) {
     if (!t->is_in_syscallbuf()) {
       /* The tracee is outside the syscallbuf code,
@@ -478,10 +483,10 @@ static Completion go_to_a_happy_place(Task* t, siginfo_t* si) {
                  << t->syscallname(t->desched_rec()->syscallno);
       goto happy_place;
     }
-    if (initial_hdr.locked && !hdr->locked) {
-      /* Tracee just stepped out of a critical
-       * section and into a happy place.. */
-      LOG(debug) << "  tracee just unlocked syscallbuf";
+    if (!hdr->locked) {
+      /* Tracee is outside a critical section, or just
+       * stepped out of one into a happy place.. */
+      LOG(debug) << "  tracee in unlocked syscallbuf code";
       goto happy_place;
     }
 
@@ -583,6 +588,28 @@ static void handle_siginfo(Task* t, siginfo_t* si) {
     return;
   }
 
+  /* The syscallbuf code never executes rdtsc, so a trapped rdtsc is
+   * always at a happy place already.  It's by far the most frequent
+   * SIGSEGV in some programs, so handle it before doing any stepping
+   * checks. */
+  if (SIGSEGV == si->si_signo && try_handle_rdtsc(t)) {
+    return;
+  }
+
+  /* An asynchronous signal that the tracee ignores (explicitly, or
+   * by default like SIGCHLD and SIGWINCH) has no effect on userspace
+   * state.  The kernel only stops us for it because the tracee is
+   * ptraced, so suppressing it here behaves exactly like untraced
+   * delivery, and saves the stepping, the signal events and the
+   * extra resume. */
+  if (PerfCounters::TIME_SLICE_SIGNAL != si->si_signo &&
+      NONDETERMINISTIC_SIG == is_deterministic_signal(si) &&
+      t->is_sig_ignored(si->si_signo)) {
+    LOG(debug) << "  discarding ignored " << signalname(si->si_signo);
+    t->push_event(Event::noop(t->arch()));
+    return;
+  }
+
   if (go_to_a_happy_place(t, si) == INCOMPLETE) {
     /* While stepping, another signal arrived that we
      * "upgraded" to. */
@@ -592,12 +619,6 @@ static void handle_siginfo(Task* t, siginfo_t* si) {
   /* See if this signal occurred because of an rr implementation detail,
    * and fudge t appropriately. */
   switch (si->si_signo) {
-    case SIGSEGV:
-      if (try_handle_rdtsc(t)) {
-        return;
-      }
-      break;
-
     case PerfCounters::TIME_SLICE_SIGNAL:
       assert_is_time_slice_interrupt(t, si);
 
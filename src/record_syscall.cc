@@ -38,6 +38,7 @@
 #include <sys/vfs.h>
 #include <termios.h>
 
+#include <algorithm>
 #include <limits>
 #include <utility>
 
@@ -222,6 +223,38 @@ static ssize_t read_iovs(Task* t, const typename Arch::msghdr& msg,
   return num_iov_bytes;
 }
 
+/**
+ * Copy each range of |from| in |t| to the corresponding range of |to|,
+ * skipping null |to| ranges, with one vectored read and one write.
+ * Return the copied bytes of all the ranges, concatenated.
+ */
+static vector<uint8_t> copy_ranges(Task* t, const vector<MemoryRange>& from,
+                                   const vector<MemoryRange>& to) {
+  assert(from.size() == to.size());
+  size_t total = 0;
+  for (auto& r : to) {
+    total += r.addr.is_null() ? 0 : r.num_bytes;
+  }
+  vector<uint8_t> buf;
+  buf.resize(total);
+  vector<Task::RemoteIovec> src;
+  vector<Task::RemoteIovec> dst;
+  size_t offset = 0;
+  for (size_t i = 0; i < to.size(); ++i) {
+    if (to[i].addr.is_null()) {
+      continue;
+    }
+    src.push_back(
+        Task::RemoteIovec(from[i].addr, to[i].num_bytes, buf.data() + offset));
+    dst.push_back(
+        Task::RemoteIovec(to[i].addr, to[i].num_bytes, buf.data() + offset));
+    offset += to[i].num_bytes;
+  }
+  t->read_bytes_v(src);
+  t->write_bytes_v(dst);
+  return buf;
+}
+
 /**
  * Reserve scratch on T for all pointer members of msghdr and update the scratch
  * pointer passed in. Return TRUE if there's no scratch overflow.
@@ -263,17 +296,19 @@ static bool reserve_scratch_for_msghdr(Task* t, typename Arch::msghdr* msg,
   }
 
   // update child mem
+  vector<MemoryRange> from;
+  vector<MemoryRange> to;
   if (msg->msg_control) {
-    t->remote_memcpy(tmpmsg.msg_control, msg->msg_control,
-                     tmpmsg.msg_controllen);
+    from.push_back(MemoryRange(msg->msg_control, msg->msg_controllen));
+    to.push_back(MemoryRange(tmpmsg.msg_control, tmpmsg.msg_controllen));
   }
   *msg = tmpmsg; // update original msghdr
   t->write_bytes_helper(msg->msg_iov, num_iov_bytes, (const uint8_t*)tmpiovs);
   for (size_t i = 0; i < msg->msg_iovlen; ++i) {
-    auto& iov = iovs[i];
-    auto& tmpiov = tmpiovs[i];
-    t->remote_memcpy(tmpiov.iov_base, iov.iov_base, tmpiov.iov_len);
+    from.push_back(MemoryRange(iovs[i].iov_base, tmpiovs[i].iov_len));
+    to.push_back(MemoryRange(tmpiovs[i].iov_base, tmpiovs[i].iov_len));
   }
+  copy_ranges(t, from, to);
   return true;
 }
 
@@ -657,6 +692,18 @@ template <typename Arch> static bool is_stdio_fd(Task* t, int fd) {
   return false;
 }
 
+/**
+ * Return true if |fd| in |t| refers to a regular file.  Reads of those
+ * don't block for long.
+ */
+static bool is_regular_file_fd(Task* t, int fd) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/fd/%d", t->tid, fd);
+  struct stat st;
+  // stat() rather than open(), which could block on a FIFO.
+  return 0 == stat(path, &st) && S_ISREG(st.st_mode);
+}
+
 /**
  * |t| was descheduled while in a buffered syscall.  We don't want
  * to use scratch memory for the call, because the syscallbuf itself
@@ -695,33 +742,6 @@ static Switchable set_up_scratch_for_syscallbuf(Task* t, int syscallno) {
   }
 }
 
-static bool exec_file_supported(const string& filename) {
-#if defined(__i386__)
-  /* All this function does is reject 64-bit ELF binaries. Everything
-     else we (optimistically) indicate support for. Missing or corrupt
-     files will cause execve to fail normally. When we support 64-bit,
-     this entire function can be removed. */
-  ScopedFd fd(filename.c_str(), O_RDONLY);
-  if (fd < 0) {
-    return true;
-  }
-  char header[5];
-  bool ok = true;
-  if (read(fd, header, sizeof(header)) == sizeof(header)) {
-    if (header[0] == ELFMAG0 && header[1] == ELFMAG1 && header[2] == ELFMAG2 &&
-        header[3] == ELFMAG3 && header[4] == ELFCLASS64) {
-      ok = false;
-    }
-  }
-  return ok;
-#elif defined(__x86_64__)
-  // We support 32-bit and 64-bit binaries.
-  return true;
-#else
-#error unknown architecture
-#endif
-}
-
 template <typename Arch, typename Offset>
 static Switchable prepare_sendfile(Task* t, remote_ptr<void>* scratch) {
   Registers r = t->regs();
@@ -741,6 +761,95 @@ static Switchable prepare_sendfile(Task* t, remote_ptr<void>* scratch) {
   return ALLOW_SWITCH;
 }
 
+/**
+ * Have the io_uring that |t| is setting up post completions only while
+ * its submitter is in io_uring_enter, where they're recorded, by setting
+ * up the ring with IORING_SETUP_DEFER_TASKRUN.  Kernels without it, and
+ * rings it can't be combined with (IORING_SETUP_SQPOLL), fail the setup
+ * with EINVAL, as do rings in tracee memory (IORING_SETUP_NO_MMAP), and
+ * tracees fall back to other I/O.  The tracee's params are copied to
+ * scratch so the flags it sees are its own.
+ */
+template <typename Arch>
+static Switchable prepare_io_uring_setup(Task* t, remote_ptr<void>* scratch) {
+  Registers r = t->regs();
+  remote_ptr<typename Arch::io_uring_params> params = r.arg2();
+
+  push_arg_ptr(t, params);
+  auto params2 = allocate_scratch<typename Arch::io_uring_params>(scratch);
+  if (!can_use_scratch(t, *scratch)) {
+    return abort_scratch(t, "io_uring_setup");
+  }
+  auto p = t->read_mem(params);
+  p.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  // The kernel would set IORING_SQ_TASKRUN whenever it likes.
+  p.flags &= ~IORING_SETUP_TASKRUN_FLAG;
+  if (p.flags & IORING_SETUP_NO_MMAP) {
+    // An unknown flag.
+    p.flags |= 1U << 31;
+  }
+  t->write_mem(params2, p);
+  r.set_arg2(params2);
+  t->set_regs(r);
+  return PREVENT_SWITCH;
+}
+
+/**
+ * Remember the requests |t| is about to submit to the io_uring set up as
+ * |fd|, submitting at most |to_submit| of them, so that what they fill
+ * can be recorded when they complete.
+ */
+template <typename Arch>
+static void prepare_io_uring_enter(Task* t, int fd, uint32_t to_submit) {
+  auto& rings = t->vm()->io_urings();
+  auto it = rings.find(fd);
+  if (it == rings.end() || it->second.sq_ring.is_null() ||
+      it->second.sqes.is_null()) {
+    return;
+  }
+  AddressSpace::IoUring& ring = it->second;
+  remote_ptr<void> sq = ring.sq_ring;
+  uint32_t head = t->read_mem((sq + ring.sq_head).cast<uint32_t>());
+  uint32_t tail = t->read_mem((sq + ring.sq_tail).cast<uint32_t>());
+  uint32_t mask = t->read_mem((sq + ring.sq_ring_mask).cast<uint32_t>());
+  size_t sqe_size = (ring.setup_flags & IORING_SETUP_SQE128) ? 128 : 64;
+  uint32_t count = min(tail - head, to_submit);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t index = (head + i) & mask;
+    if (!(ring.setup_flags & IORING_SETUP_NO_SQARRAY)) {
+      index = t->read_mem((sq + ring.sq_array).cast<uint32_t>() + index);
+    }
+    auto sqe = t->read_mem(
+        (ring.sqes + index * sqe_size).cast<typename Arch::io_uring_sqe>());
+    if (sqe.flags & IOSQE_BUFFER_SELECT) {
+      FATAL() << "io_uring provided buffers aren't supported";
+    }
+    switch (sqe.opcode) {
+      case IORING_OP_FGETXATTR:
+      case IORING_OP_GETXATTR:
+      case IORING_OP_URING_CMD:
+        FATAL() << "io_uring opcode " << int(sqe.opcode)
+                << " isn't supported";
+        break;
+      default:
+        ASSERT(t, sqe.opcode <= IORING_OP_SENDMSG_ZC)
+            << "Unknown io_uring opcode " << int(sqe.opcode);
+        break;
+    }
+    AddressSpace::IoUring::Request request;
+    request.opcode = sqe.opcode;
+    request.addr = sqe.addr;
+    request.addr2 = sqe.off;
+    request.len = sqe.len;
+    if (sqe.opcode == IORING_OP_ACCEPT && sqe.addr && sqe.off) {
+      // The size of the address buffer, before accepting overwrites it.
+      request.len = t->read_mem(
+          remote_ptr<typename Arch::socklen_t>(sqe.off));
+    }
+    ring.requests.insert(make_pair(sqe.user_data, request));
+  }
+}
+
 template <typename Arch> static Switchable rec_prepare_syscall_arch(Task* t) {
   int syscallno = t->ev().Syscall().number;
   /* If we are called again due to a restart_syscall, we musn't
@@ -776,6 +885,7 @@ template <typename Arch> static Switchable rec_prepare_syscall_arch(Task* t) {
   }
 
   switch (syscallno) {
+    case Arch::copy_file_range:
     case Arch::splice: {
       Registers r = t->regs();
       remote_ptr<loff_t> off_in = r.arg2();
@@ -823,14 +933,20 @@ template <typename Arch> static Switchable rec_prepare_syscall_arch(Task* t) {
     case Arch::clone: {
       unsigned long flags = t->regs().arg1();
       push_arg_ptr(t, flags);
-      if (flags & CLONE_UNTRACED) {
+      if (flags & (CLONE_UNTRACED | CLONE_VFORK)) {
         Registers r = t->regs();
         // We can't let tracees clone untraced tasks,
         // because they can create nondeterminism that
         // we can't replay.  So unset the UNTRACED bit
         // and then cover our tracks on exit from
         // clone().
-        r.set_arg1(flags & ~CLONE_UNTRACED);
+        // CLONE_VFORK would suspend the parent in the kernel
+        // until the child execs or exits, but the child
+        // can't make progress until we've finished with the
+        // parent's clone().  So unset it too and emulate the
+        // suspension by not scheduling the parent; see
+        // Task::is_waiting_for_vfork_child().
+        r.set_arg1(flags & ~(CLONE_UNTRACED | CLONE_VFORK));
         t->set_regs(r);
       }
       return PREVENT_SWITCH;
@@ -861,7 +977,7 @@ template <typename Arch> static Switchable rec_prepare_syscall_arch(Task* t) {
       // the trace event for this system call.
       t->exec_saved_arg1 = r.arg1();
       uintptr_t end = r.arg1() + raw_filename.length();
-      if (!exec_file_supported(t->exec_file())) {
+      if (!t->record_session().exec_file_supported(t->exec_file())) {
         // Force exec to fail with ENOENT by advancing arg1 to
         // the null byte
         r.set_arg1(end);
@@ -966,6 +1082,14 @@ template <typename Arch> static Switchable rec_prepare_syscall_arch(Task* t) {
         return ALLOW_SWITCH;
       }
       Registers r = t->regs();
+      if ((size_t)r.arg3() >= SYSCALLBUF_DIRECT_READ_SIZE &&
+          is_regular_file_fd(t, (int)r.arg1_signed())) {
+        // Let the kernel write straight into the tracee's buffer
+        // rather than into scratch we'd then have to copy out.
+        // Without scratch, no other task may run meanwhile, but
+        // this read won't block for long.
+        return PREVENT_SWITCH;
+      }
 
       push_arg_ptr(t, r.arg2());
       r.set_arg2(scratch);
@@ -1289,6 +1413,30 @@ template <typename Arch> static Switchable rec_prepare_syscall_arch(Task* t) {
       return (flags & MSG_DONTWAIT) ? PREVENT_SWITCH : ALLOW_SWITCH;
     }
 
+    case Arch::io_uring_setup:
+      if (!need_scratch_setup) {
+        return PREVENT_SWITCH;
+      }
+      return prepare_io_uring_setup<Arch>(t, &scratch);
+
+    case Arch::io_uring_enter:
+      prepare_io_uring_enter<Arch>(t, (int)t->regs().arg1_signed(),
+                                   t->regs().arg2());
+      return ALLOW_SWITCH;
+
+    case Arch::io_uring_register: {
+      Registers r = t->regs();
+      push_arg_ptr(t, r.arg2());
+      if (r.arg2() == IORING_REGISTER_RING_FDS) {
+        // io_uring_enter would be passed a registered index instead of
+        // the fd that identifies the ring.  Set an invalid opcode so the
+        // registration fails.
+        r.set_arg2(-1);
+        t->set_regs(r);
+      }
+      return PREVENT_SWITCH;
+    }
+
     case Arch::sched_setaffinity: {
       // Ignore all sched_setaffinity syscalls. They might interfere
       // with our own affinity settings.
@@ -1354,26 +1502,32 @@ void rec_prepare_restart_syscall(Task* t) {
   RR_ARCH_FUNCTION(rec_prepare_restart_syscall_arch, t->arch(), t)
 }
 
+/**
+ * Scratch memory is a sparse shared segment, so only the pages syscalls
+ * actually write to take up memory. That lets us reserve enough address
+ * space that large blocking reads and recvmsgs fit, keeping them
+ * switchable, while a task's scratch usually costs only its first
+ * SCRATCH_RESIDENT_BYTES; see AutoRestoreScratch. 32-bit tracees can't
+ * spare the address space for every thread.
+ */
+static const size_t SCRATCH_RESIDENT_BYTES = 512 * 4096;
+
+template <typename Arch> static size_t scratch_size_for_arch() {
+  return Arch::elfclass == ELFCLASS64 ? 64 * 1024 * 1024
+                                      : SCRATCH_RESIDENT_BYTES;
+}
+
 template <typename Arch> static void init_scratch_memory(Task* t) {
-  const int scratch_size = 512 * page_size();
+  const size_t scratch_size = scratch_size_for_arch<Arch>();
   size_t sz = scratch_size;
-  // The PROT_EXEC looks scary, and it is, but it's to prevent
-  // this region from being coalesced with another anonymous
-  // segment mapped just after this one.  If we named this
-  // segment, we could remove this hack.
-  int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
-  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
-  int fd = -1;
-  // NB: we don't need to adjust this in the remote syscall below because
-  // 0 == (0 >> PAGE_SIZE).
-  off64_t offset_pages = 0;
+  // The segment is backed by its own (unlinked) file, so unlike an
+  // anonymous mapping it can't be coalesced with its neighbours.
+  int prot = PROT_READ | PROT_WRITE;
   {
-    /* initialize the scratchpad for blocking system calls */
+    /* initialize the scratchpad for blocking system calls, shared with
+     * us so that copying syscall results through it costs no syscalls */
     AutoRemoteSyscalls remote(t);
-    t->scratch_ptr = remote.syscall(
-        has_mmap2_syscall(Arch::arch()) ? Arch::mmap2 : Arch::mmap, 0, sz, prot,
-        flags, fd, offset_pages);
-    t->scratch_size = scratch_size;
+    t->init_scratch(remote, sz, prot);
   }
   // record this mmap for the replay
   Registers r = t->regs();
@@ -1391,9 +1545,6 @@ template <typename Arch> static void init_scratch_memory(Task* t) {
 
   r.set_syscall_result(saved_result);
   t->set_regs(r);
-
-  t->vm()->map(t->scratch_ptr, sz, prot, flags, page_size() * offset_pages,
-               MappableResource::scratch(t->rec_tid));
 }
 
 /**
@@ -1466,6 +1617,11 @@ public:
     }
     ASSERT(t, t->ev().Syscall().saved_args.empty())
         << "Under-consumed saved arg pointers";
+    // Give back the memory an unusually large syscall dirtied.
+    if (t->ev().Syscall().tmp_data_num_bytes >
+        ssize_t(SCRATCH_RESIDENT_BYTES)) {
+      t->release_scratch(SCRATCH_RESIDENT_BYTES);
+    }
   }
 
   bool scratch_used() { return iter; }
@@ -1626,6 +1782,162 @@ static void record_scratch_stack_page(Task* t) {
   t->record_remote(t->sp() - page_size(), page_size());
 }
 
+/**
+ * Record |num_bytes| at |addr|, or as many of them as can be read.  For
+ * outparam buffers whose capacity we don't know.
+ */
+static void record_remote_fallible(Task* t, remote_ptr<void> addr,
+                                   size_t num_bytes) {
+  vector<uint8_t> buf;
+  buf.resize(num_bytes);
+  ssize_t nread = t->read_bytes_fallible(addr, num_bytes, buf.data());
+  t->record_local(addr, max<ssize_t>(0, nread), buf.data());
+}
+
+static size_t radeon_info_value_size(uint32_t request) {
+  switch (request) {
+    case RADEON_INFO_TIMESTAMP:
+    case RADEON_INFO_NUM_BYTES_MOVED:
+    case RADEON_INFO_VRAM_USAGE:
+    case RADEON_INFO_GTT_USAGE:
+      return sizeof(uint64_t);
+    case RADEON_INFO_SI_TILE_MODE_ARRAY:
+      return 32 * sizeof(uint32_t);
+    case RADEON_INFO_CIK_MACROTILE_MODE_ARRAY:
+      return 16 * sizeof(uint32_t);
+    default:
+      return sizeof(uint32_t);
+  }
+}
+
+/**
+ * The ioctls of the linux Direct Rendering Manager (DRM).  The ioctl
+ * "type" is 0x64 (100, or ASCII 'd' as they docs helpfully declare it
+ * :/).  The ioctl numbers are allocated as follows
+ *
+ *  [0x00, 0x40) -- generic commands
+ *  [0x40, 0xa0) -- device-specific commands
+ *  [0xa0, 0xff) -- more generic commands
+ *
+ * Chasing down unknown ioctls is somewhat annoying in this
+ * scheme, but here's an example: request "0xc0406481".  "0xc"
+ * means it's a read/write ioctl, and "0x0040" is the size of
+ * the payload.  The actual ioctl request is "0x6481".
+ *
+ * As we saw above, "0x64" is the DRM type.  So now we need to
+ * see what command "0x81" is.  It's in the
+ * device-specific-command space, so we can start by
+ * subtracting "0x40" to get a command "0x41".  Then
+ *
+ *  $ cd
+ *  $ grep -rn 0x41 *
+ *  nouveau_drm.h:200:#define DRM_NOUVEAU_GEM_PUSHBUF        0x41
+ *
+ * Well that was lucky!  So the command is
+ * DRM_NOUVEAU_GEM_PUSHBUF, and the parameters etc can be
+ * tracked down from that.
+ *
+ * Unlike the generic ioctl path, the DRM ioctls are recorded by what
+ * the kernel actually writes back.  Command submission and buffer
+ * uploads are inputs to the kernel, so the (large) buffers they point
+ * at are never copied into the trace; only the small arrays the kernel
+ * updates in place are, and identical ones from one submission to the
+ * next are stored once by the trace's raw data deduplication.
+ */
+template <typename Arch> static void process_drm_ioctl(Task* t, int request) {
+  int nr = _IOC_NR(request);
+  int dir = _IOC_DIR(request);
+  int size = _IOC_SIZE(request);
+  remote_ptr<void> param = t->regs().arg3();
+
+  if (t->regs().syscall_failed()) {
+    // Nothing was written back.
+    return;
+  }
+
+  switch (request) {
+    case DRM_IOWR(0x00, typename Arch::drm_version): {
+      auto version = t->read_mem(param.cast<typename Arch::drm_version>());
+      t->record_local(param, sizeof(version), &version);
+      // The kernel writes as much of each string as fits the caller's
+      // buffer and returns the string's full length, so the length may
+      // overstate what was written.
+      record_remote_fallible(t, version.name, version.name_len);
+      record_remote_fallible(t, version.date, version.date_len);
+      record_remote_fallible(t, version.desc, version.desc_len);
+      return;
+    }
+
+    case DRM_IOCTL_GET_MAGIC:
+    case DRM_IOCTL_GEM_OPEN:
+    case DRM_IOCTL_RADEON_GEM_CREATE:
+    case DRM_IOCTL_RADEON_GEM_GET_TILING:
+      // Plain outparam structs.
+      return record_ioctl_data(t, size);
+
+    case DRM_IOCTL_RADEON_INFO: {
+      auto info = t->read_mem(param.cast<drm_radeon_info>());
+      t->record_local(param, sizeof(info), &info);
+      t->record_remote(remote_ptr<void>(info.value),
+                       radeon_info_value_size(info.request));
+      return;
+    }
+
+    case DRM_IOCTL_I915_GEM_PWRITE:
+      // Uploads tracee memory to a buffer object; nothing comes back.
+      return;
+
+    case DRM_IOCTL_I915_GEM_EXECBUFFER2: {
+      // The batch buffers themselves live in buffer objects.  The kernel
+      // only writes back where it placed each object, and the presumed
+      // offsets of the relocations it applied.
+      auto execbuf = t->read_mem(param.cast<drm_i915_gem_execbuffer2>());
+      auto objects = remote_ptr<drm_i915_gem_exec_object2>(
+          execbuf.buffers_ptr);
+      t->record_remote(objects, execbuf.buffer_count *
+                                    sizeof(drm_i915_gem_exec_object2));
+      for (uint32_t i = 0; i < execbuf.buffer_count; ++i) {
+        auto object = t->read_mem(objects + i);
+        t->record_remote(remote_ptr<void>(object.relocs_ptr),
+                         object.relocation_count *
+                             sizeof(drm_i915_gem_relocation_entry));
+      }
+      return;
+    }
+
+    /* TODO: At least one of these ioctl()s, most likely
+     * NOUVEAU_GEM_NEW, opens a file behind rr's back on behalf of
+     * the callee.  That wreaks havoc later on in execution, so we
+     * disable the whole lot for now until rr can handle that
+     * behavior (by recording access to shmem segments). */
+    case DRM_IOCTL_NOUVEAU_GEM_NEW:
+    case DRM_IOCTL_NOUVEAU_GEM_PUSHBUF:
+      FATAL() << "Intentionally unhandled DRM(0x64) ioctl nr " << HEX(nr);
+      break;
+
+    /* Maps a buffer object into the tracee behind rr's back.  The GPU
+     * writes such mappings asynchronously, so their contents can't be
+     * recorded. */
+    case DRM_IOCTL_I915_GEM_MMAP:
+      FATAL() << "Not-understood DRM(0x64) ioctl nr " << HEX(nr);
+      break; /* not reached */
+
+    case 0x4010644d:
+    case 0xc0186441:
+    case 0x80086447:
+    case 0xc0306449:
+    case 0xc030644b:
+      FATAL() << "Unknown DRM(0x64) ioctl nr " << HEX(nr);
+      break; /* not reached */
+
+    default:
+      ASSERT(t, false) << "Unknown DRM ioctl(" << HEX(request)
+                       << "): nr:" << HEX(nr) << " dir:" << HEX(dir)
+                       << " size:" << size
+                       << " addr:" << HEX(t->regs().arg3());
+  }
+}
+
 template <typename Arch> static void process_ioctl(Task* t, int request) {
   int type = _IOC_TYPE(request);
   int nr = _IOC_NR(request);
@@ -1681,6 +1993,10 @@ template <typename Arch> static void process_ioctl(Task* t, int request) {
       return record_ioctl_data(t, sizeof(typename Arch::winsize));
   }
 
+  if (DRM_IOCTL_BASE == type) {
+    return process_drm_ioctl<Arch>(t, request);
+  }
+
   /* In ioctl language, "_IOC_WRITE" means "outparam".  Both
    * READ and WRITE can be set for inout params. */
   if (!(_IOC_WRITE & dir)) {
@@ -1704,63 +2020,6 @@ template <typename Arch> static void process_ioctl(Task* t, int request) {
       FATAL() << "Unknown 0x46-series ioctl nr " << HEX(nr);
       break; /* not reached */
 
-    /* The following are ioctls for the linux Direct Rendering
-     * Manager (DRM).  The ioctl "type" is 0x64 (100, or ASCII 'd'
-     * as they docs helpfully declare it :/).  The ioctl numbers
-     * are allocated as follows
-     *
-     *  [0x00, 0x40) -- generic commands
-     *  [0x40, 0xa0) -- device-specific commands
-     *  [0xa0, 0xff) -- more generic commands
-     *
-     * Chasing down unknown ioctls is somewhat annoying in this
-     * scheme, but here's an example: request "0xc0406481".  "0xc"
-     * means it's a read/write ioctl, and "0x0040" is the size of
-     * the payload.  The actual ioctl request is "0x6481".
-     *
-     * As we saw above, "0x64" is the DRM type.  So now we need to
-     * see what command "0x81" is.  It's in the
-     * device-specific-command space, so we can start by
-     * subtracting "0x40" to get a command "0x41".  Then
-     *
-     *  $ cd
-     *  $ grep -rn 0x41 *
-     *  nouveau_drm.h:200:#define DRM_NOUVEAU_GEM_PUSHBUF        0x41
-     *
-     * Well that was lucky!  So the command is
-     * DRM_NOUVEAU_GEM_PUSHBUF, and the parameters etc can be
-     * tracked down from that.
-     */
-
-    /* TODO: At least one of these ioctl()s, most likely
-     * NOUVEAU_GEM_NEW, opens a file behind rr's back on behalf of
-     * the callee.  That wreaks havoc later on in execution, so we
-     * disable the whole lot for now until rr can handle that
-     * behavior (by recording access to shmem segments). */
-    case DRM_IOCTL_VERSION:
-    case DRM_IOCTL_NOUVEAU_GEM_NEW:
-    case DRM_IOCTL_NOUVEAU_GEM_PUSHBUF:
-      FATAL() << "Intentionally unhandled DRM(0x64) ioctl nr " << HEX(nr);
-      break;
-
-    case DRM_IOCTL_GET_MAGIC:
-    case DRM_IOCTL_RADEON_INFO:
-    case DRM_IOCTL_I915_GEM_PWRITE:
-    case DRM_IOCTL_GEM_OPEN:
-    case DRM_IOCTL_I915_GEM_MMAP:
-    case DRM_IOCTL_RADEON_GEM_CREATE:
-    case DRM_IOCTL_RADEON_GEM_GET_TILING:
-      FATAL() << "Not-understood DRM(0x64) ioctl nr " << HEX(nr);
-      break; /* not reached */
-
-    case 0x4010644d:
-    case 0xc0186441:
-    case 0x80086447:
-    case 0xc0306449:
-    case 0xc030644b:
-      FATAL() << "Unknown DRM(0x64) ioctl nr " << HEX(nr);
-      break; /* not reached */
-
     default:
       t->regs().print_register_file(stderr);
       ASSERT(t, false) << "Unknown ioctl(" << HEX(request)
@@ -1794,8 +2053,12 @@ static void process_msgctl(Task* t, int cmd, remote_ptr<void> buf) {
 template <typename Arch>
 static void process_msgrcv(Task* t, size_t msgsize, remote_ptr<void>* msgbuf) {
   // The |msgsize| arg is only the size of message payload; there's also
-  // a |msgtype| tag set just before the payload.
-  size_t buf_size = sizeof(typename Arch::signed_long) + msgsize;
+  // a |msgtype| tag set just before the payload.  Only the payload bytes
+  // that were received, which the syscall returns, were written.
+  ssize_t nrecvd = t->regs().syscall_result_signed();
+  size_t buf_size =
+      nrecvd < 0 ? 0 : sizeof(typename Arch::signed_long) +
+                           min<size_t>(msgsize, nrecvd);
   if (has_saved_arg_ptrs(t)) {
     remote_ptr<void> orig_msgbuf = pop_arg_ptr<void>(t);
 
@@ -1805,6 +2068,123 @@ static void process_msgrcv(Task* t, size_t msgsize, remote_ptr<void>* msgbuf) {
   t->record_remote(*msgbuf, buf_size);
 }
 
+template <typename Arch>
+static void process_shmctl(Task* t, int cmd, remote_ptr<void> buf) {
+  ssize_t buf_size;
+  switch (cmd) {
+    case IPC_STAT:
+    case SHM_STAT:
+    case SHM_STAT_ANY:
+      buf_size = sizeof(typename Arch::shmid64_ds);
+      break;
+    case IPC_INFO:
+      buf_size = sizeof(typename Arch::shminfo64);
+      break;
+    case SHM_INFO:
+      buf_size = sizeof(typename Arch::shm_info);
+      break;
+    default:
+      buf_size = 0;
+      break;
+  }
+  t->record_remote(buf, buf_size);
+}
+
+/**
+ * Read the kernel's description of the SysV shm segment |shmid|, as |t|
+ * sees it.
+ */
+template <typename Arch>
+static typename Arch::shmid64_ds read_shm_segment(Task* t, int shmid) {
+  AutoRemoteSyscalls remote(t);
+  AutoRestoreMem mem(remote, nullptr, sizeof(typename Arch::shmid64_ds));
+  long ret;
+  if (Arch::shmctl >= 0) {
+    ret = remote.syscall(Arch::shmctl, shmid, IPC_STAT, mem.get());
+  } else {
+    ret = remote.syscall(Arch::ipc, SHMCTL, shmid, IPC_STAT | IPC_64, 0,
+                         mem.get());
+  }
+  ASSERT(t, ret == 0) << "Can't stat shm segment " << shmid << " of " << t->tid
+                      << ": " << strerror(-ret);
+  return t->read_mem(mem.get().cast<typename Arch::shmid64_ds>());
+}
+
+/**
+ * Record the attach at |addr| of SysV shm segment |shmid| with |shmflg|.
+ *
+ * Replay attaches an emulated file in its place, one per segment, so
+ * that tracees' writes through one attach are seen through the others
+ * as they were during recording.  So the segment's contents are only
+ * recorded while no tracee has it attached; otherwise replay has
+ * already written them.  Unless the segment may also be attached
+ * outside the tracee tree, its later changes are the tracees' own
+ * writes and aren't watched.
+ */
+template <typename Arch>
+static void process_shmat(Task* t, int shmid, int shmflg,
+                          remote_ptr<void> addr) {
+  auto ds = read_shm_segment<Arch>(t, shmid);
+  size_t size = ceil_page_size(ds.shm_segsz);
+  int prot = PROT_READ;
+  if (!(shmflg & SHM_RDONLY)) {
+    prot |= PROT_WRITE;
+  }
+  if (shmflg & SHM_EXEC) {
+    prot |= PROT_EXEC;
+  }
+
+  // The kernel names the segment's file after its key and numbers it
+  // after its id.
+  char filename[PATH_MAX];
+  snprintf(filename, sizeof(filename), "/SYSV%08x", (int)ds.shm_perm.key);
+  struct stat stat;
+  memset(&stat, 0, sizeof(stat));
+  stat.st_ino = shmid;
+  stat.st_mode = S_IFREG | (ds.shm_perm.mode & 0777);
+  stat.st_uid = ds.shm_perm.uid;
+  stat.st_gid = ds.shm_perm.gid;
+  stat.st_size = ds.shm_segsz;
+  stat.st_ctime = ds.shm_ctime_only_little_endian;
+  MappableResource resource(FileId(stat), filename);
+
+  uint64_t tracee_attaches = 0;
+  for (auto vm : t->session().vms()) {
+    for (auto& kv : vm->memmap()) {
+      if (kv.second == resource) {
+        ++tracee_attaches;
+      }
+    }
+  }
+  bool copied = tracee_attaches == 0;
+  if (copied) {
+    t->record_remote_pages(addr, size, Task::SKIP_ZERO_PAGES);
+  }
+  TraceMappedRegion file(filename, stat, addr, addr + size, copied);
+  t->trace_writer().write_mapped_region(file);
+  t->vm()->map(addr, size, prot, MAP_SHARED, 0, resource);
+
+  // The kernel counts this attach too.
+  bool foreign = !t->session().find_task(ds.shm_cpid) ||
+                 ds.shm_nattch > tracee_attaches + 1;
+  if (foreign && (prot & PROT_WRITE)) {
+    LOG(debug) << "  watching shm segment " << shmid << " at " << addr;
+    AddressSpace::SharedMappingShadow& shadow =
+        t->vm()->shared_mapping_shadows()[addr];
+    shadow.end = addr + size;
+    shadow.resource = resource;
+    shadow.contents.resize(size);
+    shadow.contents.resize(max<ssize_t>(
+        0, t->read_bytes_fallible(addr, size, shadow.contents.data())));
+  }
+}
+
+static void process_shmdt(Task* t, remote_ptr<void> addr) {
+  size_t size = t->vm()->shm_attach_size(addr);
+  ASSERT(t, size > 0) << "No shm segment attached at " << addr;
+  t->vm()->unmap(addr, size);
+}
+
 template <typename Arch> static void process_ipc(Task* t, int call) {
   LOG(debug) << "ipc call: " << call;
 
@@ -1829,12 +2209,74 @@ template <typename Arch> static void process_ipc(Task* t, int call) {
     }
     case MSGGET:
     case MSGSND:
+    case SHMGET:
+      return;
+    case SHMAT: {
+      if (t->regs().syscall_failed()) {
+        return;
+      }
+      remote_ptr<typename Arch::unsigned_long> child_addr = t->regs().arg4();
+      t->record_remote(child_addr);
+      process_shmat<Arch>(t, (int)t->regs().arg2_signed(),
+                          (int)t->regs().arg3_signed(),
+                          remote_ptr<void>(t->read_mem(child_addr)));
+      return;
+    }
+    case SHMCTL: {
+      int cmd = get_ipc_command((int)t->regs().arg3_signed());
+      process_shmctl<Arch>(t, cmd, t->regs().arg5());
+      return;
+    }
+    case SHMDT:
+      if (!t->regs().syscall_failed()) {
+        process_shmdt(t, t->regs().arg5());
+      }
       return;
     default:
       FATAL() << "Unhandled IPC call " << call;
   }
 }
 
+/**
+ * Save the |size| bytes of the copied file mapping at |addr| to the trace.
+ * Returns the name of the trace file holding the copy, or an empty string
+ * if the copy is in the trace data.
+ */
+static string save_mmap_copy(Task* t, remote_ptr<void> addr, size_t size,
+                             int flags, int fd, const struct stat& stat,
+                             off64_t offset) {
+  if (flags & MAP_SHARED) {
+    // Replay rewrites shared copies into an emulated file, a page at a
+    // time.
+    t->record_remote_pages(addr, size, Task::RECORD_ALL_PAGES);
+    return string();
+  }
+  if (Flags::get().clone_files) {
+    // Go through the tracee's fd, which works even if the file has been
+    // unlinked or renamed.
+    char fd_path[PATH_MAX];
+    snprintf(fd_path, sizeof(fd_path), "/proc/%d/fd/%d", t->tid, fd);
+    string name =
+        t->trace_writer().write_cloned_copy(fd_path, stat, offset, size);
+    if (!name.empty()) {
+      return name;
+    }
+  }
+  if (Flags::get().shared_store) {
+    // Replay maps the stored copy itself, so it must hold exactly the
+    // data the tracee saw.
+    vector<uint8_t> buf;
+    buf.resize(size);
+    t->read_bytes_helper(addr, size, buf.data());
+    return t->trace_writer().write_stored_copy(buf.data(), size);
+  }
+  // Record the copy a page at a time, so pages shared between files (or
+  // mapped repeatedly) are stored once. Private mappings are replayed over
+  // zeroed anonymous memory, so their zero pages needn't be stored.
+  t->record_remote_pages(addr, size, Task::SKIP_ZERO_PAGES);
+  return string();
+}
+
 static void process_mmap(Task* t, int syscallno, size_t length, int prot,
                          int flags, int fd, off_t offset_pages) {
   size_t size = ceil_page_size(length);
@@ -1870,12 +2312,21 @@ static void process_mmap(Task* t, int syscallno, size_t length, int prot,
   bool copied =
       should_copy_mmap_region(filename, &stat, prot, flags, WARN_DEFAULT);
 
-  if (copied) {
+  bool io_uring = is_io_uring_file(filename);
+
+  string stored_file;
+  if (io_uring) {
+    // The rings are kernel memory with no file to copy.  Replay maps
+    // anonymous memory and fills it with this.
+    t->record_remote(addr, size);
+  } else if (copied) {
     off64_t end = (off64_t)stat.st_size - offset;
-    t->record_remote(addr, min(end, (off64_t)size));
+    size_t copy_size = max<off64_t>(0, min(end, (off64_t)size));
+    stored_file = save_mmap_copy(t, addr, copy_size, flags, fd, stat, offset);
   }
 
-  TraceMappedRegion file(filename, stat, addr, addr + size, copied);
+  TraceMappedRegion file(filename, stat, addr, addr + size, copied,
+                         stored_file);
   t->trace_writer().write_mapped_region(file);
 
   if (strstr(filename, SYSCALLBUF_LIB_FILENAME) && (prot & PROT_EXEC)) {
@@ -1883,18 +2334,120 @@ static void process_mmap(Task* t, int syscallno, size_t length, int prot,
     t->syscallbuf_lib_end = file.end();
   }
 
-  t->vm()->map(addr, size, prot, flags, offset,
-               MappableResource(FileId(stat), filename));
+  MappableResource resource(FileId(stat), filename);
+  t->vm()->map(addr, size, prot, flags, offset, resource);
+
+  auto& rings = t->vm()->io_urings();
+  auto ring = io_uring ? rings.find(fd) : rings.end();
+  if (ring != rings.end()) {
+    if (offset == (off64_t)IORING_OFF_SQES) {
+      ring->second.sqes = addr;
+    } else if (offset == (off64_t)IORING_OFF_CQ_RING) {
+      ring->second.cq_ring = addr;
+    } else if (offset == (off64_t)IORING_OFF_SQ_RING) {
+      ring->second.sq_ring = addr;
+      if (ring->second.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->second.cq_ring = addr;
+      }
+    }
+  }
+
+  auto& shadows = t->vm()->shared_mapping_shadows();
+  shadows.erase(shadows.lower_bound(addr), shadows.lower_bound(addr + size));
+  if (copied && (flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+      !(io_uring && offset == (off64_t)IORING_OFF_SQES)) {
+    // Something outside the tracee tree may write the file while the
+    // mapping lives, so keep what we copied to compare against.  The
+    // kernel writes io_uring rings' heads, tails and CQEs this way; only
+    // the tracee writes SQEs.
+    AddressSpace::SharedMappingShadow& shadow = shadows[addr];
+    shadow.end = addr + size;
+    shadow.resource = resource;
+    shadow.contents.resize(size);
+    shadow.contents.resize(
+        max<ssize_t>(0, t->read_bytes_fallible(addr, size,
+                                               shadow.contents.data())));
+  }
+}
+
+/**
+ * Return true if |shadow| of the mapping at |start| still describes what
+ * |t|'s address space maps there.
+ */
+static bool shadow_is_current(Task* t, remote_ptr<void> start,
+                              const AddressSpace::SharedMappingShadow& shadow) {
+  auto& maps = t->vm()->memmap();
+  auto it = maps.find(Mapping(start, page_size()));
+  return it != maps.end() && it->first.start == start &&
+         it->first.end == shadow.end && (it->first.flags & MAP_SHARED) &&
+         it->second == shadow.resource;
+}
+
+void rec_record_shared_mapping_changes(Task* t) {
+  auto& shadows = t->vm()->shared_mapping_shadows();
+  if (shadows.empty()) {
+    return;
+  }
+
+  bool changed = false;
+  vector<uint8_t> buf;
+  for (auto it = shadows.begin(); it != shadows.end();) {
+    remote_ptr<void> start = it->first;
+    AddressSpace::SharedMappingShadow& shadow = it->second;
+    if (!shadow_is_current(t, start, shadow)) {
+      LOG(debug) << "  no longer watching shared mapping at " << start;
+      it = shadows.erase(it);
+      continue;
+    }
+
+    size_t size = shadow.end - start;
+    buf.resize(size);
+    ssize_t nread = t->read_bytes_fallible(start, size, buf.data());
+    size_t valid = max<ssize_t>(0, nread);
+    // Record each page that differs from what we saw last time.  Pages
+    // the tracee wrote itself are recorded too, harmlessly: replay has
+    // written the same data by now.
+    for (size_t offset = 0; offset < valid; offset += page_size()) {
+      size_t page = min<size_t>(page_size(), valid - offset);
+      if (offset + page <= shadow.contents.size() &&
+          !memcmp(buf.data() + offset, shadow.contents.data() + offset,
+                  page)) {
+        continue;
+      }
+      LOG(debug) << "  shared mapping page at " << start + offset
+                 << " changed";
+      t->record_local(start + offset, page, buf.data() + offset);
+      changed = true;
+    }
+    shadow.contents.assign(buf.begin(), buf.begin() + valid);
+    ++it;
+  }
+
+  if (changed) {
+    t->record_event(
+        Event(EV_SHARED_MAPPING_CHANGE, NO_EXEC_INFO, t->arch()));
+  }
+}
+
+/**
+ * Return how many bytes of the |iov_len|-byte buffer at |offset| into
+ * a scatter/gather list a transfer of |nbytes| bytes filled.
+ */
+static size_t filled_iov_len(size_t offset, size_t iov_len, ssize_t nbytes) {
+  size_t total = max<ssize_t>(0, nbytes);
+  return offset >= total ? 0 : min(iov_len, total - offset);
 }
 
 /*
  * Restore all data of msghdr from src* to dst* (all child pointers) and
- * record child memory where the pointer members point for replay
+ * record child memory where the pointer members point for replay.
+ * |nbytes| is the number of bytes received into the iovecs.
  */
 template <typename Arch>
 static void record_and_restore_msghdr(Task* t,
                                       remote_ptr<typename Arch::msghdr> dst,
-                                      remote_ptr<typename Arch::msghdr> src) {
+                                      remote_ptr<typename Arch::msghdr> src,
+                                      ssize_t nbytes) {
   auto msg = t->read_mem(dst);
   auto tmpmsg = t->read_mem(src);
 
@@ -1904,11 +2457,6 @@ static void record_and_restore_msghdr(Task* t,
   t->write_mem(dst, msg);
   t->record_local(dst, &msg);
 
-  if (msg.msg_name) {
-    t->remote_memcpy(msg.msg_name, tmpmsg.msg_name, tmpmsg.msg_namelen);
-  }
-  t->record_remote(msg.msg_name, msg.msg_namelen);
-
   ASSERT(t, msg.msg_iovlen == tmpmsg.msg_iovlen)
       << "Scratch msg should have " << msg.msg_iovlen << " iovs, but has "
       << tmpmsg.msg_iovlen;
@@ -1916,57 +2464,119 @@ static void record_and_restore_msghdr(Task* t,
   read_iovs<Arch>(t, msg, iovs);
   typename Arch::iovec tmpiovs[tmpmsg.msg_iovlen];
   read_iovs<Arch>(t, tmpmsg, tmpiovs);
-  for (size_t i = 0; i < msg.msg_iovlen; ++i) {
-    auto iov = &iovs[i];
-    auto& tmpiov = tmpiovs[i];
-    t->remote_memcpy(iov->iov_base, tmpiov.iov_base, tmpiov.iov_len);
-    iov->iov_len = tmpiov.iov_len;
 
-    t->record_remote(iov->iov_base, iov->iov_len);
+  // Copy the name, the iov buffers and the control data back in one go,
+  // and record them from the copy.
+  vector<MemoryRange> from;
+  vector<MemoryRange> to;
+  from.push_back(MemoryRange(tmpmsg.msg_name, msg.msg_namelen));
+  to.push_back(MemoryRange(msg.msg_name, msg.msg_namelen));
+  size_t iov_offset = 0;
+  for (size_t i = 0; i < msg.msg_iovlen; ++i) {
+    size_t len = filled_iov_len(iov_offset, tmpiovs[i].iov_len, nbytes);
+    from.push_back(MemoryRange(tmpiovs[i].iov_base, len));
+    to.push_back(MemoryRange(iovs[i].iov_base, len));
+    iov_offset += tmpiovs[i].iov_len;
+  }
+  from.push_back(MemoryRange(tmpmsg.msg_control, msg.msg_controllen));
+  to.push_back(MemoryRange(msg.msg_control, msg.msg_controllen));
+  vector<uint8_t> data = copy_ranges(t, from, to);
+
+  size_t offset = 0;
+  for (auto& r : to) {
+    if (r.addr.is_null()) {
+      t->record_local(r.addr, 0, nullptr);
+    } else {
+      t->record_local(r.addr, r.num_bytes, data.data() + offset);
+      offset += r.num_bytes;
+    }
   }
+}
 
-  if (msg.msg_control) {
-    t->remote_memcpy(msg.msg_control, tmpmsg.msg_control, msg.msg_controllen);
+/**
+ * Append the ranges of |msg|'s buffers that a receive of |nbytes| bytes
+ * fills to |ranges|: msg_name, the part of each of |iovs| (|msg|'s iovecs)
+ * that was filled, and msg_control.  Every iovec gets a (possibly empty)
+ * range.
+ */
+template <typename Arch>
+static void append_msghdr_ranges(const typename Arch::msghdr& msg,
+                                 const typename Arch::iovec* iovs,
+                                 ssize_t nbytes, vector<MemoryRange>& ranges) {
+  ranges.push_back(MemoryRange(msg.msg_name.rptr(), msg.msg_namelen));
+  size_t iov_offset = 0;
+  for (size_t i = 0; i < msg.msg_iovlen; ++i) {
+    size_t len = filled_iov_len(iov_offset, iovs[i].iov_len, nbytes);
+    ranges.push_back(MemoryRange(iovs[i].iov_base.rptr(), len));
+    iov_offset += iovs[i].iov_len;
   }
-  t->record_remote(msg.msg_control, msg.msg_controllen);
+  ranges.push_back(MemoryRange(msg.msg_control.rptr(), msg.msg_controllen));
 }
 
 /**
  * Record all the data needed to restore the |struct msghdr| pointed
- * at in |t|'s address space by |child_msghdr|.
+ * at in |t|'s address space by |child_msghdr|, which received |nbytes|
+ * bytes into its iovecs.  Only the received bytes are recorded, but
+ * every iovec still gets a (possibly empty) record.
  */
 template <typename Arch>
-static void record_struct_msghdr(
-    Task* t, remote_ptr<typename Arch::msghdr> child_msghdr) {
+static void record_struct_msghdr(Task* t,
+                                 remote_ptr<typename Arch::msghdr> child_msghdr,
+                                 ssize_t nbytes) {
   auto msg = t->read_mem(child_msghdr);
 
   // Record the entire struct, because some of the direct fields
   // are written as inoutparams.
   t->record_local(child_msghdr, &msg);
-  t->record_remote(msg.msg_name, msg.msg_namelen);
 
-  // Read all the inout iovecs in one shot.
+  // Read all the inout iovecs in one shot, and then all the buffers
+  // they point at.
   typename Arch::iovec iovs[msg.msg_iovlen];
-  t->read_bytes_helper(msg.msg_iov.rptr(), msg.msg_iovlen * sizeof(iovs[0]),
-                       (uint8_t*)iovs);
-  for (size_t i = 0; i < msg.msg_iovlen; ++i) {
-    auto iov = &iovs[i];
-    t->record_remote(iov->iov_base.rptr(), iov->iov_len);
-  }
-
-  t->record_remote(msg.msg_control.rptr(), msg.msg_controllen);
+  read_iovs<Arch>(t, msg, iovs);
+  vector<MemoryRange> ranges;
+  append_msghdr_ranges<Arch>(msg, iovs, nbytes, ranges);
+  t->record_remote_v(ranges);
 }
 
-/** Like record_struct_msghdr(), but records mmsghdr. */
+/**
+ * Like record_struct_msghdr(), but records each of the |nmmsgs| struct
+ * mmsghdrs at |msgvec| and their msg_len outparams.  The vector, then
+ * all of its iovecs, then everything to record are read in one go each.
+ */
 template <typename Arch>
-static void record_struct_mmsghdr(
-    Task* t, remote_ptr<typename Arch::mmsghdr> child_mmsghdr) {
-  /* struct mmsghdr has an inline struct msghdr as its first
-   * field, so it's OK to make this "cast". */
-  record_struct_msghdr<Arch>(t, REMOTE_PTR_FIELD(child_mmsghdr, msg_hdr));
-  /* We additionally have to record the outparam number of
-   * received bytes. */
-  t->record_remote(REMOTE_PTR_FIELD(child_mmsghdr, msg_len));
+static void record_struct_msgvec(Task* t, int nmmsgs,
+                                 remote_ptr<typename Arch::mmsghdr> msgvec) {
+  if (nmmsgs <= 0) {
+    return;
+  }
+  vector<typename Arch::mmsghdr> msgs(nmmsgs);
+  t->read_bytes_helper(msgvec, nmmsgs * sizeof(msgs[0]), msgs.data());
+
+  vector<vector<typename Arch::iovec> > iovs(nmmsgs);
+  vector<Task::RemoteIovec> iov_reads;
+  for (int i = 0; i < nmmsgs; ++i) {
+    auto& msg = msgs[i].msg_hdr;
+    iovs[i].resize(msg.msg_iovlen);
+    if (msg.msg_iovlen) {
+      iov_reads.push_back(Task::RemoteIovec(
+          msg.msg_iov.rptr(), msg.msg_iovlen * sizeof(iovs[i][0]),
+          iovs[i].data()));
+    }
+  }
+  t->read_bytes_v(iov_reads);
+
+  // Record in the same order as record_struct_msghdr() followed by
+  // msg_len, for each message.
+  vector<MemoryRange> ranges;
+  for (int i = 0; i < nmmsgs; ++i) {
+    ranges.push_back(MemoryRange(REMOTE_PTR_FIELD(msgvec + i, msg_hdr),
+                                 sizeof(msgs[i].msg_hdr)));
+    append_msghdr_ranges<Arch>(msgs[i].msg_hdr, iovs[i].data(),
+                               msgs[i].msg_len, ranges);
+    ranges.push_back(MemoryRange(REMOTE_PTR_FIELD(msgvec + i, msg_len),
+                                 sizeof(msgs[i].msg_len)));
+  }
+  t->record_remote_v(ranges);
 }
 
 /*
@@ -1979,9 +2589,7 @@ static void record_and_restore_msgvec(
     remote_ptr<typename Arch::mmsghdr> pnewmsg,
     remote_ptr<typename Arch::mmsghdr> poldmsg) {
   if (!has_saved_arg_ptrs) {
-    for (int i = 0; i < nmmsgs; ++i) {
-      record_struct_mmsghdr<Arch>(t, pnewmsg + i);
-    }
+    record_struct_msgvec<Arch>(t, nmmsgs, pnewmsg);
     return;
   }
 
@@ -1994,7 +2602,8 @@ static void record_and_restore_msgvec(
 
     // record the msghdr part of mmsghdr
     record_and_restore_msghdr<Arch>(t, REMOTE_PTR_FIELD(poldmsg + i, msg_hdr),
-                                    REMOTE_PTR_FIELD(pnewmsg + i, msg_hdr));
+                                    REMOTE_PTR_FIELD(pnewmsg + i, msg_hdr),
+                                    tmp.msg_len);
     // record mmsghdr.msg_len
     t->record_local(REMOTE_PTR_FIELD(poldmsg + i, msg_len), &old.msg_len);
   }
@@ -2012,6 +2621,137 @@ static void record_each_msglen(Task* t, int nmmsgs,
   }
 }
 
+/**
+ * Record the bytes a read of |nread| bytes filled in the |iovcnt| iovecs
+ * at |iovp|.
+ */
+template <typename Arch>
+static void record_iov_fill(Task* t, remote_ptr<typename Arch::iovec> iovp,
+                            int iovcnt, ssize_t nread) {
+  if (nread <= 0) {
+    return;
+  }
+  typename Arch::iovec iovs[iovcnt];
+  t->read_bytes_helper(iovp, iovcnt * sizeof(iovs[0]), (uint8_t*)iovs);
+  vector<MemoryRange> ranges;
+  size_t iov_offset = 0;
+  for (int i = 0; i < iovcnt && iov_offset < (size_t)nread; ++i) {
+    size_t len = filled_iov_len(iov_offset, iovs[i].iov_len, nread);
+    ranges.push_back(MemoryRange(iovs[i].iov_base.rptr(), len));
+    iov_offset += iovs[i].iov_len;
+  }
+  t->record_remote_v(ranges);
+}
+
+/**
+ * Record what the io_uring |request| filled, now that it completed with
+ * result |res|.
+ */
+template <typename Arch>
+static void record_io_uring_completion(
+    Task* t, const AddressSpace::IoUring::Request& request, int32_t res) {
+  if (res < 0) {
+    return;
+  }
+  remote_ptr<void> addr = request.addr;
+  remote_ptr<void> addr2 = request.addr2;
+  switch (request.opcode) {
+    case IORING_OP_READ:
+    case IORING_OP_READ_FIXED:
+    case IORING_OP_RECV:
+      t->record_remote(addr, res);
+      break;
+    case IORING_OP_READV:
+      record_iov_fill<Arch>(t, addr.cast<typename Arch::iovec>(),
+                            request.len, res);
+      break;
+    case IORING_OP_RECVMSG:
+      record_struct_msghdr<Arch>(t, addr.cast<typename Arch::msghdr>(), res);
+      break;
+    case IORING_OP_ACCEPT:
+      if (!addr.is_null() && !addr2.is_null()) {
+        auto addrlen = addr2.cast<typename Arch::socklen_t>();
+        t->record_remote(addrlen);
+        t->record_remote(addr, min<uint32_t>(t->read_mem(addrlen),
+                                             request.len));
+      }
+      break;
+    case IORING_OP_STATX:
+      // A struct statx, which older headers lack.
+      t->record_remote(addr2, 256);
+      break;
+  }
+}
+
+/**
+ * Record the buffers filled by the requests whose completions were posted
+ * to the io_uring set up as |fd| since it was last looked at.  The CQ
+ * ring itself is recorded as a shared mapping change.
+ */
+template <typename Arch>
+static void record_io_uring_completions(Task* t, int fd) {
+  auto& rings = t->vm()->io_urings();
+  auto it = rings.find(fd);
+  if (it == rings.end() || it->second.cq_ring.is_null()) {
+    return;
+  }
+  AddressSpace::IoUring& ring = it->second;
+  remote_ptr<void> cq = ring.cq_ring;
+  uint32_t tail = t->read_mem((cq + ring.cq_tail).cast<uint32_t>());
+  uint32_t mask = t->read_mem((cq + ring.cq_ring_mask).cast<uint32_t>());
+  size_t cqe_size = (ring.setup_flags & IORING_SETUP_CQE32) ? 32 : 16;
+  for (uint32_t i = ring.cq_seen; i != tail; ++i) {
+    auto cqe = t->read_mem((cq + ring.cqes + (i & mask) * cqe_size)
+                               .cast<typename Arch::io_uring_cqe>());
+    auto request = ring.requests.find(cqe.user_data);
+    if (request == ring.requests.end()) {
+      continue;
+    }
+    record_io_uring_completion<Arch>(t, request->second, cqe.res);
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      ring.requests.erase(request);
+    }
+  }
+  ring.cq_seen = tail;
+}
+
+/**
+ * Give the tracee back its io_uring_params, record them, and start
+ * tracking the ring set up, if it was.
+ */
+template <typename Arch> static void process_io_uring_setup(Task* t) {
+  Registers r = t->regs();
+  remote_ptr<typename Arch::io_uring_params> params = r.arg2();
+  auto p = t->read_mem(params);
+  if (!t->ev().Syscall().saved_args.empty()) {
+    params = pop_arg_ptr<typename Arch::io_uring_params>(t);
+    r.set_arg2(params);
+    t->set_regs(r);
+    if (!r.syscall_failed()) {
+      auto tracee_p = p;
+      tracee_p.flags = t->read_mem(REMOTE_PTR_FIELD(params, flags));
+      t->write_mem(params, tracee_p);
+    }
+  }
+  if (r.syscall_failed()) {
+    return;
+  }
+  t->record_remote(params);
+
+  AddressSpace::IoUring& ring =
+      t->vm()->io_urings()[r.syscall_result_signed()];
+  ring = AddressSpace::IoUring();
+  ring.setup_flags = p.flags;
+  ring.features = p.features;
+  ring.sq_head = p.sq_off.head;
+  ring.sq_tail = p.sq_off.tail;
+  ring.sq_ring_mask = p.sq_off.ring_mask;
+  ring.sq_array = p.sq_off.array;
+  ring.cq_tail = p.cq_off.tail;
+  ring.cq_ring_mask = p.cq_off.ring_mask;
+  ring.cqes = p.cq_off.cqes;
+}
+
 template <typename Arch>
 static void process_recvfrom(Task* t, typename Arch::recvfrom_args* argsp) {
   typename Arch::recvfrom_args& args = *argsp;
@@ -2053,19 +2793,20 @@ static void process_recvfrom(Task* t, typename Arch::recvfrom_args* argsp) {
 template <typename Arch>
 static void process_recvmsg(Task* t,
                             remote_ptr<typename Arch::msghdr>* msgbuf) {
+  ssize_t nrecvd = t->regs().syscall_result_signed();
   if (has_saved_arg_ptrs(t)) {
     // The first saved arg indicates whether we suceeded in replacing everything
     // with scratch pointers.
     auto scratch_msg_succeeded = pop_arg_ptr<typename Arch::msghdr>(t);
     if (scratch_msg_succeeded.is_null()) {
-      record_struct_msghdr<Arch>(t, *msgbuf);
+      record_struct_msghdr<Arch>(t, *msgbuf, nrecvd);
     } else {
       auto orig_msgbuf = pop_arg_ptr<typename Arch::msghdr>(t);
-      record_and_restore_msghdr<Arch>(t, orig_msgbuf, *msgbuf);
+      record_and_restore_msghdr<Arch>(t, orig_msgbuf, *msgbuf, nrecvd);
       *msgbuf = orig_msgbuf;
     }
   } else {
-    record_struct_msghdr<Arch>(t, *msgbuf);
+    record_struct_msghdr<Arch>(t, *msgbuf, nrecvd);
   }
 }
 
@@ -2411,7 +3152,7 @@ template <typename Arch> static void rec_process_syscall_arch(Task* t) {
       Task* new_task = t->session().find_task(new_tid);
       uintptr_t flags = pop_arg_ptr<void>(t).as_int();
 
-      if (flags & CLONE_UNTRACED) {
+      if (flags & (CLONE_UNTRACED | CLONE_VFORK)) {
         Registers r = t->regs();
         r.set_arg1(flags);
         t->set_regs(r);
@@ -2420,6 +3161,13 @@ template <typename Arch> static void rec_process_syscall_arch(Task* t) {
       if (new_tid < 0)
         break;
 
+      if ((flags & CLONE_VFORK) && (flags & CLONE_VM)) {
+        // The child borrows our address space, so it needs
+        // no AddressSpace of its own; we just hold the parent
+        // back until the child is done with it.
+        t->vfork_child_tid = new_tid;
+      }
+
       new_task->push_event(SyscallEvent(syscallno, t->arch()));
 
       /* record child id here */
@@ -2540,18 +3288,6 @@ template <typename Arch> static void rec_process_syscall_arch(Task* t) {
 
       break;
     }
-    case Arch::getxattr:
-    case Arch::lgetxattr:
-    case Arch::fgetxattr: {
-      ssize_t len = t->regs().syscall_result_signed();
-      if (len > 0) {
-        remote_ptr<void> value = t->regs().arg3();
-        t->record_remote(value, len);
-      } else {
-        record_noop_data(t);
-      }
-      break;
-    }
     case Arch::ioctl:
       process_ioctl<Arch>(t, (int)t->regs().arg2_signed());
       break;
@@ -2569,6 +3305,24 @@ template <typename Arch> static void rec_process_syscall_arch(Task* t) {
       process_msgctl<Arch>(t, (int)t->regs().arg2_signed(), t->regs().arg3());
       break;
 
+    case Arch::shmat:
+      if (!t->regs().syscall_failed()) {
+        process_shmat<Arch>(t, (int)t->regs().arg1_signed(),
+                            (int)t->regs().arg3_signed(),
+                            t->regs().syscall_result());
+      }
+      break;
+
+    case Arch::shmctl:
+      process_shmctl<Arch>(t, (int)t->regs().arg2_signed(), t->regs().arg3());
+      break;
+
+    case Arch::shmdt:
+      if (!t->regs().syscall_failed()) {
+        process_shmdt(t, t->regs().arg1());
+      }
+      break;
+
     case Arch::ipc:
       process_ipc<Arch>(t, (unsigned int)t->regs().arg1());
       break;
@@ -2841,6 +3595,7 @@ template <typename Arch> static void rec_process_syscall_arch(Task* t) {
                                t->regs().arg2());
       break;
 
+    case Arch::copy_file_range:
     case Arch::splice: {
       AutoRestoreScratch restore_scratch(t);
       auto off_out = pop_arg_ptr<loff_t>(t);
@@ -2938,6 +3693,32 @@ template <typename Arch> static void rec_process_syscall_arch(Task* t) {
       return;
     }
 
+    case Arch::readv:
+      // Record only the bytes read into each iovec.
+      record_iov_fill<Arch>(t, t->regs().arg2(), t->regs().arg3_signed(),
+                            t->regs().syscall_result_signed());
+      break;
+
+    case Arch::io_uring_setup:
+      process_io_uring_setup<Arch>(t);
+      break;
+
+    case Arch::io_uring_enter:
+      // Completions may be posted even if the wait was interrupted.
+      record_io_uring_completions<Arch>(t, (int)t->regs().arg1_signed());
+      break;
+
+    case Arch::io_uring_register: {
+      Registers r = t->regs();
+      r.set_arg2(pop_arg_ptr<void>(t));
+      t->set_regs(r);
+      if (!r.syscall_failed() && r.arg2() == IORING_REGISTER_PROBE) {
+        // struct io_uring_probe and its |nr_args| io_uring_probe_ops.
+        t->record_remote(r.arg3(), 16 + 8 * r.arg4());
+      }
+      break;
+    }
+
     case Arch::write:
     case Arch::writev:
       break;
@@ -2952,7 +3733,10 @@ template <typename Arch> static void rec_process_syscall_arch(Task* t) {
     }
 
     case SYS_rrcall_init_buffers:
-      t->init_buffers(nullptr, SHARE_DESCHED_EVENT_FD);
+      t->init_buffers(nullptr, SHARE_DESCHED_EVENT_FD, t->syscallbuf_size_hint);
+      // Replay reads the chosen buffer size back from this.
+      t->record_remote(
+          remote_ptr<struct rrcall_init_buffers_params>(t->regs().arg1()));
       break;
 
     case SYS_rrcall_monkeypatch_vdso:
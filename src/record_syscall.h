@@ -35,4 +35,13 @@ void rec_prepare_restart_syscall(Task* t);
  */
 void rec_process_syscall(Task* t);
 
+/**
+ * Record the pages of |t|'s copied MAP_SHARED writable file mappings that
+ * changed since they were last recorded, if any did, as an
+ * EV_SHARED_MAPPING_CHANGE event.  Call this at each point the recorder
+ * takes control of |t|, so that writes to the files from outside the
+ * tracee tree are replayed at (about) the time they were seen.
+ */
+void rec_record_shared_mapping_changes(Task* t);
+
 #endif /* RR_PROCESS_SYSCALL_H_ */
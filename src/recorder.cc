@@ -76,7 +76,9 @@ int record(const char* rr_exe, int argc, char* argv[], char** envp) {
 
   install_termsig_handlers();
 
-  auto session = RecordSession::create(args, env, cwd);
+  auto session = Flags::get().attach_pid
+                     ? RecordSession::attach(Flags::get().attach_pid)
+                     : RecordSession::create(args, env, cwd);
 
   RecordSession::RecordResult step_result;
   while ((step_result = session->record_step()).status ==
@@ -31,8 +31,6 @@
 #include <sys/socket.h>
 #include <sys/sysctl.h>
 
-#include <array>
-#include <initializer_list>
 #include <map>
 #include <memory>
 #include <sstream>
@@ -47,6 +45,7 @@
 #include "log.h"
 #include "AutoRemoteSyscalls.h"
 #include "replayer.h"
+#include "ReplayOutput.h"
 #include "ReplaySession.h"
 #include "syscalls.h"
 #include "task.h"
@@ -61,39 +60,6 @@
 using namespace std;
 using namespace rr;
 
-enum SyscallDefType {
-  rep_UNDEFINED = 0, /* NB: this symbol must have the value 0 */
-  rep_EMU,
-  rep_EXEC,
-  rep_EXEC_RET_EMU,
-  rep_IRREGULAR
-};
-struct syscall_def {
-  /* See syscalls.py for documentation on these values. */
-  SyscallDefType type;
-  /* Not meaningful for rep_IRREGULAR. */
-  ssize_t num_emu_args;
-};
-
-typedef pair<size_t, syscall_def> SyscallInit;
-
-template <size_t N> struct SyscallTable : array<syscall_def, N> {
-  SyscallTable(initializer_list<SyscallInit> init) {
-    for (auto& i : init) {
-      (*this)[i.first] = i.second;
-    }
-  }
-};
-
-template <typename Arch> struct syscall_defs {
-  // Reserve a final element which is guaranteed to be an undefined syscall.
-  // Negative and out-of-range syscall numbers are mapped to this element.
-  typedef SyscallTable<Arch::SYSCALL_COUNT + 1> Table;
-  static Table table;
-};
-
-#include "SyscallDefsTable.generated"
-
 // XXX: x86-only currently.
 #ifdef CHECK_SYSCALL_NUMBERS
 
@@ -181,7 +147,10 @@ static void __ptrace_cont(Task* t) {
 
 template <typename Arch>
 static void rep_maybe_replay_stdio_write_arch(Task* t) {
-  if (!Flags::get().redirect) {
+  if (!Flags::get().redirect || !t->replay_session().replays_output_of(t)) {
+    return;
+  }
+  if (Flags::get().quiet_goto && t->trace_time() < Flags::get().goto_event) {
     return;
   }
 
@@ -190,15 +159,39 @@ static void rep_maybe_replay_stdio_write_arch(Task* t) {
 
   int fd = t->regs().arg1_signed();
   if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
-    size_t len = t->regs().arg3();
-    remote_ptr<void> addr = t->regs().arg2();
-    uint8_t buf[len];
-    // NB: |buf| may not be null-terminated.
-    t->read_bytes_helper(addr, len, buf);
-    maybe_mark_stdio_write(t, fd);
-    if (len != (size_t)write(fd, buf, len)) {
-      FATAL() << "Couldn't write stdio";
+    vector<Task::RemoteIovec> iovs;
+    size_t len = 0;
+    vector<uint8_t> buf;
+    if (Arch::writev == t->regs().original_syscallno()) {
+      // Gather the iovecs' buffers, up to the number of bytes the
+      // recorded writev wrote.
+      int iovcnt = t->regs().arg3_signed();
+      ssize_t written = t->current_trace_frame().regs().syscall_result_signed();
+      if (iovcnt <= 0 || written <= 0) {
+        return;
+      }
+      typename Arch::iovec remote_iovs[iovcnt];
+      t->read_bytes_helper(t->regs().arg2(), sizeof(remote_iovs), remote_iovs);
+      for (int i = 0; i < iovcnt && len < (size_t)written; ++i) {
+        size_t n = min<size_t>(remote_iovs[i].iov_len, written - len);
+        iovs.push_back(Task::RemoteIovec(remote_iovs[i].iov_base, n, nullptr));
+        len += n;
+      }
+      buf.resize(len);
+      for (size_t i = 0, offset = 0; i < iovs.size(); ++i) {
+        iovs[i].local = buf.data() + offset;
+        offset += iovs[i].size;
+      }
+    } else {
+      len = t->regs().arg3();
+      buf.resize(len);
+      iovs.push_back(Task::RemoteIovec(t->regs().arg2(), len, buf.data()));
     }
+    // NB: |buf| may not be null-terminated.
+    t->read_bytes_v(iovs);
+    string mark = stdio_write_mark(t, fd);
+    ReplayOutput::write(fd, mark.data(), mark.size());
+    ReplayOutput::write(fd, buf.data(), len);
   }
 }
 
@@ -213,10 +206,8 @@ static void exit_syscall_emu_ret(Task* t, int syscall) {
 }
 
 static void exit_syscall_emu(Task* t, int syscall, int num_emu_args) {
-  int i;
-
-  for (i = 0; i < num_emu_args; ++i) {
-    t->set_data_from_trace();
+  if (num_emu_args > 0) {
+    t->set_data_from_trace_v(num_emu_args);
   }
   exit_syscall_emu_ret(t, syscall);
 }
@@ -312,9 +303,10 @@ static void process_clone(Task* t, const TraceFrame& trace_frame,
   Registers rec_regs = trace_frame.regs();
   unsigned long flags = rec_regs.arg1();
 
-  if (flags & CLONE_UNTRACED) {
-    // See related comment in rec_process_event.c.
-    rec_regs.set_arg1(flags & ~CLONE_UNTRACED);
+  if (flags & (CLONE_UNTRACED | CLONE_VFORK)) {
+    // See related comment in rec_prepare_syscall_arch.  The
+    // trace already orders the vfork parent after its child.
+    rec_regs.set_arg1(flags & ~(CLONE_UNTRACED | CLONE_VFORK));
     t->set_regs(rec_regs);
   }
 
@@ -370,7 +362,7 @@ static void process_clone(Task* t, const TraceFrame& trace_frame,
 
   Registers r = t->regs();
   // Restore the saved flags, to hide the fact that we may have
-  // masked out CLONE_UNTRACED.
+  // masked out CLONE_UNTRACED or CLONE_VFORK.
   r.set_arg1(flags);
   t->set_regs(r);
   t->set_return_value_from_trace();
@@ -528,6 +520,12 @@ static void process_ioctl(Task* t, SyscallEntryOrExit state,
       step->syscall.num_emu_args = 1;
       return;
   }
+  if (DRM_IOCTL_BASE == _IOC_TYPE(request)) {
+    // How many buffers a DRM ioctl wrote back depends on its
+    // arguments; see process_drm_ioctl() in record_syscall.cc.
+    t->apply_all_data_records_from_trace();
+    return;
+  }
   /* Now on to the "regular" ioctls. */
 
   if (!(_IOC_WRITE & dir)) {
@@ -542,29 +540,6 @@ static void process_ioctl(Task* t, SyscallEntryOrExit state,
   }
 }
 
-void process_ipc(Task* t, const TraceFrame& trace_frame,
-                 SyscallEntryOrExit state, ReplayTraceStep* step) {
-  step->syscall.emu = EMULATE;
-  step->syscall.emu_ret = EMULATE_RETURN;
-  if (SYSCALL_ENTRY == state) {
-    step->action = TSTEP_ENTER_SYSCALL;
-    return;
-  }
-
-  step->action = TSTEP_EXIT_SYSCALL;
-  unsigned int call = trace_frame.regs().arg1();
-  LOG(debug) << "ipc call: " << call;
-  switch (call) {
-    case MSGCTL:
-    case MSGRCV:
-      step->syscall.num_emu_args = 1;
-      return;
-    default:
-      step->syscall.num_emu_args = 0;
-      return;
-  }
-}
-
 /**
  * Pass NOTE_TASK_MAP to update |t|'s cached mmap data.  If the data
  * need to be manually updated, pass |DONT_NOTE_TASK_MAP| and update
@@ -641,43 +616,6 @@ static void create_sigbus_region(AutoRemoteSyscalls& remote, int prot,
   remote.syscall(Arch::close, child_fd);
 }
 
-template <typename Arch>
-static remote_ptr<void> finish_private_mmap(AutoRemoteSyscalls& remote,
-                                            const TraceFrame& trace_frame,
-                                            int prot, int flags,
-                                            off64_t offset_pages,
-                                            const TraceMappedRegion* file) {
-  LOG(debug) << "  finishing private mmap of " << file->file_name();
-
-  Task* t = remote.task();
-  const Registers& rec_regs = trace_frame.regs();
-  size_t num_bytes = rec_regs.arg2();
-  remote_ptr<void> mapped_addr =
-      finish_anonymous_mmap<Arch>(remote, trace_frame, prot,
-                                  /* The restored region
-                                   * won't be backed by
-                                   * file. */
-                                  flags | MAP_ANONYMOUS, DONT_NOTE_TASK_MAP);
-  /* Restore the map region we copied. */
-  ssize_t data_size = t->set_data_from_trace();
-
-  /* Ensure pages past the end of the file fault on access */
-  size_t data_pages = ceil_page_size(data_size);
-  size_t mapped_pages = ceil_page_size(num_bytes);
-  create_sigbus_region<Arch>(remote, prot, mapped_addr + data_pages,
-                             mapped_pages - data_pages);
-
-  t->vm()->map(mapped_addr, num_bytes, prot, flags, page_size() * offset_pages,
-               // Intentionally drop the stat() information
-               // saved to trace so as to match /proc/maps's
-               // device/inode info for this anonymous mapping.
-               // Preserve the mapping name though, so
-               // AddressSpace::dump() shows something useful.
-               MappableResource(FileId(), file->file_name().c_str()));
-
-  return mapped_addr;
-}
-
 static void verify_backing_file(const TraceMappedRegion* file, int prot,
                                 int flags) {
   struct stat metadata;
@@ -723,7 +661,11 @@ static remote_ptr<void> finish_direct_mmap(
   LOG(debug) << "directly mmap'ing " << length << " bytes of "
              << file->file_name() << " at page offset " << HEX(offset_pages);
 
-  if (verify) {
+  // Processes usually map the same libraries, so only check each file
+  // the first time it's mapped this way.
+  if (verify &&
+      t->replay_session().backing_file_needs_verification(*file, prot,
+                                                          flags)) {
     verify_backing_file(file, prot, flags);
   }
 
@@ -766,6 +708,137 @@ static remote_ptr<void> finish_direct_mmap(
   return mapped_addr;
 }
 
+/**
+ * Return the path of a file in the trace directory that holds the first
+ * |data_size| bytes of the private copy of |file| recorded at
+ * |trace_frame|, with the pages that weren't saved zeroed, writing the
+ * file from the frame's raw data if neither an earlier mapping of the same
+ * file contents nor an earlier replay of the trace already has. The
+ * frame's raw data is consumed either way. Returns an empty string,
+ * leaving the raw data unread, if the file can't be written.
+ */
+static string cached_private_copy(Task* t, const TraceFrame& trace_frame,
+                                  const TraceMappedRegion* file,
+                                  off64_t offset_pages, size_t data_size) {
+  string path = t->trace_reader().mmap_cache_path(
+      *file, page_size() * offset_pages, data_size);
+  struct stat metadata;
+  if (!stat(path.c_str(), &metadata) &&
+      size_t(metadata.st_size) == ceil_page_size(data_size)) {
+    t->trace_reader().skip_raw_data_for_frame(trace_frame);
+    return path;
+  }
+
+  // Write the file under a temporary name, so concurrent replays never map
+  // a partial copy.
+  stringstream tmp;
+  tmp << path << ".tmp" << getpid();
+  ScopedFd fd(tmp.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+              0400);
+  if (!fd.is_open()) {
+    LOG(debug) << "  can't cache copy at " << tmp.str();
+    return string();
+  }
+  bool ok = !ftruncate(fd, ceil_page_size(data_size));
+  remote_ptr<void> rec_addr = trace_frame.regs().syscall_result();
+  TraceReader::RawData buf;
+  while (t->trace_reader().read_raw_data_for_frame(trace_frame, buf)) {
+    size_t buf_offset = buf.addr - rec_addr;
+    assert(buf.addr >= rec_addr);
+    if (buf_offset >= data_size) {
+      continue;
+    }
+    size_t len = min(buf.data.size(), data_size - buf_offset);
+    ok = ok && pwrite64(fd, buf.data.data(), len, buf_offset) == ssize_t(len);
+  }
+  fd.close();
+  if (!ok || rename(tmp.str().c_str(), path.c_str())) {
+    FATAL() << "Unable to write cached copy `" << path << "'";
+  }
+  return path;
+}
+
+template <typename Arch>
+static remote_ptr<void> finish_private_mmap(AutoRemoteSyscalls& remote,
+                                            const TraceFrame& trace_frame,
+                                            int prot, int flags,
+                                            off64_t offset_pages,
+                                            const TraceMappedRegion* file) {
+  LOG(debug) << "  finishing private mmap of " << file->file_name();
+
+  Task* t = remote.task();
+  const Registers& rec_regs = trace_frame.regs();
+  size_t num_bytes = rec_regs.arg2();
+  off64_t file_end = file->stat().st_size - page_size() * offset_pages;
+  size_t data_size = min<off64_t>(max<off64_t>(file_end, 0), num_bytes);
+
+  string cached = data_size ? cached_private_copy(t, trace_frame, file,
+                                                    offset_pages, data_size)
+                            : string();
+  if (!cached.empty()) {
+    // Map the cached copy itself, so its pages are only read when the
+    // tracee touches them. Pages past its end fault with SIGBUS, as pages
+    // past the end of the recorded file did.
+    struct stat metadata;
+    if (stat(cached.c_str(), &metadata)) {
+      FATAL() << "Failed to stat " << cached << ": replay is impossible";
+    }
+    LOG(debug) << "  mapping cached copy " << cached;
+    TraceMappedRegion copy(cached, metadata, file->start(), file->end());
+    return finish_direct_mmap<Arch>(remote, trace_frame, prot, flags, 0, &copy,
+                                    DONT_VERIFY);
+  }
+
+  remote_ptr<void> mapped_addr =
+      finish_anonymous_mmap<Arch>(remote, trace_frame, prot,
+                                  /* The restored region
+                                   * won't be backed by
+                                   * file. */
+                                  flags | MAP_ANONYMOUS, DONT_NOTE_TASK_MAP);
+  /* Restore the pages of the region we copied; pages that weren't saved
+   * were zero. */
+  t->apply_all_data_records_from_trace();
+
+  /* Ensure pages past the end of the file fault on access */
+  size_t data_pages = ceil_page_size(data_size);
+  size_t mapped_pages = ceil_page_size(num_bytes);
+  create_sigbus_region<Arch>(remote, prot, mapped_addr + data_pages,
+                             mapped_pages - data_pages);
+
+  t->vm()->map(mapped_addr, num_bytes, prot, flags, page_size() * offset_pages,
+               // Intentionally drop the stat() information
+               // saved to trace so as to match /proc/maps's
+               // device/inode info for this anonymous mapping.
+               // Preserve the mapping name though, so
+               // AddressSpace::dump() shows something useful.
+               MappableResource(FileId(), file->file_name().c_str()));
+
+  return mapped_addr;
+}
+
+/**
+ * Map the copy of |file| that the recording saved in the shared store
+ * directly, so its pages are only read when the tracee touches them.
+ */
+template <typename Arch>
+static remote_ptr<void> finish_stored_mmap(AutoRemoteSyscalls& remote,
+                                           const TraceFrame& trace_frame,
+                                           int prot, int flags,
+                                           const TraceMappedRegion* file) {
+  Task* t = remote.task();
+  string path = t->trace_reader().trace_file_path(file->stored_file());
+  struct stat metadata;
+  if (stat(path.c_str(), &metadata)) {
+    FATAL() << "Failed to stat " << path << ": replay is impossible";
+  }
+  LOG(debug) << "  mapping stored copy " << path;
+  // The copy starts at the recorded offset into the file, so map it from
+  // its start.
+  TraceMappedRegion stored(path, metadata, file->start(), file->end());
+  return finish_direct_mmap<Arch>(remote, trace_frame, prot, flags, 0,
+                                  &stored, DONT_VERIFY);
+}
+
 template <typename Arch>
 static remote_ptr<void> finish_shared_mmap(AutoRemoteSyscalls& remote,
                                            const TraceFrame& trace_frame,
@@ -795,25 +868,54 @@ static remote_ptr<void> finish_shared_mmap(AutoRemoteSyscalls& remote,
   // TODO: this is a poor man's shared segment synchronization.
   // For full generality, we also need to emulate direct file
   // modifications through write/splice/etc.
-  auto buf = t->trace_reader().read_raw_data();
-  assert(mapped_addr == buf.addr &&
-         rec_num_bytes == ceil_page_size(buf.data.size()));
-
+  // The segment was saved a page at a time.
   off64_t offset_bytes = page_size() * offset_pages;
-  if (ssize_t(buf.data.size()) !=
-      pwrite64(emufile->fd(), buf.data.data(), buf.data.size(), offset_bytes)) {
-    FATAL() << "Failed to write " << buf.data.size() << " bytes at "
-            << HEX(offset_bytes) << " to " << vfile.file_name();
+  size_t data_size = 0;
+  TraceReader::RawData buf;
+  while (t->trace_reader().read_raw_data_for_frame(trace_frame, buf)) {
+    size_t buf_offset = buf.addr - mapped_addr;
+    assert(buf.addr >= mapped_addr && buf_offset == data_size &&
+           buf_offset + buf.data.size() <= rec_num_bytes);
+    emufile->write(buf.data.data(), buf.data.size(),
+                   offset_bytes + buf_offset);
+    data_size += buf.data.size();
   }
-  LOG(debug) << "  restored " << buf.data.size() << " bytes at "
-             << HEX(offset_bytes) << " to " << vfile.file_name();
+  // Private mappings of the file see these writes too.
+  Task::invalidate_read_caches();
+  LOG(debug) << "  restored " << data_size << " bytes at " << HEX(offset_bytes)
+             << " to " << vfile.file_name();
 
-  t->vm()->map(mapped_addr, buf.data.size(), prot, flags, offset_bytes,
+  t->vm()->map(mapped_addr, data_size, prot, flags, offset_bytes,
                MappableResource::shared_mmap_file(*file));
 
   return mapped_addr;
 }
 
+/**
+ * Map the io_uring rings (or SQE array) recorded as |file| over anonymous
+ * shared memory, filled with their recorded contents.  The kernel's
+ * updates to the rings are replayed as shared mapping changes.
+ */
+template <typename Arch>
+static remote_ptr<void> finish_io_uring_mmap(AutoRemoteSyscalls& remote,
+                                             const TraceFrame& trace_frame,
+                                             int prot, int flags,
+                                             off64_t offset_pages,
+                                             const TraceMappedRegion* file) {
+  LOG(debug) << "  finishing io_uring mmap at " << file->start();
+
+  Task* t = remote.task();
+  remote_ptr<void> mapped_addr = finish_anonymous_mmap<Arch>(
+      remote, trace_frame, prot, flags | MAP_ANONYMOUS, offset_pages,
+      DONT_NOTE_TASK_MAP);
+  t->apply_all_data_records_from_trace();
+  t->vm()->map(mapped_addr, trace_frame.regs().arg2(), prot, flags,
+               page_size() * offset_pages,
+               MappableResource(FileId(file->stat()),
+                                file->file_name().c_str()));
+  return mapped_addr;
+}
+
 template <typename Arch>
 static void process_mmap(Task* t, const TraceFrame& trace_frame,
                          SyscallEntryOrExit state, int prot, int flags,
@@ -841,9 +943,15 @@ static void process_mmap(Task* t, const TraceFrame& trace_frame,
     } else {
       auto file = t->trace_reader().read_mapped_region();
 
-      if (!file.copied()) {
+      if (is_io_uring_file(file.file_name().c_str())) {
+        mapped_addr = finish_io_uring_mmap<Arch>(remote, trace_frame, prot,
+                                                 flags, offset_pages, &file);
+      } else if (!file.copied()) {
         mapped_addr = finish_direct_mmap<Arch>(remote, trace_frame, prot, flags,
                                                offset_pages, &file);
+      } else if (!file.stored_file().empty()) {
+        mapped_addr =
+            finish_stored_mmap<Arch>(remote, trace_frame, prot, flags, &file);
       } else if (!(MAP_SHARED & flags)) {
         mapped_addr = finish_private_mmap<Arch>(remote, trace_frame, prot,
                                                 flags, offset_pages, &file);
@@ -861,54 +969,201 @@ static void process_mmap(Task* t, const TraceFrame& trace_frame,
 }
 
 /**
- * Restore the recorded msghdr pointed at in |t|'s address space by
- * |child_msghdr|.
+ * Attach in |t|, at |addr|, the emulated file standing in for the SysV
+ * shm segment recorded as attached there with |shmflg|, first writing
+ * the segment's recorded contents to it if there are any.  Replay
+ * attaches the same emulated file wherever the segment was attached, so
+ * the tracees see each other's writes as they did during recording.
  */
 template <typename Arch>
-static void restore_struct_msghdr(
-    Task* t, remote_ptr<typename Arch::msghdr> child_msghdr) {
-  auto msg = t->read_mem(child_msghdr);
+static void finish_shmat(Task* t, const TraceFrame& trace_frame, int shmflg,
+                         remote_ptr<void> addr) {
+  auto file = t->trace_reader().read_mapped_region();
+  size_t size = file.end() - file.start();
+  int prot = PROT_READ;
+  if (!(shmflg & SHM_RDONLY)) {
+    prot |= PROT_WRITE;
+  }
+  if (shmflg & SHM_EXEC) {
+    prot |= PROT_EXEC;
+  }
+  LOG(debug) << "  attaching " << file.file_name() << " at " << addr;
+
+  auto emufile = t->replay_session().emufs().get_or_create(file);
+  if (file.copied()) {
+    // Only the pages that weren't zero were recorded.
+    emufile->zero(0, file.stat().st_size);
+    TraceReader::RawData buf;
+    while (t->trace_reader().read_raw_data_for_frame(trace_frame, buf)) {
+      assert(buf.addr >= addr && buf.addr + buf.data.size() <= addr + size);
+      emufile->write(buf.data.data(), buf.data.size(), buf.addr - addr);
+    }
+    Task::invalidate_read_caches();
+  }
 
-  // Restore msg itself.
-  t->set_data_from_trace();
-  // Restore msg.msg_name.
-  t->set_data_from_trace();
-  // For each iovec arg, restore its recorded data.
-  for (size_t i = 0; i < msg.msg_iovlen; ++i) {
-    // Restore iov_base buffer.
+  {
+    AutoRemoteSyscalls remote(t);
+    int fd;
+    {
+      AutoRestoreMem child_str(remote, emufile->proc_path().c_str());
+      fd = remote.syscall(Arch::open, child_str.get().as_int(),
+                          (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+      if (0 > fd) {
+        FATAL() << "Couldn't open " << emufile->proc_path()
+                << " to attach in tracee";
+      }
+    }
+    remote_ptr<void> mapped_addr = remote.syscall(
+        has_mmap2_syscall(Arch::arch()) ? Arch::mmap2 : Arch::mmap, addr,
+        size, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+    ASSERT(t, mapped_addr == addr) << "Attached shm segment at "
+                                   << mapped_addr << " instead of " << addr;
+    remote.syscall(Arch::close, fd);
+  }
+  t->vm()->map(addr, size, prot, MAP_SHARED, 0,
+               MappableResource::shared_mmap_file(file));
+}
+
+/**
+ * |child_addr| is where ipc(SHMAT, ...) stores the attach address, or
+ * null for shmat(), which returns it.
+ */
+template <typename Arch>
+static void process_shmat(
+    Task* t, const TraceFrame& trace_frame, SyscallEntryOrExit state,
+    int shmflg, remote_ptr<typename Arch::unsigned_long> child_addr,
+    ReplayTraceStep* step) {
+  step->syscall.emu = EMULATE;
+  if (SYSCALL_ENTRY == state) {
+    step->action = TSTEP_ENTER_SYSCALL;
+    return;
+  }
+  if (trace_frame.regs().syscall_failed()) {
+    step->syscall.emu_ret = EMULATE_RETURN;
+    step->syscall.num_emu_args = 0;
+    step->action = TSTEP_EXIT_SYSCALL;
+    return;
+  }
+
+  t->finish_emulated_syscall();
+  remote_ptr<void> addr;
+  if (child_addr.is_null()) {
+    addr = trace_frame.regs().syscall_result();
+  } else {
     t->set_data_from_trace();
+    addr = t->read_mem(child_addr);
   }
-  // Restore msg_control buffer.
-  t->set_data_from_trace();
+  finish_shmat<Arch>(t, trace_frame, shmflg, addr);
+  t->set_return_value_from_trace();
+  validate_args(trace_frame.regs().original_syscallno(), t);
+
+  step->action = TSTEP_RETIRE;
 }
 
-/** Like restore_struct_msghdr(), but for mmsghdr. */
 template <typename Arch>
-static void restore_struct_mmsghdr(
-    Task* t, remote_ptr<typename Arch::mmsghdr> child_mmsghdr) {
-  remote_ptr<void> tmp = child_mmsghdr;
-  auto child_msghdr = tmp.cast<typename Arch::msghdr>();
-  restore_struct_msghdr<Arch>(t, child_msghdr);
-  t->set_data_from_trace();
+static void process_shmdt(Task* t, const TraceFrame& trace_frame,
+                          SyscallEntryOrExit state, remote_ptr<void> addr,
+                          ReplayTraceStep* step) {
+  step->syscall.emu = EMULATE;
+  if (SYSCALL_ENTRY == state) {
+    step->action = TSTEP_ENTER_SYSCALL;
+    return;
+  }
+  if (trace_frame.regs().syscall_failed()) {
+    step->syscall.emu_ret = EMULATE_RETURN;
+    step->syscall.num_emu_args = 0;
+    step->action = TSTEP_EXIT_SYSCALL;
+    return;
+  }
+
+  t->finish_emulated_syscall();
+  size_t size = t->vm()->shm_attach_size(addr);
+  ASSERT(t, size > 0) << "No shm segment attached at " << addr;
+  {
+    AutoRemoteSyscalls remote(t);
+    remote.syscall(Arch::munmap, addr, size);
+  }
+  t->vm()->unmap(addr, size);
+  t->set_return_value_from_trace();
+  validate_args(trace_frame.regs().original_syscallno(), t);
+
+  step->action = TSTEP_RETIRE;
+}
+
+template <typename Arch>
+static void process_ipc(Task* t, const TraceFrame& trace_frame,
+                        SyscallEntryOrExit state, ReplayTraceStep* step) {
+  unsigned int call = trace_frame.regs().arg1();
+  switch (call) {
+    case SHMAT:
+      return process_shmat<Arch>(t, trace_frame, state,
+                                 (int)trace_frame.regs().arg3_signed(),
+                                 trace_frame.regs().arg4(), step);
+    case SHMDT:
+      return process_shmdt<Arch>(t, trace_frame, state,
+                                 trace_frame.regs().arg5(), step);
+  }
+
+  step->syscall.emu = EMULATE;
+  step->syscall.emu_ret = EMULATE_RETURN;
+  if (SYSCALL_ENTRY == state) {
+    step->action = TSTEP_ENTER_SYSCALL;
+    return;
+  }
+
+  step->action = TSTEP_EXIT_SYSCALL;
+  LOG(debug) << "ipc call: " << call;
+  switch (call) {
+    case MSGCTL:
+    case MSGRCV:
+    case SHMCTL:
+      step->syscall.num_emu_args = 1;
+      return;
+    default:
+      step->syscall.num_emu_args = 0;
+      return;
+  }
+}
+
+/**
+ * Restore the recorded msghdr pointed at in |t|'s address space by
+ * |child_msghdr|.
+ */
+template <typename Arch>
+static void restore_struct_msghdr(
+    Task* t, remote_ptr<typename Arch::msghdr> child_msghdr) {
+  auto msg = t->read_mem(child_msghdr);
+
+  // Restore msg itself, msg.msg_name, each iov_base buffer and the
+  // msg_control buffer.
+  t->set_data_from_trace_v(3 + msg.msg_iovlen);
 }
 
 /**
- * Restore saved struct mmsghdr* msgvec
+ * Restore saved struct mmsghdr* msgvec: for each message, the records of
+ * restore_struct_msghdr() followed by msg_len, all written in one go.
  */
 template <typename Arch>
 static void restore_msgvec(Task* t, int nmmsgs,
                            remote_ptr<typename Arch::mmsghdr> pmsgvec) {
-  for (int i = 0; i < nmmsgs; ++i, ++pmsgvec) {
-    restore_struct_mmsghdr<Arch>(t, pmsgvec);
+  if (nmmsgs <= 0) {
+    return;
+  }
+  vector<typename Arch::mmsghdr> msgs(nmmsgs);
+  t->read_bytes_helper(pmsgvec, nmmsgs * sizeof(msgs[0]), msgs.data());
+  size_t records = 0;
+  for (auto& msg : msgs) {
+    records += 3 + msg.msg_hdr.msg_iovlen + 1;
   }
+  t->set_data_from_trace_v(records);
 }
 
 /**
  * Restore saved msglen for each struct mmsghdr* of msgvec
  */
 static void restore_msglen_for_msgvec(Task* t, int nmmsgs) {
-  for (int i = 0; i < nmmsgs; ++i) {
-    t->set_data_from_trace();
+  if (nmmsgs > 0) {
+    t->set_data_from_trace_v(nmmsgs);
   }
 }
 
@@ -1036,12 +1291,18 @@ static void process_init_buffers(Task* t, SyscallEntryOrExit state,
   t->finish_emulated_syscall();
   remote_ptr<void> rec_child_map_addr =
       t->current_trace_frame().regs().syscall_result();
+  auto data = t->trace_reader().read_raw_data();
+  ASSERT(t, data.data.size() == sizeof(struct rrcall_init_buffers_params));
+  auto rec_args =
+      reinterpret_cast<const struct rrcall_init_buffers_params*>(
+          data.data.data());
 
   /* We don't want the desched event fd during replay, because
    * we already know where they were.  (The perf_event fd is
    * emulated anyway.) */
   remote_ptr<void> child_map_addr =
-      t->init_buffers(rec_child_map_addr, DONT_SHARE_DESCHED_EVENT_FD);
+      t->init_buffers(rec_child_map_addr, DONT_SHARE_DESCHED_EVENT_FD,
+                      rec_args->syscallbuf_size);
 
   ASSERT(t, child_map_addr == rec_child_map_addr)
       << "Should have mapped syscallbuf at " << rec_child_map_addr
@@ -1281,29 +1542,22 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
     }
   }
 
-  auto& table = syscall_defs<Arch>::table;
-  if (syscall < 0 || syscall >= int(array_length(table))) {
-    // map to an invalid syscall.
-    syscall = array_length(table) - 1;
-    // we ensure this when we construct the table
-    assert(table[syscall].type == rep_UNDEFINED);
-  }
-
-  const struct syscall_def* def = &table[syscall];
-  ASSERT(t, rep_UNDEFINED != def->type) << "Valid but unhandled syscallno "
-                                        << syscall;
+  const SyscallInfo& info = syscall_info_arch<Arch>(syscall);
+  ASSERT(t, SYSCALL_REGULAR == info.kind || SYSCALL_IRREGULAR == info.kind)
+      << "Valid but unhandled syscallno " << syscall;
 
   step->syscall.number = syscall;
 
   t->maybe_update_vm(syscall, state);
 
-  if (rep_IRREGULAR != def->type) {
-    step->syscall.num_emu_args = def->num_emu_args;
+  if (SYSCALL_REGULAR == info.kind) {
+    step->syscall.num_emu_args = info.num_recorded_args;
     step->action = syscall_action(state);
-    step->syscall.emu = rep_EMU == def->type ? EMULATE : EXEC;
-    step->syscall.emu_ret =
-        (rep_EMU == def->type || rep_EXEC_RET_EMU == def->type) ? EMULATE_RETURN
-                                                                : EXEC_RETURN;
+    step->syscall.emu = SEMANTICS_EMU == info.semantics ? EMULATE : EXEC;
+    step->syscall.emu_ret = (SEMANTICS_EMU == info.semantics ||
+                             SEMANTICS_EXEC_RET_EMU == info.semantics)
+                                ? EMULATE_RETURN
+                                : EXEC_RETURN;
     // TODO: there are several syscalls below that aren't
     // /actually/ irregular, they just want to update some
     // state on syscall exit.  Convert them to use
@@ -1314,8 +1568,6 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
     return;
   }
 
-  assert(rep_IRREGULAR == def->type);
-
   /* Manual implementations of irregular syscalls. */
 
   switch (syscall) {
@@ -1370,9 +1622,6 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
       return process_futex(t, trace_frame, state, step);
 
     case Arch::epoll_wait:
-    case Arch::getxattr:
-    case Arch::lgetxattr:
-    case Arch::fgetxattr:
     case Arch::poll:
     case Arch::ppoll:
     case Arch::read:
@@ -1383,6 +1632,7 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
     case Arch::waitpid:
     case Arch::msgctl:
     case Arch::msgrcv:
+    case Arch::shmctl:
       step->syscall.emu = EMULATE;
       step->syscall.emu_ret = EMULATE_RETURN;
       step->syscall.num_emu_args = 1;
@@ -1407,7 +1657,16 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
       return process_ioctl(t, state, step);
 
     case Arch::ipc:
-      return process_ipc(t, trace_frame, state, step);
+      return process_ipc<Arch>(t, trace_frame, state, step);
+
+    case Arch::shmat:
+      return process_shmat<Arch>(t, trace_frame, state,
+                                 (int)trace_frame.regs().arg3_signed(),
+                                 nullptr, step);
+
+    case Arch::shmdt:
+      return process_shmdt<Arch>(t, trace_frame, state,
+                                 trace_frame.regs().arg1(), step);
 
     case Arch::mmap: {
       if (SYSCALL_ENTRY == state) {
@@ -1554,6 +1813,7 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
     case Arch::socketcall:
       return process_socketcall<Arch>(t, state, step);
 
+    case Arch::copy_file_range:
     case Arch::splice:
     case Arch::_sysctl:
     case Arch::wait4:
@@ -1569,6 +1829,21 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
       return;
 
     case Arch::write:
+    case Arch::readv:
+    case Arch::io_uring_setup:
+    case Arch::io_uring_enter:
+    case Arch::io_uring_register:
+      step->syscall.num_emu_args = 0;
+      step->syscall.emu = EMULATE;
+      step->syscall.emu_ret = EMULATE_RETURN;
+      step->action = syscall_action(state);
+      if (state == SYSCALL_EXIT) {
+        // The filled part of each iovec, or each buffer an io_uring
+        // completion filled, was recorded separately.
+        t->apply_all_data_records_from_trace();
+      }
+      return;
+
     case Arch::writev:
       step->syscall.num_emu_args = 0;
       step->syscall.emu = EMULATE;
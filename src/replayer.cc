@@ -10,7 +10,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <limits>
 #include <map>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -19,9 +22,12 @@
 #include "GdbContext.h"
 #include "kernel_abi.h"
 #include "log.h"
+#include "ReplayOutput.h"
+#include "ReplayProfiler.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
 #include "task.h"
+#include "TracePartition.h"
 #include "util.h"
 
 using namespace rr;
@@ -49,6 +55,23 @@ static const uintptr_t DBG_COMMAND_MSG_CREATE_CHECKPOINT = 0x01000000;
  * command parameter.
  */
 static const uintptr_t DBG_COMMAND_MSG_DELETE_CHECKPOINT = 0x02000000;
+/**
+ * Print the replay statistics gathered so far to stderr. The command
+ * parameter is ignored.
+ */
+static const uintptr_t DBG_COMMAND_MSG_PRINT_STATISTICS = 0x03000000;
+/**
+ * Serve memory and register reads from the checkpoint whose index is
+ * given by the command parameter, without restarting into it.  0 goes
+ * back to reading the current state.
+ */
+static const uintptr_t DBG_COMMAND_MSG_VIEW_CHECKPOINT = 0x04000000;
+/**
+ * Like DBG_COMMAND_MSG_VIEW_CHECKPOINT, for the last automatic
+ * checkpoint taken at or before the event given by the command
+ * parameter.
+ */
+static const uintptr_t DBG_COMMAND_MSG_VIEW_EVENT = 0x05000000;
 static const uintptr_t DBG_COMMAND_PARAMETER_MASK = 0x00FFFFFF;
 
 // |session| is used to drive replay.
@@ -63,8 +86,32 @@ static ReplaySession::shr_ptr debugger_restart_checkpoint;
 // process/event.
 static unique_ptr<GdbContext> stashed_dbg;
 
+// The socket gdb was told to connect to when it was launched before the
+// debugger was wanted, and the image it was launched on.  See
+// |maybe_launch_debugger_early()|.
+static ScopedFd early_listen_fd;
+static string early_exe_image;
+
 // Checkpoints, indexed by checkpoint ID
 map<int, ReplaySession::shr_ptr> checkpoints;
+
+// Checkpoints taken automatically every Flags::checkpoint_interval events
+// or Flags::checkpoint_interval_secs seconds, indexed by the event they
+// were taken before.
+static map<TraceFrame::Time, ReplaySession::shr_ptr> auto_checkpoints;
+
+// When the last automatic checkpoint was taken or restored.
+static double last_auto_checkpoint_sec;
+
+// The checkpoint memory and register reads are being served from, if
+// any.  Its tasks stay stopped where the checkpoint was taken; they're
+// only read, through their mem_fds and saved registers.
+static ReplaySession::shr_ptr viewed_checkpoint;
+
+// The event the debugger attached at.  Reverse execution doesn't go
+// back past it.
+static TraceFrame::Time debugger_start_event;
+
 // Special-sauce macros defined by rr when launching the gdb client,
 // which implement functionality outside of the gdb remote protocol.
 // (Don't stare at them too long or you'll go blind ;).)
@@ -82,9 +129,23 @@ static const char gdb_rr_macros[] =
     "define delete checkpoint\n"
     "  p (*(int*)29298 = 0x02000000 | $arg0), $arg0\n"
     "end\n"
+    "define rr-statistics\n"
+    "  p (*(int*)29298 = 0x03000000), 0\n"
+    "end\n"
+    "define checkpoint-view\n"
+    "  p (*(int*)29298 = 0x04000000 | $arg0), $arg0\n"
+    "  flushregs\n"
+    "end\n"
+    "define checkpoint-view-event\n"
+    "  p (*(int*)29298 = 0x05000000 | $arg0), $arg0\n"
+    "  flushregs\n"
+    "end\n"
     "define restart\n"
     "  run c$arg0\n"
     "end\n"
+    "define goto\n"
+    "  run $arg0\n"
+    "end\n"
     "handle SIGURG stop\n";
 
 // The parent process waits until the server, |child|, creates a debug socket.
@@ -110,6 +171,27 @@ static GdbRegisterValue get_reg(Task* t, GdbRegister which) {
   return reg;
 }
 
+vector<GdbRegisterValue> get_expedited_regs(Task* t) {
+  static const GdbRegister x86_regs[] = { DREG_EIP, DREG_ESP, DREG_EBP };
+  static const GdbRegister x86_64_regs[] = { DREG_RIP, DREG_RSP, DREG_RBP };
+  vector<GdbRegisterValue> regs;
+  switch (t->arch()) {
+    case x86:
+      for (auto r : x86_regs) {
+        regs.push_back(get_reg(t, r));
+      }
+      break;
+    case x86_64:
+      for (auto r : x86_64_regs) {
+        regs.push_back(get_reg(t, r));
+      }
+      break;
+    default:
+      break;
+  }
+  return regs;
+}
+
 static GdbThreadId get_threadid(Task* t) {
   GdbThreadId thread;
   thread.pid = t->tgid();
@@ -179,10 +261,62 @@ static void delete_checkpoint(int checkpoint_id) {
     return;
   }
 
+  if (viewed_checkpoint == it->second) {
+    viewed_checkpoint = nullptr;
+  }
   it->second->kill_all_tasks();
   checkpoints.erase(it);
 }
 
+/**
+ * Return the task to read |target|'s state from: |target| itself, or
+ * its counterpart in the viewed checkpoint, which is nullptr if the
+ * thread didn't exist yet when the checkpoint was taken.
+ */
+static Task* viewed_task(Task* target) {
+  if (!viewed_checkpoint) {
+    return target;
+  }
+  return viewed_checkpoint->find_task(target->rec_tid);
+}
+
+static void view_auto_checkpoint(TraceFrame::Time event) {
+  auto it = auto_checkpoints.upper_bound(event);
+  if (it == auto_checkpoints.begin()) {
+    fprintf(stderr, "No automatic checkpoint at or before event %u\n",
+            event);
+    return;
+  }
+  --it;
+  fprintf(stderr, "Viewing the automatic checkpoint at event %u\n",
+          it->first);
+  viewed_checkpoint = it->second;
+}
+
+/**
+ * The conditions gdb attached to a breakpoint.  Evaluating them here
+ * saves a round trip to gdb for every hit of a breakpoint whose
+ * condition is mostly false.
+ */
+class GdbBreakpointCondition : public BreakpointCondition {
+public:
+  GdbBreakpointCondition(const vector<GdbExpression>& expressions)
+      : expressions(expressions) {}
+  virtual bool evaluate(Task* t) const {
+    for (auto& e : expressions) {
+      int64_t value;
+      // Let gdb sort out the conditions we can't evaluate.
+      if (!e.evaluate(t, &value) || value) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  vector<GdbExpression> expressions;
+};
+
 /**
  * If |req| is a magic-write command, interpret it and return true.
  * Otherwise, do nothing and return false.
@@ -205,6 +339,18 @@ static bool maybe_process_magic_command(Task* t, GdbContext* dbg,
     case DBG_COMMAND_MSG_DELETE_CHECKPOINT:
       delete_checkpoint(param);
       break;
+    case DBG_COMMAND_MSG_PRINT_STATISTICS:
+      session->print_statistics(stderr);
+      break;
+    case DBG_COMMAND_MSG_VIEW_CHECKPOINT:
+      viewed_checkpoint = param ? get_checkpoint(param) : nullptr;
+      if (param && !viewed_checkpoint) {
+        fprintf(stderr, "No checkpoint %d\n", int(param));
+      }
+      break;
+    case DBG_COMMAND_MSG_VIEW_EVENT:
+      view_auto_checkpoint(param);
+      break;
     default:
       return false;
   }
@@ -230,18 +376,21 @@ void dispatch_debugger_request(Session& session, GdbContext* dbg, Task* t,
       return;
     case DREQ_GET_THREAD_LIST: {
       auto tasks = t->session().tasks();
-      vector<GdbThreadId> tids;
+      vector<GdbThreadInfo> threads;
       for (auto& kv : tasks) {
         Task* t = kv.second;
-        tids.push_back(get_threadid(t));
+        GdbThreadInfo info;
+        info.id = get_threadid(t);
+        info.name = t->name();
+        threads.push_back(info);
       }
-      dbg->reply_get_thread_list(tids);
+      dbg->reply_get_thread_list(threads);
       return;
     }
     case DREQ_INTERRUPT:
       // Tell the debugger we stopped and await further
       // instructions.
-      dbg->notify_stop(get_threadid(t), 0);
+      dbg->notify_stop(get_threadid(t), 0, 0, get_expedited_regs(t));
       return;
     case DREQ_DETACH:
       LOG(info) << ("(debugger detached from us, rr exiting)");
@@ -286,37 +435,36 @@ void dispatch_debugger_request(Session& session, GdbContext* dbg, Task* t,
   }
   switch (req.type) {
     case DREQ_GET_AUXV: {
-      char filename[] = "/proc/01234567890/auxv";
-      vector<GdbAuxvPair> auxv;
-      auxv.resize(4096);
-
-      snprintf(filename, sizeof(filename) - 1, "/proc/%d/auxv",
-               target->real_tgid());
-      ScopedFd fd(filename, O_RDONLY);
-      if (0 > fd) {
-        auxv.clear();
-        dbg->reply_get_auxv(auxv);
-        return;
-      }
-
-      ssize_t len = read(fd, auxv.data(), sizeof(auxv[0]) * auxv.size());
-      if (0 > len) {
-        auxv.clear();
-        dbg->reply_get_auxv(auxv);
-        return;
-      }
-
-      assert(0 == len % sizeof(auxv[0]));
-      auxv.resize(len / sizeof(auxv[0]));
+      const vector<uint8_t>& bytes = target->vm()->saved_auxv(target);
+      vector<GdbAuxvPair> auxv(bytes.size() / sizeof(GdbAuxvPair));
+      memcpy(auxv.data(), bytes.data(), auxv.size() * sizeof(auxv[0]));
       dbg->reply_get_auxv(auxv);
       return;
     }
+    case DREQ_GET_LIBRARIES: {
+      const AddressSpace::LibraryList& list = target->vm()->libraries(target);
+      vector<GdbLibraryInfo> libraries;
+      for (auto& lib : list.libraries) {
+        GdbLibraryInfo info = { lib.name, lib.lm.as_int(), lib.l_addr,
+                                lib.l_ld.as_int() };
+        libraries.push_back(info);
+      }
+      dbg->reply_get_libraries(list.valid ? list.main_lm.as_int() : 0,
+                               libraries);
+      return;
+    }
     case DREQ_GET_MEM: {
+      Task* source = viewed_task(target);
       vector<uint8_t> mem;
-      mem.resize(req.mem.len);
-      ssize_t nread =
-          target->read_bytes_fallible(req.mem.addr, req.mem.len, mem.data());
-      mem.resize(max(ssize_t(0), nread));
+      mem.resize(source ? req.mem.len : 0);
+      // Code and read-only data are served from the mapped files, which
+      // is much cheaper for the big reads gdb makes loading symbols.
+      if (source && !source->vm()->read_bytes_from_file(
+                        req.mem.addr, req.mem.len, mem.data())) {
+        ssize_t nread =
+            source->read_bytes_fallible(req.mem.addr, req.mem.len, mem.data());
+        mem.resize(max(ssize_t(0), nread));
+      }
       dbg->reply_get_mem(mem);
       return;
     }
@@ -331,6 +479,11 @@ void dispatch_debugger_request(Session& session, GdbContext* dbg, Task* t,
       if (maybe_process_magic_command(target, dbg, req)) {
         return;
       }
+      if (viewed_checkpoint) {
+        LOG(error) << "Attempt to write memory while viewing a checkpoint";
+        dbg->reply_set_mem(false);
+        return;
+      }
       // We only allow the debugger to write memory if the
       // memory will be written to an diversion session.
       // Arbitrary writes to replay sessions cause
@@ -347,20 +500,29 @@ void dispatch_debugger_request(Session& session, GdbContext* dbg, Task* t,
       return;
     }
     case DREQ_GET_REG: {
-      GdbRegisterValue reg = get_reg(target, req.reg.name);
+      Task* source = viewed_task(target);
+      GdbRegisterValue reg = get_reg(source ? source : target, req.reg.name);
+      reg.defined = reg.defined && source;
       dbg->reply_get_reg(reg);
       return;
     }
     case DREQ_GET_REGS: {
+      Task* source = viewed_task(target);
       size_t n_regs = target->regs().total_registers();
       GdbRegisterFile file(n_regs);
       for (size_t i = 0; i < n_regs; ++i) {
-        file.regs[i] = get_reg(target, GdbRegister(i));
+        file.regs[i] = get_reg(source ? source : target, GdbRegister(i));
+        file.regs[i].defined = file.regs[i].defined && source;
       }
       dbg->reply_get_regs(file);
       return;
     }
     case DREQ_SET_REG: {
+      if (viewed_checkpoint) {
+        LOG(error) << "Attempt to write register while viewing a checkpoint";
+        dbg->reply_set_reg(false);
+        return;
+      }
       if (!session.is_diversion()) {
         // gdb sets orig_eax to -1 during a restart. For a
         // replay session this is not correct (we might be
@@ -385,13 +547,21 @@ void dispatch_debugger_request(Session& session, GdbContext* dbg, Task* t,
       return;
     }
     case DREQ_GET_STOP_REASON: {
-      dbg->reply_get_stop_reason(get_threadid(target), target->child_sig);
+      dbg->reply_get_stop_reason(get_threadid(target), target->child_sig,
+                                 get_expedited_regs(target));
       return;
     }
     case DREQ_SET_SW_BREAK: {
       ASSERT(target, (req.mem.len == sizeof(AddressSpace::breakpoint_insn)))
           << "Debugger setting bad breakpoint insn";
       bool ok = target->vm()->set_breakpoint(req.mem.addr, TRAP_BKPT_USER);
+      if (ok) {
+        target->vm()->set_breakpoint_condition(
+            req.mem.addr,
+            req.mem.conditions
+                ? make_shared<GdbBreakpointCondition>(*req.mem.conditions)
+                : nullptr);
+      }
       dbg->reply_watchpoint_request(ok);
       return;
     }
@@ -457,6 +627,8 @@ static GdbRequest process_debugger_requests(GdbContext* dbg, Task* t) {
     maybe_singlestep_for_event(t, &continue_all_tasks);
     return continue_all_tasks;
   }
+  // Show the output replayed so far before the debugger's prompt.
+  ReplayOutput::flush();
   while (1) {
     GdbRequest req = dbg->get_request();
     req.suppress_debugger_stop = false;
@@ -479,6 +651,18 @@ static GdbRequest process_debugger_requests(GdbContext* dbg, Task* t) {
       // the diversion session
     }
 
+    // Execution only ever moves the current state, so stop viewing
+    // any checkpoint rather than report stops against stale state.
+    if (req.is_resume_request() || req.is_reverse_request() ||
+        req.type == DREQ_RESTART) {
+      viewed_checkpoint = nullptr;
+    }
+
+    if (req.is_reverse_request()) {
+      LOG(debug) << "  is reverse request";
+      return req;
+    }
+
     if (req.is_resume_request()) {
       maybe_singlestep_for_event(t, &req);
       LOG(debug) << "  is resume request";
@@ -496,10 +680,207 @@ static GdbRequest process_debugger_requests(GdbContext* dbg, Task* t) {
       return req;
     }
 
+    if (req.type == DREQ_DETACH && Flags::get().replay_server) {
+      LOG(info) << "(debugger detached; waiting for the next one)";
+      dbg->reply_detach();
+      return req;
+    }
+
     dispatch_debugger_request(*session, dbg, t, req);
   }
 }
 
+/**
+ * Return the GdbRegister of the general purpose register numbered |n| in
+ * x86 instruction encodings.
+ */
+static GdbRegister gpr_for_encoding(SupportedArch arch, int n) {
+  static const GdbRegister x64_gprs[] = {
+    DREG_RAX, DREG_RCX, DREG_RDX, DREG_RBX, DREG_RSP, DREG_RBP,
+    DREG_RSI, DREG_RDI, DREG_R8,  DREG_R9,  DREG_R10, DREG_R11,
+    DREG_R12, DREG_R13, DREG_R14, DREG_R15
+  };
+  // x86's numbering is the encoding's.
+  return arch == x86_64 ? x64_gprs[n] : GdbRegister(DREG_EAX + n);
+}
+
+/**
+ * Return the length of the ModRM byte at |modrm| and the SIB byte and
+ * displacement that follow it.
+ */
+static size_t modrm_length(const uint8_t* modrm) {
+  int mod = *modrm >> 6;
+  int rm = *modrm & 7;
+  if (mod == 3) {
+    return 1;
+  }
+  size_t len = 1;
+  if (rm == 4) {
+    ++len;
+    if (mod == 0 && (modrm[1] & 7) == 5) {
+      return len + 4;
+    }
+  } else if (mod == 0 && rm == 5) {
+    return len + 4;
+  }
+  return len + (mod == 1 ? 1 : mod == 2 ? 4 : 0);
+}
+
+/**
+ * If the instruction at |t|'s ip is one of a few simple ones that don't
+ * branch, touch flags or (but for push) memory, perform it on |t|'s
+ * registers and return true.  Breakpoints set on it can then stay
+ * inserted instead of being removed around a singlestep.  Compilers
+ * put nops, endbr64 and prologue pushes and movs at many of the places
+ * breakpoints are set.
+ */
+static bool emulate_simple_instruction(Task* t) {
+  remote_ptr<uint8_t> ip = t->ip();
+  uint8_t insn[16];
+  ssize_t nread = t->read_bytes_fallible(ip, sizeof(insn), insn);
+  if (nread <= 0) {
+    return false;
+  }
+  memset(insn + nread, 0, sizeof(insn) - nread);
+  t->vm()->replace_breakpoints_with_original_values(insn, nread, ip);
+
+  SupportedArch arch = t->arch();
+  size_t word_size = arch == x86_64 ? 8 : 4;
+  const uint8_t* p = insn;
+  bool opsize = false;
+  bool rep = false;
+  for (; p < insn + 4; ++p) {
+    if (*p == 0x66) {
+      opsize = true;
+    } else if (*p == 0xf3) {
+      rep = true;
+    } else {
+      break;
+    }
+  }
+  int rex = 0;
+  if (arch == x86_64 && (*p & 0xf0) == 0x40) {
+    rex = *p++;
+  }
+  bool rex_w = rex & 8;
+  int rex_r = (rex & 4) << 1;
+  int rex_b = (rex & 1) << 3;
+
+  Registers r = t->regs();
+  if (*p == 0x90 && !rex_b) {
+    // nop (or pause).
+    ++p;
+  } else if (rep && !opsize && p[0] == 0x0f && p[1] == 0x1e &&
+             (p[2] == 0xfa || p[2] == 0xfb)) {
+    // endbr64 / endbr32.
+    p += 3;
+  } else if (!rep && p[0] == 0x0f && p[1] == 0x1f && ((p[2] >> 3) & 7) == 0) {
+    // Multi-byte nop.  Its operand is never accessed.
+    p += 2 + modrm_length(p + 2);
+  } else if (!rep && !opsize && (*p & 0xf8) == 0x50) {
+    // push reg.
+    if (t->vm()->has_watchpoints() || t->vm()->has_page_watches()) {
+      return false;
+    }
+    remote_ptr<void> sp = r.sp() - word_size;
+    auto& maps = t->vm()->memmap();
+    auto m = maps.find(Mapping(floor_page_size(sp), page_size()));
+    if (m == maps.end() || !(m->first.prot & PROT_WRITE)) {
+      return false;
+    }
+    uint8_t value[8];
+    bool defined = false;
+    r.read_register(value, gpr_for_encoding(arch, (*p & 7) | rex_b),
+                    &defined);
+    t->write_bytes_helper(sp, word_size, value);
+    r.set_sp(sp.as_int());
+    ++p;
+  } else if (!rep && !opsize && (*p == 0x89 || *p == 0x8b) &&
+             (p[1] >> 6) == 3) {
+    // mov reg, reg.
+    int reg = ((p[1] >> 3) & 7) | rex_r;
+    int rm = (p[1] & 7) | rex_b;
+    int src = *p == 0x89 ? reg : rm;
+    int dest = *p == 0x89 ? rm : reg;
+    uint8_t value[8] = { 0 };
+    bool defined = false;
+    r.read_register(value, gpr_for_encoding(arch, src), &defined);
+    // 32-bit movs zero the upper half of 64-bit registers.
+    if (!rex_w) {
+      memset(value + 4, 0, 4);
+    }
+    r.write_register(gpr_for_encoding(arch, dest), value, word_size);
+    p += 2;
+  } else {
+    return false;
+  }
+
+  if (p - insn > nread) {
+    return false;
+  }
+  r.set_ip((ip + (p - insn)).as_int());
+  t->set_regs(r);
+  return true;
+}
+
+/**
+ * Like |s.replay_step(command)|, but continue past USER breakpoints
+ * whose condition is false instead of breaking at them.  Simple
+ * instructions are emulated; others are stepped over the way gdb would
+ * do it: the breakpoint removed, the instruction singlestepped, and the
+ * breakpoint reinserted.
+ */
+static ReplaySession::ReplayResult replay_step_checking_conditions(
+    ReplaySession& s, Session::RunCommand command) {
+  auto result = s.replay_step(command);
+  if (command != Session::RUN_CONTINUE ||
+      result.status != ReplaySession::REPLAY_CONTINUE ||
+      result.break_status.reason != Session::BREAK_BREAKPOINT) {
+    return result;
+  }
+  Task* t = result.break_status.task;
+  remote_ptr<uint8_t> addr = t->ip();
+  auto condition = t->vm()->get_breakpoint_condition(addr);
+  if (!condition || condition->evaluate(t)) {
+    return result;
+  }
+  LOG(debug) << "  condition false at breakpoint " << addr;
+
+  // Unless replay's next target is right here: the instruction mustn't
+  // run before it's reached.
+  const TraceFrame& frame = s.current_trace_frame();
+  bool at_frame_ip = frame.tid() == t->rec_tid &&
+                     frame.event().has_exec_info == HAS_EXEC_INFO &&
+                     frame.regs().ip() == addr.as_int();
+  if (!at_frame_ip && emulate_simple_instruction(t)) {
+    LOG(debug) << "  emulated instruction at " << addr;
+    result.break_status.reason = Session::BREAK_NONE;
+    return result;
+  }
+
+  int refs = 0;
+  while (t->vm()->get_breakpoint_type_at_addr(addr) == TRAP_BKPT_USER) {
+    t->vm()->remove_breakpoint(addr, TRAP_BKPT_USER);
+    ++refs;
+  }
+  pid_t rec_tid = t->rec_tid;
+  AddressSpace::shr_ptr vm = t->vm();
+  result = s.replay_step(Session::RUN_SINGLESTEP);
+  // Unless the instruction exited or exec'd, which takes the
+  // breakpoint with it.
+  t = s.find_task(rec_tid);
+  if (t && t->vm() == vm) {
+    for (int i = 0; i < refs; ++i) {
+      vm->set_breakpoint(addr, TRAP_BKPT_USER);
+    }
+    vm->set_breakpoint_condition(addr, condition);
+  }
+  if (result.break_status.reason == Session::BREAK_SINGLESTEP) {
+    result.break_status.reason = Session::BREAK_NONE;
+  }
+  return result;
+}
+
 static bool replay_one_step(ReplaySession& session, GdbContext* dbg,
                             GdbRequest* restart_request) {
   GdbRequest req;
@@ -513,7 +894,8 @@ static bool replay_one_step(ReplaySession& session, GdbContext* dbg,
    * rr's. */
   if (session.can_validate()) {
     req = process_debugger_requests(dbg, t);
-    if (DREQ_RESTART == req.type) {
+    if (DREQ_RESTART == req.type || DREQ_DETACH == req.type ||
+        req.is_reverse_request()) {
       *restart_request = req;
       return false;
     }
@@ -524,7 +906,7 @@ static bool replay_one_step(ReplaySession& session, GdbContext* dbg,
       (DREQ_STEP == req.type && get_threadid(t) == req.target)
           ? Session::RUN_SINGLESTEP
           : Session::RUN_CONTINUE;
-  auto result = session.replay_step(command);
+  auto result = replay_step_checking_conditions(session, command);
 
   if (result.status == ReplaySession::REPLAY_EXITED) {
     return true;
@@ -534,6 +916,9 @@ static bool replay_one_step(ReplaySession& session, GdbContext* dbg,
     return true;
   }
 
+  if (dbg) {
+    ReplayOutput::flush();
+  }
   if (dbg && !req.suppress_debugger_stop) {
     int sig = SIGTRAP;
     remote_ptr<void> watch_addr = nullptr;
@@ -550,11 +935,13 @@ static bool replay_one_step(ReplaySession& session, GdbContext* dbg,
     /* Notify the debugger and process any new requests
      * that might have triggered before resuming. */
     dbg->notify_stop(get_threadid(result.break_status.task), sig,
-                     watch_addr.as_int());
+                     watch_addr.as_int(),
+                     get_expedited_regs(result.break_status.task));
   }
 
   req = process_debugger_requests(dbg, result.break_status.task);
-  if (DREQ_RESTART == req.type) {
+  if (DREQ_RESTART == req.type || DREQ_DETACH == req.type ||
+      req.is_reverse_request()) {
     *restart_request = req;
     return false;
   }
@@ -566,7 +953,9 @@ static bool replay_one_step(ReplaySession& session, GdbContext* dbg,
  * Return true if a side effect of creating the debugger interface
  * will be checkpointing the replay session.
  */
-static bool will_checkpoint() { return !Flags::get().dont_launch_debugger; }
+static bool will_checkpoint() {
+  return !Flags::get().dont_launch_debugger || Flags::get().replay_server;
+}
 
 /**
  * Return true if |t| appears to have entered but not exited an atomic
@@ -602,6 +991,9 @@ static bool can_checkpoint_at(Task* t, const TraceFrame& frame) {
     // entry/exit.  Help the |is_atomic_syscall()|
     // heuristics by not attempting to checkpoint at
     // RESETs.  Users would never want to do that anyway.
+    case EV_SHARED_MAPPING_CHANGE:
+    // Likewise for shared mapping changes, which can also come
+    // between syscall entry and exit.
     case EV_TRACE_TERMINATION:
       // There's nothing to checkpoint at the end of an
       // early-terminated trace.
@@ -611,6 +1003,151 @@ static bool can_checkpoint_at(Task* t, const TraceFrame& frame) {
   }
 }
 
+/**
+ * Drop one automatic checkpoint: the one whose neighbours are closest
+ * together, so the survivors stay spread over the replayed part of the
+ * trace. The first and last checkpoints are kept while there are others.
+ */
+static void evict_auto_checkpoint() {
+  assert(auto_checkpoints.size() >= 2);
+  auto victim = auto_checkpoints.begin();
+  TraceFrame::Time smallest_gap = numeric_limits<TraceFrame::Time>::max();
+  for (auto it = next(auto_checkpoints.begin());
+       next(it) != auto_checkpoints.end(); ++it) {
+    TraceFrame::Time gap = next(it)->first - prev(it)->first;
+    if (gap < smallest_gap) {
+      smallest_gap = gap;
+      victim = it;
+    }
+  }
+  LOG(debug) << "Dropping automatic checkpoint at event " << victim->first;
+  auto_checkpoints.erase(victim);
+}
+
+/**
+ * Return true if the automatic checkpoints hold more memory than
+ * Flags::checkpoint_memory_mb allows.
+ */
+static bool auto_checkpoints_over_memory_budget() {
+  uint64_t budget = uint64_t(Flags::get().checkpoint_memory_mb) << 20;
+  if (!budget) {
+    return false;
+  }
+  uint64_t unique_bytes = 0;
+  for (auto& kv : auto_checkpoints) {
+    unique_bytes += kv.second->memory_usage().unique_pages * page_size();
+  }
+  LOG(debug) << "Automatic checkpoints hold " << unique_bytes
+             << " bytes of unshared memory";
+  return unique_bytes > budget;
+}
+
+/**
+ * Checkpoint the session before it replays its next frame if an automatic
+ * checkpoint is due. Nothing is taken when no debugger will ever attach,
+ * because then nothing can restart.
+ */
+static void maybe_auto_checkpoint() {
+  const Flags& flags = Flags::get();
+  if ((!flags.checkpoint_interval && !flags.checkpoint_interval_secs) ||
+      flags.goto_event == numeric_limits<decltype(flags.goto_event)>::max() ||
+      !session->can_validate() || !session->at_frame_start()) {
+    return;
+  }
+  TraceFrame next_frame = session->current_trace_frame();
+  Task* t = session->current_task();
+  if (!t) {
+    return;
+  }
+  TraceFrame::Time event_now = next_frame.time();
+  auto after = auto_checkpoints.upper_bound(event_now);
+  bool due;
+  if (after == auto_checkpoints.begin()) {
+    due = true;
+  } else {
+    TraceFrame::Time previous = prev(after)->first;
+    due = previous != event_now &&
+          ((flags.checkpoint_interval &&
+            event_now - previous >= flags.checkpoint_interval) ||
+           (flags.checkpoint_interval_secs &&
+            now_sec() - last_auto_checkpoint_sec >=
+                flags.checkpoint_interval_secs));
+  }
+  if (!due || !can_checkpoint_at(t, next_frame)) {
+    return;
+  }
+
+  LOG(debug) << "Taking automatic checkpoint at event " << event_now;
+  auto_checkpoints[event_now] = session->clone();
+  last_auto_checkpoint_sec = now_sec();
+  while (auto_checkpoints.size() > flags.max_checkpoints) {
+    evict_auto_checkpoint();
+  }
+  // Always keep the newest checkpoint, even if it alone is over budget.
+  while (auto_checkpoints.size() > 1 && auto_checkpoints_over_memory_budget()) {
+    evict_auto_checkpoint();
+  }
+}
+
+/**
+ * Return a clone of the latest automatic checkpoint taken at or before
+ * |event|, or nullptr if there isn't one.
+ */
+static ReplaySession::shr_ptr restore_auto_checkpoint(TraceFrame::Time event) {
+  auto after = auto_checkpoints.upper_bound(event);
+  if (after == auto_checkpoints.begin()) {
+    return nullptr;
+  }
+  --after;
+  LOG(debug) << "Restarting from automatic checkpoint at event "
+             << after->first;
+  last_auto_checkpoint_sec = now_sec();
+  return after->second->clone();
+}
+
+/**
+ * Return the port to serve the debugger on, and in |probe| whether other
+ * ports may be tried if it's taken.
+ */
+static unsigned short debugger_port(GdbContext::ProbePort* probe) {
+  // Don't probe if the user specified a port.  Explicitly
+  // selecting a port is usually done by scripts, which would
+  // presumably break if a different port were to be selected by
+  // rr (otherwise why would they specify a port in the first
+  // place).  So fail with a clearer error message.
+  *probe = (Flags::get().dbgport > 0) ? GdbContext::DONT_PROBE
+                                      : GdbContext::PROBE_PORT;
+  return (Flags::get().dbgport > 0) ? Flags::get().dbgport : getpid();
+}
+
+/**
+ * When rr launches gdb itself, have it launched as soon as the tracee has
+ * exec'd its image, instead of when replay reaches the event the debugger
+ * is wanted at, so gdb loads symbols while replay fast-forwards there.
+ * gdb's connection waits in |early_listen_fd|'s backlog until then.
+ *
+ * gdb is started on the image exec'd first.  That's the image debugged
+ * unless a target process was asked for, in which case gdb is launched
+ * when it's reached, as before.
+ */
+static void maybe_launch_debugger_early() {
+  if (!debugger_params_write_pipe.is_open() || Flags::get().target_process ||
+      !session->can_validate()) {
+    return;
+  }
+  Task* t = session->current_task();
+  if (!t || !t->vm()->execed()) {
+    return;
+  }
+  GdbContext::ProbePort probe;
+  unsigned short port = debugger_port(&probe);
+  early_exe_image = t->vm()->exe_image();
+  LOG(debug) << "launching gdb early on " << early_exe_image;
+  early_listen_fd = GdbContext::listen_for_client(
+      port, probe, &early_exe_image, &debugger_params_write_pipe);
+  debugger_params_write_pipe.close();
+}
+
 /**
  * Return the previous debugger |dbg| if there was one.  Otherwise if
  * the trace has reached the event at which the user wanted a debugger
@@ -687,25 +1224,32 @@ static void maybe_create_debugger(unique_ptr<GdbContext>* dbg) {
   // allows us to determine if a later session has reached this
   // target without necessarily replaying up to this point.
   Flags::update_replay_target(t->tgid(), event_now);
+  debugger_start_event = event_now;
 
   if (stashed_dbg) {
     *dbg = move(stashed_dbg);
     return;
   }
-  unsigned short port =
-      (Flags::get().dbgport > 0) ? Flags::get().dbgport : getpid();
-  // Don't probe if the user specified a port.  Explicitly
-  // selecting a port is usually done by scripts, which would
-  // presumably break if a different port were to be selected by
-  // rr (otherwise why would they specify a port in the first
-  // place).  So fail with a clearer error message.
-  auto probe = (Flags::get().dbgport > 0) ? GdbContext::DONT_PROBE
-                                          : GdbContext::PROBE_PORT;
-  const string* exe =
-      Flags::get().dont_launch_debugger ? nullptr : &t->vm()->exe_image();
-  *dbg = GdbContext::await_client_connection(port, probe, t->tgid(), exe,
-                                             &debugger_params_write_pipe);
-  debugger_params_write_pipe.close();
+  if (early_listen_fd.is_open()) {
+    if (t->vm()->exe_image() != early_exe_image) {
+      LOG(warn) << "gdb was started on " << early_exe_image
+                << ", but the debugged process runs "
+                << t->vm()->exe_image() << "; use gdb's `file' command";
+    }
+    *dbg = GdbContext::accept_client_connection(early_listen_fd, t->tgid());
+    early_listen_fd.close();
+  } else {
+    GdbContext::ProbePort probe;
+    unsigned short port = debugger_port(&probe);
+    const string* exe =
+        Flags::get().dont_launch_debugger ? nullptr : &t->vm()->exe_image();
+    *dbg = GdbContext::await_client_connection(port, probe, t->tgid(), exe,
+                                               &debugger_params_write_pipe);
+    debugger_params_write_pipe.close();
+  }
+  if (Flags::get().replay_server) {
+    (*dbg)->report_disconnect_as_detach();
+  }
 }
 
 /**
@@ -720,6 +1264,82 @@ static void set_sig_blockedness(int sig, int blockedness) {
   }
 }
 
+/**
+ * Create a session to replay |trace_dir| from the start.  When a debugger
+ * will be started at a particular event, begin from the trace's nearest
+ * process snapshot before it instead.  A flight recorder trace has to
+ * begin from a snapshot, since the trace before it was discarded.
+ */
+static ReplaySession::shr_ptr create_session(const string& trace_dir) {
+  ReplaySession::shr_ptr s = ReplaySession::create(trace_dir);
+  const Flags& flags = Flags::get();
+  TraceFrame::Time discarded_until = s->trace_reader().discarded_until();
+  bool has_target =
+      flags.goto_event > 0 &&
+      flags.goto_event != numeric_limits<decltype(flags.goto_event)>::max() &&
+      !flags.target_process;
+  if (flags.replay_target_only && !discarded_until) {
+    auto partition = make_shared<const TracePartition>(
+        TracePartition::for_process(s->trace_reader(), flags.target_process));
+    if (partition->is_whole_trace()) {
+      LOG(info) << "Process " << flags.target_process
+                << " can't be replayed on its own; replaying everything";
+    } else {
+      LOG(info) << "Replaying " << partition->num_tasks()
+                << " task(s) of process " << flags.target_process;
+      s->set_partition(partition);
+    }
+  }
+  if (discarded_until) {
+    TraceFrame::Time target = has_target && flags.goto_event > discarded_until
+                                  ? flags.goto_event
+                                  : discarded_until;
+    if (!s->start_from_snapshot(target)) {
+      FATAL() << "The trace before event " << discarded_until
+              << " was discarded, and replay can't start from a snapshot";
+    }
+  } else if (has_target) {
+    s->start_from_snapshot(flags.goto_event);
+  }
+  return s;
+}
+
+/**
+ * Return whichever of the current session, the user's checkpoints, the
+ * automatic checkpoints and the debugger restart checkpoint is latest
+ * while still at or before |event|, or nullptr if none is.  Replaying
+ * forward from there (fast-forwarding until the debugger is attached
+ * again) is the cheapest way to reach |event|.
+ */
+static ReplaySession::shr_ptr nearest_session_before(TraceFrame::Time event) {
+  ReplaySession::shr_ptr best;
+  TraceFrame::Time best_time = 0;
+  auto consider = [&](const ReplaySession::shr_ptr& s) {
+    if (!s) {
+      return;
+    }
+    TraceFrame::Time time = s->trace_reader().time();
+    if (time <= event && (!best || time > best_time)) {
+      best = s;
+      best_time = time;
+    }
+  };
+  consider(session);
+  consider(debugger_restart_checkpoint);
+  for (auto& kv : checkpoints) {
+    consider(kv.second);
+  }
+  auto after = auto_checkpoints.upper_bound(event);
+  if (after != auto_checkpoints.begin()) {
+    consider(prev(after)->second);
+  }
+  if (best && best != session) {
+    LOG(debug) << "Going to event " << event << " from checkpoint at event "
+               << best_time;
+  }
+  return best;
+}
+
 static void restart_session(unique_ptr<GdbContext>* dbg, GdbRequest* req) {
   assert(req->type == DREQ_RESTART);
 
@@ -742,27 +1362,352 @@ static void restart_session(unique_ptr<GdbContext>* dbg, GdbRequest* req) {
 
   stashed_dbg = move(*dbg);
 
+  if (req->restart.type == RESTART_FROM_EVENT) {
+    ReplaySession::shr_ptr start =
+        nearest_session_before(Flags::get().goto_event);
+    if (start != session) {
+      session = start ? start->clone()
+                      : create_session(session->trace_reader().dir());
+    }
+    return;
+  }
+
   if (session->trace_reader().time() > Flags::get().goto_event) {
     // We weren't able to reuse the stashed session, so
-    // just discard it and create a fresh one that's back
-    // at beginning-of-trace.
-    session = ReplaySession::create(session->trace_reader().dir());
+    // resume from the nearest automatic checkpoint before
+    // the target, or failing that discard it and create a
+    // fresh one that's back at beginning-of-trace.
+    ReplaySession::shr_ptr checkpoint =
+        restore_auto_checkpoint(Flags::get().goto_event);
+    session = checkpoint
+                  ? checkpoint
+                  : create_session(session->trace_reader().dir());
+  }
+}
+
+/**
+ * The client of |dbg| detached from a replay server.  Put the replay
+ * back where that client started, as a restart would, so the next
+ * client finds it there.  The checkpoints and the trace's frame cache
+ * are kept, so attaching again doesn't replay anything.
+ */
+static void disconnect_debugger(unique_ptr<GdbContext>* dbg) {
+  dbg->reset();
+  viewed_checkpoint = nullptr;
+  if (debugger_restart_checkpoint) {
+    session = debugger_restart_checkpoint->clone();
+  }
+}
+
+/**
+ * A point in the replay that reverse execution looks for: the trace
+ * frame being replayed and, once replay of it has started, how far
+ * the frame's task has got into it.
+ */
+struct ReplayPosition {
+  TraceFrame::Time time;
+  bool at_frame_start;
+  Ticks ticks;
+  remote_ptr<uint8_t> ip;
+};
+
+static ReplayPosition position_of(ReplaySession& s) {
+  ReplayPosition pos;
+  pos.time = s.current_trace_frame().time();
+  pos.at_frame_start = s.at_frame_start();
+  Task* t = s.current_task();
+  if (!pos.at_frame_start && t) {
+    pos.ticks = t->tick_count();
+    pos.ip = t->ip();
+  } else {
+    pos.ticks = 0;
+    pos.ip = nullptr;
+  }
+  return pos;
+}
+
+/**
+ * Return true if |a| is reached before |b| when replaying forward.
+ * Within a frame, positions with the same tick count are ordered by
+ * ip, which is right for the straight-line code between two branches.
+ */
+static bool is_before(const ReplayPosition& a, const ReplayPosition& b) {
+  if (a.time != b.time) {
+    return a.time < b.time;
+  }
+  if (a.at_frame_start != b.at_frame_start) {
+    return a.at_frame_start;
+  }
+  if (a.ticks != b.ticks) {
+    return a.ticks < b.ticks;
+  }
+  return a.ip < b.ip;
+}
+
+/**
+ * How reverse execution replays forward from a checkpoint: up to where,
+ * and which of the breaks on the way count as stops.
+ */
+struct ReverseScan {
+  // The position reverse execution started from.
+  ReplayPosition until;
+  // For reverse-step, the task whose singlesteps are the stops, and the
+  // frame from which on it's singlestepped.  Zero for reverse-continue,
+  // where the stops are breakpoint and watchpoint hits of the debugged
+  // process.
+  pid_t step_tid;
+  TraceFrame::Time step_from;
+};
+
+/**
+ * Replay |s| forward until it reaches |scan.until|, or until it has
+ * made |max_stops| stops, or until |dbg| has an interrupt pending.
+ * Return the number of stops made; |*last| is set to the break status
+ * of the last one.
+ */
+static size_t run_reverse_scan(GdbContext* dbg, ReplaySession& s,
+                               const ReverseScan& scan, size_t max_stops,
+                               Session::BreakStatus* last) {
+  size_t stops = 0;
+  while (stops < max_stops && is_before(position_of(s), scan.until) &&
+         !dbg->interrupt_pending()) {
+    Task* t = s.current_task();
+    Session::RunCommand command =
+        (scan.step_tid && t && t->rec_tid == scan.step_tid &&
+         s.current_trace_frame().time() >= scan.step_from)
+            ? Session::RUN_SINGLESTEP
+            : Session::RUN_CONTINUE;
+    auto result = replay_step_checking_conditions(s, command);
+    if (result.status == ReplaySession::REPLAY_EXITED) {
+      break;
+    }
+    const Session::BreakStatus& break_status = result.break_status;
+    bool is_stop;
+    switch (break_status.reason) {
+      case Session::BREAK_BREAKPOINT:
+      case Session::BREAK_WATCHPOINT:
+        is_stop = scan.step_tid
+                      ? break_status.task->rec_tid == scan.step_tid
+                      : break_status.task->tgid() == s.debugged_tgid();
+        break;
+      case Session::BREAK_SINGLESTEP:
+        is_stop = scan.step_tid && break_status.task->rec_tid == scan.step_tid;
+        break;
+      default:
+        is_stop = false;
+        break;
+    }
+    if (is_stop && is_before(position_of(s), scan.until)) {
+      ++stops;
+      *last = break_status;
+    }
+  }
+  return stops;
+}
+
+static Task* find_debugged_task(ReplaySession& s) {
+  for (auto& kv : s.tasks()) {
+    if (kv.second->tgid() == s.debugged_tgid()) {
+      return kv.second;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Return a clone of |checkpoint| that has the debugger's current
+ * breakpoints and watchpoints set.
+ */
+static ReplaySession::shr_ptr clone_for_reverse(
+    ReplaySession::shr_ptr checkpoint) {
+  ReplaySession::shr_ptr s = checkpoint->clone();
+  if (!s->debugged_tgid()) {
+    // Checkpoints taken just before the debugger attached.
+    s->set_debugged_tgid(session->debugged_tgid());
+  }
+  Task* from = find_debugged_task(*session);
+  Task* to = find_debugged_task(*s);
+  if (from && to) {
+    to->vm()->copy_debugger_breakpoints_from(*from->vm());
   }
+  return s;
+}
+
+/**
+ * Run the replay backwards as |req| asks, by replaying forward from the
+ * nearest earlier checkpoint and remembering the last stop before the
+ * current position.  Only when there's no stop between that checkpoint
+ * and the current position is the next earlier one tried, so the cost
+ * scales with the checkpoint interval, not the length of the trace.
+ * Replace |session| by one at the stop found and notify |dbg|.
+ *
+ * If the debugger interrupts the search, |session| is left where it
+ * was and the stop is reported when the interrupt request is served.
+ */
+static void reverse_execute(GdbContext* dbg, const GdbRequest& req) {
+  assert(req.is_reverse_request());
+
+  ReverseScan scan;
+  scan.until = position_of(*session);
+  scan.step_tid = 0;
+  scan.step_from = 0;
+  if (DREQ_REVERSE_STEP == req.type) {
+    Task* t = req.target.tid > 0 ? session->find_task(req.target.tid)
+                                 : session->current_task();
+    if (!t) {
+      t = find_debugged_task(*session);
+    }
+    scan.step_tid = t ? t->rec_tid : 0;
+  }
+
+  // Candidate starting points, latest first.
+  vector<pair<ReplayPosition, ReplaySession::shr_ptr> > starts;
+  for (auto& kv : auto_checkpoints) {
+    if (kv.first >= debugger_start_event) {
+      starts.push_back(make_pair(position_of(*kv.second), kv.second));
+    }
+  }
+  if (debugger_restart_checkpoint) {
+    starts.push_back(make_pair(position_of(*debugger_restart_checkpoint),
+                               debugger_restart_checkpoint));
+  }
+  starts.erase(remove_if(starts.begin(), starts.end(),
+                         [&](const pair<ReplayPosition,
+                                        ReplaySession::shr_ptr>& start) {
+                 return !is_before(start.first, scan.until);
+               }),
+               starts.end());
+  sort(starts.begin(), starts.end(),
+       [](const pair<ReplayPosition, ReplaySession::shr_ptr>& a,
+          const pair<ReplayPosition, ReplaySession::shr_ptr>& b) {
+         return is_before(b.first, a.first);
+       });
+
+  ReplaySession::shr_ptr landed;
+  Session::BreakStatus stop;
+  for (auto& start : starts) {
+    vector<TraceFrame::Time> step_froms;
+    if (scan.step_tid) {
+      // Most steps back land in the frame before, so singlestep only
+      // from there at first.
+      if (scan.until.time > start.first.time + 1) {
+        step_froms.push_back(scan.until.time - 1);
+      }
+      step_froms.push_back(start.first.time);
+    } else {
+      step_froms.push_back(0);
+    }
+    for (auto step_from : step_froms) {
+      scan.step_from = step_from;
+      LOG(debug) << "Reverse scan from event " << start.first.time
+                 << " to event " << scan.until.time;
+      size_t stops =
+          run_reverse_scan(dbg, *clone_for_reverse(start.second), scan,
+                           numeric_limits<size_t>::max(), &stop);
+      if (stops > 0 && !dbg->interrupt_pending()) {
+        // Replay is deterministic, so replaying again the same way
+        // makes the same stops.
+        landed = clone_for_reverse(start.second);
+        run_reverse_scan(dbg, *landed, scan, stops, &stop);
+        break;
+      }
+      if (dbg->interrupt_pending()) {
+        break;
+      }
+    }
+    if (dbg->interrupt_pending()) {
+      LOG(debug) << "Reverse execution interrupted by debugger";
+      last_auto_checkpoint_sec = now_sec();
+      return;
+    }
+    if (landed) {
+      break;
+    }
+    scan.until = start.first;
+  }
+
+  last_auto_checkpoint_sec = now_sec();
+  if (landed) {
+    session = landed;
+    remote_ptr<void> watch_addr = nullptr;
+    if (stop.reason == Session::BREAK_WATCHPOINT) {
+      watch_addr = stop.watch_address;
+    }
+    dbg->notify_stop(get_threadid(stop.task), SIGTRAP, watch_addr.as_int(),
+                     get_expedited_regs(stop.task));
+    return;
+  }
+
+  // Nothing to stop at: go back as far as we can.
+  if (!starts.empty()) {
+    session = clone_for_reverse(starts.back().second);
+  }
+  Task* t = session->current_task();
+  if (!t || t->tgid() != session->debugged_tgid()) {
+    t = find_debugged_task(*session);
+  }
+  dbg->notify_no_history(get_threadid(t), get_expedited_regs(t));
+}
+
+/**
+ * Return the event that replay without a debugger can fast-forward to
+ * without missing anything it has to do at earlier events: creating the
+ * debugger, taking automatic checkpoints, or tracing instructions.
+ */
+static TraceFrame::Time fast_forward_target() {
+  const Flags& flags = Flags::get();
+  if (flags.checkpoint_interval_secs) {
+    // Time-based checkpoints are checked before every frame.
+    return 0;
+  }
+  TraceFrame::Time target = flags.goto_event;
+  if (flags.checkpoint_interval) {
+    if (auto_checkpoints.empty()) {
+      return 0;
+    }
+    target = min<TraceFrame::Time>(
+        target, auto_checkpoints.rbegin()->first + flags.checkpoint_interval);
+  }
+  if (instruction_trace_at_event_last > 0) {
+    target =
+        min<TraceFrame::Time>(target, instruction_trace_at_event_start + 1);
+  }
+  return target;
 }
 
 static void replay_trace_frames(void) {
   unique_ptr<GdbContext> dbg;
   while (true) {
     while (!session->last_task()) {
+      maybe_auto_checkpoint();
+      maybe_launch_debugger_early();
       maybe_create_debugger(&dbg);
 
+      if (!dbg) {
+        TraceFrame::Time target = fast_forward_target();
+        if (session->current_trace_frame().time() < target) {
+          session->fast_forward(target);
+          continue;
+        }
+      }
+
       GdbRequest restart_request;
       if (!replay_one_step(*session, dbg.get(), &restart_request)) {
-        restart_session(&dbg, &restart_request);
+        if (restart_request.is_reverse_request()) {
+          reverse_execute(dbg.get(), restart_request);
+        } else if (DREQ_DETACH == restart_request.type) {
+          disconnect_debugger(&dbg);
+        } else {
+          restart_session(&dbg, &restart_request);
+        }
       }
     }
     LOG(info) << ("Replayer successfully finished.");
+    ReplayOutput::flush();
     fflush(stdout);
+    if (Flags::get().replay_statistics) {
+      session->print_statistics(stderr);
+    }
 
     if (dbg) {
       // TODO return real exit code, if it's useful.
@@ -773,14 +1718,34 @@ static void replay_trace_frames(void) {
         restart_session(&dbg, &req);
         continue;
       }
+      if (req.is_reverse_request()) {
+        reverse_execute(dbg.get(), req);
+        continue;
+      }
+      if (DREQ_DETACH == req.type) {
+        disconnect_debugger(&dbg);
+        continue;
+      }
       FATAL() << "Received continue request after end-of-trace.";
     }
     return;
   }
 }
 
-static void serve_replay(const string& trace_dir) {
-  session = ReplaySession::create(trace_dir);
+static void serve_replay(const string& trace_dir,
+                         shared_ptr<const TracePartition> partition = nullptr) {
+  if (partition) {
+    session = ReplaySession::create(trace_dir);
+    session->set_partition(partition);
+  } else {
+    session = create_session(trace_dir);
+  }
+  unique_ptr<ReplayProfiler> profiler;
+  if (!Flags::get().profile_path.empty()) {
+    profiler.reset(new ReplayProfiler(Flags::get().profile_path,
+                                      Flags::get().profile_period));
+    session->set_profiler(profiler.get());
+  }
 
   replay_trace_frames();
 
@@ -788,6 +1753,368 @@ static void serve_replay(const string& trace_dir) {
   LOG(debug) << "debugger server exiting ...";
 }
 
+/**
+ * Replay each partition of the trace in its own forked replayer, with up
+ * to |Flags::parallel_replay| of them running at once.  Returns the exit
+ * status for rr: nonzero if any partition failed to replay.
+ */
+static int replay_partitions(const string& trace_dir) {
+  vector<TracePartition> partitions =
+      TracePartition::compute(TraceReader(trace_dir));
+  LOG(info) << "Replaying " << partitions.size() << " partition(s)";
+  if (partitions.size() == 1) {
+    serve_replay(trace_dir);
+    return 0;
+  }
+
+  size_t next = 0;
+  uint32_t running = 0;
+  int failures = 0;
+  while (next < partitions.size() || running > 0) {
+    if (next < partitions.size() && running < Flags::get().parallel_replay) {
+      pid_t pid = fork();
+      if (pid < 0) {
+        FATAL() << "Failed to fork partition replayer";
+      }
+      if (0 == pid) {
+        serve_replay(trace_dir, make_shared<const TracePartition>(
+                                    partitions[next]));
+        ReplayOutput::flush();
+        fflush(stdout);
+        _exit(0);
+      }
+      LOG(debug) << "Replaying partition " << next << " of "
+                 << partitions[next].num_tasks() << " task(s) in " << pid;
+      ++next;
+      ++running;
+      continue;
+    }
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      FATAL() << "Failed to wait for partition replayers";
+    }
+    --running;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      LOG(error) << "Partition replayer " << pid << " failed; status "
+                 << HEX(status);
+      ++failures;
+    }
+  }
+  return failures ? 1 : 0;
+}
+
+/**
+ * Replay |trace_dir| to the end in this forked batch replayer, on |cpu|.
+ * Doesn't return.
+ */
+static void serve_batch_replay(const string& trace_dir, int cpu) {
+  // The tracees' output isn't interesting here, and would be mixed up
+  // with the other replays' and the report.
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+    FATAL() << "Can't redirect stdout to /dev/null";
+  }
+  close(null_fd);
+  Flags::get_for_init().replay_cpu = cpu;
+  serve_replay(trace_dir);
+  ReplayOutput::flush();
+  _exit(0);
+}
+
+int replay_batch(int argc, char* argv[], char** envp) {
+  uint32_t jobs = Flags::get().replay_batch_jobs;
+  int num_cpus = get_num_cpus();
+  struct Replayer {
+    int trace;
+    uint32_t slot;
+    double start;
+  };
+  map<pid_t, Replayer> running;
+  // Slots of finished replayers, for the next ones to reuse, so that each
+  // running replayer has a CPU of its own.
+  vector<uint32_t> free_slots;
+  for (uint32_t i = jobs; i > 0; --i) {
+    free_slots.push_back(i - 1);
+  }
+  int next = 0;
+  int failures = 0;
+  double batch_start = now_sec();
+  while (next < argc || !running.empty()) {
+    if (next < argc && !free_slots.empty()) {
+      uint32_t slot = free_slots.back();
+      free_slots.pop_back();
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid < 0) {
+        FATAL() << "Failed to fork batch replayer";
+      }
+      if (0 == pid) {
+        serve_batch_replay(argv[next], slot % num_cpus);
+      }
+      running[pid] = { next, slot, now_sec() };
+      ++next;
+      continue;
+    }
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      FATAL() << "Failed to wait for batch replayers";
+    }
+    auto it = running.find(pid);
+    if (it == running.end()) {
+      continue;
+    }
+    const Replayer& r = it->second;
+    double secs = now_sec() - r.start;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      printf("%s: ok %.2fs\n", argv[r.trace], secs);
+    } else {
+      ++failures;
+      if (WIFSIGNALED(status)) {
+        printf("%s: diverged (%s) %.2fs\n", argv[r.trace],
+               signalname(WTERMSIG(status)), secs);
+      } else {
+        printf("%s: diverged (exit status %d) %.2fs\n", argv[r.trace],
+               WEXITSTATUS(status), secs);
+      }
+    }
+    fflush(stdout);
+    free_slots.push_back(r.slot);
+    running.erase(it);
+  }
+  printf("%d of %d trace(s) replayed ok in %.2fs\n", argc - failures, argc,
+         now_sec() - batch_start);
+  return failures ? 1 : 0;
+}
+
+/**
+ * Return true if |s| can be cloned to bisect from.
+ */
+static bool can_bisect_from(ReplaySession& s) {
+  Task* t = s.current_task();
+  return t && !s.last_task() && s.at_frame_start() &&
+         can_checkpoint_at(t, s.current_trace_frame());
+}
+
+/**
+ * Return a session that has replayed the trace up to and including
+ * |event|, starting from a clone of |from|, or from the beginning of the
+ * trace if that's null.
+ */
+static ReplaySession::shr_ptr replay_through(
+    const ReplaySession::shr_ptr& from, const string& trace_dir,
+    TraceFrame::Time event) {
+  ReplaySession::shr_ptr s = from ? from->clone() : create_session(trace_dir);
+  s->fast_forward(event + 1);
+  return s;
+}
+
+/**
+ * The contents of a mapping at some point of the replay, as far as
+ * bisection cares.
+ */
+struct MappingState {
+  bool mapped;
+  unsigned checksum;
+  bool operator==(const MappingState& other) const {
+    return mapped == other.mapped && checksum == other.checksum;
+  }
+};
+
+static MappingState mapping_state(
+    ReplaySession& s, pid_t rec_tid,
+    const ChecksumDivergence::DivergedMapping& m) {
+  MappingState state = { false, 0 };
+  Task* t = s.find_task(rec_tid);
+  if (!t) {
+    return state;
+  }
+  for (auto& kv : t->vm()->memmap()) {
+    if (kv.first.start == m.start && kv.first.end == m.end) {
+      state.mapped = true;
+      state.checksum = checksum_memory(t, m.start, m.end);
+      break;
+    }
+  }
+  return state;
+}
+
+/**
+ * Print the ranges of pages of |m| whose contents differ between |a| and
+ * |b|.
+ */
+static void print_changed_pages(ReplaySession& a, ReplaySession& b,
+                                pid_t rec_tid,
+                                const ChecksumDivergence::DivergedMapping& m) {
+  Task* ta = a.find_task(rec_tid);
+  Task* tb = b.find_task(rec_tid);
+  if (!ta || !tb) {
+    return;
+  }
+  size_t len = m.end - m.start;
+  vector<uint8_t> mem_a(len);
+  vector<uint8_t> mem_b(len);
+  ta->read_bytes_fallible(m.start, len, mem_a.data());
+  tb->read_bytes_fallible(m.start, len, mem_b.data());
+  size_t run_start = len;
+  for (size_t offset = 0; offset <= len; offset += page_size()) {
+    bool changed =
+        offset < len && memcmp(&mem_a[offset], &mem_b[offset],
+                               min(page_size(), len - offset));
+    if (changed && run_start == len) {
+      run_start = offset;
+    } else if (!changed && run_start < len) {
+      fprintf(stderr, "      changed pages 0x%llx-0x%llx\n",
+              (unsigned long long)(m.start + run_start).as_int(),
+              (unsigned long long)(m.start + offset).as_int());
+      run_start = len;
+    }
+  }
+}
+
+/**
+ * Bisect the events after |good_time| up to |bad_time| for the first one
+ * after which |m|'s contents differ from what they were at |good_time|,
+ * and report it.  |base| is a checkpoint at or before |good_time|, or null.
+ */
+static void bisect_mapping(const string& trace_dir,
+                           const ReplaySession::shr_ptr& base,
+                           TraceFrame::Time good_time,
+                           TraceFrame::Time bad_time, pid_t rec_tid,
+                           const ChecksumDivergence::DivergedMapping& m,
+                           TraceReader& trace) {
+  fprintf(stderr, "  %s\n", m.map_line.c_str());
+
+  uint32_t kind;
+  vector<TraceStream::MappingChecksum> good_sums, bad_sums;
+  bool recorded_changed = true;
+  if (trace.read_checksums(good_time, rec_tid, &kind, &good_sums) &&
+      trace.read_checksums(bad_time, rec_tid, &kind, &bad_sums)) {
+    auto find = [&](const vector<TraceStream::MappingChecksum>& sums) {
+      for (auto& c : sums) {
+        if (remote_ptr<void>(c.start) == m.start &&
+            remote_ptr<void>(c.end) == m.end) {
+          return (int64_t)c.checksum;
+        }
+      }
+      return (int64_t)-1;
+    };
+    int64_t good_sum = find(good_sums);
+    recorded_changed = good_sum < 0 || good_sum != find(bad_sums);
+  }
+
+  ReplaySession::shr_ptr lo = replay_through(base, trace_dir, good_time);
+  TraceFrame::Time lo_time = good_time;
+  MappingState good_state = mapping_state(*lo, rec_tid, m);
+  ReplaySession::shr_ptr lo_checkpoint = can_bisect_from(*lo) ? lo : base;
+  ReplaySession::shr_ptr hi = replay_through(lo_checkpoint, trace_dir,
+                                             bad_time);
+  TraceFrame::Time hi_time = bad_time;
+  if (mapping_state(*hi, rec_tid, m) == good_state) {
+    fprintf(stderr, "    replay didn't change it after event %u, but the "
+                    "recording did: replay is missing a write\n",
+            good_time);
+    return;
+  }
+
+  // Invariant: the mapping is as it was at |good_time| after |lo_time|,
+  // and not after |hi_time|.
+  while (hi_time - lo_time > 1) {
+    TraceFrame::Time mid = lo_time + (hi_time - lo_time) / 2;
+    ReplaySession::shr_ptr s = replay_through(lo_checkpoint, trace_dir, mid);
+    LOG(debug) << "Bisecting " << m.map_line << ": event " << mid;
+    if (mapping_state(*s, rec_tid, m) == good_state) {
+      lo = s;
+      lo_time = mid;
+      if (can_bisect_from(*s)) {
+        lo_checkpoint = s;
+      }
+    } else {
+      hi = s;
+      hi_time = mid;
+    }
+  }
+
+  TraceFrame frame = trace.peek_frame_at(hi_time);
+  stringstream ev;
+  ev << Event(frame.event());
+  fprintf(stderr, "    replay first changed it at event %u (tid %d, %s)\n",
+          hi_time, frame.tid(), ev.str().c_str());
+  print_changed_pages(*lo, *hi, rec_tid, m);
+  if (recorded_changed) {
+    fprintf(stderr, "    the recording changed it too between events %u "
+                    "and %u, so this is only where the divergence may be\n",
+            good_time, bad_time);
+  } else {
+    fprintf(stderr, "    the recording didn't change it between events %u "
+                    "and %u, so this is where replay diverged\n",
+            good_time, bad_time);
+  }
+}
+
+/**
+ * Replay |trace_dir| until a memory checksum doesn't validate, then bisect
+ * between the last checksum of that task that did and that one to find
+ * the event where each diverged mapping first changed.  Returns the exit
+ * status for rr: nonzero if replay diverged.
+ */
+static int diagnose_divergence(const string& trace_dir) {
+  if (Flags::get().checksum == Flags::CHECKSUM_NONE) {
+    fprintf(stderr, "--diagnose-divergence needs --checksum\n");
+    return 1;
+  }
+  // Keep a checkpoint at the last validated checksum to bisect from.
+  ReplaySession::shr_ptr checkpoint;
+  TraceFrame::Time checkpoint_time = 0;
+  session = create_session(trace_dir);
+  while (!checksum_divergence() && !session->last_task()) {
+    TraceFrame frame = session->current_trace_frame();
+    if (session->fast_forward(frame.time() + 1) !=
+        ReplaySession::REPLAY_CONTINUE) {
+      break;
+    }
+    if (last_validated_checksum_time(frame.tid()) == (int)frame.time() &&
+        !checksum_divergence() && can_bisect_from(*session)) {
+      checkpoint = session->clone();
+      checkpoint_time = frame.time();
+    }
+  }
+  const ChecksumDivergence* divergence = checksum_divergence();
+  if (!divergence) {
+    fprintf(stderr, "Replay didn't diverge.\n");
+    session = nullptr;
+    return 0;
+  }
+  session = nullptr;
+
+  // Copy what we need; bisecting replays validate checksums again.
+  ChecksumDivergence d = *divergence;
+  TraceFrame::Time bad_time = d.global_time;
+  TraceFrame::Time good_time = last_validated_checksum_time(d.rec_tid);
+  fprintf(stderr, "Replay diverged in %zu mapping(s) of tid %d by event %u",
+          d.mappings.size(), d.rec_tid, bad_time);
+  if (!good_time) {
+    fprintf(stderr, "; no earlier checksum of it validated.\n");
+    return 1;
+  }
+  fprintf(stderr, "; they matched at event %u.\n", good_time);
+
+  ReplaySession::shr_ptr base =
+      checkpoint_time <= good_time ? checkpoint : nullptr;
+  TraceReader trace(trace_dir, TraceReader::FRAMES_ONLY);
+  for (auto& m : d.mappings) {
+    bisect_mapping(trace_dir, base, good_time, bad_time, d.rec_tid, m, trace);
+  }
+  return 1;
+}
+
 static void handle_signal(int sig) {
   switch (sig) {
     case SIGINT:
@@ -811,6 +2138,12 @@ int replay(int argc, char* argv[], char** envp) {
   // through the rigamarole to set that up.  All it does is
   // complicate the process tree and confuse users.
   if (Flags::get().dont_launch_debugger) {
+    if (Flags::get().diagnose_divergence) {
+      return diagnose_divergence(trace_dir);
+    }
+    if (Flags::get().parallel_replay) {
+      return replay_partitions(trace_dir);
+    }
     serve_replay(trace_dir);
     return 0;
   }
@@ -7,6 +7,7 @@
 #include "util.h"
 
 class GdbContext;
+struct GdbRegisterValue;
 struct GdbRequest;
 class ReplaySession;
 class Session;
@@ -18,6 +19,15 @@ class Session;
  */
 int replay(int argc, char* argv[], char** envp);
 
+/**
+ * Replay each of the traces argv[0..argc) to the end with autopilot, in
+ * up to Flags::replay_batch_jobs forked replayers at once, each on a CPU
+ * of its own, and print each trace's replay time and whether it replayed
+ * without diverging.
+ * Returns an exit code: 0 if all the traces replayed.
+ */
+int replay_batch(int argc, char* argv[], char** envp);
+
 /**
  * Process the single debugger request |req|, made by |dbg| targeting
  * |t|, inside the session |session|.
@@ -42,6 +52,12 @@ bool is_ignored_replay_signal(int sig);
 
 bool trace_instructions_up_to_event(uint64_t event);
 
+/**
+ * Return the registers of |t| that gdb reads at every stop (pc, sp and
+ * fp), to send along with the stop reply.
+ */
+std::vector<GdbRegisterValue> get_expedited_regs(Task* t);
+
 /**
  * Start a debugging connection for |t| and return when there are no
  * more requests to process (usually because the debugger detaches).
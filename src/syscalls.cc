@@ -6,11 +6,31 @@
 #include <syscall.h>
 
 #include "kernel_abi.h"
+#include "util.h"
 
 using namespace rr;
 
-#include "SyscallnameArch.generated"
+#include "SyscallInfoTable.generated"
+
+static const SyscallInfo undefined_syscall_info = { "<unknown-syscall>",
+                                                    SYSCALL_UNDEFINED,
+                                                    SEMANTICS_EMU, -1 };
+
+template <typename Arch> const SyscallInfo& syscall_info_arch(int syscallno) {
+  auto& entries = SyscallInfoTable<Arch>::entries;
+  if (syscallno < 0 || syscallno >= int(array_length(entries))) {
+    return undefined_syscall_info;
+  }
+  return entries[syscallno];
+}
+
+template const SyscallInfo& syscall_info_arch<X86Arch>(int syscallno);
+template const SyscallInfo& syscall_info_arch<X64Arch>(int syscallno);
+
+const SyscallInfo& syscall_info(int syscallno, SupportedArch arch) {
+  RR_ARCH_FUNCTION(syscall_info_arch, arch, syscallno)
+}
 
 const char* syscall_name(int syscall, SupportedArch arch) {
-  RR_ARCH_FUNCTION(syscallname_arch, arch, syscall)
+  return syscall_info(syscall, arch).name;
 }
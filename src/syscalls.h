@@ -3,11 +3,59 @@
 #ifndef RR_SYSCALLS_H_
 #define RR_SYSCALLS_H_
 
+#include <stdint.h>
+
 #include "kernel_abi.h"
 
 /**
- * Return the symbolic name of |syscall|, f.e. "read", or "???syscall"
- * if unknown.
+ * How rr handles a syscall; see the syscall classes in syscalls.py.
+ */
+enum SyscallKind {
+  /* No such syscall. */
+  SYSCALL_UNDEFINED = 0,
+  /* Recorded and replayed generically from its syscalls.py entry. */
+  SYSCALL_REGULAR,
+  /* Recorded and replayed by hand-written code. */
+  SYSCALL_IRREGULAR,
+  /* Known, but rr doesn't support it. */
+  SYSCALL_UNSUPPORTED
+};
+
+/* See ReplaySemantics in syscalls.py. */
+enum SyscallSemantics {
+  SEMANTICS_EMU,
+  SEMANTICS_EXEC,
+  SEMANTICS_EXEC_RET_EMU,
+  SEMANTICS_MAY_EXEC
+};
+
+struct SyscallInfo {
+  const char* name;
+  SyscallKind kind;
+  SyscallSemantics semantics;
+  /* The number of outparams recorded for SYSCALL_REGULAR syscalls,
+   * otherwise -1. */
+  int8_t num_recorded_args;
+};
+
+/**
+ * Per-Arch tables of SyscallInfo indexed by syscall number, generated
+ * from syscalls.py.
+ */
+template <typename Arch> struct SyscallInfoTable {
+  static const SyscallInfo entries[];
+};
+
+/**
+ * Return the SyscallInfo for |syscallno|. Unknown (including negative)
+ * syscall numbers have kind SYSCALL_UNDEFINED.
+ */
+template <typename Arch> const SyscallInfo& syscall_info_arch(int syscallno);
+const SyscallInfo& syscall_info(int syscallno, SupportedArch arch);
+
+/**
+ * Return the symbolic name of |syscall|, f.e. "read", or
+ * "<unknown-syscall>" if unknown.
  */
 const char* syscall_name(int syscall, SupportedArch arch);
 
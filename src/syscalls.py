@@ -63,7 +63,9 @@ class RegularSyscall(BaseSyscall, ReplaySemantics):
 
     * A Python string, in which case the size of the argument is sizeof(arg);
     * A DynamicSize object, in which case the size of the argument is the
-      C expression stored in the DynamicSize object;
+      C expression stored in the DynamicSize object.  Negative sizes, e.g.
+      from an expression using the result of a failed syscall, are
+      recorded as 0;
     * A NullTerminatedString object, in which case the size is determined at
       runtime in the expected fashion.
     """
@@ -792,7 +794,12 @@ flock = UnsupportedSyscall(x86=143, x64=73)
 # length is updated.
 msync = EmulatedSyscall(x86=144, x64=26)
 
-readv = UnsupportedSyscall(x86=145, x64=19)
+#  ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+#
+# The readv() function reads iovcnt buffers from the file associated
+# with the file descriptor fd into the buffers described by iov
+# ("scatter input").
+readv = IrregularEmulatedSyscall(x86=145, x64=19)
 
 #  ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
 #
@@ -1197,9 +1204,9 @@ fsetxattr = UnsupportedSyscall(x86=228, x64=190)
 # getxattr() retrieves the value of the extended attribute identified
 # by name and associated with the given path in the file system. The
 # length of the attribute value is returned.
-getxattr = IrregularEmulatedSyscall(x86=229, x64=191)
-lgetxattr = IrregularEmulatedSyscall(x86=230, x64=192)
-fgetxattr = IrregularEmulatedSyscall(x86=231, x64=193)
+getxattr = EmulatedSyscall(x86=229, x64=191, arg3=DynamicSize("t->regs().syscall_result_signed()"))
+lgetxattr = EmulatedSyscall(x86=230, x64=192, arg3=DynamicSize("t->regs().syscall_result_signed()"))
+fgetxattr = EmulatedSyscall(x86=231, x64=193, arg3=DynamicSize("t->regs().syscall_result_signed()"))
 
 listxattr = UnsupportedSyscall(x86=232, x64=194)
 llistxattr = UnsupportedSyscall(x86=233, x64=195)
@@ -1671,6 +1678,31 @@ process_vm_writev = UnsupportedSyscall(x86=348, x64=311)
 kcmp = UnsupportedSyscall(x86=349, x64=312)
 finit_module = UnsupportedSyscall(x86=350, x64=313)
 
+#  ssize_t copy_file_range(int fd_in, loff_t *off_in, int fd_out,
+#                          loff_t *off_out, size_t len, unsigned int flags);
+#
+# copy_file_range() copies len bytes from fd_in to fd_out within the
+# kernel.  As with splice, the |off| params are inout params, and the
+# data never passes through the tracee, so only the offsets need
+# recording.
+copy_file_range = IrregularEmulatedSyscall(x86=377, x64=326)
+
+#  int io_uring_setup(u32 entries, struct io_uring_params *p);
+#  int io_uring_enter(unsigned int fd, unsigned int to_submit,
+#                     unsigned int min_complete, unsigned int flags,
+#                     const void *arg, size_t argsz);
+#  int io_uring_register(unsigned int fd, unsigned int opcode, void *arg,
+#                        unsigned int nr_args);
+#
+# io_uring_setup() creates a submission and a completion ring shared
+# with the kernel, which the tracee maps; io_uring_enter() submits the
+# requests queued in the former and waits for completions to be posted
+# to the latter.  rr has completions posted only during io_uring_enter,
+# and records the buffers they filled there.
+io_uring_setup = IrregularEmulatedSyscall(x86=425, x64=425)
+io_uring_enter = IrregularEmulatedSyscall(x86=426, x64=426)
+io_uring_register = IrregularEmulatedSyscall(x86=427, x64=427)
+
 # restart_syscall is a little special.
 restart_syscall = RestartSyscall(x86=0, x64=219)
 
@@ -1700,6 +1732,10 @@ msgget = EmulatedSyscall(x64=68)
 msgsnd = EmulatedSyscall(x64=69)
 msgrcv = IrregularEmulatedSyscall(x64=70)
 msgctl = IrregularEmulatedSyscall(x64=71)
+shmget = EmulatedSyscall(x64=29)
+shmat = IrregularEmulatedSyscall(x64=30)
+shmctl = IrregularEmulatedSyscall(x64=31)
+shmdt = IrregularEmulatedSyscall(x64=67)
 
 arch_prctl = ExecutedSyscall(x64=158)
 
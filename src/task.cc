@@ -6,17 +6,21 @@
 
 #include <elf.h>
 #include <errno.h>
+#include <pthread.h>
 #include <linux/net.h>
 #include <linux/perf_event.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syscall.h>
+#include <sys/mman.h>
 #include <sys/personality.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 
+#include <deque>
 #include <limits>
 #include <set>
 
@@ -27,6 +31,7 @@
 #include "kernel_supplement.h"
 #include "log.h"
 #include "AutoRemoteSyscalls.h"
+#include "PtraceProfiler.h"
 #include "RecordSession.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
@@ -43,6 +48,10 @@ static const int REPLAY_DESCHED_EVENT_FD = -123;
 static const unsigned int NUM_X86_DEBUG_REGS = 8;
 static const unsigned int NUM_X86_WATCHPOINTS = 4;
 
+/* Shrink the syscallbuf of a task after this many flushes in a row
+ * that each used less than 1/16th of it. */
+static const uint32_t SMALL_SYSCALLBUF_FLUSHES_BEFORE_SHRINK = 64;
+
 using namespace rr;
 using namespace std;
 
@@ -51,9 +60,9 @@ using namespace std;
  * tracee |tid| will be allocated (briefly, until unlinked).
  */
 template <size_t N>
-void format_syscallbuf_shmem_path(pid_t tid, char (&path)[N]) {
+void format_shmem_path(const char* prefix, pid_t tid, char (&path)[N]) {
   static int nonce;
-  snprintf(path, N - 1, SYSCALLBUF_SHMEM_NAME_PREFIX "%d-%d", tid, nonce++);
+  snprintf(path, N - 1, "%s%d-%d", prefix, tid, nonce++);
 }
 
 /**
@@ -120,6 +129,29 @@ struct Sighandlers {
     }
   }
 
+  /**
+   * Read the dispositions of the x86-64 tracee prepared for |remote|.
+   */
+  void init_from_tracee(AutoRemoteSyscalls& remote) {
+    Task* t = remote.task();
+    struct kernel_sigaction ka;
+    // The kernel's sa_mask is a single sig_set_t.
+    const size_t ka_size =
+        offsetof(struct kernel_sigaction, sa_mask) + sizeof(sig_set_t);
+    AutoRestoreMem mem(remote, nullptr, ka_size);
+    for (int i = 1; i < ssize_t(array_length(handlers)); ++i) {
+      long ret = remote.syscall(syscall_number_for_rt_sigaction(t->arch()), i,
+                                nullptr, mem.get(), sizeof(sig_set_t));
+      if (ret < 0) {
+        // An unused signal number.
+        continue;
+      }
+      memset(&ka, 0, sizeof(ka));
+      t->read_bytes_helper(mem.get(), ka_size, &ka);
+      handlers[i] = Sighandler(ka);
+    }
+  }
+
   /**
    * For each signal in |table| such that is_user_handler() is
    * true, reset the disposition of that signal to SIG_DFL, and
@@ -174,13 +206,18 @@ TaskGroup::TaskGroup(pid_t tgid, pid_t real_tgid)
 Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, int _priority)
     : switchable(),
       pseudo_blocked(false),
+      running_in_parallel(false),
+      vfork_child_tid(0),
       succ_event_counter(),
+      timeslice_ticks(0),
       unstable(false),
       stable_exit(false),
+      run_untraced(false),
       priority(_priority),
-      in_round_robin_queue(false),
+      round_robin_epoch(0),
       scratch_ptr(),
       scratch_size(),
+      local_scratch(nullptr),
       flushed_syscallbuf(false),
       delay_syscallbuf_reset(false),
       delay_syscallbuf_flush(false),
@@ -189,6 +226,7 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, int _priority)
       seccomp_bpf_enabled(false),
       child_sig(),
       stepped_into_syscall(false),
+      emulated_syscall_unfinished(false),
       hpc(_tid),
       tid(_tid),
       rec_tid(_rec_tid > 0 ? _rec_tid : _tid),
@@ -199,11 +237,15 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, int _priority)
       syscallbuf_hdr(),
       num_syscallbuf_bytes(),
       syscallbuf_child(),
+      syscallbuf_size_hint(SYSCALLBUF_DEFAULT_BUFFER_SIZE),
+      small_syscallbuf_flushes(0),
       blocked_sigs(),
       prname("???"),
       ticks(0),
       is_stopped(false),
       extra_registers_known(false),
+      cached_debug_status(0),
+      debug_status_known(false),
       robust_futex_list(),
       robust_futex_list_len(),
       session_(&session),
@@ -253,6 +295,7 @@ bool Task::at_may_restart_syscall() const {
 }
 
 void Task::finish_emulated_syscall() {
+  emulated_syscall_unfinished = false;
   // XXX verify that this can't be interrupted by a breakpoint trap
   Registers r = regs();
   remote_ptr<uint8_t> ip = r.ip();
@@ -291,6 +334,12 @@ void Task::finish_emulated_syscall() {
   wait_status = 0;
 }
 
+void Task::defer_finish_emulated_syscall() {
+  emulated_syscall_unfinished = true;
+  // Look to the rest of rr as if the syscall had been stepped over.
+  wait_status = 0;
+}
+
 const struct syscallbuf_record* Task::desched_rec() const {
   return (ev().is_syscall_event()
               ? ev().Syscall().desched_rec
@@ -389,7 +438,8 @@ RecordSession& Task::record_session() const { return *session().as_record(); }
 ReplaySession& Task::replay_session() const { return *session().as_replay(); }
 
 remote_ptr<void> Task::init_buffers(remote_ptr<void> map_hint,
-                                    ShareDeschedEventFd share_desched_fd) {
+                                    ShareDeschedEventFd share_desched_fd,
+                                    size_t syscallbuf_size) {
   // NB: the tracee can't be interrupted with a signal while
   // we're processing the rrcall, because it's masked off all
   // signals.
@@ -409,8 +459,9 @@ remote_ptr<void> Task::init_buffers(remote_ptr<void> map_hint,
   if (args.syscallbuf_enabled) {
     traced_syscall_ip = reinterpret_cast<uintptr_t>(args.traced_syscall_ip);
     untraced_syscall_ip = reinterpret_cast<uintptr_t>(args.untraced_syscall_ip);
-    child_map_addr = init_syscall_buffer(remote, map_hint);
+    child_map_addr = init_syscall_buffer(remote, map_hint, syscallbuf_size);
     args.syscallbuf_ptr = (void*)child_map_addr.as_int();
+    args.syscallbuf_size = num_syscallbuf_bytes;
     if (share_desched_fd == SHARE_DESCHED_EVENT_FD) {
       desched_fd_child = args.desched_counter_fd;
       desched_fd = remote.retrieve_fd(desched_fd_child);
@@ -419,6 +470,14 @@ remote_ptr<void> Task::init_buffers(remote_ptr<void> map_hint,
     }
   } else {
     args.syscallbuf_ptr = nullptr;
+    args.syscallbuf_size = 0;
+  }
+  if (args.remote_syscall_stub) {
+    vm()->set_remote_syscall_stub((uintptr_t)args.remote_syscall_stub);
+  }
+  if (args.monkeypatch_vdso) {
+    patch_vdso(this, (uintptr_t)args.vsyscall_hook_trampoline,
+               args.syscallbuf_enabled);
   }
 
   // Return the mapped buffers to the child.
@@ -440,6 +499,10 @@ void Task::destroy_buffers(int which) {
     remote.syscall(syscall_number_for_munmap(arch()), scratch_ptr,
                    scratch_size);
     vm()->unmap(scratch_ptr, scratch_size);
+    if (local_scratch) {
+      munmap(local_scratch, scratch_size);
+      local_scratch = nullptr;
+    }
   }
   if ((DESTROY_SYSCALLBUF & which) && !syscallbuf_child.is_null()) {
     remote.syscall(syscall_number_for_munmap(arch()), syscallbuf_child,
@@ -566,8 +629,8 @@ void Task::log_pending_events() const {
 
   /* The event at depth 0 is the placeholder event, which isn't
    * useful to log.  Skip it. */
-  for (auto it = pending_events.rbegin(); it != pending_events.rend(); ++it) {
-    it->log();
+  for (ssize_t i = depth - 1; i >= 0; --i) {
+    pending_events[i].log();
   }
 }
 
@@ -577,6 +640,23 @@ bool Task::may_be_blocked() const {
          (EV_SIGNAL_DELIVERY == ev().type() && ev().Signal().delivered);
 }
 
+bool Task::is_waiting_for_vfork_child() {
+  if (!vfork_child_tid) {
+    return false;
+  }
+  // The child stops borrowing our address space when it execs (and
+  // gets a new AddressSpace) or exits.  Checking the task group guards
+  // against the child's tid having been recycled for one of our threads.
+  Task* child = session().find_task(vfork_child_tid);
+  if (child && child->vm() == vm() && child->tgid() != tgid()) {
+    return true;
+  }
+  LOG(debug) << "  " << tid << " released by vfork child "
+             << vfork_child_tid;
+  vfork_child_tid = 0;
+  return false;
+}
+
 template <typename Arch>
 void Task::maybe_update_vm_arch(int syscallno, SyscallEntryOrExit state) {
   // We have to use the regs() during replay because they
@@ -693,6 +773,10 @@ static bool record_extra_regs(const Event& ev) {
 
 void Task::record_event(const Event& ev) {
   maybe_flush_syscallbuf();
+  if (EV_SCHED != ev.type()) {
+    // Settle this frame's time before checksumming for it.
+    trace_writer().write_held_frame();
+  }
 
   TraceFrame frame(trace_writer().time(), tid, ev.encode());
   if (ev.has_exec_info() == HAS_EXEC_INFO) {
@@ -748,10 +832,77 @@ void Task::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
     return;
   }
 
+  TraceWriter& trace = trace_writer();
+  CompressedWriter::WriteSpan spans[2];
+  if (trace.reserve_raw(num_bytes, spans)) {
+    // Read the tracee's memory straight into the trace buffer.
+    read_bytes_helper(addr, spans[0].size, spans[0].data);
+    read_bytes_helper(addr + spans[0].size, spans[1].size, spans[1].data);
+    trace.commit_raw(num_bytes, addr);
+    return;
+  }
+
   vector<uint8_t> buf;
   buf.resize(num_bytes);
   read_bytes_helper(addr, num_bytes, buf.data());
-  trace_writer().write_raw(buf.data(), num_bytes, addr);
+  trace.write_raw(buf.data(), num_bytes, addr);
+}
+
+void Task::record_remote_pages(remote_ptr<void> addr, ssize_t num_bytes,
+                               PageRecording recording) {
+  ASSERT(this, addr.as_int() % page_size() == 0);
+  maybe_flush_syscallbuf();
+
+  // Read a batch of pages at a time; mappings of large files can be much
+  // bigger than we'd want to buffer.
+  static const size_t BATCH_BYTES = 1024 * 1024;
+  vector<uint8_t> buf;
+  buf.resize(min<size_t>(BATCH_BYTES, num_bytes));
+  while (num_bytes > 0) {
+    size_t batch = min<size_t>(buf.size(), num_bytes);
+    read_bytes_helper(addr, batch, buf.data());
+    for (size_t offset = 0; offset < batch; offset += page_size()) {
+      size_t page = min<size_t>(page_size(), batch - offset);
+      const uint8_t* p = buf.data() + offset;
+      if (recording == SKIP_ZERO_PAGES && p[0] == 0 &&
+          !memcmp(p, p + 1, page - 1)) {
+        continue;
+      }
+      trace_writer().write_raw(p, page, addr + offset);
+    }
+    addr += batch;
+    num_bytes -= batch;
+  }
+}
+
+void Task::record_remote_v(const vector<MemoryRange>& ranges) {
+  maybe_flush_syscallbuf();
+
+  size_t total = 0;
+  for (auto& r : ranges) {
+    ASSERT(this, r.addr.is_null() || r.addr != scratch_ptr);
+    if (!r.addr.is_null()) {
+      total += r.num_bytes;
+    }
+  }
+  vector<uint8_t> buf;
+  buf.resize(total);
+  vector<RemoteIovec> iovs;
+  size_t offset = 0;
+  for (auto& r : ranges) {
+    if (!r.addr.is_null()) {
+      iovs.push_back(RemoteIovec(r.addr, r.num_bytes, buf.data() + offset));
+      offset += r.num_bytes;
+    }
+  }
+  read_bytes_v(iovs);
+
+  vector<TraceWriter::RawRange> raw_ranges;
+  for (auto& r : ranges) {
+    TraceWriter::RawRange raw = { r.addr, r.addr.is_null() ? 0 : r.num_bytes };
+    raw_ranges.push_back(raw);
+  }
+  trace_writer().write_raw_v(buf.data(), raw_ranges);
 }
 
 void Task::record_remote_str(remote_ptr<void> str) {
@@ -770,21 +921,21 @@ void Task::record_remote_str(remote_ptr<void> str) {
 string Task::read_c_str(remote_ptr<void> child_addr) {
   // XXX handle invalid C strings
   string str;
+  char buf[4096];
   while (true) {
     // We're only guaranteed that [child_addr,
     // end_of_page) is mapped.
     remote_ptr<void> end_of_page = ceil_page_size(child_addr + 1);
-    ssize_t nbytes = end_of_page - child_addr;
-    char buf[nbytes];
+    ssize_t nbytes = min<ssize_t>(end_of_page - child_addr, sizeof(buf));
 
     read_bytes_helper(child_addr, nbytes, buf);
-    for (int i = 0; i < nbytes; ++i) {
-      if ('\0' == buf[i]) {
-        return str;
-      }
-      str += buf[i];
+    const char* nul = static_cast<const char*>(memchr(buf, '\0', nbytes));
+    if (nul) {
+      str.append(buf, nul - buf);
+      return str;
     }
-    child_addr = end_of_page;
+    str.append(buf, nbytes);
+    child_addr += nbytes;
   }
 }
 
@@ -859,7 +1010,12 @@ static ssize_t dr_user_word_offset(size_t i) {
 }
 
 uintptr_t Task::debug_status() {
-  return fallible_ptrace(PTRACE_PEEKUSER, dr_user_word_offset(6), nullptr);
+  if (!debug_status_known) {
+    cached_debug_status =
+        fallible_ptrace(PTRACE_PEEKUSER, dr_user_word_offset(6), nullptr);
+    debug_status_known = true;
+  }
+  return cached_debug_status;
 }
 
 remote_ptr<void> Task::watchpoint_addr(size_t i) {
@@ -877,6 +1033,10 @@ void Task::remote_memcpy(remote_ptr<void> dst, remote_ptr<void> src,
 
 void Task::resume_execution(ResumeRequest how, WaitRequest wait_how, int sig,
                             Ticks tick_period) {
+  if (emulated_syscall_unfinished && (RESUME_SYSEMU != how || sig)) {
+    finish_emulated_syscall();
+  }
+  emulated_syscall_unfinished = false;
   // Treat a 0 tick_period as a very large but finite number.
   // Always resetting here, and always to a nonzero number, improves
   // consistency between recording and replay and hopefully
@@ -885,12 +1045,17 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how, int sig,
   // Accumulate any unknown stuff in tick_count().
   hpc.reset(tick_period == 0 ? 0xffffffff : tick_period);
   LOG(debug) << "resuming execution with " << ptrace_req_name(how);
+  invalidate_read_caches();
+  double start = now_sec();
   ptrace_if_alive(how, nullptr, (void*)(uintptr_t)sig);
   is_stopped = false;
   extra_registers_known = false;
   if (RESUME_WAIT == wait_how) {
     wait();
   }
+  if (session().is_replaying()) {
+    replay_session().note_resume(how, now_sec() - start);
+  }
 }
 
 const TraceFrame& Task::current_trace_frame() {
@@ -898,13 +1063,65 @@ const TraceFrame& Task::current_trace_frame() {
 }
 
 ssize_t Task::set_data_from_trace() {
+  double start = now_sec();
   auto buf = trace_reader().read_raw_data();
+  double read_done = now_sec();
+  replay_session().note_trace_read(read_done - start);
   if (!buf.addr.is_null() && buf.data.size() > 0) {
     write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+    replay_session().note_data_write(buf.data.size(), now_sec() - read_done);
+    replay_session().note_trace_data(this, buf.addr, buf.data.size());
   }
   return buf.data.size();
 }
 
+/**
+ * Write all of |records| into |t| at once.
+ */
+static void write_raw_data(Task* t,
+                           vector<TraceReader::RawData>& records) {
+  double start = now_sec();
+  vector<Task::RemoteIovec> iovs;
+  size_t bytes = 0;
+  for (auto& buf : records) {
+    iovs.push_back(Task::RemoteIovec(buf.addr, buf.data.size(),
+                                     buf.data.data()));
+    bytes += buf.addr.is_null() ? 0 : buf.data.size();
+  }
+  t->write_bytes_v(iovs);
+  if (bytes > 0) {
+    t->replay_session().note_data_write(bytes, now_sec() - start);
+  }
+  for (auto& buf : records) {
+    t->replay_session().note_trace_data(t, buf.addr, buf.data.size());
+  }
+}
+
+void Task::set_data_from_trace_v(size_t count) {
+  double start = now_sec();
+  vector<TraceReader::RawData> records;
+  for (size_t i = 0; i < count; ++i) {
+    records.push_back(trace_reader().read_raw_data());
+  }
+  replay_session().note_trace_read(now_sec() - start);
+  write_raw_data(this, records);
+}
+
+void Task::apply_all_data_records_from_trace() {
+  vector<TraceReader::RawData> records;
+  double start = now_sec();
+  while (true) {
+    records.push_back(TraceReader::RawData());
+    if (!trace_reader().read_raw_data_for_frame(current_trace_frame(),
+                                                records.back())) {
+      records.pop_back();
+      break;
+    }
+  }
+  replay_session().note_trace_read(now_sec() - start);
+  write_raw_data(this, records);
+}
+
 void Task::set_return_value_from_trace() {
   Registers r = regs();
   r.set_syscall_result(current_trace_frame().regs().syscall_result());
@@ -919,6 +1136,11 @@ void Task::set_regs(const Registers& regs) {
 
 void Task::set_extra_regs(const ExtraRegisters& regs) {
   ASSERT(this, !regs.empty()) << "Trying to set empty ExtraRegisters";
+  // The XSAVE area can be several KB; don't write it back if the tracee
+  // already has exactly these registers at this stop.
+  if (extra_registers_known && extra_registers == regs) {
+    return;
+  }
   extra_registers = regs;
   extra_registers_known = true;
 
@@ -991,6 +1213,7 @@ bool Task::set_debug_regs(const DebugRegs& regs) {
   // Reset the debug status since we're about to change the set
   // of programmed watchpoints.
   ptrace_if_alive(PTRACE_POKEUSER, dr_user_word_offset(6), 0);
+  debug_status_known = false;
   // Ensure that we clear the programmed watchpoints in case
   // enabling one of them fails.  We guarantee atomicity to the
   // caller.
@@ -1025,6 +1248,22 @@ bool Task::set_debug_regs(const DebugRegs& regs) {
                               (void*)dr7.packed());
 }
 
+/*static*/ bool Task::fits_debug_reg(const WatchConfig& w) {
+  switch (w.num_bytes) {
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+      return 0 == (w.addr.as_int() & (w.num_bytes - 1));
+    default:
+      return false;
+  }
+}
+
+/*static*/ size_t Task::num_debug_reg_watchpoints() {
+  return NUM_X86_WATCHPOINTS;
+}
+
 void Task::set_thread_area(remote_ptr<void> tls) {
   thread_area = read_mem(tls.cast<struct user_desc>());
   thread_area_valid = true;
@@ -1073,7 +1312,7 @@ siginfo_t Task::pop_stash_sig() {
   assert(has_stashed_sig());
   wait_status = stashed_signals.front().wait_status;
   siginfo_t si = stashed_signals.front().si;
-  stashed_signals.pop_front();
+  stashed_signals.erase(stashed_signals.begin());
   return si;
 }
 
@@ -1200,6 +1439,66 @@ static void handle_alarm_signal(int sig) {
   LOG(debug) << "SIGALRM fired; maybe runaway tracee";
 }
 
+/**
+ * Interrupts waits that take longer than |timeout| seconds by sending
+ * SIGALRM to the waiting thread. Arming alarm() around every waitpid costs
+ * two syscalls per wait; begin_wait() and end_wait() cost none, and the
+ * watchdog thread only wakes up once a second.
+ */
+class WaitWatchdog {
+public:
+  static WaitWatchdog& get() {
+    // Never destroyed: the thread runs until rr exits.
+    static WaitWatchdog* watchdog = new WaitWatchdog();
+    return *watchdog;
+  }
+
+  void begin_wait(double timeout) {
+    pthread_mutex_lock(&mutex);
+    waiter = pthread_self();
+    deadline = now_sec() + timeout;
+    waiting = true;
+    pthread_mutex_unlock(&mutex);
+  }
+  void end_wait() {
+    // Holding |mutex| while clearing |waiting| means the signal can't
+    // be sent once we're past the wait.
+    pthread_mutex_lock(&mutex);
+    waiting = false;
+    pthread_mutex_unlock(&mutex);
+  }
+
+private:
+  WaitWatchdog() : waiting(false), deadline(0) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_t thread;
+    pthread_create(&thread, nullptr, thread_callback, this);
+    pthread_detach(thread);
+  }
+
+  static void* thread_callback(void* p) {
+    static_cast<WaitWatchdog*>(p)->watch();
+    return nullptr;
+  }
+  void watch() {
+    while (true) {
+      sleep(1);
+      pthread_mutex_lock(&mutex);
+      if (waiting && now_sec() >= deadline) {
+        pthread_kill(waiter, SIGALRM);
+        waiting = false;
+      }
+      pthread_mutex_unlock(&mutex);
+    }
+  }
+
+  pthread_mutex_t mutex;
+  // Protected by |mutex|.
+  pthread_t waiter;
+  bool waiting;
+  double deadline;
+};
+
 static const int ptrace_exit_wait_status = (PTRACE_EVENT_EXIT << 16) | 0x857f;
 
 void Task::wait(AllowInterrupt allow_interrupt) {
@@ -1222,11 +1521,11 @@ void Task::wait(AllowInterrupt allow_interrupt) {
       // PTRACE_INTERRUPT's shouldn't interfere with other
       // events, that's hard to test thoroughly so try to
       // avoid it.
-      alarm(3);
+      WaitWatchdog::get().begin_wait(3);
     }
     ret = waitpid(tid, &status, __WALL);
     if (enable_wait_interrupt) {
-      alarm(0);
+      WaitWatchdog::get().end_wait();
     }
     if (ret >= 0 || errno != EINTR) {
       // waitpid was not interrupted by the alarm.
@@ -1300,6 +1599,9 @@ void Task::wait(AllowInterrupt allow_interrupt) {
 }
 
 void Task::did_waitpid(int status) {
+  if (PtraceProfiler::enabled()) {
+    PtraceProfiler::get().tracee_stopped(tid);
+  }
   LOG(debug) << "  (refreshing register cache)";
   if (!ptrace_if_alive(PTRACE_GETREGS, nullptr, registers.ptrace_registers())) {
     status = ptrace_exit_wait_status;
@@ -1310,11 +1612,15 @@ void Task::did_waitpid(int status) {
   }
 
   is_stopped = true;
+  debug_status_known = false;
   wait_status = status;
   if (ptrace_event() == PTRACE_EVENT_EXIT) {
     seen_ptrace_exit_event = true;
   }
   ticks += hpc.read_ticks();
+  if (session().is_recording()) {
+    record_session().scheduler().on_status_changed(this);
+  }
 }
 
 bool Task::try_wait() {
@@ -1366,6 +1672,7 @@ static void set_up_process(void) {
   if (0 > prctl(PR_SET_PDEATHSIG, SIGKILL)) {
     FATAL() << "Couldn't set parent-death signal";
   }
+  restore_fd_limit();
 }
 
 int Task::pending_sig_from_status(int status) const {
@@ -1412,6 +1719,7 @@ Task* Task::clone(int flags, remote_ptr<void> stack, remote_ptr<void> tls,
 
   t->syscallbuf_lib_start = syscallbuf_lib_start;
   t->syscallbuf_lib_end = syscallbuf_lib_end;
+  t->syscallbuf_size_hint = syscallbuf_size_hint;
   t->blocked_sigs = blocked_sigs;
   if (CLONE_SHARE_SIGHANDLERS & flags) {
     t->sighandlers = sighandlers;
@@ -1523,45 +1831,51 @@ static void copy_tls(Task* from, AutoRemoteSyscalls& remote) {
 }
 
 void Task::copy_state(Task* from) {
-  long err;
   set_regs(from->regs());
   {
     AutoRemoteSyscalls remote(this);
     {
+      // These syscalls are independent, so make them in one batch
+      // to save ptrace round trips for each cloned task.
+      RemoteSyscallBatch batch;
       char prname[16];
       strncpy(prname, from->name().c_str(), sizeof(prname));
       AutoRestoreMem remote_prname(remote, (const uint8_t*)prname,
                                    sizeof(prname));
       LOG(debug) << "    setting name to " << prname;
-      err = remote.syscall(syscall_number_for_prctl(arch()), PR_SET_NAME,
-                           remote_prname.get().as_int());
-      ASSERT(this, 0 == err);
-      update_prname(remote_prname.get());
-    }
+      size_t set_name = batch.add(syscall_number_for_prctl(arch()),
+                                  { PR_SET_NAME, remote_prname.get() });
+
+      ssize_t set_robust = -1;
+      if (!from->robust_list().is_null()) {
+        set_robust_list(from->robust_list(), from->robust_list_len());
+        LOG(debug) << "    setting robust-list " << this->robust_list()
+                   << " (size " << this->robust_list_len() << ")";
+        set_robust = batch.add(syscall_number_for_set_robust_list(arch()),
+                               { this->robust_list(), this->robust_list_len() });
+      }
 
-    if (!from->robust_list().is_null()) {
-      set_robust_list(from->robust_list(), from->robust_list_len());
-      LOG(debug) << "    setting robust-list " << this->robust_list()
-                 << " (size " << this->robust_list_len() << ")";
-      err = remote.syscall(syscall_number_for_set_robust_list(arch()),
-                           this->robust_list(), this->robust_list_len());
-      ASSERT(this, 0 == err);
+      auto ctid = from->tid_addr();
+      ssize_t set_tid = -1;
+      if (!ctid.is_null()) {
+        set_tid =
+            batch.add(syscall_number_for_set_tid_address(arch()), { ctid });
+      }
+
+      remote.syscall_batch(batch);
+      ASSERT(this, 0 == batch.result(set_name));
+      update_prname(remote_prname.get());
+      ASSERT(this, set_robust < 0 || 0 == batch.result(set_robust));
+      ASSERT(this, set_tid < 0 || tid == batch.result(set_tid));
     }
 
     copy_tls(from, remote);
 
-    auto ctid = from->tid_addr();
-    if (!ctid.is_null()) {
-      err = remote.syscall(syscall_number_for_set_tid_address(arch()), ctid);
-      ASSERT(this, tid == err);
-    }
-
     if (!from->syscallbuf_child.is_null()) {
       // All these fields are preserved by the fork.
       traced_syscall_ip = from->traced_syscall_ip;
       untraced_syscall_ip = from->untraced_syscall_ip;
       syscallbuf_child = from->syscallbuf_child;
-      num_syscallbuf_bytes = from->num_syscallbuf_bytes;
       desched_fd_child = from->desched_fd_child;
 
       // The syscallbuf is mapped as a shared
@@ -1572,7 +1886,8 @@ void Task::copy_state(Task* from) {
       destroy_buffers(DESTROY_SYSCALLBUF);
       destroy_local_buffers();
 
-      syscallbuf_child = init_syscall_buffer(remote, map_hint);
+      syscallbuf_child =
+          init_syscall_buffer(remote, map_hint, from->num_syscallbuf_bytes);
       ASSERT(this, from->syscallbuf_child == syscallbuf_child);
       // Ensure the copied syscallbuf has the same contents
       // as the old one, for consistency checking.
@@ -1599,16 +1914,308 @@ void Task::copy_state(Task* from) {
   tid_futex = from->tid_futex;
 }
 
+static bool is_kernel_mapping(const MappableResource& r) {
+  return r.fsname == "[vvar]" || r.fsname == "[vsyscall]";
+}
+
+bool Task::save_snapshot(TraceStream::ProcessSnapshot* snapshot) {
+  typedef TraceStream::ProcessSnapshot ProcessSnapshot;
+  snapshot->tid = rec_tid;
+  snapshot->exe_image = vm()->exe_image();
+  snapshot->name = name();
+  snapshot->regs = regs();
+  snapshot->extra_regs = extra_regs();
+  snapshot->ticks = tick_count();
+  snapshot->brk = vm()->current_brk();
+  snapshot->scratch_ptr = scratch_ptr;
+  snapshot->scratch_size = scratch_size;
+  snapshot->syscallbuf_child = syscallbuf_child;
+  snapshot->num_syscallbuf_bytes = num_syscallbuf_bytes;
+  snapshot->traced_syscall_ip = traced_syscall_ip;
+  snapshot->untraced_syscall_ip = untraced_syscall_ip;
+  snapshot->syscallbuf_lib_start = syscallbuf_lib_start;
+  snapshot->syscallbuf_lib_end = syscallbuf_lib_end;
+  snapshot->robust_list = robust_list();
+  snapshot->robust_list_len = robust_list_len();
+  snapshot->tid_addr = tid_addr();
+  snapshot->regions.clear();
+
+  remote_ptr<void> vdso_start = vm()->vdso().start;
+  for (auto& kv : vm()->memmap()) {
+    const Mapping& m = kv.first;
+    const MappableResource& r = kv.second;
+    if (is_kernel_mapping(r)) {
+      continue;
+    }
+    ProcessSnapshot::Region region;
+    region.start = m.start.as_int();
+    region.end = m.end.as_int();
+    region.prot = m.prot;
+    region.flags = m.flags;
+    if (m.start == vdso_start) {
+      region.kind = ProcessSnapshot::REGION_VDSO;
+    } else if (r.is_scratch()) {
+      region.kind = ProcessSnapshot::REGION_SCRATCH;
+    } else if (m.start == syscallbuf_child) {
+      region.kind = ProcessSnapshot::REGION_SYSCALLBUF;
+    } else if (m.flags & MAP_SHARED) {
+      LOG(debug) << "Can't snapshot shared mapping " << m;
+      return false;
+    } else {
+      region.kind = ProcessSnapshot::REGION_MEMORY;
+    }
+    if (region.kind != ProcessSnapshot::REGION_SCRATCH) {
+      region.data.resize(m.num_bytes());
+      if (read_bytes_fallible(m.start, m.num_bytes(), region.data.data()) !=
+          (ssize_t)m.num_bytes()) {
+        // Inaccessible (PROT_NONE) memory; restored as zeroes.
+        region.data.clear();
+      }
+    }
+    snapshot->regions.push_back(move(region));
+  }
+  return true;
+}
+
+/**
+ * Replace [m.start, m.end) with a private anonymous mapping described by
+ * |region|.
+ */
+static void map_snapshot_region(
+    Task* t, AutoRemoteSyscalls& remote,
+    const TraceStream::ProcessSnapshot::Region& region) {
+  remote_ptr<void> start = region.start;
+  size_t size = region.end - region.start;
+  bool is_scratch =
+      region.kind == TraceStream::ProcessSnapshot::REGION_SCRATCH;
+  // Scratch memory is PROT_NONE during replay; see init_scratch_memory().
+  int prot = is_scratch ? PROT_NONE : region.prot;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+  remote_ptr<void> addr = remote.syscall(
+      has_mmap2_syscall(t->arch()) ? syscall_number_for_mmap2(t->arch())
+                                   : syscall_number_for_mmap(t->arch()),
+      start, size, prot, flags, -1, 0);
+  ASSERT(t, addr == start) << "Failed to map snapshot region at " << start
+                           << "; got " << addr;
+  t->vm()->map(start, size, prot, flags, 0,
+               is_scratch ? MappableResource::scratch(t->rec_tid)
+                          : MappableResource::anonymous());
+}
+
+void Task::restore_snapshot(const TraceStream::ProcessSnapshot& snapshot) {
+  typedef TraceStream::ProcessSnapshot ProcessSnapshot;
+  remote_ptr<void> ip_page = ip().as_int() & ~(page_size() - 1);
+  remote_ptr<void> vdso_start = vm()->vdso().start;
+  const ProcessSnapshot::Region* ip_region = nullptr;
+  const ProcessSnapshot::Region* syscallbuf_region = nullptr;
+  {
+    AutoRemoteSyscalls remote(this);
+    if (!snapshot.brk.is_null()) {
+      // Move the kernel's program break first, while the heap range is
+      // still free; the heap's contents are mapped over it below.
+      remote.syscall(syscall_number_for_brk(arch()), snapshot.brk);
+      vm()->brk(snapshot.brk);
+    }
+
+    // Unmap everything but the kernel's own mappings and the page our
+    // remote syscalls are executing from.
+    vector<Mapping> old_maps;
+    for (auto& kv : vm()->memmap()) {
+      if (!is_kernel_mapping(kv.second) && kv.first.start != vdso_start) {
+        old_maps.push_back(kv.first);
+      }
+    }
+    int munmap_no = syscall_number_for_munmap(arch());
+    for (auto& m : old_maps) {
+      if (m.start <= ip_page && ip_page < m.end) {
+        remote_ptr<void> after = ip_page + page_size();
+        if (m.start < ip_page) {
+          remote.syscall(munmap_no, m.start, ip_page - m.start);
+          vm()->unmap(m.start, ip_page - m.start);
+        }
+        if (after < m.end) {
+          remote.syscall(munmap_no, after, m.end - after);
+          vm()->unmap(after, m.end - after);
+        }
+      } else {
+        remote.syscall(munmap_no, m.start, m.num_bytes());
+        vm()->unmap(m.start, m.num_bytes());
+      }
+    }
+
+    for (auto& region : snapshot.regions) {
+      if (region.kind == ProcessSnapshot::REGION_VDSO) {
+        continue;
+      }
+      if (region.kind == ProcessSnapshot::REGION_SYSCALLBUF) {
+        syscallbuf_region = &region;
+        continue;
+      }
+      if (region.start <= ip_page.as_int() && ip_page.as_int() < region.end) {
+        ip_region = &region;
+        continue;
+      }
+      map_snapshot_region(this, remote, region);
+    }
+    // Replacing the page holding the syscall instruction has to come last.
+    ASSERT(this, ip_region) << "No snapshot region covers " << ip_page;
+    map_snapshot_region(this, remote, *ip_region);
+  }
+
+  traced_syscall_ip = snapshot.traced_syscall_ip.cast<uint8_t>();
+  untraced_syscall_ip = snapshot.untraced_syscall_ip.cast<uint8_t>();
+  syscallbuf_lib_start = snapshot.syscallbuf_lib_start;
+  syscallbuf_lib_end = snapshot.syscallbuf_lib_end;
+  scratch_ptr = snapshot.scratch_ptr;
+  scratch_size = snapshot.scratch_size;
+  {
+    AutoRemoteSyscalls remote(this);
+    if (syscallbuf_region) {
+      desched_fd_child = REPLAY_DESCHED_EVENT_FD;
+      syscallbuf_child = init_syscall_buffer(remote, snapshot.syscallbuf_child,
+                                             snapshot.num_syscallbuf_bytes);
+      ASSERT(this, syscallbuf_child == snapshot.syscallbuf_child);
+      memcpy(syscallbuf_hdr, syscallbuf_region->data.data(),
+             min<size_t>(num_syscallbuf_bytes, syscallbuf_region->data.size()));
+    }
+
+    RemoteSyscallBatch batch;
+    char prname[16];
+    strncpy(prname, snapshot.name.c_str(), sizeof(prname));
+    AutoRestoreMem remote_prname(remote, (const uint8_t*)prname,
+                                 sizeof(prname));
+    batch.add(syscall_number_for_prctl(arch()),
+              { PR_SET_NAME, remote_prname.get() });
+    set_robust_list(snapshot.robust_list, snapshot.robust_list_len);
+    if (!snapshot.robust_list.is_null()) {
+      batch.add(syscall_number_for_set_robust_list(arch()),
+                { snapshot.robust_list, snapshot.robust_list_len });
+    }
+    if (!snapshot.tid_addr.is_null()) {
+      batch.add(syscall_number_for_set_tid_address(arch()),
+                { snapshot.tid_addr });
+    }
+    remote.syscall_batch(batch);
+    update_prname(remote_prname.get());
+    tid_futex = snapshot.tid_addr;
+  }
+
+  // The remote syscalls clobbered the page they ran from, so the
+  // memory contents go in last.
+  for (auto& region : snapshot.regions) {
+    if ((region.kind == ProcessSnapshot::REGION_MEMORY ||
+         region.kind == ProcessSnapshot::REGION_VDSO) &&
+        !region.data.empty()) {
+      write_bytes_helper(region.start, region.data.size(), region.data.data());
+    }
+  }
+
+  set_regs(snapshot.regs);
+  if (!snapshot.extra_regs.empty()) {
+    set_extra_regs(snapshot.extra_regs);
+  }
+  ticks = snapshot.ticks;
+}
+
+void Task::exec_unrecorded(const string& exe) {
+  while (true) {
+    cont_nonblocking();
+    wait(DONT_ALLOW_INTERRUPT);
+    if (PTRACE_EVENT_EXEC == ptrace_event()) {
+      break;
+    }
+    ASSERT(this, !pending_sig()) << "Unexpected " << signalname(pending_sig())
+                                 << " before exec";
+  }
+  // Run to the exit of the execve.
+  cont_syscall();
+  execve_file = exe;
+  session().after_exec();
+  post_exec();
+}
+
 void Task::destroy_local_buffers() {
   desched_fd.close();
   munmap(syscallbuf_hdr, num_syscallbuf_bytes);
+  if (local_scratch) {
+    munmap(local_scratch, scratch_size);
+    local_scratch = nullptr;
+  }
 }
 
+/**
+ * Reaps tasks killed during replay on a background thread. Nothing else
+ * waits for them, so otherwise they'd stay zombies for as long as rr
+ * runs, and sessions with many threads, like checkpoints, leave many.
+ * Threads of rr can wait for tasks traced by any of its threads.
+ */
+class Reaper {
+public:
+  static Reaper& get() {
+    // Never destroyed: the thread runs until rr exits.
+    static Reaper* reaper = new Reaper();
+    return *reaper;
+  }
+
+  void reap(pid_t tid) {
+    pthread_mutex_lock(&mutex);
+    tids.push_back(tid);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+private:
+  Reaper() {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cond, nullptr);
+    pthread_t thread;
+    pthread_create(&thread, nullptr, thread_callback, this);
+    pthread_detach(thread);
+  }
+
+  static void* thread_callback(void* p) {
+    static_cast<Reaper*>(p)->reap_tasks();
+    return nullptr;
+  }
+  void reap_tasks() {
+    while (true) {
+      pthread_mutex_lock(&mutex);
+      while (tids.empty()) {
+        pthread_cond_wait(&cond, &mutex);
+      }
+      pid_t tid = tids.front();
+      tids.pop_front();
+      pthread_mutex_unlock(&mutex);
+
+      int status;
+      pid_t ret;
+      while ((ret = waitpid(tid, &status, __WALL)) < 0 && errno == EINTR) {
+      }
+      // A task stopped at its PTRACE_EVENT_EXIT can only be resumed by
+      // its tracer thread; leave it, as we would have without a reaper.
+      if (ret == tid && WIFSTOPPED(status)) {
+        LOG(debug) << "Can't reap " << tid << "; it's stopped";
+      }
+    }
+  }
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Protected by |mutex|.
+  deque<pid_t> tids;
+};
+
 void Task::detach_and_reap() {
   // child_mem_fd needs to be valid since we won't be able to open
   // it for futex_wait below after we've detached.
   ASSERT(this, as->mem_fd().is_open());
 
+  if (run_untraced) {
+    ASSERT(this, !fallible_ptrace(PTRACE_DETACH, nullptr, nullptr))
+        << "Failed to detach from " << tid;
+    return;
+  }
+
   if (unstable) {
     fallible_ptrace(PTRACE_DETACH, nullptr, nullptr);
     // In addition to problems described in the long
@@ -1617,7 +2224,12 @@ void Task::detach_and_reap() {
     // futex, for example for fatal signals.  So we would
     // deadlock waiting on the futex.
     LOG(warn) << tid << " is unstable; not blocking on its termination";
-    // This will probably leak a zombie process for rr's lifetime.
+    if (session().is_recording()) {
+      // The scheduler's waitpid(-1) may see it. Otherwise this will
+      // probably leak a zombie process for rr's lifetime.
+      return;
+    }
+    Reaper::get().reap(tid);
     return;
   }
 
@@ -1666,16 +2278,46 @@ void Task::detach_and_reap() {
 }
 
 long Task::fallible_ptrace(int request, remote_ptr<void> addr, void* data) {
-  return ptrace(__ptrace_request(request), tid, addr, data);
+  return ptrace_from(request, addr, data, __builtin_return_address(0));
+}
+
+long Task::ptrace_from(int request, remote_ptr<void> addr, void* data,
+                       void* site) {
+  if (!PtraceProfiler::enabled()) {
+    return ptrace(__ptrace_request(request), tid, addr, data);
+  }
+  uint64_t start = PtraceProfiler::now_ns();
+  long ret = ptrace(__ptrace_request(request), tid, addr, data);
+  int err = errno;
+  uint64_t end = PtraceProfiler::now_ns();
+  if (session().is_replaying()) {
+    PtraceProfiler::get().ptrace_call(request, tid, start, end, site,
+                                      Event(current_trace_frame().event()));
+  } else {
+    PtraceProfiler::get().ptrace_call(request, tid, start, end, site, ev());
+  }
+  errno = err;
+  return ret;
 }
 
 void Task::open_mem_fd() {
   // Use ptrace to read/write during open_mem_fd
   as->set_mem_fd(ScopedFd());
 
-  // We could try opening /proc/<pid>/mem directly first and
-  // only do this dance if that fails. But it's simpler to
-  // always take this path, and gives better test coverage.
+  // As our tracer we're allowed to open /proc/<tid>/mem ourselves, which
+  // is a single syscall. This runs for every new process (after fork and
+  // exec), so only fall back to having the tracee open it and pass us
+  // the fd, which takes several remote syscalls, if that fails.
+  char direct_path[PATH_MAX];
+  snprintf(direct_path, sizeof(direct_path), "/proc/%d/mem", tid);
+  ScopedFd fd(direct_path, O_RDWR | O_CLOEXEC);
+  if (fd.is_open()) {
+    as->set_mem_fd(move(fd));
+    return;
+  }
+  LOG(debug) << "Couldn't open " << direct_path << " directly: "
+             << strerror(errno);
+
   static const char path[] = "/proc/self/mem";
 
   AutoRemoteSyscalls remote(this);
@@ -1701,11 +2343,74 @@ void Task::open_mem_fd_if_needed() {
 }
 
 remote_ptr<void> Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
-                                           remote_ptr<void> map_hint) {
+                                           remote_ptr<void> map_hint,
+                                           size_t num_bytes) {
+  void* map_addr;
+  ASSERT(this, SYSCALLBUF_MIN_BUFFER_SIZE <= num_bytes &&
+                   num_bytes <= SYSCALLBUF_MAX_BUFFER_SIZE)
+      << "Bad syscallbuf size " << num_bytes;
+  num_syscallbuf_bytes = num_bytes;
+  remote_ptr<void> child_map_addr = map_shared_segment(
+      remote, SYSCALLBUF_SHMEM_NAME_PREFIX, num_syscallbuf_bytes,
+      PROT_READ | PROT_WRITE, map_hint, nullptr, &map_addr);
+  syscallbuf_child = child_map_addr;
+  syscallbuf_hdr = (struct syscallbuf_hdr*)map_addr;
+  // No entries to begin with.
+  memset(syscallbuf_hdr, 0, sizeof(*syscallbuf_hdr));
+  return child_map_addr;
+}
+
+void Task::init_scratch(AutoRemoteSyscalls& remote, size_t num_bytes,
+                        int prot) {
+  if (local_scratch) {
+    // Left over from before an exec.
+    munmap(local_scratch, scratch_size);
+  }
+  MappableResource res = MappableResource::scratch(rec_tid);
+  scratch_ptr = map_shared_segment(remote, SCRATCH_SHMEM_NAME_PREFIX,
+                                   num_bytes, prot, nullptr, &res,
+                                   &local_scratch);
+  scratch_size = num_bytes;
+}
+
+void Task::release_scratch(size_t keep_bytes) {
+  if (!local_scratch || keep_bytes >= scratch_size) {
+    return;
+  }
+  // Removing the pages through our mapping frees them for the tracee's
+  // mapping of the segment too.
+  if (madvise(static_cast<uint8_t*>(local_scratch) + keep_bytes,
+              scratch_size - keep_bytes, MADV_REMOVE)) {
+    LOG(debug) << "Couldn't release scratch memory: " << strerror(errno);
+  }
+}
+
+uint8_t* Task::local_scratch_addr(remote_ptr<void> addr, size_t num_bytes) {
+  if (!local_scratch || addr < scratch_ptr ||
+      addr + num_bytes > scratch_ptr + scratch_size) {
+    return nullptr;
+  }
+  // The tracee might have unmapped or replaced its scratch (or exec()d),
+  // leaving ours disconnected from it.
+  auto it = vm()->memmap().find(Mapping(addr, num_bytes));
+  if (it == vm()->memmap().end() || !(it->first.flags & MAP_SHARED) ||
+      it->second != MappableResource::scratch(rec_tid) ||
+      !it->first.has_subset(Mapping(addr, num_bytes))) {
+    return nullptr;
+  }
+  return static_cast<uint8_t*>(local_scratch) + (addr - scratch_ptr);
+}
+
+remote_ptr<void> Task::map_shared_segment(AutoRemoteSyscalls& remote,
+                                          const char* name_prefix,
+                                          size_t num_bytes, int prot,
+                                          remote_ptr<void> map_hint,
+                                          const MappableResource* res,
+                                          void** local) {
   // Create the segment we'll share with the tracee.
   char shmem_name[PATH_MAX];
-  format_syscallbuf_shmem_path(tid, shmem_name);
-  ScopedFd shmem_fd = create_shmem_segment(shmem_name, SYSCALLBUF_BUFFER_SIZE);
+  format_shmem_path(name_prefix, tid, shmem_name);
+  ScopedFd shmem_fd = create_shmem_segment(shmem_name, num_bytes);
   // Map the shmem fd in the child.
   int child_shmem_fd;
   {
@@ -1722,30 +2427,22 @@ remote_ptr<void> Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
   }
 
   // Map the segment in ours and the tracee's address spaces.
-  void* map_addr;
-  num_syscallbuf_bytes = SYSCALLBUF_BUFFER_SIZE;
-  int prot = PROT_READ | PROT_WRITE;
   int flags = MAP_SHARED;
   // NB: we don't need to adjust this in the remote syscall below because
   // 0 == (0 >> PAGE_SIZE).
   off64_t offset_pages = 0;
-  if ((void*)-1 == (map_addr = mmap(nullptr, num_syscallbuf_bytes, prot, flags,
-                                    shmem_fd, offset_pages))) {
+  if ((void*)-1 == (*local = mmap(nullptr, num_bytes, PROT_READ | PROT_WRITE,
+                                  flags, shmem_fd, offset_pages))) {
     FATAL() << "Failed to mmap shmem region";
   }
   remote_ptr<void> child_map_addr = remote.syscall(
       has_mmap2_syscall(remote.arch()) ? syscall_number_for_mmap2(remote.arch())
                                        : syscall_number_for_mmap(remote.arch()),
-      map_hint, num_syscallbuf_bytes, prot, flags, child_shmem_fd,
-      offset_pages);
-  syscallbuf_child = child_map_addr;
-  syscallbuf_hdr = (struct syscallbuf_hdr*)map_addr;
-  // No entries to begin with.
-  memset(syscallbuf_hdr, 0, sizeof(*syscallbuf_hdr));
+      map_hint, num_bytes, prot, flags, child_shmem_fd, offset_pages);
 
-  vm()->map(child_map_addr, num_syscallbuf_bytes, prot, flags,
-            page_size() * offset_pages,
-            MappableResource::syscallbuf(rec_tid, shmem_fd, shmem_name));
+  vm()->map(child_map_addr, num_bytes, prot, flags, page_size() * offset_pages,
+            res ? *res
+                : MappableResource::syscallbuf(rec_tid, shmem_fd, shmem_name));
 
   shmem_fd.close();
   remote.syscall(syscall_number_for_close(arch()), child_shmem_fd);
@@ -1784,13 +2481,14 @@ void Task::maybe_flush_syscallbuf() {
   }
   // Write the entire buffer in one shot without parsing it,
   // because replay will take care of that.
+  size_t flushed_bytes =
+      syscallbuf_hdr->num_rec_bytes + sizeof(*syscallbuf_hdr);
   push_event(Event(EV_SYSCALLBUF_FLUSH, NO_EXEC_INFO, arch()));
-  record_local(syscallbuf_child,
-               // Record the header for consistency checking.
-               syscallbuf_hdr->num_rec_bytes + sizeof(*syscallbuf_hdr),
-               syscallbuf_hdr);
+  // Record the header for consistency checking.
+  record_local(syscallbuf_child, flushed_bytes, syscallbuf_hdr);
   record_current_event();
   pop_event(EV_SYSCALLBUF_FLUSH);
+  update_syscallbuf_size_hint(flushed_bytes);
 
   // Reset header.
   assert(!syscallbuf_hdr->abort_commit);
@@ -1800,6 +2498,23 @@ void Task::maybe_flush_syscallbuf() {
   flushed_syscallbuf = true;
 }
 
+void Task::update_syscallbuf_size_hint(size_t flushed_bytes) {
+  if (flushed_bytes > num_syscallbuf_bytes / 4 * 3) {
+    // This flush was probably forced by the buffer filling up.
+    syscallbuf_size_hint =
+        min<size_t>(SYSCALLBUF_MAX_BUFFER_SIZE, 2 * num_syscallbuf_bytes);
+    small_syscallbuf_flushes = 0;
+  } else if (flushed_bytes < num_syscallbuf_bytes / 16) {
+    if (++small_syscallbuf_flushes >= SMALL_SYSCALLBUF_FLUSHES_BEFORE_SHRINK) {
+      syscallbuf_size_hint =
+          max<size_t>(SYSCALLBUF_MIN_BUFFER_SIZE, num_syscallbuf_bytes / 2);
+      small_syscallbuf_flushes = 0;
+    }
+  } else {
+    small_syscallbuf_flushes = 0;
+  }
+}
+
 ssize_t Task::read_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
                                 void* buf) {
   ssize_t nread = 0;
@@ -1859,6 +2574,30 @@ ssize_t Task::write_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
   return nwritten;
 }
 
+// Bumped whenever tracee memory may have changed, invalidating the
+// read cache. Starts above CachedPage's initial generation.
+static uint64_t memory_generation = 1;
+
+// Pages recently read by small reads; see |invalidate_read_caches()|.
+// An entry is valid while its |generation| is current.  Nothing runs
+// between invalidations, so one cache serves all tasks, rather than
+// each of thousands of threads keeping pages of its own.
+struct CachedPage {
+  CachedPage() : vm(nullptr), generation(0) {}
+  const AddressSpace* vm;
+  remote_ptr<void> addr;
+  uint64_t generation;
+  vector<uint8_t> data;
+};
+static const int READ_CACHE_PAGES = 4;
+static CachedPage read_cache[READ_CACHE_PAGES];
+static int read_cache_next;
+
+// Reads up to this size are served from the read cache.
+static const ssize_t MAX_CACHED_READ = 256;
+
+/*static*/ void Task::invalidate_read_caches() { ++memory_generation; }
+
 ssize_t Task::read_bytes_fallible(remote_ptr<void> addr, ssize_t buf_size,
                                   void* buf) {
   ASSERT(this, buf_size >= 0) << "Invalid buf_size " << buf_size;
@@ -1866,6 +2605,47 @@ ssize_t Task::read_bytes_fallible(remote_ptr<void> addr, ssize_t buf_size,
     return 0;
   }
 
+  if (uint8_t* local = local_scratch_addr(addr, buf_size)) {
+    memcpy(buf, local, buf_size);
+    return buf_size;
+  }
+
+  remote_ptr<void> page = addr.as_int() & ~(page_size() - 1);
+  if (buf_size <= MAX_CACHED_READ && addr + buf_size <= page + page_size()) {
+    CachedPage* cached = nullptr;
+    for (auto& entry : read_cache) {
+      if (entry.generation == memory_generation && entry.vm == as.get() &&
+          entry.addr == page) {
+        cached = &entry;
+        break;
+      }
+    }
+    if (!cached) {
+      // rr itself writes shared mappings (the syscallbuf, emulated
+      // files) without going through us, so only cache private ones.
+      auto it = vm()->memmap().find(Mapping(page, page_size()));
+      if (it != vm()->memmap().end() && !(it->first.flags & MAP_SHARED)) {
+        CachedPage& entry = read_cache[read_cache_next];
+        read_cache_next = (read_cache_next + 1) % READ_CACHE_PAGES;
+        entry.data.resize(page_size());
+        // Too big to be cached itself.
+        if (read_bytes_fallible(page, page_size(), entry.data.data()) ==
+            (ssize_t)page_size()) {
+          entry.vm = as.get();
+          entry.addr = page;
+          entry.generation = memory_generation;
+          cached = &entry;
+        } else {
+          entry.generation = 0;
+        }
+      }
+    }
+    if (cached) {
+      memcpy(buf, cached->data.data() + (addr - page), buf_size);
+      return buf_size;
+    }
+  }
+
   if (!as->mem_fd().is_open()) {
     return read_bytes_ptrace(addr, buf_size, buf);
   }
@@ -1900,6 +2680,12 @@ void Task::write_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
   if (0 == buf_size) {
     return;
   }
+  invalidate_read_caches();
+  as->notify_written(addr, buf_size);
+  if (uint8_t* local = local_scratch_addr(addr, buf_size)) {
+    memcpy(local, buf, buf_size);
+    return;
+  }
 
   if (!as->mem_fd().is_open()) {
     write_bytes_ptrace(addr, buf_size, buf);
@@ -1918,6 +2704,121 @@ void Task::write_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
                                      << ", but only wrote " << nwritten;
 }
 
+/**
+ * Transfer |iovs| with process_vm_readv/writev, IOV_MAX ranges at a time.
+ * Return the number of leading ranges that were transferred completely;
+ * the kernel stops at the first range it can't access, and refuses to
+ * write to read-only memory.
+ */
+static size_t transfer_bytes_v(pid_t tid, const Task::RemoteIovec* iovs,
+                               size_t num_iovs, bool write) {
+  // Cleared when the kernel lacks process_vm_readv/writev, or forbids it.
+  static bool process_vm_works = true;
+  size_t done = 0;
+  while (process_vm_works && done < num_iovs) {
+    size_t count = min<size_t>(IOV_MAX, num_iovs - done);
+    struct iovec local[count];
+    struct iovec remote[count];
+    ssize_t expected = 0;
+    for (size_t i = 0; i < count; ++i) {
+      const Task::RemoteIovec& iov = iovs[done + i];
+      local[i].iov_base = iov.local;
+      local[i].iov_len = iov.size;
+      remote[i].iov_base = (void*)iov.addr.as_int();
+      remote[i].iov_len = iov.size;
+      expected += iov.size;
+    }
+    ssize_t nbytes = write ? process_vm_writev(tid, local, count, remote,
+                                               count, 0)
+                           : process_vm_readv(tid, local, count, remote,
+                                              count, 0);
+    if (nbytes < 0 && (ENOSYS == errno || EPERM == errno)) {
+      process_vm_works = false;
+    }
+    if (nbytes == expected) {
+      done += count;
+      continue;
+    }
+    while (nbytes > 0 && (ssize_t)iovs[done].size <= nbytes) {
+      nbytes -= iovs[done].size;
+      ++done;
+    }
+    break;
+  }
+  return done;
+}
+
+/**
+ * Return |iovs| without the null and empty ranges, and without the ranges
+ * in |t|'s shared scratch, which are copied right here.
+ */
+static vector<Task::RemoteIovec> remote_iovs(
+    Task* t, const vector<Task::RemoteIovec>& iovs, bool write) {
+  vector<Task::RemoteIovec> result;
+  for (auto& iov : iovs) {
+    if (iov.addr.is_null() || iov.size == 0) {
+      continue;
+    }
+    if (uint8_t* local = t->local_scratch_addr(iov.addr, iov.size)) {
+      if (write) {
+        memcpy(local, iov.local, iov.size);
+      } else {
+        memcpy(iov.local, local, iov.size);
+      }
+      continue;
+    }
+    result.push_back(iov);
+  }
+  return result;
+}
+
+void Task::read_bytes_v(const vector<RemoteIovec>& iovs) {
+  vector<RemoteIovec> ranges = remote_iovs(this, iovs, false);
+  // Fall back to the mem fd for whatever process_vm_readv didn't read.
+  for (size_t i = transfer_bytes_v(tid, ranges.data(), ranges.size(), false);
+       i < ranges.size(); ++i) {
+    read_bytes_helper(ranges[i].addr, ranges[i].size, ranges[i].local);
+  }
+}
+
+void Task::read_bytes_fallible_v(const vector<RemoteIovec>& iovs,
+                                 vector<ssize_t>* nread) {
+  nread->assign(iovs.size(), 0);
+  size_t i = 0;
+  while (i < iovs.size()) {
+    size_t done = transfer_bytes_v(tid, iovs.data() + i, iovs.size() - i,
+                                   false);
+    for (size_t j = i; j < i + done; ++j) {
+      (*nread)[j] = iovs[j].size;
+    }
+    i += done;
+    if (i < iovs.size()) {
+      // Find out exactly how much of the range the kernel stopped at is
+      // readable, then carry on after it.
+      const RemoteIovec& iov = iovs[i];
+      if (!iov.addr.is_null()) {
+        (*nread)[i] = max<ssize_t>(
+            0, read_bytes_fallible(iov.addr, iov.size, iov.local));
+      }
+      ++i;
+    }
+  }
+}
+
+void Task::write_bytes_v(const vector<RemoteIovec>& iovs) {
+  invalidate_read_caches();
+  vector<RemoteIovec> ranges = remote_iovs(this, iovs, true);
+  for (auto& r : ranges) {
+    as->notify_written(r.addr, r.size);
+  }
+  // The mem fd can write read-only memory, which process_vm_writev
+  // can't.
+  for (size_t i = transfer_bytes_v(tid, ranges.data(), ranges.size(), true);
+       i < ranges.size(); ++i) {
+    write_bytes_helper(ranges[i].addr, ranges[i].size, ranges[i].local);
+  }
+}
+
 const TraceStream* Task::trace_stream() const {
   if (session().as_record()) {
     return &record_session().trace_writer();
@@ -1930,7 +2831,7 @@ const TraceStream* Task::trace_stream() const {
 
 void Task::xptrace(int request, remote_ptr<void> addr, void* data) {
   errno = 0;
-  fallible_ptrace(request, addr, data);
+  ptrace_from(request, addr, data, __builtin_return_address(0));
   ASSERT(this, !errno) << "ptrace(" << ptrace_req_name(request) << ", " << tid
                        << ", addr=" << addr << ", data=" << data
                        << ") failed with errno " << errno;
@@ -1938,7 +2839,7 @@ void Task::xptrace(int request, remote_ptr<void> addr, void* data) {
 
 bool Task::ptrace_if_alive(int request, remote_ptr<void> addr, void* data) {
   errno = 0;
-  fallible_ptrace(request, addr, data);
+  ptrace_from(request, addr, data, __builtin_return_address(0));
   if (errno == ESRCH) {
     return false;
   }
@@ -2017,13 +2918,18 @@ static void perform_remote_clone(Task* parent, AutoRemoteSyscalls& remote,
                              pid_t rec_tid) {
   assert(session.tasks().size() == 0);
 
-  if (trace.bound_to_cpu() >= 0) {
-    // Set CPU affinity now, after we've created any helper threads
-    // (so they aren't affected), but before we create any
-    // tracees (so they are all affected).
-    // Note that we're binding rr itself to the same CPU as the
-    // tracees, since this seems to help performance.
-    set_cpu_affinity(trace.bound_to_cpu());
+  CpuPlacement placement;
+  int cpu = trace.bound_to_cpu();
+  if (cpu >= 0 && session.is_replaying() && Flags::get().replay_cpu >= 0) {
+    cpu = Flags::get().replay_cpu;
+  }
+  if (cpu >= 0) {
+    // Set CPU affinity now, before we create any tracees (so they are
+    // all affected). Once the first tracee is forked, rr moves next to
+    // it and its helper threads elsewhere on the node; see
+    // CpuPlacement.
+    placement = choose_cpu_placement(cpu);
+    set_cpu_affinity(cpu);
   }
 
   pid_t tid = fork();
@@ -2061,6 +2967,10 @@ static void perform_remote_clone(Task* parent, AutoRemoteSyscalls& remote,
     FATAL() << "Failed to exec '" << trace.initial_exe().c_str() << "'";
   }
 
+  if (placement.tracee_cpu >= 0) {
+    apply_cpu_placement(placement);
+  }
+
   struct sigaction sa;
   sa.sa_handler = handle_alarm_signal;
   sigemptyset(&sa.sa_mask);
@@ -2119,6 +3029,98 @@ static void perform_remote_clone(Task* parent, AutoRemoteSyscalls& remote,
   return t;
 }
 
+/*static*/ Task* Task::attach(Session& session, const TraceStream& trace,
+                              pid_t tid) {
+  assert(session.tasks().size() == 0);
+
+  if (trace.bound_to_cpu() >= 0) {
+    apply_cpu_placement(choose_cpu_placement(trace.bound_to_cpu()));
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(trace.bound_to_cpu(), &mask);
+    if (0 > sched_setaffinity(tid, sizeof(mask), &mask)) {
+      FATAL() << "Couldn't bind " << tid << " to CPU " << trace.bound_to_cpu();
+    }
+  }
+
+  Task* t = new Task(session, tid, tid, 0);
+  // Once it traps rdtsc and uses our scratch memory, the process can't
+  // go on without rr, so it's killed along with rr like a spawned one.
+  intptr_t options =
+      PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+      PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_TRACEVFORKDONE |
+      PTRACE_O_TRACEEXIT | PTRACE_O_TRACESECCOMP | PTRACE_O_EXITKILL;
+  if (t->fallible_ptrace(PTRACE_SEIZE, nullptr, (void*)options)) {
+    FATAL() << "Unable to attach to " << tid;
+  }
+  t->xptrace(PTRACE_INTERRUPT, nullptr, nullptr);
+  while (true) {
+    t->wait(DONT_ALLOW_INTERRUPT);
+    if (PTRACE_EVENT_STOP == t->ptrace_event()) {
+      break;
+    }
+    // Let signals that were already on their way through.
+    t->cont_nonblocking(t->pending_sig());
+  }
+  t->wait_status = 0;
+  t->open_mem_fd();
+  ASSERT(t, t->arch() == x86_64) << "Can only attach to x86-64 processes";
+
+  // Recording starts here, with the tracee in a state replay can put a
+  // freshly exec()d process into.  A syscall we interrupted is restarted
+  // from scratch, rather than by the kernel (or with restart_syscall),
+  // so that recording and replay both see its entry.  (The x86-64
+  // syscall instruction is two bytes long.)
+  Registers r = t->regs();
+  if (r.original_syscallno() >= 0 && r.syscall_may_restart()) {
+    r.set_syscallno(r.original_syscallno());
+    r.set_ip(r.ip() - 2);
+  }
+  r.set_original_syscallno(-1);
+  t->set_regs(r);
+
+  session.after_exec();
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/exe", tid);
+  char exe[PATH_MAX];
+  ssize_t len = readlink(path, exe, sizeof(exe) - 1);
+  if (len < 0) {
+    FATAL() << "Unable to read the executable of " << tid;
+  }
+  exe[len] = 0;
+  auto g = create_tg(t);
+  t->tg.swap(g);
+  auto as = session.create_vm(t, exe);
+  t->as.swap(as);
+  t->prname = prname_from_exe_image(t->as->exe_image());
+
+  remote_ptr<void> robust_list;
+  size_t robust_list_len;
+  if (!syscall(SYS_get_robust_list, tid, &robust_list, &robust_list_len)) {
+    t->set_robust_list(robust_list, robust_list_len);
+  }
+
+  auto sh = Sighandlers::create();
+  t->sighandlers.swap(sh);
+  {
+    AutoRemoteSyscalls remote(t);
+    t->sighandlers->init_from_tracee(remote);
+    {
+      AutoRestoreMem mem(remote, nullptr, sizeof(t->blocked_sigs));
+      remote.syscall(syscall_number_for_rt_sigprocmask(t->arch()), SIG_BLOCK,
+                     nullptr, mem.get(), sizeof(t->blocked_sigs));
+      t->blocked_sigs = t->read_mem(mem.get().cast<sig_set_t>());
+    }
+    // The rest of set_up_process()'s setup that applies to a process
+    // that's already running.
+    long ret = remote.syscall(syscall_number_for_prctl(t->arch()), PR_SET_TSC,
+                              PR_TSC_SIGSEGV);
+    ASSERT(t, !ret) << "Unable to make " << tid << " trap rdtsc";
+    t->init_scratch(remote, 512 * page_size(), PROT_READ | PROT_WRITE);
+  }
+  return t;
+}
+
 const char* Task::syscallname(int syscall) const {
   return ::syscall_name(syscall, arch());
 }
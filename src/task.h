@@ -187,6 +187,14 @@ public:
    * assumption.
    */
   void finish_emulated_syscall();
+  /**
+   * Like |finish_emulated_syscall()|, but leave this at its sysemu stop
+   * until it's next resumed.  Resuming with PTRACE_SYSEMU leaves the stop
+   * just as stepping over the syscall insn would, so that's done without
+   * the step; any other resume steps over it first.  Replay uses this
+   * when this goes straight into another emulated syscall.
+   */
+  void defer_finish_emulated_syscall();
 
   /**
    * Shortcut to the single |pending_event->desched.rec| when
@@ -283,6 +291,12 @@ public:
    */
   Ticks tick_count() { return ticks; }
 
+  /**
+   * Return the number of fds rr holds open for this task alone: its
+   * perf counters and its copy of the desched fd.
+   */
+  size_t num_fds_held() { return hpc.num_fds() + desched_fd.is_open(); }
+
   /**
    * Set tick count to 'count'.
    */
@@ -301,8 +315,8 @@ public:
   bool exited() const { return WIFEXITED(wait_status); }
 
   /** Return the event at the top of this's stack. */
-  Event& ev() { return pending_events.back(); }
-  const Event& ev() const { return pending_events.back(); }
+  Event& ev() { return pending_events.top(); }
+  const Event& ev() const { return pending_events.top(); }
 
   /**
    * Stat |fd| in the context of this task's fd table, returning
@@ -362,9 +376,11 @@ public:
    * region; see |init_syscallbuf_buffer()|.
    *
    * Pass SHARE_DESCHED_EVENT_FD to additionally share that fd.
+   * The syscallbuf is |syscallbuf_size| bytes long.
    */
   remote_ptr<void> init_buffers(remote_ptr<void> map_hint,
-                                ShareDeschedEventFd share_desched_fd);
+                                ShareDeschedEventFd share_desched_fd,
+                                size_t syscallbuf_size);
 
   /**
    * Destroy in the tracee task the buffer(s) specified by the
@@ -477,6 +493,13 @@ public:
    */
   bool may_be_blocked() const;
 
+  /**
+   * Return true if a clone(CLONE_VM | CLONE_VFORK) child of this task
+   * is still borrowing our address space.  Until that child execs or
+   * exits, this task must not be scheduled.
+   */
+  bool is_waiting_for_vfork_child();
+
   /**
    * If |syscallno| at |state| changes our VM mapping, then
    * update the cache for that change.  The exception is mmap()
@@ -528,10 +551,10 @@ public:
    * helpers pop the event at top of the stack, which must be of
    * the specified type.
    */
-  void push_event(const Event& ev) { pending_events.push_back(ev); }
+  void push_event(const Event& ev) { pending_events.push(ev); }
   void pop_event(EventType expected_type) {
-    assert(pending_events.back().type() == expected_type);
-    pending_events.pop_back();
+    assert(pending_events.top().type() == expected_type);
+    pending_events.pop();
   }
   void pop_noop() { pop_event(EV_NOOP); }
   void pop_desched() { pop_event(EV_DESCHED); }
@@ -578,8 +601,25 @@ public:
     record_remote(addr, sizeof(T));
   }
 
+  /**
+   * Like calling |record_remote()| on each of |ranges| in order, but
+   * reading them from the tracee all at once and writing the small
+   * ones to the trace as one record.
+   */
+  void record_remote_v(const std::vector<MemoryRange>& ranges);
+
   void record_remote_str(remote_ptr<void> str);
 
+  /**
+   * Record the |num_bytes| at page-aligned |addr| as one record per page,
+   * so identical pages are stored once in the trace. If |skip_zero_pages|,
+   * pages that are all zeroes aren't recorded at all; replay must then
+   * start from zeroed memory.
+   */
+  enum PageRecording { RECORD_ALL_PAGES, SKIP_ZERO_PAGES };
+  void record_remote_pages(remote_ptr<void> addr, ssize_t num_bytes,
+                           PageRecording recording);
+
   /**
    * Attempt to find the value of |regname| (a DebuggerRegister
    * name) in this task, and if so (i) write it to |buf|; (ii)
@@ -600,11 +640,20 @@ public:
   /** Return the current regs of this. */
   const Registers& regs() const;
 
-  /** Return the extra registers of this. */
+  /**
+   * Return the extra registers of this. They're fetched on first use and
+   * cached until the task is resumed.
+   */
   const ExtraRegisters& extra_regs();
 
-  /** Return the current arch of this. This can change due to exec(). */
-  SupportedArch arch() const { return regs().arch(); }
+  /**
+   * Return the current arch of this. This could change due to exec(),
+   * but until Registers support more than one architecture it's always
+   * RR_NATIVE_ARCH. Returning that constant (instead of asking regs())
+   * lets the compiler resolve RR_ARCH_FUNCTION dispatch on it at compile
+   * time, calling and inlining the one Arch instantiation directly.
+   */
+  SupportedArch arch() const { return rr::RR_NATIVE_ARCH; }
 
   /**
    * Return the debug status, which is a bitfield comprising
@@ -669,6 +718,16 @@ public:
 
   /** Restore the next chunk of saved data from the trace to this. */
   ssize_t set_data_from_trace();
+  /**
+   * Restore the next |count| chunks of saved data, writing them into
+   * this all at once.
+   */
+  void set_data_from_trace_v(size_t count);
+  /**
+   * Restore all the remaining saved data for the current frame from the
+   * trace to this.
+   */
+  void apply_all_data_records_from_trace();
 
   /**
    * Set the syscall-return-value register of this to what was
@@ -679,7 +738,10 @@ public:
   /** Set the tracee's registers to |regs|. */
   void set_regs(const Registers& regs);
 
-  /** Set the tracee's extra registers to |regs|. */
+  /**
+   * Set the tracee's extra registers to |regs|. Does nothing if they're
+   * already known to be |regs|.
+   */
   void set_extra_regs(const ExtraRegisters& regs);
 
   /**
@@ -693,6 +755,16 @@ public:
    */
   bool set_debug_regs(const DebugRegs& regs);
 
+  /**
+   * Return true if |w| can be programmed into a single debug
+   * register: it has one of the lengths the hardware supports and
+   * is aligned to it.
+   */
+  static bool fits_debug_reg(const WatchConfig& w);
+
+  /** The number of watchpoints |set_debug_regs()| can program. */
+  static size_t num_debug_reg_watchpoints();
+
   /**
    * Update the futex robust list head pointer to |list| (which
    * is of size |len|).
@@ -821,6 +893,12 @@ public:
    * Call this before recording events or data.  Records
    * syscallbuf data and flushes the buffer, if there's buffered
    * data.
+   *
+   * Every event a task records flushes its buffer first, and rr only
+   * switches tasks after recording an event for the one that was
+   * running, so at most one task ever has unflushed records.  Replay
+   * runs each flush in its own task at the point of the trace it was
+   * recorded at, which keeps the flush frames per-task.
    */
   void maybe_flush_syscallbuf();
 
@@ -887,6 +965,58 @@ public:
   void write_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
                           const void* buf);
 
+  /**
+   * A range of tracee memory and the local buffer it's transferred
+   * to or from.
+   */
+  struct RemoteIovec {
+    RemoteIovec(remote_ptr<void> addr, size_t size, void* local)
+        : addr(addr), size(size), local(local) {}
+    remote_ptr<void> addr;
+    size_t size;
+    void* local;
+  };
+  /**
+   * Read/write all of |iovs| in as few syscalls as possible, using
+   * process_vm_readv/writev where the kernel allows it.  Like
+   * read_bytes_helper()/write_bytes_helper(), all the memory must be
+   * accessible.  Null or empty ranges are skipped.
+   */
+  void read_bytes_v(const std::vector<RemoteIovec>& iovs);
+  void write_bytes_v(const std::vector<RemoteIovec>& iovs);
+  /**
+   * Like read_bytes_v(), but memory needn't be accessible: set
+   * |(*nread)[i]| to the number of bytes at the start of |iovs[i]| that
+   * could be read, as read_bytes_fallible() would return.
+   */
+  void read_bytes_fallible_v(const std::vector<RemoteIovec>& iovs,
+                             std::vector<ssize_t>* nread);
+
+  /**
+   * Map |num_bytes| of scratch memory with |prot| into the tracee,
+   * shared with rr so that rr accesses it without syscalls; see
+   * |local_scratch_addr()|.  Sets |scratch_ptr| and |scratch_size|.
+   */
+  void init_scratch(AutoRemoteSyscalls& remote, size_t num_bytes, int prot);
+  /**
+   * Free the memory backing our scratch memory after its first
+   * |keep_bytes|; the pages read as zeroes until written again.
+   */
+  void release_scratch(size_t keep_bytes);
+  /**
+   * Return where [addr, addr + num_bytes) of our scratch memory is
+   * mapped in rr, or null if it isn't.
+   */
+  uint8_t* local_scratch_addr(remote_ptr<void> addr, size_t num_bytes);
+
+  /**
+   * Small reads of private tracee memory are served from a cache of
+   * the pages they touch, until any tracee resumes or rr writes to
+   * any tracee.  Call this when tracee memory changes some other way,
+   * e.g. through a file that's mapped into it.
+   */
+  static void invalidate_read_caches();
+
   /** See |pending_sig()| above. */
   int pending_sig_from_status(int status) const;
   /** See |ptrace_event()| above. */
@@ -933,11 +1063,24 @@ public:
    * it's safe for the scheduler to do a blocking waitpid on
    * this if our scheduling slot is open. */
   bool pseudo_blocked;
+  /* True when this task was resumed without waiting for it to stop
+   * again, so that it runs in parallel with other tasks.  The
+   * scheduler picks it up again like a blocked task once it stops;
+   * see RecordSession::may_run_in_parallel(). */
+  bool running_in_parallel;
+  /* Tid of the CLONE_VFORK child this task is waiting for, or 0.  We
+   * strip CLONE_VFORK from the tracee's clone() and emulate the
+   * parent's suspension by not scheduling it; see
+   * is_waiting_for_vfork_child(). */
+  pid_t vfork_child_tid;
   /* Number of times this context has been scheduled in a row,
    * which approximately corresponds to the number of events
    * it's processed in succession.  The scheduler maintains this
    * state and uses it to make scheduling decisions. */
   int succ_event_counter;
+  /* Number of ticks this task may run for before the scheduler
+   * interrupts it.  The scheduler maintains this too. */
+  int timeslice_ticks;
   /* True when any assumptions made about the status of this
    * process have been invalidated, and must be re-established
    * with a waitpid() call. */
@@ -945,6 +1088,9 @@ public:
   /* exit(), or exit_group() with one task, has been called, so
    * the exit can be treated as stable. */
   bool stable_exit;
+  /* rr is letting this task's process run untraced, so destroying the
+   * task detaches from it instead of waiting for it to exit. */
+  bool run_untraced;
 
   /* Task 'nice' value set by setpriority(2).
      We use this to drive scheduling decisions. rr's scheduler is
@@ -952,10 +1098,11 @@ public:
      another runnable task with a lower nice value. */
   int priority;
 
-  /* Tasks with in_round_robin_queue set are in the session's
-   * in_round_robin_queue instead of its task_priority_set.
+  /* The Scheduler's round-robin epoch when this task last had its turn
+   * in a round, or joined the runnable tasks. It takes part in the
+   * current round if that's earlier than the current epoch.
    */
-  bool in_round_robin_queue;
+  uint64_t round_robin_epoch;
 
   /* Imagine that task A passes buffer |b| to the read()
    * syscall.  Imagine that, after A is switched out for task B,
@@ -999,6 +1146,9 @@ public:
    * and |size| is the total available space. */
   remote_ptr<void> scratch_ptr;
   ssize_t scratch_size;
+  /* During recording, our own shared mapping of the scratch memory,
+   * through which rr reads and writes it directly. */
+  void* local_scratch;
 
   /* Nonzero after the trace recorder has flushed the
    * syscallbuf.  When this happens, the recorder must prepare a
@@ -1040,6 +1190,10 @@ public:
   // PTRACE_SYSCALL when instead we wanted to use
   // PTRACE_SINGLESTEP.  See replayer.cc.
   bool stepped_into_syscall;
+  // True when this is still at the sysemu stop of an emulated syscall
+  // whose exit has been replayed; see
+  // |defer_finish_emulated_syscall()|.
+  bool emulated_syscall_unfinished;
 
   /* State used during both recording and replay. */
 
@@ -1069,6 +1223,14 @@ public:
   size_t num_syscallbuf_bytes;
   /* Points at the tracee's mapping of the buffer. */
   remote_ptr<void> syscallbuf_child;
+  /* Size of the syscallbuf mapped the next time this task
+   * initializes its buffers during recording (at thread creation
+   * or exec).  Grows when flushes find the buffer nearly full and
+   * shrinks after many flushes that barely used it; see
+   * |update_syscallbuf_size_hint()|.  Inherited by clones. */
+  size_t syscallbuf_size_hint;
+  /* Number of consecutive flushes that barely used the buffer. */
+  uint32_t small_syscallbuf_flushes;
 
   /* The value of arg1 passed to the last execve syscall in this task. */
   uintptr_t exec_saved_arg1;
@@ -1104,6 +1266,25 @@ private:
    */
   void copy_state(Task* from);
 
+  /**
+   * Save the state of this task's process that replay needs to start
+   * right after the last recorded frame.  Returns false if that state
+   * can't be captured in a snapshot, because the process shares memory.
+   */
+  bool save_snapshot(TraceStream::ProcessSnapshot* snapshot);
+  /**
+   * Make this freshly exec()d replay task look like the task |snapshot|
+   * was taken of.  The caller checks that |snapshot| has a region
+   * covering our current ip, and the same vdso.
+   */
+  void restore_snapshot(const TraceStream::ProcessSnapshot& snapshot);
+  /**
+   * Run this freshly spawned replay task through its exec of |exe| for
+   * real, without replaying the trace, when the recording attached to a
+   * running process and has nothing before the snapshot to replay.
+   */
+  void exec_unrecorded(const std::string& exe);
+
   /**
    * Destroy tracer-side state of this (as opposed to remote,
    * tracee-side state).
@@ -1139,6 +1320,13 @@ private:
    */
   void xptrace(int request, remote_ptr<void> addr, void* data);
 
+  /**
+   * Make the ptrace |request| for a caller at |site|, profiling it if
+   * --ptrace-profile was given.
+   */
+  long ptrace_from(int request, remote_ptr<void> addr, void* data,
+                   void* site);
+
   /**
    * Read tracee memory using PTRACE_PEEKDATA calls. Slow, only use
    * as fallback. Returns number of bytes actually read.
@@ -1156,10 +1344,31 @@ private:
    * Map the syscallbuffer for this, shared with this process.
    * |map_hint| is the address where the syscallbuf is expected
    * to be mapped --- and this is asserted --- or nullptr if
-   * there are no expectations.
+   * there are no expectations.  The buffer is |num_bytes| long.
    */
   remote_ptr<void> init_syscall_buffer(AutoRemoteSyscalls& remote,
-                                       remote_ptr<void> map_hint);
+                                       remote_ptr<void> map_hint,
+                                       size_t num_bytes);
+
+  /**
+   * Adjust |syscallbuf_size_hint| after a flush of |flushed_bytes|
+   * bytes, header included.
+   */
+  void update_syscallbuf_size_hint(size_t flushed_bytes);
+
+  /**
+   * Create a shared memory segment of |num_bytes| named after
+   * |name_prefix|, and map it read/write into rr at |*local| and with
+   * |prot| into the tracee, at |map_hint| if possible.  The tracee
+   * mapping is added to our AddressSpace as |*res|, or as the segment
+   * itself if |res| is null.  Returns the tracee address.
+   */
+  remote_ptr<void> map_shared_segment(AutoRemoteSyscalls& remote,
+                                      const char* name_prefix,
+                                      size_t num_bytes, int prot,
+                                      remote_ptr<void> map_hint,
+                                      const MappableResource* res,
+                                      void** local);
 
   /**
    * True if this has blocked delivery of the desched signal.
@@ -1217,6 +1426,13 @@ private:
   /** Fork and exec a task to run |ae|, with |rec_tid|. */
   static Task* spawn(Session& session, const TraceStream& trace,
                      pid_t rec_tid = -1);
+  /**
+   * Attach to the running single-threaded process |tid| and stop it, for
+   * a recording that starts from a snapshot of it.  Its state is read
+   * from the kernel, and it's set up like a tracee spawn()ed for
+   * recording, as far as that's possible after the fact.
+   */
+  static Task* attach(Session& session, const TraceStream& trace, pid_t tid);
 
   // The address space of this task.
   std::shared_ptr<AddressSpace> as;
@@ -1225,10 +1441,8 @@ private:
   // The exe-file argument passed to the most recent execve call
   // made by this task.
   std::string execve_file;
-  // The current stack of events being processed.  (We use a
-  // deque instead of a stack because we need to iterate the
-  // events.)
-  std::deque<Event> pending_events;
+  // The current stack of events being processed.
+  EventStack pending_events;
   // Task's OS name.
   std::string prname;
   // Count of all ticks seen by this task since tracees became
@@ -1242,6 +1456,10 @@ private:
   // When |extra_registers_known|, we have saved our extra registers.
   ExtraRegisters extra_registers;
   bool extra_registers_known;
+  // When |debug_status_known|, this is our DR6 at the current stop.
+  // Diagnosing a trap can consult it several times.
+  uintptr_t cached_debug_status;
+  bool debug_status_known;
   // Futex list passed to |set_robust_list()|.  We could keep a
   // strong type for this list head and read it if we wanted to,
   // but for now we only need to remember its address / size at
@@ -1269,7 +1487,8 @@ private:
     siginfo_t si;
     int wait_status;
   };
-  std::deque<StashedSignal> stashed_signals;
+  // A vector, unlike a deque, costs nothing until something's stashed.
+  std::vector<StashedSignal> stashed_signals;
   // The task group this belongs to.
   std::shared_ptr<TaskGroup> tg;
   // Contents of the |tls| argument passed to |clone()| and
@@ -0,0 +1,18 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static int fib(int n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+
+int main(void) {
+  int i;
+
+  /* rr attaches while we sleep; nothing before that is recorded. */
+  sleep(3);
+
+  for (i = 0; i < 10; ++i) {
+    atomic_printf("fib(%d) = %d\n", 20 + i, fib(20 + i));
+  }
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,9 @@
+from rrutil import *
+
+# Restarting to an earlier event should resume from one of the automatic
+# checkpoints taken on the way to the -g event.
+restart_replay(500)
+send_gdb('c\n')
+expect_rr('exited normally')
+
+ok()
@@ -0,0 +1,19 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static volatile int sum;
+
+static void hit(int i) { sum += i; }
+
+int main(int argc, char* argv[]) {
+  int i;
+
+  for (i = 0; i < 1000; ++i) {
+    hit(i);
+  }
+
+  atomic_printf("sum=%d\n", sum);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
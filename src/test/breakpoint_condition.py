@@ -0,0 +1,20 @@
+from rrutil import *
+
+# Have rr evaluate the condition instead of reporting every hit to gdb.
+send_gdb('set breakpoint condition-evaluation target\n')
+send_gdb('break hit if i == 777\n')
+expect_gdb('Breakpoint 1')
+
+send_gdb('c\n')
+expect_gdb('Breakpoint 1, hit')
+send_gdb('p i\n')
+expect_gdb('= 777')
+
+send_gdb('p sum\n')
+expect_gdb('= 301476')
+
+send_gdb('c\n')
+expect_rr('EXIT-SUCCESS')
+expect_gdb('exited normally')
+
+ok()
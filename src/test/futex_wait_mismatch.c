@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#include <linux/futex.h>
+
+#define NUM_ITERATIONS 1000
+
+static int word;
+
+static int futex(int* uaddr, int op, int val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void* waker(void* dontcare) {
+  int i;
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    __sync_fetch_and_add(&word, 1);
+    futex(&word, FUTEX_WAKE, 1);
+  }
+  return NULL;
+}
+
+int main(void) {
+  pthread_t thread;
+  int seen = 0;
+  int ret;
+
+  /* The futex word doesn't hold the expected value, so this must fail
+   * without blocking. */
+  ret = futex(&word, FUTEX_WAIT, 1);
+  test_assert(-1 == ret && EAGAIN == errno);
+
+  pthread_create(&thread, NULL, waker, NULL);
+  while (seen < NUM_ITERATIONS) {
+    /* Either we sleep until the waker bumps |word|, or it already
+     * has and the wait fails immediately. */
+    ret = futex(&word, FUTEX_WAIT, seen);
+    test_assert(0 == ret || EAGAIN == errno || EINTR == errno);
+    seen = __sync_fetch_and_add(&word, 0);
+  }
+  pthread_join(thread, NULL);
+
+  atomic_printf("word=%d\n", word);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,16 @@
+from rrutil import *
+
+# "goto" to an earlier event should restart from the nearest checkpoint
+# before it, and "goto" to a later one should replay forward from there.
+send_gdb('checkpoint\n')
+expect_gdb('= 1')
+send_gdb('goto 500\n')
+expect_gdb('Start it from the beginning')
+send_gdb('y\n')
+send_gdb('goto 1000\n')
+expect_gdb('Start it from the beginning')
+send_gdb('y\n')
+send_gdb('c\n')
+expect_rr('exited normally')
+
+ok()
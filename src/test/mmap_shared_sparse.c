@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_PAGES 4096
+
+int main(int argc, char* argv[]) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t num_bytes = NUM_PAGES * page_size;
+  char filename[] = "/dev/shm/rr-test-XXXXXX";
+  int fd = mkstemp(filename);
+  uint8_t* first;
+  uint8_t* second;
+  uint8_t zeroes[16] = { 0 };
+  int i;
+
+  test_assert(fd >= 0);
+  unlink(filename);
+  test_assert(0 == ftruncate(fd, num_bytes));
+
+  first = mmap(NULL, num_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  test_assert(first != (void*)-1);
+  for (i = 0; i < NUM_PAGES; i += 512) {
+    first[i * page_size] = 1 + i / 512;
+  }
+
+  /* Clear one of the written pages behind the mapping's back, so the
+   * next mapping's snapshot has zeroes where the file had data. */
+  test_assert(sizeof(zeroes) ==
+              pwrite(fd, zeroes, sizeof(zeroes), 1024 * page_size));
+
+  second = mmap(NULL, num_bytes, PROT_READ, MAP_SHARED, fd, 0);
+  test_assert(second != (void*)-1);
+  for (i = 0; i < NUM_PAGES; ++i) {
+    uint8_t expected = (i % 512 || i == 1024) ? 0 : 1 + i / 512;
+    test_assert(second[i * page_size] == expected);
+    test_assert(first[i * page_size] == expected);
+  }
+
+  test_assert(0 == munmap(first, num_bytes));
+  test_assert(0 == munmap(second, num_bytes));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
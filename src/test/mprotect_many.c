@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_PAGES 1024
+
+int main(int argc, char* argv[]) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  uint8_t* pages;
+  int i;
+
+  pages = mmap(NULL, NUM_PAGES * page_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  test_assert(pages != (void*)-1);
+
+  /* Split the mapping into a mapping per page. */
+  for (i = 0; i < NUM_PAGES; i += 2) {
+    test_assert(0 == mprotect(pages + i * page_size, page_size, PROT_READ));
+  }
+  /* Coalesce it again. */
+  test_assert(0 ==
+              mprotect(pages, NUM_PAGES * page_size, PROT_READ | PROT_WRITE));
+  for (i = 0; i < NUM_PAGES; ++i) {
+    pages[i * page_size] = i;
+  }
+
+  for (i = 1; i < NUM_PAGES; i += 2) {
+    test_assert(0 == mprotect(pages + i * page_size, page_size, PROT_READ));
+  }
+  /* Unmap a range spanning hundreds of the pieces. */
+  test_assert(0 == munmap(pages + 100 * page_size, 800 * page_size));
+  for (i = 0; i < NUM_PAGES; ++i) {
+    if (i < 100 || i >= 900) {
+      test_assert(pages[i * page_size] == (uint8_t)i);
+    }
+  }
+
+  test_assert(0 == munmap(pages, NUM_PAGES * page_size));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
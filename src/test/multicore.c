@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_CHILDREN 4
+#define NUM_ITERATIONS 1000
+
+static int spin(int seed) {
+  int i;
+  int dummy = seed;
+
+  for (i = 0; i < 1 << 22; ++i) {
+    dummy += i % (1 << 20);
+    dummy += i % (79 * (1 << 20));
+  }
+  return dummy;
+}
+
+static void child(int n) {
+  int i;
+  int pipe_fds[2];
+  char c = 'x';
+
+  test_assert(0 == pipe(pipe_fds));
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    test_assert(1 == write(pipe_fds[1], &c, 1));
+    test_assert(1 == read(pipe_fds[0], &c, 1));
+    if (i % 100 == 0) {
+      spin(i + n);
+    }
+  }
+  exit(n);
+}
+
+int main(void) {
+  pid_t children[NUM_CHILDREN];
+  int i;
+
+  for (i = 0; i < NUM_CHILDREN; ++i) {
+    children[i] = fork();
+    if (0 == children[i]) {
+      child(i);
+    }
+  }
+  for (i = 0; i < NUM_CHILDREN; ++i) {
+    int status;
+    test_assert(children[i] == waitpid(children[i], &status, 0));
+    test_assert(WIFEXITED(status) && WEXITSTATUS(status) == i);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
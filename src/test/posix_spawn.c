@@ -0,0 +1,28 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#include <spawn.h>
+
+extern char** environ;
+
+int main(int argc, char* argv[]) {
+  char* child_argv[] = { argv[0], "child", NULL };
+  pid_t child;
+  int status;
+
+  if (2 == argc) {
+    test_assert(!strcmp(argv[1], "child"));
+    atomic_puts("child running");
+    return 0;
+  }
+
+  /* glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK). */
+  test_assert(0 == posix_spawn(&child, argv[0], NULL, NULL, child_argv,
+                               environ));
+  test_assert(child == waitpid(child, &status, 0));
+  test_assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_IOVS 16
+#define BIG_IOV_SIZE 65536
+
+int main(void) {
+  int sockets[2];
+  char out[NUM_IOVS + 1] = "abcdefghijklmnop";
+  char in[NUM_IOVS][2];
+  struct iovec iovs[NUM_IOVS];
+  struct msghdr msg = { 0 };
+  ssize_t nread;
+  int i;
+
+  test_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  test_assert(NUM_IOVS == write(sockets[0], out, NUM_IOVS));
+
+  /* Receive one byte into each of many iovs, leaving the byte after it
+   * untouched. */
+  memset(in, 'x', sizeof(in));
+  for (i = 0; i < NUM_IOVS; ++i) {
+    iovs[i].iov_base = in[i];
+    iovs[i].iov_len = 1;
+  }
+  msg.msg_iov = iovs;
+  msg.msg_iovlen = NUM_IOVS;
+  nread = recvmsg(sockets[1], &msg, 0);
+  test_assert(NUM_IOVS == nread);
+  for (i = 0; i < NUM_IOVS; ++i) {
+    test_assert(out[i] == in[i][0]);
+    test_assert('x' == in[i][1]);
+  }
+
+  /* A short message into big iovs only fills the start of the first
+   * one. */
+  iovs[0].iov_base = malloc(BIG_IOV_SIZE);
+  iovs[1].iov_base = malloc(BIG_IOV_SIZE);
+  iovs[0].iov_len = iovs[1].iov_len = BIG_IOV_SIZE;
+  memset(iovs[0].iov_base, 'x', BIG_IOV_SIZE);
+  memset(iovs[1].iov_base, 'x', BIG_IOV_SIZE);
+  msg.msg_iovlen = 2;
+  test_assert(3 == write(sockets[0], out, 3));
+  nread = recvmsg(sockets[1], &msg, 0);
+  test_assert(3 == nread);
+  test_assert(0 == memcmp(iovs[0].iov_base, "abcx", 4));
+  test_assert('x' == ((char*)iovs[1].iov_base)[0]);
+  free(iovs[0].iov_base);
+  free(iovs[1].iov_base);
+
+  /* Echo them with a writev, which replay must gather the same way. */
+  for (i = 0; i < NUM_IOVS; ++i) {
+    iovs[i].iov_base = in[i];
+    iovs[i].iov_len = 1;
+  }
+  test_assert(NUM_IOVS == writev(STDOUT_FILENO, iovs, NUM_IOVS));
+  atomic_puts("");
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,23 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void breakpoint(int n) {
+  int break_here = n;
+  (void)break_here;
+}
+
+int main(void) {
+  int i, j;
+
+  for (i = 0; i < 5; ++i) {
+    breakpoint(i);
+    /* Make enough events between the hits for automatic checkpoints
+     * to be taken in between. */
+    for (j = 0; j < 50; ++j) {
+      (void)sys_gettid();
+    }
+  }
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
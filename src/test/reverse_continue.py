@@ -0,0 +1,24 @@
+from rrutil import *
+
+send_gdb('b breakpoint\n')
+expect_gdb('Breakpoint 1')
+
+for n in range(3):
+    send_gdb('c\n')
+    expect_gdb('Breakpoint 1, breakpoint \\(n=%d\\)' % n)
+
+# Each of these replays forward from the nearest automatic checkpoint
+# before the current position.
+send_gdb('reverse-continue\n')
+expect_gdb('Breakpoint 1, breakpoint \\(n=1\\)')
+
+send_gdb('reverse-continue\n')
+expect_gdb('Breakpoint 1, breakpoint \\(n=0\\)')
+
+send_gdb('reverse-continue\n')
+expect_gdb('No more reverse-execution history')
+
+send_gdb('c\n')
+expect_gdb('Breakpoint 1, breakpoint \\(n=0\\)')
+
+ok()
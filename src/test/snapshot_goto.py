@@ -0,0 +1,13 @@
+from rrutil import *
+
+send_gdb('b breakpoint\n')
+expect_gdb('Breakpoint 1')
+
+send_gdb('c\n')
+expect_gdb('Breakpoint 1, breakpoint')
+send_gdb('disable\n')
+send_gdb('c\n')
+expect_rr('EXIT-SUCCESS')
+expect_gdb('exited normally')
+
+ok()
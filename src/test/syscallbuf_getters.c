@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ITERATIONS 1000
+
+int main(int argc, char** argv) {
+  pid_t pid = getpid();
+  pid_t tid = sys_gettid();
+  pid_t ppid = getppid();
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+  int i;
+
+  /* These are buffered, so replay has to get their results from the
+   * syscallbuf. */
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    test_assert(pid == getpid());
+    test_assert(tid == sys_gettid());
+    test_assert(ppid == getppid());
+    test_assert(uid == getuid() && uid == geteuid());
+    test_assert(gid == getgid() && gid == getegid());
+    test_assert(getpgrp() == getpgid(0));
+  }
+  atomic_printf("pid %d tid %d\n", pid, tid);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
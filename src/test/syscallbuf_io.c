@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#include <dirent.h>
+
+#define DUMMY_FILE "dummy.txt"
+
+static void check_file_io(void) {
+  char buf[16];
+  char a[3], b[8];
+  struct iovec iov[2] = { { a, sizeof(a) }, { b, sizeof(b) } };
+  struct stat st;
+  int fd = open(DUMMY_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+  test_assert(fd >= 0);
+  test_assert(5 == pwrite(fd, "hello", 5, 2));
+  test_assert(0 == fstatat(AT_FDCWD, DUMMY_FILE, &st, 0));
+  test_assert(7 == st.st_size);
+
+  memset(buf, 0, sizeof(buf));
+  test_assert(3 == pread(fd, buf, sizeof(buf), 4));
+  test_assert(!strcmp(buf, "llo"));
+
+  memset(b, 0, sizeof(b));
+  test_assert(0 == lseek(fd, 0, SEEK_SET));
+  test_assert(7 == readv(fd, iov, ALEN(iov)));
+  test_assert(0 == a[0] && 0 == a[1] && 'h' == a[2]);
+  test_assert(!strcmp(b, "ello"));
+
+  close(fd);
+  unlink(DUMMY_FILE);
+}
+
+static void check_getdents(void) {
+  DIR* dir = opendir(".");
+  struct dirent* ent;
+  int saw_dot = 0;
+
+  test_assert(dir != NULL);
+  while ((ent = readdir(dir))) {
+    saw_dot |= !strcmp(ent->d_name, ".");
+  }
+  test_assert(saw_dot);
+  closedir(dir);
+}
+
+static void check_sockets(void) {
+  int sockfds[2];
+  char buf[16];
+  char a[2], b[8];
+  struct iovec out = { "world", 5 };
+  struct iovec in[2] = { { a, sizeof(a) }, { b, sizeof(b) } };
+  struct msghdr msg;
+  struct epoll_event ev;
+  int epfd;
+
+  test_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockfds));
+
+  epfd = epoll_create(1);
+  test_assert(epfd >= 0);
+  ev.events = EPOLLIN;
+  ev.data.u32 = 42;
+  test_assert(0 == epoll_ctl(epfd, EPOLL_CTL_ADD, sockfds[1], &ev));
+  test_assert(0 == epoll_wait(epfd, &ev, 1, 0));
+
+  test_assert(5 == sendto(sockfds[0], "hello", 5, 0, NULL, 0));
+  memset(&ev, 0, sizeof(ev));
+  test_assert(1 == epoll_wait(epfd, &ev, 1, -1));
+  test_assert(EPOLLIN == ev.events && 42 == ev.data.u32);
+  memset(buf, 0, sizeof(buf));
+  test_assert(5 == recv(sockfds[1], buf, sizeof(buf), 0));
+  test_assert(!strcmp(buf, "hello"));
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &out;
+  msg.msg_iovlen = 1;
+  test_assert(5 == sendmsg(sockfds[0], &msg, 0));
+
+  memset(b, 0, sizeof(b));
+  msg.msg_iov = in;
+  msg.msg_iovlen = ALEN(in);
+  test_assert(5 == recvmsg(sockfds[1], &msg, 0));
+  test_assert('w' == a[0] && 'o' == a[1]);
+  test_assert(!strcmp(b, "rld"));
+
+  close(epfd);
+  close(sockfds[0]);
+  close(sockfds[1]);
+}
+
+int main(int argc, char* argv[]) {
+  check_file_io();
+  check_getdents();
+  check_sockets();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
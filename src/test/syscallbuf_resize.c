@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define CHUNK_SIZE (1 << 18)
+#define NUM_CHUNKS 64
+/* Bigger than any syscallbuf record can be. */
+#define HUGE_SIZE (3 << 20)
+
+static char* buf;
+
+static int checksum_reads(void) {
+  int fd = open("/dev/zero", O_RDONLY);
+  int sum = 0;
+  int i;
+
+  test_assert(fd >= 0);
+  /* Each of these fills a good part of the syscallbuf, so rr
+   * grows the buffers of threads created after them. */
+  for (i = 0; i < NUM_CHUNKS; ++i) {
+    test_assert(CHUNK_SIZE == read(fd, buf, CHUNK_SIZE));
+    sum += buf[i];
+  }
+  test_assert(HUGE_SIZE == read(fd, buf, HUGE_SIZE));
+  sum += buf[HUGE_SIZE - 1];
+  close(fd);
+  return sum;
+}
+
+static void* thread(void* p) {
+  test_assert(0 == checksum_reads());
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  pthread_t t;
+
+  buf = malloc(HUGE_SIZE);
+  test_assert(0 == checksum_reads());
+
+  pthread_create(&t, NULL, thread, NULL);
+  pthread_join(t, NULL);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,26 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+/* Too big for the debug registers, so watched by page protection. */
+static int big[256];
+static int other[256];
+
+int main(int argc, char* argv[]) {
+  breakpoint();
+
+  other[10] = 7;
+  big[100] = 42;
+  other[20] = big[100];
+  big[200] = 1337;
+
+  atomic_printf("big[100]=%d big[200]=%d\n", big[100], big[200]);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,27 @@
+from rrutil import *
+
+send_gdb('break breakpoint\n')
+expect_gdb('Breakpoint 1')
+send_gdb('c\n')
+expect_gdb('Breakpoint 1')
+
+# Writes to |other| share pages with |big| but mustn't stop.
+send_gdb('watch big\n')
+expect_gdb('Hardware[()/a-z ]+watchpoint 2')
+
+send_gdb('c\n')
+expect_gdb('Hardware watchpoint 2: big')
+expect_gdb('main')
+send_gdb('p big[100]\n')
+expect_gdb('= 42')
+
+send_gdb('c\n')
+expect_gdb('Hardware watchpoint 2: big')
+send_gdb('p big[200]\n')
+expect_gdb('= 1337')
+
+send_gdb('c\n')
+expect_rr('EXIT-SUCCESS')
+expect_gdb('exited normally')
+
+ok()
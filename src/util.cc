@@ -9,6 +9,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -17,9 +18,11 @@
 #include <linux/ipc.h>
 #include <linux/magic.h>
 #include <linux/net.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <asm/ptrace-abi.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
@@ -31,11 +34,18 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+
 #include "preload/syscall_buffer.h"
 
 #include "Flags.h"
 #include "kernel_abi.h"
 #include "log.h"
+#include "MemoryDumpWriter.h"
 #include "AutoRemoteSyscalls.h"
 #include "replayer.h"
 #include "RecordSession.h"
@@ -86,17 +96,23 @@ bool probably_not_interactive(int fd) {
   return !isatty(fd);
 }
 
-void maybe_mark_stdio_write(Task* t, int fd) {
+string stdio_write_mark(Task* t, int fd) {
   char buf[256];
-  ssize_t len;
 
   if (!Flags::get().mark_stdio ||
       !(STDOUT_FILENO == fd || STDERR_FILENO == fd)) {
-    return;
+    return string();
   }
   snprintf(buf, sizeof(buf) - 1, "[rr %d %d]", t->tgid(), t->trace_time());
-  len = strlen(buf);
-  if (write(fd, buf, len) != len) {
+  return buf;
+}
+
+void maybe_mark_stdio_write(Task* t, int fd) {
+  string mark = stdio_write_mark(t, fd);
+  if (mark.empty()) {
+    return;
+  }
+  if (write(fd, mark.data(), mark.size()) != ssize_t(mark.size())) {
     FATAL() << "Couldn't write to " << fd;
   }
 }
@@ -219,10 +235,12 @@ const char* signalname(int sig) {
   }
 }
 
-#include "IsAlwaysEmulatedSyscall.generated"
-
 bool is_always_emulated_syscall(int syscall, SupportedArch arch) {
-  RR_ARCH_FUNCTION(is_always_emulated_syscall_arch, arch, syscall);
+  const SyscallInfo& info = syscall_info(syscall, arch);
+  if (SYSCALL_UNDEFINED == info.kind) {
+    FATAL() << "Unknown syscall " << syscall;
+  }
+  return SEMANTICS_EMU == info.semantics;
 }
 
 int clone_flags_to_task_flags(int flags_arg) {
@@ -247,6 +265,10 @@ remote_ptr<void> ceil_page_size(remote_ptr<void> addr) {
   return remote_ptr<void>(ceil_page_size(addr.as_int()));
 }
 
+remote_ptr<void> floor_page_size(remote_ptr<void> addr) {
+  return remote_ptr<void>(addr.as_int() & ~(page_size() - 1));
+}
+
 void print_process_state(pid_t tid) {
   char path[64];
   FILE* file;
@@ -345,30 +367,28 @@ bool should_dump_memory(Task* t, const TraceFrame& f) {
 
 void dump_process_memory(Task* t, int global_time, const char* tag) {
   char filename[PATH_MAX];
-  FILE* dump_file;
-
   format_dump_filename(t, global_time, tag, filename, sizeof(filename));
-  dump_file = fopen64(filename, "w");
 
+  // Copy the memory while |t| is stopped; MemoryDumpWriter formats and
+  // writes it in the background.
   const AddressSpace& as = *(t->vm());
+  vector<MemoryRange> ranges;
+  vector<MemoryDumpWriter::Range> dump;
   for (auto& kv : as.memmap()) {
     const Mapping& first = kv.first;
-    const MappableResource& second = kv.second;
-    vector<uint8_t> mem;
-    mem.resize(first.num_bytes());
-
-    ssize_t mem_len =
-        t->read_bytes_fallible(first.start, first.num_bytes(), mem.data());
-    mem_len = max(ssize_t(0), mem_len);
-
-    string label = first.str() + ' ' + second.str();
-
-    if (!is_start_of_scratch_region(t, first.start)) {
-      dump_binary_chunk(dump_file, label.c_str(), (const uint32_t*)mem.data(),
-                        mem_len / sizeof(uint32_t), first.start);
+    if (is_start_of_scratch_region(t, first.start)) {
+      continue;
     }
+    ranges.push_back(MemoryRange(first.start, first.num_bytes()));
+    dump.push_back(MemoryDumpWriter::Range());
+    dump.back().label = first.str() + ' ' + kv.second.str();
+    dump.back().addr = first.start;
   }
-  fclose(dump_file);
+  as.read_ranges(t, ranges,
+                 [&](size_t i, const uint8_t* data, size_t valid) {
+    dump[i].data.assign(data, data + valid);
+  });
+  MemoryDumpWriter::get().write(string(filename) + ".gz", move(dump));
 }
 
 static void notify_checksum_error(Task* t, int global_time, unsigned checksum,
@@ -378,6 +398,8 @@ static void notify_checksum_error(Task* t, int global_time, unsigned checksum,
   char rec_dump[PATH_MAX];
 
   dump_process_memory(t, global_time, "checksum_error");
+  // We're about to die; finish the dump first.
+  MemoryDumpWriter::get().flush();
 
   /* TODO: if the right recorder memory dump is present,
    * automatically compare them, taking the oddball
@@ -387,6 +409,8 @@ static void notify_checksum_error(Task* t, int global_time, unsigned checksum,
   format_dump_filename(t, global_time, "checksum_error", cur_dump,
                        sizeof(cur_dump));
   format_dump_filename(t, global_time, "rec", rec_dump, sizeof(rec_dump));
+  strcat(cur_dump, ".gz");
+  strcat(rec_dump, ".gz");
 
   Event ev(t->current_trace_frame().event());
   ASSERT(t, checksum == rec_checksum)
@@ -406,23 +430,30 @@ static void notify_checksum_error(Task* t, int global_time, unsigned checksum,
       << "then you can use the following to determine which memory cells "
          "differ:\n"
          "\n"
-      << "$ diff -u " << rec_dump << " " << cur_dump << " > mem-diverge.diff\n";
+      << "$ diff -u <(zcat " << rec_dump << ") <(zcat " << cur_dump
+      << ") > mem-diverge.diff\n";
+}
+
+static ChecksumDivergence divergence;
+static map<pid_t, int> last_validated_times;
+
+const ChecksumDivergence* checksum_divergence() {
+  return divergence.global_time ? &divergence : nullptr;
+}
+
+int last_validated_checksum_time(pid_t rec_tid) {
+  auto it = last_validated_times.find(rec_tid);
+  return it == last_validated_times.end() ? 0 : it->second;
 }
 
 /**
- * This helper does the heavy lifting of storing or validating
- * checksums.  The iterator data determines which behavior the helper
- * function takes on, and to/from which file it writes/read.
+ * Whether iterate_checksums() stores checksums in the trace or validates
+ * them against the trace.
  */
 enum ChecksumMode {
   STORE_CHECKSUMS,
   VALIDATE_CHECKSUMS
 };
-struct checksum_iterator_data {
-  ChecksumMode mode;
-  FILE* checksums_file;
-  int global_time;
-};
 
 static bool checksum_segment_filter(const Mapping& m,
                                     const MappableResource& r) {
@@ -447,46 +478,414 @@ static bool checksum_segment_filter(const Mapping& m,
   return may_diverge;
 }
 
+// Bit of a /proc/[pid]/pagemap entry that's set when the page has been
+// written since the last "4" was written to /proc/[pid]/clear_refs.
+static const uint64_t PAGEMAP_SOFT_DIRTY = 1ULL << 55;
+
+static bool read_pagemap_entry(int pagemap, const void* p, uint64_t* entry) {
+  off64_t offset = (uintptr_t(p) / page_size()) * sizeof(*entry);
+  return pread64(pagemap, entry, sizeof(*entry), offset) == sizeof(*entry);
+}
+
 /**
- * Either create and store checksums for each segment mapped in |t|'s
- * address space, or validate an existing computed checksum.  Behavior
- * is selected by |mode|.
+ * Return true if this kernel tracks soft-dirty pages, by checking that
+ * clearing our own refs cleans a page and writing it dirties it again.
  */
-static void iterate_checksums(Task* t, ChecksumMode mode, int global_time) {
-  struct checksum_iterator_data c;
-  memset(&c, 0, sizeof(c));
-  char filename[PATH_MAX];
-  const char* fmode = (STORE_CHECKSUMS == mode) ? "w" : "r";
+static bool soft_dirty_supported() {
+  static int supported = -1;
+  if (supported >= 0) {
+    return supported;
+  }
+  supported = 0;
+  size_t len = page_size();
+  void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ScopedFd clear_refs("/proc/self/clear_refs", O_WRONLY);
+  ScopedFd pagemap("/proc/self/pagemap", O_RDONLY);
+  if (p != MAP_FAILED && clear_refs.is_open() && pagemap.is_open()) {
+    uint64_t clean, dirty;
+    *static_cast<volatile char*>(p) = 1;
+    if (write(clear_refs, "4", 1) == 1 &&
+        read_pagemap_entry(pagemap, p, &clean)) {
+      *static_cast<volatile char*>(p) = 2;
+      supported = read_pagemap_entry(pagemap, p, &dirty) &&
+                  !(clean & PAGEMAP_SOFT_DIRTY) && (dirty & PAGEMAP_SOFT_DIRTY);
+    }
+  }
+  if (p != MAP_FAILED) {
+    munmap(p, len);
+  }
+  if (!supported) {
+    LOG(warn) << "Kernel doesn't track soft-dirty pages; checksumming all "
+                 "pages";
+  }
+  return supported;
+}
 
-  c.mode = mode;
-  snprintf(filename, sizeof(filename) - 1, "%s/%d_%d", t->trace_dir().c_str(),
-           global_time, t->rec_tid);
-  c.checksums_file = fopen64(filename, fmode);
-  c.global_time = global_time;
-  if (!c.checksums_file) {
-    FATAL() << "Failed to open checksum file " << filename;
+/**
+ * How a mapping's checksum is computed from its contents, stored with
+ * each checksums record. Each page's
+ * checksum is computed separately and the page checksums are then
+ * combined in address order, so that incremental checksumming can reuse
+ * the checksums of unchanged pages.
+ *
+ * CHECKSUM_WORD_SUM, the sum of all the 32-bit words, is what older rr
+ * versions used. That doesn't notice words being swapped, so new
+ * checksums use CHECKSUM_CRC32C: the CRC-32C of each page, and the
+ * CRC-32C of the sequence of page CRCs.
+ */
+enum ChecksumKind {
+  CHECKSUM_WORD_SUM,
+  CHECKSUM_CRC32C
+};
+
+static unsigned page_checksum(ChecksumKind kind, const uint8_t* data,
+                              size_t len) {
+  if (kind == CHECKSUM_CRC32C) {
+    return crc32c(0, data, len);
   }
+  auto words = reinterpret_cast<const unsigned*>(data);
+  unsigned sum = 0;
+  for (size_t i = 0; i < len / sizeof(*words); ++i) {
+    sum += words[i];
+  }
+  return sum;
+}
 
-  const AddressSpace& as = *(t->vm());
+static unsigned combine_checksums(ChecksumKind kind, unsigned checksum,
+                                  unsigned page) {
+  if (kind == CHECKSUM_CRC32C) {
+    return crc32c(checksum, &page, sizeof(page));
+  }
+  return checksum + page;
+}
+
+/**
+ * Return the checksum of the first |len| bytes of |data|.
+ */
+static unsigned checksum_bytes(ChecksumKind kind, const uint8_t* data,
+                               size_t len) {
+  unsigned checksum = 0;
+  for (size_t offset = 0; offset < len; offset += page_size()) {
+    checksum = combine_checksums(
+        kind, checksum,
+        page_checksum(kind, data + offset, min(page_size(), len - offset)));
+  }
+  return checksum;
+}
+
+/**
+ * Pages of one mapping whose page checksums iterate_checksums() computes,
+ * possibly on a worker thread. Only the pages that |entries| (soft-dirty
+ * pagemap entries) reports dirty, or that couldn't be read last time, are
+ * read; the other pages' checksums are taken from |old|. When |old| is
+ * null, every page is read.
+ */
+struct PageChecksumJob {
+  remote_ptr<void> start;
+  size_t begin_page;
+  size_t end_page;
+  const uint64_t* entries;
+  const AddressSpace::PageChecksums* old;
+  AddressSpace::PageChecksums* sums;
+  // Set by a worker when the job has to be run again on the main thread.
+  bool retry;
+};
+
+// Reads tracee memory like Task::read_bytes_fallible().
+typedef function<ssize_t(remote_ptr<void>, size_t, uint8_t*)> MemoryReader;
+
+/**
+ * A run of consecutive pages of a PageChecksumJob that have to be read.
+ */
+struct DirtyRun {
+  PageChecksumJob* job;
+  size_t begin_page;
+  size_t end_page;
+
+  MemoryRange range() const {
+    return MemoryRange(job->start + begin_page * page_size(),
+                       (end_page - begin_page) * page_size());
+  }
+};
+
+/**
+ * Copy the checksums of |job|'s clean pages from its old checksums, and
+ * append the runs of pages that have to be read to |runs|.
+ */
+static void find_dirty_runs(PageChecksumJob& job, vector<DirtyRun>* runs) {
+  size_t psize = page_size();
+  const AddressSpace::PageChecksums* old = job.old;
+  auto dirty = [&](size_t i) {
+    return !old || (job.entries[i] & PAGEMAP_SOFT_DIRTY) ||
+           old->valid_bytes[i] < psize;
+  };
+
+  size_t i = job.begin_page;
+  while (i < job.end_page) {
+    if (!dirty(i)) {
+      job.sums->sums[i] = old->sums[i];
+      job.sums->valid_bytes[i] = psize;
+      ++i;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < job.end_page && dirty(end)) {
+      ++end;
+    }
+    runs->push_back({ &job, i, end });
+    i = end;
+  }
+}
+
+/**
+ * Store the page checksums of |run| from |mem|, the first |nread| bytes
+ * of which were read from the run.
+ */
+static void checksum_dirty_run(ChecksumKind kind, const DirtyRun& run,
+                               const uint8_t* mem, ssize_t nread) {
+  size_t psize = page_size();
+  nread = max(ssize_t(0), nread);
+  for (size_t page = run.begin_page; page < run.end_page; ++page) {
+    ssize_t offset = (page - run.begin_page) * psize;
+    size_t valid = max(ssize_t(0), min(ssize_t(psize), nread - offset));
+    run.job->sums->sums[page] = page_checksum(kind, mem + offset, valid);
+    run.job->sums->valid_bytes[page] = valid;
+  }
+}
+
+/**
+ * Run |job|, reading tracee memory with |read|. Returns false if a read
+ * returned nothing without an error, which the caller should retry with
+ * Task::read_bytes_fallible().
+ */
+static bool run_page_checksum_job(ChecksumKind kind, PageChecksumJob& job,
+                                  const MemoryReader& read) {
+  vector<DirtyRun> runs;
+  find_dirty_runs(job, &runs);
+  vector<uint8_t> mem;
+  for (auto& run : runs) {
+    // Read the whole run of dirty pages at once.
+    MemoryRange range = run.range();
+    mem.resize(range.num_bytes);
+    errno = 0;
+    ssize_t nread = read(range.addr, mem.size(), mem.data());
+    if (nread == 0 && errno == 0) {
+      return false;
+    }
+    checksum_dirty_run(kind, run, mem.data(), nread);
+  }
+  return true;
+}
+
+/**
+ * Run |jobs| on this thread, reading the dirty runs of all of them in as
+ * few vectored reads of |t|'s memory as possible.
+ */
+static void run_page_checksum_jobs_serially(
+    Task* t, ChecksumKind kind, const vector<PageChecksumJob*>& jobs) {
+  vector<DirtyRun> runs;
+  for (auto job : jobs) {
+    find_dirty_runs(*job, &runs);
+  }
+  vector<MemoryRange> ranges;
+  for (auto& run : runs) {
+    ranges.push_back(run.range());
+  }
+  t->vm()->read_ranges(t, ranges,
+                       [&](size_t i, const uint8_t* data, size_t valid) {
+    checksum_dirty_run(kind, runs[i], data, valid);
+  });
+}
+
+/**
+ * Return the checksum of a mapping from its page checksums, computed the
+ * same way as checksum_bytes() is over the mapping's contents: like a
+ * read of the whole mapping, stop at the first byte that can't be read.
+ */
+static unsigned combine_page_checksums(
+    ChecksumKind kind, const AddressSpace::PageChecksums& sums) {
+  unsigned checksum = 0;
+  for (size_t i = 0; i < sums.sums.size() && sums.valid_bytes[i] > 0; ++i) {
+    checksum = combine_checksums(kind, checksum, sums.sums[i]);
+    if (sums.valid_bytes[i] < page_size()) {
+      break;
+    }
+  }
+  return checksum;
+}
+
+struct PageChecksumWork {
+  ChecksumKind kind;
+  vector<PageChecksumJob>* jobs;
+  int mem_fd;
+  atomic<size_t> next_job;
+};
+
+static void* page_checksum_thread(void* p) {
+  PageChecksumWork* work = static_cast<PageChecksumWork*>(p);
+  MemoryReader read = [work](remote_ptr<void> addr, size_t len,
+                             uint8_t* buf) {
+    return pread64(work->mem_fd, buf, len, addr.as_int());
+  };
+  while (true) {
+    size_t i = work->next_job++;
+    if (i >= work->jobs->size()) {
+      return nullptr;
+    }
+    PageChecksumJob& job = (*work->jobs)[i];
+    job.retry = !run_page_checksum_job(work->kind, job, read);
+  }
+}
+
+/**
+ * Run |jobs|, spread over worker threads when there's enough memory to
+ * read that it's worth starting them.
+ */
+static void run_page_checksum_jobs(Task* t, ChecksumKind kind,
+                                   vector<PageChecksumJob>& jobs) {
+  // Reading less than this serially is faster than starting threads.
+  static const size_t MIN_PARALLEL_BYTES = 16 * 1024 * 1024;
+  static const long MAX_THREADS = 8;
+  size_t total_bytes = 0;
+  for (auto& job : jobs) {
+    total_bytes += (job.end_page - job.begin_page) * page_size();
+  }
+  long num_threads = min(MAX_THREADS, sysconf(_SC_NPROCESSORS_ONLN));
+  num_threads = min<long>(num_threads, jobs.size());
+  if (total_bytes >= MIN_PARALLEL_BYTES && num_threads > 1 &&
+      t->vm()->mem_fd().is_open()) {
+    PageChecksumWork work;
+    work.kind = kind;
+    work.jobs = &jobs;
+    work.mem_fd = t->vm()->mem_fd();
+    work.next_job = 0;
+    vector<pthread_t> threads;
+    for (long i = 0; i < num_threads; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, nullptr, page_checksum_thread, &work)) {
+        break;
+      }
+      threads.push_back(thread);
+    }
+    // With no threads, every job is still left to do below.
+    page_checksum_thread(&work);
+    for (auto thread : threads) {
+      pthread_join(thread, nullptr);
+    }
+    vector<PageChecksumJob*> retries;
+    for (auto& job : jobs) {
+      if (job.retry) {
+        retries.push_back(&job);
+      }
+    }
+    run_page_checksum_jobs_serially(t, kind, retries);
+    return;
+  }
+  vector<PageChecksumJob*> all_jobs;
+  for (auto& job : jobs) {
+    all_jobs.push_back(&job);
+  }
+  run_page_checksum_jobs_serially(t, kind, all_jobs);
+}
+
+static void iterate_checksums(Task* t, ChecksumMode mode, int global_time) {
+  uint32_t rec_kind = CHECKSUM_CRC32C;
+  vector<TraceStream::MappingChecksum> checksums;
+  if (VALIDATE_CHECKSUMS == mode &&
+      !t->trace_reader().read_checksums(global_time, t->rec_tid, &rec_kind,
+                                        &checksums)) {
+    FATAL() << "No checksums for " << t->rec_tid << " at " << global_time
+            << " in the trace";
+  }
+  if (rec_kind != CHECKSUM_WORD_SUM && rec_kind != CHECKSUM_CRC32C) {
+    FATAL() << "Unknown checksum kind " << rec_kind;
+  }
+  ChecksumKind kind = ChecksumKind(rec_kind);
+  size_t next_checksum = 0;
+
+  // With incremental checksumming, private mappings' unchanged pages
+  // reuse the sums from the last checksum. Shared mappings are always read
+  // in full, because other processes (including rr) can write them
+  // without dirtying this address space's pages.
+  ScopedFd pagemap;
+  if (Flags::get().checksum_incremental && soft_dirty_supported()) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", t->tid);
+    pagemap = ScopedFd(path, O_RDONLY);
+  }
+  AddressSpace& as = *(t->vm());
+  AddressSpace::PageChecksumMap page_checksums;
+
+  // First work out which pages of which mappings need reading, in chunks
+  // that can be read in parallel.
+  static const size_t JOB_PAGES = 4096;
+  struct MappingState {
+    bool filtered;
+    bool is_syscallbuf;
+    string raw_map_line;
+    vector<uint64_t> entries;
+    AddressSpace::PageChecksums* sums;
+  };
+  vector<MappingState> states;
+  // Page checksums of mappings that aren't kept for the next checksum.
+  deque<AddressSpace::PageChecksums> uncached_sums;
+  vector<PageChecksumJob> jobs;
   for (auto& kv : as.memmap()) {
     const Mapping& first = kv.first;
     const MappableResource& second = kv.second;
-
-    vector<uint8_t> mem;
-    ssize_t valid_mem_len = 0;
-
-    if (checksum_segment_filter(first, second)) {
-      mem.resize(first.num_bytes());
-      valid_mem_len =
-          t->read_bytes_fallible(first.start, first.num_bytes(), mem.data());
-      valid_mem_len = max(ssize_t(0), valid_mem_len);
+    MappingState state;
+    state.is_syscallbuf =
+        second.fsname.find(SYSCALLBUF_SHMEM_PATH_PREFIX) != string::npos;
+    state.filtered = checksum_segment_filter(first, second);
+    state.raw_map_line = first.str() + ' ' + second.str();
+    state.sums = nullptr;
+    if (state.filtered && !state.is_syscallbuf) {
+      size_t num_pages = first.num_bytes() / page_size();
+      const AddressSpace::PageChecksums* old = nullptr;
+      if (pagemap.is_open() && (first.flags & MAP_PRIVATE)) {
+        auto it = as.page_checksums().find(first.start);
+        state.entries.resize(num_pages);
+        ssize_t entries_size = num_pages * sizeof(uint64_t);
+        off64_t entries_offset =
+            (first.start.as_int() / page_size()) * sizeof(uint64_t);
+        if (it != as.page_checksums().end() &&
+            it->second.map_line == state.raw_map_line &&
+            it->second.kind == kind &&
+            entries_size == pread64(pagemap, state.entries.data(),
+                                    entries_size, entries_offset)) {
+          old = &it->second;
+        }
+        state.sums = &page_checksums[first.start];
+      } else {
+        uncached_sums.push_back(AddressSpace::PageChecksums());
+        state.sums = &uncached_sums.back();
+      }
+      state.sums->map_line = state.raw_map_line;
+      state.sums->kind = kind;
+      state.sums->sums.resize(num_pages);
+      state.sums->valid_bytes.resize(num_pages);
+      for (size_t page = 0; page < num_pages; page += JOB_PAGES) {
+        PageChecksumJob job = { first.start, page,
+                                min(num_pages, page + JOB_PAGES),
+                                state.entries.data(), old, state.sums, false };
+        jobs.push_back(job);
+      }
     }
+    states.push_back(move(state));
+  }
+  run_page_checksum_jobs(t, kind, jobs);
 
-    unsigned* buf = (unsigned*)mem.data();
+  size_t state_index = 0;
+  for (auto& kv : as.memmap()) {
+    const Mapping& first = kv.first;
+    const MappingState& state = states[state_index++];
+    const string& raw_map_line = state.raw_map_line;
     unsigned checksum = 0;
-    int i;
 
-    if (second.fsname.find(SYSCALLBUF_SHMEM_PATH_PREFIX) != string::npos) {
+    if (state.sums) {
+      checksum = combine_page_checksums(kind, *state.sums);
+    } else if (state.filtered) {
       /* The syscallbuf consists of a region that's written
       * deterministically wrt the trace events, and a
       * region that's written nondeterministically in the
@@ -499,33 +898,28 @@ static void iterate_checksums(Task* t, ChecksumMode mode, int global_time) {
       *
       * So here, we set things up so that we only checksum
       * the deterministic region. */
+      vector<uint8_t> mem;
+      mem.resize(first.num_bytes());
+      ssize_t valid_mem_len =
+          t->read_bytes_fallible(first.start, first.num_bytes(), mem.data());
+      valid_mem_len = max(ssize_t(0), valid_mem_len);
       auto child_hdr = first.start.cast<struct syscallbuf_hdr>();
       auto hdr = t->read_mem(child_hdr);
-      valid_mem_len = !buf ? 0 : sizeof(hdr) + hdr.num_rec_bytes +
-                                     sizeof(struct syscallbuf_record);
-    }
-
-    ASSERT(t, buf || valid_mem_len == 0);
-    for (i = 0; i < ssize_t(valid_mem_len / sizeof(*buf)); ++i) {
-      checksum += buf[i];
+      valid_mem_len = sizeof(hdr) + hdr.num_rec_bytes +
+                      sizeof(struct syscallbuf_record);
+      checksum = checksum_bytes(kind, mem.data(), valid_mem_len);
     }
 
-    string raw_map_line = first.str() + ' ' + second.str();
-    if (STORE_CHECKSUMS == c.mode) {
-      fprintf(c.checksums_file, "(%x) %s\n", checksum, raw_map_line.c_str());
+    if (STORE_CHECKSUMS == mode) {
+      TraceStream::MappingChecksum m = { first.start.as_int(),
+                                         first.end.as_int(), checksum };
+      checksums.push_back(m);
     } else {
-      char line[1024];
-      unsigned rec_checksum;
-      unsigned long rec_start;
-      unsigned long rec_end;
-      int nparsed;
-
-      fgets(line, sizeof(line), c.checksums_file);
-      nparsed =
-          sscanf(line, "(%x) %lx-%lx", &rec_checksum, &rec_start, &rec_end);
-      remote_ptr<void> rec_start_addr = rec_start;
-      remote_ptr<void> rec_end_addr = rec_end;
-      ASSERT(t, 3 == nparsed) << "Only parsed " << nparsed << " items";
+      ASSERT(t, next_checksum < checksums.size())
+          << "Segment " << first << " wasn't mapped during recording";
+      const TraceStream::MappingChecksum& rec = checksums[next_checksum++];
+      remote_ptr<void> rec_start_addr = rec.start;
+      remote_ptr<void> rec_end_addr = rec.end;
 
       ASSERT(t, rec_start_addr == first.start && rec_end_addr == first.end)
           << "Segment " << rec_start_addr << "-" << rec_end_addr
@@ -541,14 +935,52 @@ static void iterate_checksums(Task* t, ChecksumMode mode, int global_time) {
                    << rec_start_addr << dec;
         continue;
       }
-      if (checksum != rec_checksum) {
-        notify_checksum_error(t, c.global_time, checksum, rec_checksum,
-                              raw_map_line.c_str());
+      if (checksum != rec.checksum) {
+        if (!Flags::get().diagnose_divergence) {
+          notify_checksum_error(t, global_time, checksum, rec.checksum,
+                                raw_map_line.c_str());
+        } else if (!divergence.global_time ||
+                   (divergence.global_time == global_time &&
+                    divergence.rec_tid == t->rec_tid)) {
+          divergence.global_time = global_time;
+          divergence.rec_tid = t->rec_tid;
+          ChecksumDivergence::DivergedMapping m = { first.start, first.end,
+                                                    raw_map_line };
+          divergence.mappings.push_back(m);
+        }
       }
     }
   }
 
-  fclose(c.checksums_file);
+  if (STORE_CHECKSUMS == mode) {
+    t->trace_writer().write_checksums(global_time, t->rec_tid, kind,
+                                      checksums);
+  } else {
+    ASSERT(t, next_checksum == checksums.size())
+        << "Segments mapped during recording are missing";
+    if (!divergence.global_time) {
+      last_validated_times[t->rec_tid] = global_time;
+    }
+  }
+
+  if (pagemap.is_open()) {
+    // Start tracking the pages written from now on.
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/clear_refs", t->tid);
+    ScopedFd clear_refs(path, O_WRONLY);
+    if (clear_refs.is_open() && write(clear_refs, "4", 1) == 1) {
+      as.page_checksums().swap(page_checksums);
+    } else {
+      as.page_checksums().clear();
+    }
+  }
+}
+
+unsigned checksum_memory(Task* t, remote_ptr<void> start,
+                         remote_ptr<void> end) {
+  vector<uint8_t> mem(end - start);
+  ssize_t valid = t->read_bytes_fallible(start, mem.size(), mem.data());
+  return checksum_bytes(CHECKSUM_CRC32C, mem.data(), max(ssize_t(0), valid));
 }
 
 bool should_checksum(Task* t, const TraceFrame& f) {
@@ -712,6 +1144,10 @@ static bool is_tmp_file(const char* path) {
           path == strstr(path, "/tmp/"));
 }
 
+bool is_io_uring_file(const char* filename) {
+  return !strcmp(filename, "anon_inode:[io_uring]");
+}
+
 bool should_copy_mmap_region(const char* filename, const struct stat* stat,
                              int prot, int flags, int warn_shared_writeable) {
   bool private_mapping = (flags & MAP_PRIVATE);
@@ -828,6 +1264,25 @@ ScopedFd create_shmem_segment(const char* name, size_t num_bytes) {
   return fd;
 }
 
+ScopedFd create_memfd_segment(const char* name, size_t num_bytes) {
+#ifdef SYS_memfd_create
+  // memfd names are at most 249 bytes; the tail of |name| is the
+  // least useful part.
+  string memfd_name(name, min<size_t>(strlen(name), 249));
+  // MFD_CLOEXEC
+  ScopedFd fd = syscall(SYS_memfd_create, memfd_name.c_str(), 1);
+  if (fd.is_open()) {
+    resize_shmem_segment(fd, num_bytes);
+    LOG(debug) << "created memfd segment " << memfd_name;
+    return fd;
+  }
+  if (ENOSYS != errno) {
+    FATAL() << "Failed to create memfd segment " << memfd_name;
+  }
+#endif
+  return create_shmem_segment(name, num_bytes);
+}
+
 void resize_shmem_segment(ScopedFd& fd, size_t num_bytes) {
   if (ftruncate(fd, num_bytes)) {
     FATAL() << "Failed to resize shmem to " << num_bytes;
@@ -899,105 +1354,6 @@ void destroy_buffers(Task* t) {
 
 #include "AssemblyTemplates.generated"
 
-/**
- * Return true iff |addr| points to a known |__kernel_vsyscall()|
- * implementation.
- */
-static bool is_kernel_vsyscall(Task* t, remote_ptr<void> addr) {
-  uint8_t impl[X86VsyscallImplementation::size];
-  t->read_bytes(addr, impl);
-  return X86VsyscallImplementation::match(impl);
-}
-
-/**
- * Return the address of a recognized |__kernel_vsyscall()|
- * implementation in |t|'s address space.
- */
-static remote_ptr<void> locate_and_verify_kernel_vsyscall(
-    Task* t, size_t nsymbols, const typename X86Arch::ElfSym* symbols,
-    const char* symbolnames) {
-  remote_ptr<void> kernel_vsyscall = nullptr;
-  // It is unlikely but possible that multiple, versioned __kernel_vsyscall
-  // symbols will exist.  But we can't rely on setting |kernel_vsyscall| to
-  // catch that case, because only one of the versioned symbols will
-  // actually match what we expect to see, and the matching one might be
-  // the last one.  Therefore, we have this separate flag to alert us to
-  // this possbility.
-  bool seen_kernel_vsyscall = false;
-
-  for (size_t i = 0; i < nsymbols; ++i) {
-    auto sym = &symbols[i];
-    const char* name = &symbolnames[sym->st_name];
-    if (strcmp(name, "__kernel_vsyscall") == 0) {
-      assert(!seen_kernel_vsyscall);
-      seen_kernel_vsyscall = true;
-      // The ELF information in the VDSO assumes that the VDSO
-      // is always loaded at a particular address.  The kernel,
-      // however, subjects the VDSO to ASLR, which means that
-      // we have to adjust the offsets properly.
-      auto vdso_start = t->vm()->vdso().start;
-      remote_ptr<void> candidate = sym->st_value;
-      // The symbol values can be absolute or relative addresses.
-      // The first part of the assertion is for absolute
-      // addresses, and the second part is for relative.
-      assert((candidate.as_int() & ~uintptr_t(0xfff)) == 0xffffe000 ||
-             (candidate.as_int() & ~uintptr_t(0xfff)) == 0);
-      uintptr_t candidate_offset = candidate.as_int() & uintptr_t(0xfff);
-      candidate = vdso_start + candidate_offset;
-
-      if (is_kernel_vsyscall(t, candidate)) {
-        kernel_vsyscall = candidate;
-      }
-    }
-  }
-
-  return kernel_vsyscall;
-}
-
-/**
- * Perform any required monkeypatching on the VDSO for the given Task.
- * Abort if anything at all goes wrong.
- */
-template <typename Arch>
-static void perform_monkeypatch(Task* t, size_t nsymbols,
-                                const typename Arch::ElfSym* symbols,
-                                const char* symbolnames);
-
-template <>
-void perform_monkeypatch<X86Arch>(Task* t, size_t nsymbols,
-                                  const typename X86Arch::ElfSym* symbols,
-                                  const char* symbolnames) {
-  if (!t->regs().arg2()) {
-    return;
-  }
-
-  auto kernel_vsyscall =
-      locate_and_verify_kernel_vsyscall(t, nsymbols, symbols, symbolnames);
-  if (!kernel_vsyscall) {
-    FATAL() << "Failed to monkeypatch vdso: your __kernel_vsyscall() wasn't "
-               "recognized.\n"
-               "    Syscall buffering is now effectively disabled.  If you're "
-               "OK with\n"
-               "    running rr without syscallbuf, then run the recorder "
-               "passing the\n"
-               "    --no-syscall-buffer arg.\n"
-               "    If you're *not* OK with that, file an issue.";
-  }
-
-  // Luckily, linux is happy for us to scribble directly over
-  // the vdso mapping's bytes without mprotecting the region, so
-  // we don't need to prepare remote syscalls here.
-  remote_ptr<void> vsyscall_hook_trampoline_ptr = t->regs().arg1();
-  uint32_t vsyscall_hook_trampoline = vsyscall_hook_trampoline_ptr.as_int();
-
-  uint8_t patch[X86VsyscallMonkeypatch::size];
-  X86VsyscallMonkeypatch::substitute(patch, vsyscall_hook_trampoline);
-
-  t->write_bytes(kernel_vsyscall, patch);
-  LOG(debug) << "monkeypatched __kernel_vsyscall to jump to "
-             << vsyscall_hook_trampoline;
-}
-
 // x86-64 doesn't have a convenient vsyscall-esque function in the VDSO;
 // syscalls happen directly with the |syscall| instruction and manual
 // syscall restarting if necessary.  Its VDSO is filled with overhead
@@ -1021,57 +1377,73 @@ static const named_syscall syscalls_to_monkeypatch[] = {
 };
 #undef S
 
+/**
+ * A place in the VDSO that gets monkeypatched: a recognized
+ * |__kernel_vsyscall()| on x86, or the function for |syscall_number| on
+ * x86-64.
+ */
+struct VdsoPatchSite {
+  size_t offset;
+  int syscall_number;
+};
+
+/**
+ * Return the offset in the VDSO of a symbol's code.
+ */
+template <typename Arch>
+static size_t vdso_symbol_offset(const typename Arch::ElfSym& sym);
+
 template <>
-void perform_monkeypatch<X64Arch>(Task* t, size_t nsymbols,
-                                  const typename X64Arch::ElfSym* symbols,
-                                  const char* symbolnames) {
-  auto vdso_start = t->vm()->vdso().start;
+size_t vdso_symbol_offset<X86Arch>(const typename X86Arch::ElfSym& sym) {
+  // The ELF information in the VDSO assumes that the VDSO
+  // is always loaded at a particular address.  The kernel,
+  // however, subjects the VDSO to ASLR, which means that
+  // we have to adjust the offsets properly.
+  uintptr_t address = sym.st_value;
+  // The symbol values can be absolute or relative addresses.
+  // The first part of the assertion is for absolute
+  // addresses, and the second part is for relative.
+  assert((address & ~uintptr_t(0xfff)) == 0xffffe000 ||
+         (address & ~uintptr_t(0xfff)) == 0);
+  return address & uintptr_t(0xfff);
+}
 
-  for (size_t i = 0; i < nsymbols; ++i) {
-    auto sym = &symbols[i];
-    const char* symname = &symbolnames[sym->st_name];
-    for (size_t j = 0; j < array_length(syscalls_to_monkeypatch); ++j) {
-      if (strcmp(symname, syscalls_to_monkeypatch[j].name) == 0) {
-        uint8_t patch[X64VsyscallMonkeypatch::size];
-        uint32_t syscall_number = syscalls_to_monkeypatch[j].syscall_number;
-        X64VsyscallMonkeypatch::substitute(patch, syscall_number);
-
-        // Absolutely-addressed symbols in the VDSO claim to start here.
-        const uintptr_t base = uintptr_t(0xffffffffff700000);
-        uintptr_t sym_address = uintptr_t(sym->st_value);
-        // The symbol values can be absolute or relative addresses.
-        // The first part of the assertion is for absolute
-        // addresses, and the second part is for relative.
-        assert((sym_address & ~uintptr_t(0xfff)) == base ||
-               (sym_address & ~uintptr_t(0xfff)) == 0);
-        uintptr_t sym_offset = sym_address & uintptr_t(0xfff);
-        t->write_bytes(vdso_start + sym_offset, patch);
-        LOG(debug) << "monkeypatched " << symname << " to syscall "
-                   << syscalls_to_monkeypatch[j].syscall_number;
-      }
-    }
-  }
+template <>
+size_t vdso_symbol_offset<X64Arch>(const typename X64Arch::ElfSym& sym) {
+  // Absolutely-addressed symbols in the VDSO claim to start here.
+  const uintptr_t base = uintptr_t(0xffffffffff700000);
+  uintptr_t address = uintptr_t(sym.st_value);
+  // The symbol values can be absolute or relative addresses.
+  // The first part of the assertion is for absolute
+  // addresses, and the second part is for relative.
+  assert((address & ~uintptr_t(0xfff)) == base ||
+         (address & ~uintptr_t(0xfff)) == 0);
+  return address & uintptr_t(0xfff);
 }
 
+/**
+ * Return the sites to patch in the VDSO whose contents are |image|.
+ */
 template <typename Arch>
-static void locate_vdso_symbols(Task* t, size_t* nsymbols,
-                                remote_ptr<void>* symbols, size_t* strtabsize,
-                                remote_ptr<void>* strtab) {
-  auto vdso_start = t->vm()->vdso().start;
-  auto elfheader = t->read_mem(vdso_start.cast<typename Arch::ElfEhdr>());
-  assert(elfheader.e_ident[EI_CLASS] == Arch::elfclass);
-  assert(elfheader.e_ident[EI_DATA] == Arch::elfendian);
-  assert(elfheader.e_machine == Arch::elfmachine);
-  assert(elfheader.e_shentsize == sizeof(typename Arch::ElfShdr));
-
-  auto sections_start = vdso_start + elfheader.e_shoff;
-  typename Arch::ElfShdr sections[elfheader.e_shnum];
-  t->read_bytes_helper(sections_start, sizeof(sections), sections);
-
-  typename Arch::ElfShdr* dynsym = nullptr;
-  typename Arch::ElfShdr* dynstr = nullptr;
-
-  for (size_t i = 0; i < elfheader.e_shnum; ++i) {
+static vector<VdsoPatchSite> find_vdso_patch_sites(
+    const vector<uint8_t>& image) {
+  assert(image.size() >= sizeof(typename Arch::ElfEhdr));
+  auto elfheader =
+      reinterpret_cast<const typename Arch::ElfEhdr*>(image.data());
+  assert(elfheader->e_ident[EI_CLASS] == Arch::elfclass);
+  assert(elfheader->e_ident[EI_DATA] == Arch::elfendian);
+  assert(elfheader->e_machine == Arch::elfmachine);
+  assert(elfheader->e_shentsize == sizeof(typename Arch::ElfShdr));
+  assert(elfheader->e_shoff +
+             elfheader->e_shnum * sizeof(typename Arch::ElfShdr) <=
+         image.size());
+
+  auto sections = reinterpret_cast<const typename Arch::ElfShdr*>(
+      image.data() + elfheader->e_shoff);
+  const typename Arch::ElfShdr* dynsym = nullptr;
+  const typename Arch::ElfShdr* dynstr = nullptr;
+
+  for (size_t i = 0; i < elfheader->e_shnum; ++i) {
     auto header = &sections[i];
     if (header->sh_type == SHT_DYNSYM) {
       assert(!dynsym && "multiple .dynsym sections?!");
@@ -1079,7 +1451,7 @@ static void locate_vdso_symbols(Task* t, size_t* nsymbols,
       continue;
     }
     if (header->sh_type == SHT_STRTAB && (header->sh_flags & SHF_ALLOC) &&
-        i != elfheader.e_shstrndx) {
+        i != elfheader->e_shstrndx) {
       assert(!dynstr && "multiple .dynstr sections?!");
       dynstr = header;
     }
@@ -1090,37 +1462,162 @@ static void locate_vdso_symbols(Task* t, size_t* nsymbols,
   }
 
   assert(dynsym->sh_entsize == sizeof(typename Arch::ElfSym));
-  *nsymbols = dynsym->sh_size / dynsym->sh_entsize;
-  *symbols = vdso_start + dynsym->sh_offset;
-  *strtabsize = dynstr->sh_size;
-  *strtab = vdso_start + dynstr->sh_offset;
+  assert(dynsym->sh_offset + dynsym->sh_size <= image.size());
+  assert(dynstr->sh_offset + dynstr->sh_size <= image.size());
+  size_t nsymbols = dynsym->sh_size / dynsym->sh_entsize;
+  auto symbols = reinterpret_cast<const typename Arch::ElfSym*>(
+      image.data() + dynsym->sh_offset);
+  auto symbolnames =
+      reinterpret_cast<const char*>(image.data() + dynstr->sh_offset);
+
+  vector<VdsoPatchSite> sites;
+  for (size_t i = 0; i < nsymbols; ++i) {
+    auto sym = &symbols[i];
+    const char* name = &symbolnames[sym->st_name];
+    if (Arch::arch() == x86) {
+      // It is unlikely but possible that multiple, versioned
+      // __kernel_vsyscall symbols will exist, and only one of them will
+      // match what we expect to see.
+      if (strcmp(name, "__kernel_vsyscall") == 0) {
+        size_t offset = vdso_symbol_offset<Arch>(*sym);
+        if (offset + X86VsyscallImplementation::size <= image.size() &&
+            X86VsyscallImplementation::match(image.data() + offset)) {
+          sites.push_back({ offset, -1 });
+        }
+      }
+      continue;
+    }
+    for (size_t j = 0; j < array_length(syscalls_to_monkeypatch); ++j) {
+      if (strcmp(name, syscalls_to_monkeypatch[j].name) == 0) {
+        size_t offset = vdso_symbol_offset<Arch>(*sym);
+        assert(offset + X64VsyscallMonkeypatch::size <= image.size());
+        sites.push_back({ offset, syscalls_to_monkeypatch[j].syscall_number });
+      }
+    }
+  }
+  return sites;
+}
+
+/**
+ * Apply the patches for |sites| to |image|, a copy of |t|'s VDSO.
+ * Abort if anything at all goes wrong. Returns false if no patching is
+ * needed.
+ */
+template <typename Arch>
+static bool perform_monkeypatch(const vector<VdsoPatchSite>& sites,
+                                remote_ptr<void> vsyscall_hook_trampoline,
+                                bool syscallbuf_enabled, uint8_t* image);
+
+template <>
+bool perform_monkeypatch<X86Arch>(const vector<VdsoPatchSite>& sites,
+                                  remote_ptr<void> vsyscall_hook_trampoline,
+                                  bool syscallbuf_enabled, uint8_t* image) {
+  if (!syscallbuf_enabled) {
+    return false;
+  }
+
+  if (sites.empty()) {
+    FATAL() << "Failed to monkeypatch vdso: your __kernel_vsyscall() wasn't "
+               "recognized.\n"
+               "    Syscall buffering is now effectively disabled.  If you're "
+               "OK with\n"
+               "    running rr without syscallbuf, then run the recorder "
+               "passing the\n"
+               "    --no-syscall-buffer arg.\n"
+               "    If you're *not* OK with that, file an issue.";
+  }
+
+  uint32_t trampoline = vsyscall_hook_trampoline.as_int();
+  for (auto& site : sites) {
+    X86VsyscallMonkeypatch::substitute(image + site.offset, trampoline);
+  }
+  LOG(debug) << "monkeypatched __kernel_vsyscall to jump to "
+             << vsyscall_hook_trampoline;
+  return true;
 }
 
-template <typename Arch> static void monkeypatch_vdso_arch(Task* t) {
-  size_t nsymbols = 0;
-  remote_ptr<void> symbolsaddr = nullptr;
-  size_t strtabsize = 0;
-  remote_ptr<void> strtabaddr = nullptr;
+template <>
+bool perform_monkeypatch<X64Arch>(const vector<VdsoPatchSite>& sites,
+                                  remote_ptr<void> vsyscall_hook_trampoline,
+                                  bool syscallbuf_enabled, uint8_t* image) {
+  for (auto& site : sites) {
+    X64VsyscallMonkeypatch::substitute(image + site.offset,
+                                       site.syscall_number);
+    LOG(debug) << "monkeypatched " << syscall_name(site.syscall_number, x86_64)
+               << " to syscall " << site.syscall_number;
+  }
+  return !sites.empty();
+}
 
-  locate_vdso_symbols<Arch>(t, &nsymbols, &symbolsaddr, &strtabsize,
-                            &strtabaddr);
+/**
+ * VDSO images we've found patch sites in. Every exec maps the same VDSO,
+ * so this saves parsing its ELF tables again each time.
+ */
+struct VdsoPatchSites {
+  SupportedArch arch;
+  vector<uint8_t> image;
+  vector<VdsoPatchSite> sites;
+};
+static vector<VdsoPatchSites> vdso_patch_sites_cache;
 
-  typename Arch::ElfSym symbols[nsymbols];
-  t->read_bytes_helper(symbolsaddr, sizeof(symbols), symbols);
-  char strtab[strtabsize];
-  t->read_bytes_helper(strtabaddr, sizeof(strtab), strtab);
+template <typename Arch>
+static void patch_vdso_arch(Task* t, remote_ptr<void> vsyscall_hook_trampoline,
+                            bool syscallbuf_enabled) {
+  auto vdso = t->vm()->vdso();
+  vector<uint8_t> image(vdso.end - vdso.start);
+  t->read_bytes_helper(vdso.start, image.size(), image.data());
+
+  const vector<VdsoPatchSite>* sites = nullptr;
+  for (auto& cached : vdso_patch_sites_cache) {
+    if (cached.arch == Arch::arch() && cached.image == image) {
+      sites = &cached.sites;
+      break;
+    }
+  }
+  if (!sites) {
+    VdsoPatchSites cached = { Arch::arch(), image,
+                              find_vdso_patch_sites<Arch>(image) };
+    vdso_patch_sites_cache.push_back(move(cached));
+    sites = &vdso_patch_sites_cache.back().sites;
+  }
 
-  perform_monkeypatch<Arch>(t, nsymbols, symbols, strtab);
+  // Patch a local copy and write back the span covering all the patches
+  // in one go.  Luckily, linux is happy for us to scribble directly over
+  // the vdso mapping's bytes without mprotecting the region, so we don't
+  // need to prepare remote syscalls here.
+  vector<uint8_t> patched = image;
+  if (!perform_monkeypatch<Arch>(*sites, vsyscall_hook_trampoline,
+                                 syscallbuf_enabled, patched.data())) {
+    return;
+  }
+  size_t start = 0;
+  while (start < image.size() && patched[start] == image[start]) {
+    ++start;
+  }
+  size_t end = image.size();
+  while (end > start && patched[end - 1] == image[end - 1]) {
+    --end;
+  }
+  if (start < end) {
+    t->write_bytes_helper(vdso.start + start, end - start,
+                          patched.data() + start);
+  }
 }
 
-void monkeypatch_vdso(Task* t) {
+void patch_vdso(Task* t, remote_ptr<void> vsyscall_hook_trampoline,
+                bool syscallbuf_enabled) {
   ASSERT(t, 1 == t->vm()->task_set().size())
       << "TODO: monkeypatch multithreaded process";
 
   // NB: the tracee can't be interrupted with a signal while
   // we're processing the rrcall, because it's masked off all
   // signals.
-  RR_ARCH_FUNCTION(monkeypatch_vdso_arch, t->arch(), t)
+  RR_ARCH_FUNCTION(patch_vdso_arch, t->arch(), t, vsyscall_hook_trampoline,
+                   syscallbuf_enabled)
+}
+
+void monkeypatch_vdso(Task* t) {
+  patch_vdso(t, t->regs().arg1(), t->regs().arg2());
 
   Registers r = t->regs();
   r.set_syscall_result(0);
@@ -1135,6 +1632,13 @@ void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
                : "ebx");
 }
 
+void cpuid(int code, int subrequest, unsigned int* a, unsigned int* b,
+           unsigned int* c, unsigned int* d) {
+  asm volatile("cpuid"
+               : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+               : "a"(code), "c"(subrequest));
+}
+
 void set_cpu_affinity(int cpu) {
   assert(cpu >= 0);
 
@@ -1151,6 +1655,192 @@ int get_num_cpus() {
   return cpus > 0 ? cpus : 1;
 }
 
+/**
+ * Read a sysfs cpu list like "0-3,8,10-11". Returns an empty list if
+ * |path| can't be read.
+ */
+static vector<int> read_cpu_list(const string& path) {
+  vector<int> cpus;
+  ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (!fd.is_open()) {
+    return cpus;
+  }
+  char buf[4096];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  if (len <= 0) {
+    return cpus;
+  }
+  buf[len] = 0;
+  char* p = buf;
+  while (isdigit(*p)) {
+    int first = strtol(p, &p, 10);
+    int last = first;
+    if (*p == '-') {
+      last = strtol(p + 1, &p, 10);
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    if (*p == ',') {
+      ++p;
+    }
+  }
+  return cpus;
+}
+
+static string cpu_sysfs_path(int cpu, const string& file) {
+  return "/sys/devices/system/cpu/cpu" + to_string(cpu) + "/" + file;
+}
+
+static vector<int> l3_cpus(int cpu) {
+  for (int index = 0;; ++index) {
+    string dir = cpu_sysfs_path(cpu, "cache/index" + to_string(index));
+    ScopedFd fd((dir + "/level").c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd.is_open()) {
+      return vector<int>();
+    }
+    char level = 0;
+    if (read(fd, &level, 1) == 1 && level == '3') {
+      return read_cpu_list(dir + "/shared_cpu_list");
+    }
+  }
+}
+
+static vector<int> node_cpus(int cpu) {
+  DIR* dir = opendir(cpu_sysfs_path(cpu, "").c_str());
+  vector<int> cpus;
+  if (!dir) {
+    return cpus;
+  }
+  while (struct dirent* ent = readdir(dir)) {
+    if (!strncmp(ent->d_name, "node", 4) && isdigit(ent->d_name[4])) {
+      cpus = read_cpu_list(string("/sys/devices/system/node/") + ent->d_name +
+                           "/cpulist");
+      break;
+    }
+  }
+  closedir(dir);
+  return cpus;
+}
+
+/**
+ * The CPUs rr may run on, as of the first call, before any placement
+ * narrowed the calling thread's affinity.
+ */
+static const cpu_set_t& initial_cpu_affinity() {
+  static cpu_set_t mask;
+  static bool initialized;
+  if (!initialized) {
+    if (0 > sched_getaffinity(0, sizeof(mask), &mask)) {
+      FATAL() << "Couldn't read CPU affinity";
+    }
+    initialized = true;
+  }
+  return mask;
+}
+
+CpuPlacement choose_cpu_placement(int tracee_cpu) {
+  const cpu_set_t& allowed = initial_cpu_affinity();
+  auto usable = [&](int cpu) {
+    return cpu != tracee_cpu && cpu >= 0 && cpu < CPU_SETSIZE &&
+           CPU_ISSET(cpu, &allowed);
+  };
+
+  CpuPlacement placement;
+  placement.tracee_cpu = tracee_cpu;
+  placement.tracer_cpu = tracee_cpu;
+  for (auto& cpus : { read_cpu_list(cpu_sysfs_path(
+                          tracee_cpu, "topology/thread_siblings_list")),
+                      l3_cpus(tracee_cpu) }) {
+    auto it = find_if(cpus.begin(), cpus.end(), usable);
+    if (it != cpus.end()) {
+      placement.tracer_cpu = *it;
+      break;
+    }
+  }
+
+  vector<int> node = node_cpus(tracee_cpu);
+  if (node.empty()) {
+    for (int cpu = 0; cpu < get_num_cpus(); ++cpu) {
+      node.push_back(cpu);
+    }
+  }
+  for (int cpu : node) {
+    if (usable(cpu) && cpu != placement.tracer_cpu) {
+      placement.helper_cpus.push_back(cpu);
+    }
+  }
+  LOG(debug) << "Tracees on CPU " << tracee_cpu << ", rr on CPU "
+             << placement.tracer_cpu << ", " << placement.helper_cpus.size()
+             << " CPUs for helper threads";
+  return placement;
+}
+
+static cpu_set_t helper_cpu_mask;
+static atomic<bool> have_helper_cpus(false);
+
+static void bind_helper(pid_t tid) {
+  if (0 > sched_setaffinity(tid, sizeof(helper_cpu_mask), &helper_cpu_mask)) {
+    LOG(warn) << "Couldn't bind helper thread " << tid;
+  }
+}
+
+void apply_cpu_placement(const CpuPlacement& placement) {
+  set_cpu_affinity(placement.tracer_cpu);
+  // Threads created from here on start out on the tracer's CPU until
+  // they call bind_helper_thread().
+  have_helper_cpus = false;
+  if (placement.helper_cpus.empty()) {
+    return;
+  }
+  CPU_ZERO(&helper_cpu_mask);
+  for (int cpu : placement.helper_cpus) {
+    CPU_SET(cpu, &helper_cpu_mask);
+  }
+  have_helper_cpus = true;
+  DIR* dir = opendir("/proc/self/task");
+  if (!dir) {
+    return;
+  }
+  pid_t self = syscall(SYS_gettid);
+  while (struct dirent* ent = readdir(dir)) {
+    pid_t tid = atoi(ent->d_name);
+    if (tid > 0 && tid != self) {
+      bind_helper(tid);
+    }
+  }
+  closedir(dir);
+}
+
+void bind_helper_thread() {
+  if (have_helper_cpus) {
+    bind_helper(0);
+  }
+}
+
+static struct rlimit initial_fd_limit;
+static bool fd_limit_raised;
+
+void raise_fd_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == limit.rlim_max) {
+    return;
+  }
+  initial_fd_limit = limit;
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit)) {
+    LOG(warn) << "Unable to raise the fd limit to " << limit.rlim_max;
+    return;
+  }
+  fd_limit_raised = true;
+}
+
+void restore_fd_limit() {
+  if (fd_limit_raised && setrlimit(RLIMIT_NOFILE, &initial_fd_limit)) {
+    FATAL() << "Unable to restore the fd limit";
+  }
+}
+
 template <typename Arch>
 static void extract_clone_parameters_arch(const Registers& regs,
                                           remote_ptr<void>* stack,
@@ -1196,3 +1886,212 @@ void extract_clone_parameters(Task* t, remote_ptr<void>* stack,
   RR_ARCH_FUNCTION(extract_clone_parameters_arch, t->arch(), t->regs(), stack,
                    parent_tid, tls, child_tid);
 }
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+Hash128 hash_bytes(const void* data, size_t len, uint64_t seed) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  const size_t nblocks = len / 16;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+
+  for (size_t i = 0; i < nblocks; ++i) {
+    uint64_t k[2];
+    memcpy(k, bytes + i * 16, sizeof(k));
+
+    k[0] *= c1;
+    k[0] = rotl64(k[0], 31);
+    k[0] *= c2;
+    h1 ^= k[0];
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k[1] *= c2;
+    k[1] = rotl64(k[1], 33);
+    k[1] *= c1;
+    h2 ^= k[1];
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  // Mix in the last 0-15 bytes.
+  const uint8_t* tail = bytes + nblocks * 16;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  switch (len & 15) {
+    case 15:
+      k2 ^= uint64_t(tail[14]) << 48;
+    case 14:
+      k2 ^= uint64_t(tail[13]) << 40;
+    case 13:
+      k2 ^= uint64_t(tail[12]) << 32;
+    case 12:
+      k2 ^= uint64_t(tail[11]) << 24;
+    case 11:
+      k2 ^= uint64_t(tail[10]) << 16;
+    case 10:
+      k2 ^= uint64_t(tail[9]) << 8;
+    case 9:
+      k2 ^= uint64_t(tail[8]);
+      k2 *= c2;
+      k2 = rotl64(k2, 33);
+      k2 *= c1;
+      h2 ^= k2;
+    case 8:
+      k1 ^= uint64_t(tail[7]) << 56;
+    case 7:
+      k1 ^= uint64_t(tail[6]) << 48;
+    case 6:
+      k1 ^= uint64_t(tail[5]) << 40;
+    case 5:
+      k1 ^= uint64_t(tail[4]) << 32;
+    case 4:
+      k1 ^= uint64_t(tail[3]) << 24;
+    case 3:
+      k1 ^= uint64_t(tail[2]) << 16;
+    case 2:
+      k1 ^= uint64_t(tail[1]) << 8;
+    case 1:
+      k1 ^= uint64_t(tail[0]);
+      k1 *= c1;
+      k1 = rotl64(k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+  }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  Hash128 result = { h1, h2 };
+  return result;
+}
+
+static uint32_t crc32c_table[8][256];
+
+static void init_crc32c_table() {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (int t = 1; t < 8; ++t) {
+      uint32_t prev = crc32c_table[t - 1][i];
+      crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+    }
+  }
+}
+
+/**
+ * Slicing-by-8 CRC-32C, for CPUs without SSE4.2.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v ^= crc;
+    crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+          crc32c_table[5][(v >> 16) & 0xff] ^
+          crc32c_table[4][(v >> 24) & 0xff] ^
+          crc32c_table[3][(v >> 32) & 0xff] ^
+          crc32c_table[2][(v >> 40) & 0xff] ^
+          crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc, const uint8_t* p, size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc64 = __builtin_ia32_crc32di(crc64, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = crc64;
+  while (len--) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cImpl)(uint32_t, const uint8_t*, size_t);
+
+static Crc32cImpl choose_crc32c_impl() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return crc32c_hw;
+  }
+#endif
+  init_crc32c_table();
+  return crc32c_sw;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+  static const Crc32cImpl impl = choose_crc32c_impl();
+  return ~impl(~crc, static_cast<const uint8_t*>(data), len);
+}
+
+bool is_zeroed(const void* data, size_t len) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const uint8_t* end = p + len;
+  while (p < end && (uintptr_t(p) & (sizeof(uint64_t) - 1))) {
+    if (*p++) {
+      return false;
+    }
+  }
+  // OR together a block of words at a time, which the compiler turns into
+  // vector instructions, and only test the result once per block.
+  static const size_t BLOCK_WORDS = 8;
+  const uint64_t* w = reinterpret_cast<const uint64_t*>(p);
+  while (size_t(end - p) >= BLOCK_WORDS * sizeof(uint64_t)) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i < BLOCK_WORDS; ++i) {
+      acc |= w[i];
+    }
+    if (acc) {
+      return false;
+    }
+    w += BLOCK_WORDS;
+    p += BLOCK_WORDS * sizeof(uint64_t);
+  }
+  while (p < end) {
+    if (*p++) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -15,6 +15,8 @@
 
 #include <array>
 #include <ostream>
+#include <string>
+#include <vector>
 
 #include "Event.h"
 #include "ExtraRegisters.h"
@@ -45,6 +47,8 @@ constexpr size_t array_length(std::array<T, N>& array) {
  * anonymously. */
 #define SYSCALLBUF_SHMEM_NAME_PREFIX "rr-tracee-shmem-"
 #define SYSCALLBUF_SHMEM_PATH_PREFIX SHMEM_FS "/" SYSCALLBUF_SHMEM_NAME_PREFIX
+/* Likewise for the scratch memory of recorded tracees. */
+#define SCRATCH_SHMEM_NAME_PREFIX "rr-tracee-scratch-"
 
 #define PREFIX_FOR_EMPTY_MMAPED_REGIONS "/tmp/rr-emptyfile-"
 
@@ -103,8 +107,9 @@ void format_dump_filename(Task* t, int global_time, const char* tag,
  */
 bool should_dump_memory(Task* t, const TraceFrame& f);
 /**
- * Dump all of the memory in |t|'s address to the file
- * "[trace_dir]/[t->tid]_[global_time]_[tag]".
+ * Dump all of the memory in |t|'s address to the gzip-compressed file
+ * "[trace_dir]/[t->tid]_[global_time]_[tag].gz".  The file is written in
+ * the background; see MemoryDumpWriter.
  */
 void dump_process_memory(Task* t, int global_time, const char* tag);
 
@@ -125,6 +130,37 @@ void checksum_process_memory(Task* t, int global_time);
  */
 void validate_process_memory(Task* t, int global_time);
 
+/**
+ * With Flags::diagnose_divergence, validate_process_memory() doesn't fail
+ * on a mismatch but records the first checksum record that didn't
+ * validate here.
+ */
+struct ChecksumDivergence {
+  struct DivergedMapping {
+    remote_ptr<void> start;
+    remote_ptr<void> end;
+    std::string map_line;
+  };
+  int global_time;
+  pid_t rec_tid;
+  std::vector<DivergedMapping> mappings;
+};
+/**
+ * Return the divergence validate_process_memory() recorded, or null.
+ */
+const ChecksumDivergence* checksum_divergence();
+/**
+ * Return the time of the last checksum record of |rec_tid| that
+ * validate_process_memory() found to match, or 0.
+ */
+int last_validated_checksum_time(pid_t rec_tid);
+/**
+ * Return the checksum of |t|'s memory in [start, end), computed the way
+ * checksum records compute a mapping's.
+ */
+unsigned checksum_memory(Task* t, remote_ptr<void> start,
+                         remote_ptr<void> end);
+
 /**
  * Open a temporary debugging connection for |t| and service requests
  * until the user quits or requests execution to resume.
@@ -162,6 +198,11 @@ bool probably_not_interactive(int fd = STDERR_FILENO);
  * more easily correlate stdio with trace event numbers.
  */
 void maybe_mark_stdio_write(Task* t, int child_fd);
+/**
+ * Return the mark maybe_mark_stdio_write() would write for |child_fd|,
+ * or an empty string if it wouldn't write one.
+ */
+std::string stdio_write_mark(Task* t, int child_fd);
 
 /**
  * Return the symbolic name of the PTRACE_EVENT_* |event|, or
@@ -201,6 +242,12 @@ int clone_flags_to_task_flags(int flags_arg);
 size_t ceil_page_size(size_t sz);
 remote_ptr<void> ceil_page_size(remote_ptr<void> addr);
 
+/**
+ * Return the argument rounded down to the nearest multiple of the
+ * system |page_size()|.
+ */
+remote_ptr<void> floor_page_size(remote_ptr<void> addr);
+
 /** Return the system page size. */
 size_t page_size();
 
@@ -254,12 +301,27 @@ enum {
 bool should_copy_mmap_region(const char* filename, const struct stat* stat,
                              int prot, int flags, int warn_shared_writeable);
 
+/**
+ * Return true if |filename| is what a tracee's mapping of an io_uring's
+ * rings is named.  Such mappings are copied, and replayed as anonymous
+ * shared memory.
+ */
+bool is_io_uring_file(const char* filename);
+
 /**
  * Return an fd referring to a new shmem segment with descriptive
  * |name| of size |num_bytes|.
  */
 ScopedFd create_shmem_segment(const char* name, size_t num_bytes);
 
+/**
+ * Like |create_shmem_segment()|, but back the segment with an
+ * anonymous memfd when the kernel supports them, so that it has no
+ * file system name at all.  /proc/maps shows such segments as
+ * "/memfd:|name| (deleted)".
+ */
+ScopedFd create_memfd_segment(const char* name, size_t num_bytes);
+
 /**
  * Ensure that the shmem segment referred to by |fd| has exactly the
  * size |num_bytes|.
@@ -277,7 +339,16 @@ void destroy_buffers(Task* t);
 
 /**
  * Locate |t|'s |__kernel_vsyscall()| helper and then monkey-patch it
- * to jump to the preload lib's hook function.
+ * to jump to |vsyscall_hook_trampoline| in the preload lib, if
+ * |syscallbuf_enabled|.  On x86-64, patch the vdso's time functions to
+ * make real syscalls.
+ */
+void patch_vdso(Task* t, remote_ptr<void> vsyscall_hook_trampoline,
+                bool syscallbuf_enabled);
+
+/**
+ * Handle |t|'s rrcall_monkeypatch_vdso: patch_vdso() with the rrcall's
+ * arguments.
  */
 void monkeypatch_vdso(Task* t);
 
@@ -302,6 +373,9 @@ enum cpuid_requests {
  */
 void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
            unsigned int* d);
+/** Like cpuid() above, but also returns EBX in *b. */
+void cpuid(int code, int subrequest, unsigned int* a, unsigned int* b,
+           unsigned int* c, unsigned int* d);
 
 /**
  * Force this process (and its descendants) to only use the cpu with the given
@@ -314,6 +388,77 @@ void set_cpu_affinity(int cpu);
  */
 int get_num_cpus();
 
+/**
+ * Where rr runs relative to tracees bound to |tracee_cpu|. Ptrace stops
+ * bounce between the tracer and the tracee, so the tracer is kept close:
+ * on an SMT sibling of |tracee_cpu| if there is one, else on a CPU
+ * sharing its L3 cache, else on |tracee_cpu| itself. Helper threads
+ * (compression and decompression) get the other CPUs of the same NUMA
+ * node, so they don't preempt either. An empty |helper_cpus| leaves
+ * helpers unbound.
+ */
+struct CpuPlacement {
+  CpuPlacement() : tracee_cpu(-1), tracer_cpu(-1) {}
+  int tracee_cpu;
+  int tracer_cpu;
+  std::vector<int> helper_cpus;
+};
+
+/**
+ * Work out the placement for |tracee_cpu| from the CPU topology in sysfs,
+ * among the CPUs rr was allowed to run on when it started.
+ */
+CpuPlacement choose_cpu_placement(int tracee_cpu);
+
+/**
+ * Bind the calling thread to |placement.tracer_cpu|, and rr's other
+ * threads, and those it creates later, to |placement.helper_cpus|.
+ */
+void apply_cpu_placement(const CpuPlacement& placement);
+
+/**
+ * Bind the calling thread to the helper CPUs of the placement applied
+ * last, if any. Helper threads call this when they start.
+ */
+void bind_helper_thread();
+
+/**
+ * Raise this process's soft limit on open fds to the hard limit, since
+ * we hold fds for every tracee thread.  restore_fd_limit() undoes that
+ * in a tracee we've forked, so it sees the limit it would without rr.
+ */
+void raise_fd_limit();
+void restore_fd_limit();
+
+/**
+ * A 128-bit hash of a byte string. Not cryptographically strong, but
+ * collisions between distinct inputs are vanishingly unlikely.
+ */
+struct Hash128 {
+  uint64_t lo;
+  uint64_t hi;
+  bool operator==(const Hash128& other) const {
+    return lo == other.lo && hi == other.hi;
+  }
+  bool operator!=(const Hash128& other) const { return !(*this == other); }
+};
+/**
+ * Compute the Hash128 (MurmurHash3_x64_128) of |len| bytes at |data|.
+ */
+Hash128 hash_bytes(const void* data, size_t len, uint64_t seed = 0);
+
+/**
+ * Compute the CRC-32C (Castagnoli) of |len| bytes at |data|, continuing
+ * from the CRC |crc| of the preceding data (zero to start). Uses the
+ * SSE4.2 crc32 instruction when the CPU supports it.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+/**
+ * Return true if all |len| bytes at |data| are zero.
+ */
+bool is_zeroed(const void* data, size_t len);
+
 /**
  * Extract various clone(2) parameters out of the given Task's registers.
  * Each remote_ptr parameter may be nullptr.